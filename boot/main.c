@@ -38,10 +38,11 @@
  **********************************************************************/
 
 #define SECTSIZE	512
+#define MAXSECTS	255	// Most sectors one ATA read command can take
 #define ELFHDR		((elfhdr *) 0x10000) // scratch space
 
-void readsect(void*, uint32_t);
-void readseg(uint32_t, uint32_t, uint32_t);
+static void readsects(void*, uint32_t, uint32_t);
+static void readseg(uint32_t, uint32_t, uint32_t);
 
 void
 bootmain(void)
@@ -74,7 +75,7 @@ bad:
 
 // Read 'count' bytes at 'offset' from kernel into virtual address 'va'.
 // Might copy more than asked
-void
+static void
 readseg(uint32_t va, uint32_t count, uint32_t offset)
 {
 	uint32_t end_va;
@@ -88,17 +89,20 @@ readseg(uint32_t va, uint32_t count, uint32_t offset)
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
+	// Read up to MAXSECTS sectors per disk command.
+	// We may write more to memory than asked, but it doesn't matter --
 	// we load in increasing order.
 	while (va < end_va) {
-		readsect((uint8_t*) va, offset);
-		va += SECTSIZE;
-		offset++;
+		uint32_t n = (end_va - va + SECTSIZE - 1) / SECTSIZE;
+		if (n > MAXSECTS)
+			n = MAXSECTS;
+		readsects((uint8_t*) va, offset, n);
+		va += n * SECTSIZE;
+		offset += n;
 	}
 }
 
-void
+static void
 waitdisk(void)
 {
 	// wait for disk reaady
@@ -106,23 +110,29 @@ waitdisk(void)
 		/* do nothing */;
 }
 
-void
-readsect(void *dst, uint32_t offset)
+// Read 'n' (1 to MAXSECTS) consecutive sectors starting at 'offset'
+// with a single read command.
+static void
+readsects(void *dst, uint32_t offset, uint32_t n)
 {
 	// wait for disk to be ready
 	waitdisk();
 
-	outb(0x1F2, 1);		// count = 1
+	outb(0x1F2, n);		// sector count
 	outb(0x1F3, offset);
 	outb(0x1F4, offset >> 8);
 	outb(0x1F5, offset >> 16);
 	outb(0x1F6, (offset >> 24) | 0xE0);
 	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
 
-	// wait for disk to be ready
-	waitdisk();
+	// the disk interrupts us, so to speak, once per sector
+	while (n-- > 0) {
+		// wait for the next sector to be ready
+		waitdisk();
 
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE/4);
+		// read a sector
+		insl(0x1F0, dst, SECTSIZE/4);
+		dst += SECTSIZE;
+	}
 }
 
@@ -18,3 +18,28 @@ V = @
 # following line and set it to the full path to QEMU.
 #
 # QEMU=
+
+# Spinlocks record the call stack of every acquire for debugging.
+# For a leaner kernel without that per-acquire stack walk,
+# uncomment the following line.
+#
+# DEFS += -DSPINLOCK_NOTRACE
+
+# To count acquisitions, contention, spin time and hold times per
+# spinlock_init() site, readable by the root process in the "lockstat"
+# file, uncomment the following line.
+#
+# DEFS += -DSPINLOCK_PROFILE
+
+# To sample every busy CPU's EIP and call stack on each timer tick,
+# readable by the root process in the "profile" file (see user/prof.c),
+# uncomment the following line.
+#
+# DEFS += -DPROF_SAMPLING
+
+# To skip the kernel's boot-time self-checks (mem_check(), pmap_check(),
+# trap_check_kernel() and the like) in production boots,
+# uncomment the following line.  Boot phase timings are printed
+# at boot either way, and kept in the root process's "boottime" file.
+#
+# DEFS += -DBOOT_NOCHECK
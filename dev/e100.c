@@ -16,11 +16,13 @@
 #include <kern/mem.h>
 #include <kern/spinlock.h>
 #include <kern/net.h>
+#include <kern/timer.h>
 
 #include <dev/pic.h>
 #include <dev/ioapic.h>
 #include <dev/pci.h>
 #include <dev/e100.h>
+#include <dev/virtio.h>
 
 
 bool e100_present;
@@ -29,11 +31,23 @@ uint8_t e100_irq;
 #define E100_TX_SLOTS			64
 #define E100_RX_SLOTS			64
 
+// Frames e100_intr() or one e100_poll() hands to net_rx() at most.
+// If more are waiting, the card's interrupts stay masked and the rest
+// are polled for by idle CPUs (via net_idle()) or, failing that,
+// a timer tick later, until the receive ring is drained.
+#define E100_RX_BUDGET			16
+#define E100_POLLDELAY			1	// Timer ticks between polls
+
+// Frames queued in a batch (see e100_txbegin()) before we ring anyway,
+// so that a long batch doesn't fill the ring before the card starts.
+#define E100_TX_BATCHMAX		16
+
 #define E100_NULL			0xffffffff
 #define E100_SIZE_MASK			0x3fff	// mask out status/control bits
 
 #define	E100_CSR_SCB_STATACK		0x01	// scb_statack (1 byte)
 #define	E100_CSR_SCB_COMMAND		0x02	// scb_command (1 byte)
+#define	E100_CSR_SCB_INTMASK		0x03	// scb interrupt mask (1 byte)
 #define	E100_CSR_SCB_GENERAL		0x04	// scb_general (4 bytes)
 #define	E100_CSR_PORT			0x08	// port (4 bytes)
 #define E100_CSR_EEPROM			0x0e	// EEPROM control reg (1 byte)
@@ -46,6 +60,8 @@ uint8_t e100_irq;
 #define E100_SCB_COMMAND_RU_START	1
 #define E100_SCB_COMMAND_RU_RESUME	2
 
+#define E100_SCB_INTMASK_M		0x01	// mask all interrupts
+
 #define E100_SCB_STATACK_RNR		0x10
 #define E100_SCB_STATACK_CNA		0x20
 #define E100_SCB_STATACK_FR		0x40
@@ -113,11 +129,15 @@ struct e100_rbd {
 	volatile uint16_t rbd_pad1;
 };
 
+// Transmits are flexible mode, with one TBD for a packet copied into
+// the slot's buffer, or two for a header there and a body sent in place.
+// The TBDs right after the TCB double as the "Extended TBDs" some cards
+// expect there, so either way the card finds them.
 struct e100_tx_slot {
 	struct e100_cb_tx tcb;	// Transmit command block
-	struct e100_tbd tbd;	// Transmit buffer descriptor
-	struct e100_tbd unused;	// Some cards require a second "Extended TBD"
+	struct e100_tbd tbd[2];	// Transmit buffer descriptors
 	char buf[NET_MAXPKT];	// Buffer
+	pageinfo *pin;		// Page the body is sent from in place, if any
 };
 
 struct e100_rx_slot {
@@ -133,12 +153,17 @@ static struct {
 	int tx_head;	// Next slot we'll use to enqueue a tx packet
 	int tx_tail;	// Next slot e100 should transmit and mark complete
 	char tx_idle;
+	int tx_batch;	// Batches open: hold the doorbell till they close
+	int tx_unrung;	// Frames queued since we last rang it
 
 	struct e100_rx_slot rx[E100_RX_SLOTS];
 	int rx_head;	// Next slot e100 should receive into and mark complete
 	int rx_tail;	// Last slot e100 can use before it must suspend
 	char rx_idle;
 
+	bool polling;	// Interrupts masked till e100_poll() drains the ring
+	timer polltimer;
+
 	int eebits;
 	union {
 		uint8_t mac[6];
@@ -193,7 +218,11 @@ static void e100_tx_start(void)
 	}
 }
 
-int e100_tx(void *hdr, int hlen, void *body, int blen)
+// Transmit a packet made of a header and a body.
+// If pin is non-NULL, the body lies within that page, and the card
+// DMAs it from there instead of from a copy; the page stays referenced
+// until the transmit completes (see e100_intr_tx()).
+int e100_tx(void *hdr, int hlen, void *body, int blen, pageinfo *pin)
 {
 	assert(hlen + blen <= NET_MAXPKT);
 	int i;
@@ -209,30 +238,77 @@ int e100_tx(void *hdr, int hlen, void *body, int blen)
 	}
 
 	i = e100.tx_head % E100_TX_SLOTS;
-
-	// Copy the packet header and body into the transmit buffer
-	memcpy(e100.tx[i].buf, hdr, hlen);
-	memcpy(e100.tx[i].buf+hlen, body, blen);
+	assert(e100.tx[i].pin == NULL);
 
 	// Compute the total packet length,
 	// accounting for Ethernet's 64-byte minimum.
 	// XXX include the 4-byte trailing CRC.
 	int len = MAX(hlen + blen, 64);
 
-	// Set up the transmit command block
-	e100.tx[i].tbd.tb_addr = mem_phys(e100.tx[i].buf);
-	e100.tx[i].tbd.tb_size = len;
+	if (pin != NULL && hlen + blen >= 64) {
+		// Copy just the header, and point a second TBD at the body.
+		assert(PGADDR(body) == (uint32_t)mem_pi2ptr(pin));
+		assert(PGOFF(body) + blen <= PAGESIZE);
+		mem_incref(pin);
+		e100.tx[i].pin = pin;
+		memcpy(e100.tx[i].buf, hdr, hlen);
+		e100.tx[i].tbd[0].tb_addr = mem_phys(e100.tx[i].buf);
+		e100.tx[i].tbd[0].tb_size = hlen;
+		e100.tx[i].tbd[1].tb_addr = mem_phys(body);
+		e100.tx[i].tbd[1].tb_size = blen;
+		e100.tx[i].tcb.tbd_number = 2;
+	} else {
+		// Copy the packet header and body into the transmit buffer
+		memcpy(e100.tx[i].buf, hdr, hlen);
+		memcpy(e100.tx[i].buf+hlen, body, blen);
+		e100.tx[i].tbd[0].tb_addr = mem_phys(e100.tx[i].buf);
+		e100.tx[i].tbd[0].tb_size = len;
+		e100.tx[i].tcb.tbd_number = 1;
+	}
+
+	// Set up the transmit command block.  Only the newest one
+	// has the suspend bit: once it's written, let the card run on
+	// from the one before it, if it hasn't got there yet.
 	e100.tx[i].tcb.cb_status = 0;
 	e100.tx[i].tcb.cb_command = E100_CB_COMMAND_XMIT
 		| E100_CB_COMMAND_SF | E100_CB_COMMAND_I | E100_CB_COMMAND_S;
+	if (e100.tx_head > e100.tx_tail) {
+		int prev = (e100.tx_head - 1) % E100_TX_SLOTS;
+		e100.tx[prev].tcb.cb_command &= ~E100_CB_COMMAND_S;
+	}
 	e100.tx_head++;
 
-	e100_tx_start();
+	if (e100.tx_batch == 0 || ++e100.tx_unrung >= E100_TX_BATCHMAX) {
+		e100_tx_start();
+		e100.tx_unrung = 0;
+	}
 
 	spinlock_release(&e100.lock);
 	return 1;
 }
 
+// Open a transmit batch: frames queued until the matching e100_txend()
+// share one CU command, instead of each waiting for the card to take
+// its own.  Batches on several CPUs at once just hold it a bit longer.
+void e100_txbegin(void)
+{
+	spinlock_acquire(&e100.lock);
+	e100.tx_batch++;
+	spinlock_release(&e100.lock);
+}
+
+void e100_txend(void)
+{
+	spinlock_acquire(&e100.lock);
+	assert(e100.tx_batch > 0);
+	if (--e100.tx_batch == 0 && e100.tx_unrung > 0) {
+		if (e100.tx_head != e100.tx_tail)
+			e100_tx_start();
+		e100.tx_unrung = 0;
+	}
+	spinlock_release(&e100.lock);
+}
+
 static void e100_rx_start(void)
 {
 	assert(spinlock_holding(&e100.lock));
@@ -257,19 +333,25 @@ static void e100_intr_tx(void)
 {
 	int i;
 
-	// Bump tx_tail past all transmit commands that have completed
+	// Bump tx_tail past all transmit commands that have completed,
+	// releasing the pages any of them sent from in place.
 	for (; e100.tx_head != e100.tx_tail; e100.tx_tail++) {
 		i = e100.tx_tail % E100_TX_SLOTS;
 		if (!(e100.tx[i].tcb.cb_status & E100_CB_STATUS_C))
 			break;
+		if (e100.tx[i].pin != NULL) {
+			mem_decref(e100.tx[i].pin, mem_free);
+			e100.tx[i].pin = NULL;
+		}
 	}
 }
 
-static void e100_intr_rx(void)
+// Hand up to 'budget' received frames to net_rx().
+// Returns true if more remain to be processed.
+static bool e100_intr_rx(int budget)
 {
 	assert(spinlock_holding(&e100.lock));
 
-	int *count;
 	int i;
 
 	// Dispatch newly-filled receive buffers
@@ -278,10 +360,15 @@ static void e100_intr_rx(void)
 	// so we have to release and reacquire the e100.lock in the loop.
 	// We use the RFD's E100_RFA_STATUS_C bit as a high-level "lock"
 	// on the RFD while the received packet is being processed.
+	bool more = 0;
 	while (1) {
 		i = e100.rx_head % E100_RX_SLOTS;
 		if (!(e100.rx[i].rfd.status & E100_RFA_STATUS_C))
 			break;	// No more un-processed packets received
+		if (budget-- == 0) {
+			more = 1;
+			break;
+		}
 
 		// "Claim" this RFD by moving e100.rx_head past it,
 		// while leaving the E100_RFA_STATUS_OK bit set.
@@ -321,15 +408,18 @@ static void e100_intr_rx(void)
 		e100.rx[i].rfd.control = 0;	// Prev RFD need not suspend
 		e100.rx_tail++;
 	}
+	return more;
 }
 
-void e100_intr(void)
+// Acknowledge and handle whatever the card has to report,
+// receiving up to E100_RX_BUDGET frames.
+// Called with e100.lock held; returns true if frames remain.
+static bool e100_service(void)
 {
-	spinlock_acquire(&e100.lock);
-
 	int r = inb(e100.iobase + E100_CSR_SCB_STATACK);
 	outb(e100.iobase + E100_CSR_SCB_STATACK, r);
 	//cprintf("e100_intr status %x\n", r);
+	bool more = 0;
 
 	if (r & (E100_SCB_STATACK_CXTNO | E100_SCB_STATACK_CNA)) {
 		r &= ~(E100_SCB_STATACK_CXTNO | E100_SCB_STATACK_CNA);
@@ -344,16 +434,64 @@ void e100_intr(void)
 		cprintf("e100_intr: RNR interrupt, no RX bufs?\n");
 	}
 
-	if (r & E100_SCB_STATACK_FR) {
+	// When polling, frames may have arrived without our noticing FR.
+	if ((r & E100_SCB_STATACK_FR) || e100.polling) {
 		r &= ~E100_SCB_STATACK_FR;
-		e100_intr_rx();	// releases and re-acquires e100.lock!
+		// releases and re-acquires e100.lock!
+		more = e100_intr_rx(E100_RX_BUDGET);
 	}
 	e100_rx_start();
 
 	if (r)
 		warn("e100_intr: unhandled STAT/ACK %x\n", r);
+	return more;
+}
+
+// Switch between interrupts and polling, depending on whether
+// the last e100_service() left frames in the receive ring.
+// Once drained, we unmask only after acknowledging the card's status
+// in e100_service(), so a frame that arrived since interrupts us.
+static void e100_setpolling(bool more)
+{
+	assert(spinlock_holding(&e100.lock));
+	if (more && !e100.polling) {
+		outb(e100.iobase + E100_CSR_SCB_INTMASK, E100_SCB_INTMASK_M);
+		e100.polling = 1;
+	} else if (!more && e100.polling) {
+		e100.polling = 0;
+		outb(e100.iobase + E100_CSR_SCB_INTMASK, 0);
+	}
+	// Only timer_intr() clears pending, and only once the timer is
+	// firing, when timer_add() just leaves the re-arm to that CPU;
+	// e100.lock serializes our own re-arms.
+	if (e100.polling && !e100.polltimer.pending)
+		timer_add(&e100.polltimer, E100_POLLDELAY);
+}
+
+void e100_intr(void)
+{
+	spinlock_acquire(&e100.lock);
+	e100_setpolling(e100_service());
+	spinlock_release(&e100.lock);
+}
 
+// Drain more of the receive ring if a burst left interrupts masked.
+// Called by idle CPUs, and by the poll timer in case none is idle.
+// Returns true if there was anything to do.
+bool e100_poll(void)
+{
+	if (!e100.polling)
+		return 0;
+	spinlock_acquire(&e100.lock);
+	if (e100.polling)
+		e100_setpolling(e100_service());
 	spinlock_release(&e100.lock);
+	return 1;
+}
+
+static void e100_polltimer(timer *t)
+{
+	e100_poll();
 }
 
 // Clock a serial opcode/address bit out to the EEPROM.
@@ -392,12 +530,18 @@ int e100_attach(struct pci_func *pcif)
 {
 	int i, next;
 
+	if (virtio_present) {
+		cprintf("e100: already using virtio-net; ignoring e100\n");
+		return 0;
+	}
+
 	pci_func_enable(pcif);
 
 	e100_irq = pcif->irq_line;
 	e100.iobase = pcif->reg_base[1];
 	e100.tx_idle = 1;
 	e100.rx_idle = 1;
+	e100.polltimer.func = e100_polltimer;
 
 	// Reset the card
 	outl(e100.iobase + E100_CSR_PORT, E100_PORT_SOFTWARE_RESET);
@@ -408,7 +552,7 @@ int e100_attach(struct pci_func *pcif)
 		next = (i + 1) % E100_TX_SLOTS;
 		memset(&e100.tx[i], 0, sizeof(e100.tx[i]));
 		e100.tx[i].tcb.link_addr = mem_phys(&e100.tx[next].tcb);
-		e100.tx[i].tcb.tbd_array_addr = mem_phys(&e100.tx[i].tbd);
+		e100.tx[i].tcb.tbd_array_addr = mem_phys(&e100.tx[i].tbd[0]);
 		e100.tx[i].tcb.tbd_number = 1;
 		e100.tx[i].tcb.tx_threshold = 4;
 	}
@@ -445,9 +589,11 @@ int e100_attach(struct pci_func *pcif)
 	cprintf("\n");
 	memcpy(net_mac, e100.mac, 6);
 
-	// Enable network card interrupts
-	pic_enable(e100_irq);
-	ioapic_enable(e100_irq);
+	// Enable network card interrupts, by MSI if the card supports it,
+	// steering each one to the least-loaded CPU (see ioapic_resteer).
+	if (!ioapic_msi(e100_irq, pcif))
+		pic_enable(e100_irq);
+	ioapic_steer(e100_irq, IOAPIC_LEASTLOAD, ~0);
 
 	// Start receiving packets
 	spinlock_acquire(&e100.lock);
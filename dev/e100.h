@@ -12,12 +12,17 @@
 #define PIOS_KERN_E100_H
 
 struct pci_func;
+struct pageinfo;
 
 extern bool e100_present;
 extern uint8_t e100_irq;
 
 int  e100_attach(struct pci_func *pcif);
-int  e100_tx(void *hdr, int hlen, void *body, int blen);
+int  e100_tx(void *hdr, int hlen, void *body, int blen,
+		struct pageinfo *pin);
+void e100_txbegin(void);
+void e100_txend(void);
 void e100_intr(void);
+bool e100_poll(void);
 
 #endif	// PIOS_KERN_E100_H
@@ -0,0 +1,44 @@
+/*
+ * Definitions for the BIOS physical memory map (INT 15h, AX=E820h).
+ * The boot loader collects the map while still in real mode,
+ * and leaves it in low memory where the kernel's mem_init() finds it.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_E820_H
+#define PIOS_DEV_E820_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#define E820_MAGIC	0x534d4150	// 'SMAP', in %edx and returned in %eax
+#define E820_MAP	0x500		// Phys addr of the map (below bootother)
+#define E820_MAX	32		// Most entries the boot loader stores
+#define E820_ENTSIZE	20		// Size of one BIOS map entry
+
+// Entry types
+#define E820_RAM	1		// Usable RAM
+#define E820_RESERVED	2		// Reserved: ROMs, I/O, etc.
+#define E820_ACPI	3		// ACPI tables, reclaimable after parsing
+#define E820_NVS	4		// ACPI non-volatile storage
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+typedef struct e820entry {
+	uint64_t	base;		// Physical start address
+	uint64_t	len;		// Length in bytes
+	uint32_t	type;		// E820_RAM, etc.
+} gcc_packed e820entry;
+
+// Layout the boot loader leaves at physical address E820_MAP.
+typedef struct e820map {
+	uint32_t	nent;		// Number of valid entries (0 = no map)
+	e820entry	ent[E820_MAX];
+} gcc_packed e820map;
+
+#endif /* !__ASSEMBLER__ */
+
+#endif	// !PIOS_DEV_E820_H
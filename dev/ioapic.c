@@ -16,8 +16,12 @@
 
 #include <kern/mem.h>
 #include <kern/mp.h>
+#include <kern/cpu.h>
+#include <kern/proc.h>
+#include <kern/spinlock.h>
 
 #include <dev/ioapic.h>
+#include <dev/pci.h>
 
 
 #define IOAPIC  0xFEC00000   // Default physical address of IO APIC
@@ -39,6 +43,8 @@
 #define INT_FIXED	0x00000000	// Deliver to all matching processors
 #define INT_LOWEST	0x00000100	// to processor at lowest priority
 
+#define IOAPIC_NIRQ	24	// Interrupt pins we keep steering state for
+
 
 // IO APIC MMIO structure: write reg, then read or write data.
 struct ioapic {
@@ -47,6 +53,21 @@ struct ioapic {
 	uint32_t data;
 };
 
+// Steering state for each interrupt, whether it arrives on an I/O APIC pin
+// or as an MSI sent at vector T_IRQ0+irq by the device itself.
+static struct irqsteer {
+	int		policy;		// IOAPIC_* policy; see ioapic_steer()
+	uint32_t	cpumask;	// Allowed CPUs, by position in cpu list
+	uint8_t		dest;		// APIC ID of the CPU it's routed to now
+	int		next;		// Round-robin position in the cpu list
+	bool		msi;		// Delivered by MSI rather than a pin
+	struct pci_msi	msimsg;		// Where to retarget the MSI
+} irqsteer[IOAPIC_NIRQ];
+
+// Protects irqsteer and the I/O APIC's shared register window,
+// which any CPU may now use to retarget an interrupt it just took.
+static spinlock ioapic_lock;
+
 static uint32_t
 ioapic_read(int reg)
 {
@@ -66,7 +87,9 @@ ioapic_init(void)
 {
 	int i, id, maxintr;
 
-	if(!ismp)
+	// Only once, on the boot CPU: the APs start up all at once,
+	// and must not share the I/O APIC's register window meanwhile.
+	if(!ismp || !cpu_onboot())
 		return;
 
 	if (ioapic == NULL)
@@ -82,6 +105,8 @@ ioapic_init(void)
 	if (id != ioapicid)
 		warn("ioapicinit: id %d != ioapicid %d", id, ioapicid);
 
+	spinlock_init(&ioapic_lock);
+
 	// Mark all interrupts edge-triggered, active high, disabled,
 	// and not routed to any CPUs.
 	for (i = 0; i <= maxintr; i++){
@@ -90,16 +115,132 @@ ioapic_init(void)
 	}
 }
 
+// Pick a CPU to take an interrupt according to its steering policy,
+// returning the CPU's APIC ID.
+static uint8_t
+ioapic_pick(struct irqsteer *s)
+{
+	cpu *c, *best = NULL;
+	int i, bestload = 0;
+
+	if (s->policy == IOAPIC_ROUNDROBIN) {
+		// First allowed CPU after the last one we used.
+		for (i = 0; i < ncpu; i++) {
+			s->next = (s->next + 1) % ncpu;
+			if (s->cpumask & (1u << s->next))
+				break;
+		}
+		for (c = &cpu_boot, i = 0; c != NULL; c = c->next, i++)
+			if (i == s->next && (s->cpumask & (1u << i)))
+				return c->id;
+		return cpu_boot.id;
+	}
+
+	for (c = &cpu_boot, i = 0; c != NULL; c = c->next, i++) {
+		if (i >= 32 || !(s->cpumask & (1u << i)))
+			continue;
+		if (s->policy != IOAPIC_LEASTLOAD)
+			return c->id;		// IOAPIC_FIXED: first allowed
+
+		// A CPU's load is its ready processes plus the one running;
+		// ties go to the current target so we don't churn the route.
+		int load = c->nready + (c->proc != NULL);
+		if (best == NULL || load < bestload
+				|| (load == bestload && c->id == s->dest)) {
+			best = c;
+			bestload = load;
+		}
+	}
+	return best != NULL ? best->id : cpu_boot.id;
+}
+
+// Program the hardware to deliver an interrupt as its steering says.
+// Caller must hold ioapic_lock.
+static void
+ioapic_route(int irq, struct irqsteer *s)
+{
+	int vector = T_IRQ0 + irq;
+
+	if (s->msi) {
+		pci_msi_route(&s->msimsg, vector,
+				s->policy == IOAPIC_ANY ? -1 : s->dest);
+		return;
+	}
+
+	// Edge-triggered, active high, enabled; either to whichever CPU
+	// is at lowest priority, or to the chosen CPU's physical APIC ID.
+	if (s->policy == IOAPIC_ANY) {
+		ioapic_write(REG_TABLE+2*irq+1, 0xff << 24);
+		ioapic_write(REG_TABLE+2*irq, INT_LOGICAL | INT_LOWEST | vector);
+	} else {
+		ioapic_write(REG_TABLE+2*irq+1, s->dest << 24);
+		ioapic_write(REG_TABLE+2*irq, INT_FIXED | vector);
+	}
+}
+
 void
 ioapic_enable(int irq)
 {
+	// Mark interrupt enabled and routed to any CPU.
+	ioapic_steer(irq, IOAPIC_ANY, ~0);
+}
+
+// Enable an interrupt and set which CPUs may take it, and how to choose
+// among them: cpumask bit n allows the n'th CPU on the cpu_boot list.
+// With IOAPIC_ROUNDROBIN or IOAPIC_LEASTLOAD the interrupt's handler
+// must call ioapic_resteer() after each interrupt to move it along.
+void
+ioapic_steer(int irq, int policy, uint32_t cpumask)
+{
+	assert(irq >= 0 && irq < IOAPIC_NIRQ);
 	if (!ismp)
 		return;
 
-	// Mark interrupt edge-triggered, active high,
-	// enabled, and routed to any CPU.
-	ioapic_write(REG_TABLE+2*irq,
-			INT_LOGICAL | INT_LOWEST | (T_IRQ0 + irq));
-	ioapic_write(REG_TABLE+2*irq+1, 0xff << 24);
+	spinlock_acquire(&ioapic_lock);
+	struct irqsteer *s = &irqsteer[irq];
+	s->policy = policy;
+	s->cpumask = cpumask;
+	s->dest = ioapic_pick(s);
+	ioapic_route(irq, s);
+	spinlock_release(&ioapic_lock);
+}
+
+// Have PCI function f signal interrupt irq by MSI instead of its pin,
+// if it can; returns false if it can't, leaving the pin to be used.
+// The interrupt still arrives at vector T_IRQ0+irq,
+// and ioapic_steer() and ioapic_resteer() route it as usual.
+bool
+ioapic_msi(int irq, struct pci_func *f)
+{
+	assert(irq >= 0 && irq < IOAPIC_NIRQ);
+	if (!ismp)
+		return 0;
+
+	spinlock_acquire(&ioapic_lock);
+	struct irqsteer *s = &irqsteer[irq];
+	s->msi = pci_msi_enable(f, &s->msimsg, T_IRQ0 + irq, -1);
+	s->policy = IOAPIC_ANY;
+	spinlock_release(&ioapic_lock);
+	return s->msi;
+}
+
+// Called on the CPU that just handled interrupt irq,
+// to retarget it if its steering policy now picks another CPU.
+void
+ioapic_resteer(int irq)
+{
+	struct irqsteer *s = &irqsteer[irq];
+	if (!ismp || s->policy < IOAPIC_ROUNDROBIN)
+		return;
+
+	// If another CPU is already retargeting it, let that one do it.
+	if (!spinlock_try(&ioapic_lock))
+		return;
+	uint8_t dest = ioapic_pick(s);
+	if (dest != s->dest) {
+		s->dest = dest;
+		ioapic_route(irq, s);
+	}
+	spinlock_release(&ioapic_lock);
 }
 
@@ -13,8 +13,21 @@
 # error "This is a kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct pci_func;
+
+// Policies for choosing which CPU takes an interrupt (see ioapic_steer).
+#define IOAPIC_ANY		0	// Hardware's lowest-priority pick
+#define IOAPIC_FIXED		1	// First CPU in the allowed mask
+#define IOAPIC_ROUNDROBIN	2	// Each allowed CPU in turn
+#define IOAPIC_LEASTLOAD	3	// Allowed CPU with fewest runnable procs
+
 void ioapic_init(void);
 
 void ioapic_enable(int irq);
+void ioapic_steer(int irq, int policy, uint32_t cpumask);
+bool ioapic_msi(int irq, struct pci_func *f);
+void ioapic_resteer(int irq);
 
 #endif /* !PIOS_DEV_IOAPIC_H */
@@ -38,14 +38,12 @@ lapic_init()
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
+	// The timer counts down once at bus frequency
+	// from lapic[TICR] and then issues an interrupt.
+	// It stays stopped until kern/timer.c arms it with lapic_timer().
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | T_LTIMER);
-
-	// If we cared more about precise timekeeping,
-	// we would calibrate TICR with another time source such as the PIT.
-	lapicw(TICR, 10000000);
+	lapicw(TIMER, T_LTIMER);
+	lapicw(TICR, 0);
 
 	// Disable logical interrupt lines.
 	lapicw(LINT0, MASKED);
@@ -106,12 +104,26 @@ microdelay(int us)
 
 #define IO_RTC  0x70
 
-// Start additional processor running bootstrap code at addr.
+// Send interprocessor interrupt command 'cmd' to local APIC 'apicid',
+// waiting for it to go out before the next one.
+static void
+lapic_icr(uint8_t apicid, uint32_t cmd)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, cmd);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Start the additional processors with local APIC IDs 'apicids[0..n-1]'
+// running bootstrap code at addr, all at once: each step of the startup
+// goes to every processor in turn before the delay that follows it,
+// so the delays don't add up with the number of processors.
 // See Appendix B of MultiProcessor Specification.
 void
-lapic_startcpu(uint8_t apicid, uint32_t addr)
+lapic_startcpus(const uint8_t *apicids, int n, uint32_t addr)
 {
-	int i;
+	int i, j;
 	uint16_t *wrv;
 
 	// "The BSP must initialize CMOS shutdown code to 0AH
@@ -124,11 +136,12 @@ lapic_startcpu(uint8_t apicid, uint32_t addr)
 	wrv[1] = addr >> 4;
 
 	// "Universal startup algorithm."
-	// Send INIT (level-triggered) interrupt to reset other CPU.
-	lapicw(ICRHI, apicid<<24);
-	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	// Send INIT (level-triggered) interrupt to reset other CPUs.
+	for (j = 0; j < n; j++)
+		lapic_icr(apicids[j], INIT | LEVEL | ASSERT);
 	microdelay(200);
-	lapicw(ICRLO, INIT | LEVEL);
+	for (j = 0; j < n; j++)
+		lapic_icr(apicids[j], INIT | LEVEL);
 	microdelay(100);    // should be 10ms, but too slow in Bochs!
 
 	// Send startup IPI (twice!) to enter bootstrap code.
@@ -137,9 +150,35 @@ lapic_startcpu(uint8_t apicid, uint32_t addr)
 	// should be ignored, but it is part of the official Intel algorithm.
 	// Bochs complains about the second one.  Too bad for Bochs.
 	for(i = 0; i < 2; i++){
-		lapicw(ICRHI, apicid<<24);
-		lapicw(ICRLO, STARTUP | (addr>>12));
+		for (j = 0; j < n; j++)
+			lapic_icr(apicids[j], STARTUP | (addr>>12));
 		microdelay(200);
 	}
 }
 
+// Send interrupt 'vector' to the CPU with local APIC ID 'apicid',
+// using fixed delivery mode and a physical destination.
+void
+lapic_ipi(uint8_t apicid, int vector)
+{
+	if (!lapic)
+		return;
+
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+void
+lapic_timer(uint32_t count)
+{
+	if (lapic)
+		lapicw(TICR, count);
+}
+
+uint32_t
+lapic_timerleft(void)
+{
+	return lapic ? lapic[TCCR] : 0;
+}
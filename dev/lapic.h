@@ -20,6 +20,11 @@
 // Must be at least 19Hz in order to keep the system type up-to-date.
 #define HZ		25
 
+// Local APIC timer counts per kernel timer tick (see kern/timer.c).
+// If we cared more about precise timekeeping,
+// we would calibrate this with another time source such as the PIT.
+#define LAPIC_TICK	10000000
+
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)	// ID
@@ -68,8 +73,17 @@ void lapic_eoi(void);
 // Handle local APIC error interrupt
 void lapic_errintr(void);
 
-// Send a message to start an Application Processor (AP) running at addr.
-void lapic_startcpu(uint8_t apicid, uint32_t addr);
+// Send messages to start several Application Processors (APs)
+// running at addr, all at once.
+void lapic_startcpus(const uint8_t *apicids, int n, uint32_t addr);
+
+// Send a fixed-vector inter-processor interrupt to one CPU.
+void lapic_ipi(uint8_t apicid, int vector);
+
+// Arm this CPU's one-shot timer to interrupt after 'count' bus clocks,
+// or stop it if count is 0; and read the counts left before it fires.
+void lapic_timer(uint32_t count);
+uint32_t lapic_timerleft(void);
 
 
 #endif /* !PIOS_DEV_LAPIC_H */
@@ -16,6 +16,8 @@
 
 #include <dev/pci.h>
 #include <dev/e100.h>
+#include <dev/virtio.h>
+#include <dev/vblk.h>
 
 
 // Flag to do "lspci" at bootup
@@ -42,6 +44,8 @@ struct pci_driver pci_attach_class[] = {
 
 struct pci_driver pci_attach_vendor[] = {
 	{ 0x8086, 0x1209, &e100_attach },
+	{ 0x1af4, 0x1000, &virtio_attach },	// legacy virtio-net
+	{ 0x1af4, 0x1001, &vblk_attach },	// legacy virtio-blk
 	{ 0, 0, 0 },
 };
 
@@ -254,6 +258,95 @@ pci_func_enable(struct pci_func *f)
 	}
 }
 
+static uint32_t
+pci_msi_read(struct pci_msi *m, uint32_t off)
+{
+	pci_conf1_set_addr(m->busno, m->dev, m->func, m->cap + off);
+	return inl(pci_conf1_data_ioport);
+}
+
+static void
+pci_msi_write(struct pci_msi *m, uint32_t off, uint32_t v)
+{
+	pci_conf1_set_addr(m->busno, m->dev, m->func, m->cap + off);
+	outl(pci_conf1_data_ioport, v);
+}
+
+// Switch function f over from its legacy INTx pin
+// to Message Signaled Interrupts at the given vector,
+// delivered as described for pci_msi_route().
+// Returns false if the function has no MSI capability,
+// in which case it is left using its interrupt pin.
+bool
+pci_msi_enable(struct pci_func *f, struct pci_msi *m, int vector, int apicid)
+{
+	uint32_t stat = pci_conf_read(f, PCI_COMMAND_STATUS_REG);
+	if (!(stat & PCI_STATUS_CAPLIST_SUPPORT))
+		return 0;
+
+	// Walk the capability list looking for MSI.
+	// The bound guards against a malformed, looping list.
+	uint32_t cap = PCI_CAPLIST_PTR(pci_conf_read(f, PCI_CAPLISTPTR_REG));
+	int n;
+	for (n = 0; cap != 0 && n < 48; n++) {
+		uint32_t cr = pci_conf_read(f, cap);
+		if (PCI_CAPLIST_CAP(cr) == PCI_CAP_MSI)
+			break;
+		cap = PCI_CAPLIST_NEXT(cr);
+	}
+	if (cap == 0 || n == 48)
+		return 0;
+
+	m->busno = f->bus->busno;
+	m->dev = f->dev;
+	m->func = f->func;
+	m->cap = cap;
+	uint32_t ctl = pci_msi_read(m, PCI_MSI_CTL);
+	m->is64 = (ctl & PCI_MSI_CTL_64BIT) != 0;
+
+	// Program the message before turning it on,
+	// asking for a single vector (multiple message enable = 0),
+	// then stop the function from also asserting its pin.
+	pci_msi_route(m, vector, apicid);
+	pci_msi_write(m, PCI_MSI_CTL, (ctl & ~0x00700000) | PCI_MSI_CTL_ENABLE);
+	pci_conf_write(f, PCI_COMMAND_STATUS_REG,
+		(stat & PCI_COMMAND_MASK) | PCI_COMMAND_INTERRUPT_DISABLE);
+
+	if (pci_show_devs)
+		cprintf("PCI: %02x:%02x.%d: using MSI vector %d\n",
+			m->busno, m->dev, m->func, vector);
+	return 1;
+}
+
+// Point an MSI-enabled function's interrupt at a given CPU:
+// apicid is the local APIC ID of the CPU that should take it,
+// or -1 to let the hardware pick the lowest-priority CPU.
+// Messages are edge-triggered, as MSIs always are on x86.
+void
+pci_msi_route(struct pci_msi *m, int vector, int apicid)
+{
+	uint32_t addr, data;
+	if (apicid < 0) {
+		// Logical destination 0xff (every CPU; see lapic_init),
+		// redirection hint set, lowest-priority delivery.
+		addr = 0xfee00000 | (0xff << 12) | 0x8 | 0x4;
+		data = 0x100 | vector;
+	} else {
+		// Physical destination, fixed delivery.
+		addr = 0xfee00000 | (apicid << 12);
+		data = vector;
+	}
+
+	pci_msi_write(m, PCI_MSI_MADDR, addr);
+	if (m->is64) {
+		pci_msi_write(m, PCI_MSI_MADDR64_HI, 0);
+		pci_msi_write(m, PCI_MSI_MDATA64,
+			(pci_msi_read(m, PCI_MSI_MDATA64) & ~0xffff) | data);
+	} else
+		pci_msi_write(m, PCI_MSI_MDATA,
+			(pci_msi_read(m, PCI_MSI_MDATA) & ~0xffff) | data);
+}
+
 int
 pci_init(void)
 {
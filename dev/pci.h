@@ -59,6 +59,7 @@ typedef uint16_t pci_product_id_t;
 #define	PCI_COMMAND_STEPPING_ENABLE		0x00000080
 #define	PCI_COMMAND_SERR_ENABLE			0x00000100
 #define	PCI_COMMAND_BACKTOBACK_ENABLE		0x00000200
+#define	PCI_COMMAND_INTERRUPT_DISABLE		0x00000400
 
 #define	PCI_STATUS_CAPLIST_SUPPORT		0x00100000
 #define	PCI_STATUS_66MHZ_SUPPORT		0x00200000
@@ -418,6 +419,29 @@ typedef uint8_t pci_intr_line_t;
 #define	PCI_INTERRUPT_PIN_D			0x04
 #define	PCI_INTERRUPT_PIN_MAX			0x04
 
+/*
+ * Capability list pointer, valid if PCI_STATUS_CAPLIST_SUPPORT is set;
+ * each capability starts with an ID byte and a next-pointer byte.
+ */
+#define	PCI_CAPLISTPTR_REG		0x34
+#define	PCI_CAPLIST_PTR(cpr)			((cpr) & 0xfc)
+#define	PCI_CAPLIST_CAP(cr)			((cr) & 0xff)
+#define	PCI_CAPLIST_NEXT(cr)			(((cr) >> 8) & 0xfc)
+
+#define	PCI_CAP_MSI				0x05
+
+/*
+ * Message Signaled Interrupt capability registers,
+ * as offsets from the start of the capability.
+ */
+#define	PCI_MSI_CTL			0x00	// Message control in bits 31-16
+#define	  PCI_MSI_CTL_ENABLE			0x00010000
+#define	  PCI_MSI_CTL_64BIT			0x00800000
+#define	PCI_MSI_MADDR			0x04	// Message address (low 32 bits)
+#define	PCI_MSI_MADDR64_HI		0x08	// High 32 bits, if 64-bit
+#define	PCI_MSI_MDATA			0x08	// Message data in bits 15-0
+#define	PCI_MSI_MDATA64			0x0c	// Its offset if 64-bit
+
 /* Header Type 1 (Bridge) configuration registers */
 #define PCI_BRIDGE_BUS_REG		0x18
 #define   PCI_BRIDGE_BUS_PRIMARY_SHIFT		0
@@ -497,7 +521,20 @@ struct pci_bus {
     uint32_t busno;
 };
 
+// Location of a function's MSI capability, kept by the interrupt code
+// so it can retarget the interrupt after attach-time pci_func is gone.
+struct pci_msi {
+    uint32_t busno;
+    uint32_t dev;
+    uint32_t func;
+    uint8_t cap;		// Config space offset of the MSI capability
+    bool is64;			// Capability has a 64-bit message address
+};
+
 int  pci_init(void);
 void pci_func_enable(struct pci_func *f);
+bool pci_msi_enable(struct pci_func *f, struct pci_msi *m,
+		    int vector, int apicid);
+void pci_msi_route(struct pci_msi *m, int vector, int apicid);
 
 #endif	// PIOS_KERN_PCI_H
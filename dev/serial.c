@@ -13,8 +13,10 @@
 
 #include <inc/x86.h>
 #include <inc/trap.h>
+#include <inc/assert.h>
 
 #include <kern/cons.h>
+#include <kern/spinlock.h>
 
 #include <dev/serial.h>
 #include <dev/pic.h>
@@ -23,6 +25,17 @@
 
 bool serial_exists;
 
+// Output waiting for room in the UART's transmit FIFO.
+// Everything that sends goes through serial_txfill(), under the lock;
+// since the kernel runs with interrupts disabled,
+// serial_intr() never finds the lock held by the CPU it interrupted.
+static struct {
+	spinlock lock;
+	uint8_t buf[SERIAL_TXBUFSIZE];
+	uint32_t rpos;		// Next byte to send
+	uint32_t wpos;		// Where the next queued byte goes
+} serial_tx;
+
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -42,33 +55,108 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// Move queued output into the transmit FIFO, if it has emptied.
+// The UART raises its THR-empty interrupt when it finishes these.
+static void
+serial_txfill(void)
+{
+	assert(spinlock_holding(&serial_tx.lock));
+	if (serial_tx.rpos == serial_tx.wpos
+			|| !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY))
+		return;
+	int n;
+	for (n = 0; n < COM_TXFIFO && serial_tx.rpos != serial_tx.wpos; n++)
+		outb(COM1 + COM_TX,
+			serial_tx.buf[serial_tx.rpos++ % SERIAL_TXBUFSIZE]);
+}
+
+// Acquire the transmit lock, unless panicking while already holding it.
+static bool
+serial_txlock(void)
+{
+	if (spinlock_holding(&serial_tx.lock))
+		return 1;
+	spinlock_acquire(&serial_tx.lock);
+	return 0;
+}
+
+static void
+serial_txunlock(bool already)
+{
+	if (!already)
+		spinlock_release(&serial_tx.lock);
+}
+
 void
 serial_intr(void)
 {
-	if (serial_exists)
-		cons_intr(serial_proc_data);
+	if (!serial_exists)
+		return;
+	(void) inb(COM1+COM_IIR);	// acknowledges a THR-empty interrupt
+	bool already = serial_txlock();
+	serial_txfill();
+	serial_txunlock(already);
+	cons_intr(serial_proc_data);
 }
 
+// Queue as much of 'buf' as fits in the transmit ring, without waiting,
+// and start sending it.  Returns the number of bytes queued.
+int
+serial_write(const void *buf, int len)
+{
+	if (!serial_exists)
+		return len;
+
+	bool already = serial_txlock();
+	int n = MIN(len, SERIAL_TXBUFSIZE - (serial_tx.wpos - serial_tx.rpos));
+	int i;
+	for (i = 0; i < n; i++)
+		serial_tx.buf[serial_tx.wpos++ % SERIAL_TXBUFSIZE] =
+			((const uint8_t*)buf)[i];
+	serial_txfill();
+	serial_txunlock(already);
+	return n;
+}
+
+// Wait until the transmit ring has drained into the FIFO, polling,
+// but give up if the UART makes no progress for as long as
+// the old unbuffered driver would wait on each byte.
 void
-serial_putc(int c)
+serial_flush(void)
 {
 	if (!serial_exists)
 		return;
 
-	int i;
-	for (i = 0;
-	     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
-	     i++)
-		delay();
-	
-	outb(COM1 + COM_TX, c);
+	bool already = serial_txlock();
+	int i = 0;
+	while (serial_tx.rpos != serial_tx.wpos && i < 12800) {
+		if (inb(COM1 + COM_LSR) & COM_LSR_TXRDY) {
+			serial_txfill();
+			i = 0;
+		} else {
+			delay();
+			i++;
+		}
+	}
+	serial_txunlock(already);
+}
+
+void
+serial_putc(int c)
+{
+	uint8_t ch = c;
+	while (serial_write(&ch, 1) == 0)
+		serial_flush();
 }
 
 void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
+	spinlock_init(&serial_tx.lock);
+
+	// Turn on and clear the FIFOs
+	outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_RCLR | COM_FCR_TCLR
+				| COM_FCR_TRIG8);
 	
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
@@ -80,8 +168,8 @@ serial_init(void)
 
 	// No modem controls
 	outb(COM1+COM_MCR, 0);
-	// Enable rcv interrupts
-	outb(COM1+COM_IER, COM_IER_RDI);
+	// Enable rcv and THR-empty interrupts
+	outb(COM1+COM_IER, COM_IER_RDI | COM_IER_TXI);
 
 	// Clear any preexisting overrun indications and interrupts
 	// Serial port doesn't exist if COM_LSR returns 0xFF
@@ -28,8 +28,14 @@
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define   COM_IER_TXI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
 #define COM_FCR		2	// Out: FIFO Control Register
+#define   COM_FCR_ENABLE 0x01	//   Enable the 16550's FIFOs
+#define   COM_FCR_RCLR	0x02	//   Clear the receive FIFO
+#define   COM_FCR_TCLR	0x04	//   Clear the transmit FIFO
+#define   COM_FCR_TRIG8	0x80	//   Receive interrupt at 8 bytes
+#define COM_TXFIFO	16	// Bytes the 16550's transmit FIFO holds
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -43,10 +49,15 @@
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
 
+// Transmit ring, drained into the UART's FIFO from its THR-empty interrupt
+#define SERIAL_TXBUFSIZE 4096
+
 extern bool serial_exists;
 
 void serial_init(void);
-void serial_putc(int c);
+void serial_putc(int c);	// Queue a byte, waiting for room if needed
+int serial_write(const void *buf, int len); // Queue what fits, no waiting
+void serial_flush(void);	// Wait until all queued output is sent
 void serial_intenable(void);
 void serial_intr(void); // irq 4
 
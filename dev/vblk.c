@@ -0,0 +1,227 @@
+/*
+ * Legacy virtio-blk PCI block device driver.
+ *
+ * Like the virtio-net driver (dev/virtio.c) we use the legacy I/O-port
+ * interface, through the virtqueue helpers there.  The device has one
+ * queue, on which each request is a descriptor chain: a header naming
+ * the operation and the first sector, one descriptor per page of data,
+ * which the host reads from or writes into by DMA, and a status byte.
+ *
+ * Each request slot owns VBLK_CHAIN consecutive descriptors, so a slot's
+ * chain is always laid out the same way.  When every slot is busy,
+ * vblk_submit() queues the request until vblk_intr() frees one:
+ * callers never have to wait for room on the ring themselves.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/mem.h>
+#include <kern/spinlock.h>
+
+#include <dev/pic.h>
+#include <dev/ioapic.h>
+#include <dev/pci.h>
+#include <dev/virtio.h>
+#include <dev/vblk.h>
+
+
+bool vblk_present;
+bool vblk_readonly;
+uint8_t vblk_irq;
+uint64_t vblk_nsect;
+
+#define VBLK_SLOTS		16
+#define VBLK_CHAIN		(VBLK_MAXSEGS + 2)	// Descriptors per slot
+
+#define VIRTIO_BLK_F_RO		(1 << 5)	// Disk is read-only
+
+#define VIRTIO_BLK_T_IN		0	// Read sectors
+#define VIRTIO_BLK_T_OUT	1	// Write sectors
+
+#define VIRTIO_BLK_S_OK		0	// Status byte: success
+
+struct virtio_blk_hdr {
+	uint32_t type;			// VIRTIO_BLK_T_*
+	uint32_t ioprio;
+	uint64_t sector;
+};
+
+struct vblk_slot {
+	struct virtio_blk_hdr hdr;	// Header the host reads
+	volatile uint8_t status;	// Status byte the host writes
+	vblkreq *rq;			// Request in flight, if any
+};
+
+static struct {
+	spinlock lock;
+	uint32_t iobase;
+	struct virtq q;
+
+	struct vblk_slot slot[VBLK_SLOTS];
+	int free[VBLK_SLOTS];		// Stack of free slot numbers
+	int nfree;
+	int nslot;			// Slots that fit the queue
+
+	vblkreq *pending;		// Requests waiting for a free slot
+	vblkreq **pendtail;
+} vblk;
+
+
+// Put queued requests into free slots, and tell the host about them.
+static void
+vblk_post(void)
+{
+	assert(spinlock_holding(&vblk.lock));
+	bool posted = 0;
+	while (vblk.pending != NULL && vblk.nfree > 0) {
+		vblkreq *rq = vblk.pending;
+		vblk.pending = rq->next;
+		if (vblk.pending == NULL)
+			vblk.pendtail = &vblk.pending;
+
+		int slot = vblk.free[--vblk.nfree];
+		struct vblk_slot *s = &vblk.slot[slot];
+		struct vring_desc *d = &vblk.q.desc[slot * VBLK_CHAIN];
+		s->hdr.type = rq->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+		s->hdr.ioprio = 0;
+		s->hdr.sector = rq->sector;
+		s->status = 0xff;
+		s->rq = rq;
+
+		d[0].addr = mem_phys(&s->hdr);
+		d[0].len = sizeof(s->hdr);
+		d[0].flags = VRING_DESC_F_NEXT;
+		int i;
+		for (i = 0; i < rq->nseg; i++) {
+			d[1+i].addr = rq->seg[i];
+			d[1+i].len = PAGESIZE;
+			d[1+i].flags = VRING_DESC_F_NEXT |
+				(rq->write ? 0 : VRING_DESC_F_WRITE);
+		}
+		d[1+i].addr = mem_phys(&s->status);	// chains straight on
+		d[1+i].len = 1;
+		d[1+i].flags = VRING_DESC_F_WRITE;
+		virtq_post(&vblk.q, slot * VBLK_CHAIN);
+		posted = 1;
+	}
+	if (posted)
+		virtq_kick(&vblk.q);
+}
+
+// Start a transfer; rq->done gets called when it finishes.
+void
+vblk_submit(vblkreq *rq)
+{
+	assert(vblk_present);
+	assert(rq->nseg > 0 && rq->nseg <= VBLK_MAXSEGS);
+	assert(!rq->write || !vblk_readonly);
+
+	spinlock_acquire(&vblk.lock);
+	rq->next = NULL;
+	*vblk.pendtail = rq;
+	vblk.pendtail = &rq->next;
+	vblk_post();
+	spinlock_release(&vblk.lock);
+}
+
+// Collect the requests the host has finished, free their slots
+// for queued requests, then tell their owners, without our lock held
+// so that completions can submit follow-on requests.
+// Also callable with interrupts off, to poll for completions at boot.
+void
+vblk_intr(void)
+{
+	vblkreq *done = NULL, **donetail = &done;
+	spinlock_acquire(&vblk.lock);
+	inb(vblk.iobase + VIRTIO_PCI_ISR);	// acknowledge
+	struct virtq *q = &vblk.q;
+	while (q->lastused != q->used->idx) {
+		int slot = q->used->ring[q->lastused % q->num].id / VBLK_CHAIN;
+		q->lastused++;
+		struct vblk_slot *s = &vblk.slot[slot];
+		vblkreq *rq = s->rq;
+		s->rq = NULL;
+		rq->ok = s->status == VIRTIO_BLK_S_OK;
+		*donetail = rq;
+		donetail = &rq->next;
+		vblk.free[vblk.nfree++] = slot;
+	}
+	*donetail = NULL;
+	vblk_post();
+	spinlock_release(&vblk.lock);
+
+	while (done != NULL) {
+		vblkreq *rq = done;
+		done = rq->next;
+		rq->done(rq);
+	}
+}
+
+int
+vblk_attach(struct pci_func *pcif)
+{
+	int i;
+
+	// A device revision other than 0 is virtio 1.0 only.
+	if (PCI_REVISION(pcif->dev_class) != 0)
+		return 0;
+	if (vblk_present) {
+		cprintf("vblk: already have a disk; ignoring another\n");
+		return 0;
+	}
+
+	pci_func_enable(pcif);
+	vblk_irq = pcif->irq_line;
+	vblk.iobase = pcif->reg_base[0];
+	vblk.pendtail = &vblk.pending;
+
+	// Reset the device and say we know how to drive it.
+	outb(vblk.iobase + VIRTIO_PCI_STATUS, 0);
+	outb(vblk.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+	outb(vblk.iobase + VIRTIO_PCI_STATUS,
+		VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+	// We need no optional features, but note a read-only disk.
+	uint32_t features = inl(vblk.iobase + VIRTIO_PCI_HOST_FEATURES);
+	vblk_readonly = (features & VIRTIO_BLK_F_RO) != 0;
+	outl(vblk.iobase + VIRTIO_PCI_GUEST_FEATURES, 0);
+
+	if (!virtq_init(&vblk.q, vblk.iobase, 0)) {
+		cprintf("vblk: can't set up virtqueue\n");
+		goto fail;
+	}
+	vblk.nslot = MIN(VBLK_SLOTS, vblk.q.num / VBLK_CHAIN);
+	if (vblk.nslot == 0) {
+		cprintf("vblk: virtqueue too small\n");
+		goto fail;
+	}
+	for (i = 0; i < vblk.nslot * VBLK_CHAIN; i++)
+		vblk.q.desc[i].next = i + 1;
+	for (i = 0; i < vblk.nslot; i++)
+		vblk.free[vblk.nfree++] = vblk.nslot - 1 - i;
+
+	// Capacity is the first device-specific field, 64 bits of sectors.
+	vblk_nsect = inl(vblk.iobase + VIRTIO_PCI_CONFIG) |
+		(uint64_t)inl(vblk.iobase + VIRTIO_PCI_CONFIG + 4) << 32;
+	cprintf("vblk: %llu sectors%s, %d request slots\n", vblk_nsect,
+		vblk_readonly ? " read-only" : "", vblk.nslot);
+
+	if (!ioapic_msi(vblk_irq, pcif))
+		pic_enable(vblk_irq);
+	ioapic_steer(vblk_irq, IOAPIC_LEASTLOAD, ~0);
+
+	outb(vblk.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK
+		| VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	vblk_present = 1;
+	return 1;
+
+fail:
+	outb(vblk.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	return 0;
+}
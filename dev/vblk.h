@@ -0,0 +1,38 @@
+/*
+ * Legacy virtio-blk PCI block device driver definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_VBLK_H
+#define PIOS_DEV_VBLK_H
+
+struct pci_func;
+
+#define VBLK_SECTSIZE	512		// Bytes per disk sector
+#define VBLK_MAXSEGS	16		// Most pages one request transfers
+
+// A request to transfer whole pages to or from consecutive sectors.
+// The caller owns the request and the pages, and must keep both
+// until the driver calls 'done', from vblk_intr() with no locks held.
+typedef struct vblkreq {
+	uint64_t	sector;		// First sector to transfer
+	bool		write;		// Write to the disk, else read it
+	int		nseg;		// Pages to transfer, 1-VBLK_MAXSEGS
+	uint32_t	seg[VBLK_MAXSEGS]; // Physical address of each page
+	bool		ok;		// Set when done: the transfer worked
+	void		(*done)(struct vblkreq *rq);
+	struct vblkreq	*next;		// Driver's queue of requests to post
+} vblkreq;
+
+extern bool vblk_present;
+extern bool vblk_readonly;	// Host won't let us write
+extern uint8_t vblk_irq;
+extern uint64_t vblk_nsect;	// Disk capacity in sectors
+
+int  vblk_attach(struct pci_func *pcif);
+void vblk_submit(vblkreq *rq);
+void vblk_intr(void);
+
+#endif	// PIOS_DEV_VBLK_H
@@ -53,8 +53,22 @@ video_init(void)
 
 
 
-void
-video_putc(int c)
+// While rendering a burst of output, scrolling just advances crt_top,
+// the physical row showing logical row 0, treating the buffer as a ring;
+// video_done() puts the rows back in order once at the end of the burst.
+static int crt_top;
+static uint16_t crt_tmp[CRT_SIZE];
+
+static inline uint16_t *
+video_cell(int pos)
+{
+	return &crt_buf[((crt_top + pos / CRT_COLS) % CRT_ROWS) * CRT_COLS
+			+ pos % CRT_COLS];
+}
+
+// Render one character at the cursor, scrolling as needed.
+static void
+video_emit(int c)
 {
 	// if no attribute given, then use black on white
 	if (!(c & ~0xFF))
@@ -64,7 +78,7 @@ video_putc(int c)
 	case '\b':
 		if (crt_pos > 0) {
 			crt_pos--;
-			crt_buf[crt_pos] = (c & ~0xff) | ' ';
+			*video_cell(crt_pos) = (c & ~0xff) | ' ';
 		}
 		break;
 	case '\n':
@@ -74,26 +88,39 @@ video_putc(int c)
 		crt_pos -= (crt_pos % CRT_COLS);
 		break;
 	case '\t':
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
+		video_emit(' ');
+		video_emit(' ');
+		video_emit(' ');
+		video_emit(' ');
+		video_emit(' ');
 		break;
 	default:
-		crt_buf[crt_pos++] = c;		/* write the character */
+		*video_cell(crt_pos++) = c;	/* write the character */
 		break;
 	}
 
-	// What is the purpose of this?
+	// Scroll up a line: the oldest row becomes the new, blank bottom row.
 	if (crt_pos >= CRT_SIZE) {
+		crt_top = (crt_top + 1) % CRT_ROWS;
+		crt_pos -= CRT_COLS;
 		int i;
-
-		memmove(crt_buf, crt_buf + CRT_COLS,
-			(CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
 		for (i = CRT_SIZE - CRT_COLS; i < CRT_SIZE; i++)
-			crt_buf[i] = 0x0700 | ' ';
-		crt_pos -= CRT_COLS;
+			*video_cell(i) = 0x0700 | ' ';
+	}
+}
+
+// Finish rendering a burst: unrotate the rows and move the cursor.
+static void
+video_done(void)
+{
+	if (crt_top != 0) {
+		int split = crt_top * CRT_COLS;
+		memcpy(crt_tmp, crt_buf + split,
+			(CRT_SIZE - split) * sizeof(uint16_t));
+		memcpy(crt_tmp + CRT_SIZE - split, crt_buf,
+			split * sizeof(uint16_t));
+		memcpy(crt_buf, crt_tmp, CRT_SIZE * sizeof(uint16_t));
+		crt_top = 0;
 	}
 
 	/* move that little blinky thing */
@@ -103,4 +130,19 @@ video_putc(int c)
 	outb(addr_6845 + 1, crt_pos);
 }
 
+void
+video_putc(int c)
+{
+	video_emit(c);
+	video_done();
+}
 
+// Render 'len' characters, scrolling and moving the cursor just once.
+void
+video_write(const char *buf, int len)
+{
+	int i;
+	for (i = 0; i < len; i++)
+		video_emit((uint8_t) buf[i]);
+	video_done();
+}
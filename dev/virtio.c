@@ -0,0 +1,351 @@
+/*
+ * Legacy virtio-net PCI network interface device driver.
+ *
+ * Under QEMU/KVM an emulated e100 costs a VM exit per SCB command,
+ * and copies every frame through its 64-slot rings; a virtio NIC
+ * shares its descriptor rings ("virtqueues") with the host directly,
+ * and only needs a notification, which either side can suppress,
+ * when the other may be asleep.  We use the legacy I/O-port interface
+ * (virtio 0.9.5), which every QEMU offers: queue 0 receives, queue 1
+ * transmits, and each packet is a chain of descriptors, headed by the
+ * virtio_net_hdr, which we never need to fill in since we ask for
+ * no offloads.
+ *
+ * Transmit chains come in two shapes: the header plus a copy of
+ * the frame in the slot's buffer, or, when net.c passes a page
+ * to send the body from in place, the header, a copy of the frame
+ * header, and the body itself, held referenced until the host is done.
+ * We don't take transmit interrupts: finished slots are reclaimed
+ * on the next transmit, or whenever a receive interrupt comes in.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/mem.h>
+#include <kern/spinlock.h>
+#include <kern/net.h>
+
+#include <dev/pic.h>
+#include <dev/ioapic.h>
+#include <dev/pci.h>
+#include <dev/virtio.h>
+#include <dev/e100.h>
+
+
+bool virtio_present;
+uint8_t virtio_irq;
+
+#define VIRTIO_TX_SLOTS			64
+#define VIRTIO_RX_SLOTS			64
+
+#define VIRTIO_NET_F_MAC		(1 << 5)	// Config has a MAC
+
+#define VIRTIO_QUEUE_RX			0
+#define VIRTIO_QUEUE_TX			1
+
+#define VIRTIO_NET_HDRLEN		10	// sizeof(virtio_net_hdr)
+
+
+struct virtio_tx_slot {
+	char buf[NET_MAXPKT];	// Copy of the frame, or just its header
+	pageinfo *pin;		// Page the body is sent from in place, if any
+};
+
+struct virtio_rx_slot {
+	char hdr[VIRTIO_NET_HDRLEN];	// virtio_net_hdr the host writes
+	char buf[NET_MAXPKT];		// Received frame
+};
+
+static struct {
+	spinlock lock;
+	uint32_t iobase;
+
+	struct virtq rxq, txq;
+
+	struct virtio_tx_slot tx[VIRTIO_TX_SLOTS];
+	int txfree[VIRTIO_TX_SLOTS];	// Stack of free tx slot numbers
+	int ntxfree;
+	int tx_batch;	// Batches open: hold notifications till they close
+	int tx_unkicked;	// Chains made available since we last notified
+	char txhdr[VIRTIO_NET_HDRLEN];	// All-zero header for every frame
+
+	struct virtio_rx_slot rx[VIRTIO_RX_SLOTS];
+	int nrx;	// Receive slots in use: as many as fit the queue
+} virtio;
+
+
+// Legacy virtqueue helpers, shared with the virtio-blk driver (dev/vblk.c).
+
+// Allocate virtqueue 'sel' of the device at I/O port 'iobase',
+// and register it with the host, returning false on failure.
+bool
+virtq_init(struct virtq *q, uint32_t iobase, int sel)
+{
+	outw(iobase + VIRTIO_PCI_QUEUE_SEL, sel);
+	int num = inw(iobase + VIRTIO_PCI_QUEUE_NUM);
+	if (num == 0)
+		return 0;
+	uint32_t usedoff = ROUNDUP(sizeof(struct vring_desc) * num +
+				4 + 2 * num + 2, PAGESIZE);
+	uint32_t size = usedoff + ROUNDUP(4 + 8 * num + 2, PAGESIZE);
+	int order = 0;
+	while ((PAGESIZE << order) < size)
+		order++;
+	pageinfo *pi = mem_allocn(order);
+	if (pi == NULL)
+		return 0;
+	int i;
+	for (i = 0; i < (1 << order); i++)
+		mem_incref(&pi[i]);
+	void *mem = mem_pi2ptr(pi);
+	memset(mem, 0, PAGESIZE << order);
+
+	q->iobase = iobase;
+	q->sel = sel;
+	q->num = num;
+	q->desc = mem;
+	q->avail = mem + sizeof(struct vring_desc) * num;
+	q->used = mem + usedoff;
+	q->lastused = 0;
+	outl(iobase + VIRTIO_PCI_QUEUE_PFN, mem_phys(mem) >> PAGESHIFT);
+	return 1;
+}
+
+// Make the descriptor chain starting at 'head' available to the host.
+void
+virtq_post(struct virtq *q, int head)
+{
+	q->avail->ring[q->avail->idx % q->num] = head;
+	asm volatile("" : : : "memory");	// ring entry before index
+	q->avail->idx++;		// (x86 keeps stores in order)
+}
+
+// Tell the host about newly available chains on the queue,
+// unless it has said it's busy enough to find them by itself.
+void
+virtq_kick(struct virtq *q)
+{
+	mfence();		// host must see our index before we read flags
+	if (!(q->used->flags & VRING_USED_F_NO_NOTIFY))
+		outw(q->iobase + VIRTIO_PCI_QUEUE_NOTIFY, q->sel);
+}
+
+// Take back the transmit slots whose frames the host has sent.
+static void
+virtio_txreclaim(void)
+{
+	assert(spinlock_holding(&virtio.lock));
+	struct virtq *q = &virtio.txq;
+	while (q->lastused != q->used->idx) {
+		int slot = q->used->ring[q->lastused % q->num].id / 3;
+		q->lastused++;
+		if (virtio.tx[slot].pin != NULL) {
+			mem_decref(virtio.tx[slot].pin, mem_free);
+			virtio.tx[slot].pin = NULL;
+		}
+		virtio.txfree[virtio.ntxfree++] = slot;
+	}
+}
+
+// Transmit a packet made of a header and a body, as for e100_tx().
+int virtio_tx(void *hdr, int hlen, void *body, int blen, pageinfo *pin)
+{
+	assert(hlen + blen <= NET_MAXPKT);
+
+	spinlock_acquire(&virtio.lock);
+	virtio_txreclaim();
+	if (virtio.ntxfree == 0) {
+		warn("virtio_tx: no transmit buffers");
+		spinlock_release(&virtio.lock);
+		return 0;
+	}
+	int slot = virtio.txfree[--virtio.ntxfree];
+	struct virtio_tx_slot *ts = &virtio.tx[slot];
+	struct vring_desc *d = &virtio.txq.desc[slot * 3];
+
+	d[0].addr = mem_phys(virtio.txhdr);
+	d[0].len = VIRTIO_NET_HDRLEN;
+	d[0].flags = VRING_DESC_F_NEXT;
+	memcpy(ts->buf, hdr, hlen);
+	d[1].addr = mem_phys(ts->buf);
+	if (pin != NULL) {	// body goes straight from its page
+		assert(PGADDR(body) == (uint32_t)mem_pi2ptr(pin));
+		assert(PGOFF(body) + blen <= PAGESIZE);
+		mem_incref(pin);
+		ts->pin = pin;
+		d[1].len = hlen;
+		d[1].flags = VRING_DESC_F_NEXT;
+		d[2].addr = mem_phys(body);
+		d[2].len = blen;
+		d[2].flags = 0;
+	} else {
+		memcpy(ts->buf + hlen, body, blen);
+		d[1].len = hlen + blen;
+		d[1].flags = 0;
+	}
+	virtq_post(&virtio.txq, slot * 3);
+
+	if (virtio.tx_batch == 0)
+		virtq_kick(&virtio.txq);
+	else
+		virtio.tx_unkicked++;
+
+	spinlock_release(&virtio.lock);
+	return 1;
+}
+
+// Open and close a transmit batch, as for e100_txbegin():
+// the chains made available meanwhile share one notification.
+void virtio_txbegin(void)
+{
+	spinlock_acquire(&virtio.lock);
+	virtio.tx_batch++;
+	spinlock_release(&virtio.lock);
+}
+
+void virtio_txend(void)
+{
+	spinlock_acquire(&virtio.lock);
+	assert(virtio.tx_batch > 0);
+	if (--virtio.tx_batch == 0 && virtio.tx_unkicked > 0) {
+		virtq_kick(&virtio.txq);
+		virtio.tx_unkicked = 0;
+	}
+	spinlock_release(&virtio.lock);
+}
+
+// Hand received frames to net_rx(), releasing the lock around each
+// as e100_intr_rx() does, then give their buffers back to the host.
+// Receive interrupts stay suppressed while we're at it;
+// after re-enabling them we check once more for a frame that slipped in.
+static void
+virtio_intr_rx(void)
+{
+	assert(spinlock_holding(&virtio.lock));
+	struct virtq *q = &virtio.rxq;
+	bool posted = 0;
+	do {
+		q->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+		while (q->lastused != q->used->idx) {
+			struct vring_used_elem *e =
+				&q->used->ring[q->lastused % q->num];
+			int slot = e->id / 2;
+			int len = e->len - VIRTIO_NET_HDRLEN;
+			q->lastused++;
+
+			spinlock_release(&virtio.lock);
+			if (len > 0)
+				net_rx(virtio.rx[slot].buf, len);
+			spinlock_acquire(&virtio.lock);
+
+			virtq_post(q, slot * 2);
+			posted = 1;
+		}
+		q->avail->flags = 0;
+		mfence();	// host must see flags before we re-read idx
+	} while (q->lastused != q->used->idx);
+	if (posted)
+		virtq_kick(q);
+}
+
+void virtio_intr(void)
+{
+	spinlock_acquire(&virtio.lock);
+	inb(virtio.iobase + VIRTIO_PCI_ISR);	// acknowledge
+	virtio_txreclaim();
+	virtio_intr_rx();	// releases and re-acquires virtio.lock!
+	spinlock_release(&virtio.lock);
+}
+
+int virtio_attach(struct pci_func *pcif)
+{
+	int i;
+
+	// A device revision other than 0 is virtio 1.0 only.
+	if (PCI_REVISION(pcif->dev_class) != 0)
+		return 0;
+	if (e100_present) {
+		cprintf("virtio: already using an e100; ignoring virtio-net\n");
+		return 0;
+	}
+
+	pci_func_enable(pcif);
+	virtio_irq = pcif->irq_line;
+	virtio.iobase = pcif->reg_base[0];
+
+	// Reset the device and say we know how to drive it.
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, 0);
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+	outb(virtio.iobase + VIRTIO_PCI_STATUS,
+		VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+	// We only need the MAC address, which gives us our node number.
+	uint32_t features = inl(virtio.iobase + VIRTIO_PCI_HOST_FEATURES);
+	if (!(features & VIRTIO_NET_F_MAC)) {
+		cprintf("virtio: device has no MAC address\n");
+		goto fail;
+	}
+	outl(virtio.iobase + VIRTIO_PCI_GUEST_FEATURES, VIRTIO_NET_F_MAC);
+
+	if (!virtq_init(&virtio.rxq, virtio.iobase, VIRTIO_QUEUE_RX)
+			|| !virtq_init(&virtio.txq, virtio.iobase, VIRTIO_QUEUE_TX)) {
+		cprintf("virtio: can't set up virtqueues\n");
+		goto fail;
+	}
+
+	// Each transmit slot owns 3 consecutive descriptors,
+	// and each receive slot 2: the header and the frame.
+	int ntx = MIN(VIRTIO_TX_SLOTS, virtio.txq.num / 3);
+	for (i = 0; i < ntx; i++) {
+		struct vring_desc *d = &virtio.txq.desc[i * 3];
+		d[0].next = i * 3 + 1;
+		d[1].next = i * 3 + 2;
+		virtio.txfree[virtio.ntxfree++] = ntx - 1 - i;
+	}
+	virtio.nrx = MIN(VIRTIO_RX_SLOTS, virtio.rxq.num / 2);
+	for (i = 0; i < virtio.nrx; i++) {
+		struct vring_desc *d = &virtio.rxq.desc[i * 2];
+		d[0].addr = mem_phys(virtio.rx[i].hdr);
+		d[0].len = VIRTIO_NET_HDRLEN;
+		d[0].flags = VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
+		d[0].next = i * 2 + 1;
+		d[1].addr = mem_phys(virtio.rx[i].buf);
+		d[1].len = NET_MAXPKT;
+		d[1].flags = VRING_DESC_F_WRITE;
+		virtq_post(&virtio.rxq, i * 2);
+	}
+	virtio.txq.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+
+	cprintf("virtio: MAC address");
+	for (i = 0; i < 6; i++) {
+		net_mac[i] = inb(virtio.iobase + VIRTIO_PCI_CONFIG + i);
+		cprintf("%c%02x", i ? ':' : ' ', net_mac[i]);
+	}
+	cprintf(", %d/%d rx/tx slots\n", virtio.nrx, ntx);
+
+	// Enable network card interrupts, by MSI if the card supports it,
+	// steering each one to the least-loaded CPU (see ioapic_resteer).
+	if (!ioapic_msi(virtio_irq, pcif))
+		pic_enable(virtio_irq);
+	ioapic_steer(virtio_irq, IOAPIC_LEASTLOAD, ~0);
+
+	// Start receiving packets
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK
+		| VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	spinlock_acquire(&virtio.lock);
+	virtq_kick(&virtio.rxq);
+	spinlock_release(&virtio.lock);
+
+	virtio_present = 1;
+	return 1;
+
+fail:
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	return 0;
+}
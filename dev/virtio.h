@@ -0,0 +1,89 @@
+/*
+ * Legacy virtio PCI transport and virtio-net driver definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_VIRTIO_H
+#define PIOS_DEV_VIRTIO_H
+
+struct pci_func;
+struct pageinfo;
+
+// Legacy virtio PCI registers, in I/O space at BAR 0
+#define VIRTIO_PCI_HOST_FEATURES	0x00	// 32 bits
+#define VIRTIO_PCI_GUEST_FEATURES	0x04	// 32 bits
+#define VIRTIO_PCI_QUEUE_PFN		0x08	// 32 bits
+#define VIRTIO_PCI_QUEUE_NUM		0x0c	// 16 bits
+#define VIRTIO_PCI_QUEUE_SEL		0x0e	// 16 bits
+#define VIRTIO_PCI_QUEUE_NOTIFY		0x10	// 16 bits
+#define VIRTIO_PCI_STATUS		0x12	// 8 bits
+#define VIRTIO_PCI_ISR			0x13	// 8 bits, cleared by reading
+#define VIRTIO_PCI_CONFIG		0x14	// Device-specific config
+
+#define VIRTIO_STATUS_ACK		0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVER_OK		0x04
+#define VIRTIO_STATUS_FAILED		0x80
+
+#define VRING_DESC_F_NEXT		1
+#define VRING_DESC_F_WRITE		2
+#define VRING_AVAIL_F_NO_INTERRUPT	1	// We: don't interrupt us
+#define VRING_USED_F_NO_NOTIFY		1	// Host: don't notify me
+
+struct vring_desc {
+	volatile uint32_t addr;		// Physical address, low 32 bits...
+	volatile uint32_t addrhi;	// ...and high, always 0 here
+	volatile uint32_t len;
+	volatile uint16_t flags;
+	volatile uint16_t next;
+};
+
+struct vring_avail {
+	volatile uint16_t flags;
+	volatile uint16_t idx;
+	volatile uint16_t ring[];
+};
+
+struct vring_used_elem {
+	volatile uint32_t id;		// Head of the descriptor chain used
+	volatile uint32_t len;		// Bytes written into it
+};
+
+struct vring_used {
+	volatile uint16_t flags;
+	volatile uint16_t idx;
+	struct vring_used_elem ring[];
+};
+
+// One virtqueue, laid out as the legacy interface requires:
+// descriptors, then the available ring, then on the next page boundary
+// the used ring, all in physically contiguous, page-aligned memory.
+struct virtq {
+	uint32_t iobase;		// Device's I/O ports
+	int sel;			// Queue number on the device
+	int num;			// Entries, as the host dictates
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t lastused;		// Next used entry we'll look at
+};
+
+bool virtq_init(struct virtq *q, uint32_t iobase, int sel);
+void virtq_post(struct virtq *q, int head);
+void virtq_kick(struct virtq *q);
+
+
+// The virtio-net network interface driver itself
+extern bool virtio_present;
+extern uint8_t virtio_irq;
+
+int  virtio_attach(struct pci_func *pcif);
+int  virtio_tx(void *hdr, int hlen, void *body, int blen,
+		struct pageinfo *pin);
+void virtio_txbegin(void);
+void virtio_txend(void);
+void virtio_intr(void);
+
+#endif	// PIOS_DEV_VIRTIO_H
@@ -25,5 +25,7 @@
 #define EAGAIN		8	/* Resource temporarily unavailable */
 #define ECHILD		9	/* No child processes */
 #define ECONFLICT	10	/* Conflict detected (PIOS-specific) */
+#define ENOMEM		11	/* Cannot allocate memory */
+#define ENOTEMPTY	12	/* Directory not empty */
 
 #endif	// !PIOS_INC_ERRNO_H
@@ -17,7 +17,8 @@
  * with files kept within each process's own address space
  * in the virtual address range 2GB-3GB (0x80000000-0xc0000000).
  * Each file's contents occupies a 4MB area of this address region
- * (regardless of the file's actual size), for up to 256 files total.
+ * (regardless of the file's actual size), for up to 256 files total;
+ * a file that grows beyond 4MB borrows further 4MB areas of unused inodes.
  * The first 4MB region, for "file 0", is reserved for a process state area.
  *
  * Output streams such as the display are represented by append-mode files,
@@ -30,7 +31,7 @@
  */
 
 // These definitions should really be in limits.h according to POSIX
-#define OPEN_MAX	256	// Max number of open files per process
+#define OPEN_MAX	1024	// Max number of open files per process
 #define NAME_MAX	63	// Max length of a filename, not inluding null
 #define PATH_MAX	1024	// Max length of a full pathname, incl. null
 
@@ -55,11 +56,22 @@
 // and the various sub-structures it incorporates and builds upon.
 // The remaining 255 4MB areas each hold the content of one file,
 // indexed by an "inode number" from 1 through 255.
-// Thus, this file system can have at most 255 files in existence at once,
-// each having a maximum size of PTSIZE bytes (4MB).
+// Thus, this file system can have at most 255 files in existence at once.
+// A file larger than its own area's PTSIZE bytes (4MB) continues
+// in the areas of other, unallocated inodes, chained through 'next'
+// and marked with 'extof' so they aren't allocated to anything else;
+// each area it continues in is preferably the one right after the last,
+// so a large file is usually contiguous from FILEDATA(ino) onwards.
+// The special inodes below FILEINO_GENERAL never grow beyond one area.
 
-#define FILE_INODES	OPEN_MAX		// Max number of files or "inodes"
-#define	FILE_MAXSIZE	(1<<22)		// Max size of a single file - 4MB
+#define FILE_INODES	256			// Max number of files or "inodes"
+#define FILE_DIRHASH	FILE_INODES		// Directory name hash chains
+#define FILE_DIRTYWORDS	(FILE_INODES/32)	// Words in an inode bitmap
+#define	FILE_SLOTSIZE	(1<<22)		// Size of one inode's area - 4MB
+#define	FILE_MAXSIZE	((FILE_INODES-FILEINO_GENERAL) * FILE_SLOTSIZE)
+#define	FILE_PIPEBUF	(16*PAGESIZE)	// Pipe data a writer holds at most
+#define	FILE_NSLOTS(size) \
+	((size) <= FILE_SLOTSIZE ? 1 : ROUNDUP(size, FILE_SLOTSIZE) >> 22)
 
 #define FILESVA	0x80000000		// Virtual address of file state area
 #define FILEDATA(ino)	((void*)FILESVA + ((ino) << 22)) // File data per inode
@@ -90,6 +102,14 @@ typedef struct filedesc {		// Per-open file descriptor state
 	int	err;									// Last error on this file descriptor
 } filedesc;
 
+// One logged positioned (non-append) write to a file, see fileino_logwrite().
+typedef struct filerange {
+	off_t	lo, hi;			// Bytes written, lo to just before hi
+	int	seq;			// Sequence number in the inode's log, 0 = none
+} filerange;
+
+#define FILE_WRANGES	8		// Positioned writes logged per inode
+
 // Per-file "inode" metadata structure.
 // These inode structs live in the large 'filestate' struct below;
 // there are 256 of them (FILE_INODES) in a given process's file system,
@@ -102,11 +122,27 @@ typedef struct fileinode {		// Per-file state - like an "inode"
 	int	ver;										// Version - bumped on every change
 	mode_t	mode;								// File mode (stat.h), 0 if deleted
 	size_t	size;								// Current size if regular file
+	int	next;			// Inode whose area holds the next 4MB
+	int	extof;			// File this unallocated inode's area extends
+
+	// Directory index links, see dir_lookup() in lib/dir.c
+	int	hnext;			// Next inode on the same name hash chain
+	int	dnext;			// Next entry in the same directory
+	int	dfirst;			// First entry, if this is a directory
 
 	// Reference information for file system state reconciliation
 	int	rino;			// Parent's inode this corresponds to
 	int	rver;			// Version at last reconcile w/ parent
 	size_t	rlen;			// Size when last reconciled w/ parent
+	size_t	released;		// Pipe data freed below, see fileino_release
+
+	// Log of recent positioned writes, so that reconciliation can merge
+	// concurrent writes to disjoint byte ranges instead of conflicting
+	int	wseq;			// Sequence number of the latest write
+	int	wlost;			// Latest sequence number dropped from wr[]
+	int	wsync;			// Our wseq at last reconcile w/ parent
+	int	pwseq;			// Parent's wseq at last reconcile w/ parent
+	filerange wr[FILE_WRANGES];	// Latest writes, in no particular order
 } fileinode;
 
 
@@ -116,26 +152,50 @@ typedef struct fileinode {		// Per-file state - like an "inode"
 // on top of PIOS's minimalistic GET/PUT/RET process management API.
 typedef struct procinfo {
 	int	state;			// Current state of this child process
+	bool	mapped;			// p2c[] has been built by reconcile()
+	uint32_t pdirty[FILE_DIRTYWORDS]; // Our inodes changed since last sync
+	uint16_t p2c[FILE_INODES];	// Child's inode for each of ours, or 0
 } procinfo;
 
 // Values for procinfo.state
 #define PROC_FREE	0		// Unused child, available for fork()
 #define PROC_RESERVED	(-1)		// Child reserved for special purpose
 #define PROC_FORKED	1		// This child forked and running
-#define PROC_CHILDREN	FILE_INODES		// Size of child array
+#define PROC_CKPT	2		// Checkpoint image, see ckpt_save()
+#define PROC_CHILDREN	256			// Size of child array
 
 
 // User-space Unix process state.
+// Everything before 'fd' is the state a parent process reconciles with,
+// so waitpid() exchanges only the FILE_SYNCSIZE bytes holding that part;
+// the file descriptors and child table after it are the process's own.
 typedef struct filestate {
 	int		err;		// This process/thread's errno variable
 	int		cwd;		// Ref to inode for current directory
 	bool		exited;		// Set to true when this process exits
 	int		status;		// Process exit status - set on exit()
-	filedesc	fd[OPEN_MAX];	// File descriptor table
+	bool		consasync;	// Kernel prints consout unprompted (root)
+	bool		diskasync;	// Kernel writes files to disk (root)
+	uint32_t	dirty[FILE_DIRTYWORDS];	// Inodes changed since parent sync
+	uint32_t	cdirty[FILE_DIRTYWORDS]; // Same, not yet in child[].pdirty
+	bool		dirindexed;	// dirhash[], iused[] and links are valid
+	int		dirhash[FILE_DIRHASH];	// Heads of name hash chains
+	uint32_t	iused[FILE_DIRTYWORDS];	// Inodes not fileino_isfree()
 	fileinode	fi[FILE_INODES]; // "Inodes" describing actual files
+
+	filedesc	fd[OPEN_MAX];	// File descriptor table
 	procinfo	child[PROC_CHILDREN]; 	// Unix state of child processes
+
+	// Which entries of the tables above are in use, so that finding
+	// a free one or visiting the used ones skips 32 at a time.
+	// Untouched table entries cost nothing but zero-page mappings.
+	uint32_t	fdopen[OPEN_MAX/32];	// fd[] entries with an inode
+	uint32_t	cbusy[PROC_CHILDREN/32]; // child[] not PROC_FREE
+	uint32_t	cforked[PROC_CHILDREN/32]; // child[] in PROC_FORKED
 } filestate;
 
+#define FILE_SYNCSIZE	ROUNDUP(offsetof(filestate, fd), PAGESIZE)
+
 #define FILES		((filestate *) FILESVA)
 extern filestate *const files;		// always = FILES
 
@@ -161,6 +221,23 @@ extern filestate *const files;		// always = FILES
 // Validity and status checking for file inode numbers ('ino')
 #define fileino_isvalid(ino) \
 	((ino) > 0 && (ino) < FILE_INODES)
+// Inode bitmaps, such as the dirty sets that reconcile() uses to visit
+// only the inodes that changed since a child last synchronized:
+// fileino_dirty() notes a change both for our parent to pick up
+// and for reconcile() to pass on to each of our children.
+#define fileino_setbit(map, ino)	((map)[(ino)/32] |= 1 << ((ino)%32))
+#define fileino_clrbit(map, ino)	((map)[(ino)/32] &= ~(1 << ((ino)%32)))
+#define fileino_hasbit(map, ino)	((map)[(ino)/32] & (1 << ((ino)%32)))
+#define fileino_dirty(fs, ino) \
+	(fileino_setbit((fs)->dirty, ino), fileino_setbit((fs)->cdirty, ino))
+
+// Find the first bit at or after 'i' in an 'n'-bit map
+// that is set, or with bitmap_nextclear() clear; n if there is none.
+int bitmap_next(const uint32_t *map, int n, int i);
+int bitmap_nextclear(const uint32_t *map, int n, int i);
+
+#define fileino_isfree(fs, ino) \
+	((fs)->fi[ino].de.d_name[0] == 0 && (fs)->fi[ino].extof == 0)
 #define fileino_alloced(ino) \
 	(fileino_isvalid(ino) && files->fi[ino].de.d_name[0] != 0)
 #define fileino_exists(ino) \
@@ -171,20 +248,37 @@ extern filestate *const files;		// always = FILES
 	(fileino_alloced(ino) && S_ISDIR(files->fi[ino].mode))
 
 
+void dir_index(filestate *fs);
+int dir_lookup(filestate *fs, int dino, const char *name, int len);
+void dir_link(filestate *fs, int ino);
+
 int fileino_alloc(void);
 int fileino_create(filestate *st, int dino, const char *name);
 ssize_t fileino_read(int ino, off_t ofs, void *buf,
 			size_t eltsize, size_t count);
 ssize_t fileino_write(int ino, off_t ofs, const void *buf,
 			size_t eltsize, size_t count);
+ssize_t fileino_xfer(int dst, off_t dofs, int src, off_t sofs, size_t len);
 int fileino_stat(int ino, struct stat *statbuf);
 int fileino_truncate(int ino, off_t newsize);
 int fileino_flush(int ino);
+void *fileino_map(int ino, off_t ofs, size_t len, bool grow);
+void fileino_logwrite(filestate *fs, int ino, off_t lo, off_t hi);
+int fileino_writes(filestate *fs, int ino, int since, filerange *wr);
+int fileino_slot(filestate *fs, int ino, off_t ofs);
+int fileino_extend(filestate *fs, int ino, size_t size);
+void fileino_shrink(filestate *fs, int ino, size_t size);
+void fileino_release(int ino, off_t ofs);
+
+void procinfo_setstate(filestate *fs, int pid, int state);
 
 filedesc *filedesc_alloc(void);
+void filedesc_setino(filedesc *fd, int ino);
 filedesc *filedesc_open(filedesc *fd, const char *path, int flags, mode_t mode);
 int filedesc_read(filedesc *fd, void *buf, size_t eltsize, size_t count);
 int filedesc_write(filedesc *fd, const void *buf, size_t eltsize, size_t count);
+ssize_t filedesc_sendfile(filedesc *out, filedesc *in, off_t *offset,
+			size_t count);
 off_t filedesc_seek(filedesc *fd, off_t ofs, int whence);
 void filedesc_close(filedesc *fd);
 
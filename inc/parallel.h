@@ -0,0 +1,30 @@
+/*
+ * PIOS-specific structured parallelism: parallel loops and fork/join tasks
+ * built on the SNAP/MERGE-based deterministic "threads" in lib/thread.c.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_INC_PARALLEL_H
+#define PIOS_INC_PARALLEL_H 1
+
+#include <types.h>
+
+#define PAR_WORKERS	8	// Most workers a parallel loop uses
+#define PAR_MAXCHUNKS	256	// Most chunks a parallel loop splits into
+
+extern int parallel_nodes;	// Spread workers across remote nodes too
+
+void	parallel_for(int lo, int hi, int grain,
+		void (*fn)(int i, void *arg), void *arg);
+long	parallel_reduce(int lo, int hi, int grain,
+		long (*fn)(int i, void *arg), long (*op)(long a, long b),
+		long ident, void *arg);
+void	parallel_tree(int n, void (*fn)(int w, void *arg), void *arg);
+int	task_fork(void (*fn)(void *arg), void *arg);
+void	task_join(int task);
+void	task_barrier(void);
+int	task_sync(int *task, int n);
+
+#endif	// !PIOS_INC_PARALLEL_H
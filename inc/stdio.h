@@ -24,6 +24,9 @@
 void	printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...);
 void	vprintfmt(void (*putch)(int, void*), void *putdat,
 		const char *fmt, va_list);
+void	vprintfmtbuf(void (*putch)(int, void*),
+		void (*putbuf)(const char*, int, void*), void *putdat,
+		const char *fmt, va_list);
 
 // Debug console output functions.
 // These are available in both the PIOS kernel and in user space,
@@ -40,6 +43,12 @@ int	vcprintf(const char *fmt, va_list);	// lib/cprintf.c
 
 #define EOF		(-1)	/* return value indicating end-of-file */
 
+#define BUFSIZ		1024	/* default stdio buffer size */
+
+#define _IOFBF		1	/* setvbuf(): fully buffered */
+#define _IOLBF		2	/* setvbuf(): line buffered */
+#define _IONBF		3	/* setvbuf(): unbuffered */
+
 typedef struct filedesc FILE;
 
 extern FILE *const stdin;
@@ -78,6 +87,10 @@ int	feof(FILE *fd);
 int	ferror(FILE *fd);
 void	clearerr(FILE *fd);
 int	fflush(FILE *fd);
+int	setvbuf(FILE *fd, char *buf, int mode, size_t size);
+void	setbuf(FILE *fd, char *buf);
+void	stdio_close(FILE *fd);	// drain a stream's buffer before closing
+void	stdio_sync(void);	// drain all buffers before fork/exec/exit
 
 // lib/readline.c
 char*	readline(const char *prompt);
@@ -26,5 +26,11 @@
 void	exit(int status) gcc_noreturn;
 void	abort(void) gcc_noreturn;
 
+// Memory allocation: lib/malloc.c
+void *	malloc(size_t size);
+void *	calloc(size_t n, size_t size);
+void *	realloc(void *ptr, size_t size);
+void	free(void *ptr);
+
 
 #endif /* !PIOS_INC_STDLIB_H */
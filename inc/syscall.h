@@ -19,18 +19,32 @@
 #define SYS_PUT		0x00000001	// Push data to child and start it
 #define SYS_GET		0x00000002	// Pull results from child
 #define SYS_RET		0x00000003	// Return to parent
+#define SYS_BATCH	0x00000004	// Run an array of gets and puts
+#define SYS_WAIT	0x00000005	// Wait for any of a set of children
 
 #define SYS_START	0x00000010	// Put: start child running
+#define SYS_POLL	0x00000020	// Wait: don't block (see SYS_WAIT)
 
 #define SYS_REGS	0x00001000	// Get/put register state
 #define SYS_FPU		0x00002000	// Get/put FPU state (with SYS_REGS)
 #define SYS_MEM		0x00004000	// Get/put memory mappings
+#define SYS_PMC		0x00008000	// Get/clear perf counter totals (below)
 
 #define SYS_MEMOP	0x00030000	// Get/put memory operation
 #define SYS_ZERO	0x00010000	// Get/put fresh zero-filled memory
 #define SYS_COPY	0x00020000	// Get/put virtual copy
 #define SYS_MERGE	0x00030000	// Get: diffs only from last snapshot
 #define SYS_SNAP	0x00040000	// Put: snapshot child state
+#define SYS_CLONE	0x00080000	// Put: clone a sibling's subtree (below)
+#define SYS_PREFETCH	0x00800000	// Get/put: send src region along (below)
+
+// Get with SYS_MERGE: what to do with bytes changed on both sides
+#define SYS_MERGEPOL	0x00700000	// Conflict policy:
+#define SYS_MERGECLR	0x00000000	// Remove the page from the parent
+#define SYS_MERGESRC	0x00100000	// Take the child's bytes
+#define SYS_MERGEDST	0x00200000	// Keep the parent's bytes
+#define SYS_MERGEADD	0x00300000	// Add both changes to 32-bit words
+#define SYS_MERGEMAX	0x00400000	// Keep the larger (signed) word
 
 #define SYS_PERM	0x00000100	// Set memory permissions on get/put
 #define SYS_READ	0x00000200	// Read permission (NB: in PTE_AVAIL)
@@ -46,8 +60,10 @@
 
 // Register conventions on GET/PUT system call entry:
 //	EAX:	System call command/flags (SYS_*)
-//	EDX:	bits 15-8: Node number to migrate to, 0 for current
+//	EDX:	bits 15-8: Node number to migrate to, 0 for current,
+//			or SYS_NODEANY to let the kernel choose (see below)
 //		bits 7-0: Child process number on above node to get/put
+//		bits 23-16: Sibling to clone for a put with SYS_CLONE
 //	EBX:	Get/put CPU state pointer for SYS_REGS and/or SYS_FPU)
 //	ECX:	Get/put memory region size
 //	ESI:	Get/put local memory region start
@@ -55,19 +71,131 @@
 //	EBP:	reserved
 
 
+// The first get or put naming child cn on SYS_NODEANY places it
+// on the least-loaded node the kernel knows of, maybe this one;
+// later ones with SYS_NODEANY for cn go to that same node,
+// as do any with its node number explicitly.
+#define SYS_NODEANY	0xff
+
+
+// A put with SYS_CLONE first makes the child a copy-on-write clone of
+// its sibling numbered in bits 23-16 of EDX, SYS_CLONESRC(cn) below,
+// together with that sibling's whole subtree of descendants:
+// registers, address spaces and snapshots, sharing every page.
+// Cloning a child into a spare slot checkpoints it, and cloning the
+// spare back into a slot restores it; other put flags then apply to
+// the clone.  Naming the child itself as the sibling instead clears
+// its subtree, leaving it like a fresh child.  Everything in both
+// subtrees must have stopped (the put waits for the two children
+// themselves) and be on the same node, else the put traps as if
+// with T_GPFLT.
+#define SYS_CLONESRC(cn)	((cn) << 16)
+
+
+// A get with SYS_PMC copies the child's hardware performance counter
+// totals into the pmc field of the procstate at EBX, without touching
+// the rest of it unless SYS_REGS is also given; a put with SYS_PMC
+// zeroes the totals.  They include kernel work done on the child's
+// behalf, such as its page faults, and stay zero on CPUs without an
+// architectural PMU (see kern/pmc.c).  A put with SYS_REGS leaves them be.
+
+// A get or put with SYS_PREFETCH that migrates to another node first
+// sends the caller's own pages at ESI, ECX bytes of them, along with us,
+// ahead of the pulls that would otherwise fetch them one round trip at
+// a time.  For a put with SYS_COPY, ESI is the caller's source,
+// so that is the region copied, as for a job's input.  For a get,
+// ESI is an address in the child, so the caller's pages at the same
+// addresses are only a hint, as they are without a memory operation,
+// and the get or put otherwise ignores them.
+// Only the first pages go (see kern/net.h).
+
+
+// Register conventions for BATCH system call:
+//	EAX:	System call command
+//	EBX:	User pointer to an array of sysop structures
+//	ECX:	Number of sysops in the array
+// The kernel advances EBX and decrements ECX past each sysop it completes,
+// so a batch that blocks in a GET or migrates resumes where it left off,
+// and a child that takes a trap in the middle of a batch
+// leaves EBX pointing at the (incomplete) sysop that caused it.
+
+
+// Register conventions for WAIT system call:
+//	EAX:	System call command
+//	EDX:	bits 15-8: Node number to migrate to, 0 for current
+//			(not SYS_NODEANY: the children might be anywhere)
+//	EBX:	User pointer to a childset of child numbers on that node
+// Waits until at least one child in the set has stopped,
+// then rewrites the set to hold just the children that have.
+// Which children those are depends on timing, so only processes with
+// PFF_NONDET get that behavior; any other process waits for the
+// lowest-numbered child in the set, and gets back a set of just that one.
+// Children that do not exist count as stopped (as they do for GET).
+// With SYS_POLL, a wait that would block returns an empty set instead;
+// without PFF_NONDET the set always comes back empty,
+// since whether a child has stopped yet depends on timing too.
+
+
 #ifndef __ASSEMBLER__
 
+// Results of the last GET with SYS_MERGE from a child,
+// returned in its procstate by a GET with SYS_REGS.
+typedef struct mergereport {
+	uint32_t	policy;		// SYS_MERGE* conflict policy used
+	uint32_t	conflicts;	// Bytes (words for ADD/MAX) in conflict
+	uint32_t	pages;		// Pages with conflicts
+	uint32_t	va;		// Lowest such page in parent, 0 if none
+} mergereport;
+
+// Hardware performance counter totals for a process (see SYS_PMC).
+#define PMC_CYCLES	0		// Unhalted core clock cycles
+#define PMC_INSTRS	1		// Instructions retired
+#define PMC_LLCMISS	2		// Last-level cache misses
+#define PMC_DTLBMISS	3		// Data TLB misses that walked
+#define PMC_N		4
+typedef struct pmcstats {
+	uint64_t	count[PMC_N];
+} pmcstats;
+
 // Process state save area format for GET/PUT with SYS_REGS flags
 typedef struct procstate {
 	trapframe	tf;		// general registers
 	uint32_t	pff;		// process feature flags - see below
 	fxsave		fx;		// x87/MMX/XMM registers
+	mergereport	merge;		// Get only: last merge's conflicts
+	pmcstats	pmc;		// Get only: perf counts, see SYS_PMC
 } procstate;
 
 // process feature enable/status flags
 #define PFF_USEFPU	0x0001		// process has used the FPU
 #define PFF_NONDET	0x0100		// enable nondeterministic features
 #define PFF_ICNT	0x0200		// enable instruction count/recovery
+#define PFF_PINCPU	0x0400		// run only on the CPU in PFF_CPU
+#define PFF_PRIO	0x00030000	// base scheduling priority, 0 = highest
+#define PFF_PRIOSHIFT	16
+#define PFF_CPU		0xff000000	// Local APIC ID of CPU for PFF_PINCPU
+#define PFF_CPUSHIFT	24
+
+
+// One get or put in a batch: the registers for the equivalent system call
+typedef struct sysop {
+	uint32_t	cmd;		// EAX: SYS_GET or SYS_PUT, with flags
+	uint32_t	child;		// EDX: node and child number
+	procstate	*save;		// EBX: CPU state for SYS_REGS
+	void		*src;		// ESI: source memory region start
+	void		*dest;		// EDI: destination memory region start
+	size_t		size;		// ECX: memory region size
+} sysop;
+
+// Set of child numbers on one node, for SYS_WAIT
+#define CHILDSET_MAX	256
+typedef struct childset {
+	uint32_t	bits[CHILDSET_MAX/32];
+} childset;
+
+#define childset_add(s, cn)	((s)->bits[(cn) >> 5] |= 1 << ((cn) & 31))
+#define childset_del(s, cn)	((s)->bits[(cn) >> 5] &= ~(1 << ((cn) & 31)))
+#define childset_has(s, cn)	(((s)->bits[(cn) >> 5] >> ((cn) & 31)) & 1)
 
 
 static void gcc_inline
@@ -92,18 +220,30 @@ sys_cputs(const char *s)
 		: "cc", "memory");
 }
 
+// The calls below enter the kernel with SYSENTER, which is much cheaper
+// than INT T_SYSCALL (though the kernel accepts either; see sys_cputs()).
+// SYSENTER saves no user state, so we push our return address
+// and pass the kernel our stack pointer in EBP.  The kernel returns
+// with SYSEXIT, which loses ECX and EDX, so they are outputs below.
+#define SYS_ENTER				\
+	"pushl	%%ebp\n\t"			\
+	"pushl	$1f\n\t"			\
+	"movl	%%esp,%%ebp\n\t"		\
+	"sysenter\n"				\
+	"1:\taddl	$4,%%esp\n\t"		\
+	"popl	%%ebp"
+
 static void gcc_inline
-sys_put(uint32_t flags, uint16_t child, procstate *save,
+sys_put(uint32_t flags, uint32_t child, procstate *save,
 		void *localsrc, void *childdest, size_t size)
 {
-	asm volatile("int %0" :
-		: "i" (T_SYSCALL),
-		  "a" (SYS_PUT | flags),
+	uint32_t edx = child;
+	asm volatile(SYS_ENTER
+		: "+c" (size), "+d" (edx)
+		: "a" (SYS_PUT | flags),
 		  "b" (save),
-		  "d" (child),
 		  "S" (localsrc),
-		  "D" (childdest),
-		  "c" (size)
+		  "D" (childdest)
 		: "cc", "memory");
 }
 
@@ -111,23 +251,62 @@ static void gcc_inline
 sys_get(uint32_t flags, uint16_t child, procstate *save,
 		void *childsrc, void *localdest, size_t size)
 {
-	asm volatile("int %0" :
-		: "i" (T_SYSCALL),
-		  "a" (SYS_GET | flags),
+	uint32_t edx = child;
+	asm volatile(SYS_ENTER
+		: "+c" (size), "+d" (edx)
+		: "a" (SYS_GET | flags),
 		  "b" (save),
-		  "d" (child),
 		  "S" (childsrc),
-		  "D" (localdest),
-		  "c" (size)
+		  "D" (localdest)
+		: "cc", "memory");
+}
+
+// Run 'n' gets and puts in a single kernel entry,
+// with one TLB shootdown for the whole batch instead of one per sysop.
+static void gcc_inline
+sys_batch(sysop *ops, int n)
+{
+	uint32_t edx;
+	asm volatile(SYS_ENTER
+		: "+b" (ops), "+c" (n), "=d" (edx)
+		: "a" (SYS_BATCH)
+		: "cc", "memory");
+}
+
+// Wait for any child in 'set' on 'node' (0 for current) to stop,
+// leaving in 'set' the ones that have (see SYS_WAIT above).
+static void gcc_inline
+sys_wait(uint8_t node, childset *set)
+{
+	uint32_t ecx, edx = node << 8;
+	asm volatile(SYS_ENTER
+		: "=c" (ecx), "+d" (edx)
+		: "a" (SYS_WAIT),
+		  "b" (set)
+		: "cc", "memory");
+}
+
+// Like sys_wait(), but leaving 'set' empty instead of waiting
+// if none of its children has stopped yet (see SYS_POLL above).
+static void gcc_inline
+sys_waitpoll(uint8_t node, childset *set)
+{
+	uint32_t ecx, edx = node << 8;
+	asm volatile(SYS_ENTER
+		: "=c" (ecx), "+d" (edx)
+		: "a" (SYS_WAIT | SYS_POLL),
+		  "b" (set)
 		: "cc", "memory");
 }
 
 static void gcc_inline
 sys_ret(void)
 {
-	asm volatile("int %0" : :
-		"i" (T_SYSCALL),
-		"a" (SYS_RET));
+	uint32_t ecx, edx;
+	asm volatile(SYS_ENTER
+		: "=c" (ecx), "=d" (edx)
+		: "a" (SYS_RET)
+		: "cc", "memory");
 }
 
 
@@ -44,9 +44,15 @@
 // processor defined exceptions or ISA hardware interrupt vectors.
 #define T_SYSCALL	48	// System call
 
+// Error code in a T_SYSCALL trapframe: how the process entered the kernel
+#define T_SYSCALL_INT	0	// INT T_SYSCALL, always returned from by IRET
+#define T_SYSCALL_SYSENTER 1	// SYSENTER; completion returns by SYSEXIT
+
 // We use these vectors to receive local per-CPU interrupts
 #define T_LTIMER	49	// Local APIC timer interrupt
 #define T_LERROR	50	// Local APIC error interrupt
+#define T_IPIWAKE	51	// Inter-processor interrupt to wake idle CPU
+#define T_IPITLB	52	// Inter-processor interrupt to flush the TLB
 
 #define T_DEFAULT	500	// Unused trap vectors produce this value
 #define T_ICNT		501	// Child process instruction count expired
@@ -36,6 +36,25 @@
 #define WIFSIGNALED(x)		(((x) & 0xf00) == WSIGNALED)
 #define WTERMSIG(x)		((x) & 0xff)
 
+#define WNOHANG			0x1	// waitpid(): return 0 if none is done
+
+// Memory mapping protections and flags for mmap().
+// These are traditionally in <sys/mman.h>.
+#define PROT_NONE		0x0
+#define PROT_READ		0x1	// Pages may be read
+#define PROT_WRITE		0x2	// Pages may be written
+#define PROT_EXEC		0x4	// Pages may be executed
+
+#define MAP_SHARED		0x01	// Writes change the file
+#define MAP_PRIVATE		0x02	// Writes go to a private copy
+#define MAP_TYPE		0x0f	// Mask for the above
+
+#define MAP_FAILED		((void*) -1)
+
+#define MS_SYNC			0x1	// Flags for msync() - all synchronous
+#define MS_ASYNC		0x2
+#define MS_INVALIDATE		0x4
+
 
 // Process management functions
 pid_t	fork(void);
@@ -43,6 +62,8 @@ pid_t	wait(int *status);				// trad. in sys/wait.h
 pid_t	waitpid(pid_t pid, int *status, int options);	// trad. in sys/wait.h
 int	execl(const char *path, const char *arg0, ...);
 int	execv(const char *path, char *const argv[]);
+pid_t	spawnl(const char *path, const char *arg0, ...);	// cf. posix_spawn
+pid_t	spawnv(const char *path, char *const argv[]);
 
 // File management functions
 int	open(const char *path, int flags, ...);		// trad. in fcntl.h
@@ -59,11 +80,37 @@ int	ftruncate(int fn, off_t newlength);
 int	isatty(int fn);
 int	remove(const char *path);
 int	fsync(int fn);
+ssize_t	sendfile(int outfn, int infn, off_t *offset, size_t count); // Linux
+
+// Memory-mapped file functions - traditionally in sys/mman.h
+void	*mmap(void *addr, size_t len, int prot, int flags, int fn, off_t ofs);
+int	msync(void *addr, size_t len, int flags);
+int	munmap(void *addr, size_t len);
 
 
 // PIOS-specific thread fork/join functions
 int	tfork(uint16_t child);
 void	tjoin(uint16_t child);
+void	tbarrier(void);
+int	tbarrier_sync(const uint16_t *child, int n, bool *done);
+bool	tjoinbarrier(uint16_t child);
+void	tresume(uint16_t child);
+
+// PIOS-specific persistent worker "threads", joined with tjoin()
+#define TPOOL_ARGMAX	4000		// so a job fits in a page
+void	tpool_start(uint16_t child);
+void	tpool_run(uint16_t child, void (*fn)(void *arg),
+		const void *arg, size_t len);
+void	tpool_stop(uint16_t child);
+
+// PIOS-specific checkpoints of forked children and their descendants,
+// held as stopped copy-on-write clones in spare child slots
+pid_t	ckpt_save(pid_t pid);
+pid_t	ckpt_restore(pid_t ckpt);
+void	ckpt_free(pid_t ckpt);
+
+// PIOS-specific pipeline support: relay a pipe between two forked children
+pid_t	waitpipe(pid_t wpid, pid_t rpid, int ino, int *status);
 
 
 #endif	// !PIOS_INC_UNISTD_H
@@ -88,6 +88,10 @@
 //                     | shared between user threads: |
 //                     |   program text, data, heap   |
 //                     |                              |
+//    VM_HEAPHI        +  .  .  .  .  .  .  .  .  .  .+ 0x70000000
+//                     |        malloc() heap         |
+//    VM_HEAPLO        +  .  .  .  .  .  .  .  .  .  .+ 0x60000000
+//                     |                              |
 //    VM_SHARELO, ---> +==============================+ 0x40000000
 //    VM_USERLO        |                              |
 
@@ -107,5 +111,10 @@
 #define VM_SHAREHI	0x80000000
 #define VM_SHARELO	0x40000000
 
+// Part of it for malloc()'s arenas (see lib/malloc.c):
+// program data goes below, and mmap()'s private copies above.
+#define VM_HEAPHI	0x70000000
+#define VM_HEAPLO	0x60000000
+
 
 #endif /* !PIOS_INC_VM_H */
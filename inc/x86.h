@@ -311,13 +311,66 @@ xadd(volatile uint32_t *addr, int32_t incr)
 	int32_t result;
 
 	// The + in "+m" denotes a read-modify-write operand.
-	asm volatile("lock; xaddl %0, %1" :
+	asm volatile("lock; xaddl %1, %0" :
 	       "+m" (*addr), "=a" (result) :
 	       "1" (incr) :
 	       "cc");
 	return result;
 }
 
+// Full memory barrier: x86 may otherwise let a later load
+// pass an earlier store to a different location.
+static inline void
+mfence(void)
+{
+	asm volatile("mfence" : : : "memory");
+}
+
+// Atomically OR bits into *addr.
+static inline void
+lockor(volatile uint32_t *addr, uint32_t bits)
+{
+	asm volatile("lock; orl %1,%0" : "+m" (*addr) : "r" (bits) : "cc");
+}
+
+// Atomically AND *addr with mask.
+static inline void
+lockand(volatile uint32_t *addr, uint32_t mask)
+{
+	asm volatile("lock; andl %1,%0" : "+m" (*addr) : "r" (mask) : "cc");
+}
+
+// Atomically set *addr to newval if it still equals oldval.
+// Returns the value *addr held before the operation.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+	asm volatile("lock; cmpxchgl %2, %1" :
+	       "=a" (result), "+m" (*addr) :
+	       "r" (newval), "0" (oldval) :
+	       "cc");
+	return result;
+}
+
+// Return the index of the least significant set bit in a nonzero word.
+static gcc_inline int
+bsf(uint32_t v)
+{
+	uint32_t r;
+	asm("bsfl %1,%0" : "=r" (r) : "rm" (v) : "cc");
+	return r;
+}
+
+// Return the index of the most significant set bit in a nonzero word.
+static gcc_inline int
+bsr(uint32_t v)
+{
+	uint32_t r;
+	asm("bsrl %1,%0" : "=r" (r) : "rm" (v) : "cc");
+	return r;
+}
+
 static inline void
 pause(void)
 {
@@ -333,6 +386,26 @@ cpuid(uint32_t idx, cpuinfo *info)
 		: "a" (idx));
 }
 
+// Model-specific registers for the SYSENTER instruction
+#define MSR_SYSENTER_CS		0x174	// Kernel CS; SS is CS+8
+#define MSR_SYSENTER_ESP	0x175	// Kernel stack pointer
+#define MSR_SYSENTER_EIP	0x176	// Kernel entrypoint
+
+static gcc_inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+// Read performance-monitoring counter n (see kern/pmc.c).
+static gcc_inline uint64_t
+rdpmc(uint32_t n)
+{
+	uint64_t val;
+	asm volatile("rdpmc" : "=A" (val) : "c" (n));
+	return val;
+}
+
 static gcc_inline uint64_t
 rdtsc(void)
 {
@@ -355,6 +428,43 @@ cli(void)
 	asm volatile("cli");
 }
 
+// Enable interrupts and halt until the next one arrives.
+// STI's one-instruction interrupt shadow makes the pair atomic,
+// so a wakeup interrupt already pending can't slip in before the HLT.
+static gcc_inline void
+sti_hlt(void)
+{
+	asm volatile("sti; hlt" : : : "memory");
+}
+
+// Clear CR0's task-switched flag, re-enabling x87/SSE instructions.
+static gcc_inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+// Reset the x87 FPU to its power-on state.
+static gcc_inline void
+fninit(void)
+{
+	asm volatile("fninit");
+}
+
+// Save the x87/SSE register state to a 16-byte aligned 512-byte area.
+static gcc_inline void
+fxstore(void *area)
+{
+	asm volatile("fxsave %0" : "=m" (*(char (*)[512]) area));
+}
+
+// Load the x87/SSE register state from a 16-byte aligned 512-byte area.
+static gcc_inline void
+fxrstor(const void *area)
+{
+	asm volatile("fxrstor %0" : : "m" (*(const char (*)[512]) area));
+}
+
 // Byte-swap a 32-bit word to convert to/from big-endian byte order.
 // (Reverses the order of the 4 bytes comprising the word.)
 static gcc_inline uint32_t
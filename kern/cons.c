@@ -24,19 +24,47 @@
 #include <kern/mem.h>
 #include <kern/spinlock.h>
 #include <kern/file.h>
+#include <kern/proc.h>
+#include <kern/pmap.h>
 
 #include <dev/video.h>
 #include <dev/kbd.h>
 #include <dev/serial.h>
 
 void cons_intr(int (*proc)(void));
-static void cons_putc(int c);
 
 // To keep track of write out
 static int cons_out_pos;
+static spinlock cons_outlock;	// Protects cons_out_pos
+
+// Most bytes cons_drain() prints at a time on behalf of a root process
+// that is not running, since it holds the root's lock while printing.
+#define CONS_DRAINMAX	128
 
 spinlock cons_lock;	// Spinlock to make console output atomic
 
+// Kernel console output is logged to a ring per CPU (see cputs()),
+// which cons_logdrain() prints from on one CPU at a time.
+#define CONS_LOGSIZE	(PAGESIZE - 16)	// Bytes of log text per CPU
+#define CONS_LOGDRAINMAX 512		// Most bytes one drain prints
+
+typedef struct cons_logring {
+	volatile uint32_t head;		// Where this CPU appends next
+	volatile uint32_t tail;		// Where the drainer reads next
+	volatile uint32_t lost;		// Messages dropped with the ring full
+	uint32_t	lostshown;	// How many of those we've reported
+	char		buf[CONS_LOGSIZE];
+} cons_logring;
+
+// Header of each message in a ring, followed by its text.
+typedef struct cons_logrec {
+	uint64_t	tsc;		// Time logged, to order CPUs' messages
+	uint32_t	len;		// Length of the text
+} cons_logrec;
+
+// Set once we're panicking or done, to print everything directly again.
+static volatile bool cons_logoff;
+
 /***** General device-independent console code *****/
 // Here we manage the console input buffer,
 // where we stash characters received from the keyboard or serial port
@@ -95,12 +123,15 @@ cons_getc(void)
 	return 0;
 }
 
-// output a character to the console
-static void
-cons_putc(int c)
+// Output up to 'len' bytes to the console without waiting on the UART,
+// as much as the serial transmit ring has room for.
+// Returns the number of bytes output.
+static int
+cons_write(const char *buf, int len)
 {
-	serial_putc(c);
-	video_putc(c);
+	int n = serial_write(buf, len);
+	video_write(buf, n);
+	return n;
 }
 
 // initialize the console devices
@@ -111,6 +142,7 @@ cons_init(void)
 		return;
 
 	spinlock_init(&cons_lock);
+	spinlock_init(&cons_outlock);
 	video_init();
 	kbd_init();
 	serial_init();
@@ -132,13 +164,198 @@ cons_intenable(void)
 	serial_intenable();
 }
 
+// Set up this CPU's console log ring.
+// Until then its console output is printed directly.
+void
+cons_loginit(void)
+{
+	assert(sizeof(cons_logring) == PAGESIZE);
+
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL) {
+		warn("cons_loginit: no memory for CPU %d log ring",
+			cpu_cur()->id);
+		return;
+	}
+	mem_incref(pi);
+	cons_logring *lr = mem_pi2ptr(pi);
+	memset(lr, 0, sizeof(*lr));
+	cpu_cur()->conslog = lr;
+}
+
+// Copy 'n' bytes in or out of log ring 'lr' at 'pos', wrapping around.
+static uint32_t
+cons_logcopy(cons_logring *lr, uint32_t pos, void *p, uint32_t n, bool in)
+{
+	while (n > 0) {
+		uint32_t len = MIN(n, CONS_LOGSIZE - pos);
+		if (in)
+			memmove(&lr->buf[pos], p, len);
+		else
+			memmove(p, &lr->buf[pos], len);
+		p += len;
+		n -= len;
+		pos += len;
+		if (pos == CONS_LOGSIZE)
+			pos = 0;
+	}
+	return pos;
+}
+
+// Append a message to the current CPU's log ring, without locking:
+// only this CPU appends to it, with interrupts disabled as always
+// in the kernel, and the drainer only moves the tail.
+// If the ring is too full, the message is dropped and counted as lost.
+static void
+cons_log(cons_logring *lr, const char *str)
+{
+	cons_logrec rec = { rdtsc(), strlen(str) };
+	uint32_t head = lr->head, tail = lr->tail;
+	uint32_t used = head >= tail ? head - tail : CONS_LOGSIZE - tail + head;
+	if (used + sizeof(rec) + rec.len >= CONS_LOGSIZE) {
+		lr->lost++;
+		return;
+	}
+	head = cons_logcopy(lr, head, &rec, sizeof(rec), 1);
+	head = cons_logcopy(lr, head, (char*)str, rec.len, 1);
+	asm volatile("" : : : "memory");	// publish text before head
+	lr->head = head;
+}
+
+// Print 'n' bytes straight to the console devices.
+static void
+cons_putdirect(const char *s, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		serial_putc(s[i]);
+	video_write(s, n);
+}
+
+// Print 'n' bytes to the console devices, waiting for room if 'wait',
+// else only as many as the serial transmit ring has room for.
+// Returns the number of bytes printed.
+static int
+cons_logput(const char *s, int n, bool wait)
+{
+	if (!wait)
+		return cons_write(s, n);
+	cons_putdirect(s, n);
+	return n;
+}
+
+// Print messages from all CPUs' log rings in the order they were logged,
+// up to about 'max' bytes, with cons_lock held.
+// Unless 'wait', stops when the serial transmit ring is full,
+// leaving the rest of a message for next time, so as never to wait on it.
+static int
+cons_logprint(int max, bool wait)
+{
+	int n = 0;
+	bool full = 0;
+	while (n < max && !full) {
+		cpu *c, *oldest = NULL;
+		cons_logrec rec, orec;
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			cons_logring *lr = c->conslog;
+			if (lr == NULL)
+				continue;
+			if (lr->lost != lr->lostshown) {
+				char msg[64];
+				snprintf(msg, sizeof(msg), "[CPU %d: %d console "
+					"messages lost]\n", c->id,
+					lr->lost - lr->lostshown);
+				int len = strlen(msg);
+				if (cons_logput(msg, len, wait) < len) {
+					full = 1;	// try it again next time
+					break;
+				}
+				lr->lostshown = lr->lost;
+			}
+			if (lr->tail == lr->head)
+				continue;
+			cons_logcopy(lr, lr->tail, &rec, sizeof(rec), 0);
+			if (oldest == NULL || rec.tsc < orec.tsc)
+				oldest = c, orec = rec;
+		}
+		if (full || oldest == NULL)
+			break;
+
+		cons_logring *lr = oldest->conslog;
+		uint32_t pos = lr->tail + sizeof(orec);
+		if (pos >= CONS_LOGSIZE)
+			pos -= CONS_LOGSIZE;
+		uint32_t left = orec.len;
+		while (left > 0) {
+			uint32_t len = MIN(left, CONS_LOGSIZE - pos);
+			uint32_t done = cons_logput(&lr->buf[pos], len, wait);
+			left -= done;
+			pos += done;
+			n += done;
+			if (pos == CONS_LOGSIZE)
+				pos = 0;
+			if (done < len) {
+				full = 1;
+				break;
+			}
+		}
+		if (left > 0) {
+			// Turn the rest into a record of its own, in place:
+			// its header overlaps only bytes we've consumed.
+			pos = (pos + CONS_LOGSIZE - sizeof(orec)) % CONS_LOGSIZE;
+			orec.len = left;
+			cons_logcopy(lr, pos, &orec, sizeof(orec), 1);
+		}
+		asm volatile("" : : : "memory");	// done reading first
+		lr->tail = pos;
+	}
+	return n;
+}
+
+// Called from idle CPUs and the boot CPU's timer ticks
+// to print the kernel's logged console output.
+// Only one CPU drains at a time; the rest go on with their work.
+bool
+cons_logdrain(void)
+{
+	if (!spinlock_try(&cons_lock))
+		return 0;
+	int n = cons_logprint(CONS_LOGDRAINMAX, 0);
+	spinlock_release(&cons_lock);
+	return n > 0;
+}
+
+// Print all logged output now, and any more directly as it comes,
+// so that nothing is left in the rings when we panic or finish.
+void
+cons_logsync(void)
+{
+	cons_logoff = 1;
+	bool already = spinlock_holding(&cons_lock);
+	if (!already && !spinlock_try(&cons_lock))
+		return;		// the CPU draining will print the rest
+	cons_logprint(0x7fffffff, 1);
+	serial_flush();
+	if (!already)
+		spinlock_release(&cons_lock);
+}
+
 // `High'-level console I/O.  Used by readline and cprintf.
+// In the kernel, output goes to this CPU's log ring when it has one,
+// so that callers in interrupt paths don't wait on the UART;
+// otherwise straight to the console.
 void
 cputs(const char *str)
 {
 	if (read_cs() & 3)
 		return sys_cputs(str);	// use syscall from user mode
 
+	cons_logring *lr = cpu_cur()->conslog;
+	if (lr != NULL && !cons_logoff) {
+		cons_log(lr, str);
+		return;
+	}
+
 	// Hold the console spinlock while printing the entire string,
 	// so that the output of different cputs calls won't get mixed.
 	// Implement ad hoc recursive locking for debugging convenience.
@@ -146,9 +363,11 @@ cputs(const char *str)
 	if (!already)
 		spinlock_acquire(&cons_lock);
 
-	char ch;
-	while (*str)
-		cons_putc(*str++);
+	const char *s;
+	for (s = str; *s; s++)
+		serial_putc(*s);
+	serial_flush();		// debugging output shouldn't linger
+	video_write(str, s - str);
 
 	if (!already)
 		spinlock_release(&cons_lock);
@@ -164,18 +383,20 @@ cons_io(void)
 	// Get output file
 	fileinode *fi = &files->fi[FILEINO_CONSOUT];
 	int c;
-	// spinlock_acquire(&cons_lock);
-	while(cons_out_pos < fi->size) {
-		c = ((char*)FILEDATA(FILEINO_CONSOUT))[cons_out_pos];
-		cons_putc(c);
-		num_io++;
-		cons_out_pos++;
+	// Just queue it for the serial port's interrupt to send out;
+	// if the queue fills up, the rest waits for cons_drain().
+	spinlock_acquire(&cons_outlock);
+	if (cons_out_pos < fi->size) {
+		int n = cons_write((char*)FILEDATA(FILEINO_CONSOUT)
+				+ cons_out_pos, fi->size - cons_out_pos);
+		num_io += n;
+		cons_out_pos += n;
 	}
-	// spinlock_release(&cons_lock);
+	spinlock_release(&cons_outlock);
 	// Input file
 	fi = &files->fi[FILEINO_CONSIN];
 	// Read from console
-	while(fi->size <= FILE_MAXSIZE && (c = cons_getc())) {
+	while(fi->size <= FILE_SLOTSIZE && (c = cons_getc())) {
 		// And appened to CONSIN
 		((char*)FILEDATA(FILEINO_CONSIN))[fi->size++] = c;
 		num_io++;
@@ -184,3 +405,69 @@ cons_io(void)
 	return num_io;
 }
 
+// Print up to CONS_DRAINMAX bytes of the root's console output
+// through its page tables, while the root is not running.
+static int
+cons_drainroot(void)
+{
+	uint32_t *sizep = pmap_lookup(proc_root->pdir,
+			(uint32_t)&files->fi[FILEINO_CONSOUT].size);
+	if (sizep == NULL)
+		return 0;
+	uint32_t size = MIN(*sizep, FILE_SLOTSIZE);
+
+	int n = 0;
+	uint32_t va = (uint32_t)FILEDATA(FILEINO_CONSOUT) + cons_out_pos;
+	while (cons_out_pos < size && n < CONS_DRAINMAX) {
+		uint8_t *p = pmap_lookup(proc_root->pdir, va);
+		if (p == NULL)
+			break;
+		int len = MIN(size - cons_out_pos, PAGESIZE - PGOFF(va));
+		len = MIN(len, CONS_DRAINMAX - n);
+		int done = cons_write((char*)p, len);
+		cons_out_pos += done;
+		va += done;
+		n += done;
+		if (done < len)
+			break;		// serial queue is full
+	}
+	return n;
+}
+
+// The root process's console output file is a ring it shares with us:
+// the root appends at the inode's size, and we print from cons_out_pos.
+// Instead of waiting for the root to trap into file_io(),
+// print whatever it has appended from timer ticks and idle CPUs:
+// directly if the root is the process interrupted on this CPU,
+// otherwise by reading its memory, provided it is not running anywhere.
+bool
+cons_drain(void)
+{
+	proc *root = proc_root;
+	serial_intr();		// in case the UART's interrupts are lost
+	if (root == NULL || !spinlock_try(&cons_outlock))
+		return 0;
+
+	int n = 0;
+	if (proc_cur() == root && root->state == PROC_RUN
+			&& root->runcpu == cpu_cur()) {
+		// Interrupted the root in user mode: its memory is loaded.
+		fileinode *fi = &files->fi[FILEINO_CONSOUT];
+		if (cons_out_pos < fi->size) {
+			n = cons_write((char*)FILEDATA(FILEINO_CONSOUT)
+					+ cons_out_pos, MIN(fi->size - cons_out_pos,
+							CONS_DRAINMAX));
+			cons_out_pos += n;
+		}
+	} else if (spinlock_try(&root->lock)) {
+		// Holding the root's lock keeps it from starting to run,
+		// so its page tables and file area stay put meanwhile.
+		if (root->state == PROC_STOP || root->state == PROC_READY
+				|| root->state == PROC_WAIT)
+			n = cons_drainroot();
+		spinlock_release(&root->lock);
+	}
+
+	spinlock_release(&cons_outlock);
+	return n > 0;
+}
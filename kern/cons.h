@@ -45,4 +45,22 @@ void cons_intenable(void);
 // Returns true if I/O was done, false if no new I/O was ready.
 bool cons_io(void);
 
+// Called from timer interrupts and idle CPUs to print console output
+// the root process has appended without trapping into file_io() for it.
+// Returns true if it printed anything.
+bool cons_drain(void);
+
+// Called on each processor once it can allocate memory,
+// to give it a ring for its kernel console output (see cputs()).
+void cons_loginit(void);
+
+// Called from idle CPUs and the boot CPU's timer ticks to print
+// kernel console output from the per-CPU rings, oldest first.
+// Returns true if it printed anything.
+bool cons_logdrain(void);
+
+// Print all the kernel's logged console output, and stop logging,
+// before a panic or when the kernel is done.
+void cons_logsync(void);
+
 #endif /* PIOS_KERN_CONSOLE_H_ */
@@ -14,6 +14,7 @@
 #include <kern/mem.h>
 #include <kern/cpu.h>
 #include <kern/init.h>
+#include <kern/syscall.h>
 
 #include <dev/lapic.h>
 
@@ -82,6 +83,19 @@ void cpu_init()
     
     ltr(CPU_GDT_TSS);
 
+	// Accept system calls through SYSENTER, into the same kernel stack
+	// as the TSS gives traps.  SYSEXIT relies on our GDT order:
+	// kernel code, kernel data, user code, user data.
+	// Processors without SYSENTER take T_ILLOP instead,
+	// and syscall_emulate() treats that like INT T_SYSCALL.
+	cpuinfo inf;
+	cpuid(1, &inf);
+	if (inf.edx & (1 << 11)) {
+		wrmsr(MSR_SYSENTER_CS, CPU_GDT_KCODE);
+		wrmsr(MSR_SYSENTER_ESP, (uint32_t)c->kstackhi);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+	}
+
 }
 
 // Allocate an additional cpu struct representing a non-bootstrap processor.
@@ -137,19 +151,26 @@ cpu_bootothers(void)
 	memmove(code, _binary_obj_boot_bootother_start,
 		(uint32_t)_binary_obj_boot_bootother_size);
 
+	// Fill in the local APIC's address, %eip, and each cpu's %esp
+	// in the table below that, by APIC ID, for bootother.S to find.
+	void **stacks = (void**)(code-8) - 256;
+	*(void**)(code-4) = (void*)lapic;
+	*(void**)(code-8) = init;
+	uint8_t ids[256];
+	int n = 0;
 	cpu *c;
 	for(c = &cpu_boot; c; c = c->next){
 		if(c == cpu_cur())  // We''ve started already.
 			continue;
-
-		// Fill in %esp, %eip and start code on cpu.
-		*(void**)(code-4) = c->kstackhi;
-		*(void**)(code-8) = init;
-		lapic_startcpu(c->id, (uint32_t)code);
-
-		// Wait for cpu to get through bootstrap.
-		while(c->booted == 0)
-			;
+		stacks[c->id] = c->kstackhi;
+		ids[n++] = c->id;
 	}
+
+	// Start them all at once, letting them run their per-CPU init
+	// side by side, then wait for all of them to get through it.
+	lapic_startcpus(ids, n, (uint32_t)code);
+	for(c = &cpu_boot; c; c = c->next)
+		while(c->booted == 0 && c != cpu_cur())
+			pause();
 }
 
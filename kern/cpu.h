@@ -31,6 +31,15 @@
 #include <inc/x86.h>
 #include <inc/mmu.h>
 #include <inc/trap.h>
+#include <inc/syscall.h>
+
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/mem.h>
+
+
+// Number of scheduling priority levels (see PFF_PRIO in inc/syscall.h).
+#define PROC_NPRIO	4
 
 
 // Per-CPU kernel state structure.
@@ -58,12 +67,89 @@ typedef struct cpu {
 	// Local APIC ID of this CPU, for inter-processor interrupts etc.
 	uint8_t		id;
 
-	// Flag used in cpu.c to serialize bootstrap of all CPUs
+	// Flag used in cpu.c to wait for the bootstrap of all CPUs
 	volatile uint32_t booted;
 
 	// Process currently running on this CPU.
 	struct proc	*proc;
 
+	// Per-CPU cache of free physical pages (see kern/mem.c).
+	struct pageinfo	*magazine;	// Chain of free pages via free_next
+	int		nmag;		// Number of pages in magazine
+	int32_t		memstat[MEMSTAT_N];	// Accounting (see kern/mem.h)
+
+	// Per-CPU ready queues of processes waiting to run on this CPU,
+	// one per priority level, with a bitmask of the nonempty levels.
+	// Idle CPUs steal from the queues of other CPUs (see kern/proc.c).
+	spinlock	readylock;	// Protects the ready queues below
+	struct proc	*readyhead[PROC_NPRIO];	// First proc on each queue
+	struct proc	**readytail[PROC_NPRIO]; // Points to last readynext
+	uint32_t	readymask;	// Bit n set if readyhead[n] nonempty
+	volatile int	nready;		// Number of procs on all ready queues
+	volatile int	npinned;	// Of those, pinned here (PFF_PINCPU)
+
+	// Process whose FPU/SSE state is currently loaded in this CPU's
+	// registers, or NULL.  CR0.TS is set whenever anyone else runs,
+	// so the first FPU instruction traps and proc_fpuload() swaps it in.
+	struct proc	*fpuowner;
+
+	// TLB shootdown state (see pmap_shootdown()).  tlbpdir is the
+	// physical address of the page directory last loaded into CR3;
+	// other CPUs that edit that pdir bump tlbreq, and this CPU sets
+	// tlbdone to the tlbreq value it has flushed for.
+	volatile uint32_t tlbpdir;
+	volatile uint32_t tlbreq;
+	volatile uint32_t tlbdone;
+
+	// Page directories the current system call has changed
+	// but not yet shot down on other CPUs: its process's own
+	// and that of the child it last operated on (see sysflush()).
+	uint32_t	*syspdir[2];
+
+	// Child just started by the process running on this CPU,
+	// held off the ready queues in the hope that the parent
+	// will immediately wait for it (see proc_start()).
+	struct proc	*handoff;
+
+	// This CPU's wheel of pending one-shot timers (see kern/timer.c).
+	struct timer	*timers[TIMER_WHEEL];
+	int		ntimers;	// Number of pending timers
+	uint32_t	ticks;		// Current tick, while timer running
+	uint32_t	timerlast;	// Tick of last timer_intr() scan
+	uint32_t	timerpart;	// LAPIC counts into the current tick
+	uint32_t	timercount;	// LAPIC counts programmed, 0 if stopped
+	uint32_t	timerdeadline;	// Tick the LAPIC is programmed for
+
+	// Time-slice preemption for the process running on this CPU.
+	// The slice timer is only armed when another process is waiting.
+	struct timer	slicetimer;	// Fires when the slice is used up
+	volatile uint32_t slicing;	// Slice timer armed for this proc
+	bool		sliceup;	// Slice timer has fired
+
+	// Ring of kernel console output from this CPU (see kern/cons.c).
+	struct cons_logring *conslog;
+
+	// Ring of scheduler events recorded on this CPU (see kern/trace.c).
+	struct trace_ring *trace;
+
+	// Ring of timer-driven profile samples (see kern/prof.c),
+	// and the timer that keeps the LAPIC ticking to take them.
+	struct prof_ring *prof;
+	struct timer	proftimer;
+
+	// Trap and system call latency histograms (see kern/lat.c).
+	struct latstats	*lat;
+
+	// Performance counters this CPU has programmed (see kern/pmc.c):
+	// bit n set if it counts event PMC_n, in counter n, and the
+	// counter values at the last switch or proc_save().
+	uint32_t	pmcmask;
+	uint64_t	pmcwrap;	// Counter width mask
+	uint64_t	pmcbase[PMC_N];
+
+	// Network traffic counters and latencies (see kern/net.c).
+	struct netstats	*net;
+
 	// Magic verification tag (CPU_MAGIC) to help detect corruption,
 	// e.g., if the CPU's ring 0 stack overflows down onto the cpu struct.
 	uint32_t	magic;
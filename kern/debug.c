@@ -36,6 +36,7 @@ debug_panic(const char *file, int line, const char *fmt,...)
 		if (panicstr)
 			goto dead;
 		panicstr = fmt;
+		cons_logsync();	// print what's logged, then print directly
 	}
 
 	// First print the requested message
@@ -0,0 +1,1053 @@
+/*
+ * Persistent storage of the root process's files on a block device.
+ *
+ * With a virtio-blk disk attached (dev/vblk.c), the root process's
+ * regular files and directories outlive a reboot.  The disk mirrors
+ * the root's file system layout: each 4MB file area ("inode area")
+ * has a fixed place on disk, so a file's pages go to and come from
+ * disk blocks at the same offsets they have in the root's memory.
+ *
+ * At boot we read only the metadata: the inode table, and for each
+ * page of each area which of two on-disk copies holds its contents.
+ * File pages get mapped "absent" (see disk.h): the first process to
+ * touch one faults, and disk_pagefault() reads it in, along with the
+ * pages after it, into a cache of boot-time contents the disk code
+ * keeps per area.  Every process that touches the same page shares the
+ * cached copy, copy-on-write.  Absent mappings travel between address
+ * spaces like any other, as long as they keep their place in a 4MB
+ * area; copies that move them elsewhere, merges and migrations get
+ * them read in first (disk_fill()).
+ *
+ * Writing back happens on the root's sys_ret(), from file_io():
+ * disk_flush() writes the pages of each file that changed since it last
+ * did so, asynchronously, without blocking the root.  A page always goes
+ * to whichever of its block's two on-disk copies the metadata on disk
+ * does NOT name, and the metadata written after the data then names the
+ * new copy; a copy that still holds boot-time contents some absent
+ * mapping may need gets read into the cache before it is overwritten.
+ * The metadata itself has two copies on disk, written alternately,
+ * each with a sequence number and a checksum: at boot we take the
+ * newest one that's whole.
+ *
+ * So after a crash, the disk holds the files as of the last flush whose
+ * metadata write completed: that flush's inodes, and the pages it names,
+ * none of which anything since has overwritten.  A flush that had to
+ * leave part of a file for later may have written some of its pages
+ * already, and then the file has those newer pages under its older inode.
+ * Nothing after the last completed metadata write survives.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stat.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/file.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/proc.h>
+#include <kern/file.h>
+#include <kern/disk.h>
+#include <kern/spinlock.h>
+
+#include <dev/vblk.h>
+
+
+// On-disk layout, in page-sized blocks: two copies of the metadata,
+// each a superblock, a copy of the root's inode table, and a map saying
+// which of each page's two copies is current; then two consecutive
+// copies of each file area.
+#define DISK_MAGIC	0x50494f53		// "PIOS"
+#define DISK_BLKSECTS	(PAGESIZE / VBLK_SECTSIZE)
+#define DISK_AREABLKS	(FILE_SLOTSIZE / PAGESIZE)	// Pages per area
+#define DISK_MAPWORDS	(DISK_AREABLKS / 32)		// Map words per area
+#define DISK_INOBLK	1		// Within a copy of the metadata
+#define DISK_INOBLKS	((sizeof(fileinode) * FILE_INODES + PAGESIZE - 1) \
+				/ PAGESIZE)
+#define DISK_MAPBLK	(DISK_INOBLK + DISK_INOBLKS)
+#define DISK_MAPBLKS	(FILE_INODES * DISK_MAPWORDS * 4 / PAGESIZE)
+#define DISK_METABLKS	(DISK_MAPBLK + DISK_MAPBLKS)	// Per copy
+#define DISK_DATABLK	(2 * DISK_METABLKS)
+#define DISK_METARQS	((DISK_METABLKS + VBLK_MAXSEGS - 1) / VBLK_MAXSEGS)
+
+// Block holding page i of area s in copy 'half' (0 or 1)
+#define disk_blk(s, half, i) \
+	(DISK_DATABLK + ((s) * 2 + (half)) * DISK_AREABLKS + (i))
+
+typedef struct disksuper {
+	uint32_t	magic;		// DISK_MAGIC
+	uint32_t	inodes;		// FILE_INODES
+	uint32_t	inosize;	// sizeof(fileinode)
+	uint32_t	areablks;	// DISK_AREABLKS
+	uint32_t	seq;		// Newer copies have higher numbers
+	uint32_t	sum;		// disk_metasum() of the whole copy
+} disksuper;
+
+// In the kernel's private per-area page tables below,
+// a read or write of the page is in flight
+#define DISK_BUSY	PTE_W
+// In a boot table: the read failed, so the page has no contents
+#define DISK_BAD	PTE_D
+
+// Kernel state for one file area.  Both tables hold page references.
+typedef struct diskarea {
+	// The area's contents as of boot, read in as processes fault on them:
+	// 0 until read, page | DISK_BUSY while being read, then page | PTE_P,
+	// or DISK_BAD if the disk couldn't read it.
+	pte_t		*boot;
+	int		nboot;		// Pages the boot-time contents cover
+
+	// What the disk holds of each page, for disk_flush():
+	// 0 for the boot-time contents, page | PTE_P for a page written
+	// there since (PTE_ZERO for zeros), DISK_BUSY while writing it,
+	// and no PTE_P if we know nothing useful.
+	pte_t		*synced;
+} diskarea;
+
+#define DISK_NRQ	32		// Page runs in flight at once
+
+typedef struct diskrq {
+	vblkreq		v;		// Driver's request, first for done()
+	int		area;		// Area the run of pages belongs to
+	int		i;		// Its first page within the area
+	struct diskrq	*next;		// Next free request
+} diskrq;
+
+uint32_t disk_absentlo, disk_absenthi;
+
+static struct {
+	spinlock	lock;
+	bool		writable;	// We have a disk we may write to
+	int		firstino;	// First inode not the kernel's own
+	int		nareas;		// Areas the disk has room for
+	int		nboot;		// Areas with boot-time contents cached
+
+	diskarea	area[FILE_INODES];
+	uint32_t	bootmap[FILE_INODES][DISK_MAPWORDS]; // Copy booted from
+	uint32_t	curmap[FILE_INODES][DISK_MAPWORDS];  // Copy written last
+	uint32_t	diskmap[FILE_INODES][DISK_MAPWORDS]; // Copy disk names
+	fileinode	fi[FILE_INODES];	// Inodes as of their last flush
+	uint32_t	saved[FILE_DIRTYWORDS];	// fi[] entries that are in use
+
+	diskrq		rq[DISK_NRQ];
+	diskrq		*freerq;
+	int		nreads, nwrites;	// Page runs in flight
+	proc		*waiters;	// Processes waiting for reads
+	bool		deferred;	// A flush left some file for later
+
+	uint8_t		*meta;		// Staging copy of the metadata blocks
+	vblkreq		metarq[DISK_METARQS];
+	int		metaout;	// Metadata requests in flight
+	bool		metaerr;	// One of them failed
+	int		metacopy;	// Copy of the metadata to write next
+	uint32_t	metaseq;	// Sequence number of the newest on disk
+	bool		metadirty;	// fi[] or curmap[] changed since staged
+	bool		metapend;	// Staged, waiting for data writes
+
+	// Statistics for the "diskstat" file
+	uint32_t	faults, hits, reads, readpages;
+	uint32_t	waits, writes, writepages, metawrites, errors;
+} disk;
+
+#define disk_absentpte(s)	(disk_absentlo + (s) * PAGESIZE)
+#define disk_absentarea(pte)	((PGADDR(pte) - disk_absentlo) / PAGESIZE)
+#define disk_bootbit(s, i)	((disk.bootmap[s][(i)/32] >> ((i)%32)) & 1)
+#define disk_diskbit(s, i)	((disk.diskmap[s][(i)/32] >> ((i)%32)) & 1)
+
+static int disk_readboot(int s, int i);
+static void disk_readdone(vblkreq *v);
+static void disk_writedone(vblkreq *v);
+static void disk_metadone(vblkreq *v);
+
+
+static diskrq *
+disk_rqalloc(void)
+{
+	diskrq *rq = disk.freerq;
+	if (rq != NULL)
+		disk.freerq = rq->next;
+	return rq;
+}
+
+static void
+disk_rqfree(diskrq *rq)
+{
+	rq->next = disk.freerq;
+	disk.freerq = rq;
+}
+
+// Allocate one of the per-area tables, empty.
+static pte_t *
+disk_newtable(void)
+{
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return NULL;
+	mem_incref(pi);
+	memset(mem_pi2ptr(pi), 0, PAGESIZE);
+	return mem_pi2ptr(pi);
+}
+
+// Drop the page reference a per-area table entry holds, if any.
+static void
+disk_unref(pte_t e)
+{
+	if (PGADDR(e) != 0 && PGADDR(e) != PTE_ZERO)
+		mem_decref(mem_phys2pi(PGADDR(e)), mem_free);
+}
+
+static void
+disk_freetable(pte_t *t)
+{
+	int i;
+	for (i = 0; i < NPTENTRIES; i++)
+		disk_unref(t[i]);
+	mem_decref(mem_ptr2pi(t), mem_free);
+}
+
+// Transfer metadata blocks between the staging copy
+// and copy 'copy' on disk.
+static void
+disk_metaio(bool write, int copy)
+{
+	assert(disk.metaout == 0);
+	int r;
+	for (r = 0; r < DISK_METARQS; r++) {
+		vblkreq *v = &disk.metarq[r];
+		int b = r * VBLK_MAXSEGS, k;
+		v->sector = (uint64_t)(copy * DISK_METABLKS + b) * DISK_BLKSECTS;
+		v->write = write;
+		v->nseg = MIN(VBLK_MAXSEGS, DISK_METABLKS - b);
+		for (k = 0; k < v->nseg; k++)
+			v->seg[k] = mem_phys(disk.meta) + (b + k) * PAGESIZE;
+		v->done = disk_metadone;
+		disk.metaout++;
+	}
+	disk.metaerr = 0;
+	for (r = 0; r < DISK_METARQS; r++)
+		vblk_submit(&disk.metarq[r]);
+}
+
+// Checksum of the staged metadata, with its own 'sum' field as zero.
+static uint32_t
+disk_metasum(void)
+{
+	disksuper *sb = (disksuper*)disk.meta;
+	uint32_t saved = sb->sum, h = 2166136261u;	// FNV-1a, by words
+	sb->sum = 0;
+	const uint32_t *w = (const uint32_t*)disk.meta;
+	int i;
+	for (i = 0; i < DISK_METABLKS * PAGESIZE / 4; i++)
+		h = (h ^ w[i]) * 16777619;
+	sb->sum = saved;
+	return h;
+}
+
+// Read metadata copy 'copy' into the staging buffer, polling,
+// and return true if it holds a whole file system of ours.
+static bool
+disk_metaread(int copy)
+{
+	disk_metaio(0, copy);
+	while (disk.metaout > 0)
+		vblk_intr();
+	disksuper *sb = (disksuper*)disk.meta;
+	return !disk.metaerr && sb->magic == DISK_MAGIC &&
+		sb->inodes == FILE_INODES && sb->inosize == sizeof(fileinode) &&
+		sb->areablks == DISK_AREABLKS && sb->sum == disk_metasum();
+}
+
+// Map the first 'size' bytes of file area 's' absent in the root,
+// to be read in from the boot-time copy on demand.
+static void
+disk_restorearea(proc *root, int s, size_t size)
+{
+	diskarea *a = &disk.area[s];
+	int n = ROUNDUP(size, PAGESIZE) / PAGESIZE, i;
+	if (n == 0)
+		return;
+	a->boot = disk_newtable();
+	pte_t *pte = pmap_walk(root->pdir, (uint32_t)FILEDATA(s), 1);
+	if (a->boot == NULL || pte == NULL)
+		panic("disk_restorearea: out of memory");
+	pageinfo *abs = mem_phys2pi(disk_absentpte(s));
+	for (i = 0; i < n; i++) {
+		mem_incref(abs);
+		pte[i] = disk_absentpte(s) | SYS_RW | PTE_U;
+	}
+	a->nboot = n;
+	disk.nboot++;
+}
+
+// Bring back the files the disk holds, after the kernel's own.
+static void
+disk_restore(proc *root)
+{
+	int ino, j;
+	for (ino = disk.firstino; ino < disk.nareas; ino++) {
+		fileinode *fi = &disk.fi[ino];
+		if (fi->de.d_name[0] == 0 && fi->extof == 0)
+			continue;
+		for (j = FILEINO_GENERAL; j < disk.firstino; j++)
+			if (fi->dino == FILEINO_ROOTDIR && strcmp(fi->de.d_name,
+					files->fi[j].de.d_name) == 0)
+				break;
+		if (j < disk.firstino) {
+			cprintf("disk: '%s' is now a kernel file; dropping it\n",
+				fi->de.d_name);
+			continue;
+		}
+		fileino_setbit(disk.saved, ino);
+	}
+
+	// Drop whatever hangs off something dropped, until nothing more goes.
+	bool dropped;
+	do {
+		dropped = 0;
+		for (ino = disk.firstino; ino < disk.nareas; ino++) {
+			if (!fileino_hasbit(disk.saved, ino))
+				continue;
+			fileinode *fi = &disk.fi[ino];
+			int up = fi->extof != 0 ? fi->extof : fi->dino;
+			if (up == FILEINO_ROOTDIR && fi->extof == 0)
+				continue;
+			if (up >= disk.firstino && up < disk.nareas &&
+					fileino_hasbit(disk.saved, up))
+				continue;
+			fileino_clrbit(disk.saved, ino);
+			dropped = 1;
+		}
+	} while (dropped);
+
+	int nfiles = 0;
+	for (ino = disk.firstino; ino < disk.nareas; ino++) {
+		if (!fileino_hasbit(disk.saved, ino))
+			continue;
+		fileinode *fi = &disk.fi[ino];
+		files->fi[ino] = *fi;
+		if (fi->extof != 0 || !S_ISREG(fi->mode))
+			continue;
+		nfiles++;
+		size_t left = fi->size;
+		int s = ino;
+		while (left > 0 && s != 0) {
+			size_t n = MIN(left, FILE_SLOTSIZE);
+			disk_restorearea(root, s, n);
+			left -= n;
+			s = disk.fi[s].next;
+		}
+	}
+	cprintf("disk: %d files restored\n", nfiles);
+}
+
+// Set up persistent storage for the root process's files,
+// and bring back any it had, at inodes from 'firstino' on.
+// Called from file_initroot() with the root's page directory loaded.
+void
+disk_initroot(proc *root, int firstino)
+{
+	int i;
+
+	spinlock_init(&disk.lock);
+	if (!vblk_present)
+		return;
+
+	disk.firstino = firstino;
+	uint64_t nblk = vblk_nsect / DISK_BLKSECTS;
+	if (nblk > DISK_DATABLK)
+		disk.nareas = MIN(FILE_INODES,
+			(nblk - DISK_DATABLK) / (2 * DISK_AREABLKS));
+	if (disk.nareas <= firstino) {
+		cprintf("disk: too small to hold any files\n");
+		return;
+	}
+
+	// The placeholder pages absent mappings point to,
+	// which never get freed: each holds one reference of our own.
+	int order = 0, metaorder = 0;
+	while ((1 << order) < FILE_INODES)
+		order++;
+	while ((1 << metaorder) < DISK_METABLKS)
+		metaorder++;
+	pageinfo *abs = mem_allocn(order);
+	pageinfo *meta = mem_allocn(metaorder);
+	if (abs == NULL || meta == NULL)
+		panic("disk_initroot: out of memory");
+	for (i = 0; i < FILE_INODES; i++) {
+		mem_incref(&abs[i]);
+		memset(mem_pi2ptr(&abs[i]), 0, PAGESIZE);
+	}
+	for (i = 0; i < (1 << metaorder); i++)
+		mem_incref(&meta[i]);
+	disk_absentlo = mem_pi2phys(abs);
+	disk_absenthi = disk_absentlo + FILE_INODES * PAGESIZE;
+	disk.meta = mem_pi2ptr(meta);
+
+	for (i = 0; i < DISK_NRQ; i++)
+		disk_rqfree(&disk.rq[i]);
+
+	// Read the newest whole copy of the metadata,
+	// polling since interrupts are still off.
+	disksuper *sb = (disksuper*)disk.meta;
+	bool ok0 = disk_metaread(0), err0 = disk.metaerr;
+	uint32_t seq0 = sb->seq;
+	bool ok1 = disk_metaread(1), err1 = disk.metaerr;
+	if (err0 && err1) {
+		cprintf("disk: can't read metadata; leaving the disk alone\n");
+		return;
+	}
+	if (ok0 && (!ok1 || (int32_t)(seq0 - sb->seq) > 0))
+		ok0 = disk_metaread(0);		// copy 0 is newer after all
+	else
+		ok0 = 0;
+	if (!ok0 && !ok1)
+		cprintf("disk: no file system found; starting a new one\n");
+	else {
+		disk.metacopy = ok0;		// overwrite the other one first
+		disk.metaseq = sb->seq;
+		memmove(disk.fi, disk.meta + DISK_INOBLK * PAGESIZE,
+			sizeof(disk.fi));
+		memmove(disk.bootmap, disk.meta + DISK_MAPBLK * PAGESIZE,
+			sizeof(disk.bootmap));
+		memmove(disk.curmap, disk.bootmap, sizeof(disk.curmap));
+		memmove(disk.diskmap, disk.bootmap, sizeof(disk.diskmap));
+		disk_restore(root);
+	}
+
+	// Restored files are already as the disk has them.
+	for (i = disk.firstino; i < FILE_INODES; i++)
+		if (fileino_hasbit(disk.saved, i)) {
+			files->fi[i].rver = files->fi[i].ver;
+			files->fi[i].rlen = files->fi[i].size;
+		}
+
+	disk.writable = !vblk_readonly;
+	files->diskasync = disk.writable;
+}
+
+// Give the absent page 'pte' at 'va' the contents it stands for:
+// install the cached boot-time copy if we have it and return 1,
+// else start reading it in and return 0, or -1 if out of memory
+// or the disk couldn't read it.
+static int
+disk_resolve(pte_t *pte, uint32_t va)
+{
+	assert(spinlock_holding(&disk.lock));
+	int s = disk_absentarea(*pte), i = PTX(va);
+	diskarea *a = &disk.area[s];
+	assert(a->boot != NULL && i < a->nboot);
+	if (a->boot[i] & PTE_P) {
+		pmap_fillpte(pte, mem_phys2pi(PGADDR(a->boot[i])));
+		disk.hits++;
+		return 1;
+	}
+	if (a->boot[i] & DISK_BAD)
+		return -1;
+	if (a->boot[i] & DISK_BUSY)
+		return 0;		// someone else's read will do
+	return disk_readboot(s, i);
+}
+
+// Start reading page i of area s as of boot, with the pages after it.
+// Returns 0 if started or to be retried when a request finishes,
+// or -1 if out of memory.
+static int
+disk_readboot(int s, int i)
+{
+	diskarea *a = &disk.area[s];
+	int n;
+	assert(a->boot[i] == 0);
+
+	// Read ahead the following pages from the same copy of the area.
+	diskrq *rq = disk_rqalloc();
+	if (rq == NULL)
+		return 0;		// retry when some request finishes
+	int half = disk_bootbit(s, i);
+	for (n = 0; n < VBLK_MAXSEGS && i + n < a->nboot &&
+			a->boot[i + n] == 0 && disk_bootbit(s, i + n) == half;
+			n++) {
+		pageinfo *pi = mem_alloc();
+		if (pi == NULL)
+			break;
+		mem_incref(pi);
+		a->boot[i + n] = mem_pi2phys(pi) | DISK_BUSY;
+		rq->v.seg[n] = mem_pi2phys(pi);
+	}
+	if (n == 0) {
+		disk_rqfree(rq);
+		return -1;
+	}
+	rq->area = s;
+	rq->i = i;
+	rq->v.sector = (uint64_t)disk_blk(s, half, i) * DISK_BLKSECTS;
+	rq->v.write = 0;
+	rq->v.nseg = n;
+	rq->v.done = disk_readdone;
+	disk.nreads++;
+	disk.reads++;
+	disk.readpages += n;
+	vblk_submit(&rq->v);
+	return 0;
+}
+
+// Does 'pdir' map anything absent in 'size' bytes at 'va'?
+bool
+disk_hasabsent(pde_t *pdir, uint32_t va, size_t size)
+{
+	if (disk.nboot == 0)		// none can exist
+		return 0;
+	uint32_t end = ROUNDUP(va + size, PAGESIZE);
+	for (va = PGADDR(va); va < end; va += PAGESIZE) {
+		pde_t pde = pdir[PDX(va)];
+		if (!(pde & PTE_P) || (pde & PTE_PS) || PGADDR(pde) == PTE_ZERO) {
+			va = PTADDR(va + PTSIZE) - PAGESIZE;
+			continue;
+		}
+		if (disk_isabsent(((pte_t*)PGADDR(pde))[PTX(va)]))
+			return 1;
+	}
+	return 0;
+}
+
+//
+// Read in whatever 'pdir' maps absent in 'size' bytes at 'va',
+// for the current process, whose trapframe is 'tf'.
+// If that means waiting for the disk, blocks the process as
+// proc_save() does with 'entry', so that it tries again once woken.
+// Returns false if out of memory, or if the disk couldn't read a page.
+//
+bool
+disk_fill(trapframe *tf, pde_t *pdir, uint32_t va, size_t size, int entry)
+{
+	if (disk.nboot == 0)
+		return 1;
+	uint32_t lo = PGADDR(va), end = ROUNDUP(va + size, PAGESIZE);
+	bool wait = 0, ok = 1;
+	spinlock_acquire(&disk.lock);
+	for (va = lo; va < end; va += PAGESIZE) {
+		pde_t pde = pdir[PDX(va)];
+		if (!(pde & PTE_P) || (pde & PTE_PS) || PGADDR(pde) == PTE_ZERO) {
+			va = PTADDR(va + PTSIZE) - PAGESIZE;
+			continue;
+		}
+		if (!disk_isabsent(((pte_t*)PGADDR(pde))[PTX(va)]))
+			continue;
+		pte_t *pte = pmap_walk(pdir, va, 1);	// our own table
+		int r = pte != NULL ? disk_resolve(pte, va) : -1;
+		if (r < 0) {
+			ok = 0;
+			break;
+		}
+		if (r == 0)
+			wait = 1;
+	}
+	if (ok && wait) {
+		proc *p = proc_cur();
+		disk.waits++;
+		p->state = PROC_DISK;
+		p->runcpu = NULL;
+		p->disknext = disk.waiters;
+		disk.waiters = p;
+		proc_save(p, tf, entry);
+		spinlock_release(&disk.lock);
+		proc_sched();
+	}
+	spinlock_release(&disk.lock);
+	pmap_inval(pdir, lo, end - lo);
+	return ok;
+}
+
+//
+// Handle a page fault at 'va' on a page still on disk:
+// returns false if it wasn't one, so pmap_pagefault() carries on.
+// A process faulting from user mode gets the page read in, and resumes;
+// a fault in the kernel we leave to the trap's recovery handler.
+//
+bool
+disk_pagefault(trapframe *tf, uint32_t va)
+{
+	proc *p = proc_cur();
+	if (!disk_hasabsent(p->pdir, va, 1))
+		return 0;
+	if (!(tf->cs & 3))
+		return 1;
+	disk.faults++;		// only statistics
+	if (!disk_fill(tf, p->pdir, PGADDR(va), PAGESIZE, -1))
+		return 1;	// no memory or unreadable: reflect the fault
+	trap_return(tf);
+}
+
+// Wake every process waiting for reads, to look again.
+static void
+disk_wake(void)
+{
+	assert(spinlock_holding(&disk.lock));
+	while (disk.waiters != NULL) {
+		proc *p = disk.waiters;
+		disk.waiters = p->disknext;
+		p->disknext = NULL;
+		proc_ready(p);
+	}
+}
+
+static void
+disk_readdone(vblkreq *v)
+{
+	diskrq *rq = (diskrq*)v;
+	diskarea *a = &disk.area[rq->area];
+	bool wakeroot;
+	int k;
+	spinlock_acquire(&disk.lock);
+	if (!v->ok) {
+		cprintf("disk: read error in area %d page %d\n",
+			rq->area, rq->i);
+		disk.errors++;
+	}
+	for (k = 0; k < v->nseg; k++) {
+		pte_t *b = &a->boot[rq->i + k];
+		if (v->ok)
+			*b = PGADDR(*b) | PTE_P;
+		else {		// faults on it fail from now on
+			disk_unref(*b);
+			*b = DISK_BAD;
+		}
+	}
+	disk.nreads--;
+	disk_rqfree(rq);
+	disk_wake();
+	wakeroot = disk.deferred;	// a flush may be waiting for it too
+	disk.deferred = 0;
+	spinlock_release(&disk.lock);
+	if (wakeroot)
+		file_wakeroot();
+}
+
+static void
+disk_writedone(vblkreq *v)
+{
+	diskrq *rq = (diskrq*)v;
+	diskarea *a = &disk.area[rq->area];
+	bool wakeroot = 0;
+	int k;
+	spinlock_acquire(&disk.lock);
+	if (!v->ok) {
+		cprintf("disk: write error in area %d page %d\n",
+			rq->area, rq->i);
+		disk.errors++;
+	}
+	for (k = 0; k < v->nseg; k++) {
+		pte_t *sp = &a->synced[rq->i + k];
+		*sp &= ~DISK_BUSY;
+		if (!v->ok)
+			*sp &= ~PTE_P;
+	}
+	disk_rqfree(rq);
+	if (--disk.nwrites == 0) {
+		if (disk.metapend) {
+			disk.metapend = 0;
+			disk.metawrites++;
+			disk_metaio(1, disk.metacopy);
+		} else {
+			wakeroot = disk.deferred;
+			disk.deferred = 0;
+		}
+	}
+	disk_wake();		// there may be a request free for them now
+	spinlock_release(&disk.lock);
+	if (wakeroot)
+		file_wakeroot();
+}
+
+static void
+disk_metadone(vblkreq *v)
+{
+	bool wakeroot = 0;
+	spinlock_acquire(&disk.lock);
+	if (!v->ok) {
+		if (!disk.metaerr)
+			cprintf("disk: metadata %s error\n",
+				v->write ? "write" : "read");
+		disk.metaerr = 1;
+		disk.errors++;
+	}
+	if (--disk.metaout == 0 && v->write) {
+		wakeroot = disk.metadirty || disk.deferred;	// more to write
+		disk.deferred = 0;
+		if (!disk.metaerr) {
+			// It's whole on disk: it names the copies to keep now,
+			// and next time we write the other copy of it.
+			disk.metaseq++;
+			disk.metacopy = !disk.metacopy;
+			memmove(disk.diskmap, disk.meta + DISK_MAPBLK * PAGESIZE,
+				sizeof(disk.diskmap));
+		} else
+			disk.metadirty = 1;	// try it again next flush
+	}
+	spinlock_release(&disk.lock);
+	if (wakeroot)
+		file_wakeroot();
+}
+
+// Does the root's inode 'ino' belong on disk?
+// Directories do, and regular files whose areas all fit on the disk,
+// along with the areas they continue in.
+static bool
+disk_saves(int ino)
+{
+	fileinode *fi = &files->fi[ino];
+	if (fi->extof != 0)
+		return fi->de.d_name[0] == 0 && fi->extof != ino &&
+			fileino_isvalid(fi->extof) && disk_saves(fi->extof);
+	if (fi->de.d_name[0] == 0 || fi->mode == 0 || (fi->mode & S_IFPART))
+		return 0;
+	if (S_ISDIR(fi->mode))
+		return 1;
+	if (!S_ISREG(fi->mode))
+		return 0;
+	int k, s = ino, nslots = FILE_NSLOTS(fi->size);
+	for (k = 0; k < nslots; k++) {
+		if (s < disk.firstino || s >= disk.nareas)
+			return 0;
+		s = files->fi[s].next;
+	}
+	return 1;
+}
+
+// Is the disk's copy of page i of area s the page 'r' the root maps?
+static bool
+disk_clean(int s, int i, pte_t r)
+{
+	diskarea *a = &disk.area[s];
+	pte_t sy = a->synced[i];
+	if (sy != 0)
+		return (sy & PTE_P) && PGADDR(sy) == PGADDR(r) &&
+			!disk_isabsent(r);
+	if (disk_isabsent(r))
+		return disk_absentarea(r) == s;
+	return a->boot != NULL && i < a->nboot && (a->boot[i] & PTE_P) &&
+		PGADDR(a->boot[i]) == PGADDR(r);
+}
+
+static void
+disk_writerun(diskrq **rqp)
+{
+	diskrq *rq = *rqp;
+	if (rq == NULL)
+		return;
+	disk.nwrites++;
+	disk.writes++;
+	disk.writepages += rq->v.nseg;
+	vblk_submit(&rq->v);
+	*rqp = NULL;
+}
+
+//
+// Start writing the pages among the first 'size' bytes of area 's'
+// that the disk doesn't have yet, from the root's page directory 'pdir'.
+// Written pages become read-only in the root, so that the next write
+// to one copies it, and we can tell it changed; sets *wrprot if so.
+// Returns false if some pages had to be left for a later flush.
+// No data goes out while metadata is on its way: until that lands,
+// we don't know which copy of a page the disk names.
+//
+static bool
+disk_syncarea(pde_t *pdir, int s, size_t size, bool *wrprot)
+{
+	diskarea *a = &disk.area[s];
+	int n = ROUNDUP(size, PAGESIZE) / PAGESIZE, i;
+	if (disk.metapend || disk.metaout > 0)
+		return 0;
+	if (a->synced == NULL && (a->synced = disk_newtable()) == NULL)
+		return 0;
+
+	uint32_t va = (uint32_t)FILEDATA(s);
+	pde_t *pde = &pdir[PDX(va)];
+	pte_t *pt = NULL;
+	if (*pde & PTE_PS) {
+		if ((pt = pmap_walk(pdir, va, 0)) == NULL)
+			return 0;
+	} else if ((*pde & PTE_P) && PGADDR(*pde) != PTE_ZERO)
+		pt = (pte_t*)PGADDR(*pde);
+
+	bool ok = 1;
+	diskrq *rq = NULL;
+	for (i = 0; i < n; i++) {
+		pte_t r = pt != NULL ? pt[i] : PTE_ZERO;
+		pte_t *sp = &a->synced[i];
+		if (disk_clean(s, i, r) || (*sp & DISK_BUSY)) {
+			if (*sp & DISK_BUSY)
+				ok = 0;
+			disk_writerun(&rq);
+			continue;
+		}
+		if (disk_isabsent(r)) {		// another area's boot contents
+			pte_t *e = pmap_walk(pdir, va + i * PAGESIZE, 1);
+			if (e == NULL || disk_resolve(e, va + i * PAGESIZE) <= 0) {
+				ok = 0;
+				disk_writerun(&rq);
+				continue;
+			}
+			pt = e - i;
+			r = *e;
+		}
+
+		// Never overwrite the copy the disk names; and if the other
+		// still has boot-time contents we may need, read them first.
+		int half = !disk_diskbit(s, i);
+		if (half == disk_bootbit(s, i) && a->boot != NULL &&
+				i < a->nboot &&
+				!(a->boot[i] & (PTE_P | DISK_BAD))) {
+			if (a->boot[i] == 0)
+				disk_readboot(s, i);
+			ok = 0;
+			disk_writerun(&rq);
+			continue;
+		}
+		if (rq != NULL && (rq->i + rq->v.nseg != i ||
+				rq->v.nseg == VBLK_MAXSEGS ||
+				disk_diskbit(s, rq->i) == half))
+			disk_writerun(&rq);
+		if (rq == NULL) {
+			if ((rq = disk_rqalloc()) == NULL) {
+				ok = 0;
+				continue;
+			}
+			rq->area = s;
+			rq->i = i;
+			rq->v.sector = (uint64_t)disk_blk(s, half, i) *
+					DISK_BLKSECTS;
+			rq->v.write = 1;
+			rq->v.nseg = 0;
+			rq->v.done = disk_writedone;
+		}
+		rq->v.seg[rq->v.nseg++] = PGADDR(r);
+		if (PGADDR(r) != PTE_ZERO)
+			mem_incref(mem_phys2pi(PGADDR(r)));
+		disk_unref(*sp);
+		*sp = PGADDR(r) | PTE_P | DISK_BUSY;
+		if (pt != NULL && (*pde & PTE_W) && (pt[i] & PTE_W)) {
+			pt[i] &= ~PTE_W;
+			*wrprot = 1;
+		}
+		if (half)
+			disk.curmap[s][i/32] |= 1 << (i%32);
+		else
+			disk.curmap[s][i/32] &= ~(1 << (i%32));
+		disk.metadirty = 1;
+	}
+	disk_writerun(&rq);
+
+	// Forget pages past the end: if the file grows back over them,
+	// the disk's copies are no use.
+	for (; i < NPTENTRIES; i++)
+		if (a->synced[i] != 0 && !(a->synced[i] & DISK_BUSY)) {
+			disk_unref(a->synced[i]);
+			a->synced[i] = PTE_ZERO;
+		}
+	return ok;
+}
+
+// Forget what we wrote of area 's', which no file we save uses now,
+// so that a file that takes it over later gets all its pages written.
+// Which copies hold what stays as it is: the boot-time copies
+// absent mappings may still need were never overwritten unread.
+static void
+disk_dropsynced(int s)
+{
+	diskarea *a = &disk.area[s];
+	int i;
+	if (a->synced == NULL)
+		return;
+	for (i = 0; i < NPTENTRIES; i++)
+		if (a->synced[i] & DISK_BUSY)
+			return;
+	for (i = 0; i < NPTENTRIES; i++)
+		if (a->synced[i] != 0 && a->synced[i] != PTE_ZERO) {
+			disk_unref(a->synced[i]);
+			a->synced[i] = PTE_ZERO;
+		}
+}
+
+// Start writing whatever changed in the regular file 'ino'.
+static bool
+disk_syncfile(pde_t *pdir, int ino, bool *wrprot)
+{
+	size_t left = files->fi[ino].size;
+	int s = ino;
+	bool ok = 1;
+	do {
+		size_t n = MIN(left, FILE_SLOTSIZE);
+		if (!disk_syncarea(pdir, s, n, wrprot))
+			ok = 0;
+		left -= n;
+		s = files->fi[s].next;
+	} while (left > 0);
+	return ok;
+}
+
+// Let go of the cached boot-time contents of areas
+// no absent mapping refers to any more.
+static void
+disk_reclaim(void)
+{
+	int s, i;
+	for (s = disk.firstino; s < disk.nareas && disk.nboot > 0; s++) {
+		diskarea *a = &disk.area[s];
+		if (a->boot == NULL ||
+				mem_phys2pi(disk_absentpte(s))->refcount > 1)
+			continue;
+		for (i = 0; i < a->nboot && !(a->boot[i] & DISK_BUSY); i++)
+			;
+		if (i < a->nboot)
+			continue;
+
+		// The disk still has these pages: remember them as such,
+		// so disk_flush() doesn't write them again.
+		if (a->synced == NULL)
+			a->synced = disk_newtable();
+		for (i = 0; a->synced != NULL && i < a->nboot; i++)
+			if (a->synced[i] == 0 && (a->boot[i] & PTE_P)) {
+				a->synced[i] = a->boot[i];
+				a->boot[i] = 0;
+			}
+		disk_freetable(a->boot);
+		a->boot = NULL;
+		a->nboot = 0;
+		disk.nboot--;
+	}
+}
+
+// Copy the metadata to write into the staging buffer.
+static void
+disk_metastage(void)
+{
+	disksuper *sb = (disksuper*)disk.meta;
+	memset(disk.meta, 0, PAGESIZE);
+	sb->magic = DISK_MAGIC;
+	sb->inodes = FILE_INODES;
+	sb->inosize = sizeof(fileinode);
+	sb->areablks = DISK_AREABLKS;
+	sb->seq = disk.metaseq + 1;
+	fileinode *fi = (fileinode*)(disk.meta + DISK_INOBLK * PAGESIZE);
+	int ino;
+	for (ino = 0; ino < FILE_INODES; ino++)
+		if (fileino_hasbit(disk.saved, ino))
+			fi[ino] = disk.fi[ino];
+		else
+			memset(&fi[ino], 0, sizeof(fi[ino]));
+	memmove(disk.meta + DISK_MAPBLK * PAGESIZE, disk.curmap,
+		sizeof(disk.curmap));
+	sb->sum = disk_metasum();
+}
+
+//
+// Start writing back the root's files that changed since last time.
+// Called from file_io() in the root process, whose page directory
+// is loaded.  Returns true if there was anything to do, so that a
+// root process calling sys_ret() just to flush doesn't go to sleep.
+// Files we have to leave for later get the root woken up to retry.
+//
+bool
+disk_flush(void)
+{
+	if (!disk.writable)
+		return 0;
+	pde_t *pdir = proc_root->pdir;
+	bool did = 0, wrprot = 0;
+	int ino;
+
+	spinlock_acquire(&disk.lock);
+	for (ino = disk.firstino; ino < FILE_INODES; ino++) {
+		fileinode *fi = &files->fi[ino];
+		if (!disk_saves(ino)) {
+			if (fileino_hasbit(disk.saved, ino)) {
+				fileino_clrbit(disk.saved, ino);
+				disk.metadirty = 1;
+				did = 1;
+			}
+			if (ino < disk.nareas)
+				disk_dropsynced(ino);
+			continue;
+		}
+		if (fileino_hasbit(disk.saved, ino) &&
+				fi->ver == fi->rver && fi->size == fi->rlen)
+			continue;
+		did = 1;
+		if (fi->extof == 0 && S_ISREG(fi->mode) &&
+				!disk_syncfile(pdir, ino, &wrprot)) {
+			disk.deferred = 1;
+			continue;
+		}
+		fi->rver = fi->ver;
+		fi->rlen = fi->size;
+		disk.fi[ino] = *fi;
+		fileino_setbit(disk.saved, ino);
+		disk.metadirty = 1;
+	}
+
+	// The metadata goes out once the data it describes is on disk.
+	if (disk.metadirty && !disk.metapend && disk.metaout == 0) {
+		disk_metastage();
+		disk.metadirty = 0;
+		disk.metapend = 1;
+	}
+	if (disk.metapend && disk.nwrites == 0) {
+		disk.metapend = 0;
+		disk.metawrites++;
+		disk_metaio(1, disk.metacopy);
+	}
+	disk_reclaim();
+	spinlock_release(&disk.lock);
+
+	if (wrprot) {
+		pmap_inval(pdir, VM_FILELO, VM_FILEHI - VM_FILELO);
+		pmap_shootdown(pdir);
+	}
+	return did;
+}
+
+// Write everything back before the system goes down,
+// polling for completions since the root won't run again.
+void
+disk_sync(void)
+{
+	int tries;
+	for (tries = 0; disk.writable && tries < 10; tries++) {
+		bool did = disk_flush();
+		while (disk.nreads + disk.nwrites + disk.metaout > 0)
+			vblk_intr();
+		if (!did && !disk.deferred && !disk.metadirty &&
+				!disk.metapend)
+			break;
+	}
+}
+
+// Update the "diskstat" special file in the root process,
+// whenever the root truncates it to ask for a fresh snapshot.
+void
+disk_statfile(int ino)
+{
+	fileinode *fi = &files->fi[ino];
+	if (fi->size != 0 || !vblk_present)
+		return;
+
+	int s, ncached = 0, nsynced = 0;
+	for (s = 0; s < FILE_INODES; s++)	// racy, but only statistics
+		ncached += disk.area[s].boot != NULL;
+	for (s = 0; s < FILE_INODES; s++)
+		nsynced += disk.area[s].synced != NULL;
+	fi->size = snprintf(FILEDATA(ino), PAGESIZE,
+		"disk sectors %llu areas %d writable %d\n"
+		"faults %u hits %u waits %u reads %u readpages %u\n"
+		"writes %u writepages %u metawrites %u errors %u\n"
+		"cached %d synced %d inflight %d\n",
+		vblk_nsect, disk.nareas, disk.writable,
+		disk.faults, disk.hits, disk.waits, disk.reads, disk.readpages,
+		disk.writes, disk.writepages, disk.metawrites, disk.errors,
+		ncached, nsynced, disk.nreads + disk.nwrites + disk.metaout);
+}
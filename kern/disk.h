@@ -0,0 +1,41 @@
+/*
+ * Persistent storage of the root process's files on a block device.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_DISK_H
+#define PIOS_KERN_DISK_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/mmu.h>
+
+#include <kern/net.h>
+
+struct proc;
+struct trapframe;
+
+// File data still on disk is mapped by "absent" PTEs, which point to
+// one of a block of placeholder pages the disk code owns, one per file
+// area, with the page's place in its 4MB area giving the disk block.
+// An absent PTE carries nominal permissions like any other mapping,
+// and the references that go with it, but never PTE_P:
+// the first access to it faults, and disk_pagefault() reads it in.
+extern uint32_t disk_absentlo, disk_absenthi;
+#define disk_isabsent(pte) \
+	(!((pte) & (PTE_P | PTE_REMOTE)) && \
+	 PGADDR(pte) - disk_absentlo < disk_absenthi - disk_absentlo)
+
+void disk_initroot(struct proc *root, int firstino);
+bool disk_hasabsent(pde_t *pdir, uint32_t va, size_t size);
+bool disk_fill(struct trapframe *tf, pde_t *pdir, uint32_t va, size_t size,
+		int entry);
+bool disk_pagefault(struct trapframe *tf, uint32_t va);
+bool disk_flush(void);
+void disk_sync(void);
+void disk_statfile(int ino);
+
+#endif /* !PIOS_KERN_DISK_H */
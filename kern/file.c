@@ -23,22 +23,35 @@
 #include <kern/file.h>
 #include <kern/init.h>
 #include <kern/cons.h>
+#include <kern/trace.h>
+#include <kern/prof.h>
+#include <kern/lat.h>
+#include <kern/disk.h>
 
 
-// Build a table of files to include in the initial file system.
+// Build a table of files to include in the initial file system:
+// each program, then each program's symbol table as "name.sym".
 #define INITFILE(name)	\
 	extern char _binary_obj_user_##name##_start[]; \
 	extern char _binary_obj_user_##name##_end[];
+#define INITSYM(name)	\
+	extern char _binary_obj_user_##name##_sym_start[]; \
+	extern char _binary_obj_user_##name##_sym_end[];
 #include <obj/kern/initfiles.h>
 #undef INITFILE
+#undef INITSYM
 
 #define INITFILE(name)	\
 	{ #name, _binary_obj_user_##name##_start, \
 		_binary_obj_user_##name##_end },
+#define INITSYM(name)	\
+	{ #name ".sym", _binary_obj_user_##name##_sym_start, \
+		_binary_obj_user_##name##_sym_end },
 char *initfiles[][3] = {
 	#include <obj/kern/initfiles.h>
 };
 #undef INITFILE
+#undef INITSYM
 
 
 // Although 'files' itself could be a preprocessor symbol like FILES,
@@ -48,6 +61,34 @@ char *initfiles[][3] = {
 filestate *const files = FILES;
 
 static spinlock file_lock;	// Lock to protect file I/O state
+
+// Special files the kernel maintains in the root process's root directory.
+// Each file's update function is called on every file_io()
+// to bring its contents up to date with kernel state;
+// this does not by itself count as I/O that wakes the root process,
+// except for a stream: a partial file (S_IFPART) like "consin",
+// which the kernel only ever appends to, and readers wait on at its end.
+// All of them are marked S_IFKERN, so user code can tell them apart.
+static const struct filespecial {
+	const char	*name;
+	void		(*update)(int ino);
+	bool		stream;		// Partial file the kernel appends to
+} file_specials[] = {
+	{ "schedtrace",	trace_drain },	// Scheduler events (kern/trace.c)
+	{ "memstat",	mem_statfile },	// Memory accounting (kern/mem.c)
+	{ "profile",	prof_drain },	// Timer PC samples (kern/prof.c)
+	{ "latstat",	lat_statfile },	// Trap latencies (kern/lat.c)
+	{ "netnodes",	net_nodesfile }, // Node MAC addresses (kern/net.c)
+	{ "netstat",	net_statfile },	// Network traffic (kern/net.c)
+	{ "metrics",	net_metricsfile, 1 }, // Cluster metrics (kern/net.c)
+	{ "boottime",	init_bootfile }, // Boot phase timings (kern/init.c)
+	{ "diskstat",	disk_statfile }, // Disk cache and writeback (kern/disk.c)
+#ifdef SPINLOCK_PROFILE
+	{ "lockstat",	spinlock_statfile }, // Lock contention (kern/spinlock.c)
+#endif
+};
+#define NSPECIALS	(sizeof(file_specials) / sizeof(file_specials[0]))
+static int file_specialino[NSPECIALS];	// Inode of each special file
 static size_t file_consout;	// Bytes written to console so far
 
 void
@@ -83,6 +124,7 @@ file_initroot(proc *root)
 	files->fd[1].flags = O_WRONLY | O_APPEND;
 	files->fd[2].ino = FILEINO_CONSOUT;
 	files->fd[2].flags = O_WRONLY | O_APPEND;
+	files->fdopen[0] = 0x7;		// fds 0-2 are open
 
 	// Setup the inodes for the console I/O files and root directory
 	strcpy(files->fi[FILEINO_CONSIN].de.d_name, "consin");
@@ -91,7 +133,7 @@ file_initroot(proc *root)
 	files->fi[FILEINO_CONSIN].dino = FILEINO_ROOTDIR;
 	files->fi[FILEINO_CONSOUT].dino = FILEINO_ROOTDIR;
 	files->fi[FILEINO_ROOTDIR].dino = FILEINO_ROOTDIR;
-	files->fi[FILEINO_CONSIN].mode = S_IFREG | S_IFPART;
+	files->fi[FILEINO_CONSIN].mode = S_IFREG | S_IFPART | S_IFKERN;
 	files->fi[FILEINO_CONSOUT].mode = S_IFREG;
 	files->fi[FILEINO_ROOTDIR].mode = S_IFDIR;
 
@@ -115,25 +157,57 @@ file_initroot(proc *root)
 		int ino = i + FILEINO_GENERAL;
 		int fsize = initfiles[i][2] - initfiles[i][1];
 		// Need to set name, dino, mode, size, permissions, just like above.
-		// We also need to copy the file data into the FILEDATA for that inode
 		strcpy(files->fi[ino].de.d_name, initfiles[i][0]);
 		files->fi[ino].dino = FILEINO_ROOTDIR;					// In the root directory
 		files->fi[ino].mode = S_IFREG;									// Regular file
 		files->fi[ino].size = fsize;										// The size, as calculated above.
-		// Read - write permission for the system (we need to ROUNDUP because pmap_setperm)
-		// expects sizes in the multiple of PTSIZE
-		pmap_setperm(root->pdir, (uintptr_t)FILEDATA(ino), 
-			ROUNDUP(fsize, PTSIZE), SYS_READ | SYS_WRITE);
-		// Copy the data over
-		memcpy(FILEDATA(ino), initfiles[i][1], fsize);
+		// Rather than copying the file data into the FILEDATA for that inode,
+		// map the kernel image's own page-aligned, zero-padded copy there
+		// read-only but nominally writable, so the first write to a page
+		// copies it.  The kernel keeps its own reference to each page,
+		// which keeps them copy-on-write and never frees them.
+		assert(PGOFF(initfiles[i][1]) == 0);
+		assert(fsize <= FILE_SLOTSIZE);
+		int ofs;
+		for (ofs = 0; ofs < fsize; ofs += PAGESIZE) {
+			pageinfo *pi = mem_ptr2pi(initfiles[i][1] + ofs);
+			mem_incref(pi);
+			if (!pmap_insert(root->pdir, pi,
+					(uintptr_t)FILEDATA(ino) + ofs,
+					SYS_READ | SYS_WRITE | PTE_U))
+				panic("file_initroot: no memory for page tables");
+		}
 	}
 	// warn("file_initroot: file system initialization not done\n");
 
+	// Create the kernel-maintained special files after the initial files.
+	for (i = 0; i < NSPECIALS; i++) {
+		int ino = FILEINO_GENERAL + ninitfiles + i;
+		assert(fileino_isvalid(ino));
+		strcpy(files->fi[ino].de.d_name, file_specials[i].name);
+		files->fi[ino].dino = FILEINO_ROOTDIR;
+		files->fi[ino].mode = S_IFREG | S_IFKERN
+				| (file_specials[i].stream ? S_IFPART : 0);
+		files->fi[ino].size = 0;
+		pmap_setperm(root->pdir, (uintptr_t)FILEDATA(ino),
+				PTSIZE, SYS_READ | SYS_WRITE);
+		file_specialino[i] = ino;
+	}
+
 	// Set root process's current working directory
 	files->cwd = FILEINO_ROOTDIR;
 
+	// The kernel picks up console output from timer ticks and idle CPUs
+	// (see cons_drain()), so flushing it needs no trap into file_io().
+	files->consasync = 1;
+
+	// Bring back the files the root had on disk, if there is one,
+	// in the inodes after the kernel's own.
+	disk_initroot(root, FILEINO_GENERAL + ninitfiles + NSPECIALS);
+
 	// Child process state - reserve PID 0 as a "scratch" child process.
 	files->child[0].state = PROC_RESERVED;
+	files->cbusy[0] = 0x1;		// see procinfo_setstate()
 }
 
 // Called from proc_ret() when the root process "returns" -
@@ -153,13 +227,29 @@ file_io(trapframe *tf)
 	// This is very different from handling system calls
 	// on behalf of arbitrary processes that might be buggy or evil.
 
-	// Perform I/O with whatever devices we have access to.
+	// Refresh the kernel's special files, marking those that changed
+	// so that the root's reconcile() passes them on to its children.
 	bool iodone = 0;
+	int i;
+	for (i = 0; i < NSPECIALS; i++) {
+		int ino = file_specialino[i];
+		size_t size = files->fi[ino].size;
+		int ver = files->fi[ino].ver;
+		file_specials[i].update(ino);
+		if (files->fi[ino].size != size || files->fi[ino].ver != ver)
+			fileino_dirty(files, ino);
+		if (file_specials[i].stream && files->fi[ino].size != size)
+			iodone = 1;	// new input for a waiting reader
+	}
+
+	// Perform I/O with whatever devices we have access to.
 	iodone |= cons_io();
+	iodone |= disk_flush();
 
 	// Has the root process exited?
 	if (files->exited) {
 		cprintf("root process exited with status %d\n", files->status);
+		disk_sync();
 		done();
 	}
 
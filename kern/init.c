@@ -14,6 +14,8 @@
 #include <inc/cdefs.h>
 #include <inc/elf.h>
 #include <inc/vm.h>
+#include <inc/x86.h>
+#include <inc/file.h>
 
 #include <kern/init.h>
 #include <kern/cons.h>
@@ -22,6 +24,11 @@
 #include <kern/cpu.h>
 #include <kern/trap.h>
 #include <kern/spinlock.h>
+#include <kern/slab.h>
+#include <kern/trace.h>
+#include <kern/prof.h>
+#include <kern/lat.h>
+#include <kern/pmc.h>
 #include <kern/mp.h>
 #include <kern/proc.h>
 #include <kern/file.h>
@@ -42,6 +49,42 @@ static char gcc_aligned(16) user_stack[PAGESIZE];
 #endif
 extern char ROOTEXE_START[];
 
+// Timestamps of the end of each boot phase on the bootstrap processor,
+// printed once the root process is ready and kept for "boottime".
+#define INIT_MAXPHASES	24
+static struct initphase {
+	const char	*name;
+	uint64_t	tsc;
+} init_phases[INIT_MAXPHASES];
+static int init_nphases;
+static uint64_t init_starttsc;
+
+// Note the end of boot phase 'name', if we're the bootstrap processor.
+static void
+init_phase(const char *name)
+{
+	if (!cpu_onboot() || init_nphases == INIT_MAXPHASES)
+		return;
+	init_phases[init_nphases].name = name;
+	init_phases[init_nphases].tsc = rdtsc();
+	init_nphases++;
+}
+
+// Print the cycles each boot phase took.
+static void
+init_phasereport(void)
+{
+	uint64_t last = init_starttsc;
+	int i;
+	cprintf("boot phases (cycles):");
+	for (i = 0; i < init_nphases; i++) {
+		cprintf(" %s %llu", init_phases[i].name,
+			init_phases[i].tsc - last);
+		last = init_phases[i].tsc;
+	}
+	cprintf("\nboot to root process: %llu cycles\n", last - init_starttsc);
+}
+
 // Called first from entry.S on the bootstrap processor,
 // and later from boot/bootother.S on all other processors.
 // As a rule, "init" functions in PIOS are called once on EACH processor.
@@ -49,57 +92,89 @@ void
 init(void)
 {
 	extern char start[], edata[], end[];
+	uint64_t tsc = rdtsc();
 
 	// Before anything else, complete the ELF loading process.
 	// Clear all uninitialized global data (BSS) in our program,
 	// ensuring that all static/global variables start out zero.
-	if (cpu_onboot())
+	if (cpu_onboot()) {
 		memset(edata, 0, end - edata);
+		init_starttsc = tsc;
+	}
 
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
+	init_phase("cons");
 
 	// Lab 1: test cprintf and debug_trace
 	cprintf("1234 decimal is %o octal!\n", 1234);
    	unsigned int i = 0x00646c72;
     cprintf("H%x Wo%s", 57616, &i);
+#ifndef BOOT_NOCHECK
 	debug_check();
+	init_phase("debug_check");
+#endif
 
 	// Initialize and load the bootstrap CPU's GDT, TSS, and IDT.
 	cpu_init();
+	init_phase("cpu");
 	trap_init();
+	init_phase("trap");
 
 	// Physical memory detection/initialization.
 	// Can't call mem_alloc until after we do this!
 	mem_init();
+	init_phase("mem");
 
 	// Lab 2: check spinlock implementation
+#ifndef BOOT_NOCHECK
 	if (cpu_onboot())
 		spinlock_check();
+	init_phase("spinlock_check");
+#endif
 
 	// Initialize the paged virtual memory system.
 	pmap_init();
+	init_phase("pmap");
+
+	// Check the kernel object cache allocator.
+#ifndef BOOT_NOCHECK
+	if (cpu_onboot())
+		slab_check();
+	init_phase("slab_check");
+#endif
 
 	// Find and start other processors in a multiprocessor system
 	mp_init();		// Find info about processors in system
 	pic_init();		// setup the legacy PIC (mainly to disable it)
 	ioapic_init();		// prepare to handle external device interrupts
 	lapic_init();		// setup this CPU's local APIC
+	init_phase("mp");
 	cpu_bootothers();	// Get other processors started
+	init_phase("bootothers");
     cprintf("CPU %d (%s) has booted\n", cpu_cur()->id,
 		cpu_onboot() ? "BP" : "AP");
 
 	// Initialize the I/O system.
 	file_init();		// Create root directory and console I/O files
 	pci_init();		  // Initialize the PCI bus and network card
+	init_phase("pci");
 	net_init();
+	init_phase("net");
 
 	// Lab 4: uncomment this when you can handle IRQ_SERIAL and IRQ_KBD.
 	cons_intenable();	// Let the console start producing interrupts
 
 	// Initialize the process management code.
+	cons_loginit();		// Per-CPU kernel console output ring
+	trace_init();		// Per-CPU scheduler event ring
+	prof_init();		// Per-CPU profile sample ring
+	lat_init();		// Per-CPU trap latency histograms
+	pmc_init();		// Per-CPU performance counters
+	net_statinit();		// Per-CPU network statistics
 	proc_init();
+	init_phase("proc");
 
   if(!cpu_onboot())
     proc_sched();
@@ -143,12 +218,43 @@ init(void)
   proc_root->sv.tf.eip = elf->e_entry;
   proc_root->sv.tf.esp = VM_STACKHI;
   proc_root->sv.tf.eflags |= FL_IF;
+  // The root takes input from the outside world anyway,
+  // so it may as well wait for whichever child stops first
+  // (SYS_WAIT), as the shell's background jobs want.
+  proc_root->sv.pff |= PFF_NONDET;
+  init_phase("rootload");
   // Initialize file system
   file_initroot(proc_root);
+  init_phase("initroot");
+  init_phasereport();
   proc_ready(proc_root);
   proc_sched();
 }
 
+// Update function for the root process's "boottime" special file:
+// a line "phase <name> cycles <n>" for each boot phase in order,
+// then "total cycles <n>" from entering init() to readying the root.
+void
+init_bootfile(int ino)
+{
+	fileinode *fi = &files->fi[ino];
+	if (fi->size != 0)
+		return;
+
+	char *data = FILEDATA(ino);
+	size_t n = 0;
+	uint64_t last = init_starttsc;
+	int i;
+	for (i = 0; i < init_nphases; i++) {
+		n += snprintf(data + n, 64, "phase %s cycles %llu\n",
+			init_phases[i].name, init_phases[i].tsc - last);
+		last = init_phases[i].tsc;
+	}
+	n += snprintf(data + n, 64, "total cycles %llu\n",
+			last - init_starttsc);
+	fi->size = n;
+}
+
 // This is the first function that gets run in user mode (ring 3).
 // It acts as PIOS's "root process",
 // of which all other processes are descendants.
@@ -168,6 +274,7 @@ user()
 void gcc_noreturn
 done()
 {
+	cons_logsync();		// print any console output still logged
 	while (1)
 		;	// just spin
 }
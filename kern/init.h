@@ -23,6 +23,9 @@ void init(void);
 // First function run in user mode (only on one processor)
 void user(void);
 
+// Write boot phase timings to the root's "boottime" file (kern/file.c).
+void init_bootfile(int ino);
+
 // Called when there is no more work left to do in the system.
 // The grading scripts trap calls to this to know when to stop.
 void done(void) gcc_noreturn;
@@ -0,0 +1,181 @@
+/*
+ * Per-CPU trap and system call latency histograms.
+ *
+ * Every trap from user mode is timestamped on entry in trap()
+ * (or syscall_fast() for SYSENTER) and again in trap_return(),
+ * and the difference goes into the histogram for the trap's class:
+ * its vector, or for system calls its type and memory operation,
+ * so that e.g. GET|MERGE and PUT|COPY|SNAP are told apart.
+ * A trap whose handler blocks or switches to another process
+ * doesn't return on its own behalf, and is only counted as switched.
+ * With two RDTSCs and a few per-CPU adds per trap it is always on.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/file.h>
+#include <inc/syscall.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/lat.h>
+
+
+#define LAT_ORDER	1	// latstats takes 2^LAT_ORDER pages
+#define LAT_LINEMAX	160	// Longest line lat_statfile() produces
+
+static const char *const lat_sysnames[] = {
+	[SYS_CPUTS]	= "cputs",
+	[SYS_PUT]	= "put",
+	[SYS_GET]	= "get",
+	[SYS_RET]	= "ret",
+	[SYS_BATCH]	= "batch",
+	[SYS_WAIT]	= "wait",
+};
+
+static const char *const lat_memopnames[] = {
+	"", "|zero", "|copy", "|merge",
+};
+
+void
+lat_init(void)
+{
+	assert(sizeof(latstats) <= (PAGESIZE << LAT_ORDER));
+
+	pageinfo *pi = mem_allocn(LAT_ORDER);
+	if (pi == NULL) {
+		warn("lat_init: no memory for CPU %d latency statistics",
+			cpu_cur()->id);
+		return;
+	}
+	int i;
+	for (i = 0; i < (1 << LAT_ORDER); i++)
+		mem_incref(&pi[i]);
+	latstats *ls = mem_pi2ptr(pi);
+	memset(ls, 0, sizeof(*ls));
+	cpu_cur()->lat = ls;
+}
+
+// Called first thing in trap(): start timing a trap from user mode.
+// Kernel-mode traps, such as page faults on user memory in a system call,
+// are part of whatever trap the kernel is handling.
+void
+lat_trap(trapframe *tf)
+{
+	latstats *ls = cpu_cur()->lat;
+	if (ls == NULL || !(tf->cs & 3))
+		return;
+	ls->cls = MIN(tf->trapno, LAT_NTRAP - 1);
+	ls->start = rdtsc();
+}
+
+// Called from syscall() to refine a T_SYSCALL trap's class.
+void
+lat_syscall(uint32_t cmd)
+{
+	latstats *ls = cpu_cur()->lat;
+	if (ls == NULL || ls->start == 0)
+		return;
+	ls->cls = LAT_NTRAP + ((cmd & 7) | ((cmd & SYS_MEMOP) >> 13)
+				| (cmd & SYS_SNAP ? 0x20 : 0));
+}
+
+// Called from trap_return() on the way out to user mode.
+void
+lat_done(trapframe *tf)
+{
+	latstats *ls = cpu_cur()->lat;
+	if (ls == NULL || ls->start == 0 || !(tf->cs & 3))
+		return;
+	uint64_t t = rdtsc() - ls->start;
+	ls->start = 0;
+
+	latclass *lc = &ls->c[ls->cls];
+	lc->n++;
+	lc->cycles += t;
+	uint32_t t32 = t >> 32 ? ~0 : t;
+	if (t32 > lc->max)
+		lc->max = t32;
+	int b = t32 < 256 ? 0 : (bsr(t32) - 6) / 2;
+	lc->hist[MIN(b, LAT_NHIST - 1)]++;
+}
+
+// Called from the scheduler: the trap being timed, if any,
+// won't be returned from by this CPU any time soon.
+void
+lat_switch(void)
+{
+	latstats *ls = cpu_cur()->lat;
+	if (ls == NULL || ls->start == 0)
+		return;
+	ls->c[ls->cls].switched++;
+	ls->start = 0;
+}
+
+// Update function for the root process's "latstat" special file:
+// a line per class of trap that has occurred, summed over all CPUs,
+// named "trap <vector>" or "sys <type>[|<memop>][|snap]",
+// giving the count, the number that switched away, the total and
+// longest latency in TSC cycles, and the histogram (see latclass).
+// As with "memstat", the root process truncates the file to zero length
+// to request a fresh snapshot, and writing "reset" into it instead
+// zeroes all the counts first.
+void
+lat_statfile(int ino)
+{
+	fileinode *fi = &files->fi[ino];
+	char *data = FILEDATA(ino);
+	cpu *c;
+	if (fi->size >= 5 && strncmp(data, "reset", 5) == 0) {
+		for (c = &cpu_boot; c != NULL; c = c->next)
+			if (c->lat != NULL)	// racy, but only statistics
+				memset(c->lat->c, 0, sizeof(c->lat->c));
+		fi->size = 0;
+	}
+	if (fi->size != 0)
+		return;
+
+	size_t n = 0;
+	int i, j;
+	for (i = 0; i < LAT_NCLASS; i++) {
+		latclass sum;
+		memset(&sum, 0, sizeof(sum));
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			if (c->lat == NULL)
+				continue;
+			latclass *lc = &c->lat->c[i];
+			sum.n += lc->n;
+			sum.switched += lc->switched;
+			sum.cycles += lc->cycles;
+			sum.max = MAX(sum.max, lc->max);
+			for (j = 0; j < LAT_NHIST; j++)
+				sum.hist[j] += lc->hist[j];
+		}
+		if (sum.n == 0 && sum.switched == 0)
+			continue;
+
+		char name[32];
+		if (i < LAT_NTRAP)
+			snprintf(name, sizeof(name), "trap %d", i);
+		else {
+			int s = i - LAT_NTRAP;
+			const char *type = (s & 7) <= SYS_WAIT ?
+					lat_sysnames[s & 7] : "?";
+			snprintf(name, sizeof(name), "sys %s%s%s", type,
+				lat_memopnames[(s >> 3) & 3],
+				s & 0x20 ? "|snap" : "");
+		}
+		n += snprintf(data + n, LAT_LINEMAX,
+			"%s n %u switched %u cycles %llu max %u "
+			"hist %u %u %u %u %u %u %u %u\n", name,
+			sum.n, sum.switched, sum.cycles, sum.max,
+			sum.hist[0], sum.hist[1], sum.hist[2], sum.hist[3],
+			sum.hist[4], sum.hist[5], sum.hist[6], sum.hist[7]);
+	}
+	fi->size = n;
+}
@@ -0,0 +1,55 @@
+/*
+ * Per-CPU trap and system call latency histograms.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_LAT_H
+#define PIOS_KERN_LAT_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct trapframe;
+
+
+// Latency classes: one per trap vector below LAT_NTRAP
+// (anything above counts as the last), then one per system call type
+// and SYS_MEMOP/SYS_SNAP combination (see lat_syscall()).
+#define LAT_NTRAP	64
+#define LAT_NSYS	64
+#define LAT_NCLASS	(LAT_NTRAP + LAT_NSYS)
+
+#define LAT_NHIST	8	// Buckets of < 2^(8+2i) cycles, last = rest
+
+// Statistics for one class of trap on one CPU.
+typedef struct latclass {
+	uint32_t	n;		// Traps handled without switching away
+	uint32_t	switched;	// Traps that blocked or switched procs
+	uint32_t	max;		// Longest in TSC cycles (saturating)
+	uint32_t	pad;
+	uint64_t	cycles;		// Total TSC cycles of the n traps
+	uint32_t	hist[LAT_NHIST];
+} latclass;
+
+// Each CPU's statistics, written only by that CPU with interrupts off,
+// so updating them takes no atomic operations.
+typedef struct latstats {
+	uint64_t	start;		// TSC at entry of current trap, or 0
+	uint32_t	cls;		// Class of current trap
+	uint32_t	pad;
+	latclass	c[LAT_NCLASS];
+} latstats;
+
+
+void lat_init(void);		// Allocate this CPU's statistics
+void lat_trap(struct trapframe *tf);	// Trap entry from user mode
+void lat_syscall(uint32_t cmd);	// The trap is a system call 'cmd'
+void lat_done(struct trapframe *tf);	// Returning from a trap
+void lat_switch(void);		// Switching away from the trap's process
+void lat_statfile(int ino);	// Update the root's "latstat" file
+
+#endif /* !PIOS_KERN_LAT_H */
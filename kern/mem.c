@@ -12,14 +12,18 @@
 #include <inc/mmu.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/file.h>
 
 #include <kern/cpu.h>
 #include <kern/mem.h>
 #include <kern/spinlock.h>
 #include <kern/pmap.h>
+#include <kern/proc.h>
 #include <kern/net.h>
 
 #include <dev/nvram.h>
+#include <dev/e820.h>
 
 
 size_t mem_max;			// Maximum physical address
@@ -27,11 +31,52 @@ size_t mem_npage;		// Total number of physical memory pages
 
 pageinfo *mem_pageinfo;		// Metadata array indexed by page number
 
-pageinfo *mem_freelist;		// Start of free page list
-spinlock _freelist_lock;
-spinlock mem_freelock;
+// Free physical memory is managed by a binary buddy allocator:
+// mem_freeblocks[n] lists the free, naturally aligned blocks
+// of 2^n contiguous pages, doubly linked through their first pages.
+// Freeing a block merges it with its "buddy" - the other half of the
+// next larger aligned block - whenever that buddy is also free.
+pageinfo *mem_freeblocks[MEM_MAXORDER+1];
+size_t mem_nfreepages;		// Pages in mem_freeblocks, not magazines
+spinlock _freelist_lock;	// Protects the two above
+
+// Hash table of local copies of remote pages, keyed by home RR.
+// Each lock protects every MEM_RRSTRIPES'th chain, so concurrent
+// lookups of different RRs rarely contend.
+#define MEM_RRHASHBITS	12
+#define MEM_RRHASH(rr)	(((uint32_t)(rr) * 2654435761U) >> (32 - MEM_RRHASHBITS))
+#define MEM_RRSTRIPES	64
+#define MEM_RRSTRIPE(h)	((h) % MEM_RRSTRIPES)
+static pageinfo *mem_rrtab[1 << MEM_RRHASHBITS];
+static spinlock mem_rrlock[MEM_RRSTRIPES];
+
+// Overflow sharer sets for pages shared with many nodes (see mem.h).
+#define MEM_NSHAREOVF	256
+static uint32_t mem_shareovf[MEM_NSHAREOVF][256/32];
+static bool mem_shareovfused[MEM_NSHAREOVF];
+static spinlock mem_sharelock;		// Protects all nonempty sets
+static void mem_rruntrack(pageinfo *pi);
+static void mem_shareaddlocked(pageinfo *pi, uint8_t node);
+
+// Each CPU keeps a small "magazine" of free pages in its cpu struct,
+// so that most allocations and frees touch no shared state at all.
+// An empty magazine refills, and an overfull one drains,
+// MEM_MAGBATCH pages at a time against the buddy allocator.
+#define MEM_MAGSIZE	32	// Most pages a magazine holds
+#define MEM_MAGBATCH	16	// Pages moved per refill or drain
+#define MEM_RECLAIMFRAC	8	// Reclaim copies below 1/8 of memory free
+
+// Prefilled page pools, all registered on the mem_pools list.
+#define MEM_ZEROPOOL	256	// Zeroed pages we try to keep ready (1MB)
+mempool mem_zeropool;
+static mempool *mem_pools;
+static pageinfo *mem_poolget(mempool *mp);
 
 void mem_check(void);
+static pageinfo *mem_buddyalloc(int order);
+static void mem_buddyfree(pageinfo *pi, int order);
+static void mem_freerange(size_t lo, size_t hi);
+static void mem_freeusable(size_t lo, size_t hi);
 
 void
 mem_init(void)
@@ -40,19 +85,48 @@ mem_init(void)
 		return;
 
 	// Determine how much base (<640K) and extended (>1MB) memory
-	// is available in the system (in bytes),
-	// by reading the PC's BIOS-managed nonvolatile RAM (NVRAM).
+	// is available in the system (in bytes).
+	// Prefer the BIOS E820 memory map the boot loader collected,
+	// which describes all of RAM including any holes in it.
+	// Failing that, read the PC's BIOS-managed nonvolatile RAM (NVRAM).
 	// The NVRAM tells us how many kilobytes there are.
-	// Since the count is 16 bits, this gives us up to 64MB of RAM;
-	// additional RAM beyond that would have to be detected another way.
+	// Since the count is 16 bits, this gives us up to 64MB of RAM.
 	size_t basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
 	size_t extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
+	mem_max = MEM_EXT + extmem;
 
-	warn("Assuming we have 1GB of memory!");
-	extmem = 1024*1024*1024 - MEM_EXT;	// assume 1GB total memory
+	const e820map *map = (const e820map*)E820_MAP;
+	if (map->nent > E820_MAX)	// garbage: not left by the boot loader
+		warn("mem_init: bad E820 map (%d entries)", map->nent);
+	else if (map->nent > 0) {
+		basemem = 0;
+		mem_max = 0;
+		uint64_t ignored = 0;
+		int i;
+		for (i = 0; i < map->nent; i++) {
+			const e820entry *e = &map->ent[i];
+			if (e->type != E820_RAM)
+				continue;
+			uint64_t hi = e->base + e->len;
+			if (hi > VM_USERLO) {	// beyond our direct mapping
+				ignored += hi - MAX(e->base, VM_USERLO);
+				hi = VM_USERLO;
+			}
+			if (e->base >= hi)
+				continue;
+			if (e->base < MEM_IO)
+				basemem = MAX(basemem, ROUNDDOWN(
+					(size_t)MIN(hi, MEM_IO), PAGESIZE));
+			mem_max = MAX(mem_max, ROUNDDOWN((size_t)hi, PAGESIZE));
+		}
+		extmem = mem_max > MEM_EXT ? mem_max - MEM_EXT : 0;
+		if (ignored > 0)
+			warn("mem_init: ignoring %dMB of RAM above %dMB",
+				(int)(ignored >> 20), VM_USERLO >> 20);
+	}
 
-	// The maximum physical address is the top of extended memory.
-	mem_max = MEM_EXT + extmem;
+	// The maximum physical address is the top of usable RAM.
+	assert(mem_max > MEM_EXT);
 
 	// Compute the total number of physical pages (including I/O holes)
 	mem_npage = mem_max / PAGESIZE;
@@ -62,26 +136,36 @@ mem_init(void)
 		(int)(basemem/1024), (int)(extmem/1024));
 
   spinlock_init(&_freelist_lock);
-  pageinfo *mem_pageinfo = (pageinfo*)ROUNDUP((uint32_t)end, (uint32_t)sizeof(pageinfo));
-  memset(mem_pageinfo, 0, sizeof(pageinfo)*mem_npage);
-	pageinfo **freetail = &mem_freelist;
 	int i;
-	// Pages 0 and 1 are reserved.
-	for (i = 2; i < mem_npage; i++) {           
-    // All of base memory otherwise is free after the kernel
-    // and the pageinfo table all memory should be free
-    if(i < basemem/4096 ||          
-      i >= (uint32_t)(ROUNDUP(&mem_pageinfo[mem_npage],4096))/4096) {
-      // A free page has no references to it.
-      mem_pageinfo[i].refcount = 0;
-      // Add the page to the end of the free list.
-      *freetail = &mem_pageinfo[i];
-      freetail = &mem_pageinfo[i].free_next;
-    }
+	for (i = 0; i < MEM_RRSTRIPES; i++)
+		spinlock_init(&mem_rrlock[i]);
+	spinlock_init(&mem_sharelock);
+  mem_pageinfo = (pageinfo*)ROUNDUP((uint32_t)end, (uint32_t)sizeof(pageinfo));
+  memset(mem_pageinfo, 0, sizeof(pageinfo)*mem_npage);
+
+	// Hand the usable RAM to the buddy allocator a range at a time,
+	// mostly as large aligned blocks, so this takes time proportional
+	// to the number of ranges and blocks rather than the number of pages.
+	if (map->nent > 0 && map->nent <= E820_MAX) {
+		for (i = 0; i < map->nent; i++) {
+			const e820entry *e = &map->ent[i];
+			if (e->type != E820_RAM || e->base >= mem_max)
+				continue;
+			uint64_t hi = MIN(e->base + e->len, mem_max);
+			mem_freeusable(ROUNDUP((size_t)e->base, PAGESIZE)
+					/ PAGESIZE, (size_t)hi / PAGESIZE);
+		}
+	} else {
+		mem_freeusable(0, basemem / PAGESIZE);
+		mem_freeusable(MEM_EXT / PAGESIZE, mem_npage);
 	}
-	*freetail = NULL;	// null-terminate the freelist
+
 	// Check to make sure the page allocator seems to work correctly.
+#ifndef BOOT_NOCHECK
 	mem_check();
+#endif
+
+	mem_poolinit(&mem_zeropool, MEM_ZEROPOOL, 0);
 }
 
 //
@@ -98,15 +182,43 @@ mem_init(void)
 pageinfo *
 mem_alloc(void)
 {
-  if(!spinlock_holding(&_freelist_lock));
-    spinlock_acquire(&_freelist_lock);
-	pageinfo *p = mem_freelist;
-	if(p != NULL)
-		mem_freelist = p->free_next;	// Remove page from free list
+	cpu *c = cpu_cur();
+	if (c->nmag == 0) {
+		// Refill this CPU's magazine from the buddy allocator.
+		spinlock_acquire(&_freelist_lock);
+		pageinfo *pi;
+		while (c->nmag < MEM_MAGBATCH &&
+				(pi = mem_buddyalloc(0)) != NULL) {
+			pi->free_next = c->magazine;
+			c->magazine = pi;
+			c->nmag++;
+		}
+		spinlock_release(&_freelist_lock);
+
+		// Drop the references held by page tables and superpages
+		// that pmap_removelazy() left for idle CPUs to free:
+		// the pages freed go into our magazine.
+		while (c->nmag == 0 && pmap_reclaimhelp())
+			;
+		if (c->nmag == 0) {
+			// Last resort: reclaim a prefilled page.
+			mempool *mp;
+			for (mp = mem_pools; mp != NULL; mp = mp->next)
+				if ((pi = mem_poolget(mp)) != NULL)
+					return pi;
+			return NULL;
+		}
+	}
+
+	pageinfo *p = c->magazine;
+	c->magazine = p->free_next;
+	c->nmag--;
+	c->memstat[MEMSTAT_ALLOC]++;
 	p->home = 0;
 	p->shared = 0;
-  spinlock_release(&_freelist_lock);
-  return p;
+	p->version = 0;
+	p->origin = 0;
+	return p;
 }
 
 //
@@ -116,50 +228,499 @@ mem_alloc(void)
 void
 mem_free(pageinfo *pi)
 {
-  spinlock_acquire(&_freelist_lock);
-  pi->free_next = mem_freelist;
-  mem_freelist = pi;
-  spinlock_release(&_freelist_lock);
+	if (pi->home != 0)
+		mem_rruntrack(pi);
+
+	cpu *c = cpu_cur();
+	c->memstat[MEMSTAT_FREE]++;
+	pi->free_next = c->magazine;
+	c->magazine = pi;
+	if (++c->nmag <= MEM_MAGSIZE)
+		return;
+
+	// Drain the oldest part of the magazine back to the buddy allocator,
+	// keeping the most recently freed (cache-warm) pages here.
+	pageinfo **pp = &c->magazine;
+	int i;
+	for (i = 0; i < MEM_MAGSIZE - MEM_MAGBATCH; i++)
+		pp = &(*pp)->free_next;
+	pageinfo *drain = *pp;
+	*pp = NULL;
+	c->nmag = MEM_MAGSIZE - MEM_MAGBATCH;
+
+	spinlock_acquire(&_freelist_lock);
+	while (drain != NULL) {
+		pageinfo *next = drain->free_next;
+		mem_buddyfree(drain, 0);
+		drain = next;
+	}
+	spinlock_release(&_freelist_lock);
+}
+
+// Add a free block to, or remove it from, its buddy free list.
+static void
+mem_blockinsert(pageinfo *pi, int order)
+{
+	pi->freehead = 1;
+	pi->order = order;
+	pi->free_pprev = &mem_freeblocks[order];
+	pi->free_next = mem_freeblocks[order];
+	if (pi->free_next != NULL)
+		pi->free_next->free_pprev = &pi->free_next;
+	mem_freeblocks[order] = pi;
+	mem_nfreepages += 1 << order;
+}
+
+static void
+mem_blockremove(pageinfo *pi)
+{
+	assert(pi->freehead);
+	*pi->free_pprev = pi->free_next;
+	if (pi->free_next != NULL)
+		pi->free_next->free_pprev = pi->free_pprev;
+	pi->freehead = 0;
+	mem_nfreepages -= 1 << pi->order;
+}
+
+// Allocate a block of 2^order pages with _freelist_lock held,
+// splitting the smallest sufficient free block as needed.
+static pageinfo *
+mem_buddyalloc(int order)
+{
+	int o = order;
+	while (o <= MEM_MAXORDER && mem_freeblocks[o] == NULL)
+		o++;
+	if (o > MEM_MAXORDER)
+		return NULL;
+
+	pageinfo *pi = mem_freeblocks[o];
+	mem_blockremove(pi);
+	while (o > order) {		// return the unused upper halves
+		o--;
+		mem_blockinsert(pi + (1 << o), o);
+	}
+	return pi;
+}
+
+// Free a block of 2^order pages with _freelist_lock held,
+// coalescing it with free buddies into the largest block possible.
+static void
+mem_buddyfree(pageinfo *pi, int order)
+{
+	size_t idx = pi - mem_pageinfo;
+	assert((idx & ((1 << order) - 1)) == 0);
+	while (order < MEM_MAXORDER) {
+		size_t bidx = idx ^ (1 << order);
+		if (bidx + (1 << order) > mem_npage)
+			break;
+		pageinfo *buddy = &mem_pageinfo[bidx];
+		if (!buddy->freehead || buddy->order != order)
+			break;
+		mem_blockremove(buddy);
+		idx &= ~(1 << order);
+		order++;
+	}
+	mem_blockinsert(&mem_pageinfo[idx], order);
+}
+
+// Give the page range [lo,hi) to the buddy allocator at boot,
+// as the largest naturally aligned blocks that fit.
+static void
+mem_freerange(size_t lo, size_t hi)
+{
+	while (lo < hi) {
+		int order = MEM_MAXORDER;
+		while (order > 0 && ((lo & ((1 << order) - 1)) != 0 ||
+				lo + (1 << order) > hi))
+			order--;
+		mem_blockinsert(&mem_pageinfo[lo], order);
+		lo += 1 << order;
+	}
+}
+
+// Free the usable RAM pages in [lo,hi), minus those in use at boot:
+// pages 0 and 1 (BIOS data, E820 map, and bootother code),
+// and the kernel image plus pageinfo table starting at MEM_EXT.
+static void
+mem_freeusable(size_t lo, size_t hi)
+{
+	size_t kernlo = MEM_EXT / PAGESIZE;
+	size_t kernhi = ROUNDUP(mem_phys(&mem_pageinfo[mem_npage]), PAGESIZE)
+			/ PAGESIZE;
+
+	lo = MAX(lo, 2);
+	if (lo < kernlo)
+		mem_freerange(lo, MIN(hi, kernlo));
+	mem_freerange(MAX(lo, kernhi), hi);
+}
+
+pageinfo *
+mem_allocn(int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	if (order == 0)
+		return mem_alloc();
+
+	spinlock_acquire(&_freelist_lock);
+	pageinfo *pi = mem_buddyalloc(order);
+	spinlock_release(&_freelist_lock);
+	if (pi == NULL)
+		return NULL;
+
+	int i;
+	for (i = 0; i < (1 << order); i++) {
+		pi[i].home = 0;
+		pi[i].shared = 0;
+		pi[i].version = 0;
+		pi[i].origin = 0;
+	}
+	mem_stat(MEMSTAT_ALLOC, 1 << order);
+	return pi;
+}
+
+void
+mem_freen(pageinfo *pi, int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	if (order == 0)
+		return mem_free(pi);
+
+	mem_stat(MEMSTAT_FREE, 1 << order);
+	spinlock_acquire(&_freelist_lock);
+	mem_buddyfree(pi, order);
+	spinlock_release(&_freelist_lock);
+}
+
+size_t
+mem_nfree(void)
+{
+	size_t n = mem_nfreepages;
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		n += c->nmag;
+	mempool *mp;
+	for (mp = mem_pools; mp != NULL; mp = mp->next)
+		n += mp->npages;
+	return n;
+}
+
+// Fill a page with copies of a 32-bit word.
+static void
+mem_fill(void *pg, uint32_t fill)
+{
+	asm volatile("cld; rep stosl"
+		: "+D" (pg) : "a" (fill), "c" (PAGESIZE/4)
+		: "cc", "memory");
+}
+
+void
+mem_poolinit(mempool *mp, int target, uint32_t fill)
+{
+	spinlock_init(&mp->lock);
+	mp->pages = NULL;
+	mp->npages = 0;
+	mp->target = target;
+	mp->fill = fill;
+	mp->next = mem_pools;
+	mem_pools = mp;
+}
+
+// Take a prefilled page from a pool, or return NULL if it's empty.
+static pageinfo *
+mem_poolget(mempool *mp)
+{
+	if (mp->npages == 0)		// cheap unlocked check first
+		return NULL;
+	spinlock_acquire(&mp->lock);
+	pageinfo *pi = mp->pages;
+	if (pi != NULL) {
+		mp->pages = pi->free_next;
+		mp->npages--;
+	}
+	spinlock_release(&mp->lock);
+	return pi;
+}
+
+pageinfo *
+mem_poolalloc(mempool *mp)
+{
+	pageinfo *pi = mem_poolget(mp);
+	if (pi == NULL && (pi = mem_alloc()) != NULL)
+		mem_fill(mem_pi2ptr(pi), mp->fill);
+	return pi;
+}
+
+// Add node to the set of nodes page pi is shared with.
+void
+mem_shareadd(pageinfo *pi, uint8_t node)
+{
+	spinlock_acquire(&mem_sharelock);
+	mem_shareaddlocked(pi, node);
+	spinlock_release(&mem_sharelock);
+}
+
+// Add node to page pi's sharers unless pi is free or being freed:
+// neither referenced nor already shared.  Returns false if so.
+bool
+mem_shareaddlive(pageinfo *pi, uint8_t node)
+{
+	spinlock_acquire(&mem_sharelock);
+	bool live = pi->refcount != 0 || pi->shared != 0;
+	if (live)
+		mem_shareaddlocked(pi, node);
+	spinlock_release(&mem_sharelock);
+	return live;
+}
+
+static void
+mem_shareaddlocked(pageinfo *pi, uint8_t node)
+{
+	assert(node != 0);
+	assert(spinlock_holding(&mem_sharelock));
+	uint32_t s = pi->shared;
+	int i;
+	if (s == MEM_SHAREALL)
+		goto done;
+	if (s & MEM_SHAREOVF) {
+		mem_shareovf[s & ~MEM_SHAREOVF][node / 32] |= 1u << (node % 32);
+		goto done;
+	}
+	for (i = 0; i < MEM_SHAREINLINE; i++) {
+		uint8_t n = s >> (8 * i);
+		if (n == node)
+			goto done;
+		if (n == 0) {
+			pi->shared = s | (uint32_t)node << (8 * i);
+			goto done;
+		}
+	}
+
+	// No room inline: move the set out to an overflow bitmap.
+	for (i = 0; i < MEM_NSHAREOVF && mem_shareovfused[i]; i++)
+		;
+	if (i == MEM_NSHAREOVF) {
+		pi->shared = MEM_SHAREALL;
+		goto done;
+	}
+	mem_shareovfused[i] = 1;
+	uint32_t *bits = mem_shareovf[i];
+	memset(bits, 0, sizeof(mem_shareovf[i]));
+	for (; s != 0; s >>= 8)
+		bits[(uint8_t)s / 32] |= 1u << ((uint8_t)s % 32);
+	bits[node / 32] |= 1u << (node % 32);
+	pi->shared = MEM_SHAREOVF | i;
+done:
+	return;
+}
+
+// Remove node from page pi's sharer set, returning true if
+// that removed the last one and pi has no references either:
+// the caller must then free it.  pi->shared is then 0.
+// Deciding that under mem_sharelock, like mem_unref() does,
+// ensures exactly one of us frees a page losing both at once.
+bool
+mem_sharedel(pageinfo *pi, uint8_t node)
+{
+	bool empty = 0;
+	spinlock_acquire(&mem_sharelock);
+	uint32_t s = pi->shared;
+	int i;
+	if (s == MEM_SHAREALL || s == 0)
+		goto done;
+	if (s & MEM_SHAREOVF) {
+		int o = s & ~MEM_SHAREOVF;
+		uint32_t *bits = mem_shareovf[o];
+		if (!(bits[node / 32] & (1u << (node % 32))))
+			goto done;
+		bits[node / 32] &= ~(1u << (node % 32));
+		for (i = 0; i < 256/32 && bits[i] == 0; i++)
+			;
+		if (i == 256/32) {
+			mem_shareovfused[o] = 0;
+			pi->shared = 0;
+			empty = 1;
+		}
+		goto done;
+	}
+	for (i = 0; i < MEM_SHAREINLINE; i++)
+		if ((uint8_t)(s >> (8 * i)) == node) {
+			// Shift the later slots down over this one.
+			uint32_t low = s & ((1 << (8 * i)) - 1);
+			pi->shared = low | ((s >> (8 * (i + 1))) << (8 * i));
+			empty = pi->shared == 0;
+			break;
+		}
+done:
+	empty = empty && pi->refcount == 0;
+	spinlock_release(&mem_sharelock);
+	return empty;
+}
+
+// Drop what looks like the last reference to page pi, for mem_decref(),
+// returning true if the caller must now free it: no one took another
+// reference meanwhile, and no remote sharer pins it.
+bool
+mem_unref(pageinfo *pi)
+{
+	spinlock_acquire(&mem_sharelock);
+	int32_t old = xadd((volatile uint32_t*)&pi->refcount, -1);
+	assert(old > 0);
+	bool last = old == 1 && pi->shared == 0;
+	if (old == 2)
+		mem_stat(MEMSTAT_SHARED, -1);
+	else if (old == 1 && !last)	// remote refs pin it in memory
+		mem_stat(MEMSTAT_PINNED, 1);
+	spinlock_release(&mem_sharelock);
+	return last;
+}
+
+// Free up to max unreferenced copies of remote pages
+// that only NET_SELFSHARE pins as a cache,
+// so that their home nodes can free the originals too.
+// Scans a bit more of the remote reference table each time.
+static int
+mem_rrreclaim(int max)
+{
+	static uint32_t next;	// Next chain to look at; races are harmless
+	pageinfo *freed = NULL, *pi, **pp;
+	int n = 0, i;
+	for (i = 0; i < 64 && n < max; i++) {
+		uint32_t h = next++ % (1 << MEM_RRHASHBITS);
+		spinlock_acquire(&mem_rrlock[MEM_RRSTRIPE(h)]);
+		pp = &mem_rrtab[h];
+		while ((pi = *pp) != NULL && n < max) {
+			// mem_rrlookup() takes references under this lock,
+			// and nothing else can find an unreferenced copy.
+			if (pi->refcount != 0 || pi->shared != NET_SELFSHARE) {
+				pp = &pi->homenext;
+				continue;
+			}
+			*pp = pi->homenext;
+			mem_stat(MEMSTAT_RRCOPY, -1);
+			pi->free_next = freed;
+			freed = pi;
+			n++;
+		}
+		spinlock_release(&mem_rrlock[MEM_RRSTRIPE(h)]);
+	}
+	while ((pi = freed) != NULL) {
+		freed = pi->free_next;
+		net_rrrelease(pi->home);
+		pi->home = 0;
+		bool unpinned = mem_sharedel(pi, net_node);
+		assert(unpinned);	// no one else could find it
+		mem_stat(MEMSTAT_PINNED, -1);
+		mem_free(pi);
+	}
+	return n;
+}
+
+bool
+mem_idle(void)
+{
+	// Running low: give cached copies of remote pages back.
+	if (mem_nfreepages < mem_npage / MEM_RECLAIMFRAC
+	    && mem_rrreclaim(MEM_MAGBATCH) > 0)
+		return 1;
+
+	mempool *mp;
+	for (mp = mem_pools; mp != NULL; mp = mp->next) {
+		if (mp->npages >= mp->target)
+			continue;
+
+		// Don't eat into the last of free memory just to prefill it.
+		if (mem_nfreepages < MEM_MAGBATCH * 4)
+			return 0;
+		pageinfo *pi = mem_alloc();
+		if (pi == NULL)
+			return 0;
+		mem_fill(mem_pi2ptr(pi), mp->fill);
+
+		spinlock_acquire(&mp->lock);
+		pi->free_next = mp->pages;
+		mp->pages = pi;
+		mp->npages++;
+		spinlock_release(&mp->lock);
+		return 1;
+	}
+	return 0;
 }
 
 // When we receive a copy of a page or kernel object from a remote node,
 // we call this function to keep track of the page's origin,
 // so that we can later find it again given the same remote reference.
+// Tracked pages live in a hash table keyed by their full home RR,
+// chained through their pageinfo's homenext; this works no matter
+// how much memory the page's home node has.
 void mem_rrtrack(uint32_t rr, pageinfo *pi)
+{
+	bool tracked = mem_rrtracknew(rr, pi);
+	assert(tracked);	// shouldn't already be there!
+}
+
+// Track pi as our copy of rr unless we already have one,
+// returning false in that case.
+bool mem_rrtracknew(uint32_t rr, pageinfo *pi)
 {
 	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 	assert(pi != mem_ptr2pi(pmap_zero));	// Don't track zero page!
-	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
-
-	// Change these to use whatever your memory spinlock is called.
-	spinlock_acquire(&mem_freelock);
+	assert(!mem_iskernel(pi));
 
 	uint8_t node = RRNODE(rr);
-	assert(node > 0 && node <= NET_MAXNODES);
-
-	// Look up our pageinfo struct containing our homelist
-	// for the appropriate remote physical address.
-	// This design assumes that our pageinfo array will be big enough,
-	// which implies that all nodes must have the same amount of RAM.
-	// This could easily be fixed by allocating a separate hash table
-	// mapping remote references to local pages.
-	uint32_t addr = RRADDR(rr);
-	pageinfo *hpi = mem_phys2pi(addr);
-	assert(hpi > &mem_pageinfo[1] && hpi < &mem_pageinfo[mem_npage]);
-
-	// Quick scan just to make sure it's not already there - shouldn't be!
+	assert(node > 0);
+
+	uint32_t h = MEM_RRHASH(rr);
+	spinlock_acquire(&mem_rrlock[MEM_RRSTRIPE(h)]);
+
+	// Quick scan to make sure it's not already there
 	pageinfo *spi;
-	for (spi = hpi->homelist; spi != NULL; spi = spi->homenext) {
-		assert(RRADDR(spi->home) == addr);
-		assert(spi->home != rr);
-	}
+	for (spi = mem_rrtab[h]; spi != NULL; spi = spi->homenext)
+		if (spi->home == rr) {
+			spinlock_release(&mem_rrlock[MEM_RRSTRIPE(h)]);
+			return 0;
+		}
 
-	// Insert the new page at the head of the appropriate homelist
+	// Insert the new page at the head of its hash chain
 	pi->home = rr;
-	pi->homenext = hpi->homelist;
-	hpi->homelist = pi;
+	pi->homenext = mem_rrtab[h];
+	mem_rrtab[h] = pi;
+	mem_stat(MEMSTAT_RRCOPY, 1);
+
+	spinlock_release(&mem_rrlock[MEM_RRSTRIPE(h)]);
+	return 1;
+}
 
-	spinlock_release(&mem_freelock);
+// Remove a tracked page from the remote reference table
+// when the page is freed, so the table never holds free pages,
+// and let its home node know unless we've passed its RR on.
+static void
+mem_rruntrack(pageinfo *pi)
+{
+	if (pi->shared == 0 || pi->shared == NET_SELFSHARE)
+		net_rrrelease(pi->home);
+
+	uint32_t h = MEM_RRHASH(pi->home);
+	spinlock_acquire(&mem_rrlock[MEM_RRSTRIPE(h)]);
+	pageinfo **pp;
+	for (pp = &mem_rrtab[h]; *pp != NULL; pp = &(*pp)->homenext)
+		if (*pp == pi) {
+			*pp = pi->homenext;
+			mem_stat(MEMSTAT_RRCOPY, -1);
+			break;
+		}
+	pi->home = 0;
+	spinlock_release(&mem_rrlock[MEM_RRSTRIPE(h)]);
+}
+
+// Stop treating pi as a copy of its remote page,
+// e.g. because it no longer matches it; it becomes just a local page.
+void
+mem_rrforget(pageinfo *pi)
+{
+	if (pi->home == 0)
+		return;
+	mem_rruntrack(pi);
+	mem_sharedel(pi, net_node);	// no longer pinned as a cached copy
 }
 
 // Given a remote reference to a page on some other node,
@@ -169,30 +730,150 @@ void mem_rrtrack(uint32_t rr, pageinfo *pi)
 pageinfo *
 mem_rrlookup(uint32_t rr)
 {
-	// Change these to use whatever your memory spinlock is called.
-	spinlock_acquire(&mem_freelock);
-
 	uint8_t node = RRNODE(rr);
-	assert(node > 0 && node <= NET_MAXNODES);
-	uint32_t addr = RRADDR(rr);
-	pageinfo *pi = mem_phys2pi(addr);
-	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
+	assert(node > 0);
 
-	// Search for a page corresponding to this rr in the homelist
-	for (pi = pi->homelist; pi != NULL; pi = pi->homenext) {
-		assert(RRADDR(pi->home) == addr);
+	uint32_t h = MEM_RRHASH(rr);
+	spinlock_acquire(&mem_rrlock[MEM_RRSTRIPE(h)]);
+
+	pageinfo *pi;
+	for (pi = mem_rrtab[h]; pi != NULL; pi = pi->homenext)
 		if (pi->home == rr) {		// found it!
+			// Unreferenced and unpinned, it's on its way to
+			// mem_free() and just not untracked yet: ignore it.
+			if (pi->refcount == 0 && pi->shared == 0) {
+				pi = NULL;
+				break;
+			}
 			// Take a reference while we still have
-			// the pageinfo array locked, so it can't go away.
+			// the hash chain locked, so it can't go away.
 			mem_incref(pi);
 			break;
 		}
-	}
 
-	spinlock_release(&mem_freelock);
+	spinlock_release(&mem_rrlock[MEM_RRSTRIPE(h)]);
 	return pi;
 }
 
+// Allocate every free page, for self-tests that need to see
+// an empty allocator; returns them chained through free_next.
+pageinfo *
+mem_stealall(void)
+{
+	pageinfo *fl = NULL, *pi;
+	while ((pi = mem_alloc()) != NULL) {
+		pi->free_next = fl;
+		fl = pi;
+	}
+	return fl;
+}
+
+// Free a chain of pages taken by mem_stealall().
+void
+mem_giveback(pageinfo *fl)
+{
+	while (fl != NULL) {
+		pageinfo *pi = fl;
+		fl = pi->free_next;
+		mem_free(pi);
+	}
+}
+
+void
+mem_stat(enum memstat stat, int32_t delta)
+{
+	cpu_cur()->memstat[stat] += delta;
+}
+
+int32_t
+mem_statsum(enum memstat stat)
+{
+	int32_t n = 0;
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		n += c->memstat[stat];
+	return n;
+}
+
+#define MEM_STATLINEMAX	128	// Longest line mem_statfile() produces
+
+// Find the next process after p in a preorder walk of the process tree,
+// without recursion, which could overflow our small kernel stack.
+static proc *
+mem_statnext(proc *p)
+{
+	int i = 0;
+	while (p != NULL) {
+		for (; i < PROC_CHILDREN; i++)
+			if (p->child[i] != NULL)
+				return p->child[i];
+		if (p == proc_root)
+			break;
+		proc *pp = p->parent;
+		for (i = 0; pp->child[i] != p; i++)
+			;
+		i++;			// continue with p's next sibling
+		p = pp;
+	}
+	return NULL;
+}
+
+// Update function for the root process's "memstat" special file:
+// one line of global page accounting, one of event counts,
+// then a line per process in the process tree giving its home RR,
+// state, and mapped pages as counted by pmap_usage().
+// Walking every process's page tables is too costly for every file_io(),
+// so we only write a fresh snapshot when the root process has truncated
+// the file to zero length; the root process does that to request one.
+void
+mem_statfile(int ino)
+{
+	fileinode *fi = &files->fi[ino];
+	if (fi->size != 0)
+		return;
+
+	char *data = FILEDATA(ino);
+	size_t n = 0;
+	int npool = 0;
+	mempool *mp;
+	for (mp = mem_pools; mp != NULL; mp = mp->next)
+		npool += mp->npages;
+	n += snprintf(data + n, MEM_STATLINEMAX,
+		"pages %d free %d pooled %d inuse %d ptabs %d shared %d "
+		"pinned %d rrcopies %d\n", (int)mem_npage, (int)mem_nfree(),
+		npool, mem_statsum(MEMSTAT_ALLOC) -
+			mem_statsum(MEMSTAT_FREE) - npool,
+		mem_statsum(MEMSTAT_PTAB), mem_statsum(MEMSTAT_SHARED),
+		mem_statsum(MEMSTAT_PINNED), mem_statsum(MEMSTAT_RRCOPY));
+	n += snprintf(data + n, MEM_STATLINEMAX,
+		"allocs %u frees %u pulled %u pushed %u validated %u "
+		"faults %u faultahead %u\n",
+		mem_statsum(MEMSTAT_ALLOC), mem_statsum(MEMSTAT_FREE),
+		mem_statsum(MEMSTAT_PULLED), mem_statsum(MEMSTAT_PUSHED),
+		mem_statsum(MEMSTAT_VALIDATED), mem_statsum(MEMSTAT_FAULTS),
+		mem_statsum(MEMSTAT_FAULTAHEAD));
+	n += snprintf(data + n, MEM_STATLINEMAX,
+		"dedupzero %u dedupshared %u\n",
+		mem_statsum(MEMSTAT_DEDUPZERO),
+		mem_statsum(MEMSTAT_DEDUPSHARED));
+
+	proc *p;
+	for (p = proc_root; p != NULL && n + MEM_STATLINEMAX <= FILE_SLOTSIZE;
+			p = mem_statnext(p)) {
+		pmapusage u;
+		if (p->pdir != NULL && p->state != PROC_AWAY)
+			pmap_usage(p->pdir, &u);
+		else
+			memset(&u, 0, sizeof(u));
+		n += snprintf(data + n, MEM_STATLINEMAX,
+			"proc %x state %d resident %d shared %d zero %d "
+			"remote %d ptabs %d supers %d\n", p->home, p->state,
+			u.resident, u.shared, u.zero, u.remote, u.ptabs,
+			u.supers);
+	}
+	fi->size = n;
+}
+
 //
 // Check the physical page allocator (mem_alloc(), mem_free())
 // for correct operation after initialization via mem_init().
@@ -208,10 +889,14 @@ mem_check()
   // the free list, try to make sure it
   // eventually causes trouble.
 	int freepages = 0;
-	for (pp = mem_freelist; pp != 0; pp = pp->free_next) {
-		memset(mem_pi2ptr(pp), 0x97, 128);
-		freepages++;
-	}
+	for (i = 0; i <= MEM_MAXORDER; i++)
+		for (pp = mem_freeblocks[i]; pp != 0; pp = pp->free_next) {
+			int j;
+			for (j = 0; j < (1 << i); j++)
+				memset(mem_pi2ptr(pp + j), 0x97, 128);
+			freepages += 1 << i;
+		}
+	assert(freepages == mem_nfree());
 	cprintf("mem_check: %d free pages\n", freepages);
 	assert(freepages < mem_npage);	// can't have more free than total!
 	assert(freepages > 16000);	// make sure it's in the right ballpark
@@ -230,8 +915,7 @@ mem_check()
   assert(mem_pi2phys(pp2) < mem_npage*PAGESIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = 0;
+	fl = mem_stealall();
 
 	// should be no free memory
 	assert(mem_alloc() == 0);
@@ -249,13 +933,43 @@ mem_check()
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 	assert(mem_alloc() == 0);
 
+	assert(mem_nfree() == 0);
+
 	// give free list back
-	mem_freelist = fl;
+	mem_giveback(fl);
 
 	// free the pages we took
 	mem_free(pp0);
 	mem_free(pp1);
 	mem_free(pp2);
+	assert(mem_nfree() == freepages);
+
+	// overfill the magazine, forcing a drain to the buddy allocator
+	cpu *c = cpu_cur();
+	pageinfo *pages[MEM_MAGSIZE+1];
+	for (i = 0; i < MEM_MAGSIZE+1; i++)
+		assert((pages[i] = mem_alloc()) != NULL);
+	for (i = 0; i < MEM_MAGSIZE+1; i++)
+		mem_free(pages[i]);
+	assert(c->nmag <= MEM_MAGSIZE);
+	assert(mem_nfree() == freepages);
+
+	// multi-page blocks are naturally aligned, and coalesce when freed
+	int nmax = 0;
+	for (pp = mem_freeblocks[MEM_MAXORDER]; pp != NULL; pp = pp->free_next)
+		nmax++;
+	pp0 = mem_allocn(3);
+	assert(pp0 && ((pp0 - mem_pageinfo) & 7) == 0);
+	pp1 = mem_allocn(MEM_MAXORDER);
+	assert(pp1 && (mem_pi2phys(pp1) & ((PAGESIZE << MEM_MAXORDER) - 1)) == 0);
+	assert(pp0 + 8 <= pp1 || pp1 + (1 << MEM_MAXORDER) <= pp0);
+	assert(mem_nfree() == freepages - 8 - (1 << MEM_MAXORDER));
+	mem_freen(pp0, 3);
+	mem_freen(pp1, MEM_MAXORDER);
+	assert(mem_nfree() == freepages);
+	for (pp = mem_freeblocks[MEM_MAXORDER]; pp != NULL; pp = pp->free_next)
+		nmax--;
+	assert(nmax == 0);
 
 	cprintf("mem_check() succeeded!\n");
 }
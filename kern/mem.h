@@ -19,6 +19,8 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 
+#include <kern/spinlock.h>
+
 
 // At physical address MEM_IO (640K) there is a 384K hole for I/O.
 // The hole ends at physical address MEM_EXT, where extended memory begins.
@@ -45,11 +47,16 @@
 // but that might make debugging a bit more challenging.
 typedef struct pageinfo {
 	struct pageinfo	*free_next;	// Next page number on free list
+	struct pageinfo	**free_pprev;	// Points to our link on buddy list
+	uint8_t	freehead;		// Heads a free buddy block of ...
+	uint8_t	order;			// ... 2^order pages
 	int32_t	refcount;		// Reference count on allocated pages
 	uint32_t home;			// Remote reference to page's home
-	uint32_t shared;		// Other nodes I've given RRs to
-	struct pageinfo *homelist;	// My pages with homes at this physaddr
-	struct pageinfo *homenext;	// Next pointer on homelist
+	uint32_t shared;		// Other nodes I've given RRs to: see below
+	struct pageinfo *homenext;	// Next page on remote ref hash chain
+	struct pageinfo *ptabsrc;	// Page table this one borrows refs from
+	uint32_t version;		// Copy's contents hash at home, 0=none
+	uint32_t origin;		// RR of remote page this began as a copy of
 } pageinfo;
 
 
@@ -71,6 +78,17 @@ extern pageinfo *mem_pageinfo;	// Metadata array indexed by page number
 // Use these to avoid treating kernel code/data pages as free memory!
 extern char start[], end[];
 
+// Except that the initial files' pages within the kernel image,
+// between these symbols from kern/initfiles.S, get mapped into the root
+// process and reference-counted like any other page (see file_initroot()).
+extern char initfiles_start[], initfiles_end[];
+
+// Is this one of the kernel image's pages that must never be refcounted?
+#define mem_iskernel(pi) \
+	((pi) >= mem_ptr2pi(start) && (pi) <= mem_ptr2pi(end-1) && \
+	 ((pi) < mem_ptr2pi(initfiles_start) || \
+	  (pi) >= mem_ptr2pi(initfiles_end)))
+
 
 // Detect available physical memory and initialize the mem_pageinfo array.
 void mem_init(void);
@@ -82,11 +100,97 @@ pageinfo *mem_alloc(void);
 // Return a physical page to the free list.
 void mem_free(pageinfo *pi);
 
+// Allocate a naturally aligned block of 2^order contiguous pages
+// (up to a 4MB superpage), returning the pageinfo of its first page;
+// and free such a block.  Reference counting is up to the caller:
+// mem_decref() frees only single pages.
+#define MEM_MAXORDER	10
+pageinfo *mem_allocn(int order);
+void mem_freen(pageinfo *pi, int order);
+
+// Number of free pages, including those cached by each CPU.
+size_t mem_nfree(void);
+
+// A pool of free pages already filled with a 32-bit pattern,
+// kept topped up by idle CPUs so that fault paths needing a cleared page
+// can skip clearing it.  If memory runs short, mem_alloc() takes
+// pages back out of the pools before failing.
+typedef struct mempool {
+	spinlock	lock;		// Protects the pool
+	struct pageinfo	*pages;		// Prefilled pages, via free_next
+	int		npages;		// Pages in the pool
+	int		target;		// How many idle CPUs try to keep
+	uint32_t	fill;		// Every word of a pooled page
+	struct mempool	*next;		// Next pool idle CPUs attend to
+} mempool;
+
+extern mempool mem_zeropool;		// Pages of all zeros
+
+// Set up and register a pool that idle CPUs keep 'target' pages in.
+void mem_poolinit(mempool *mp, int target, uint32_t fill);
+
+// Allocate a page filled with the pool's pattern, from the pool if
+// possible, otherwise filling a fresh page; NULL if out of memory.
+pageinfo *mem_poolalloc(mempool *mp);
+
+// Called by the scheduler on an idle CPU: fill one page for some pool
+// that is below its target.  Returns true if there was work to do.
+bool mem_idle(void);
+
+// Self-test support: allocate all free pages, then free them again.
+pageinfo *mem_stealall(void);
+void mem_giveback(pageinfo *fl);
+
 extern uint8_t pmap_zero[PAGESIZE];	// for the asserts below
 
+// The set of nodes in pageinfo.shared, 0 if empty.  Up to
+// MEM_SHAREINLINE node numbers live inline, one per low-order byte;
+// a page shared with more nodes than that gets an overflow bitmap,
+// named by the low bits, or if those run out, MEM_SHAREALL:
+// shared with nodes we've lost track of, for good.
+// Use only the functions below to change a nonempty set.
+#define MEM_SHAREINLINE	3
+#define MEM_SHAREOVF	0x80000000	// Low 24 bits index an overflow set
+#define MEM_SHAREALL	0xffffffff	// Shared with too many to tell
+#define MEM_SHAREONE(node)	((uint32_t)(uint8_t)(node))
+
+void mem_shareadd(pageinfo *pi, uint8_t node);
+bool mem_shareaddlive(pageinfo *pi, uint8_t node); // false if pi is free
+bool mem_sharedel(pageinfo *pi, uint8_t node);	// true if pi is to be freed
+bool mem_unref(pageinfo *pi);			// for mem_decref()
+
 void mem_rrtrack(uint32_t rr, pageinfo *pi);
+bool mem_rrtracknew(uint32_t rr, pageinfo *pi);
+void mem_rrforget(pageinfo *pi);
 pageinfo *mem_rrlookup(uint32_t rr);
 
+// Memory accounting counters, kept per CPU in cpu->memstat
+// and summed over all CPUs by mem_statsum().
+// The "live" counters go up and down with current usage;
+// the others only count events, and may wrap.
+enum memstat {
+	MEMSTAT_ALLOC,		// Pages allocated
+	MEMSTAT_FREE,		// Pages freed
+	MEMSTAT_PTAB,		// live: Page tables in use
+	MEMSTAT_SHARED,		// live: Pages with more than one reference
+	MEMSTAT_PINNED,		// live: Unreferenced pages held by remote refs
+	MEMSTAT_RRCOPY,		// live: Tracked local copies of remote pages
+	MEMSTAT_PULLED,		// Pages pulled in from other nodes
+	MEMSTAT_PUSHED,		// Pages pushed to us ahead of a migration
+	MEMSTAT_VALIDATED,	// Cached copies reused without a re-pull
+	MEMSTAT_FAULTS,		// Write faults resolved by pmap_pagefault()
+	MEMSTAT_FAULTAHEAD,	// Further pages those faults resolved
+	MEMSTAT_DEDUPZERO,	// Zero pages pmap_dedup() returned to PTE_ZERO
+	MEMSTAT_DEDUPSHARED,	// Pages pmap_dedup() merged with another
+	MEMSTAT_N
+};
+
+void mem_stat(enum memstat stat, int32_t delta);	// Count on this CPU
+int32_t mem_statsum(enum memstat stat);			// Total of all CPUs
+
+// Rewrite the root process's "memstat" special file if it is empty.
+void mem_statfile(int ino);
+
 
 // Atomically increment the reference count on a page.
 static gcc_inline void
@@ -94,24 +198,39 @@ mem_incref(pageinfo *pi)
 {
 	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 	assert(pi != mem_ptr2pi(pmap_zero));	// Don't alloc/free zero page!
-	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
+	assert(!mem_iskernel(pi));
 
-	lockadd(&pi->refcount, 1);
+	int32_t old = xadd((volatile uint32_t*)&pi->refcount, 1);
+	if (old == 1)
+		mem_stat(MEMSTAT_SHARED, 1);
+	else if (old == 0 && pi->shared != 0)	// re-referenced while pinned
+		mem_stat(MEMSTAT_PINNED, -1);
 }
 
 // Atomically decrement the reference count on a page,
 // freeing the page with the provided function if there are no more refs.
+// The last reference goes via mem_unref(), which decides whether to free
+// the page under the same lock as mem_sharedel() drops remote sharers.
 static gcc_inline void
 mem_decref(pageinfo* pi, void (*freefun)(pageinfo *pi))
 {
 	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 	assert(pi != mem_ptr2pi(pmap_zero));	// Don't alloc/free zero page!
-	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
-
-	if (lockaddz(&pi->refcount, -1))
-		if (pi->shared == 0)	// free only if no remote refs
-			freefun(pi);
-	assert(pi->refcount >= 0);
+	assert(!mem_iskernel(pi));
+
+	uint32_t old;
+	do {
+		old = pi->refcount;
+		assert(old > 0);
+		if (old == 1) {
+			if (mem_unref(pi))	// free only if no remote refs
+				freefun(pi);
+			return;
+		}
+	} while (cmpxchg((volatile uint32_t*)&pi->refcount, old, old - 1)
+			!= old);
+	if (old == 2)
+		mem_stat(MEMSTAT_SHARED, -1);
 }
 
 
@@ -8,37 +8,164 @@
  */
 
 #include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/file.h>
+#include <inc/x86.h>
 
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/net.h>
+#include <kern/trace.h>
+#include <kern/file.h>
+#include <kern/mp.h>
+#include <kern/disk.h>
 
 #include <dev/e100.h>
+#include <dev/virtio.h>
 
 
 uint8_t net_node; // My node number - from net_mac[5]
 uint8_t net_mac[6]; // My MAC address from the Ethernet card
+uint8_t net_nodemac[NET_MAXNODES+1][6]; // MAC address of each node
+static const uint8_t net_brdmac[6] = { 0xff,0xff,0xff,0xff,0xff,0xff };
+uint16_t net_mtu = NET_MAXPKT; // Largest frame the card handles
 
 spinlock net_lock;
-proc *net_migrlist; // List of currently migrating processes
-proc *net_pulllist; // List of processes currently pulling a page
-
-#define NET_ETHERTYPE 0x9876  // Claim this ethertype for our packets
 
+// Outstanding migrations and pulls, hashed by the RR that the reply
+// will carry (the migrating proc's home, or the RR being pulled),
+// so that finding the proc a reply is for doesn't scan every request.
+#define NET_HASHSIZE	256	// Chains per table; must be a power of two
+#define NET_RRHASH(rr)	(((rr) >> 12 ^ (rr) >> 20 ^ (rr) >> 1) \
+				& (NET_HASHSIZE-1))
+static proc *net_migrhash[NET_HASHSIZE]; // Migrating procs via migrnext
+static net_pullslot *net_pullhash[NET_HASHSIZE]; // Pulls in flight
+static int net_nmigr, net_npull;	// Entries on all chains of each table
+
+// Adaptive retransmission, after Jacobson's algorithm for TCP.
+// For each peer node we keep a smoothed round-trip time and its mean
+// deviation, in timestamp counter cycles, sampled only from requests
+// answered on their first transmission (Karn's rule), and resend a
+// request once srtt + 4*rttvar cycles pass without a reply.
+// Each resend doubles that request's timeout, up to NET_RTOMAX,
+// so a lossy or overloaded peer gets exponentially fewer resends.
+#define NET_RTOINIT	(1 << 26)	// Timeout before the first RTT sample
+#define NET_RTOMIN	(1 << 20)	// Floor for the adaptive timeout
+#define NET_RTOMAX	(1 << 30)	// Ceiling for timeouts and backoff
+typedef struct net_peer {
+	uint32_t	srtt;		// Smoothed RTT, 0 if no sample yet
+	uint32_t	rttvar;		// Smoothed mean deviation of RTT
+	uint16_t	mtu;		// From its last pull request, 0=unknown
+	uint8_t		encs;		// Ditto for the encodings it takes
+	uint16_t	nrun;		// From its last load broadcast...
+	uint16_t	ncpu;
+	uint32_t	nfree;
+	uint64_t	loadtime;	// ...received at this TSC, 0 if never
+	uint16_t	nmigr;		// Procs sent there, not yet acknowledged
+	uint16_t	nmigrwait;	// Procs queued to go there with them
+} net_peer;
+static net_peer net_peers[NET_MAXNODES+1];	// Indexed by node number
+
+// Timer that checks for requests whose timeout has passed,
+// armed only while some migration or pull is outstanding.
+// Timeouts are in cycles, so this just polls at tick granularity.
+#define NET_POLL	1	// Timer ticks between checks
+
+// Load broadcasts go out every NET_LOADPERIOD ticks from the boot CPU.
+// A node we've heard nothing from in NET_LOADSTALE cycles (several
+// periods) is down, or too busy to say, so net_place() passes it by.
+#define NET_LOADPERIOD	25		// Timer ticks between broadcasts
+#define NET_LOADSTALE	(1ULL << 33)	// TSC cycles before load is stale
+#define NET_LOWMEM	256		// Free pages a node must have to place
+static timer net_ltimer;
+static timer net_timer;
+
+// Metrics samples go to the collector node every NET_METPERIOD ticks,
+// also from the boot CPU, but only while some node is collecting.
+// The collector queues them, its own included, until file_io() drains
+// them into its root process's "metrics" file (see net_metricsfile()).
+// A node that says in its load broadcasts that it collects becomes
+// the collector of every other node that has none, or that learned its
+// own from a broadcast too, until it says it has stopped; a collector
+// picked in a node's "netnodes" file stays until the file changes it.
+#define NET_METPERIOD	100		// Timer ticks between samples
+#define NET_METQ	64		// Samples the collector holds
+#define NET_METLINEMAX	384		// Longest line net_metricsfile() writes
+typedef struct net_metsample {
+	uint32_t	period;		// Collector's sample number on arrival
+	uint32_t	seq;		// Sender's sample number
+	uint8_t		node;		// Sender
+	uint32_t	val[NETMET_N];
+} net_metsample;
+static uint8_t net_collector;		// Node collecting metrics, 0 if none
+static bool net_colheard;		// We learned it from its broadcasts
+static bool net_metreset;		// Start the "metrics" stream over
+static uint32_t net_metseq;		// Our latest sample number
+static timer net_mtimer;
+static spinlock net_metlock;		// Protects the queue
+static net_metsample net_metq[NET_METQ];
+static uint32_t net_methead, net_mettail; // Samples queued and drained
+static uint32_t net_metlost;		// Samples dropped for a full queue
+static const char *const net_metnames[NETMET_N] = {
+  "nrun", "ncpu", "traps", "syscalls", "switched", "lockwaits",
+  "free", "alloc", "faults", "pulled", "migrs",
+  "txpkts", "txbytes", "rxpkts", "rxbytes", "rexmits",
+};
 
-void net_txmigrq(proc *p);
-void net_rxmigrq(net_migrq *migrq);
-void net_txmigrp(uint8_t dstnode, uint32_t prochome);
-void net_rxmigrp(net_migrp *migrp);
+#define NET_ETHERTYPE 0x9876  // Claim this ethertype for our packets
 
-void net_pull(proc *p, uint32_t rr, void *pg, int pglevel);
-void net_txpullrq(proc *p);
-void net_rxpullrq(net_pullrq *rq);
-void net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg);
+// Pages other nodes pushed to us ahead of migrating a process here.
+// Each slot holds a reference to its page, and once all of the page
+// has arrived, tracks it under its RR with mem_rrtrack(),
+// so that net_pullpte() finds it locally instead of pulling it.
+// Slots are reused round-robin, and let go of pages that have been
+// picked up when a migrated process finishes pulling.
+#define NET_PUSHSLOTS	128
+typedef struct net_pushslot {
+	uint32_t	rr;		// RR of the pushed page, 0 if slot free
+	pageinfo	*pi;		// Our copy of the page
+	uint8_t		arrived;	// Bits 0-2: which parts have arrived
+	uint32_t	version;	// Its version, once it's all there
+} net_pushslot;
+static net_pushslot net_pushcache[NET_PUSHSLOTS];
+static int net_pushnext;		// Next slot to reuse
+
+// RRs of copies we've freed, queued until an idle CPU sends them home
+// in batches per home node (see net_idle()).  Best effort: if the queue
+// fills up or a release is lost, the home node keeps its page pinned.
+#define NET_RELQ	1024
+static spinlock net_rellock;		// Leaf lock: mem_free() takes it
+static uint32_t net_relq[NET_RELQ];
+static volatile int net_nrelq;
+
+
+static void net_txmigrq(uint8_t dstnode, uint64_t now);
+void net_rxmigrq(uint8_t srcnode, net_migrq *migrq, int len);
+void net_txmigrp(uint8_t dstnode, uint32_t *homes, int nhome);
+void net_rxmigrp(uint8_t srcnode, net_migrp *migrp, int len);
+
+void net_pull(proc *p, uint32_t rr, void *pg, int pglevel,
+		uint32_t version, uint32_t *pte);
+void net_txpullrq(net_pullslot *s);
+void net_rxpullrq(uint8_t rqnode, net_pullrq *rq);
+void net_txpullrp(uint8_t rqnode, int type, uint32_t rr, int pglev,
+		int part, int nparts, int encs, uint32_t version, void *pg);
 void net_rxpullrp(net_pullrphdr *rp, int len);
+static void net_push(proc *p, uint8_t dstnode);
+static void net_rxpushrp(uint8_t srcnode, net_pullrphdr *rp, int len);
+static void net_pushrelease(void);
+static void net_rxrelease(uint8_t srcnode, net_release *rl, int len);
+static void net_rxload(uint8_t srcnode, net_load *ld, int len);
+static void net_rxmetrics(uint8_t srcnode, net_metrics *m, int len);
 bool net_pullpte(proc *p, uint32_t *pte, int pglevel);
+static void net_pullmore(proc *p);
+static void net_pullwake(uint32_t rr, void *pg);
+static void net_retransmit(timer *t);
+static void net_loadtimer(timer *t);
+static void net_mettimer(timer *t);
+static bool net_present(void);
 
 void
 net_init(void)
@@ -47,8 +174,13 @@ net_init(void)
     return;
 
   spinlock_init(&net_lock);
+  spinlock_init(&net_rellock);
+  spinlock_init(&net_metlock);
+  net_timer.func = net_retransmit;
+  net_ltimer.func = net_loadtimer;
+  net_mtimer.func = net_mettimer;
 
-  if (!e100_present) {
+  if (!net_present()) {
     cprintf("No network card found; networking disabled\n");
     return;
   }
@@ -56,29 +188,604 @@ net_init(void)
   // Ethernet card should already have been initialized
   assert(net_mac[0] != 0 && net_mac[5] != 0);
   net_node = net_mac[5];  // Last byte in MAC addr is our node number
+
+  // Until the root process says otherwise (see net_nodesfile()),
+  // node n's MAC address is ours with n as the last byte.
+  int n;
+  for (n = 1; n <= NET_MAXNODES; n++) {
+    memcpy(net_nodemac[n], net_mac, 6);
+    net_nodemac[n][5] = n;
+  }
+
+  assert(sizeof(net_migrq) + sizeof(net_migent) + sizeof(procstate)
+         + PROC_CHILDREN <= NET_MAXPKT);
+  assert(sizeof(net_migrp) <= NET_MAXPKT);
+  timer_add(&net_ltimer, NET_LOADPERIOD);
+  timer_add(&net_mtimer, NET_METPERIOD);
+
+  // The e100 has no jumbo frame support, so net_mtu stays NET_MAXPKT;
+  // a driver for a card that has it would raise net_mtu when it attaches.
+  assert(net_mtu >= NET_MAXPKT && net_mtu <= NET_MAXJUMBO);
 }
 
 // Setup the Ethernet header in a packet to be sent.
 static void
 net_ethsetup(net_ethhdr *eth, uint8_t destnode)
 {
-  assert(destnode > 0 && destnode <= NET_MAXNODES);
+  assert(destnode > 0);
   assert(destnode != net_node); // soliloquy isn't a virtue here
 
-  memcpy(eth->dst, net_mac, 6); eth->dst[5] = destnode;
+  memcpy(eth->dst, net_nodemac[destnode], 6);
   memcpy(eth->src, net_mac, 6);
   eth->type = htons(NET_ETHERTYPE);
 }
 
+static uint8_t net_macnode(const uint8_t *mac);
+static int net_txref(void *hdr, int hlen, void *body, int blen,
+		pageinfo *pin);
+
 // Just a trivial wrapper for the e100 driver's transmit function.
 // The two buffers provided get concatenated to form the transmitted packet;
 // this is just a convenience (and optimization) for when the caller has a
 // "packet head" and a "packet body" coming from different memory areas.
 // To transmit from just one buffer, set blen to zero.
+// Also counts the frame in this CPU's statistics.
 int net_tx(void *hdr, int hlen, void *body, int blen)
+{
+  return net_txref(hdr, hlen, body, blen, NULL);
+}
+
+// We drive whichever one network card pci_init() attached first.
+static bool
+net_present(void)
+{
+  return e100_present || virtio_present;
+}
+
+// Bracket a burst of transmissions, so the card is notified once.
+static void
+net_txbegin(void)
+{
+  if (virtio_present)
+    virtio_txbegin();
+  else if (e100_present)
+    e100_txbegin();
+}
+
+static void
+net_txend(void)
+{
+  if (virtio_present)
+    virtio_txend();
+  else if (e100_present)
+    e100_txend();
+}
+
+// Like net_tx(), but if pin is non-NULL, the body lies in that page,
+// which the card sends from in place, holding a reference meanwhile.
+static int
+net_txref(void *hdr, int hlen, void *body, int blen, pageinfo *pin)
 {
   //cprintf("net_tx %d+%d\n", hlen, blen);
-  return e100_tx(hdr, hlen, body, blen);
+  int ok = virtio_present ? virtio_tx(hdr, hlen, body, blen, pin)
+                          : e100_tx(hdr, hlen, body, blen, pin);
+  netstats *ns = cpu_cur()->net;
+  if (ns == NULL)
+    return ok;
+  if (!ok) {
+    ns->ev[NETEV_TXFULL]++;
+    return ok;
+  }
+  net_hdr *h = hdr;
+  net_typestats *ts = &ns->tx[h->type < NET_NTYPES ? h->type : 0];
+  ts->pkts++;
+  ts->bytes += hlen + blen;
+  net_peerstats *ps = &ns->peer[h->eth.dst[0] & 1 ? 0
+                                : net_macnode(h->eth.dst)];
+  ps->txpkts++;
+  ps->txbytes += hlen + blen;
+  return ok;
+}
+
+// Count an event in this CPU's network statistics.
+static void
+net_statev(enum netev ev)
+{
+  netstats *ns = cpu_cur()->net;
+  if (ns != NULL)
+    ns->ev[ev]++;
+}
+
+// Record how long a request took, from first transmission to reply.
+// Buckets are as for kern/lat.c's histograms.
+static void
+net_statlat(enum netlat nl, net_rqtimer *rt)
+{
+  netstats *ns = cpu_cur()->net;
+  if (ns == NULL)
+    return;
+  uint64_t t = rdtsc() - rt->start;
+  latclass *lc = &ns->lat[nl];
+  lc->n++;
+  lc->cycles += t;
+  uint32_t t32 = t >> 32 ? ~0 : t;
+  if (t32 > lc->max)
+    lc->max = t32;
+  int b = t32 < 256 ? 0 : (bsr(t32) - 6) / 2;
+  lc->hist[MIN(b, LAT_NHIST - 1)]++;
+}
+
+// Find the node whose MAC address is mac, or return 0 if none.
+// Normally the last byte is the node number, so check that first.
+static uint8_t
+net_macnode(const uint8_t *mac)
+{
+  if (mac[5] != 0 && memcmp(net_nodemac[mac[5]], mac, 6) == 0)
+    return mac[5];
+  int n;
+  for (n = 1; n <= NET_MAXNODES; n++)
+    if (memcmp(net_nodemac[n], mac, 6) == 0)
+      return n;
+  return 0;
+}
+
+// Parse a number of at most 3 digits in the given base at *sp,
+// advancing *sp past it; returns -1 if there are no digits.
+// (The kernel's little libc has no strtol().)
+static int
+net_parsenum(char **sp, int base)
+{
+  char *s = *sp;
+  int v = 0, d;
+  for (; s < *sp + 3; s++) {
+    if (*s >= '0' && *s <= '9')
+      d = *s - '0';
+    else if (*s >= 'a' && *s <= 'f')
+      d = *s - 'a' + 10;
+    else if (*s >= 'A' && *s <= 'F')
+      d = *s - 'A' + 10;
+    else
+      break;
+    if (d >= base)
+      break;
+    v = v * base + d;
+  }
+  if (s == *sp)
+    return -1;
+  *sp = s;
+  return v;
+}
+
+// Parse one "node <n> <xx:xx:xx:xx:xx:xx>" line and apply it.
+static bool
+net_nodeline(char *s)
+{
+  if (strncmp(s, "node ", 5) != 0)
+    return 0;
+  s += 5;
+  int n = net_parsenum(&s, 10);
+  if (n < 1 || n > NET_MAXNODES || n == net_node || *s++ != ' ')
+    return 0;
+  uint8_t mac[6];
+  int i;
+  for (i = 0; i < 6; i++) {
+    int b = net_parsenum(&s, 16);
+    if (b < 0 || b > 0xff || *s != (i < 5 ? ':' : 0))
+      return 0;
+    mac[i] = b;
+    s++;
+  }
+  memcpy(net_nodemac[n], mac, 6);
+  return 1;
+}
+
+// Parse one "collector <n>" line and apply it.
+static bool
+net_collectorline(char *s)
+{
+  if (strncmp(s, "collector ", 10) != 0)
+    return 0;
+  s += 10;
+  int n = net_parsenum(&s, 10);
+  if (n < 0 || n > NET_MAXNODES || *s != 0)
+    return 0;
+  if (n == net_node || net_collector == net_node)
+    net_metreset = 1;   // a collection starts, or ours ends
+  net_collector = n;
+  net_colheard = 0;
+  return 1;
+}
+
+// Update function for the root process's "netnodes" special file,
+// which lists the MAC address of each node other than the default
+// ("node <n> <xx:xx:xx:xx:xx:xx>" per line, after a "#" header line),
+// and the node we send metrics to, if any ("collector <n>").
+// As with "memstat", truncating it to zero length asks for a fresh
+// listing; writing lines of the same form (without the header)
+// assigns those nodes those addresses, or picks that collector,
+// instead.  "collector" with our own node number makes us collect
+// from the whole cluster, and "collector 0" stops sending metrics.
+void
+net_nodesfile(int ino)
+{
+  fileinode *fi = &files->fi[ino];
+  char *data = FILEDATA(ino);
+  if (fi->size != 0 && data[0] != '#') {  // the root gave us new ones
+    char *s = data, *lim = data + MIN(fi->size, FILE_SLOTSIZE);
+    while (s < lim) {
+      char *nl = memchr(s, '\n', lim - s);
+      if (nl == NULL)
+        nl = lim;
+      // Parse a copy: a full file has no room for a final terminator.
+      char line[64];
+      int len = MIN(nl - s, sizeof(line) - 1);
+      memmove(line, s, len);
+      line[len] = 0;
+      if (len != 0 && (nl - s >= sizeof(line)
+          || (!net_nodeline(line) && !net_collectorline(line))))
+        warn("net_nodesfile: bad line '%s'", line);
+      s = nl + 1;
+    }
+    fi->size = 0;
+  }
+  if (fi->size != 0)
+    return;
+
+  size_t n = snprintf(data, FILE_SLOTSIZE, "# node %d mac "
+      "%02x:%02x:%02x:%02x:%02x:%02x\n", net_node, net_mac[0], net_mac[1],
+      net_mac[2], net_mac[3], net_mac[4], net_mac[5]);
+  if (net_collector != 0)
+    n += snprintf(data + n, 64, "collector %d\n", net_collector);
+  int i;
+  for (i = 1; i <= NET_MAXNODES && n + 64 <= FILE_SLOTSIZE; i++) {
+    uint8_t *m = net_nodemac[i];
+    if (i == net_node || (memcmp(m, net_mac, 5) == 0 && m[5] == i))
+      continue;   // the default
+    n += snprintf(data + n, 64, "node %d %02x:%02x:%02x:%02x:%02x:%02x\n",
+        i, m[0], m[1], m[2], m[3], m[4], m[5]);
+  }
+  fi->size = n;
+}
+
+// Broadcast our load to every node that's listening, every so often.
+// Runs on the boot CPU, which started it in net_init().
+static void
+net_loadtimer(timer *t)
+{
+  net_load ld;
+  memset(ld.eth.dst, 0xff, 6);
+  memcpy(ld.eth.src, net_mac, 6);
+  ld.eth.type = htons(NET_ETHERTYPE);
+  ld.type = NET_LOAD;
+  ld.nrun = proc_nrun();
+  ld.ncpu = ncpu;
+  ld.nfree = mem_nfree();
+  ld.collector = net_collector;
+  net_tx(&ld, sizeof(ld), 0, 0);
+  timer_add(t, NET_LOADPERIOD);
+}
+
+static void
+net_rxload(uint8_t srcnode, net_load *ld, int len)
+{
+  if (len < sizeof(*ld) || ld->ncpu == 0) {
+    warn("net_rxload: bad load message");
+    net_statev(NETEV_BAD);
+    return;
+  }
+  spinlock_acquire(&net_lock);
+  net_peer *np = &net_peers[srcnode];
+  np->nrun = ld->nrun;
+  np->ncpu = ld->ncpu;
+  np->nfree = ld->nfree;
+  np->loadtime = rdtsc();
+  if (ld->collector == srcnode && (net_collector == 0 || net_colheard)) {
+    net_collector = srcnode;
+    net_colheard = 1;
+  } else if (net_collector == srcnode && net_colheard)
+    net_collector = 0;    // it stopped collecting
+  spinlock_release(&net_lock);
+}
+
+// Fill in our current counters for a metrics sample,
+// summing the per-CPU statistics as the stat files do.
+static void
+net_metgather(uint32_t *val)
+{
+  memset(val, 0, NETMET_N * sizeof(val[0]));
+  val[NETMET_NRUN] = proc_nrun();
+  val[NETMET_NCPU] = ncpu;
+#ifdef SPINLOCK_PROFILE
+  val[NETMET_LOCKWAITS] = spinlock_contended();
+#endif
+  val[NETMET_FREE] = mem_nfree();
+  val[NETMET_ALLOC] = mem_statsum(MEMSTAT_ALLOC);
+  val[NETMET_FAULTS] = mem_statsum(MEMSTAT_FAULTS);
+  val[NETMET_PULLED] = mem_statsum(MEMSTAT_PULLED);
+
+  cpu *c;
+  int i;
+  for (c = &cpu_boot; c != NULL; c = c->next) {
+    if (c->lat != NULL)   // racy, but only statistics
+      for (i = 0; i < LAT_NCLASS; i++) {
+        latclass *lc = &c->lat->c[i];
+        val[NETMET_TRAPS] += lc->n + lc->switched;
+        if (i >= LAT_NTRAP)
+          val[NETMET_SYSCALLS] += lc->n + lc->switched;
+        val[NETMET_SWITCHED] += lc->switched;
+      }
+    netstats *ns = c->net;
+    if (ns == NULL)
+      continue;
+    for (i = 0; i < NET_NTYPES; i++) {
+      val[NETMET_TXPKTS] += ns->tx[i].pkts;
+      val[NETMET_TXBYTES] += ns->tx[i].bytes;
+      val[NETMET_RXPKTS] += ns->rx[i].pkts;
+      val[NETMET_RXBYTES] += ns->rx[i].bytes;
+    }
+    val[NETMET_MIGRS] += ns->tx[NET_MIGRQ].pkts;
+    for (i = 0; i <= NET_MAXNODES; i++)
+      val[NETMET_REXMITS] += ns->peer[i].rexmits;
+  }
+}
+
+// Queue a sample from 'node' for the root's "metrics" file,
+// and wake the root to pass it on to whoever is reading it.
+static void
+net_metqueue(uint8_t node, uint32_t seq, uint32_t *val)
+{
+  spinlock_acquire(&net_metlock);
+  if (net_methead - net_mettail < NET_METQ) {
+    net_metsample *ms = &net_metq[net_methead++ % NET_METQ];
+    ms->period = net_metseq;
+    ms->seq = seq;
+    ms->node = node;
+    memcpy(ms->val, val, sizeof(ms->val));
+  } else
+    net_metlost++;
+  spinlock_release(&net_metlock);
+  file_wakeroot();
+}
+
+// Take a metrics sample and send it to the collector, if there is one,
+// every so often.  Runs on the boot CPU, which started it in net_init().
+static void
+net_mettimer(timer *t)
+{
+  net_metrics m;
+  uint8_t coll = net_collector;
+  net_metseq++;
+  if (coll != 0) {
+    m.type = NET_METRICS;
+    m.seq = net_metseq;
+    m.nval = NETMET_N;
+    net_metgather(m.val);
+    if (coll == net_node)
+      net_metqueue(net_node, m.seq, m.val);
+    else {
+      net_ethsetup(&m.eth, coll);
+      net_tx(&m, sizeof(m), 0, 0);
+    }
+  }
+  timer_add(t, NET_METPERIOD);
+}
+
+static void
+net_rxmetrics(uint8_t srcnode, net_metrics *m, int len)
+{
+  if (len < sizeof(*m) || m->nval != NETMET_N) {
+    warn("net_rxmetrics: bad metrics message");
+    net_statev(NETEV_BAD);
+    return;
+  }
+  if (net_collector != net_node)
+    return;   // sent before the sender heard we stopped
+  net_metqueue(srcnode, m->seq, m->val);
+}
+
+// Update function for the root process's "metrics" file, a stream
+// (see file_specials[] in kern/file.c) of the samples we've collected,
+// one line each: "period node seq", then each counter's name and value,
+// period being our own sample number when the sample arrived,
+// so samples with the same period arrived within NET_METPERIOD ticks.
+// Samples wait in the queue while the file is at its maximum size,
+// and those the full queue turned away are counted in a "lost" line.
+// The stream starts over, as a new version, whenever the "netnodes" file
+// makes us start or stop collecting, so that each collection's reader
+// gets a whole file's worth of room and finds only its own samples.
+void
+net_metricsfile(int ino)
+{
+  fileinode *fi = &files->fi[ino];
+  char *data = FILEDATA(ino);
+  spinlock_acquire(&net_metlock);
+  if (net_metreset) {
+    net_metreset = 0;
+    fi->ver++;
+    fi->size = 0;
+  }
+  if (net_metlost && fi->size + NET_METLINEMAX <= FILE_SLOTSIZE) {
+    fi->size += snprintf(data + fi->size, NET_METLINEMAX,
+        "%u 0 0 lost %u\n", net_metseq, net_metlost);
+    net_metlost = 0;
+  }
+  while (net_mettail != net_methead
+      && fi->size + NET_METLINEMAX <= FILE_SLOTSIZE) {
+    net_metsample *ms = &net_metq[net_mettail++ % NET_METQ];
+    char *s = data + fi->size, *lim = s + NET_METLINEMAX;
+    int i;
+    s += snprintf(s, lim - s, "%u %d %u", ms->period, ms->node, ms->seq);
+    for (i = 0; i < NETMET_N; i++)
+      s += snprintf(s, lim - s, " %s %u", net_metnames[i], ms->val[i]);
+    s += snprintf(s, lim - s, "\n");
+    fi->size = s - data;
+  }
+  spinlock_release(&net_metlock);
+}
+
+// Choose a node for a new child whose parent asked for SYS_NODEANY:
+// whichever node, this one included, has the fewest runnable processes
+// per CPU, among those with memory to spare and fresh load reports.
+// A node we pick is charged one more process right away,
+// so a burst of placements spreads out before its next report.
+uint8_t
+net_place(void)
+{
+  uint8_t best = net_node;
+  uint32_t bestrun = proc_nrun(), bestcpu = ncpu;
+  if (!net_present())
+    return best;
+
+  uint64_t now = rdtsc();
+  int n;
+  spinlock_acquire(&net_lock);
+  for (n = 1; n <= NET_MAXNODES; n++) {
+    net_peer *np = &net_peers[n];
+    if (n == net_node || np->loadtime == 0
+        || now - np->loadtime > NET_LOADSTALE || np->nfree < NET_LOWMEM)
+      continue;
+    if (np->nrun * bestcpu < bestrun * np->ncpu) {  // compare nrun/ncpu
+      best = n;
+      bestrun = np->nrun;
+      bestcpu = np->ncpu;
+    }
+  }
+  if (best != net_node)
+    net_peers[best].nrun++;
+  spinlock_release(&net_lock);
+  return best;
+}
+
+#define NET_STATORDER	2	// netstats takes 2^NET_STATORDER pages
+#define NET_STATLINEMAX	192	// Longest line net_statfile() produces:
+				// "lat" and "peer" with every count at max
+
+static const char *const net_typenames[NET_NTYPES] = {
+  "other", "migrq", "migrp", "pullrq", "pullrp", "pushrp", "release", "load",
+  "metrics",
+};
+static const char *const net_evnames[NETEV_N] = {
+  "runt", "stray", "badtype", "bad", "dup", "txfull", "follow",
+  "diff",
+};
+static const char *const net_latnames[NETLAT_N] = {
+  "pull", "validate", "migr",
+};
+
+void
+net_statinit(void)
+{
+  assert(sizeof(netstats) <= (PAGESIZE << NET_STATORDER));
+
+  pageinfo *pi = mem_allocn(NET_STATORDER);
+  if (pi == NULL) {
+    warn("net_statinit: no memory for CPU %d network statistics",
+      cpu_cur()->id);
+    return;
+  }
+  int i;
+  for (i = 0; i < (1 << NET_STATORDER); i++)
+    mem_incref(&pi[i]);
+  netstats *ns = mem_pi2ptr(pi);
+  memset(ns, 0, sizeof(*ns));
+  cpu_cur()->net = ns;
+}
+
+// Update function for the root process's "netstat" special file,
+// summing all CPUs' statistics: a "tx" and an "rx" line per message
+// type seen, giving frames and bytes; a line of event counts; a "lat"
+// line per kind of request answered, in the format of "latstat";
+// and a "peer" line per node we've exchanged frames with,
+// including its RTT estimate in TSC cycles (peer 0 is broadcasts).
+// As with "latstat", truncating the file asks for a fresh snapshot,
+// and writing "reset" into it zeroes all the counts first.
+void
+net_statfile(int ino)
+{
+  fileinode *fi = &files->fi[ino];
+  char *data = FILEDATA(ino);
+  cpu *c;
+  if (fi->size >= 5 && strncmp(data, "reset", 5) == 0) {
+    for (c = &cpu_boot; c != NULL; c = c->next)
+      if (c->net != NULL)   // racy, but only statistics
+        memset(c->net, 0, sizeof(*c->net));
+    fi->size = 0;
+  }
+  if (fi->size != 0)
+    return;
+
+  size_t n = 0;
+  int i, j, dir;
+  for (dir = 0; dir < 2; dir++)
+    for (i = 0; i < NET_NTYPES; i++) {
+      net_typestats sum = { 0, 0, 0 };
+      for (c = &cpu_boot; c != NULL; c = c->next)
+        if (c->net != NULL) {
+          net_typestats *ts = dir ? &c->net->rx[i] : &c->net->tx[i];
+          sum.pkts += ts->pkts;
+          sum.bytes += ts->bytes;
+        }
+      if (sum.pkts != 0)
+        n += snprintf(data + n, NET_STATLINEMAX,
+          "%s %s pkts %u bytes %llu\n", dir ? "rx" : "tx",
+          net_typenames[i], sum.pkts, sum.bytes);
+    }
+
+  uint32_t ev[NETEV_N];
+  memset(ev, 0, sizeof(ev));
+  for (c = &cpu_boot; c != NULL; c = c->next)
+    if (c->net != NULL)
+      for (i = 0; i < NETEV_N; i++)
+        ev[i] += c->net->ev[i];
+  n += snprintf(data + n, NET_STATLINEMAX, "events");
+  for (i = 0; i < NETEV_N; i++)
+    n += snprintf(data + n, NET_STATLINEMAX, " %s %u", net_evnames[i], ev[i]);
+  n += snprintf(data + n, NET_STATLINEMAX, "\n");
+
+  for (i = 0; i < NETLAT_N; i++) {
+    latclass sum;
+    memset(&sum, 0, sizeof(sum));
+    for (c = &cpu_boot; c != NULL; c = c->next) {
+      if (c->net == NULL)
+        continue;
+      latclass *lc = &c->net->lat[i];
+      sum.n += lc->n;
+      sum.cycles += lc->cycles;
+      sum.max = MAX(sum.max, lc->max);
+      for (j = 0; j < LAT_NHIST; j++)
+        sum.hist[j] += lc->hist[j];
+    }
+    if (sum.n == 0)
+      continue;
+    n += snprintf(data + n, NET_STATLINEMAX,
+      "lat %s n %u cycles %llu max %u hist %u %u %u %u %u %u %u %u\n",
+      net_latnames[i], sum.n, sum.cycles, sum.max,
+      sum.hist[0], sum.hist[1], sum.hist[2], sum.hist[3],
+      sum.hist[4], sum.hist[5], sum.hist[6], sum.hist[7]);
+  }
+
+  for (i = 0; i <= NET_MAXNODES && n + NET_STATLINEMAX <= FILE_SLOTSIZE; i++) {
+    net_peerstats sum;
+    memset(&sum, 0, sizeof(sum));
+    for (c = &cpu_boot; c != NULL; c = c->next) {
+      if (c->net == NULL)
+        continue;
+      net_peerstats *ps = &c->net->peer[i];
+      sum.txpkts += ps->txpkts;
+      sum.rxpkts += ps->rxpkts;
+      sum.rexmits += ps->rexmits;
+      sum.txbytes += ps->txbytes;
+      sum.rxbytes += ps->rxbytes;
+    }
+    if (sum.txpkts == 0 && sum.rxpkts == 0)
+      continue;
+    n += snprintf(data + n, NET_STATLINEMAX,
+      "peer %d txpkts %u txbytes %llu rxpkts %u rxbytes %llu "
+      "rexmits %u srtt %u rttvar %u\n", i, sum.txpkts, sum.txbytes,
+      sum.rxpkts, sum.rxbytes, sum.rexmits,
+      net_peers[i].srtt, net_peers[i].rttvar);
+  }
+  fi->size = n;
 }
 
 // The e100 network interface device driver calls this
@@ -89,99 +796,184 @@ net_rx(void *pkt, int len)
   //cprintf("net_rx len %d\n", len);
   if (len < sizeof(net_hdr)) {
     warn("net_rx: runt packet (%d bytes)", len);
+    net_statev(NETEV_RUNT);
     return; // drop
   }
   net_hdr *h = pkt;
-  if (memcmp(h->eth.dst, net_mac, 6) != 0) {  // is it for us?
+  if (memcmp(h->eth.dst, net_mac, 6) != 0     // is it for us?
+      && (memcmp(h->eth.dst, net_brdmac, 6) != 0 || h->type != NET_LOAD)) {
     warn("net_rx: stray packet received for someone else");
+    net_statev(NETEV_STRAY);
     return; // drop
   }
-  if (memcmp(h->eth.src, net_mac, 5) != 0   // from a node we know?
-      || h->eth.src[5] < 1 || h->eth.src[5] > NET_MAXNODES) {
+  if (memcmp(h->eth.src, net_mac, 6) == 0)
+    return;   // our own broadcast, looped back
+  uint8_t srcnode = net_macnode(h->eth.src);  // from a node we know?
+  if (srcnode == 0 || srcnode == net_node) {
     warn("net_rx: stray packet received from outside cluster");
+    net_statev(NETEV_STRAY);
     return; // drop
   }
   if (h->eth.type != htons(NET_ETHERTYPE)) {
     warn("net_rx: unrecognized ethertype %x", ntohs(h->eth.type));
+    net_statev(NETEV_BADTYPE);
     return; // drop
   }
 
+  netstats *ns = cpu_cur()->net;
+  if (ns != NULL) {
+    net_typestats *ts = &ns->rx[h->type < NET_NTYPES ? h->type : 0];
+    ts->pkts++;
+    ts->bytes += len;
+    ns->peer[srcnode].rxpkts++;
+    ns->peer[srcnode].rxbytes += len;
+  }
+
   // Process received packet
   switch(h->type) {
     case NET_MIGRQ:
-      net_rxmigrq(pkt);
+      net_rxmigrq(srcnode, pkt, len);
       break;
     case NET_MIGRP:
-      net_rxmigrp(pkt);
+      net_rxmigrp(srcnode, pkt, len);
       break;
     case NET_PULLRQ:
-      net_rxpullrq(pkt);
+      net_rxpullrq(srcnode, pkt);
       break;
     case NET_PULLRP:    // Page pull reply
       net_rxpullrp(pkt, len);    
       break;
+    case NET_PUSHRP:
+      net_rxpushrp(srcnode, pkt, len);
+      break;
+    case NET_RELEASE:
+      net_rxrelease(srcnode, pkt, len);
+      break;
+    case NET_LOAD:
+      net_rxload(srcnode, pkt, len);
+      break;
+    case NET_METRICS:
+      net_rxmetrics(srcnode, pkt, len);
+      break;
     default:
       warn("net_rx: invalid packet type\n");
+      net_statev(NETEV_BADTYPE);
   }
 }
 
-// Called by trap() on every timer interrupt,
-// so that we can periodically retransmit lost packets.
-void
-net_tick()
+// Called with net_lock held whenever a request is added to
+// net_migrhash or net_pullhash.
+static void
+net_armtimer(void)
 {
-  if (!cpu_onboot())
-    return;   // count only one CPU's ticks
+  assert(spinlock_holding(&net_lock));
+  if (!net_timer.pending)
+    timer_add(&net_timer, NET_POLL);
+}
 
-  static int tick;
-  if (++tick & 63)
-    return;
+// Start the retransmission state for a new request to node.
+static void
+net_rtinit(net_rqtimer *rt, uint8_t node)
+{
+  assert(spinlock_holding(&net_lock));
+  net_peer *np = &net_peers[node];
+  rt->tries = 0;
+  rt->start = rdtsc();
+  rt->rto = NET_RTOINIT;
+  if (np->srtt != 0)
+    rt->rto = MAX(MIN(np->srtt + 4 * np->rttvar, NET_RTOMAX), NET_RTOMIN);
+}
+
+// Note that a request is being (re)transmitted now.
+static void
+net_rtsent(net_rqtimer *rt)
+{
+  rt->sent = rdtsc();
+  if (rt->tries < 255)
+    rt->tries++;
+}
+
+// Has a request's timeout passed?  If so, back off for the next try.
+static bool
+net_rtexpired(net_rqtimer *rt, uint64_t now)
+{
+  if (now - rt->sent < rt->rto)
+    return 0;
+  rt->rto = MIN(rt->rto * 2, NET_RTOMAX);
+  return 1;
+}
+
+// A reply to a request to node arrived: update the node's RTT estimate.
+static void
+net_rtsample(net_rqtimer *rt, uint8_t node)
+{
+  assert(spinlock_holding(&net_lock));
+  if (rt->tries != 1)
+    return;     // can't tell which transmission was answered
+  rt->tries = 255;  // only the first reply counts: never sample again
+  uint64_t m64 = rdtsc() - rt->sent;
+  int32_t m = MIN(m64, NET_RTOMAX);
+
+  net_peer *np = &net_peers[node];
+  if (np->srtt == 0) {
+    np->srtt = m;
+    np->rttvar = m / 2;
+  } else {
+    int32_t err = m - np->srtt;
+    np->srtt += err / 8;
+    np->rttvar += ((err < 0 ? -err : err) - (int32_t)np->rttvar) / 4;
+  }
+  if (np->srtt == 0)
+    np->srtt = 1;
+}
 
+static void
+net_statrexmit(uint8_t node)
+{
+  netstats *ns = cpu_cur()->net;
+  if (ns != NULL)
+    ns->peer[node].rexmits++;
+}
+
+// Resend every outstanding request whose timeout has passed,
+// and check again later if any remain.
+static void
+net_retransmit(timer *t)
+{
   spinlock_acquire(&net_lock);
 
-  if(net_migrlist){
-    proc *net_migrpoint;
-    // cprintf("net_tick: resending migrlist ");
-    for(net_migrpoint = net_migrlist; net_migrpoint; 
-      net_migrpoint = net_migrpoint->migrnext) {
-      // Resend packets
-      // cprintf("%p->", net_migrpoint);
-      net_txmigrq(net_migrpoint);
-    }
-    // cprintf("END\n");
-  }
-  if(net_pulllist) {
-    proc *net_pullpoint;
-    // cprintf("net_tick: resending pulllist ");
-    for(net_pullpoint = net_pulllist; net_pullpoint; 
-      net_pullpoint = net_pullpoint->pullnext) {
-      // Resend packets
-      // cprintf("%p->", net_pullpoint);
-      net_txpullrq(net_pullpoint);
-   }
-   // cprintf("END\n");
-  }
-  /*
-  Akshay: This won't work if there aren't the same number of pulls and migrations
-  proc *migrations, *pulls;
-  for(migrations = net_migrlist, pulls = net_pulllist; (migrations || pulls);
-          migrations = migrations->migrnext, pulls = pulls->pullnext) {
-    if(migrations) {
-        // cprintf("sending migrq from %x\n", migrations);
-        net_txmigrq(migrations);
-    }
-    if(pulls) {
-        // cprintf("sending pull request from %x\n", pulls);
-        net_txpullrq(pulls);
-    }
+  uint64_t now = rdtsc();
+  uint32_t migrdue[(NET_MAXNODES+32)/32];
+  proc *p;
+  net_pullslot *s;
+  int i;
+  memset(migrdue, 0, sizeof(migrdue));
+  net_txbegin();
+  for (i = 0; i < NET_HASHSIZE; i++) {
+    // Migrations go in batches per node, below.
+    for (p = net_migrhash[i]; p; p = p->migrnext)
+      if (p->migrrt.tries == 0
+          || now - p->migrrt.sent >= p->migrrt.rto)
+        migrdue[p->migrdest / 32] |= 1u << (p->migrdest % 32);
+    for (s = net_pullhash[i]; s; s = s->next)
+      if (!s->follow && net_rtexpired(&s->rt, now)) {
+        net_statrexmit(RRNODE(s->rr));
+        net_txpullrq(s);
+      }
   }
-  */
+  for (i = 1; i <= NET_MAXNODES; i++)
+    if (migrdue[i / 32] & (1u << (i % 32)))
+      net_txmigrq(i, now);
+  net_txend();
+  if (net_nmigr || net_npull)
+    net_armtimer();
+
   spinlock_release(&net_lock);
 }
 
 // Whenever we send a page containing remote refs to a new node,
 // we call this function to account for this sharing
-// by ORing the destination node into the pageinfo's sharemask.
+// by adding the destination node to the pageinfo's sharer set.
 void
 net_rrshare(void *page, uint8_t dstnode)
 {
@@ -189,9 +981,84 @@ net_rrshare(void *page, uint8_t dstnode)
   assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
   assert(pi != mem_ptr2pi(pmap_zero));  // No remote refs to zero page!
 
-  assert(dstnode > 0 && dstnode <= NET_MAXNODES);
-  assert(NET_MAXNODES <= sizeof(pi->shared)*8);
-  pi->shared |= 1 << (dstnode-1);   // XXX lock_or?
+  assert(dstnode > 0);
+  mem_shareadd(pi, dstnode);
+}
+
+// A node freed its copies of the pages named in a release message:
+// drop it from their sharer sets, freeing any it alone pinned.
+static void
+net_rxrelease(uint8_t srcnode, net_release *rl, int len)
+{
+  int nrr = rl->nrr, i;
+  if (len < (int)sizeof(*rl) - NET_RELMAX*4 || nrr < 0 || nrr > NET_RELMAX
+      || len < (int)sizeof(*rl) - (NET_RELMAX - nrr)*4) {
+    warn("net_rxrelease: bad release message");
+    net_statev(NETEV_BAD);
+    return;
+  }
+
+  // net_lock keeps net_pullpte() from taking a reference meanwhile.
+  spinlock_acquire(&net_lock);
+  for (i = 0; i < nrr; i++) {
+    uint32_t rr = rl->rr[i];
+    pageinfo *pi = mem_phys2pi(RRADDR(rr));
+    if (RRNODE(rr) != net_node || pi <= &mem_pageinfo[1]
+        || pi >= &mem_pageinfo[mem_npage] || pi->home != 0)
+      continue;   // not one of ours
+    if (mem_sharedel(pi, srcnode)) {  // only it pinned
+      mem_stat(MEMSTAT_PINNED, -1);
+      mem_free(pi);
+    }
+  }
+  spinlock_release(&net_lock);
+}
+
+// We no longer hold a copy of the page at rr: tell its home, eventually.
+// Called from mem_free(), so just queue it up.
+void
+net_rrrelease(uint32_t rr)
+{
+  assert(RRNODE(rr) > 0 && RRNODE(rr) != net_node);
+  spinlock_acquire(&net_rellock);
+  if (net_nrelq < NET_RELQ)
+    net_relq[net_nrelq++] = rr;
+  spinlock_release(&net_rellock);
+}
+
+// Called by idle CPUs: poll the card if it's in polling mode,
+// or else send one batch of queued releases home, all those
+// for the home node of the oldest one, up to NET_RELMAX.
+// Returns true if there was anything to do.
+bool
+net_idle(void)
+{
+  if (e100_present && e100_poll())  // a burst left interrupts masked
+    return 1;
+  if (net_nrelq == 0)
+    return 0;
+
+  net_release rl;
+  spinlock_acquire(&net_rellock);
+  if (net_nrelq == 0) {
+    spinlock_release(&net_rellock);
+    return 0;
+  }
+  uint8_t node = RRNODE(net_relq[0]);
+  int i, j = 0;
+  rl.nrr = 0;
+  for (i = 0; i < net_nrelq; i++)
+    if (RRNODE(net_relq[i]) == node && rl.nrr < NET_RELMAX)
+      rl.rr[rl.nrr++] = net_relq[i];
+    else
+      net_relq[j++] = net_relq[i];
+  net_nrelq = j;
+  spinlock_release(&net_rellock);
+
+  net_ethsetup(&rl.eth, node);
+  rl.type = NET_RELEASE;
+  net_tx(&rl, sizeof(rl) - (NET_RELMAX - rl.nrr)*4, 0, 0);
+  return 1;
 }
 
 // Called from syscall handlers to migrate to another node if we need to.
@@ -201,10 +1068,28 @@ void gcc_noinline
 net_migrate(trapframe *tf, uint8_t dstnode, int entry)
 {
   proc *p = proc_cur();
+
+  // File data still on disk can't travel as it is: read it all in first.
+  // If we can't, blame the process with a page fault as systrap() does,
+  // if its parent is here to take it; away from home, try again later.
+  if (!disk_fill(tf, p->pdir, VM_USERLO, VM_USERHI - VM_USERLO, entry)) {
+    if (RRNODE(p->home) == net_node) {
+      if (entry == 0) {   // else tf already holds the trap
+        tf->trapno = T_PGFLT;
+        tf->err = 0;
+      }
+      proc_ret(tf, entry);
+    }
+    proc_save(p, tf, entry);
+    proc_ready(p);
+    proc_sched();
+  }
+
   // cprintf("net_migrate: saving eip %x for %p\n", tf->eip, p);
   proc_save(p, tf, entry);  // save current process's state
+  trace_log(TRACE_MIGRATE, p, dstnode);
 
-  assert(dstnode > 0 && dstnode <= NET_MAXNODES && dstnode != net_node);
+  assert(dstnode > 0 && dstnode != net_node);
 
   // Account for the fact that we've shared this process,
   // to make sure the remote refs it contains don't go away.
@@ -215,164 +1100,361 @@ net_migrate(trapframe *tf, uint8_t dstnode, int entry)
   assert(p->migrnext == NULL);  // Is this true?
   p->migrdest = dstnode;
 
+  // Send ahead what the destination will need first.
+  // Do it before the request, since once p gets there
+  // it could come straight back and change its pages.
+  net_push(p, dstnode);
+
   spinlock_acquire(&net_lock);
-  // If the list is empty, add p to the front
-  if(!net_migrlist) {
-    net_migrlist = p;
-  } else {
-    // Otherwise, go to the end of the list
-    proc *net_migrpoint = net_migrlist;
-    while(net_migrpoint->migrnext)
-      net_migrpoint = net_migrpoint->migrnext;
-    // Now net_migrtail->migrnext is NULL, so make it p
-    net_migrpoint->migrnext = p;
-  }
-  // cprintf("net_migrate: added proc. migrlist is now ");
-  // proc *np = net_migrlist;
-  // while(np) {
-  //   cprintf("%p->", np);
-  //   np = np->migrnext;
-  // }
-  // cprintf("END\n");
-  // Send request
-  net_txmigrq(p);
+  // Track the request by the home RR the reply will carry
+  proc **chain = &net_migrhash[NET_RRHASH(p->home)];
+  p->migrnext = *chain;
+  *chain = p;
+  net_nmigr++;
+  net_rtinit(&p->migrrt, dstnode);
+  net_peers[dstnode].nmigrwait++;
+
+  // Send the request now, unless requests we sent dstnode earlier are
+  // still unanswered: then it waits to go along with any others that
+  // set off for dstnode meanwhile, when the reply or the timer comes.
+  // So processes fanning out to a node together migrate together,
+  // at a cost of at most a round trip each.
+  if (net_peers[dstnode].nmigr == 0)
+    net_txmigrq(dstnode, 0);
+  net_armtimer();
   spinlock_release(&net_lock);
   // Do something else now
   proc_sched();
 }
 
-// Transmit a process migration request message
-// using the state in process 'p'.
-// This function does not cause p's state to change,
-// since we don't know if this migration request will be received
+// Number of entries of migrating process p's childnode[] worth sending.
+static int
+net_mignchild(proc *p)
+{
+  int nchild = PROC_CHILDREN;
+  while (nchild > 0 && p->childnode[nchild-1] == 0)
+    nchild--;
+  return nchild;
+}
+
+// Length of migrating process p's entry in a migration request.
+static int
+net_miglen(proc *p)
+{
+  int len = sizeof(net_migent) + offsetof(procstate, fx)
+      + sizeof(procstate) - offsetof(procstate, merge) + net_mignchild(p);
+  if (p->sv.pff & PFF_USEFPU)
+    len += sizeof(fxsave);
+  return ROUNDUP(len, 4);
+}
+
+// Pack migrating process p's state into a migration request at buf,
+// returning the length of the entry, as net_miglen() computes it.
+static int
+net_migpack(void *buf, proc *p)
+{
+  net_migent *me = buf;
+  uint8_t *d = (uint8_t*)(me + 1);
+  int nchild = net_mignchild(p);
+  me->home = p->home;
+  me->pdir = RRCONS(net_node, mem_phys(p->pdir), 0);
+  me->nchild = nchild;
+  me->fx = p->sv.pff & PFF_USEFPU;   // else there's no FPU state to send
+
+  int tail = sizeof(procstate) - offsetof(procstate, merge);
+  memcpy(d, &p->sv, offsetof(procstate, fx));
+  d += offsetof(procstate, fx);
+  memcpy(d, &p->sv.merge, tail);
+  d += tail;
+  if (me->fx) {
+    memcpy(d, &p->sv.fx, sizeof(fxsave));
+    d += sizeof(fxsave);
+  }
+  memcpy(d, p->childnode, nchild);
+  d += nchild;
+  me->len = ROUNDUP(d - (uint8_t*)buf, 4);
+  assert(me->len == net_miglen(p));
+  return me->len;
+}
+
+// Send dstnode migration requests for every process migrating there
+// that is due: not sent yet, or if now is nonzero, not answered in time.
+// Packs as many into each request as fit in a frame.
+// Sending doesn't change the processes' states,
+// since we don't know if the request will be received
 // until we get a reply via net_rxmigrp().
-void
-net_txmigrq(proc *p)
+static void
+net_txmigrq(uint8_t dstnode, uint64_t now)
 {
-  assert(p->state == PROC_MIGR);
   assert(spinlock_holding(&net_lock));
+  static uint32_t buf[NET_MAXPKT/4];  // protected by net_lock
+  net_migrq *rq = (net_migrq*) buf;
+  net_ethsetup(&rq->eth, dstnode);
+  rq->type = NET_MIGRQ;                        // As per net.h
+  rq->nproc = 0;
+  int len = sizeof(*rq), i;
+  proc *p;
+
+  net_txbegin();
+  for (i = 0; i < NET_HASHSIZE; i++)
+    for (p = net_migrhash[i]; p; p = p->migrnext) {
+      assert(p->state == PROC_MIGR);
+      if (p->migrdest != dstnode)
+        continue;
+      if (p->migrrt.tries == 0) {
+        net_peers[dstnode].nmigrwait--;
+        net_peers[dstnode].nmigr++;
+      } else if (now == 0 || !net_rtexpired(&p->migrrt, now))
+        continue;
+      else
+        net_statrexmit(dstnode);
+
+      if (rq->nproc == NET_MIGRMAX || len + net_miglen(p) > NET_MAXPKT) {
+        net_tx(rq, len, 0, 0);
+        rq->nproc = 0;
+        len = sizeof(*rq);
+      }
+      len += net_migpack((uint8_t*)buf + len, p);
+      rq->nproc++;
+      net_rtsent(&p->migrrt);
+    }
+  if (rq->nproc > 0)
+    net_tx(rq, len, 0, 0);
+  net_txend();
+}
 
-  // Make request from scratch
-  net_migrq rq;
-  net_ethsetup(&rq.eth, p->migrdest);
-  rq.type = NET_MIGRQ;                         // As per net.h
-  rq.home = p->home; 
-  rq.pdir = RRCONS(net_node, mem_phys(p->pdir), 0);
-  rq.save = p->sv;
-  // Send (No body)
-  net_tx(&rq, sizeof(rq), 0, 0);
+// Versions validate the copies of data pages other nodes keep
+// in their remote page caches (see net_pullpte()).
+// Pages given out by RR are written in place, with no fault to count
+// versions by, so a page's version is a hash of its contents:
+// computed by the home node when it sends the page or is asked
+// to validate it, and by the holder of a copy to see if that changed.
+static uint32_t
+net_pagehash(const void *pg)
+{
+  const uint32_t *w = pg;
+  uint32_t h = 2166136261u;   // FNV-1a, a word at a time
+  int i;
+  for (i = 0; i < PAGESIZE/4; i++)
+    h = (h ^ w[i]) * 16777619;
+  return h != 0 ? h : 1;
 }
 
-// This gets called by net_rx() to process a received migrq packet.
-void net_rxmigrq(net_migrq *migrq)
+// Tell rqnode that its version of the page at rr is current:
+// a whole-page reply with no data.
+static void
+net_txsame(uint8_t rqnode, uint32_t rr, uint32_t version)
+{
+  net_pullrphdr rph;
+  net_ethsetup(&rph.eth, rqnode);
+  rph.type = NET_PULLRP;
+  rph.rr = rr;
+  rph.part = 0;
+  rph.nparts = 3;
+  rph.enc = NET_ENC_SAME;
+  rph.pglev = PGLEV_PAGE;
+  rph.version = version;
+  net_tx(&rph, sizeof(rph), 0, 0);
+}
+
+// Send the needed parts of page pg to dstnode, as many consecutive ones
+// per frame as both our card and its card (whose MTU is mtu) take.
+static void
+net_txpage(uint8_t dstnode, int type, uint32_t rr, int pglev, int need,
+    int mtu, int encs, uint32_t version, void *pg)
 {
-  uint8_t srcnode = migrq->eth.src[5];
-  assert(srcnode > 0 && srcnode <= NET_MAXNODES);
+  mtu = MIN(mtu != 0 ? mtu : NET_MAXPKT, net_mtu);
+  int maxparts = (mtu - sizeof(net_pullrphdr)) / NET_PULLPART;
+  assert(maxparts >= 1);
+  int part = 0;
+  net_txbegin();
+  while (part < 3) {
+    if (!(need & (1 << part))) {
+      part++;
+      continue;
+    }
+    int n = 1;
+    while (n < maxparts && part + n < 3 && (need & (1 << (part + n))))
+      n++;
+    net_txpullrp(dstnode, type, rr, pglev, part, n, encs, version, pg);
+    part += n;
+  }
+  net_txend();
+}
 
+// Take in one process from a migration request, whose entry is me,
+// and start pulling its page directory.  Returns false if we couldn't,
+// so the source should resend it, or true if it should stop resending.
+static bool
+net_migin(net_migent *me)
+{
   // Do we already have a local proc corresponding to the remote one?
   proc *p = NULL;
-  if (RRNODE(migrq->home) == net_node) {  // Our proc returning home
-    p = mem_ptr(RRADDR(migrq->home));
+  if (RRNODE(me->home) == net_node) {  // Our proc returning home
+    p = proc_home(me->home);
   } else {  // Someone else's proc - have we seen it before?
-    pageinfo *pi = mem_rrlookup(migrq->home);
+    pageinfo *pi = mem_rrlookup(me->home);
     p = pi != NULL ? mem_pi2ptr(pi) : NULL;
   }
   if (p == NULL) {      // Unrecognized proc RR
-    p = proc_alloc(NULL, 0);  // Allocate new local proc
-    p->state = PROC_AWAY;   // Pretend it's been away
-    p->home = migrq->home;    // Record where proc originated
-    mem_rrtrack(migrq->home, mem_ptr2pi(p)); // Track for future
+    p = proc_allocaway(me->home);  // Allocate new local proc
+    if (p == NULL)
+      return 0;   // Drop; the source will resend
   }
-  assert(p->home == migrq->home);
+  assert(p->home == me->home);
 
   // If the proc isn't in the AWAY state, assume it's a duplicate packet.
   // XXX not very robust - should probably have sequence numbers too.
   if (p->state != PROC_AWAY) {
     cprintf("net_rxmigrq: proc %p is already local\n", p);
-    return net_txmigrp(srcnode, p->home);
+    net_statev(NETEV_DUP);
+    return 1;
   }
 
   // Copy the CPU state and pdir RR into our proc struct
-  p->sv = migrq->save;
-  p->rrpdir = migrq->pdir;
+  uint8_t *d = (uint8_t*)(me + 1);
+  int tail = sizeof(procstate) - offsetof(procstate, merge);
+  memset(&p->sv, 0, sizeof(p->sv));
+  memcpy(&p->sv, d, offsetof(procstate, fx));
+  d += offsetof(procstate, fx);
+  memcpy(&p->sv.merge, d, tail);
+  d += tail;
+  if (me->fx) {
+    memcpy(&p->sv.fx, d, sizeof(fxsave));
+    d += sizeof(fxsave);
+  }
+  memset(p->childnode, 0, sizeof(p->childnode));
+  memcpy(p->childnode, d, me->nchild);
+  proc_fpuforget(p);
+  proc_setprio(p);
+  p->rrpdir = me->pdir;
   p->pullva = VM_USERLO;  // pull all user space from USERLO to USERHI
 
-  // Acknowledge the migration request so the source node stops resending
-  net_txmigrp(srcnode, p->home);
-
   // Free the proc's old page directory and allocate a fresh one.
   // (The old pdir will hang around until all shared copies disappear.)
   mem_decref(mem_ptr2pi(p->pdir), pmap_freepdir);
   p->pdir = pmap_newpdir(); assert(p->pdir);
+  pmap_dirtyall(p->dirty);  // writes made elsewhere weren't tracked
 
   // Now we need to pull over the page directory next,
   // before we can do anything else.
   // Just pull it straight into our proc's page directory;
   // XXX first free old contents of pdir
 
-  net_pull(p, p->rrpdir, p->pdir, PGLEV_PDIR);
+  net_pull(p, p->rrpdir, p->pdir, PGLEV_PDIR, 0, NULL);
+  return 1;
 }
 
-// Transmit a migration reply to a given node, for a given proc's home RR
+// This gets called by net_rx() to process a received migrq packet.
+void net_rxmigrq(uint8_t srcnode, net_migrq *migrq, int len)
+{
+  uint32_t homes[NET_MIGRMAX];
+  int nhome = 0, off = sizeof(*migrq), i;
+  if (len < sizeof(*migrq) || migrq->nproc < 1
+      || migrq->nproc > NET_MIGRMAX) {
+    warn("net_rxmigrq: malformed request");
+    net_statev(NETEV_BAD);
+    return;
+  }
+  for (i = 0; i < migrq->nproc; i++) {
+    net_migent *me = (net_migent*)((uint8_t*)migrq + off);
+    bool ok = off + sizeof(*me) <= len;
+    if (ok) {
+      int need = sizeof(*me) + offsetof(procstate, fx)
+          + sizeof(procstate) - offsetof(procstate, merge)
+          + (me->fx ? sizeof(fxsave) : 0) + me->nchild;
+      ok = me->nchild <= PROC_CHILDREN && me->len >= need
+          && off + me->len <= len;
+    }
+    if (!ok) {
+      warn("net_rxmigrq: malformed request");
+      net_statev(NETEV_BAD);
+      break;
+    }
+    if (net_migin(me))
+      homes[nhome++] = me->home;
+    off += me->len;
+  }
+
+  // Acknowledge the processes we took, so the source stops resending.
+  if (nhome > 0)
+    net_txmigrp(srcnode, homes, nhome);
+}
+
+// Transmit a migration reply to a given node, for some procs' home RRs
 void
-net_txmigrp(uint8_t dstnode, uint32_t prochome)
+net_txmigrp(uint8_t dstnode, uint32_t *homes, int nhome)
 {
   net_migrp rp;
+  assert(nhome > 0 && nhome <= NET_MIGRMAX);
   net_ethsetup(&rp.eth, dstnode);
   rp.type = NET_MIGRP;
-  rp.home = prochome;
-  net_tx(&rp, sizeof(rp), 0, 0);
+  rp.nhome = nhome;
+  memcpy(rp.home, homes, nhome * sizeof(uint32_t));
+  net_tx(&rp, offsetof(net_migrp, home[nhome]), 0, 0);
 }
 
 // Receive a migrate reply message.
-void net_rxmigrp(net_migrp *migrp)
+void net_rxmigrp(uint8_t msgsrcnode, net_migrp *migrp, int len)
 {
-  uint8_t msgsrcnode = migrp->eth.src[5];
-  assert(msgsrcnode > 0 && msgsrcnode <= NET_MAXNODES);
-  proc *p = NULL;
+  if (len < offsetof(net_migrp, home) || migrp->nhome < 1 || migrp->nhome > NET_MIGRMAX
+      || len < offsetof(net_migrp, home[migrp->nhome])) {
+    warn("net_rxmigrp: malformed reply");
+    net_statev(NETEV_BAD);
+    return;
+  }
 
-  spinlock_acquire(&net_lock);
-  // First node is the one!
-  if(net_migrlist && net_migrlist->home == migrp->home) {
-    p = net_migrlist;
-    // Move the migrlist head
-    net_migrlist = net_migrlist->migrnext;
-  } else {
-    // Scan through the list for it
-    proc *net_migrpoint = net_migrlist;
-    while(net_migrpoint) {
-      // Found it
-      if(net_migrpoint->migrnext->home == migrp->home) {
-        p = net_migrpoint->migrnext;
-        // Point this migrnext to the one after the_one
-        net_migrpoint->migrnext = p->migrnext;
-        // Finish
+  int i;
+  for (i = 0; i < migrp->nhome; i++) {
+    uint32_t home = migrp->home[i];
+    proc *p = NULL;
+
+    spinlock_acquire(&net_lock);
+    // Find and unlink the migrating proc on its home's chain
+    proc **pp;
+    for (pp = &net_migrhash[NET_RRHASH(home)]; (p = *pp) != NULL;
+        pp = &p->migrnext)
+      if (p->home == home && p->migrrt.tries != 0) {
+        *pp = p->migrnext;
+        net_nmigr--;
+        net_peers[p->migrdest].nmigr--;
+        net_rtsample(&p->migrrt, msgsrcnode);
+        net_statlat(NETLAT_MIGR, &p->migrrt);
         break;
       }
-      net_migrpoint = net_migrpoint->migrnext;
+    spinlock_release(&net_lock);
+    // If we didn't find it, nothing to do...
+    if(!p) {
+      cprintf("Unable to find process %p\n", RRADDR(home));
+      net_statev(NETEV_DUP);
+      continue;
     }
-  }
-  spinlock_release(&net_lock);
-  // If we didn't find it, nothing to do...
-  if(!p) {
-    cprintf("Unable to find process %p\n", RRADDR(migrp->home));
-    return;
+
+    // Mark the process correctly
+    p->migrnext = NULL;
+    p->migrdest = 0;
+    p->state = PROC_AWAY;
   }
 
-  // Mark the process correctly
-  p->migrnext = NULL;
-  p->migrdest = 0;
-  p->state = PROC_AWAY;
+  // Send whatever queued up behind the requests just answered.
+  spinlock_acquire(&net_lock);
+  if (net_peers[msgsrcnode].nmigrwait > 0)
+    net_txmigrq(msgsrcnode, 0);
+  spinlock_release(&net_lock);
 }
 
-// Pull a page via a remote ref and put process p to sleep waiting for it.
+// Pull a page via a remote ref into one of process p's free pull slots,
+// and put p to sleep, if it isn't already, until its pulls are done.
+// If version is nonzero, pg is a copy of that version we already have,
+// mapped by *pte, and the home node need only confirm it's current.
 void
-net_pull(proc *p, uint32_t rr, void *pg, int pglevel)
+net_pull(proc *p, uint32_t rr, void *pg, int pglevel,
+	uint32_t version, uint32_t *pte)
 {
   //cprintf("net_pull: proc %x rr %x -> %x level %d\n",
   //  p, rr, pg, pglevel);
   uint8_t dstnode = RRNODE(rr);
-  assert(dstnode > 0 && dstnode <= NET_MAXNODES);
+  assert(dstnode > 0);
   assert(dstnode != net_node);
   assert(pglevel >= 0 && pglevel <= 2);
 
@@ -380,108 +1462,324 @@ net_pull(proc *p, uint32_t rr, void *pg, int pglevel)
   // save in the proc structure all information needed for the pull,
   // and transmit a pull message using net_txpullrq().
 
-  // assert(spinlock_holding(&p->lock));
   spinlock_acquire(&net_lock);
 
-  if(!net_pulllist) {
-    net_pulllist = p;
-  } else {
-    // Otherwise, go to the end of the list
-    proc *net_pullpoint = net_pulllist;
-    while(net_pullpoint->pullnext)
-      net_pullpoint = net_pullpoint->pullnext;
-    // Now net_pulltail->pullnext is NULL, so make it p
-    net_pullpoint->pullnext = p;
-  }
+  net_pullslot *s = p->pull;
+  while (s->rr != 0)
+    s++;
+  assert(s < &p->pull[NET_PULLWIN]);  // caller checked p->npull
+
+  // Track the request by the RR the reply will carry
+  net_pullslot **chain = &net_pullhash[NET_RRHASH(rr)];
+  s->next = *chain;
+  *chain = s;
+  net_npull++;
+  p->npull++;
+  trace_log(TRACE_PULL, p, dstnode);
   p->state    = PROC_PULL;
-  p->pullrr   = rr;
-  p->pglev    = pglevel;
-  p->pullpg   = pg;
-  p->arrived  = 0;
-  net_txpullrq(p);
+  s->proc     = p;
+  s->rr       = rr;
+  s->pglev    = pglevel;
+  s->pg       = pg;
+  s->arrived  = 0;
+  s->filling  = 0;
+  s->version  = version;
+  s->rpversion = 0;
+  s->pte      = pte;
+  s->follow   = 0;
+  net_rtinit(&s->rt, dstnode);
+  net_txpullrq(s);
+  net_armtimer();
+  spinlock_release(&net_lock);
+}
+
+// If another process is already pulling rr into page pg, as when
+// processes forked from the same one migrate here together,
+// have p wait for that pull to finish too, instead of pulling rr
+// itself, in one of its free pull slots; returns true if so.
+static bool
+net_pullfollow(proc *p, uint32_t rr, void *pg, int pglevel)
+{
+  spinlock_acquire(&net_lock);
+  net_pullslot *s, **chain = &net_pullhash[NET_RRHASH(rr)];
+  for (s = *chain; s != NULL; s = s->next)
+    if (s->rr == rr && s->pg == pg && !s->follow)
+      break;
+  if (s == NULL) {
+    spinlock_release(&net_lock);
+    return 0;
+  }
+
+  net_pullslot *f = p->pull;
+  while (f->rr != 0)
+    f++;
+  assert(f < &p->pull[NET_PULLWIN]);  // caller checked p->npull
+  f->next = *chain;
+  *chain = f;
+  net_npull++;
+  p->npull++;
+  p->state   = PROC_PULL;
+  f->proc    = p;
+  f->rr      = rr;
+  f->pglev   = pglevel;
+  f->pg      = pg;
+  f->arrived = 0;
+  f->filling = 0;
+  f->version = 0;
+  f->rpversion = 0;
+  f->pte     = NULL;
+  f->follow  = 1;
+  net_statev(NETEV_FOLLOW);
   spinlock_release(&net_lock);
+  return 1;
+}
+
+// A pull of rr into page pg just finished: finish the slots following it
+// (see net_pullfollow()), and let their processes pull what's next.
+static void
+net_pullwake(uint32_t rr, void *pg)
+{
+  while (1) {
+    spinlock_acquire(&net_lock);
+    net_pullslot *s, **sp;
+    for (sp = &net_pullhash[NET_RRHASH(rr)]; (s = *sp) != NULL;
+        sp = &s->next)
+      if (s->rr == rr && s->pg == pg && s->follow)
+        break;
+    if (s == NULL) {
+      spinlock_release(&net_lock);
+      return;
+    }
+    proc *p = s->proc;
+    *sp = s->next;
+    s->rr = 0;
+    s->follow = 0;
+    net_npull--;
+    p->npull--;
+    spinlock_release(&net_lock);
+    net_pullmore(p);
+  }
 }
 
 // Transmit a page pull request on behalf of some process.
 void
-net_txpullrq(proc *p)
+net_txpullrq(net_pullslot *s)
 {
-  assert(p->state == PROC_PULL);
+  assert(s->proc->state == PROC_PULL);
   assert(spinlock_holding(&net_lock));
+  assert(!s->follow);
   
   net_pullrq rq;
-  net_ethsetup(&rq.eth, RRNODE(p->pullrr));
+  net_ethsetup(&rq.eth, RRNODE(s->rr));
   rq.type = NET_PULLRQ;
-  rq.rr = p->pullrr;
-  rq.pglev = p->pglev;
-  rq.need = p->arrived ^ 7; // ~arrived lower bits
+  rq.rr = s->rr;
+  rq.pglev = s->pglev;
+  rq.need = s->arrived ^ 7; // ~arrived lower bits
+  rq.mtu = net_mtu;         // so the reply can use jumbo frames
+  rq.encs = NET_ENC_ALL;
+  rq.version = s->version;
 
   // No body, just header
   // cprintf("txpullrq: sending for %p, addr %p, pglev %d\n", 
-  //   p, RRADDR(p->pullrr), p->pglev);
+  //   s->proc, RRADDR(s->rr), s->pglev);
+  net_rtsent(&s->rt);
   net_tx(&rq, sizeof(rq), 0, 0);
 }
 
 // Process a page pull request we've received.
 void
-net_rxpullrq(net_pullrq *rq)
+net_rxpullrq(uint8_t rqnode, net_pullrq *rq)
 {
   assert(rq->type == NET_PULLRQ);
-  uint8_t rqnode = rq->eth.src[5];
-  assert(rqnode > 0 && rqnode <= NET_MAXNODES && rqnode != net_node);
 
   // Validate the requested node number and page address.
   uint32_t rr = rq->rr;
   if (RRNODE(rr) != net_node) {
     warn("net_rxpullrq: pull request came to wrong node!?");
+    net_statev(NETEV_BAD);
     return;
   }
   uint32_t addr = RRADDR(rr);
   pageinfo *pi = mem_phys2pi(addr);
   if (pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]) {
     warn("net_rxpullrq: pull request for invalid page %x", addr);
-    return;
-  }
-  if (pi->refcount == 0) {
-    warn("net_rxpullrq: pull request for free page %x", addr);
+    net_statev(NETEV_BAD);
     return;
   }
   if (pi->home != 0) {
     warn("net_rxpullrq: pull request for unowned page %x", addr);
+    net_statev(NETEV_BAD);
     return;
   }
-  void *pg = mem_pi2ptr(pi);
 
-  // OK, looks legit as far as we can tell.
-  // Mark the page shared, since we're about to share it.
-  net_rrshare(pg, rqnode);
-
-  // First part needed
-  if(rq->need & 1) {
-    net_txpullrp(rqnode, rr, rq->pglev, 0, (void*)addr);
-  }
-  if(rq->need & 2) {
-    net_txpullrp(rqnode, rr, rq->pglev, 1, (void*)addr);
+  // Mark the page shared, since we're about to share it,
+  // provided it's still in use: once the requester is a sharer
+  // it stays pinned while we read it, and until it's released.
+  if (!mem_shareaddlive(pi, rqnode)) {
+    warn("net_rxpullrq: pull request for free page %x", addr);
+    net_statev(NETEV_BAD);
+    return;
   }
-  if(rq->need & 4) {
-    net_txpullrp(rqnode, rr, rq->pglev, 2, (void*)addr);
+  void *pg = mem_pi2ptr(pi);
+
+  // Remote nodes only understand page tables, not superpages.
+  if (rq->pglev == PGLEV_PDIR && !pmap_splitall(pg)) {
+    warn("net_rxpullrq: no memory to split superpages");
+    return;   // the requester will retry
   }
-  // Mark this page shared with the requesting node.
-  // (XXX might be necessarily only for pdir/ptab pages.)
-  assert(NET_MAXNODES <= sizeof(pi->shared)*8);
-  pi->shared |= 1 << (rqnode-1);
+
+  // Remember what the requester takes, for pushing pages to it.
+  // (Racy but harmless: these only ever change on a driver upgrade.)
+  net_peers[rqnode].mtu = rq->mtu;
+  net_peers[rqnode].encs = rq->encs;
+
+  // If the requester's copy is current, just say so.
+  uint32_t version = rq->pglev == PGLEV_PAGE ? net_pagehash(pg) : 0;
+  if (rq->version != 0 && rq->version == version)
+    net_txsame(rqnode, rr, version);
+  else
+    net_txpage(rqnode, NET_PULLRP, rr, rq->pglev, rq->need, rq->mtu,
+        rq->encs, version, (void*)addr);
 }
 
 static const int partlen[3] = {
   NET_PULLPART0, NET_PULLPART1, NET_PULLPART2};
 
+// Length of the RLE run that could start at in[i], given the last word;
+// sets *kind to its NET_RLE_x kind, or returns 1 if there is no run.
+static int
+net_rlerun(const uint32_t *in, int i, int n, uint32_t last, uint32_t *kind)
+{
+  int j;
+  uint32_t w = in[i];
+  if (w == 0) {
+    for (j = i + 1; j < n && in[j] == 0; j++)
+      ;
+    *kind = NET_RLE_ZERO;
+  } else if (w == last) {
+    for (j = i + 1; j < n && in[j] == last; j++)
+      ;
+    *kind = NET_RLE_REPEAT;
+  } else if (w == last + PAGESIZE) {
+    for (j = i + 1; j < n && in[j] == in[j-1] + PAGESIZE; j++)
+      ;
+    *kind = NET_RLE_STRIDE;
+  } else
+    return 1;
+  return j - i;
+}
+
+// RLE-encode n words from in into out (see net.h),
+// returning the encoded length in bytes,
+// or 0 if that would be no shorter than the raw words.
+static int
+net_rleencode(const uint32_t *in, int n, uint32_t *out)
+{
+  int i = 0, o = 0;
+  uint32_t last = 0, kind;
+  while (i < n) {
+    int run = net_rlerun(in, i, n, last, &kind);
+    if (run == 1) {   // literal words until the next real run
+      int lit = i;
+      do
+        last = in[i++];
+      while (i < n && net_rlerun(in, i, n, last, &kind) == 1);
+      run = i - lit;
+      if (o + 1 + run >= n)
+        return 0;
+      out[o++] = NET_RLE_LIT | run;
+      memcpy(&out[o], &in[lit], run * 4);
+      o += run;
+      continue;
+    }
+    if (o + 1 >= n)
+      return 0;
+    out[o++] = kind | run;
+    last = in[i + run - 1];
+    i += run;
+  }
+  return o * 4;
+}
+
+// Decode an RLE-encoded reply of inlen bytes into exactly n words.
+static bool
+net_rledecode(const uint32_t *in, int inlen, uint32_t *out, int n)
+{
+  int i = 0, o = 0, inwords = inlen / 4;
+  uint32_t last = 0;
+  if (inlen & 3)
+    return 0;
+  while (i < inwords) {
+    uint32_t t = in[i++], count = t & NET_RLE_COUNT;
+    if (count > n - o)
+      return 0;
+    switch (t & NET_RLE_KIND) {
+    case NET_RLE_ZERO:
+      memset(&out[o], 0, count * 4);
+      last = 0;
+      break;
+    case NET_RLE_REPEAT:
+      while (count-- > 0)
+        out[o++] = last;
+      continue;
+    case NET_RLE_STRIDE:
+      while (count-- > 0)
+        out[o++] = last = last + PAGESIZE;
+      continue;
+    case NET_RLE_LIT:
+      if (count == 0 || count > inwords - i)
+        return 0;
+      memcpy(&out[o], &in[i], count * 4);
+      i += count;
+      last = out[o + count - 1];
+      break;
+    }
+    o += count;
+  }
+  return o == n;
+}
+
+// Convert one of our PDEs or PTEs into the remote reference
+// node dstnode should see for it.
+static uint32_t
+net_pte2rr(pte_t tab, uint8_t dstnode)
+{
+  // If its a global pte then dont send it
+  if(tab & PTE_G)
+    return 0;
+  // If its a remote reference, just send it
+  else if(tab & PTE_REMOTE)
+    return tab;
+  // If its a zero page, just send RR_REMOTE
+  else if(PGADDR(tab) == PTE_ZERO)
+    return (tab & RR_RW) | RR_REMOTE;
+  // Otherwise its a user-space pte that needs to be transferred
+  else {
+    pageinfo *p = mem_phys2pi(PGADDR(tab));
+    if(p->home == 0)    // This is our comps page
+      return RRCONS(net_node, PGADDR(tab), tab & RR_RW);
+    // Send back remote ref.  dstnode might not pull it for a while,
+    // so keep our copy for good: we can't say when it's safe to release.
+    if(RRNODE(p->home) != dstnode)
+      net_rrshare(mem_pi2ptr(p), dstnode);
+    return p->home;
+  }
+}
+
+// Send parts part through part+nparts-1 of page pg in one reply
+// of the given type, encoded with one of the encodings in the
+// requester's encs if that makes it shorter.
 void
-net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg)
+net_txpullrp(uint8_t rqnode, int type, uint32_t rr, int pglev,
+		int part, int nparts, int encs, uint32_t version, void *pg)
 {
   // Find appropriate part of this page
+  assert(part >= 0 && nparts >= 1 && part + nparts <= 3);
   void *data = pg + NET_PULLPART*part;
-  int len = partlen[part];
-  assert(len <= NET_PULLPART);
+  int len = 0, i;
+  for (i = part; i < part + nparts; i++)
+    len += partlen[i];
+  assert(sizeof(net_pullrphdr) + len <= net_mtu);
   assert((len & 3) == 0);   // must contain only whole PTEs
   assert(RRADDR(rr) == (uint32_t)pg);
 
@@ -490,136 +1788,321 @@ net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg)
   // XXX it's not ideal that we just believe the requestor's word
   // about whether this is a page table or regular page;
   // would be better if we kept our own type info in struct pageinfo.
+  // Convert RRs and encode into a pair of scratch pages:
+  // a multi-part reply wouldn't fit on the kernel stack.
+  // Without them, send one raw part at a time.
   int nrrs = len/4;
-  uint32_t rrs[nrrs];
+  pageinfo *scratch = NULL;
+  if (pglev > 0 || (encs & (1 << NET_ENC_RLE)))
+    scratch = mem_allocn(1);
+  if (scratch == NULL && pglev > 0 && nparts > 1) {
+    warn("net_txpullrp: no memory for RRs; sending one part");
+    return net_txpullrp(rqnode, type, rr, pglev, part, 1, 0, version, pg);
+  }
+  uint32_t rrsbuf[scratch == NULL && pglev > 0 ? nrrs : 1];
+  uint32_t *rrs = scratch ? mem_pi2ptr(scratch) : rrsbuf;
   if (pglev > 0) {
     const uint32_t *pt = data;
-    int i;
-    for(i = 0; i < nrrs; i++) {
-      pte_t tab = pt[i];
-      // If its a global pte then dont send it
-      if(tab & PTE_G)
-        rrs[i] = 0;
-      // If its a remote reference, just send it
-      else if(tab & PTE_REMOTE)
-        rrs[i] = tab;
-      // If its a zero page, just send RR_REMOTE
-      else if(PGADDR(tab) == PTE_ZERO)
-        rrs[i] = (tab & RR_RW) | RR_REMOTE;
-      // Otherwise its a user-space pte that needs to be transferred
-      else {
-        pageinfo *p = mem_phys2pi(PGADDR(tab));
-        if(p->home == 0)    // This is our comps page
-          rrs[i] = RRCONS(net_node, PGADDR(tab), tab & RR_RW);
-        else
-          rrs[i] = p->home; // Send back remote ref
-      }
-    }
+    for(i = 0; i < nrrs; i++)
+      rrs[i] = net_pte2rr(pt[i], rqnode);
     data = rrs; // Send RRs instead of original page.
   }
 
   // Build and send the message
   net_pullrphdr rph;
   net_ethsetup(&rph.eth, rqnode);
-  rph.type = NET_PULLRP;
+  rph.type = type;
   rph.rr = rr;
   rph.part = part;
-  net_tx(&rph, sizeof(rph), data, len);
+  rph.nparts = nparts;
+  rph.pglev = pglev;
+  rph.version = version;
+  rph.enc = NET_ENC_RAW;
+  if (scratch != NULL && (encs & (1 << NET_ENC_RLE))) {
+    uint32_t *rle = mem_pi2ptr(scratch) + PAGESIZE;
+    int rlelen = net_rleencode(data, nrrs, rle);
+    if (rlelen > 0) {
+      rph.enc = NET_ENC_RLE;
+      data = rle;
+      len = rlelen;
+    }
+  }
+  // Raw page data goes out straight from the page, without a copy.
+  bool inplace = pglev == 0 && rph.enc == NET_ENC_RAW;
+  net_txref(&rph, sizeof(rph), data, len, inplace ? mem_ptr2pi(pg) : NULL);
+  if (scratch != NULL)
+    mem_freen(scratch, 1);
+}
+
+// Check which parts of a page a pull or push reply carries,
+// given that the parts in 'arrived' are already there.
+// Returns their mask, or 0 if the reply is no good or a duplicate.
+static int
+net_rxpartmask(net_pullrphdr *rp, int arrived)
+{
+  int part = rp->part, nparts = rp->nparts;
+  if (part < 0 || part > 2 || nparts < 1 || part + nparts > 3) {
+    warn("net_rxparts: invalid parts %d+%d", part, nparts);
+    net_statev(NETEV_BAD);
+    return 0;
+  }
+  int mask = ((1 << nparts) - 1) << part;
+  if ((arrived & mask) == mask) {
+    warn("net_rxparts: part %d already arrived", part);
+    net_statev(NETEV_DUP);
+    return 0;
+  }
+  return mask;
+}
+
+// Fill the parts a reply of len bytes carries, already checked
+// by net_rxpartmask(), into page pg.  Returns false if it's no good.
+static bool
+net_rxfill(net_pullrphdr *rp, int len, void *pg)
+{
+  int part = rp->part, nparts = rp->nparts;
+  int datalen = len - sizeof(*rp), i, partslen = 0;
+  for (i = part; i < part + nparts; i++)
+    partslen += partlen[i];
+  if (rp->enc == NET_ENC_RLE) {   // Decode straight into the page
+    if (!net_rledecode((uint32_t*)rp->data, datalen,
+        pg + NET_PULLPART*part, partslen / 4)) {
+      warn("net_rxparts: part %d bad encoding", part);
+      net_statev(NETEV_BAD);
+      return 0;
+    }
+  } else if (rp->enc == NET_ENC_RAW && datalen == partslen) {
+    memcpy(pg + NET_PULLPART*part, rp->data, datalen);
+  } else {
+    warn("net_rxparts: part %d wrong size %d", part, datalen);
+    net_statev(NETEV_BAD);
+    return 0;
+  }
+  return 1;
+}
+
+// Check a pull or push reply of len bytes and fill the parts it carries
+// into page pg, of which the parts in 'arrived' are already there.
+// Returns the mask of parts filled in, or 0 if the reply was no good.
+static int
+net_rxparts(net_pullrphdr *rp, int len, void *pg, int arrived)
+{
+  int mask = net_rxpartmask(rp, arrived);
+  if (mask == 0 || !net_rxfill(rp, len, pg))
+    return 0;
+  return mask;
+}
+
+// The home node of the cached copy pull s is validating says it changed,
+// and is sending the page afresh: switch the pull, and the entry mapping
+// the copy, to a new page for it.  The old copy is no longer one.
+static bool
+net_pullchanged(net_pullslot *s)
+{
+  assert(spinlock_holding(&net_lock));
+  pageinfo *pi = mem_alloc();
+  if (pi == NULL)
+    return 0;
+  mem_incref(pi);
+  pageinfo *cached = mem_ptr2pi(s->pg);
+  mem_rrforget(cached);
+  mem_rrtracknew(s->rr, pi);  // unless someone's pulling it afresh too
+  pi->shared = NET_SELFSHARE;  // pinned as a cached copy
+  *s->pte = mem_pi2phys(pi) | (*s->pte & ~PGADDR(~0));
+  mem_decref(cached, mem_free);  // the entry's reference is now pi's
+  s->pg = mem_pi2ptr(pi);
+  s->version = 0;
+  return 1;
 }
 
 void
 net_rxpullrp(net_pullrphdr *rp, int len)
 {
-  static const int partlen[3] = {
-    NET_PULLPART0, NET_PULLPART1, NET_PULLPART2};
-
   assert(rp->type == NET_PULLRP);
 
   spinlock_acquire(&net_lock);
-  // Find the process waiting for this pull reply, if any.
-  proc *p, **pp;
-  int part = rp->part;
+  // Find the pull this reply is for, if any.
+  net_pullslot *s, **sp;
 
   // cprintf("rxpullrp (part %d): data: %p, len: %d, datalen: %d, rr: %d\n",
   //  rp->part+1, rp->data, len, len - sizeof(*rp), rp->rr);
-  for (pp = &net_pulllist; (p = *pp) != NULL; pp = &p->pullnext) {
-    assert(p->state == PROC_PULL);
-    if (p->pullrr == rp->rr)
+  for (sp = &net_pullhash[NET_RRHASH(rp->rr)]; (s = *sp) != NULL;
+      sp = &s->next) {
+    assert(s->proc->state == PROC_PULL);
+    if (s->rr == rp->rr && !s->follow)
       break;
   }
-  if (p == NULL) {  // Probably a duplicate due to retransmission
+  if (s == NULL) {  // Probably a duplicate due to retransmission
     //warn("net_rxpullrp: no process waiting for RR %x", rp->rr);
+    net_statev(NETEV_DUP);
     return spinlock_release(&net_lock);
   }
-  if (part < 0 || part > 2) {
-    warn("net_rxpullrp: invalid part number %d", part);
-    return spinlock_release(&net_lock);
-  }
-  if (p->arrived & (1 << rp->part)) {
-    warn("net_rxpullrp: part %d already arrived", part);
-    return spinlock_release(&net_lock);
+
+  // Fill in the appropriate part of the page,
+  // or if validating a cached copy, see if the home node kept it.
+  int mask;
+  bool same = rp->enc == NET_ENC_SAME;
+  if (same) {
+    if (s->filling != 0)  // can't complete under a CPU filling parts
+      return spinlock_release(&net_lock);
+    if (s->version == 0 || rp->version != s->version
+        || len != sizeof(*rp)) {
+      warn("net_rxpullrp: bogus validation of RR %x", rp->rr);
+      net_statev(NETEV_BAD);
+      return spinlock_release(&net_lock);
+    }
+    mask = 7;
+  } else {
+    if (s->version != 0 && !net_pullchanged(s))
+      return spinlock_release(&net_lock);  // try again on retransmit
+    mask = net_rxpartmask(rp, s->arrived | s->filling);
+    if (mask == 0)
+      return spinlock_release(&net_lock);
+
+    // Copy the data straight from the receive buffer into place
+    // without net_lock, so that CPUs handling other replies
+    // can do the same meanwhile.  Claiming the parts in s->filling
+    // keeps the slot from completing, and so from being reused.
+    s->filling |= mask;
+    spinlock_release(&net_lock);
+    bool ok = net_rxfill(rp, len, s->pg);
+    spinlock_acquire(&net_lock);
+    s->filling &= ~mask;
+    if (!ok)
+      return spinlock_release(&net_lock);
   }
-  int datalen = len - sizeof(*rp);
-  if (datalen != partlen[rp->part]) {
-    warn("net_rxpullrp: part %d wrong size %d", part, datalen);
-    return spinlock_release(&net_lock);
+  net_rtsample(&s->rt, RRNODE(s->rr));
+
+  // The home node versions each reply as of the request it answers.
+  // Parts answering requests sent before and after the page changed
+  // there make a copy of no one version: leave it unversioned then,
+  // so it's never validated against either, but pulled afresh.
+  if (s->arrived == 0)
+    s->rpversion = rp->version;
+  else if (rp->version != s->rpversion)
+    s->rpversion = 0;
+  s->arrived |= mask;           // Mark these parts arrived.
+  if (s->arrived != 7) {        // Wait for remaining parts
+    spinlock_release(&net_lock);
+    return;
   }
 
-  // Fill in the appropriate part of the page.
-  memcpy(p->pullpg + NET_PULLPART*part, rp->data, datalen);
-  p->arrived |= 1 << rp->part;  // Mark this part arrived.
-  if (p->arrived == 7)          // All three parts arrived?
-    *pp = p->pullnext;          // Remove from list of waiting procs.
-
+  // All three parts arrived: free the slot.
+  net_statlat(same ? NETLAT_VALIDATE : NETLAT_PULL, &s->rt);
+  proc *p = s->proc;
+  int pglev = s->pglev;
+  uint32_t *pg = s->pg;
+  // Other pulls on our chain may have come and gone while we filled
+  // without net_lock, so find our predecessor afresh.
+  for (sp = &net_pullhash[NET_RRHASH(s->rr)]; *sp != s; sp = &(*sp)->next)
+    assert(*sp != NULL);
+  *sp = s->next;                // Remove from list of waiting pulls.
+  s->rr = 0;
+  net_npull--;
+  p->npull--;
+  if (pglev == PGLEV_PAGE)
+    mem_ptr2pi(pg)->version = s->rpversion;
   spinlock_release(&net_lock);
 
-  if (p->arrived != 7)
-    return;     // Wait for remaining parts
+  mem_stat(same ? MEMSTAT_VALIDATED : MEMSTAT_PULLED, 1);
+  if (pglev == PGLEV_PTAB) // freed via pmap_freeptab(), so count it
+    mem_stat(MEMSTAT_PTAB, 1);
 
   // If this was a page directory, reinitialize the kernel portions.
-  if (p->pglev == PGLEV_PDIR) {
-    uint32_t *pdir = p->pullpg;
+  if (pglev == PGLEV_PDIR) {
     int i;
     for (i = 0; i < NPDENTRIES; i++) {
       if (i == PDX(VM_USERLO))  // skip user area
         i = PDX(VM_USERHI);
-      pdir[i] = pmap_bootpdir[i];
+      pg[i] = pmap_bootpdir[i];
     }
   }
 
   // Done - what else does this proc need to pull before it can run?
   // Remove/disable this code if the VM system supports pull-on-demand.
-  while (p->pullva < VM_USERHI) {
+  // Likewise for any procs that were waiting on this same pull.
+  net_pullmore(p);
+  if (pglev != PGLEV_PDIR)
+    net_pullwake(rp->rr, pg);
+}
+
+// Is page pg being pulled into for process p right now?
+static bool
+net_pulling(proc *p, uint32_t pg)
+{
+  int i;
+  for (i = 0; i < NET_PULLWIN; i++)
+    if (p->pull[i].rr != 0 && mem_phys(p->pull[i].pg) == pg)
+      return 1;
+  return 0;
+}
+
+// Pull in whatever migrating process p still needs before it can run,
+// with up to NET_PULLWIN pulls in flight, and make p ready when done.
+// Called whenever one of p's pulls completes.  Walks p's address space
+// from p->pullva, requesting every remote page table and page it finds
+// until its slots are full, and skipping the ones still in flight
+// (including pages in tables that haven't arrived yet), so that
+// when a page table arrives, the pages it refers to are all requested
+// together instead of one round trip at a time.
+// p->pullva only advances past what has fully arrived.
+static void
+net_pullmore(proc *p)
+{
+  spinlock_acquire(&p->lock);   // another CPU may complete a pull too
+  if (p->state != PROC_PULL) {  // someone already finished it
+    spinlock_release(&p->lock);
+    return;
+  }
+
+  bool complete = 1;  // everything from p->pullva to va has arrived
+  uint32_t va = p->pullva;
+  while (va < VM_USERHI) {
 
     // Pull or traverse PDE to find page table.
-    uint32_t *pde = &p->pdir[PDX(p->pullva)];
+    uint32_t *pde = &p->pdir[PDX(va)];
     if (*pde & PTE_REMOTE) {  // Need to pull remote ptab?
-      // cprintf("rxpullrp: pulling remote page %p (addr %p)\n", pde, p->pullva);
-      if (!net_pullpte(p, pde, PGLEV_PTAB))
-        return; // Wait for the pull to complete.
+      if (p->npull == NET_PULLWIN)
+        break;    // Wait for a pull to complete.
+      net_pullpte(p, pde, PGLEV_PTAB);
     }
     assert(!(*pde & PTE_REMOTE));
-    if (PGADDR(*pde) == PTE_ZERO) {   // Skip empty PDEs
-      p->pullva = PTADDR(p->pullva + PTSIZE);
+    if (PGADDR(*pde) == PTE_ZERO || net_pulling(p, PGADDR(*pde))) {
+      if (PGADDR(*pde) != PTE_ZERO)
+        complete = 0;   // come back when the table is here
+      va = PTADDR(va + PTSIZE);
+      if (complete)
+        p->pullva = va;
       continue;
     }
     assert(PGADDR(*pde) != 0);
     uint32_t *ptab = mem_ptr(PGADDR(*pde));
 
     // Pull or traverse PTE to find page.
-    uint32_t *pte = &ptab[PTX(p->pullva)];
+    uint32_t *pte = &ptab[PTX(va)];
     if (*pte & PTE_REMOTE) {  // Need to pull remote page?
-      if (!net_pullpte(p, pte, PGLEV_PAGE))
-        return; // Wait for the pull to complete.
+      if (p->npull == NET_PULLWIN)
+        break;    // Wait for a pull to complete.
+      net_pullpte(p, pte, PGLEV_PAGE);
     }
     assert(!(*pte & PTE_REMOTE));
     assert(PGADDR(*pte) != 0);
-    p->pullva += PAGESIZE;  // Page is local - move to next.
+    if (net_pulling(p, PGADDR(*pte)))
+      complete = 0;
+    va += PAGESIZE;
+    if (complete)
+      p->pullva = va;   // Page is local - move past it.
   }
 
   // We've pulled the proc's entire address space: it's ready to go!
-  //cprintf("net_rxpullrp: migration complete\n");
-  proc_ready(p);
+  bool done = p->pullva >= VM_USERHI && p->npull == 0;
+  if (done)
+    p->state = PROC_READY;    // so nobody else readies it too
+  spinlock_release(&p->lock);
+  if (done) {
+    net_pushrelease();
+    proc_ready(p);
+  }
 }
 
 // See if we need to pull a page to fill a given PDE or PTE.
@@ -643,7 +2126,9 @@ net_pullpte(proc *p, uint32_t *pte, int pglevel)
   if(RRNODE(rr) == net_node) {
     pageinfo *pi = mem_phys2pi(RRADDR(rr));
     assert(pi);
+    spinlock_acquire(&net_lock);  // so net_rxrelease() can't free it
     mem_incref(pi);
+    spinlock_release(&net_lock);
     *pte = RRADDR(rr) | (rr & RR_RW);
     if(rr & SYS_READ || pglevel > 0)      // Same as before, but if it's not a page
       *pte |= PTE_P | PTE_U;
@@ -652,21 +2137,344 @@ net_pullpte(proc *p, uint32_t *pte, int pglevel)
     
   // reuse pages we already have
   pageinfo *pi = mem_rrlookup(rr);
+  if(pi != NULL && pglevel == PGLEV_PAGE && pi->version != 0
+      && net_pagehash(mem_pi2ptr(pi)) != pi->version) {
+    mem_rrforget(pi);   // changed here: no longer a copy of rr
+    mem_decref(pi, mem_free);
+    pi = NULL;
+  }
   if(pi != NULL) {
     *pte = mem_pi2phys(pi) | (rr & RR_RW);
     if(rr & SYS_READ || pglevel > 0)
       *pte |= PTE_P | PTE_U;
-    return 1;
+    if(pi->version == 0 || pglevel != PGLEV_PAGE)
+      // Our copy, unless it's still on its way for someone else.
+      return !net_pullfollow(p, rr, mem_pi2ptr(pi), pglevel);
+    // A copy from some earlier visit: check it's still current.
+    net_pull(p, rr, mem_pi2ptr(pi), pglevel, pi->version, pte);
+    return 0;
   }
 
   // otherwise we have to allocate our own page 
   pi = mem_alloc();
   mem_incref(pi);
+  if (!mem_rrtracknew(rr, pi)) {  // a push just completed it after all
+    mem_decref(pi, mem_free);
+    return net_pullpte(p, pte, pglevel);
+  }
   *pte = mem_pi2phys(pi) | (rr & RR_RW);
   if(rr & SYS_READ || pglevel > 0)
       *pte |= PTE_P | PTE_U;
-  mem_rrtrack(rr, pi);
-  pi->shared = (RRNODE(rr)%2)+1;
-  net_pull(p, rr, mem_pi2ptr(pi), pglevel);
+  pi->shared = NET_SELFSHARE;   // pin it as a cached copy
+  net_pull(p, rr, mem_pi2ptr(pi), pglevel, 0, NULL);
   return 0;
 }
+
+// Push one of our pages to dstnode as the page at level pglev behind rr,
+// unless dstnode has it already; returns true if we pushed it.
+static bool
+net_pushpage(uint8_t dstnode, uint32_t rr, int pglev, void *pg)
+{
+  if (!(rr & RR_REMOTE) || RRNODE(rr) != net_node || RRADDR(rr) == 0)
+    return 0;   // not ours to push, or nothing to push
+  assert(RRADDR(rr) == mem_phys(pg));
+
+  // Account for the sharing just as net_rxpullrq() would.
+  net_rrshare(pg, dstnode);
+  net_peer *np = &net_peers[dstnode];
+  net_txpage(dstnode, NET_PUSHRP, rr, pglev, 7, np->mtu,
+      np->mtu != 0 ? np->encs : 1 << NET_ENC_RAW,
+      pglev == PGLEV_PAGE ? net_pagehash(pg) : 0, pg);
+  return 1;
+}
+
+// Is pte a page written here since it was copied from one of dstnode's?
+// (See pmap_faultpage().)  If so, net_pushdiff() can send it as a delta.
+static bool
+net_diffable(pte_t pte, uint8_t dstnode)
+{
+  if ((pte & PTE_REMOTE) || PGADDR(pte) == PTE_ZERO)
+    return 0;
+  pageinfo *pi = mem_phys2pi(PGADDR(pte));
+  return pi->home == 0 && pi->origin != 0 && RRNODE(pi->origin) == dstnode;
+}
+
+// Push page pte maps to dstnode as a delta against the page of dstnode's
+// it was copied from, which our copy of that page still holds
+// (see net.h).  Returns false if we couldn't, or the delta doesn't fit
+// in a frame: then dstnode pulls the page whole, as usual.
+static bool
+net_pushdiff(uint8_t dstnode, pte_t pte)
+{
+  if (!net_diffable(pte, dstnode))
+    return 0;
+  const uint32_t *pg = mem_ptr(PGADDR(pte));
+  pageinfo *pi = mem_ptr2pi(pg);
+  uint32_t base = pi->origin;
+  pageinfo *bpi = mem_rrlookup(base);
+  if (bpi == NULL)
+    return 0;   // our copy of it is gone
+  const uint32_t *bpg = mem_pi2ptr(bpi);
+  pageinfo *scratch = NULL;
+  bool ok = bpi->version != 0 && net_pagehash(bpg) == bpi->version
+      && (scratch = mem_allocn(1)) != NULL;
+  if (!ok) {  // not validated yet, or no memory
+    mem_decref(bpi, mem_free);
+    return 0;
+  }
+
+  // XOR into the first scratch page, encode into the second.
+  uint32_t *x = mem_pi2ptr(scratch), *rle = x + PAGESIZE/4;
+  int i;
+  for (i = 0; i < PAGESIZE/4; i++)
+    x[i] = pg[i] ^ bpg[i];
+  uint32_t version = bpi->version;
+  mem_decref(bpi, mem_free);
+  net_peer *np = &net_peers[dstnode];
+  int mtu = MIN(np->mtu != 0 ? np->mtu : NET_MAXPKT, net_mtu);
+  int rlelen = net_rleencode(x, PAGESIZE/4, rle);
+  if (rlelen == 0 || sizeof(net_pullrphdr) + sizeof(net_diffbase) + rlelen
+      > mtu) {
+    mem_freen(scratch, 1);
+    return 0;
+  }
+
+  uint32_t hdr[(sizeof(net_pullrphdr) + sizeof(net_diffbase)) / 4];
+  net_pullrphdr *rph = (net_pullrphdr*) hdr;
+  net_diffbase *db = (net_diffbase*) rph->data;
+  net_ethsetup(&rph->eth, dstnode);
+  rph->type = NET_PUSHRP;
+  rph->rr = net_pte2rr(pte, dstnode);
+  rph->part = 0;
+  rph->nparts = 3;
+  rph->enc = NET_ENC_DIFF;
+  rph->pglev = PGLEV_PAGE;
+  rph->version = net_pagehash(pg);
+  db->rr = base;
+  db->version = version;
+  net_rrshare((void*)pg, dstnode);  // as net_pushpage() would
+  net_tx(hdr, sizeof(hdr), rle, rlelen);
+  mem_freen(scratch, 1);
+  net_statev(NETEV_DIFF);
+  return 1;
+}
+
+// Push the pages of migrating process p's region from va to lim
+// to dstnode, each page table ahead of its pages, up to max pages
+// in all (see SYS_PREFETCH).  Returns how many were pushed.
+// Kicks the card every NET_PUSHBURST pages, so that it starts sending
+// before the transmit ring fills.
+static int
+net_pushrange(proc *p, uint8_t dstnode, uint32_t va, uint32_t lim, int max)
+{
+  int npush = 0;
+  net_txbegin();
+  while (va < lim && npush < max) {
+    pde_t pde = p->pdir[PDX(va)];
+    if ((pde & (PTE_REMOTE | PTE_PS)) || PGADDR(pde) == PTE_ZERO) {
+      va = PTADDR(va + PTSIZE);
+      continue;
+    }
+    pte_t *ptab = mem_ptr(PGADDR(pde));
+    if (net_pushpage(dstnode, net_pte2rr(pde, dstnode), PGLEV_PTAB, ptab))
+      npush++;
+    for (; va < lim && npush < max; va += PAGESIZE) {
+      pte_t pte = ptab[PTX(va)];
+      if (PGADDR(pte) != PTE_ZERO && !(pte & PTE_REMOTE)
+          && net_pushpage(dstnode, net_pte2rr(pte, dstnode), PGLEV_PAGE,
+              mem_ptr(PGADDR(pte)))
+          && ++npush % NET_PUSHBURST == 0) {
+        net_txend();
+        net_txbegin();
+      }
+      if (PTX(va) == NPTENTRIES-1) {
+        va += PAGESIZE;
+        break;
+      }
+    }
+  }
+  net_txend();
+  return npush;
+}
+
+// Push the hot part of migrating process p's address space to dstnode:
+// up to NET_PUSHMAX of the pages p touched since its last migration,
+// by their PTE_A bits, each preceded by its page table.
+// The destination keeps them in its push cache (see net_rxpushrp()),
+// so that when p's pulls get to them they are already there.
+// Our reply to its pull of p's page directory queues up behind them.
+// Besides these, every page p wrote here that began as a copy of one
+// of dstnode's - as all do when p goes back home - goes as a delta.
+// First of all go the pages p named with SYS_PREFETCH, if any.
+static void
+net_push(proc *p, uint8_t dstnode)
+{
+  assert(p->state == PROC_MIGR);
+  if (p->pushlim > p->pushva)
+    net_pushrange(p, dstnode, p->pushva, p->pushlim, NET_PREFETCHMAX);
+  p->pushva = p->pushlim = 0;
+
+  int npush = 0;
+  uint32_t va;
+  net_txbegin();
+  for (va = VM_USERLO; va < VM_USERHI; va += PTSIZE) {
+    pde_t pde = p->pdir[PDX(va)];
+    if ((pde & (PTE_REMOTE | PTE_PS)) || PGADDR(pde) == PTE_ZERO)
+      continue;
+    pte_t *ptab = mem_ptr(PGADDR(pde));
+    int i;
+    for (i = 0; i < NPTENTRIES; i++)
+      if ((npush < NET_PUSHMAX && (ptab[i] & PTE_A)
+          && PGADDR(ptab[i]) != PTE_ZERO && !(ptab[i] & PTE_REMOTE))
+          || net_diffable(ptab[i], dstnode))
+        break;
+    if (i == NPTENTRIES || !net_pushpage(dstnode, net_pte2rr(pde, dstnode),
+        PGLEV_PTAB, ptab))
+      continue;   // nothing hot or changed in here
+    npush++;
+
+    for (; i < NPTENTRIES; i++) {
+      pte_t pte = ptab[i];
+      if (net_pushdiff(dstnode, pte))
+        continue;
+      if (npush < NET_PUSHMAX && (pte & PTE_A) && PGADDR(pte) != PTE_ZERO
+          && !(pte & PTE_REMOTE)
+          && net_pushpage(dstnode, net_pte2rr(pte, dstnode), PGLEV_PAGE,
+              mem_ptr(PGADDR(pte))))
+        npush++;
+    }
+
+    // Start measuring afresh for the next migration.  Only in tables
+    // nobody else uses: another CPU's MMU could be setting PTE_D.
+    if (mem_ptr2pi(ptab)->refcount == 1)
+      for (i = 0; i < NPTENTRIES; i++)
+        ptab[i] &= ~PTE_A;
+  }
+  net_txend();
+}
+
+// Let go of push cache slot ps's page.  Until now its version stayed 0,
+// so the migration it was pushed for could use it without validating it.
+static void
+net_pushfree(net_pushslot *ps)
+{
+  assert(spinlock_holding(&net_lock));
+  if (ps->rr == 0)
+    return;
+  if (ps->arrived == 7)
+    ps->pi->version = ps->version;
+  mem_decref(ps->pi, mem_free);
+  ps->rr = 0;
+  ps->pi = NULL;
+}
+
+// Rebuild into pg a page pushed to us as a delta of len bytes against
+// one of our own pages (see net_pushdiff()).  Returns the mask of parts
+// filled in - all of them - or 0 if the delta was no good, or is against
+// a version of the base page we no longer have: then it gets pulled.
+static int
+net_rxdiff(net_pullrphdr *rp, int len, uint32_t *pg)
+{
+  net_diffbase *db = (net_diffbase*) rp->data;
+  if (len < sizeof(*rp) + sizeof(*db) || rp->part != 0 || rp->nparts != 3
+      || rp->pglev != PGLEV_PAGE || !(db->rr & RR_REMOTE)
+      || RRNODE(db->rr) != net_node) {
+    warn("net_rxdiff: bogus delta for RR %x", rp->rr);
+    net_statev(NETEV_BAD);
+    return 0;
+  }
+  pageinfo *bpi = mem_phys2pi(RRADDR(db->rr));
+  if (bpi <= &mem_pageinfo[0] || bpi >= &mem_pageinfo[mem_npage]
+      || bpi->refcount == 0 || bpi->home != 0) {
+    warn("net_rxdiff: delta against invalid page %x", RRADDR(db->rr));
+    net_statev(NETEV_BAD);
+    return 0;
+  }
+  const uint32_t *bpg = mem_pi2ptr(bpi);
+  if (net_pagehash(bpg) != db->version)
+    return 0;   // written here since it was copied
+  if (!net_rledecode((uint32_t*)(db + 1), len - sizeof(*rp) - sizeof(*db),
+      pg, PAGESIZE/4)) {
+    warn("net_rxdiff: bad encoding for RR %x", rp->rr);
+    net_statev(NETEV_BAD);
+    return 0;
+  }
+  int i;
+  for (i = 0; i < PAGESIZE/4; i++)
+    pg[i] ^= bpg[i];
+  if (net_pagehash(pg) != rp->version) {
+    warn("net_rxdiff: RR %x rebuilt wrong", rp->rr);
+    net_statev(NETEV_BAD);
+    return 0;
+  }
+  return 7;
+}
+
+// Receive a page some node pushed to us ahead of migrating a process.
+static void
+net_rxpushrp(uint8_t srcnode, net_pullrphdr *rp, int len)
+{
+  uint32_t rr = rp->rr;
+  if (!(rr & RR_REMOTE) || RRNODE(rr) != srcnode
+      || rp->pglev < PGLEV_PAGE || rp->pglev > PGLEV_PTAB) {
+    warn("net_rxpushrp: bogus push of RR %x", rr);
+    net_statev(NETEV_BAD);
+    return;
+  }
+
+  spinlock_acquire(&net_lock);
+  net_pushslot *ps;
+  for (ps = net_pushcache; ps < &net_pushcache[NET_PUSHSLOTS]; ps++)
+    if (ps->rr == rr)
+      break;
+  if (ps == &net_pushcache[NET_PUSHSLOTS]) {  // a new page
+    pageinfo *pi = mem_rrlookup(rr);
+    if (pi != NULL) {   // we already have it
+      mem_decref(pi, mem_free);
+      return spinlock_release(&net_lock);
+    }
+    ps = &net_pushcache[net_pushnext];
+    net_pushnext = (net_pushnext + 1) % NET_PUSHSLOTS;
+    net_pushfree(ps);
+    if ((pi = mem_alloc()) == NULL)
+      return spinlock_release(&net_lock); // it was just a hint anyway
+    mem_incref(pi);
+    ps->rr = rr;
+    ps->pi = pi;
+    ps->arrived = 0;
+  } else if (ps->arrived == 7)  // a duplicate
+    return spinlock_release(&net_lock);
+
+  int mask = rp->enc == NET_ENC_DIFF
+      ? net_rxdiff(rp, len, mem_pi2ptr(ps->pi))
+      : net_rxparts(rp, len, mem_pi2ptr(ps->pi), ps->arrived);
+  ps->arrived |= mask;
+  if (ps->arrived != 7)
+    return spinlock_release(&net_lock);
+
+  // All there: make it findable by RR, unless a pull got it first.
+  if (!mem_rrtracknew(rr, ps->pi)) {
+    net_pushfree(ps);
+    return spinlock_release(&net_lock);
+  }
+  ps->pi->shared = NET_SELFSHARE;  // pinned as a cached copy
+  ps->version = rp->version;
+  mem_stat(MEMSTAT_PUSHED, 1);
+  if (rp->pglev == PGLEV_PTAB)
+    mem_stat(MEMSTAT_PTAB, 1);
+  spinlock_release(&net_lock);
+}
+
+// A migrated process has everything it needs: let go of the pushed
+// pages it (or anyone) picked up, so they don't look shared forever
+// and take a copy-on-write fault on their first write.
+static void
+net_pushrelease(void)
+{
+  spinlock_acquire(&net_lock);
+  net_pushslot *ps;
+  for (ps = net_pushcache; ps < &net_pushcache[NET_PUSHSLOTS]; ps++)
+    if (ps->rr != 0 && ps->arrived == 7 && ps->pi->refcount > 1)
+      net_pushfree(ps);
+  spinlock_release(&net_lock);
+}
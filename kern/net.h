@@ -16,6 +16,9 @@
 #include <inc/cdefs.h>
 #include <inc/trap.h>
 #include <inc/syscall.h>
+#include <inc/file.h>
+
+#include <kern/lat.h>
 
 
 // Ethernet header
@@ -28,8 +31,10 @@ typedef struct net_ethhdr {
 #define NET_ETYPE_IP	0x0800		// Ethernet packet type for IPv4
 
 #define NET_MAXPKT	1514		// Max Ethernet packet size w/o csum
+#define NET_MAXJUMBO	9014		// Max jumbo frame size w/o csum
 
-#define NET_MAXNODES	32		// Max number of nodes in system
+#define NET_MAXNODES	254		// Max number of nodes in system
+					// (255 is SYS_NODEANY)
 
 
 // Message types
@@ -39,6 +44,10 @@ typedef enum net_msgtype {
 	NET_MIGRP,		// Migrate reply
 	NET_PULLRQ,		// Page pull request
 	NET_PULLRP,		// Page pull reply
+	NET_PUSHRP,		// Unrequested page pushed ahead of a migration
+	NET_RELEASE,		// RRs the sender no longer holds copies of
+	NET_LOAD,		// Sender's load, broadcast for net_place()
+	NET_METRICS,		// Sender's counters, for the collector node
 } net_msgtype;
 
 // Minimal packet header for all our network messages
@@ -47,18 +56,32 @@ typedef struct net_hdr {
 	net_msgtype	type;	// Message request/response type
 } net_hdr;
 
+// A migration request carries one or more processes bound for the
+// same node, so that processes setting off together travel together:
+// each a net_migent, followed by the parts of its state worth sending.
+#define NET_MIGRMAX	16	// Most processes in one migration request
 typedef struct net_migrq {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_MIGRQ
+	int		nproc;	// Number of processes that follow
+	uint8_t		data[0]; // Their net_migents, back to back
+} net_migrq;
+
+typedef struct net_migent {
 	uint32_t	home;	// Remote ref for proc's home node & physaddr
 	uint32_t	pdir;	// Remote ref for proc's page directory
-	procstate	save;	// Process's saved user-visible state
-} net_migrq;
+	uint16_t	len;	// Bytes in this entry, with what follows it
+	uint16_t	nchild;	// Entries of childnode[] sent, the rest 0
+	uint32_t	fx;	// Nonzero if procstate.fx is sent
+	// Then the process's procstate without fx, then fx if sent,
+	// then the first nchild of the nodes SYS_NODEANY put kids on.
+} net_migent;
 
 typedef struct net_migrp {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_MIGRP
-	uint32_t	home;	// Remote ref for proc being acknowledged
+	int		nhome;	// Number of procs acknowledged
+	uint32_t	home[NET_MIGRMAX]; // Remote refs for procs acknowledged
 } net_migrp;
 
 // Pull a page from a remote node
@@ -68,21 +91,114 @@ typedef struct net_pullrq {
 	uint32_t	rr;	// Remote ref to pdir, ptab, or page
 	uint8_t		pglev;	// 0=page, 1=page table, 2=page directory
 	uint8_t		need;	// Bits 2-0: which parts of page are needed
+	uint16_t	mtu;	// Largest frame requester can take, 0=MAXPKT
+	uint8_t		encs;	// Bit (1 << NET_ENC_x) set for each it takes
+	uint32_t	version; // Version of requester's copy, 0 if none
 } net_pullrq;
 
 // Page pull reply - 3 required per page, to fit in Ethernet packet size.
+// Between nodes whose cards both take jumbo frames (see net_mtu),
+// one reply may carry several consecutive parts, up to the whole page.
 #define NET_PULLPART	1368		// 1368*3 >= 4096
 #define NET_PULLPART0	NET_PULLPART
 #define NET_PULLPART1	NET_PULLPART
 #define NET_PULLPART2	(PAGESIZE-NET_PULLPART0-NET_PULLPART1)
 typedef struct net_pullrphdr {
 	net_ethhdr	eth;
-	net_msgtype	type;	// = NET_PULLRP
+	net_msgtype	type;	// = NET_PULLRP or NET_PUSHRP
 	uint32_t	rr;	// Remote reference
 	int		part;	// Which part of the page this is: 0, 1, or 2
+	int		nparts;	// Number of consecutive parts carried
+	int		enc;	// How data is encoded: NET_ENC_x
+	int		pglev;	// 0=page, 1=page table, 2=page directory
+	uint32_t	version; // Version of the page as sent, 0 if none
 	char		data[0]; // Variable-length payload follows pullrphdr
 } net_pullrphdr;
 
+// Pull reply data encodings.
+#define NET_ENC_RAW	0		// The parts' words as they are
+#define NET_ENC_RLE	1		// Run-length encoded 32-bit words
+#define NET_ENC_SAME	2		// No data: requester's version is current
+#define NET_ENC_DIFF	3		// Pushes only: delta against a base page
+#define NET_ENC_ALL	((1 << NET_ENC_RAW) | (1 << NET_ENC_RLE) \
+			 | (1 << NET_ENC_SAME))
+
+// An RLE-encoded reply is a sequence of 32-bit tokens, each holding
+// a run kind in its top two bits and a word count in the rest.
+// Runs of zero, repeated, or page-strided words (as in the RR arrays of
+// sparse or contiguously-allocated page tables) need only the token;
+// a literal token is followed by that many words.
+#define NET_RLE_ZERO	0x00000000	// count words of zero
+#define NET_RLE_REPEAT	0x40000000	// count copies of the last word
+#define NET_RLE_STRIDE	0x80000000	// each word last word + PAGESIZE
+#define NET_RLE_LIT	0xc0000000	// count words follow the token
+#define NET_RLE_KIND	0xc0000000
+#define NET_RLE_COUNT	0x3fffffff
+
+// A NET_ENC_DIFF push carries a whole page as the changes made to it
+// since it was copied from one of the recipient's pages: this header
+// naming that base page, then the RLE encoding (as above) of the page's
+// words each XORed with the base page's.  The recipient uses it only
+// if its base page is still at the version the sender copied.
+typedef struct net_diffbase {
+	uint32_t	rr;	// RR of the recipient's base page
+	uint32_t	version; // Version of the base page copied
+} net_diffbase;
+
+
+// Tell a home node we freed our copies of some of its pages,
+// so it can remove us from their sharer sets (pageinfo.shared).
+#define NET_RELMAX	128		// RRs per release message
+typedef struct net_release {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_RELEASE
+	int		nrr;	// Number of RRs that follow
+	uint32_t	rr[NET_RELMAX];
+} net_release;
+
+// Every node broadcasts its load now and then (see net_loadtimer()),
+// so that net_place() can put new children on the least-loaded node.
+typedef struct net_load {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_LOAD
+	uint16_t	nrun;	// Processes running or ready to run
+	uint16_t	ncpu;	// CPUs to run them on
+	uint32_t	nfree;	// Free pages
+	uint8_t		collector; // Sender's metrics collector, 0 if none
+} net_load;
+
+// Counters every node sends the metrics collector now and then
+// (see net_mettimer()), for the collector's root to read in its
+// "metrics" file.  Those marked "gauge" are current values;
+// the rest count up from boot, and wrap.
+enum netmetric {
+	NETMET_NRUN,		// gauge: Processes running or ready to run
+	NETMET_NCPU,		// gauge: CPUs to run them on
+	NETMET_TRAPS,		// Traps and system calls handled
+	NETMET_SYSCALLS,	// System calls alone
+	NETMET_SWITCHED,	// Traps that blocked or switched processes
+	NETMET_LOCKWAITS,	// Contended lock acquisitions, if profiled
+	NETMET_FREE,		// gauge: Free pages
+	NETMET_ALLOC,		// Pages allocated
+	NETMET_FAULTS,		// Write faults resolved by pmap_pagefault()
+	NETMET_PULLED,		// Pages pulled in from other nodes
+	NETMET_MIGRS,		// Migration requests sent
+	NETMET_TXPKTS,		// Frames sent
+	NETMET_TXBYTES,
+	NETMET_RXPKTS,		// Frames received
+	NETMET_RXBYTES,
+	NETMET_REXMITS,		// Requests resent
+	NETMET_N
+};
+
+typedef struct net_metrics {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_METRICS
+	uint32_t	seq;	// Sender's sample number, counting from 1
+	uint32_t	nval;	// = NETMET_N, or the sender's kernel differs
+	uint32_t	val[NETMET_N];
+} net_metrics;
+
 
 // 32-bit remote reference layout.
 // Note that bit 0, corresponding to PTE_P, must always be zero,
@@ -106,15 +222,109 @@ typedef struct net_pullrphdr {
 #define PGLEV_PDIR		2	// Page directory
 
 
+// Retransmission state for one outstanding request (see net.c).
+typedef struct net_rqtimer {
+	uint64_t	start;		// Timestamp counter at first transmission
+	uint64_t	sent;		// Timestamp counter at last transmission
+	uint32_t	rto;		// Cycles to wait for a reply before resend
+	uint8_t		tries;		// Times transmitted so far
+} net_rqtimer;
+
+#define NET_PULLWIN		8	// Pulls a migrating proc has in flight
+#define NET_PUSHMAX		16	// Hot pages pushed per migration, 0=off
+#define NET_PREFETCHMAX		48	// SYS_PREFETCH pages pushed, likewise
+#define NET_PUSHBURST		8	// Pages pushed per kick of the card
+
+// One page pull in flight on behalf of a migrating process.
+// Each proc has NET_PULLWIN of these (see net_pullmore() in net.c).
+// A slot may instead follow another process's pull of the same RR
+// into the same page, sending nothing itself (see net_pullfollow()).
+typedef struct net_pullslot {
+	struct net_pullslot *next;	// Next on net.c's page-pulling chain
+	struct proc	*proc;		// Process the pull is for
+	uint32_t	rr;		// RR we are pulling, 0 if slot free
+	void		*pg;		// Local page we are pulling into
+	uint8_t		pglev;		// Level: 0=page, 1=page table, 2=pdir
+	uint8_t		arrived;	// Bits 0-2: which parts have arrived
+	uint8_t		filling;	// Bits 0-2: parts being copied in now
+	net_rqtimer	rt;		// When to retransmit the request
+	uint32_t	version;	// Version of cached pg we're validating
+	uint32_t	rpversion;	// Version the parts arrived are of
+	uint32_t	*pte;		// Entry mapping pg, if validating
+	bool		follow;		// Waiting on another proc's pull of rr
+} net_pullslot;
+
+
 extern uint8_t net_node;	// My node number - from net_mac[5]
 extern uint8_t net_mac[6];	// My MAC address from the Ethernet card
+extern uint8_t net_nodemac[NET_MAXNODES+1][6];	// Each node's MAC address
+extern uint16_t net_mtu;	// Largest frame our card can send & receive
+
+// Our local copy of a remote page stays pinned in memory as a cache
+// by having our own node, never otherwise there, as its only sharer.
+// If we pass the copy's RR on, the recipient pins it for good;
+// if not, mem_idle() can reclaim it once nothing references it.
+#define NET_SELFSHARE	MEM_SHAREONE(net_node)
+
+
+// Network statistics, kept per CPU in cpu->net like kern/lat.c's,
+// and so written by only that CPU with interrupts off.
+enum netev {
+	NETEV_RUNT,		// Frames too short for a header
+	NETEV_STRAY,		// Frames not to us, or not from the cluster
+	NETEV_BADTYPE,		// Unknown ethertype or message type
+	NETEV_BAD,		// Malformed messages of a known type
+	NETEV_DUP,		// Duplicate requests and replies
+	NETEV_TXFULL,		// Frames dropped for a full transmit ring
+	NETEV_FOLLOW,		// Pulls that waited on another proc's
+	NETEV_DIFF,		// Pages pushed as deltas (NET_ENC_DIFF)
+	NETEV_N
+};
+
+enum netlat {
+	NETLAT_PULL,		// Page pulls, first request to last part
+	NETLAT_VALIDATE,	// Pulls a home node answered NET_ENC_SAME
+	NETLAT_MIGR,		// Migration requests, to their reply
+	NETLAT_N
+};
+
+#define NET_NTYPES	9	// Message types counted; others count as 0
+
+typedef struct net_typestats {
+	uint32_t	pkts;
+	uint32_t	pad;
+	uint64_t	bytes;
+} net_typestats;
+
+typedef struct net_peerstats {
+	uint32_t	txpkts;
+	uint32_t	rxpkts;
+	uint32_t	rexmits;	// Requests resent to this node
+	uint32_t	pad;
+	uint64_t	txbytes;
+	uint64_t	rxbytes;
+} net_peerstats;
+
+typedef struct netstats {
+	uint32_t	ev[NETEV_N];
+	net_typestats	tx[NET_NTYPES];
+	net_typestats	rx[NET_NTYPES];
+	latclass	lat[NETLAT_N];	// 'switched' unused
+	net_peerstats	peer[NET_MAXNODES+1];	// [0] = broadcasts
+} netstats;
 
 
 struct trapframe;
 
 void net_init(void);
+void net_statinit(void);	// Allocate this CPU's statistics
+void net_statfile(int ino);	// Update the root's "netstat" file
 void net_rx(void *ethpkt, int len);
-void net_tick(void);
+void net_nodesfile(int ino);
+void net_metricsfile(int ino);	// Drain metrics into the root's file
+void net_rrrelease(uint32_t rr);
+bool net_idle(void);
+uint8_t net_place(void);
 void gcc_noreturn net_migrate(struct trapframe *tf, uint8_t node, int entry);
 
 #endif // !PIOS_KERN_NET_H
@@ -21,6 +21,10 @@
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/pmap.h>
+#include <kern/net.h>
+#include <kern/disk.h>
+
+#include <dev/lapic.h>
 
 
 // Statically allocated page directory mapping the kernel's address space.
@@ -30,6 +34,26 @@ pde_t pmap_bootpdir[1024] gcc_aligned(PAGESIZE);
 // Statically allocated page that we always keep set to all zeros.
 uint8_t pmap_zero[PAGESIZE] gcc_aligned(PAGESIZE);
 
+// Pool of free pages prefilled with PTE_ZERO entries, ready to become
+// new page tables without a fill loop on the page fault path.
+#define PMAP_PTABPOOL	32
+static mempool pmap_ptabpool;
+static bool pmap_sse2;		// CPU has SSE2, for pmap_mergepage()
+static spinlock pmap_deduplock;	// Protects pmap_deduptab
+
+// Whole page tables and superpages that pmap_removelazy() has taken
+// out of address spaces, whose references pmap_reclaimhelp() drops
+// later on idle CPUs: freeing a page table drops a reference
+// on every page it maps, too slow a job for the system call.
+#define PMAP_RECLAIMMAX	1024
+static struct {
+	spinlock	lock;
+	uint32_t	head, tail;	// Next slot to fill and to reclaim
+	pde_t		pde[PMAP_RECLAIMMAX];
+} pmap_reclaimq;
+
+static void pmap_dirtyadd(pmapdirty *d, uint32_t va);
+
 // --------------------------------------------------------------
 // Set up initial memory mappings and turn on MMU.
 // --------------------------------------------------------------
@@ -67,6 +91,10 @@ pmap_init(void)
         pmap_bootpdir[page_index] = (page_index << PDXSHIFT) | PTE_P | PTE_W | PTE_G | PTE_PS;
       }
     }  
+
+		mem_poolinit(&pmap_ptabpool, PMAP_PTABPOOL, PTE_ZERO);
+		spinlock_init(&pmap_deduplock);
+		spinlock_init(&pmap_reclaimq.lock);
 	}
 	// On x86, segmentation maps a VA to a LA (linear addr) and
 	// paging maps the LA to a PA.  i.e., VA => LA => PA.  If paging is
@@ -77,9 +105,15 @@ pmap_init(void)
 	// In PIOS this is always the case for the kernel's address space,
 	// so we don't have to play any special tricks as in other kernels.
 
-	// Enable 4MB pages and global pages.
+	// Enable 4MB pages and global pages,
+	// and FXSAVE/FXRSTOR and SSE for lazy FPU switching in kern/proc.c.
+	cpuinfo inf;
+	cpuid(1, &inf);
+	if (!(inf.edx & (1 << 24)))
+		panic("pmap_init: processor lacks FXSAVE/FXRSTOR");
+	pmap_sse2 = (inf.edx & (1 << 26)) != 0;
 	uint32_t cr4 = rcr4();
-	cr4 |= CR4_PSE | CR4_PGE;
+	cr4 |= CR4_PSE | CR4_PGE | CR4_OSFXSR | CR4_OSXMMEXCPT;
 	lcr4(cr4);
 
 	// Install the bootstrap page directory into the PDBR.
@@ -87,13 +121,15 @@ pmap_init(void)
 
 	// Turn on paging.
 	uint32_t cr0 = rcr0();
-	cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_TS|CR0_MP|CR0_TS;
+	cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_TS|CR0_MP;
 	cr0 &= ~(CR0_EM);
 	lcr0(cr0);
 	// If we survived the lcr0, we're running with paging enabled.
 	// Now check the page table management functions below.
+#ifndef BOOT_NOCHECK
 	if (cpu_onboot())
 		pmap_check();
+#endif
 }
 //
 // Allocate a new page directory, initialized from the bootstrap pdir.
@@ -120,20 +156,211 @@ void
 pmap_freepdir(pageinfo *pdirpi)
 {
 	pmap_remove(mem_pi2ptr(pdirpi), VM_USERLO, VM_USERHI-VM_USERLO);
+	pmap_shootdown(mem_pi2ptr(pdirpi));	// before the page is reused
+	if (rcr3() == mem_pi2phys(pdirpi))	// don't keep running on it
+		lcr3(mem_phys(pmap_bootpdir));
 	mem_free(pdirpi);
 }
 
+// Unsharing a copy-on-write page table would normally mean giving every
+// page it maps one more reference, which is 1024 locked increments.
+// Instead the private copy borrows those references from the shared
+// original, named by the copy's ptabsrc and kept alive by a reference
+// the copy holds on it.  An entry of the copy holds no reference of
+// its own exactly when it still maps the same page as the original;
+// no one modifies the original while we hold our reference to it.
+// A copy of a copy borrows from the same original, never the copy,
+// so ptabsrc chains are at most one table long.
+
+// Return true if the PTE at 'pte' borrows its page's reference.
+static bool
+pmap_borrowed(pte_t *pte)
+{
+	pageinfo *src = mem_ptr2pi(pte)->ptabsrc;
+	if (src == NULL || PGADDR(*pte) == PTE_ZERO)
+		return 0;
+	pte_t *spte = mem_pi2ptr(src);
+	return PGADDR(spte[PGOFF(pte) / sizeof(pte_t)]) == PGADDR(*pte);
+}
+
+// Drop whatever reference the PTE at 'pte' holds on its page,
+// before the caller overwrites it.
+static void
+pmap_pteunref(pte_t *pte)
+{
+	if (PGADDR(*pte) != PTE_ZERO && !pmap_borrowed(pte))
+		mem_decref(mem_phys2pi(PGADDR(*pte)), mem_free);
+}
+
+// Store into 'pte' a mapping whose page reference the caller has
+// already taken, turning it back into a borrowed one if it can be.
+static void
+pmap_pteset(pte_t *pte, pte_t val)
+{
+	*pte = val;
+	if (pmap_borrowed(pte))		// original's reference will do
+		mem_decref(mem_phys2pi(PGADDR(val)), mem_free);
+}
+
+// Map page 'pi' in place of whatever 'pte' maps, read-only,
+// keeping its nominal permissions: for pages read in from disk.
+void
+pmap_fillpte(pte_t *pte, pageinfo *pi)
+{
+	pte_t perm = *pte & (SYS_RW | PTE_U);
+	mem_incref(pi);
+	pmap_pteunref(pte);
+	pmap_pteset(pte, mem_pi2phys(pi) | perm |
+			((perm & SYS_READ) ? PTE_P : 0));
+}
+
 // Free a page table and all page mappings it may contain.
 void
 pmap_freeptab(pageinfo *ptabpi)
 {
 	pte_t *pte = mem_pi2ptr(ptabpi), *ptelim = pte + NPTENTRIES;
-	for (; pte < ptelim; pte++) {
-		uint32_t pgaddr = PGADDR(*pte);
-		if (pgaddr != PTE_ZERO)
-			mem_decref(mem_phys2pi(pgaddr), mem_free);
-	}
+	for (; pte < ptelim; pte++)
+		pmap_pteunref(pte);
+	pageinfo *src = ptabpi->ptabsrc;
+	ptabpi->ptabsrc = NULL;
+	mem_stat(MEMSTAT_PTAB, -1);
 	mem_free(ptabpi);
+	if (src != NULL)
+		mem_decref(src, pmap_freeptab);
+}
+
+// Once the original a page table borrows from is referenced by nothing
+// else, take over its references and let it go.
+static void
+pmap_unborrow(pte_t *ptab)
+{
+	pageinfo *pi = mem_ptr2pi(ptab), *src = pi->ptabsrc;
+	if (src == NULL || src->refcount != 1)
+		return;
+	pte_t *spte = mem_pi2ptr(src);
+	int i;
+	for (i = 0; i < NPTENTRIES; i++)
+		if (pmap_borrowed(&ptab[i]))
+			spte[i] = PTE_ZERO;	// its reference is now ours
+	pi->ptabsrc = NULL;
+	mem_decref(src, pmap_freeptab);
+}
+
+// A superpage maps a naturally aligned 4MB block of physical memory
+// directly from its PDE (PTE_PS), saving the TLB 1023 entries.
+// Each of the block's pages carries its own reference for the mapping,
+// just as if a page table mapped it, so that splitting a superpage
+// into a page table on a partial write or COW moves no references around.
+// We map superpages only in the file and scratch areas, which see large
+// sequential writes, and only once a region has shown it is such a write
+// by filling its first PMAP_SUPERMIN pages in order.
+#define PMAP_SUPERMIN	64
+#define pmap_superok(va)	(((va) >= VM_FILELO && (va) < VM_FILEHI) || \
+				 ((va) >= VM_SCRATCHLO && (va) < VM_SCRATCHHI))
+
+// Add a reference to, or drop a reference from, whatever a user PDE maps.
+static void
+pmap_pdeincref(pde_t pde)
+{
+	if (pde & PTE_PS) {
+		pageinfo *pi = mem_phys2pi(PGADDR(pde));
+		int i;
+		for (i = 0; i < NPTENTRIES; i++)
+			mem_incref(&pi[i]);
+	} else if (PGADDR(pde) != PTE_ZERO)
+		mem_incref(mem_phys2pi(PGADDR(pde)));
+}
+
+static void
+pmap_pdedecref(pde_t pde)
+{
+	if (pde & PTE_PS) {
+		pageinfo *pi = mem_phys2pi(PGADDR(pde));
+		int i;
+		for (i = 0; i < NPTENTRIES; i++)
+			mem_decref(&pi[i], mem_free);
+	} else if (PGADDR(pde) != PTE_ZERO)
+		mem_decref(mem_phys2pi(PGADDR(pde)), pmap_freeptab);
+}
+
+// Split the superpage mapped by *pde into an equivalent page table.
+// The caller must invalidate the TLB.  Returns false if out of memory.
+static bool
+pmap_split(pde_t *pde)
+{
+	assert(*pde & PTE_PS);
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return 0;
+	mem_incref(pi);
+	mem_stat(MEMSTAT_PTAB, 1);
+
+	pte_t *ptab = mem_pi2ptr(pi);
+	uint32_t pa = PGADDR(*pde);
+	uint32_t perm = *pde & (SYS_RW | PTE_P | PTE_U | PTE_W | PTE_A | PTE_D);
+	int i;
+	for (i = 0; i < NPTENTRIES; i++)
+		ptab[i] = (pa + i * PAGESIZE) | perm;
+	*pde = mem_pi2phys(pi) | PTE_P | PTE_U | PTE_A | PTE_W;
+	return 1;
+}
+
+// Split every superpage in the user part of 'pdir',
+// e.g., before sending it to another node that expects page tables.
+bool
+pmap_splitall(pde_t *pdir)
+{
+	pde_t *pde = &pdir[PDX(VM_USERLO)], *pdelim = &pdir[PDX(VM_USERHI)];
+	for (; pde < pdelim; pde++)
+		if ((*pde & PTE_PS) && !pmap_split(pde))
+			return 0;
+	return 1;
+}
+
+// Try to turn the page table mapping 'va's 4MB region into a superpage,
+// on a write fault into its first page past PMAP_SUPERMIN written pages.
+// That requires the pages before 'va' to be private pages with the same
+// permissions, and the rest still zero mappings; they get copied into a
+// fresh block whose remainder we clear.  Returns false if we can't.
+static bool
+pmap_promote(proc *p, uint32_t va)
+{
+	pde_t *pde = &p->pdir[PDX(va)];
+	pte_t *ptab = mem_ptr(PGADDR(*pde));
+	pte_t zero = ptab[PTX(va)];
+	assert(PGADDR(zero) == PTE_ZERO && (zero & SYS_WRITE));
+	if (mem_ptr2pi(ptab)->refcount != 1 || mem_ptr2pi(ptab)->ptabsrc)
+		return 0;
+	int i;
+	for (i = 0; i < PTX(va); i++)
+		if ((ptab[i] & (PTE_REMOTE | SYS_RW)) != (zero & SYS_RW) ||
+				PGADDR(ptab[i]) == PTE_ZERO ||
+				mem_phys2pi(PGADDR(ptab[i]))->refcount != 1)
+			return 0;
+	for (; i < NPTENTRIES; i++)
+		if (ptab[i] != zero)
+			return 0;
+
+	pageinfo *blk = mem_allocn(MEM_MAXORDER);
+	if (blk == NULL)
+		return 0;
+	uint8_t *pg = mem_pi2ptr(blk);
+	for (i = 0; i < PTX(va); i++) {
+		memmove(pg + i * PAGESIZE, mem_ptr(PGADDR(ptab[i])), PAGESIZE);
+		mem_decref(mem_phys2pi(PGADDR(ptab[i])), mem_free);
+		ptab[i] = zero;
+	}
+	memset(pg + i * PAGESIZE, 0, PTSIZE - i * PAGESIZE);
+	for (i = 0; i < NPTENTRIES; i++)
+		mem_incref(&blk[i]);
+
+	mem_decref(mem_ptr2pi(ptab), pmap_freeptab);
+	*pde = mem_pi2phys(blk) | (zero & SYS_RW) |
+		PTE_PS | PTE_P | PTE_U | PTE_A | PTE_D | PTE_W;
+	if (p->dirty != NULL)
+		pmap_dirtyadd(p->dirty, PTADDR(va) | PMAP_DIRTYSUPER);
+	pmap_inval(p->pdir, PTADDR(va), PTSIZE);
+	return 1;
 }
 
 // Given 'pdir', a pointer to a page directory, pmap_walk returns
@@ -165,6 +392,11 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
 	assert(va >= VM_USERLO && va < VM_USERHI);
   pde_t *table = &pdir[PDX(va)];
   pte_t *t;
+  if(*table & PTE_PS) {       // Callers want PTEs: split the superpage
+    if(!pmap_split(table))
+      return NULL;
+    pmap_inval(pdir, PTADDR(va), PTSIZE);
+  }
   if(*table & PTE_P) {        // Is there a table at the index?
     pte_t *tmp = (pte_t*)PGADDR(*table);
     // We know if our table is not writable but we are writing
@@ -172,27 +404,44 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
     // just not writable. If its shared its refcount must be >
     // than 1
     if(!(*table & PTE_W) && writing) { 
-      // This isnt a shared table, entries should actually be read-only
-      if(mem_ptr2pi(tmp)->refcount == 1) {
+      // This isnt a shared table, entries should actually be read-only.
+      // A copy of a remote table stays one (see pmap_faultpage()).
+      if(mem_ptr2pi(tmp)->refcount == 1 && mem_ptr2pi(tmp)->home == 0) {
         int ind;
         for(ind = 0; ind < 1024; ind++)
           tmp[ind] = tmp[ind] & ~PTE_W;
       } else {
-        // Ref count decrement bc no longer shared
+        // Copy the table, borrowing its page references (see above);
+        // our reference to the shared table becomes the borrower's.
+        // If it borrows itself, we borrow from its original instead,
+        // and need our own references only where the two differ.
         pageinfo *p = mem_alloc();
+        if (p == NULL)
+          return NULL;
         mem_incref(p);
+        mem_stat(MEMSTAT_PTAB, 1);
         pte_t *new = mem_pi2ptr(p);
+        pageinfo *tpi = mem_ptr2pi(tmp);
         int k;
-        for(k = 0; k < 1024; k++) {
+        for(k = 0; k < 1024; k++)
           new[k] = tmp[k] & ~PTE_W;
-          if(PGADDR(tmp[k]) != PTE_ZERO)
-            mem_incref(mem_phys2pi(PGADDR(tmp[k])));
+        if(tpi->ptabsrc == NULL)
+          p->ptabsrc = tpi;
+        else {
+          p->ptabsrc = tpi->ptabsrc;
+          mem_incref(p->ptabsrc);
+          for(k = 0; k < 1024; k++)
+            if(PGADDR(tmp[k]) != PTE_ZERO && !pmap_borrowed(&tmp[k]))
+              mem_incref(mem_phys2pi(PGADDR(tmp[k])));
+          mem_decref(tpi, pmap_freeptab);
         }
-        mem_decref(mem_ptr2pi(tmp), pmap_freeptab);
         tmp = new;
       }
     }
-    *table = (pte_t)tmp | PTE_P | PTE_U | PTE_A | PTE_W;
+    if(writing)
+      pmap_unborrow(tmp);
+    if(writing)   // a shared table isn't ours to make writable
+      *table = (pte_t)tmp | PTE_P | PTE_U | PTE_A | PTE_W;
     return &tmp[PTX(va)];
   }
 
@@ -200,19 +449,38 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
     return NULL;
 
   // We have to create a new table bc it doesnt exist
-  pageinfo *pi = mem_alloc();
+  pageinfo *pi = mem_poolalloc(&pmap_ptabpool);	// prefilled with PTE_ZERO
   if(!pi)
     return NULL;
   t = mem_pi2ptr(pi);
   mem_incref(pi);
-  int i;
-  for(i = 0; i < 1024; i++)
-    t[i] = PTE_ZERO;
+  mem_stat(MEMSTAT_PTAB, 1);
   *table = mem_pi2phys(pi) | PTE_P | PTE_U | PTE_A | PTE_W;
 
   return &t[PTX(va)];
 }
 
+// Find the kernel address of the byte at user address va in pdir,
+// reading pdir's page tables without changing them (unlike pmap_walk()),
+// so that it is safe to use on page tables another CPU may be using.
+// Returns NULL if va is outside user space or not backed by a page
+// other than the zero page.
+void *
+pmap_lookup(pde_t *pdir, uint32_t va)
+{
+	if (va < VM_USERLO || va >= VM_USERHI)
+		return NULL;
+	pde_t pde = pdir[PDX(va)];
+	if (pde & PTE_PS)
+		return (uint8_t*)mem_ptr(PTADDR(pde)) + (va - PTADDR(va));
+	if (!(pde & PTE_P) || PGADDR(pde) == PTE_ZERO)
+		return NULL;
+	pte_t pte = ((pte_t*)mem_ptr(PGADDR(pde)))[PTX(va)];
+	if (!(pte & PTE_P) || PGADDR(pte) == PTE_ZERO)
+		return NULL;
+	return (uint8_t*)mem_ptr(PGADDR(pte)) + PGOFF(va);
+}
+
 //
 // Map the physical page 'pi' at user virtual address 'va'.
 // The permissions (the low 12 bits) of the page table
@@ -244,7 +512,7 @@ pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t va, int perm)
   // If entry was a valid entry, remove it
   if (*entry & PTE_P)
     pmap_remove(pdir, va, PAGESIZE);
-  *entry = mem_pi2phys(pi) | perm | PTE_P;
+  pmap_pteset(entry, mem_pi2phys(pi) | perm | PTE_P);
   return entry;
 }
 
@@ -269,8 +537,69 @@ pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t va, int perm)
 // Hint: The TA solution is implemented using pmap_lookup,
 // 	pmap_inval, and mem_decref.
 //
+// Queue a PDE mapping a whole page table or superpage for
+// pmap_reclaimhelp() to drop its references.
+// Returns false if the queue is full.
+static bool
+pmap_reclaimadd(pde_t pde)
+{
+	spinlock_acquire(&pmap_reclaimq.lock);
+	bool ok = pmap_reclaimq.head - pmap_reclaimq.tail < PMAP_RECLAIMMAX;
+	if (ok)
+		pmap_reclaimq.pde[pmap_reclaimq.head++ % PMAP_RECLAIMMAX] = pde;
+	spinlock_release(&pmap_reclaimq.lock);
+	return ok;
+}
+
+// Called from idle CPUs, and from mem_alloc() when it runs out,
+// to free one page table or superpage that pmap_removelazy() queued.
+// Returns true if there was one.
+bool
+pmap_reclaimhelp(void)
+{
+	if (pmap_reclaimq.head == pmap_reclaimq.tail)
+		return 0;
+	spinlock_acquire(&pmap_reclaimq.lock);
+	bool any = pmap_reclaimq.head != pmap_reclaimq.tail;
+	pde_t pde = any ? pmap_reclaimq.pde[pmap_reclaimq.tail++
+					% PMAP_RECLAIMMAX] : PTE_ZERO;
+	spinlock_release(&pmap_reclaimq.lock);
+	if (any)
+		pmap_pdedecref(pde);
+	return any;
+}
+
+static void pmap_remove_(pde_t *pdir, uint32_t va, size_t size, bool lazy);
+
+// Return true if entries lo through hi-1 of page table 'pt' all hold 'pte'.
+static bool
+pmap_ptesare(const pte_t *pt, int lo, int hi, pte_t pte)
+{
+	for (; lo < hi; lo++)
+		if (pt[lo] != pte)
+			return 0;
+	return 1;
+}
+
 void
 pmap_remove(pde_t *pdir, uint32_t va, size_t size)
+{
+	pmap_remove_(pdir, va, size, 0);
+}
+
+// Like pmap_remove(), but leave whole page tables and superpages
+// for idle CPUs to free (see pmap_reclaimhelp()),
+// so that the caller isn't kept waiting while each of their pages is.
+// Their pages stay allocated a little longer, so we do it all at once
+// as pmap_remove() does when free memory is running low.
+void
+pmap_removelazy(pde_t *pdir, uint32_t va, size_t size)
+{
+	pmap_remove_(pdir, va, size, mem_nfree() >= mem_npage / 8);
+}
+
+static void
+pmap_remove_(pde_t *pdir, uint32_t va, size_t size, bool lazy)
 {
 	assert(PGOFF(size) == 0);	// must be page-aligned
 	assert(va >= VM_USERLO && va < VM_USERHI);
@@ -295,10 +624,31 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
     // then we have to remove the entries one-by-one
     if(PTX(start) != 0
         || start + PTSIZE > end) {
+      // Look first, before pmap_walk() copies a shared table:
+      // maybe there's nothing in the range to remove,
+      // or nothing outside it either, so the table can just go.
+      uint32_t tend = MIN(end, PTADDR(start) + PTSIZE);
+      if((*table & (PTE_P | PTE_PS)) == PTE_P) {
+        pte_t *pt = mem_ptr(PGADDR(*table));
+        int lo = PTX(start), hi = lo + (tend - start) / PAGESIZE;
+        if(pmap_ptesare(pt, lo, hi, PTE_ZERO)) {
+          start = tend;
+          continue;
+        }
+        if(pmap_ptesare(pt, 0, lo, PTE_ZERO) &&
+            pmap_ptesare(pt, hi, NPTENTRIES, PTE_ZERO)) {
+          if (!lazy || !pmap_reclaimadd(*table))
+            pmap_pdedecref(*table);
+          *table = PTE_ZERO;
+          start = tend;
+          continue;
+        }
+      }
       pte_t *entry = pmap_walk(pdir, start, 1);
+      if(!entry)
+        panic("pmap_remove: no memory to split superpage");
       while(start < end) {
-        if(PGADDR(*entry) != PTE_ZERO) // Theres a page here!
-            mem_decref(mem_phys2pi(PGADDR(*entry)), mem_free);
+        pmap_pteunref(entry);   // if theres a page here
         *entry = PTE_ZERO;
         start += PAGESIZE;
         *entry++;
@@ -308,9 +658,9 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
       continue;
     }
 
-		// We can remove an entire table!	
-		if(PGADDR(*table) != PTE_ZERO)
-			mem_decref(mem_phys2pi(PGADDR(*table)), pmap_freeptab);
+		// We can remove an entire table (or superpage)!
+		if (!lazy || !pmap_reclaimadd(*table))
+			pmap_pdedecref(*table);
 		*table = PTE_ZERO;
 		start += PTSIZE;
   }
@@ -320,17 +670,70 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 // Invalidate the TLB entry or entries for a given virtual address range,
 // but only if the page tables being edited are the ones
 // currently in use by the processor.
+// Small ranges get a page-by-page invlpg, which keeps the rest of the TLB;
+// past PMAP_INVLPGMAX pages, reloading CR3 to flush everything is cheaper.
+// Kernel mappings are global (PTE_G), so survive the reload either way.
 //
+#define PMAP_INVLPGMAX	32
+
 void
 pmap_inval(pde_t *pdir, uint32_t va, size_t size)
 {
-	// Flush the entry only if we're modifying the current address space.
-	proc *p = proc_cur();
-	if (p == NULL || p->pdir == pdir) {
-		if (size == PAGESIZE)
-			invlpg(mem_ptr(va));	// invalidate one page
-		else
-			lcr3(mem_phys(pdir));	// invalidate everything
+	// Flush only if we're modifying the address space the CPU is using,
+	// whether or not a process is running in it right now.
+	if (rcr3() != mem_phys(pdir))
+		return;
+	if (size <= PMAP_INVLPGMAX * PAGESIZE) {
+		uint32_t end = va + size;
+		for (; va < end; va += PAGESIZE)
+			invlpg(mem_ptr(va));
+	} else
+		lcr3(mem_phys(pdir));	// invalidate everything
+}
+
+//
+// Make sure no other CPU keeps stale TLB entries for pdir,
+// after an operation that changed or removed some of its mappings.
+// pmap_inval() only flushes this CPU, so callers make one call here
+// per operation, once all of its edits are in place, not per page.
+// Only CPUs whose CR3 holds pdir can have cached its mappings.
+// Those not running a process in it right now are marked lazily,
+// and flush in proc_run() before they next return to user mode;
+// those that are get a T_IPITLB and we wait until they have flushed.
+// Must not be called holding any spinlock another CPU might spin on.
+//
+void
+pmap_shootdown(pde_t *pdir)
+{
+	cpu *self = cpu_cur(), *c;
+	uint32_t pa = mem_phys(pdir);
+
+	// Order our page table stores before the tlbpdir loads below.
+	xadd(&self->tlbdone, 0);
+
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		if (c == self || c->tlbpdir != pa)
+			continue;
+		uint32_t ticket = xadd(&c->tlbreq, 1) + 1;
+		proc *p = c->proc;
+		if (p == NULL || p->state != PROC_RUN || p->runcpu != c)
+			continue;	// idle or switching: flushes later
+		lapic_ipi(c->id, T_IPITLB);
+		while ((int32_t)(c->tlbdone - ticket) < 0) {
+			pmap_tlbservice(self);	// in case c is shooting us
+			pause();
+		}
+	}
+}
+
+// Flush this CPU's TLB if another CPU asked us to with pmap_shootdown().
+void
+pmap_tlbservice(cpu *c)
+{
+	uint32_t req = c->tlbreq;
+	if (req != c->tlbdone) {
+		lcr3(rcr3());
+		c->tlbdone = req;
 	}
 }
 
@@ -338,15 +741,18 @@ pmap_inval(pde_t *pdir, uint32_t va, size_t size)
 // Virtually copy a range of pages from spdir to dpdir (could be the same).
 // Uses copy-on-write to avoid the cost of immediate copying:
 // instead just copies the mappings and makes both source and dest read-only.
+// The range need only be page-aligned: wherever source and destination
+// are both at a 4MB boundary with a whole 4MB left, we share the entire
+// page table (or superpage), and otherwise share individual PTEs.
 // Returns true if successfull, false if not enough memory for copy.
 //
 int
 pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 		size_t size)
 {
-	assert(PTOFF(sva) == 0);	// must be 4MB-aligned
-	assert(PTOFF(dva) == 0);
-	assert(PTOFF(size) == 0);
+	assert(PGOFF(sva) == 0);	// must be page-aligned
+	assert(PGOFF(dva) == 0);
+	assert(PGOFF(size) == 0);
 	assert(sva >= VM_USERLO && sva < VM_USERHI);
 	assert(dva >= VM_USERLO && dva < VM_USERHI);
 	assert(size <= VM_USERHI - sva);
@@ -356,25 +762,197 @@ pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 	pmap_inval(dpdir, dva, size);
   uint32_t start = sva;
   uint32_t end = sva + size;
-	pde_t *source = &spdir[PDX(sva)];
-	pde_t *dest = &dpdir[PDX(dva)];
-  for(; start < end; source++, dest++,
-        start += PTSIZE, dva += PTSIZE) {
-    // Shared means one more reference
-  	if(*source != PTE_ZERO)
-  		mem_incref(mem_phys2pi(PGADDR(*source)));
-        // Delete the old page table
-  	if(*dest & PTE_P)
-  		pmap_remove(dpdir, dva, PTSIZE);
-        // share mappings
-  	*dest = *source;
-    // Mark both as not writable bc they are now shared
-    *dest &= ~PTE_W;
-    *source &= ~PTE_W;
+  while(start < end) {
+    pde_t *source = &spdir[PDX(start)];
+    pde_t *dest = &dpdir[PDX(dva)];
+    if(PTOFF(start) == 0 && PTOFF(dva) == 0 && end - start >= PTSIZE) {
+      // Shared means one more reference
+      pmap_pdeincref(*source);
+          // Delete the old page table
+      if(*dest & PTE_P)
+        pmap_remove(dpdir, dva, PTSIZE);
+          // share mappings
+      *dest = *source;
+      // Mark both as not writable bc they are now shared
+      *dest &= ~PTE_W;
+      *source &= ~PTE_W;
+      start += PTSIZE;
+      dva += PTSIZE;
+      continue;
+    }
+
+    // Partial table: go as far as the nearer page table boundary.
+    size_t n = MIN(PTSIZE - PTOFF(start), PTSIZE - PTOFF(dva));
+    n = MIN(n, end - start);
+    if(*source == PTE_ZERO) {   // nothing there: dest becomes the same
+      pmap_remove(dpdir, dva, n);
+      start += n;
+      dva += n;
+      continue;
+    }
+    pte_t *src_e = pmap_walk(spdir, start, 1);
+    pte_t *dst_e = pmap_walk(dpdir, dva, 1);
+    if(src_e == NULL || dst_e == NULL)
+      return 0;   // out of memory
+    for(; n > 0; n -= PAGESIZE, start += PAGESIZE, dva += PAGESIZE) {
+      pte_t pte = *src_e++ & ~PTE_W;
+      if(PGADDR(pte) != PTE_ZERO)
+        mem_incref(mem_phys2pi(PGADDR(pte)));
+      pmap_pteunref(dst_e);
+      src_e[-1] = pte;
+      pmap_pteset(dst_e++, pte);
+    }
   }
 	return 1;
 }
 
+// Start a fresh dirty page list at a snapshot, allocating it if 'd' is NULL.
+// Returns NULL if there's no memory for it,
+// in which case pmap_merge() just compares the whole address space.
+pmapdirty *
+pmap_dirtyreset(pmapdirty *d)
+{
+	if (d == NULL) {
+		pageinfo *pi = mem_alloc();
+		if (pi == NULL)
+			return NULL;
+		d = mem_pi2ptr(pi);
+	}
+	d->n = 0;
+	return d;
+}
+
+// The address space changed behind pmap_pagefault()'s back:
+// the dirty list is no longer complete, so stop relying on it.
+void
+pmap_dirtyall(pmapdirty *d)
+{
+	if (d != NULL)
+		d->n = PMAP_NDIRTY + 1;
+}
+
+static void
+pmap_dirtyadd(pmapdirty *d, uint32_t va)
+{
+	if (d->n < PMAP_NDIRTY)
+		d->va[d->n++] = va;
+	else
+		pmap_dirtyall(d);
+}
+
+// A system call changed 'size' bytes at 'va' behind pmap_pagefault()'s
+// back: add those pages to the dirty list if they fit,
+// so that a small SYS_COPY or SYS_PERM needn't spoil it.
+void
+pmap_dirtyrange(pmapdirty *d, uint32_t va, size_t size)
+{
+	if (d == NULL || d->n > PMAP_NDIRTY)
+		return;
+	uint32_t end = ROUNDUP(va + size, PAGESIZE);
+	va = ROUNDDOWN(va, PAGESIZE);
+	if ((end - va) / PAGESIZE > PMAP_NDIRTY - d->n) {
+		pmap_dirtyall(d);
+		return;
+	}
+	for (; va < end; va += PAGESIZE)
+		d->va[d->n++] = va;
+}
+
+// Return true if page 'va' of dirty list 'd' is also covered
+// by a superpage entry, which callers handle in one go.
+static bool
+pmap_dirtysuper(const pmapdirty *d, uint32_t va)
+{
+	int i;
+	for (i = 0; i < d->n; i++)
+		if (d->va[i] == (PTADDR(va) | PMAP_DIRTYSUPER))
+			return 1;
+	return 0;
+}
+
+// Bring the snapshot 'rpdir' of user space 'pdir' up to date,
+// as pmap_copy() of all of user space would.
+// If 'dirty' is a complete list of the pages written since the last
+// snapshot, copy and write-protect only those: everything else is
+// already the same in both, and keeps whatever tables it has,
+// so a process snapshotted over and over only takes new COW faults
+// on the pages it actually writes.
+int
+pmap_snap(pde_t *pdir, pde_t *rpdir, const pmapdirty *dirty)
+{
+	if (dirty == NULL || dirty->n > PMAP_NDIRTY)
+		return pmap_copy(pdir, VM_USERLO, rpdir, VM_USERLO,
+				VM_USERHI - VM_USERLO);
+
+	int i;
+	for (i = 0; i < dirty->n; i++) {
+		uint32_t va = dirty->va[i];
+		size_t size = PAGESIZE;
+		if (va & PMAP_DIRTYSUPER) {
+			va = PTADDR(va);
+			size = PTSIZE;
+		} else if (pmap_dirtysuper(dirty, va))
+			continue;
+		if (!pmap_copy(pdir, va, rpdir, va, size))
+			return 0;	// out of memory
+	}
+	return 1;
+}
+
+// Return the physical page the snapshot 'rpdir' maps at 'va'.
+static uint32_t
+pmap_snappage(pde_t *rpdir, uint32_t va)
+{
+	pde_t pde = rpdir[PDX(va)];
+	if (!(pde & PTE_P))
+		return PTE_ZERO;
+	if (pde & PTE_PS)
+		return PGADDR(pde) + PTX(va) * PAGESIZE;
+	return PGADDR(((pte_t*)PGADDR(pde))[PTX(va)]);
+}
+
+// Most pages pmap_pagefault() resolves ahead of a sequential writer.
+#define PMAP_FAULTMAX	16
+
+// Give the process 'p' a private writable page at 'va', whose PTE
+// is 'entry' and nominally writable, for pmap_pagefault().
+// Returns false if out of memory.
+static bool
+pmap_faultpage(proc *p, pte_t *entry, uint32_t va)
+{
+  // If this write makes the page diverge from the process's snapshot,
+  // note it so pmap_merge() knows to look at it.
+  if(p->dirty != NULL && PGADDR(*entry) == pmap_snappage(p->rpdir, va))
+    pmap_dirtyadd(p->dirty, va);
+  pte_t new = PGADDR(*entry);
+  pageinfo *spi = mem_phys2pi(new);
+  if(PGADDR(*entry) == PTE_ZERO) {
+    // First write to a zero page: take an already-zeroed page.
+    pageinfo *pi = mem_poolalloc(&mem_zeropool);
+    if(!pi)
+      return 0;
+    mem_incref(pi);
+    new = mem_pi2phys(pi);
+  } else if(pmap_borrowed(entry) || spi->refcount > 1 || spi->home != 0) {
+    // Copy on write.  Our copy of a remote page is copied even if
+    // we alone use it, so that it stays a true copy of its RR:
+    // the new page remembers that RR as its origin, for net_push()
+    // to send the changes back to its home node as a delta.
+    pageinfo *pi = mem_alloc();
+    if(!pi)
+      return 0;
+    mem_incref(pi);
+    memmove((void*)mem_pi2phys(pi), (void*)PGADDR(*entry), PAGESIZE);
+    pi->origin = spi->home != 0 ? spi->home : spi->origin;
+    pmap_pteunref(entry);
+    new = mem_pi2phys(pi);
+  }
+  *entry = new | SYS_WRITE // still nominally writable
+  | PTE_P | PTE_U // present and in user space
+  | PTE_W;    // system writable and accessed
+  return 1;
+}
+
 //
 // Transparently handle a page fault entirely in the kernel, if possible.
 // If the page fault was caused by a write to a copy-on-write page,
@@ -393,72 +971,397 @@ pmap_pagefault(trapframe *tf)
   if(fva < VM_USERLO || fva >= VM_USERHI)
     return;
   proc *curr = proc_cur();
+
+  // File data not yet read in from disk (see kern/disk.c)
+  if(disk_pagefault(tf, fva))
+    return;
+
+  // A write to a read-only superpage we alone map just needs PTE_W;
+  // if any of its pages is shared, pmap_walk() splits it for COW below.
+  pde_t *pde = &curr->pdir[PDX(fva)];
+  if((*pde & (PTE_PS | SYS_WRITE | PTE_W)) == (PTE_PS | SYS_WRITE)) {
+    pageinfo *pi = mem_phys2pi(PGADDR(*pde));
+    int i;
+    for(i = 0; i < NPTENTRIES && pi[i].refcount == 1; i++)
+      ;
+    if(i == NPTENTRIES) {
+      *pde |= PTE_W;
+      pmap_inval(curr->pdir, PTADDR(fva), PTSIZE);
+      pmap_shootdown(curr->pdir);
+      trap_return(tf);
+    }
+  }
+
   pte_t *entry = pmap_walk(curr->pdir, fva, 1);
   // The page must be nominally writable
-  if(!(*entry & SYS_WRITE)) 
+  if(!entry || !(*entry & SYS_WRITE)) 
       return;
-  pte_t new = PGADDR(*entry);
-  if(mem_phys2pi(PGADDR(*entry))->refcount > 1 // shared for copy on write
-    || PGADDR(*entry) == PTE_ZERO) {      // we can also copy zero pages!
-    pageinfo *p = mem_alloc();
-    if(PGADDR(*entry) != PTE_ZERO)
-        mem_decref(mem_phys2pi(PGADDR(*entry)), mem_free);
-    mem_incref(p);
-    memmove((void*)mem_pi2phys(p), (void*)PGADDR(*entry), PAGESIZE);
-    new = mem_pi2phys(p);
+  // A sequential writer reaching far enough gets a superpage.
+  if(PGADDR(*entry) == PTE_ZERO && PTX(fva) == PMAP_SUPERMIN &&
+      pmap_superok(fva) && pmap_promote(curr, fva)) {
+    pmap_shootdown(curr->pdir);
+    trap_return(tf);
   }
-  *entry = new | SYS_WRITE // still nominally writable
-  | PTE_P | PTE_U // present and in user space
-  | PTE_W;    // system writable and accessed
-  pmap_inval(curr->pdir, PGADDR(fva), PAGESIZE);
+  if(!pmap_faultpage(curr, entry, PGADDR(fva)))
+    return;       // out of memory: reflect the fault
+  mem_stat(MEMSTAT_FAULTS, 1);
+
+  // Fault around: a process writing its way sequentially through memory
+  // gets the following pages in its window resolved in the same trap,
+  // up to the end of the page table.  The window doubles on every fault
+  // one page past the last one resolved, and halves on any other.
+  uint32_t va = PGADDR(fva);
+  if(va == curr->faultnext)
+    curr->faultwin = curr->faultwin ? MIN(curr->faultwin * 2,
+        PMAP_FAULTMAX) : 1;
+  else
+    curr->faultwin /= 2;
+  int n;
+  for(n = curr->faultwin; n > 0; n--) {
+    va += PAGESIZE;
+    entry++;
+    if(PTX(va) == 0 || !(*entry & SYS_WRITE) || (*entry & PTE_W) ||
+        disk_isabsent(*entry))
+      break;
+    if(PTX(va) == PMAP_SUPERMIN && PGADDR(*entry) == PTE_ZERO &&
+        pmap_superok(va))
+      break;      // leave this fault to pmap_promote()
+    if(!pmap_faultpage(curr, entry, va))
+      break;
+    mem_stat(MEMSTAT_FAULTAHEAD, 1);
+  }
+  if(n > 0)       // stopped short: va is the next page not resolved
+    va -= PAGESIZE;
+  curr->faultnext = va + PAGESIZE;
+  pmap_inval(curr->pdir, PGADDR(fva), va + PAGESIZE - PGADDR(fva));
+  pmap_shootdown(curr->pdir);
   trap_return(tf);
 }
 
 //
+// Merge the changes in page 'src' relative to snapshot 'snap' into 'dest',
+// a word at a time, looking at individual bytes only in words that
+// changed on both sides.  Stops at the first word with a conflicting byte,
+// returning its offset, or PAGESIZE if there was none.
+static uint32_t
+pmap_mergewords(uint32_t *dest, const uint32_t *src, const uint32_t *snap)
+{
+	int i, j;
+	for (i = 0; i < PAGESIZE/4; i++) {
+		if (src[i] == snap[i])		// unchanged in source
+			continue;
+		if (dest[i] == snap[i]) {	// unchanged in destination
+			dest[i] = src[i];
+			continue;
+		}
+		uint8_t *d = (uint8_t*)&dest[i];
+		const uint8_t *s = (const uint8_t*)&src[i];
+		const uint8_t *r = (const uint8_t*)&snap[i];
+		for (j = 0; j < 4; j++) {
+			if (s[j] == r[j])
+				continue;
+			if (d[j] != r[j])
+				return i * 4;
+		}
+		for (j = 0; j < 4; j++)
+			if (s[j] != r[j])
+				d[j] = s[j];
+	}
+	return PAGESIZE;
+}
+
+// The same merge, 16 bytes at a time with SSE2 byte compares:
+// lanes unchanged in the source are skipped after one compare,
+// and mixed lanes are blended with a mask instead of byte by byte.
+// Stops at the first lane with a conflict, likewise returning its offset.
+// The caller must own the SSE registers (see proc_fpugrab()).
+static uint32_t
+pmap_mergesse2(uint8_t *dest, const uint8_t *src, const uint8_t *snap)
+{
+	uint32_t off = 0, conflict;
+	asm volatile(
+		"1:	movdqa	(%2,%1),%%xmm0\n"	// source
+		"	movdqa	(%3,%1),%%xmm1\n"	// snapshot
+		"	movdqa	%%xmm0,%%xmm2\n"
+		"	pcmpeqb	%%xmm1,%%xmm2\n"	// bytes unchanged in source
+		"	pmovmskb %%xmm2,%0\n"
+		"	cmpl	$0xffff,%0\n"
+		"	je	2f\n"			// keep destination's lane
+		"	movdqa	(%4,%1),%%xmm3\n"	// destination
+		"	pcmpeqb	%%xmm3,%%xmm1\n"	// bytes unchanged in dest
+		"	por	%%xmm2,%%xmm1\n"
+		"	pmovmskb %%xmm1,%0\n"
+		"	cmpl	$0xffff,%0\n"
+		"	jne	3f\n"			// both sides changed a byte
+		"	pand	%%xmm2,%%xmm3\n"	// dest where source unchanged,
+		"	pandn	%%xmm0,%%xmm2\n"	// source everywhere else
+		"	por	%%xmm2,%%xmm3\n"
+		"	movdqa	%%xmm3,(%4,%1)\n"
+		"2:	addl	$16,%1\n"
+		"	cmpl	%5,%1\n"
+		"	jb	1b\n"
+		"3:\n"
+		: "=&r" (conflict), "+r" (off)
+		: "r" (src), "r" (snap), "r" (dest), "i" (PAGESIZE)
+		: "cc", "memory");
+	return off;
+}
+
+// Finish merging a page from offset 'off', where a byte changed on both
+// sides, under the conflict policy in rep->policy (see inc/syscall.h).
+// Returns the number of conflicts: bytes changed on both sides,
+// or words for the policies that combine whole words.
+static uint32_t
+pmap_mergeresolve(uint8_t *dest, const uint8_t *src, const uint8_t *snap,
+		uint32_t off, const mergereport *rep)
+{
+	uint32_t policy = rep->policy, n = 0;
+	if (policy == SYS_MERGEADD || policy == SYS_MERGEMAX) {
+		int32_t *d = (int32_t*)dest;
+		const int32_t *s = (const int32_t*)src, *r = (const int32_t*)snap;
+		int i;
+		for (i = off / 4; i < PAGESIZE/4; i++) {
+			if (s[i] == r[i])
+				continue;
+			if (d[i] == r[i]) {
+				d[i] = s[i];
+				continue;
+			}
+			n++;
+			if (policy == SYS_MERGEADD)	// unsigned: wraps, no UB
+				d[i] = (uint32_t)d[i] +
+					((uint32_t)s[i] - (uint32_t)r[i]);
+			else if (s[i] > d[i])
+				d[i] = s[i];
+		}
+		return n;
+	}
+	int i;
+	for (i = off; i < PAGESIZE; i++) {
+		if (src[i] == snap[i])
+			continue;
+		if (dest[i] != snap[i]) {
+			n++;
+			if (policy != SYS_MERGESRC)
+				continue;	// keep dest's byte
+		}
+		dest[i] = src[i];
+	}
+	return n;
+}
+
+// Add a page's conflicts to the merge report.
+// Helper CPUs of a parallel merge may be updating it at the same time.
+static void
+pmap_mergenote(mergereport *rep, uint32_t dva, uint32_t n)
+{
+	xadd(&rep->conflicts, n);
+	xadd(&rep->pages, 1);
+	uint32_t va;
+	while ((va = rep->va) == 0 || dva < va)
+		if (cmpxchg(&rep->va, va, dva) == va)
+			break;
+}
+
 // Helper function for pmap_merge: merge a single memory page
 // that has been modified in both the source and destination.
-// If conflicting writes to a single byte are detected on the page,
-// print a warning to the console and remove the page from the destination.
+// Bytes changed on both sides are conflicts, counted in 'rep'
+// and settled by its policy; under the default SYS_MERGECLR,
+// the page is removed from the destination instead.
 // If the destination page is read-shared, be sure to copy it before modifying!
 //
 void
-pmap_mergepage(pte_t *rpte, pte_t *spte, pte_t *dpte, uint32_t dva)
+pmap_mergepage(pte_t *rpte, pte_t *spte, pte_t *dpte, uint32_t dva,
+		mergereport *rep)
 {
-  uint8_t *dest = (uint8_t*)PGADDR(*dpte); // We're doing a byte by byte merge hence uint8_t
+  uint8_t *dest = (uint8_t*)PGADDR(*dpte);
   uint8_t *src = (uint8_t*)PGADDR(*spte);
+  uint8_t *snap = (uint8_t*)PGADDR(*rpte);
+
+  // Identical pages need no comparing: the PTEs differed only in perms.
+  if (src == snap)		// nothing changed in the source
+    return;
+  if (dest == snap) {		// nothing changed in dest: share source
+    pmap_pteunref(dpte);
+    if (src != (uint8_t*)PTE_ZERO)
+      mem_incref(mem_ptr2pi(src));
+    pmap_pteset(dpte, *spte & ~PTE_W);
+    *spte &= ~PTE_W;
+    return;
+  }
 
   // If dest is read-shared we have to copy it
   // same as in page fault handler
-  if(mem_ptr2pi(dest)->refcount > 1 || dest == (uint8_t*)PTE_ZERO) {  
+  if(dest == (uint8_t*)PTE_ZERO || pmap_borrowed(dpte) ||
+      mem_ptr2pi(dest)->refcount > 1) {
     // zero pages have to be copied too so we can "write" to them
     pageinfo *p = mem_alloc();
-    if(dest != (uint8_t*)PTE_ZERO)
-        mem_decref(mem_ptr2pi(dest), mem_free);
+    if (p == NULL)
+      panic("pmap_mergepage: out of memory");
     mem_incref(p);
     memmove(mem_pi2ptr(p), dest, PAGESIZE);
+    pmap_pteunref(dpte);
     dest = mem_pi2ptr(p);
     *dpte = (pte_t)mem_pi2ptr(p) | SYS_RW | PTE_P | PTE_U | PTE_W;
   }
-  uint8_t *snap = (uint8_t*)PGADDR(*rpte);
-	int i;
-	for(i = 0; i < PAGESIZE; i++) {
-		if(!(src[i] == snap[i] || dest[i] == snap[i])) {
-      cprintf("Warning: merge conflict.\n");  // if neither src or dest match ref we have a conflict
-      *dpte = PTE_ZERO;
+
+  // Merging byte by byte up to the first conflict is exact for the
+  // byte policies; SYS_MERGEADD and SYS_MERGEMAX compare whole words.
+  uint32_t off = 0;
+  if (rep->policy != SYS_MERGEADD && rep->policy != SYS_MERGEMAX) {
+    if (pmap_sse2) {
+      proc_fpugrab();
+      off = pmap_mergesse2(dest, src, snap);
+      proc_fpudrop();
+    } else
+      off = pmap_mergewords((uint32_t*)dest, (uint32_t*)src,
+          (uint32_t*)snap);
+    if (off == PAGESIZE)
       return;
-    }
-		if(dest[i] == snap[i])  // only copy when something has changed
-			dest[i] = src[i];
-	}
+  }
+
+  // if neither src or dest match ref we have a conflict
+  uint32_t n = pmap_mergeresolve(dest, src, snap, off, rep);
+  if (n == 0)
+    return;
+  pmap_mergenote(rep, dva, n);
+  if (rep->policy == SYS_MERGECLR) {
+    mem_decref(mem_ptr2pi(dest), mem_free);
+    *dpte = PTE_ZERO;
+  }
+}
+
+// Merge one page's PTE from source into destination
+// given the snapshot's PTE for the same page.
+static void
+pmap_mergepte(pte_t *snp_e, pte_t *src_e, pte_t *dst_e, uint32_t dva,
+		mergereport *rep)
+{
+  if(!(*src_e == *snp_e) && !(*dst_e == *snp_e)) {
+    // we have to do a byte merge
+    pmap_mergepage(snp_e, src_e, dst_e, dva, rep);
+  } else if (*dst_e == *snp_e && *src_e != *snp_e) {
+    // just do a full copy with copy on write
+    pmap_pteunref(dst_e);
+    if(PGADDR(*src_e) != PTE_ZERO)
+      mem_incref(mem_phys2pi(PGADDR(*src_e)));
+    *src_e &= ~PTE_W; // not writeable anymore bc its copied
+    pmap_pteset(dst_e, *src_e);
+  }
+}
+
+// Merge the page at 'va' in spdir into 'dva' in dpdir, relative to rpdir.
+static bool
+pmap_mergeva(pde_t *rpdir, pde_t *spdir, uint32_t va,
+		pde_t *dpdir, uint32_t dva, mergereport *rep)
+{
+	pte_t zero = PTE_ZERO;
+	pte_t *src_e = pmap_walk(spdir, va, 1);
+	pte_t *dst_e = pmap_walk(dpdir, dva, 1);
+	pte_t *snp_e = pmap_walk(rpdir, va, 0);
+	if (src_e == NULL || dst_e == NULL)
+		return 0;
+	pmap_mergepte(snp_e ? snp_e : &zero, src_e, dst_e, dva, rep);
+	return 1;
+}
+
+// A full merge of a large region is split into 4MB chunks
+// that idle CPUs help work through (see pmap_mergehelp()).
+// Chunks cover disjoint page tables in all three address spaces,
+// and each page's outcome depends only on its three versions,
+// so the result is the same whichever CPU merges which chunk, in any order.
+// There is one job slot; a merge that finds it taken works alone.
+#define PMAP_MERGEPAR	16	// Fewest chunks worth sharing out
+static struct {
+	pde_t		*rpdir, *spdir, *dpdir;
+	uint32_t	sva, dva;
+	mergereport	*rep;
+	uint32_t	nchunks;
+	volatile uint32_t next;		// Next chunk to claim
+	volatile uint32_t open;		// Helpers may join
+	volatile uint32_t busy;		// CPUs working on the job
+	volatile uint32_t failed;	// Some chunk ran out of memory
+} pmap_mergejob;
+static volatile uint32_t pmap_mergeslot;	// Job slot in use
+
+// Claim and merge chunks of the posted job until there are none left.
+static void
+pmap_mergechunks(void)
+{
+	uint32_t i;
+	while ((i = xadd(&pmap_mergejob.next, 1)) < pmap_mergejob.nchunks)
+		if (!pmap_merge(pmap_mergejob.rpdir, pmap_mergejob.spdir,
+				pmap_mergejob.sva + i * PTSIZE,
+				pmap_mergejob.dpdir,
+				pmap_mergejob.dva + i * PTSIZE, PTSIZE, NULL,
+				pmap_mergejob.rep))
+			pmap_mergejob.failed = 1;
+}
+
+// Called from the idle loop in proc_sched():
+// help with a posted merge, if any.  Returns true if we did.
+bool
+pmap_mergehelp(void)
+{
+	if (!pmap_mergejob.open)
+		return 0;
+	xadd(&pmap_mergejob.busy, 1);	// pins the job before we look at it
+	bool helped = pmap_mergejob.open;
+	if (helped)
+		pmap_mergechunks();
+	xadd(&pmap_mergejob.busy, -1);
+	return helped;
+}
+
+// Merge a large region with help from idle CPUs.
+// Returns -1 if the job slot is taken, else pmap_merge()'s result.
+static int
+pmap_mergepar(pde_t *rpdir, pde_t *spdir, uint32_t sva,
+		pde_t *dpdir, uint32_t dva, size_t size, mergereport *rep)
+{
+	if (cmpxchg(&pmap_mergeslot, 0, 1) != 0)
+		return -1;
+	xadd(&pmap_mergejob.busy, 1);
+	pmap_mergejob.rpdir = rpdir;
+	pmap_mergejob.spdir = spdir;
+	pmap_mergejob.dpdir = dpdir;
+	pmap_mergejob.sva = sva;
+	pmap_mergejob.dva = dva;
+	pmap_mergejob.rep = rep;
+	pmap_mergejob.nchunks = size / PTSIZE;
+	pmap_mergejob.next = 0;
+	pmap_mergejob.failed = 0;
+	xchg(&pmap_mergejob.open, 1);
+	proc_wakeidle();
+
+	pmap_mergechunks();
+
+	// Wait for helpers still finishing their last chunks.
+	xchg(&pmap_mergejob.open, 0);
+	xadd(&pmap_mergejob.busy, -1);
+	while (pmap_mergejob.busy != 0)
+		pause();
+	int ok = !pmap_mergejob.failed;
+	xchg(&pmap_mergeslot, 0);
+
+	// Helpers invalidated only their own TLBs.
+	pmap_inval(spdir, sva, size);
+	pmap_inval(dpdir, dva, size);
+	return ok;
 }
 
 // 
 // Merge differences between a reference snapshot represented by rpdir
 // and a source address space spdir into a destination address space dpdir.
+// If 'dirty' is a complete list of the source pages written since the
+// snapshot, only those pages are compared; otherwise, everything is,
+// with the help of idle CPUs if the region is large.
+// Conflicts are settled by rep->policy and tallied in the rest of 'rep'.
 //
 int
 pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
-		pde_t *dpdir, uint32_t dva, size_t size)
+		pde_t *dpdir, uint32_t dva, size_t size,
+		const pmapdirty *dirty, mergereport *rep)
 {
 	assert(PTOFF(sva) == 0);	// must be 4MB-aligned
 	assert(PTOFF(dva) == 0);
@@ -476,6 +1379,36 @@ pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
 	pmap_inval(dpdir, dva, size);
     pmap_inval(rpdir, sva, size); // same range in reference as source
 
+	if (dirty != NULL && dirty->n <= PMAP_NDIRTY) {
+		// Visit just the pages written since the snapshot.
+		// A superpage entry covers its whole 4MB region,
+		// including any pages listed before it was promoted.
+		int i;
+		for (i = 0; i < dirty->n; i++) {
+			uint32_t va = dirty->va[i];
+			int npages = 1;
+			if (va & PMAP_DIRTYSUPER) {
+				va = PTADDR(va);
+				npages = NPTENTRIES;
+			} else if (pmap_dirtysuper(dirty, va))
+				continue;
+			if (va < sva || va - sva >= size)
+				continue;
+			for (; npages > 0; npages--, va += PAGESIZE)
+				if (!pmap_mergeva(rpdir, spdir, va,
+						dpdir, dva + (va - sva), rep))
+					return 0;	// out of memory
+		}
+		return 1;
+	}
+
+	if (size / PTSIZE >= PMAP_MERGEPAR) {
+		int ok = pmap_mergepar(rpdir, spdir, sva, dpdir, dva, size,
+				rep);
+		if (ok >= 0)
+			return ok;
+	}
+
 	uint32_t start = sva;
     uint32_t end = start + size;
     for(; start < end; snp++, dst++, src++) {
@@ -495,24 +1428,13 @@ pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
 		pte_t *src_e = pmap_walk(spdir, start, 1);
 		pte_t *dst_e = pmap_walk(dpdir, dva, 1);	
     pte_t *snp_e = pmap_walk(rpdir, start, 1);
+    if(src_e == NULL || dst_e == NULL || snp_e == NULL)
+      return 0;   // out of memory
 
     int i;
     for(i = 0; i < 1024; i++, src_e++, dst_e++, snp_e++,
-      start += PAGESIZE, dva += PAGESIZE) {
-      // Same deal entry by entry
-      if(!(*src_e == *snp_e) && !(*dst_e == *snp_e)) {
-        // we have to do a byte merge
-        pmap_mergepage(snp_e, src_e, dst_e, dva);
-      } else if (*dst_e == *snp_e && *src_e != *snp_e) {
-        // just do a full copy with copy on write
-    		if(PGADDR(*dst_e) != PTE_ZERO)
-    			mem_decref(mem_phys2pi(PGADDR(*dst_e)), mem_free);
-    		mem_incref(mem_phys2pi(PGADDR(*src_e)));
-    		*dst_e = *src_e;
-    		*src_e &= ~PTE_W; // not writeable anymore bc its copied
-        *dst_e &= ~PTE_W;
-	    }
-    }
+      start += PAGESIZE, dva += PAGESIZE)
+      pmap_mergepte(snp_e, src_e, dst_e, dva, rep);
 	}
 	return 1;
 }
@@ -525,6 +1447,20 @@ pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
 // If the user gives SYS_WRITE permission to a PTE_ZERO mapping,
 // the page fault handler copies the zero page when the first write occurs.
 //
+// Return what PTE 'pte' becomes with nominal permissions 'perm'.
+static pte_t
+pmap_permpte(pte_t pte, int perm)
+{
+  if(disk_isabsent(pte))        // stays absent until read in from disk
+    return (pte & ~SYS_RW) | (perm & SYS_RW) | PTE_U;
+  if((perm & SYS_READ) && (perm & SYS_WRITE))
+    return pte | SYS_RW | PTE_U | PTE_P | PTE_A | PTE_D;
+  else if(perm & SYS_READ)      // no more write
+    return (pte & ~SYS_WRITE & ~PTE_W) | SYS_READ | PTE_U | PTE_P;
+  else
+    return pte & ~SYS_RW & ~PTE_P & ~PTE_W;
+}
+
 int
 pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm)
 {
@@ -545,16 +1481,34 @@ pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm)
         start = PTADDR(start + PTSIZE); // Next page table
         continue;
     }
+    // Whole superpages stay whole unless losing all access.
+    if((*tab & PTE_PS) && PTX(start) == 0 && start + PTSIZE <= end &&
+        (perm & SYS_READ)) {
+      if(perm & SYS_WRITE)
+        *tab |= SYS_RW;
+      else
+        *tab &= ~SYS_WRITE & ~PTE_W;
+      start += PTSIZE;
+      continue;
+    }
+    // Leave a (maybe shared) table alone if nothing in it would change,
+    // rather than have pmap_walk() copy it for no reason.
+    uint32_t tend = MIN(end, PTADDR(start) + PTSIZE);
+    if((*tab & (PTE_P | PTE_PS)) == PTE_P) {
+      pte_t *pt = mem_ptr(PGADDR(*tab));
+      int i = PTX(start), hi = i + (tend - start) / PAGESIZE;
+      while(i < hi && pmap_permpte(pt[i], perm) == pt[i])
+        i++;
+      if(i == hi) {
+        start = tend;
+        continue;
+      }
+    }
     pte_t *entry = pmap_walk(pdir, start, 1);
+    if(!entry)
+      return 0;
     while(start < end) {    
-      if((perm & SYS_READ) && (perm & SYS_WRITE)){
-              *entry |= SYS_RW | PTE_U | PTE_P | PTE_A | PTE_D;
-            }
-      else if((perm & SYS_READ)) {
-        *entry &= ~SYS_WRITE & ~PTE_W;    // no more write
-        *entry |= SYS_READ | PTE_U | PTE_P;
-      } else
-        *entry &= ~SYS_RW & ~PTE_P & ~PTE_W;
+      *entry = pmap_permpte(*entry, perm);
       *entry++;
       start += PAGESIZE;
       if(PTX(start) == 0) // we reached the end of the table
@@ -576,12 +1530,165 @@ va2pa(pde_t *pdir, uintptr_t va)
 	return PGADDR(ptab[PTX(va)]);
 }
 
+// Content-based deduplication of private pages (see pmap_dedup()).
+// Each slot of the table holds a reference to a page whose mappings
+// are all read-only, so its contents can't change while it's there;
+// a later page with the same contents can then share it copy-on-write.
+#define PMAP_DEDUPSCAN	16	// Pages examined per pass; 0 disables
+#define PMAP_DEDUPEVERY	32	// Calls per pass, to keep proc_ret() cheap
+#define PMAP_DEDUPSLOTS	256	// Slots in the table of candidate pages
+static struct {
+	uint32_t	hash;		// Hash of the page's contents
+	pageinfo	*pi;		// The page, or NULL
+} pmap_deduptab[PMAP_DEDUPSLOTS];
+
+// Hash a page's contents, and note whether it is all zeros.
+static uint32_t
+pmap_hashpage(const uint32_t *pg, bool *zero)
+{
+	uint32_t h = 2166136261u, any = 0;
+	int i;
+	for (i = 0; i < PAGESIZE/4; i++) {
+		h = (h ^ pg[i]) * 16777619;	// FNV-1a, a word at a time
+		any |= pg[i];
+	}
+	*zero = (any == 0);
+	return h;
+}
+
+//
+// Reclaim memory from private pages of process 'p' whose contents
+// some other mapping already has, such as identical tables or buffers
+// filled in by many children of the same parent.
+// An all-zero page becomes a PTE_ZERO mapping again; a page matching
+// one in the dedup table is replaced with a read-only mapping of that,
+// and an unmatched one takes over its slot, becoming read-only itself.
+// Pages written since the last pass are left alone, but lose PTE_D so
+// we can tell next time: making a hot page read-only just costs a fault.
+// Examines up to PMAP_DEDUPSCAN mapped pages, starting where the last
+// pass for p left off, so that no one call takes long; and only makes
+// a pass every PMAP_DEDUPEVERY calls, since it's called on every return.
+// Must be called from p itself, as it stops (see proc_ret()),
+// while no one else can be editing its address space.
+//
+void
+pmap_dedup(proc *p)
+{
+	if (PMAP_DEDUPSCAN == 0 || ++p->dedupcalls < PMAP_DEDUPEVERY)
+		return;
+	p->dedupcalls = 0;
+	uint32_t va = MAX(p->dedupva, VM_USERLO);
+	int n = PMAP_DEDUPSCAN, changed = 0;
+	for (; va < VM_USERHI && n > 0; va += PAGESIZE) {
+		pde_t *pde = &p->pdir[PDX(va)];
+		if (!(*pde & PTE_P) || (*pde & PTE_PS) ||
+				PGADDR(*pde) == PTE_ZERO ||
+				mem_phys2pi(PGADDR(*pde))->refcount != 1) {
+			va = PTADDR(va + PTSIZE) - PAGESIZE;
+			continue;	// only page tables all our own
+		}
+		pte_t *pte = &((pte_t*)PGADDR(*pde))[PTX(va)];
+		if (!(*pte & PTE_P) || PGADDR(*pte) == PTE_ZERO)
+			continue;
+		n--;
+		pageinfo *pi = mem_phys2pi(PGADDR(*pte));
+		if (pi->refcount != 1 || pmap_borrowed(pte) ||
+				pi->home != 0 || pi->shared != 0)
+			continue;	// shared, or known to other nodes
+		if (*pte & PTE_D) {	// written lately: try again next time
+			*pte &= ~PTE_D;
+			changed = 1;
+			continue;
+		}
+
+		bool zero;
+		uint32_t h = pmap_hashpage(mem_ptr(PGADDR(*pte)), &zero);
+		if (zero) {
+			*pte = PTE_ZERO | (*pte & SYS_RW) |
+				((*pte & SYS_READ) ? PTE_P | PTE_U : 0);
+			mem_decref(pi, mem_free);
+			mem_stat(MEMSTAT_DEDUPZERO, 1);
+			changed = 1;
+			continue;
+		}
+
+		pageinfo *old = NULL;
+		spinlock_acquire(&pmap_deduplock);
+		int slot = h % PMAP_DEDUPSLOTS;
+		pageinfo *match = pmap_deduptab[slot].pi;
+		if (match != NULL && pmap_deduptab[slot].hash == h &&
+				memcmp(mem_pi2ptr(match), mem_pi2ptr(pi),
+					PAGESIZE) == 0) {
+			mem_incref(match);
+			*pte = mem_pi2phys(match) | (PGOFF(*pte) & ~PTE_W);
+			mem_decref(pi, mem_free);
+			mem_stat(MEMSTAT_DEDUPSHARED, 1);
+		} else {
+			old = match;		// replace with our page
+			mem_incref(pi);
+			pmap_deduptab[slot].hash = h;
+			pmap_deduptab[slot].pi = pi;
+			*pte &= ~PTE_W;
+		}
+		spinlock_release(&pmap_deduplock);
+		if (old != NULL)
+			mem_decref(old, mem_free);
+		changed = 1;
+	}
+	p->dedupva = va < VM_USERHI ? va : VM_USERLO;
+	if (changed) {
+		pmap_inval(p->pdir, VM_USERLO, VM_USERHI-VM_USERLO);
+		pmap_shootdown(p->pdir);
+	}
+}
+
+// Tally the user mappings in 'pdir' for memory accounting.
+// The caller doesn't lock out the process owning 'pdir',
+// so if that process is running the counts are only approximate.
+void
+pmap_usage(pde_t *pdir, pmapusage *u)
+{
+	memset(u, 0, sizeof(*u));
+	pde_t *pde = &pdir[PDX(VM_USERLO)], *pdelim = &pdir[PDX(VM_USERHI)];
+	for (; pde < pdelim; pde++) {
+		if (*pde & PTE_REMOTE) {
+			u->remote++;
+			continue;
+		}
+		if (PGADDR(*pde) == PTE_ZERO) {
+			if (*pde & SYS_READ)
+				u->zero += NPTENTRIES;
+			continue;
+		}
+		if (*pde & PTE_PS) {
+			u->resident += NPTENTRIES;
+			u->supers++;
+			if (mem_phys2pi(PGADDR(*pde))->refcount > 1)
+				u->shared += NPTENTRIES;	// all, most likely
+			continue;
+		}
+		u->ptabs++;
+		pte_t *pte = mem_ptr(PGADDR(*pde)), *ptelim = pte + NPTENTRIES;
+		for (; pte < ptelim; pte++) {
+			if (*pte & PTE_REMOTE)
+				u->remote++;
+			else if (PGADDR(*pte) == PTE_ZERO) {
+				if (*pte & SYS_READ)
+					u->zero++;
+			} else {
+				u->resident++;
+				if (pmap_borrowed(pte) ||
+				    mem_phys2pi(PGADDR(*pte))->refcount > 1)
+					u->shared++;
+			}
+		}
+	}
+}
+
 // check pmap_insert, pmap_remove, &c
 void
 pmap_check(void)
 {
-    extern pageinfo *mem_freelist;
-
 	pageinfo *pi, *pi0, *pi1, *pi2, *pi3;
 	pageinfo *fl;
 	pte_t *ptep, *ptep1;
@@ -599,8 +1706,7 @@ pmap_check(void)
 	assert(pi2 && pi2 != pi1 && pi2 != pi0);
 
 	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = NULL;
+	fl = mem_stealall();
 
 	// should be no free memory
 	assert(mem_alloc() == NULL);
@@ -707,7 +1813,7 @@ pmap_check(void)
 	assert(pmap_bootpdir[PDX(VM_USERLO)] == PTE_ZERO);
 	assert(pi0->refcount == 0);
 	assert(mem_alloc() == pi0);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 
 	// test pmap_remove with large, non-ptable-aligned regions
 	mem_free(pi1);
@@ -716,14 +1822,14 @@ pmap_check(void)
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PAGESIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO)]) == mem_pi2phys(pi1));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	mem_free(pi2);
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE+PAGESIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO+PTSIZE)])
 		== mem_pi2phys(pi2));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	mem_free(pi3);
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2+PAGESIZE, 0));
@@ -731,7 +1837,7 @@ pmap_check(void)
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*3-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO+PTSIZE*2)])
 		== mem_pi2phys(pi3));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	assert(pi0->refcount == 10);
 	assert(pi1->refcount == 1);
 	assert(pi2->refcount == 1);
@@ -739,17 +1845,61 @@ pmap_check(void)
 	pmap_remove(pmap_bootpdir, va+PAGESIZE, PTSIZE*3-PAGESIZE*2);
 	assert(pi0->refcount == 2);
 	assert(pi2->refcount == 0); assert(mem_alloc() == pi2);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	pmap_remove(pmap_bootpdir, va, PTSIZE*3-PAGESIZE);
 	assert(pi0->refcount == 1);
 	assert(pi1->refcount == 0); assert(mem_alloc() == pi1);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	pmap_remove(pmap_bootpdir, va+PTSIZE*3-PAGESIZE, PAGESIZE);
 	assert(pi0->refcount == 0);	// pi3 might or might not also be freed
 	pmap_remove(pmap_bootpdir, va+PAGESIZE, PTSIZE*3);
 	assert(pi3->refcount == 0);
 	mem_alloc(); mem_alloc();	// collect pi0 and pi3
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
+
+	// test page-granular pmap_copy across a page table boundary
+	mem_free(pi1);
+	mem_free(pi2);
+	assert(pmap_insert(pmap_bootpdir, pi0, va+PAGESIZE, PTE_W));
+	assert(pmap_copy(pmap_bootpdir, va, pmap_bootpdir,
+			va+PTSIZE-PAGESIZE*2, PAGESIZE*3));
+	assert(mem_nfree() == 0);
+	assert(pi0->refcount == 2);
+	ptep = pmap_walk(pmap_bootpdir, va+PAGESIZE, 0);
+	assert(PGADDR(*ptep) == mem_pi2phys(pi0) && !(*ptep & PTE_W));
+	ptep = pmap_walk(pmap_bootpdir, va+PTSIZE-PAGESIZE, 0);
+	assert(PGADDR(*ptep) == mem_pi2phys(pi0) && !(*ptep & PTE_W));
+	ptep = pmap_walk(pmap_bootpdir, va+PTSIZE-PAGESIZE*2, 0);
+	assert(PGADDR(*ptep) == PTE_ZERO);
+	ptep = pmap_walk(pmap_bootpdir, va+PTSIZE, 0);
+	assert(PGADDR(*ptep) == PTE_ZERO);
+	pmap_remove(pmap_bootpdir, va, PTSIZE*2);
+	assert(pi0->refcount == 0);
+	mem_alloc(); mem_alloc(); mem_alloc();	// collect pi0, pi1, pi2
+	assert(mem_nfree() == 0);
+
+	// unsharing a page table borrows its page refs instead of copying
+	mem_free(pi1);
+	mem_free(pi2);
+	assert(pmap_insert(pmap_bootpdir, pi0, va, PTE_W));
+	pageinfo *ptpi = mem_phys2pi(PGADDR(pmap_bootpdir[PDX(va)]));
+	assert(pmap_copy(pmap_bootpdir, va, pmap_bootpdir, va+PTSIZE, PTSIZE));
+	assert(ptpi->refcount == 2);
+	ptep = pmap_walk(pmap_bootpdir, va+PTSIZE, 1);
+	assert(PGADDR(*ptep) == mem_pi2phys(pi0));
+	assert(mem_ptr2pi(ptep)->ptabsrc == ptpi && ptpi->refcount == 2);
+	assert(pi0->refcount == 1 && pmap_borrowed(ptep));
+	assert(mem_nfree() == 0);
+	pmap_remove(pmap_bootpdir, va, PTSIZE);
+	assert(ptpi->refcount == 1 && pi0->refcount == 1);
+	pmap_walk(pmap_bootpdir, va+PTSIZE, 1);	// takes over ptpi's refs
+	assert(mem_ptr2pi(ptep)->ptabsrc == NULL && !pmap_borrowed(ptep));
+	assert(ptpi->refcount == 0 && pi0->refcount == 1);
+	assert(mem_nfree() == 1);
+	pmap_remove(pmap_bootpdir, va+PTSIZE, PTSIZE);
+	assert(pi0->refcount == 0);
+	mem_alloc(); mem_alloc(); mem_alloc();	// collect pi0, pi1, pi2
+	assert(mem_nfree() == 0);
 
 	// check pointer arithmetic in pmap_walk
 	mem_free(pi0);
@@ -771,7 +1921,7 @@ pmap_check(void)
 	pi0->refcount = 0;
 
 	// give free list back
-	mem_freelist = fl;
+	mem_giveback(fl);
 
 	// free the pages we filched
 	mem_free(pi0);
@@ -17,6 +17,7 @@
 #include <inc/assert.h>
 #include <inc/mmu.h>
 #include <inc/vm.h>
+#include <inc/syscall.h>
 
 #include <kern/mem.h>
 
@@ -43,21 +44,63 @@ extern uint8_t pmap_zero[PAGESIZE];
 // instead the page fault handler creates copies of the zero page on demand.
 #define PTE_ZERO	((uint32_t)pmap_zero)
 
+struct cpu;
+struct proc;
 
 void pmap_init(void);
 pte_t *pmap_newpdir(void);
 void pmap_freepdir(pageinfo *pdirpi);
 void pmap_freeptab(pageinfo *ptabpi);
 pte_t *pmap_walk(pde_t *pdir, uint32_t uva, bool writing);
+void *pmap_lookup(pde_t *pdir, uint32_t uva);
+bool pmap_splitall(pde_t *pdir);
 pte_t *pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t uva, int perm);
+void pmap_fillpte(pte_t *pte, pageinfo *pi);
 void pmap_remove(pde_t *pdir, uint32_t uva, size_t size);
+void pmap_removelazy(pde_t *pdir, uint32_t uva, size_t size);
+bool pmap_reclaimhelp(void);
 void pmap_inval(pde_t *pdir, uint32_t uva, size_t size);
+void pmap_shootdown(pde_t *pdir);
+void pmap_tlbservice(struct cpu *c);
 int pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 		size_t size);
+
+// Pages a process has written since its last snapshot (SYS_SNAP),
+// noted by pmap_pagefault() so that pmap_merge() need visit only those.
+// One page in size.  An n above PMAP_NDIRTY means the list overflowed,
+// or the address space changed in some way other than a write fault,
+// so that pmap_merge() must fall back to comparing everything.
+#define PMAP_NDIRTY	(PAGESIZE/4 - 1)
+#define PMAP_DIRTYSUPER	0x1	// In va[]: the whole 4MB region was written
+typedef struct pmapdirty {
+	uint32_t	n;			// Number of pages in va[]
+	uint32_t	va[PMAP_NDIRTY];	// Addresses of written pages
+} pmapdirty;
+
+pmapdirty *pmap_dirtyreset(pmapdirty *d);
+void pmap_dirtyall(pmapdirty *d);
+void pmap_dirtyrange(pmapdirty *d, uint32_t va, size_t size);
+int pmap_snap(pde_t *pdir, pde_t *rpdir, const pmapdirty *dirty);
+
 int pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
-		pde_t *dpdir, uint32_t dva, size_t size);
+		pde_t *dpdir, uint32_t dva, size_t size,
+		const pmapdirty *dirty, mergereport *rep);
+bool pmap_mergehelp(void);
 int pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm);
 void pmap_pagefault(trapframe *tf);
+
+// Counts of the user mappings in a page directory, from pmap_usage().
+typedef struct pmapusage {
+	int	resident;	// Pages mapped, other than the zero page
+	int	shared;		// ... that have other references too
+	int	zero;		// Accessible pages still mapping the zero page
+	int	remote;		// Remote references not yet pulled in
+	int	ptabs;		// Page tables
+	int	supers;		// 4MB superpages
+} pmapusage;
+
+void pmap_usage(pde_t *pdir, pmapusage *u);
+void pmap_dedup(struct proc *p);
 void pmap_check(void);
 
 
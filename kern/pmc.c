@@ -0,0 +1,116 @@
+/*
+ * Per-process hardware performance counter accounting.
+ *
+ * Each CPU with an Intel architectural PMU (CPUID leaf 0xA) programs
+ * one general-purpose counter per PMC_* event and leaves them running,
+ * in both user and kernel mode.  proc_run() notes the counter values
+ * as a process starts, and proc_save() charges the counts since then
+ * to the process's procstate, where GET with SYS_PMC finds them.
+ * Kernel work between a process's trap and its proc_save(), such as
+ * copy-on-write faults and merges, is thus charged to that process,
+ * as are device interrupts that arrive while it runs;
+ * time a CPU spends idle or switching is charged to nobody.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/syscall.h>
+
+#include <kern/cpu.h>
+#include <kern/proc.h>
+#include <kern/pmc.h>
+
+
+#define MSR_PERFEVTSEL0	0x186		// Event select for counter 0, ...
+#define MSR_PMC0	0x0c1		// Counter 0, ...
+
+#define EVTSEL_USR	0x00010000	// Count in user mode
+#define EVTSEL_OS	0x00020000	// Count in kernel mode
+#define EVTSEL_EN	0x00400000	// Counter enabled
+
+// Event select codes, and which bit of CPUID 0xA's EBX says
+// the event is missing (-1 for model-specific events).
+static const struct {
+	uint8_t	event;
+	uint8_t	umask;
+	int8_t	archbit;
+} pmc_events[PMC_N] = {
+	[PMC_CYCLES]	= { 0x3c, 0x00, 0 },
+	[PMC_INSTRS]	= { 0xc0, 0x00, 1 },
+	[PMC_LLCMISS]	= { 0x2e, 0x41, 4 },
+	// DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK: not architectural,
+	// but it has kept this code since PMU version 3 (Nehalem).
+	[PMC_DTLBMISS]	= { 0x08, 0x01, -1 },
+};
+
+void
+pmc_init(void)
+{
+	cpu *c = cpu_cur();
+	cpuinfo inf;
+	int i;
+
+	c->pmcmask = 0;
+
+	// Only Intel's MSR layout is known here; AMD's differs.
+	cpuid(0, &inf);
+	if (inf.ebx != 0x756e6547 || inf.eax < 0xa)	// "Genu"
+		return;
+
+	cpuid(0xa, &inf);
+	int version = inf.eax & 0xff;
+	int ncounters = (inf.eax >> 8) & 0xff;
+	int width = (inf.eax >> 16) & 0xff;
+	int veclen = (inf.eax >> 24) & 0xff;
+	if (version == 0 || width == 0)
+		return;		// no PMU, e.g., under emulation
+
+	c->pmcwrap = width >= 64 ? ~0ULL : (1ULL << width) - 1;
+	for (i = 0; i < PMC_N && i < ncounters; i++) {
+		int bit = pmc_events[i].archbit;
+		if (bit >= 0 ? bit >= veclen || (inf.ebx & (1 << bit))
+				: version < 3)
+			continue;
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+		wrmsr(MSR_PMC0 + i, 0);
+		wrmsr(MSR_PERFEVTSEL0 + i, EVTSEL_EN | EVTSEL_USR | EVTSEL_OS
+			| pmc_events[i].umask << 8 | pmc_events[i].event);
+		c->pmcbase[i] = 0;
+		c->pmcmask |= 1 << i;
+	}
+	if (cpu_onboot())
+		cprintf("pmc: counting events 0x%x of %d counters, "
+			"%d bits wide\n", c->pmcmask, ncounters, width);
+}
+
+// Called from proc_run(): counts from here on are the new process's.
+void
+pmc_start(void)
+{
+	cpu *c = cpu_cur();
+	uint32_t m = c->pmcmask;
+	while (m != 0) {
+		int i = bsf(m);
+		m &= m - 1;
+		c->pmcbase[i] = rdpmc(i);
+	}
+}
+
+// Called from proc_save(): charge counts since the last call
+// or pmc_start() to p, which is running on this CPU.
+void
+pmc_save(proc *p)
+{
+	cpu *c = cpu_cur();
+	uint32_t m = c->pmcmask;
+	while (m != 0) {
+		int i = bsf(m);
+		m &= m - 1;
+		uint64_t now = rdpmc(i);
+		p->sv.pmc.count[i] += (now - c->pmcbase[i]) & c->pmcwrap;
+		c->pmcbase[i] = now;
+	}
+}
@@ -0,0 +1,21 @@
+/*
+ * Per-process hardware performance counter accounting.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_PMC_H
+#define PIOS_KERN_PMC_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+struct proc;
+
+
+void pmc_init(void);		// Program this CPU's counters, if any
+void pmc_start(void);		// This CPU is about to run a process
+void pmc_save(struct proc *p);	// Charge counts since then to p
+
+#endif /* !PIOS_KERN_PMC_H */
@@ -12,80 +12,483 @@
 
 #include <kern/cpu.h>
 #include <kern/mem.h>
+#include <kern/slab.h>
+#include <kern/trace.h>
+#include <kern/prof.h>
+#include <kern/pmc.h>
+#include <kern/lat.h>
+#include <kern/timer.h>
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/init.h>
 #include <kern/file.h>
+#include <kern/cons.h>
 #include <kern/net.h>
 
+#include <dev/lapic.h>
+
 proc proc_null;		// null process - just leave it initialized to 0
 
 proc *proc_root;	// root process, once it's created in init()
 
-// LAB 2: insert your scheduling data structure declarations here.
+// Each CPU keeps its own FIFO ready queue in its cpu struct,
+// so that enqueue and dequeue are O(1) and CPUs normally touch only
+// their own queue lock.  A CPU whose queue is empty steals work
+// from the most heavily loaded other CPU (see proc_steal()).
+
+// Bitmask of CPUs, by local APIC ID, halted in proc_sched() for lack of work.
+// proc_ready() clears a CPU's bit when it claims that CPU for a wakeup,
+// so each newly-ready process sends at most one wakeup IPI.
+static volatile uint32_t proc_idlemask;
+
+// Proc structs are packed several to a page in this object cache.
+// A proc's home RR names the slab page holding it,
+// and the RR's two nominal-permission bits select the proc within that page.
+static slab_cache proc_cache;
+#define PROC_RRSLOTSHIFT	9
+#define PROC_RRSLOT(rr)		(((rr) & RR_RW) >> PROC_RRSLOTSHIFT)
 
-proc *queue_head;
-spinlock _proc_queue_lock;
+static void proc_sliceup(timer *t);
 
 void
 proc_init(void)
 {
 	if (!cpu_onboot())
 		return;
-  spinlock_init(&_proc_queue_lock);
-  queue_head = NULL;
+
+	// mp_init() has already found all the CPUs by now,
+	// so initialize every CPU's ready queue before any CPU can steal.
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		assert(c->id < 32);	// must fit in proc_idlemask
+		spinlock_init(&c->readylock);
+		int i;
+		for (i = 0; i < PROC_NPRIO; i++) {
+			c->readyhead[i] = NULL;
+			c->readytail[i] = &c->readyhead[i];
+		}
+		c->readymask = 0;
+		c->nready = 0;
+		c->npinned = 0;
+		c->slicetimer.func = proc_sliceup;
+	}
+
+	// fxsave areas in the procstate need 16-byte alignment.
+	slab_init(&proc_cache, "proc", sizeof(proc), 16);
+	assert(proc_cache.perslab <= (RR_RW >> PROC_RRSLOTSHIFT) + 1);
 }
 
-// Allocate and initialize a new proc as child 'cn' of parent 'p'.
-// Returns NULL if no physical memory available.
-proc *
-proc_alloc(proc *p, uint32_t cn)
+// Give 'cp' the register state of a fresh child.
+static void
+proc_setregs(proc *cp)
 {
-  pageinfo *pi = mem_alloc();
-	if (!pi) {
-    warn("proc_alloc: no memory for new process\n");
-		return NULL;
-  }
-	mem_incref(pi);
+	// Integer register state
+	cp->sv.tf.ds = CPU_GDT_UDATA | 3;
+	cp->sv.tf.es = CPU_GDT_UDATA | 3;
+	cp->sv.tf.cs = CPU_GDT_UCODE | 3;
+	cp->sv.tf.ss = CPU_GDT_UDATA | 3;
+}
 
-	proc *cp = (proc*)mem_pi2ptr(pi);
+// Initialize the fields common to all newly allocated procs.
+static void
+proc_setup(proc *cp, proc *p)
+{
 	memset(cp, 0, sizeof(proc));
 	spinlock_init(&cp->lock);
 	cp->parent = p;
 	cp->state = PROC_STOP;
-	cp->home = RRCONS(net_node, mem_phys(cp), 0);
+	proc_setregs(cp);
 
-	// Integer register state
-	cp->sv.tf.ds = CPU_GDT_UDATA | 3;
-	cp->sv.tf.es = CPU_GDT_UDATA | 3;
-	cp->sv.tf.cs = CPU_GDT_UCODE | 3;
-	cp->sv.tf.ss = CPU_GDT_UDATA | 3;
-    
-  cp->pdir = pmap_newpdir();
-	cp->rpdir = pmap_newpdir();
+	// The reference pdir gets allocated on the child's first SYS_SNAP.
+	cp->pdir = pmap_newpdir();
+}
+
+// Allocate and initialize a new proc as child 'cn' of parent 'p'.
+// Returns NULL if no physical memory available.
+proc *
+proc_alloc(proc *p, uint32_t cn)
+{
+	proc *cp = slab_alloc(&proc_cache);
+	if (!cp) {
+		warn("proc_alloc: no memory for new process\n");
+		return NULL;
+	}
+	proc_setup(cp, p);
+	if (p)
+		cp->prio = p->prio;
+	cp->home = RRCONS(net_node, mem_phys(cp),
+			slab_index(&proc_cache, cp) << PROC_RRSLOTSHIFT);
 
 	if (p)
 		p->child[cn] = cp;
+	cp->childnum = cn;
+	return cp;
+}
+
+// Allocate a local proc to stand in for a remote proc with home RR 'home'
+// that is migrating to this node for the first time.
+// This proc gets a whole page to itself, because mem_rrtrack()
+// tracks remote refs at page granularity.
+proc *
+proc_allocaway(uint32_t home)
+{
+	pageinfo *pi = mem_alloc();
+	if (!pi) {
+		warn("proc_allocaway: no memory for new process\n");
+		return NULL;
+	}
+	mem_incref(pi);
+
+	proc *cp = mem_pi2ptr(pi);
+	proc_setup(cp, NULL);
+	cp->state = PROC_AWAY;		// Pretend it's been away
+	cp->home = home;		// Record where proc originated
+	mem_rrtrack(home, pi);		// Track for future
 	return cp;
 }
 
+// Find the local proc named by a home RR that refers to this node.
+proc *
+proc_home(uint32_t rr)
+{
+	assert(RRNODE(rr) == net_node);
+	return slab_object(&proc_cache, mem_ptr(RRADDR(rr)), PROC_RRSLOT(rr));
+}
+
+// Return true if every process in the subtree rooted at 'p' is stopped
+// on this node, so nothing in it can run or change while we copy it.
+static bool
+proc_quiet(proc *p)
+{
+	if (p->state != PROC_STOP)
+		return 0;
+	int cn;
+	for (cn = 0; cn < PROC_CHILDREN; cn++)
+		if (p->child[cn] != NULL && !proc_quiet(p->child[cn]))
+			return 0;
+	return 1;
+}
+
+// Recursive part of proc_clone(), once both subtrees are known quiet.
+static bool
+proc_clonetree(proc *dst, proc *src)
+{
+	dst->sv = src->sv;
+	if (src == &proc_null)
+		proc_setregs(dst);
+	else
+		dst->prio = src->prio;
+	proc_fpuforget(dst);
+	memmove(dst->childnode, src->childnode, sizeof(dst->childnode));
+
+	// The working address space, and the parent's snapshot of it.
+	if (src->pdir != NULL) {
+		if (!pmap_copy(src->pdir, VM_USERLO, dst->pdir, VM_USERLO,
+				VM_USERHI - VM_USERLO))
+			return 0;
+		pmap_shootdown(src->pdir);
+	} else
+		pmap_remove(dst->pdir, VM_USERLO, VM_USERHI - VM_USERLO);
+	pmap_shootdown(dst->pdir);
+	if (src->rpdir != NULL) {
+		if (dst->rpdir == NULL && (dst->rpdir = pmap_newpdir()) == NULL)
+			return 0;
+		if (!pmap_copy(src->rpdir, VM_USERLO, dst->rpdir, VM_USERLO,
+				VM_USERHI - VM_USERLO))
+			return 0;
+	} else if (dst->rpdir != NULL)
+		pmap_remove(dst->rpdir, VM_USERLO, VM_USERHI - VM_USERLO);
+	if (src->dirty != NULL) {
+		if ((dst->dirty = pmap_dirtyreset(dst->dirty)) == NULL)
+			return 0;
+		memmove(dst->dirty, src->dirty, sizeof(pmapdirty));
+	} else
+		pmap_dirtyall(dst->dirty);
+	dst->faultnext = src->faultnext;
+	dst->faultwin = src->faultwin;
+	dst->dedupva = src->dedupva;
+	dst->dedupcalls = src->dedupcalls;
+
+	int cn;
+	for (cn = 0; cn < PROC_CHILDREN; cn++) {
+		proc *sc = src->child[cn];
+		proc *dc = dst->child[cn];
+		if (sc == NULL && dc == NULL)
+			continue;
+		if (dc == NULL && (dc = proc_alloc(dst, cn)) == NULL)
+			return 0;
+		if (!proc_clonetree(dc, sc != NULL ? sc : &proc_null))
+			return 0;
+	}
+	return 1;
+}
+
+// Make 'dst' a copy-on-write clone of the process subtree rooted at 'src',
+// for a parent checkpointing or restoring it with SYS_CLONE:
+// dst gets src's register state, and its address space and snapshot
+// share all of src's page tables, and the same goes for each of src's
+// children in turn.  Children of dst's that src lacks get cleared back
+// to fresh ones, and src == &proc_null clears dst itself that way.
+// No page is copied, so the cost is a few page directories per process.
+// Returns false if either subtree has a process that isn't stopped here,
+// or if we run out of memory, leaving dst partly cloned.
+bool
+proc_clone(proc *dst, proc *src)
+{
+	assert(dst != src);
+	return proc_quiet(dst) && proc_quiet(src) && proc_clonetree(dst, src);
+}
+
+// Multi-level feedback scheduling.
+// Each process has a base priority from PFF_PRIO in its procstate,
+// and a current priority level p->prio that is never above its base.
+// A process that uses up its whole time slice drops one level,
+// and one that blocks (waits for a child or returns to its parent)
+// before its slice runs out climbs back one level toward its base.
+// Lower levels run less often but get longer slices, PROC_QUANTUM().
+// The root process does the system's I/O and is never demoted.
+#define PROC_QUANTUM(prio)	(1 << (prio))	// timer ticks per slice
+
+// The scheduler is tickless: a CPU arms its slice timer only while
+// some other process is waiting to run on it (or parked for a handoff),
+// so a CPU running one process with nothing else to do runs untimed.
+// Whoever queues work on a CPU that isn't slicing makes sure it starts.
+static void
+proc_slicestart(cpu *c)
+{
+	assert(c == cpu_cur());
+	if (!c->slicing) {
+		c->slicing = 1;
+		timer_add(&c->slicetimer, PROC_QUANTUM(c->proc->prio));
+	}
+}
+
+static void
+proc_sliceup(timer *t)
+{
+	cpu_cur()->sliceup = 1;	// proc_tick() will preempt
+}
+
+static int
+proc_baseprio(proc *p)
+{
+	return (p->sv.pff & PFF_PRIO) >> PFF_PRIOSHIFT;
+}
+
+// Reset p's priority after its parent sets its PFF_PRIO with SYS_PUT.
+// A child can't be given a higher base priority than its parent has.
+void
+proc_setprio(proc *p)
+{
+	if (p->parent && proc_baseprio(p) < proc_baseprio(p->parent))
+		p->sv.pff = (p->sv.pff & ~PFF_PRIO) |
+				(p->parent->sv.pff & PFF_PRIO);
+	p->prio = proc_baseprio(p);
+}
+
+// Append process p to the tail of CPU c's ready queue for p's priority.
+static void
+proc_enqueue(cpu *c, proc *p)
+{
+	int prio = p->prio;
+	spinlock_acquire(&c->readylock);
+	p->state = PROC_READY;
+	p->readynext = NULL;
+	*c->readytail[prio] = p;
+	c->readytail[prio] = &p->readynext;
+	c->readymask |= 1 << prio;
+	c->nready++;
+	if (p->sv.pff & PFF_PINCPU)
+		c->npinned++;
+	spinlock_release(&c->readylock);
+}
+
+// Remove and return the first process on CPU c's highest-priority
+// nonempty ready queue that is allowed to run on CPU 'self',
+// or NULL if there is none.
+// Only pinned processes (PFF_PINCPU) are ever skipped,
+// and they are only ever queued on the CPU they are pinned to,
+// so the common local case always takes a queue head in O(1).
+// On success the process is returned locked, ready for proc_run().
+static proc *
+proc_dequeue(cpu *c, cpu *self)
+{
+	if (c->nready == 0)		// cheap unlocked check first
+		return NULL;
+
+	spinlock_acquire(&c->readylock);
+	proc *p = NULL;
+	uint32_t mask;
+	for (mask = c->readymask; mask != 0; mask &= mask - 1) {
+		int prio = bsf(mask);
+		proc **pp = &c->readyhead[prio];
+		while ((p = *pp) != NULL && c != self &&
+				(p->sv.pff & PFF_PINCPU))
+			pp = &p->readynext;
+		if (p == NULL)
+			continue;
+		*pp = p->readynext;
+		if (*pp == NULL)
+			c->readytail[prio] = pp;
+		if (c->readyhead[prio] == NULL)
+			c->readymask &= ~(1 << prio);
+		p->readynext = NULL;
+		c->nready--;
+		if (p->sv.pff & PFF_PINCPU)
+			c->npinned--;
+		spinlock_acquire(&p->lock);
+		break;
+	}
+	spinlock_release(&c->readylock);
+	return p;
+}
+
+// Steal a ready process from the busiest other CPU, if any has work
+// we may take: processes pinned to their CPU don't count.
+// Scans starting just after CPU 'self' so that concurrent thieves
+// tend to pick different victims.
+static proc *
+proc_steal(cpu *self)
+{
+	cpu *c, *victim = NULL;
+	int most = 0;
+	for (c = self->next ? self->next : &cpu_boot; c != self;
+			c = c->next ? c->next : &cpu_boot) {
+		int n = c->nready - c->npinned;	// racy, but only a hint
+		if (n > most) {
+			most = n;
+			victim = c;
+		}
+	}
+	return victim != NULL ? proc_dequeue(victim, self) : NULL;
+}
+
+// Choose the CPU whose ready queue process p should go on.
+// A process pinned with PFF_PINCPU always goes to that CPU if it exists;
+// otherwise we prefer the CPU it last ran on, whose caches and TLB
+// are most likely still warm, and fall back to the current CPU.
+static cpu *
+proc_affinity(proc *p)
+{
+	if (p->sv.pff & PFF_PINCPU) {
+		uint8_t id = (p->sv.pff & PFF_CPU) >> PFF_CPUSHIFT;
+		cpu *c;
+		for (c = &cpu_boot; c != NULL; c = c->next)
+			if (c->id == id)
+				return c;
+		p->sv.pff &= ~PFF_PINCPU;	// no such CPU: ignore pinning
+	}
+	if (p->lastcpu != NULL)
+		return p->lastcpu;
+	return cpu_cur();
+}
+
+// Wake exactly one idle CPU to run work just queued on CPU c:
+// c itself if it is idle, otherwise any idle CPU, which will steal it.
+static void
+proc_wake(cpu *c)
+{
+	uint32_t mask, bit;
+	while ((mask = proc_idlemask) != 0) {
+		bit = (mask & (1 << c->id)) ? 1 << c->id : mask & -mask;
+		if (cmpxchg(&proc_idlemask, mask, mask & ~bit) != mask)
+			continue;	// lost a race with another waker; retry
+		int id = bsf(bit);
+		if (id != cpu_cur()->id)	// we'll notice our own work
+			lapic_ipi(id, T_IPIWAKE);
+		return;
+	}
+}
+
+// Wake every idle CPU, for kernel work any number of them can share,
+// such as a large merge (see pmap_mergehelp()).
+void
+proc_wakeidle(void)
+{
+	uint32_t mask, bit;
+	while ((mask = proc_idlemask) != 0) {
+		bit = mask & -mask;
+		if (cmpxchg(&proc_idlemask, mask, mask & ~bit) != mask)
+			continue;	// lost a race with another waker; retry
+		int id = bsf(bit);
+		if (id != cpu_cur()->id)
+			lapic_ipi(id, T_IPIWAKE);
+	}
+}
+
+// Count the processes running or ready to run on this node,
+// for the load net.c reports to other nodes.  Racy but cheap.
+int
+proc_nrun(void)
+{
+	int n = 0;
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		n += c->nready + (c->proc != NULL);
+	return n;
+}
+
+// Return true if any CPU's ready queue is nonempty.
+static bool
+proc_anyready(void)
+{
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->nready > 0)
+			return 1;
+	return 0;
+}
+
 // Put process p in the ready state and add it to the ready queue.
 void
 proc_ready(proc *p)
 {
-  spinlock_acquire(&_proc_queue_lock);
-  p->state = PROC_READY;
-  p->readynext = NULL;
-  proc *temp = queue_head;
-  if(!temp) {
-    queue_head = p;
-    spinlock_release(&_proc_queue_lock);
-    return;
-  }
-  while(temp->readynext)
-    temp = temp->readynext;
-  temp->readynext = p;
-  spinlock_release(&_proc_queue_lock);
+	cpu *c = proc_affinity(p);
+	trace_log(TRACE_READY, p, c->id);
+	proc_enqueue(c, p);
+	proc_wake(c);
+
+	// If c is busy running a process untimed, start its slice timer.
+	// proc_run() clears c->slicing before checking c->nready,
+	// and we check in the opposite order, so one of us will notice.
+	if (!c->slicing && c->proc != NULL) {
+		if (c == cpu_cur())
+			proc_slicestart(c);
+		else
+			lapic_ipi(c->id, T_IPIWAKE);
+	}
+}
+
+// Push any child parked for a direct handoff onto the ready queues.
+static void
+proc_handoffflush(cpu *c)
+{
+	proc *p = c->handoff;
+	if (p != NULL) {
+		c->handoff = NULL;
+		proc_ready(p);
+	}
+}
+
+// Start child process p of the current process, as for SYS_PUT|SYS_START.
+// The usual next step is for the parent to SYS_GET and wait for p,
+// so when no CPU is idle to pick p up in parallel anyway,
+// park p on this CPU and let proc_wait() switch straight to it
+// without touching any ready queue.  Any other switch on this CPU
+// (including the end of the parent's time slice) queues p normally.
+void
+proc_start(proc *p)
+{
+	cpu *c = cpu_cur();
+	if (proc_idlemask != 0 ||
+			((p->sv.pff & PFF_PINCPU) && proc_affinity(p) != c)) {
+		proc_ready(p);
+		return;
+	}
+	proc_handoffflush(c);
+	p->state = PROC_READY;
+	c->handoff = p;
+	proc_slicestart(c);	// don't let the parent starve p
 }
 
 // Save the current process's state before switching to another process.
@@ -99,12 +502,84 @@ void
 proc_save(proc *p, trapframe *tf, int entry)
 {
   p->sv.tf = *tf;
-  if(entry == 0)
+  if(entry == 0) {
     p->sv.tf.eip -= 2;   // move back an instruction because the syscall 
                          // pushes eip of the NEXT instruction on the tf
+                         // (INT and SYSENTER are both 2 bytes long)
+    if(p->sv.tf.trapno == T_SYSCALL)	// restarting needs every register,
+      p->sv.tf.err = T_SYSCALL_INT;	// so resume with IRET, not SYSEXIT
+  }
+
+	// If p touched the FPU during this time slice, CR0.TS is clear
+	// and the registers are newer than p->sv.fx.  Write them back,
+	// but stay the owner: if p runs here next, no reload is needed.
+	cpu *c = cpu_cur();
+	if (c->fpuowner == p && !(rcr0() & CR0_TS)) {
+		fxstore(&p->sv.fx);
+		lcr0(rcr0() | CR0_TS);
+	}
+	pmc_save(p);		// and its performance counts so far
+}
+
+// Handle a device-not-available trap from the current process 'p':
+// load its FPU/SSE state, or a fresh FPU state if it never used one,
+// and let it use the FPU without trapping until it's next switched out.
+void
+proc_fpuload(proc *p)
+{
+	cpu *c = cpu_cur();
+	clts();
+	if (c->fpuowner != p) {
+		// The CPU p last had the FPU on may still think it owns it,
+		// but its registers go stale as soon as p changes them here.
+		cpu *oc = p->fpucpu;
+		if (oc != NULL && oc != c)
+			cmpxchg((volatile uint32_t*)&oc->fpuowner,
+				(uint32_t)p, 0);
+		p->fpucpu = c;
+		if (p->sv.pff & PFF_USEFPU)
+			fxrstor(&p->sv.fx);
+		else {
+			fninit();
+			p->sv.pff |= PFF_USEFPU;
+		}
+		c->fpuowner = p;
+	}
+}
+
+// Take over this CPU's FPU/SSE registers for use by the kernel itself,
+// writing back the owning process's state first if it is live here.
+// The kernel can then use SSE until it calls proc_fpudrop().
+void
+proc_fpugrab(void)
+{
+	cpu *c = cpu_cur();
+	if (c->fpuowner != NULL && !(rcr0() & CR0_TS))
+		fxstore(&c->fpuowner->sv.fx);
+	c->fpuowner = NULL;		// owner reloads on its next FPU trap
+	clts();
 }
 
-// Go to sleep waiting for a given child process to finish running.
+// Done using the FPU in the kernel: make user FPU instructions trap again.
+void
+proc_fpudrop(void)
+{
+	lcr0(rcr0() | CR0_TS);
+}
+
+// Called whenever p's saved FPU state is overwritten from outside,
+// so no CPU mistakes its stale registers for p's current state.
+void
+proc_fpuforget(proc *p)
+{
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->fpuowner == p)
+			c->fpuowner = NULL;
+}
+
+// Go to sleep waiting for a given child process to finish running,
+// or with cp == &proc_null, for any of the children in p->waitset.
 // Parent process 'p' must be running and locked on entry.
 // The supplied trapframe represents p's register state on syscall entry.
 void gcc_noreturn
@@ -113,6 +588,18 @@ proc_wait(proc *p, proc *cp, trapframe *tf)
   p->state = PROC_WAIT;
   p->waitchild = cp;
   proc_save(p, tf, 0);
+	trace_log(TRACE_WAIT, p, 0);
+	if (p->prio > proc_baseprio(p))
+		p->prio--;		// blocked early: reward
+
+	// Direct handoff: the child we just started is still parked here.
+	cpu *c = cpu_cur();
+	if (c->handoff == cp) {
+		c->handoff = NULL;
+		spinlock_release(&p->lock);
+		spinlock_acquire(&cp->lock);
+		proc_run(cp);
+	}
   spinlock_release(&p->lock);
   proc_sched();
 }
@@ -120,26 +607,37 @@ proc_wait(proc *p, proc *cp, trapframe *tf)
 void gcc_noreturn
 proc_sched(void)
 {
-  spinlock_acquire(&_proc_queue_lock);
-  while(!queue_head) {
-    // Release the spinlock while waiting
-    spinlock_release(&_proc_queue_lock);
-    while(!queue_head) {
-      // Enable interrupts briefly for keyboard, serial
-      sti();
-      pause();
-      cli();
-    }
-    spinlock_acquire(&_proc_queue_lock);
-    // Now make sure queue_head didn't get snatched while we were
-    // acquiring the spinlock
-  }
-
-  proc *to_run = queue_head;
-  queue_head = queue_head->readynext;
-  spinlock_acquire(&to_run->lock);
-  spinlock_release(&_proc_queue_lock);
-  proc_run(to_run);
+	cpu *c = cpu_cur();
+	proc_handoffflush(c);
+	lat_switch();		// the trap that got us here isn't returning
+	while (1) {
+		proc *p = proc_dequeue(c, c);
+		if (p == NULL)
+			p = proc_steal(c);
+		if (p != NULL)
+			proc_run(p);
+
+		// Nothing to run: do some useful background work if there is
+		// any, such as helping with a merge, printing the root's
+		// queued console output or the kernel's own, freeing
+		// address spaces torn down by SYS_ZERO, pre-zeroing
+		// pages, or sending released remote refs home,
+		// then look for work again.
+		if (pmap_mergehelp() || cons_drain() || cons_logdrain()
+		    || pmap_reclaimhelp() || mem_idle() || net_idle())
+			continue;
+
+		// Still nothing to run: advertise that we're idle, then check again
+		// in case work was queued before the mask update was visible.
+		// Halt with interrupts enabled until a device interrupt,
+		// the timer, or a wakeup IPI from proc_ready() arrives.
+		uint32_t bit = 1 << c->id;
+		lockor(&proc_idlemask, bit);
+		if (!proc_anyready())
+			sti_hlt();
+		cli();
+		lockand(&proc_idlemask, ~bit);
+	}
 }
 
 // Switch to and run a specified process, which must already be locked.
@@ -149,13 +647,63 @@ proc_run(proc *p)
   assert(spinlock_holding(&p->lock));
   p->state = PROC_RUN;
   cpu *curr = cpu_cur();
+	proc_handoffflush(curr);	// parked by the proc we are leaving
+	lat_switch();			// as is any trap it was handling
   curr->proc = p;
+	xchg(&curr->slicing, 0);
+	curr->sliceup = 0;
+	if (curr->nready > 0)
+		proc_slicestart(curr);
+	else
+		timer_cancel(&curr->slicetimer);
+	trace_log(TRACE_RUN, p, p->prio);
+	prof_start();			// keep sampling while p runs
+	pmc_start();			// count p's events from here
   p->runcpu = curr;
+  p->lastcpu = curr;
   spinlock_release(&p->lock);
-	lcr3(mem_phys(p->pdir));
+
+	// FPU instructions trap unless p's state is already loaded here.
+	uint32_t cr0 = rcr0();
+	if (curr->fpuowner == p)
+		clts();
+	else if (!(cr0 & CR0_TS))
+		lcr0(cr0 | CR0_TS);
+
+	// Skip the CR3 reload, and the TLB flush it implies,
+	// if we're switching back into the address space we were last in
+	// and no other CPU has changed it since (see pmap_shootdown()).
+	uint32_t pa = mem_phys(p->pdir);
+	xchg(&curr->tlbpdir, pa);	// orders the tlbreq load after it
+	uint32_t req = curr->tlbreq;
+	if (rcr3() != pa || req != curr->tlbdone) {
+		lcr3(pa);
+		curr->tlbdone = req;
+	}
   trap_return(&p->sv.tf);
 }
 
+// Called on a timer interrupt or wakeup IPI from user mode:
+// preempt the current process if its time slice is used up
+// or if a higher-priority process is waiting on this CPU,
+// and make sure its slice is timed if anything else is waiting.
+// Returns if the current process should keep running.
+void
+proc_tick(trapframe *tf)
+{
+	cpu *c = cpu_cur();
+	proc *curr = c->proc;
+	if (c->sliceup) {
+		if (curr != proc_root && curr->prio < PROC_NPRIO - 1)
+			curr->prio++;	// used its whole slice: demote
+		proc_yield(tf);
+	}
+	if (c->readymask & ((1 << curr->prio) - 1))
+		proc_yield(tf);
+	if (c->nready > 0)
+		proc_slicestart(c);
+}
+
 // Yield the current CPU to another ready process.
 // Called while handling a timer interrupt.
 void gcc_noreturn
@@ -163,6 +711,8 @@ proc_yield(trapframe *tf)
 {
 	proc *curr = proc_cur();
   proc_save(curr, tf, -1);
+	trace_log(TRACE_YIELD, curr, 0);
+	proc_handoffflush(cpu_cur());	// let a parked child go first
   proc_ready(curr);
   proc_sched();
 }
@@ -184,13 +734,19 @@ proc_ret(trapframe *tf, int entry)
     }
     file_io(tf);
   }
+  pmap_dedup(me);	// no one touches our pages until we've stopped
   spinlock_acquire(&me->lock);
   me->state = PROC_STOP;
   proc_save(me, tf, entry);
+	trace_log(TRACE_RET, me, 0);
+	if (me->prio > proc_baseprio(me))
+		me->prio--;		// blocked early: reward
   spinlock_release(&me->lock);
 
   spinlock_acquire(&parent->lock);
-  if(parent->waitchild == me) {
+  if(parent->waitchild == me || (parent->waitchild == &proc_null &&
+      parent->child[me->childnum] == me &&
+      childset_has(&parent->waitset, me->childnum))) {
     parent->waitchild = NULL;
     proc_run(parent);
   }
@@ -204,6 +760,7 @@ static void child(int n);
 static void grandchild(int n);
 
 static struct procstate child_state;
+static childset child_set, child_ready;
 static char gcc_aligned(16) child_stack[4][PAGESIZE];
 
 static volatile uint32_t pingpong = 0;
@@ -248,9 +805,22 @@ proc_check(void)
 		sys_put(SYS_START, i, NULL, NULL, NULL, 0);
 	}
 
-	// Wait for all 4 children to complete.
-	for (i = 0; i < 4; i++)
-		sys_get(0, i, NULL, NULL, NULL, 0);
+	// Wait for all 4 children to complete, collecting each as it stops.
+	int left = 0;
+	memset(&child_set, 0, sizeof(child_set));
+	for (i = 0; i < 4; i++, left++)
+		childset_add(&child_set, i);
+	while (left > 0) {
+		child_ready = child_set;
+		sys_wait(0, &child_ready);
+		for (i = 0; i < CHILDSET_MAX; i++)
+			if (childset_has(&child_ready, i)) {
+				assert(childset_has(&child_set, i));
+				sys_get(0, i, NULL, NULL, NULL, 0);
+				childset_del(&child_set, i);
+				left--;
+			}
+	}
 	cprintf("proc_check() 4-child test succeeded\n");
 
 	// Now do a trap handling test using all 4 children -
@@ -18,6 +18,7 @@
 
 #include <kern/spinlock.h>
 #include <kern/pmap.h>
+#include <kern/net.h>
 #include <inc/file.h>
 
 typedef enum proc_state {
@@ -28,10 +29,12 @@ typedef enum proc_state {
 	PROC_MIGR,		// Migrating to another node
 	PROC_AWAY,		// Migrated to another node
 	PROC_PULL,		// Migrated to another node
+	PROC_DISK,		// Waiting for file data from disk
 } proc_state;
 
 // Thread control block structure.
-// Consumes 1 physical memory page, though we don't use all of it.
+// Allocated from an object cache that packs several per physical page,
+// except for stand-ins for remote procs, which get a page each.
 typedef struct proc {
 
 	// Master spinlock protecting proc's state.
@@ -44,29 +47,41 @@ typedef struct proc {
 	// Scheduling state for this process.
 	proc_state	state;		// current state
 	struct proc	*readynext;	// chain on ready queue
+	uint8_t		prio;		// current priority level, 0 = highest
 	struct cpu	*runcpu;	// cpu we're running on if running
+	struct cpu	*lastcpu;	// cpu we last ran on, for affinity
+	struct cpu	*fpucpu;	// cpu we last loaded our FPU state on
 	struct proc	*waitchild;	// child proc if waiting for child
+	childset	waitset;	// children if waitchild == &proc_null
+	uint8_t		childnum;	// our index in parent->child[]
+	uint8_t		childnode[PROC_CHILDREN]; // nodes SYS_NODEANY chose
 
 	// Save area for user-visible state when process is not running.
 	procstate	sv;
 
 	// Virtual memory state for this process.
 	pde_t		*pdir;		// Working page directory
-	pde_t		*rpdir;		// Reference page directory
+	pde_t		*rpdir;		// Reference page directory, if snapped
+	pmapdirty	*dirty;		// Pages written since snapshot, if any
+	uint32_t	faultnext;	// Page after the last write fault's
+	int		faultwin;	// Pages to resolve ahead of a fault
+	uint32_t	dedupva;	// Where pmap_dedup() resumes
+	uint32_t	dedupcalls;	// pmap_dedup() calls since its last pass
+	struct proc	*disknext;	// Next waiting on kern/disk.c's reads
 
 	// Network and process migration state.
 	uint32_t	home;		// RR to proc's home node and addr
 	uint32_t	rrpdir;		// RR to migration source's page dir
 	uint8_t		migrdest;	// Destination we're migrating to
-	struct proc	*migrnext;	// Next on list of migrating procs
+	struct proc	*migrnext;	// Next on net.c's migrating hash chain
+	net_rqtimer	migrrt;		// When to retransmit migration request
+	uint32_t	pushva;		// SYS_PREFETCH region to push when
+	uint32_t	pushlim;	// we migrate, from pushva to pushlim
 
 	// Remote reference pulling state.
-	struct proc	*pullnext;	// Next on list of page-pulling procs
-	uint32_t	pullva;		// Where we are pulling in our addr spc
-	uint32_t	pullrr;		// Current RR we are pulling
-	void		*pullpg;	// Local page we are pulling into
-	uint8_t		pglev;		// Level: 0=page, 1=page table, 2=pdir
-	uint8_t		arrived;	// Bits 0-2: which parts have arrived
+	uint32_t	pullva;		// All pulled in below this address
+	int		npull;		// Slots of pull[] in use
+	net_pullslot	pull[NET_PULLWIN]; // Pulls in flight
 } proc;
 
 #define proc_cur()	(cpu_cur()->proc)
@@ -81,12 +96,24 @@ extern proc *proc_root;
 
 void proc_init(void);	// Initialize process management code
 proc *proc_alloc(proc *p, uint32_t cn);	// Allocate new child
+proc *proc_allocaway(uint32_t home);	// Allocate stand-in for remote proc
+proc *proc_home(uint32_t rr);	// Find local proc from its home RR
+bool proc_clone(proc *dst, proc *src);	// Clone a stopped subtree
 void proc_ready(proc *p);	// Make process p ready
+void proc_start(proc *p);	// Make child p ready, maybe for a handoff
+void proc_wakeidle(void);	// Wake all idle CPUs to look for work
+int proc_nrun(void);		// Processes running or ready on this node
+void proc_fpuload(proc *p);	// Give the current process the FPU
+void proc_fpuforget(proc *p);	// p's saved FPU state was replaced
+void proc_fpugrab(void);	// Let the kernel use the FPU/SSE registers
+void proc_fpudrop(void);	// Kernel is done with the FPU/SSE registers
 void proc_save(proc *p, trapframe *tf, int entry);	// save process state
 void proc_wait(proc *p, proc *cp, trapframe *tf) gcc_noreturn;
 void proc_sched(void) gcc_noreturn;	// Find and run some ready process
 void proc_run(proc *p) gcc_noreturn;	// Run a specific process
 void proc_yield(trapframe *tf) gcc_noreturn;	// Yield to another process
+void proc_tick(trapframe *tf);		// Timer tick in user mode
+void proc_setprio(proc *p);		// Reset priority from p->sv.pff
 void proc_ret(trapframe *tf, int entry) gcc_noreturn;	// Return to parent
 void proc_check(void);			// Check process code
 
@@ -0,0 +1,172 @@
+/*
+ * Per-CPU sampling profiler driven by the LAPIC timer.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/file.h>
+#include <inc/trap.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/proc.h>
+#include <kern/pmap.h>
+#include <kern/debug.h>
+#include <kern/prof.h>
+
+
+#define PROF_LINEMAX	(16 + 9 * PROF_DEPTH)	// Longest prof_drain() line
+
+// Sampling is compiled in only with PROF_SAMPLING (see conf/env.mk),
+// since the LAPIC timer otherwise stops whenever no deadline is pending
+// (see kern/timer.c), and keeping it ticking costs every busy CPU
+// an interrupt per tick.  Without it no ring is allocated,
+// and the "profile" file stays empty.
+
+// Keep sampling while this CPU is running a process.
+// An idle CPU takes one last sample and stops ticking till prof_start().
+static void
+prof_timer(timer *t)
+{
+	cpu *c = cpu_cur();
+	proc *p = c->proc;
+	if (p != NULL && p->state == PROC_RUN && p->runcpu == c)
+		timer_add(t, PROF_PERIOD);
+}
+
+void
+prof_init(void)
+{
+#ifdef PROF_SAMPLING
+	assert(sizeof(prof_ring) <= PAGESIZE);
+	assert(PROF_DEPTH <= DEBUG_TRACEFRAMES + 1);
+
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL) {
+		warn("prof_init: no memory for CPU %d profile ring",
+			cpu_cur()->id);
+		return;
+	}
+	mem_incref(pi);
+	prof_ring *pr = mem_pi2ptr(pi);
+	memset(pr, 0, sizeof(*pr));
+	cpu_cur()->prof = pr;
+	cpu_cur()->proftimer.func = prof_timer;
+#endif
+}
+
+// Called from proc_run(): make sure the sampling timer is running.
+void
+prof_start(void)
+{
+	cpu *c = cpu_cur();
+	if (c->prof != NULL && !c->proftimer.pending)
+		timer_add(&c->proftimer, PROF_PERIOD);
+}
+
+// Follow a user process's frame pointer chain starting at ebp,
+// filling eip[1..] with return addresses as debug_trace() does.
+// User stacks are untrusted, and may be unmapped or copy-on-write,
+// so read them through the page tables with pmap_lookup() instead
+// of dereferencing them and risking a page fault in the kernel.
+static int
+prof_usertrace(pde_t *pdir, uint32_t ebp, uint32_t *eip)
+{
+	int n = 1;
+	while (ebp != 0 && (ebp & 3) == 0 && n < PROF_DEPTH) {
+		uint32_t *fp = pmap_lookup(pdir, ebp);
+		if (fp == NULL || PGOFF(ebp) > PAGESIZE - 8)
+			break;
+		eip[n++] = fp[1];
+		if (fp[0] <= ebp)	// stacks grow down: callers are above
+			break;
+		ebp = fp[0];
+	}
+	return n;
+}
+
+// Record where this CPU was interrupted by its LAPIC timer.
+// Called from trap() with interrupts disabled, as all kernel code runs.
+// Like trace_log(), counts the sample as lost if the ring is full.
+void
+prof_tick(trapframe *tf)
+{
+	cpu *c = cpu_cur();
+	prof_ring *pr = c->prof;
+	if (pr == NULL)
+		return;
+
+	uint32_t head = pr->head;
+	uint32_t next = head + 1 == PROF_NREC ? 0 : head + 1;
+	if (next == pr->tail) {
+		pr->lost++;
+		return;
+	}
+	prof_rec *r = &pr->rec[head];
+	r->cpu = c->id;
+	r->eip[0] = tf->eip;
+	if (tf->cs & 3) {
+		proc *p = c->proc;
+		r->proc = p->home;
+		r->user = 1;
+		r->depth = prof_usertrace(p->pdir, tf->regs.ebp, r->eip);
+	} else {
+		// Kernel code runs with interrupts off except when idle,
+		// so kernel samples are chiefly of the idle loop.
+		uint32_t eips[DEBUG_TRACEFRAMES];
+		debug_trace(tf->regs.ebp, eips);
+		int n;
+		for (n = 1; n < PROF_DEPTH && eips[n-1] != 0; n++)
+			r->eip[n] = eips[n-1];
+		r->proc = 0;
+		r->user = 0;
+		r->depth = n;
+	}
+	asm volatile("" : : : "memory");	// publish sample before head
+	pr->head = next;
+}
+
+// Drain every CPU's profile ring into the root process's file 'ino',
+// one text line per sample:  "cpu proc u|k eip caller caller...",
+// all in hex, innermost frame first.
+// Called from file_io() in the root process's address space.
+// Samples stay in the rings while the file is at its maximum size;
+// the root process can truncate the file to make room for more.
+void
+prof_drain(int ino)
+{
+	fileinode *fi = &files->fi[ino];
+	char *data = FILEDATA(ino);
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		prof_ring *pr = c->prof;
+		if (pr == NULL)
+			continue;
+		if (pr->lost && fi->size + PROF_LINEMAX <= FILE_SLOTSIZE) {
+			fi->size += snprintf(data + fi->size, PROF_LINEMAX,
+					"%x 0 lost %x\n", c->id, pr->lost);
+			pr->lost = 0;	// racy, but only a statistic
+		}
+		uint32_t tail = pr->tail;
+		while (tail != pr->head &&
+				fi->size + PROF_LINEMAX <= FILE_SLOTSIZE) {
+			prof_rec *r = &pr->rec[tail];
+			fi->size += snprintf(data + fi->size, PROF_LINEMAX,
+					"%x %x %c", r->cpu, r->proc,
+					r->user ? 'u' : 'k');
+			int i;
+			for (i = 0; i < r->depth; i++)
+				fi->size += snprintf(data + fi->size, 10,
+						" %x", r->eip[i]);
+			data[fi->size++] = '\n';
+			tail = tail + 1 == PROF_NREC ? 0 : tail + 1;
+		}
+		asm volatile("" : : : "memory");	// done reading samples
+		pr->tail = tail;
+	}
+}
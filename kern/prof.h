@@ -0,0 +1,52 @@
+/*
+ * Per-CPU sampling profiler definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_PROF_H
+#define PIOS_KERN_PROF_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+struct trapframe;
+
+
+#define PROF_DEPTH	8	// Most stack frames per sample, incl. EIP
+#define PROF_PERIOD	1	// Ticks between samples of a busy CPU
+
+// One sample of where a CPU was when its LAPIC timer fired.
+typedef struct prof_rec {
+	uint32_t	proc;		// Home RR of interrupted process, or 0
+	uint8_t		cpu;		// Local APIC ID of sampling CPU
+	uint8_t		user;		// Interrupted in user mode
+	uint8_t		depth;		// Valid entries in eip[]
+	uint8_t		pad;
+	uint32_t	eip[PROF_DEPTH]; // EIP, then callers' return addresses
+} prof_rec;
+
+#define PROF_NREC	(PAGESIZE / sizeof(prof_rec) - 1)
+
+// Each CPU's profile ring occupies one page, handled like the
+// scheduler trace ring (see kern/trace.h): only the owning CPU
+// writes samples and only prof_drain() consumes them.
+typedef struct prof_ring {
+	volatile uint32_t head;		// Next slot the owning CPU fills
+	volatile uint32_t tail;		// Next slot prof_drain() reads
+	uint32_t	lost;		// Samples dropped because ring was full
+	uint32_t	pad;
+	prof_rec	rec[PROF_NREC];
+} prof_ring;
+
+
+void prof_init(void);		// Allocate this CPU's profile ring
+void prof_start(void);		// This CPU is about to run a process
+void prof_tick(struct trapframe *tf);	// Sample on a timer interrupt
+void prof_drain(int ino);	// Append all CPUs' samples to root file
+
+#endif /* !PIOS_KERN_PROF_H */
@@ -0,0 +1,157 @@
+/*
+ * Kernel object caches ("slab" allocator).
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/mem.h>
+#include <kern/slab.h>
+
+
+void
+slab_init(slab_cache *sc, const char *name, size_t size, size_t align)
+{
+	assert(align > 0 && (align & (align-1)) == 0);
+	spinlock_init(&sc->lock);
+	sc->name = name;
+	sc->objsize = ROUNDUP(MAX(size, sizeof(void*)), align);
+	sc->hdrsize = ROUNDUP(sizeof(slab), align);
+	sc->perslab = (PAGESIZE - sc->hdrsize) / sc->objsize;
+	assert(sc->perslab > 0);
+	sc->partial = NULL;
+	sc->nslabs = 0;
+	sc->nobjs = 0;
+}
+
+// Obtain a fresh page for the cache and carve it into free objects.
+static slab *
+slab_grow(slab_cache *sc)
+{
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return NULL;
+	mem_incref(pi);		// slab pages stay referenced while in use
+
+	slab *s = mem_pi2ptr(pi);
+	s->next = NULL;
+	s->free = NULL;
+	s->inuse = 0;
+	int i;
+	for (i = sc->perslab - 1; i >= 0; i--) {
+		void **obj = slab_object(sc, s, i);
+		*obj = s->free;
+		s->free = obj;
+	}
+	sc->nslabs++;
+	return s;
+}
+
+void *
+slab_alloc(slab_cache *sc)
+{
+	spinlock_acquire(&sc->lock);
+	slab *s = sc->partial;
+	if (s == NULL) {
+		s = sc->partial = slab_grow(sc);
+		if (s == NULL) {
+			spinlock_release(&sc->lock);
+			return NULL;
+		}
+	}
+	void **obj = s->free;
+	assert(obj != NULL);
+	s->free = *obj;
+	s->inuse++;
+	if (s->free == NULL)		// slab now full
+		sc->partial = s->next;
+	sc->nobjs++;
+	spinlock_release(&sc->lock);
+	return obj;
+}
+
+void
+slab_free(slab_cache *sc, void *obj)
+{
+	slab *s = ROUNDDOWN(obj, PAGESIZE);
+	assert(slab_object(sc, s, slab_index(sc, obj)) == obj);
+
+	spinlock_acquire(&sc->lock);
+	assert(s->inuse > 0);
+	if (s->free == NULL) {		// was full: back onto partial list
+		s->next = sc->partial;
+		sc->partial = s;
+	}
+	*(void**)obj = s->free;
+	s->free = obj;
+	s->inuse--;
+	sc->nobjs--;
+
+	if (s->inuse == 0) {		// completely free: give the page back
+		slab **sp;
+		for (sp = &sc->partial; *sp != s; sp = &(*sp)->next)
+			assert(*sp != NULL);
+		*sp = s->next;
+		sc->nslabs--;
+		pageinfo *pi = mem_ptr2pi(s);
+		lockadd(&pi->refcount, -1);
+		assert(pi->refcount == 0);
+		mem_free(pi);
+	}
+	spinlock_release(&sc->lock);
+}
+
+int
+slab_index(slab_cache *sc, void *obj)
+{
+	uint32_t ofs = PGOFF(obj);
+	assert(ofs >= sc->hdrsize);
+	return (ofs - sc->hdrsize) / sc->objsize;
+}
+
+void *
+slab_object(slab_cache *sc, void *page, int idx)
+{
+	assert(PGOFF(page) == 0);
+	assert(idx >= 0 && idx < sc->perslab);
+	return page + sc->hdrsize + idx * sc->objsize;
+}
+
+void
+slab_check(void)
+{
+	slab_cache sc;
+	slab_init(&sc, "slab_check", 1000, 16);
+	assert(sc.perslab == 4);
+
+	// Fill two slabs, checking placement and alignment.
+	void *objs[8];
+	int i, j;
+	for (i = 0; i < 8; i++) {
+		objs[i] = slab_alloc(&sc);
+		assert(objs[i] != NULL);
+		assert(((uint32_t)objs[i] & 15) == 0);
+		for (j = 0; j < i; j++)
+			assert(objs[j] != objs[i]);
+		assert(slab_object(&sc, ROUNDDOWN(objs[i], PAGESIZE),
+				slab_index(&sc, objs[i])) == objs[i]);
+		memset(objs[i], i, 1000);
+	}
+	assert(sc.nslabs == 2 && sc.nobjs == 8);
+	for (i = 0; i < 8; i++)		// no overlapping objects
+		assert(*(uint8_t*)(objs[i] + 999) == i);
+
+	// A freed object should be the next one handed out.
+	slab_free(&sc, objs[5]);
+	assert(slab_alloc(&sc) == objs[5]);
+
+	// Freeing everything should return both pages.
+	for (i = 0; i < 8; i++)
+		slab_free(&sc, objs[i]);
+	assert(sc.nslabs == 0 && sc.nobjs == 0 && sc.partial == NULL);
+
+	cprintf("slab_check() succeeded!\n");
+}
@@ -0,0 +1,59 @@
+/*
+ * Kernel object caches ("slab" allocator) definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_SLAB_H
+#define PIOS_KERN_SLAB_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/spinlock.h>
+
+
+// Header at the start of every physical page owned by an object cache.
+// The cache's objects follow the header in the rest of the page.
+typedef struct slab {
+	struct slab	*next;		// Next slab on cache's partial list
+	void		*free;		// Chain of free objects in this slab
+	int		inuse;		// Number of objects allocated
+} slab;
+
+// A cache of fixed-size kernel objects packed several to a page,
+// so that small kernel structures don't each consume a whole page.
+typedef struct slab_cache {
+	spinlock	lock;		// Protects all fields below
+	const char	*name;		// For debugging
+	size_t		objsize;	// Object size rounded up to alignment
+	size_t		hdrsize;	// Slab header size rounded likewise
+	int		perslab;	// Objects per slab page
+	slab		*partial;	// Slabs with at least one free object
+	int		nslabs;		// Slab pages currently held
+	int		nobjs;		// Objects currently allocated
+} slab_cache;
+
+
+// Initialize an object cache for objects of 'size' bytes,
+// each aligned to 'align' bytes (a power of two).
+void slab_init(slab_cache *sc, const char *name, size_t size, size_t align);
+
+// Allocate an object, or return NULL if no physical memory is available.
+// The object's contents are NOT cleared.
+void *slab_alloc(slab_cache *sc);
+
+// Return an object to its cache.
+// A slab page whose objects are all free goes back to mem_free().
+void slab_free(slab_cache *sc, void *obj);
+
+// Object index within its slab page, and the converse.
+int slab_index(slab_cache *sc, void *obj);
+void *slab_object(slab_cache *sc, void *page, int idx);
+
+void slab_check(void);
+
+#endif /* !PIOS_KERN_SLAB_H */
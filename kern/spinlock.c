@@ -10,19 +10,143 @@
 
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/file.h>
 
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/cons.h>
 
 
+#ifdef SPINLOCK_PROFILE
+
+#define LOCKSTAT_SITES	128	// Distinct spinlock_init() sites we track
+#define LOCKSTAT_TOP	16	// Sites listed by spinlock_statfile()
+#define LOCKSTAT_LINEMAX 160	// Longest line spinlock_statfile() writes
+
+static lockstat lockstats[LOCKSTAT_SITES];
+
+// Find or create the statistics entry for a spinlock_init() site,
+// in an open-addressed table that entries are never removed from.
+// Returns NULL if the table is full.
+static lockstat *
+spinlock_statsite(const char *file, int line)
+{
+    uint32_t h = ((uint32_t)file * 31 + line) % LOCKSTAT_SITES;
+    int i;
+    for (i = 0; i < LOCKSTAT_SITES; i++) {
+        lockstat *ls = &lockstats[(h + i) % LOCKSTAT_SITES];
+        if (ls->file == NULL && xchg(&ls->claimed, 1) == 0) {
+            ls->line = line;
+            asm volatile("" : : : "memory");  // line before file
+            ls->file = file;
+            return ls;
+        }
+        while (ls->file == NULL)    // another CPU is filling it in
+            pause();
+        if (ls->file == file && ls->line == line)
+            return ls;
+    }
+    return NULL;
+}
+
+// Record a completed acquisition that started waiting at TSC 'start'.
+static void
+spinlock_statacquire(struct spinlock *lk, uint64_t start, bool contended)
+{
+    lk->holdstart = rdtsc();
+    lockstat *ls = lk->stat;
+    if (ls == NULL)
+        return;
+    ls->acquires++;
+    if (contended) {
+        uint64_t spin = lk->holdstart - start;
+        ls->contended++;
+        ls->spincycles += spin;
+        if (spin > ls->spinmax)
+            ls->spinmax = spin;
+    }
+}
+
+// Record how long the lock was held, just before releasing it.
+static void
+spinlock_statrelease(struct spinlock *lk)
+{
+    lockstat *ls = lk->stat;
+    if (ls == NULL)
+        return;
+    uint64_t held = rdtsc() - lk->holdstart;
+    int b = held < 256 ? 0 : held >> 32 ? LOCKSTAT_NHIST - 1
+            : (bsr((uint32_t)held) - 6) / 2;
+    ls->hold[MIN(b, LOCKSTAT_NHIST - 1)]++;
+}
+
+// Update function for the root process's "lockstat" special file:
+// a line per spinlock_init() site among the LOCKSTAT_TOP most contended,
+// giving acquisitions, contended acquisitions, total and longest wait
+// in TSC cycles, and the hold-time histogram (see lockstat).
+// Like "memstat", a fresh snapshot is written only when the root
+// process has truncated the file to zero length to request one.
+void
+spinlock_statfile(int ino)
+{
+    fileinode *fi = &files->fi[ino];
+    if (fi->size != 0)
+        return;
+
+    char *data = FILEDATA(ino);
+    size_t n = 0;
+    bool listed[LOCKSTAT_SITES] = { 0 };
+    int k;
+    for (k = 0; k < LOCKSTAT_TOP; k++) {
+        lockstat *top = NULL;
+        int i, ti = 0;
+        for (i = 0; i < LOCKSTAT_SITES; i++) {
+            lockstat *ls = &lockstats[i];
+            if (ls->file != NULL && ls->acquires != 0 && !listed[i]
+                    && (top == NULL || ls->contended > top->contended
+                        || (ls->contended == top->contended
+                            && ls->acquires > top->acquires)))
+                top = ls, ti = i;
+        }
+        if (top == NULL)
+            break;
+        listed[ti] = 1;
+        n += snprintf(data + n, LOCKSTAT_LINEMAX,
+            "lock %s:%d acq %u cont %u spin %llu max %llu "
+            "hold %u %u %u %u %u %u %u %u\n", top->file, top->line,
+            top->acquires, top->contended, top->spincycles, top->spinmax,
+            top->hold[0], top->hold[1], top->hold[2], top->hold[3],
+            top->hold[4], top->hold[5], top->hold[6], top->hold[7]);
+    }
+    fi->size = n;
+}
+
+// Total contended acquisitions over all sites, for metrics samples.
+uint32_t
+spinlock_contended(void)
+{
+    uint32_t n = 0;
+    int i;
+    for (i = 0; i < LOCKSTAT_SITES; i++)
+        if (lockstats[i].file != NULL)
+            n += lockstats[i].contended;
+    return n;
+}
+
+#endif	// SPINLOCK_PROFILE
+
 void
 spinlock_init_(struct spinlock *lk, const char *file, int line)
 {
     lk->file = file;
     lk->line = line;
-    lk->locked = 0;
+    lk->next = 0;
+    lk->owner = 0;
     lk->cpu = NULL;
+#ifdef SPINLOCK_PROFILE
+    lk->stat = spinlock_statsite(file, line);
+#endif
 }
 
 // Acquire the lock.
@@ -34,21 +158,59 @@ spinlock_acquire(struct spinlock *lk)
 {
     if(spinlock_holding(lk))
         panic("Already holding lock.");
-    while(xchg(&(lk->locked), 1) != 0)
+#ifdef SPINLOCK_PROFILE
+    uint64_t start = rdtsc();
+#endif
+    uint32_t ticket = xadd(&lk->next, 1);
+    bool contended = lk->owner != ticket;
+    while(lk->owner != ticket)
         pause();
     lk->cpu = cpu_cur();
+#ifdef SPINLOCK_PROFILE
+    spinlock_statacquire(lk, start, contended);
+#endif
+#ifndef SPINLOCK_NOTRACE
     debug_trace(read_ebp(), lk->eips);
+#endif
+}
+
+// Acquire the lock only if it is free right now.
+// Returns true if we got it, false if someone else holds it.
+bool
+spinlock_try(struct spinlock *lk)
+{
+    if(spinlock_holding(lk))
+        panic("Already holding lock.");
+    uint32_t ticket = lk->owner;
+    if(lk->next != ticket || cmpxchg(&lk->next, ticket, ticket+1) != ticket)
+        return 0;
+    lk->cpu = cpu_cur();
+#ifdef SPINLOCK_PROFILE
+    spinlock_statacquire(lk, 0, 0);
+#endif
+#ifndef SPINLOCK_NOTRACE
+    debug_trace(read_ebp(), lk->eips);
+#endif
+    return 1;
 }
 
 // Release the lock.
+// Only the holder ever writes owner, and x86 doesn't reorder stores,
+// so a plain increment after a compiler barrier hands the lock on.
 void
 spinlock_release(struct spinlock *lk)
 {
     if(!spinlock_holding(lk))
         panic("Not holding lock");
+#ifdef SPINLOCK_PROFILE
+    spinlock_statrelease(lk);
+#endif
     lk->cpu = NULL;
+#ifndef SPINLOCK_NOTRACE
     lk->eips[0] = 0;
-    xchg(&(lk->locked), 0);
+#endif
+    asm volatile("" : : : "memory");
+    lk->owner++;
 }
 
 // Check whether this cpu is holding the lock.
@@ -56,7 +218,7 @@ int
 spinlock_holding(spinlock *lock)
 {
     return lock->cpu == cpu_cur() 
-        && lock->locked;
+        && lock->owner != lock->next;
 }
 
 // Function that simply recurses to a specified depth.
@@ -96,6 +258,7 @@ void spinlock_check()
 		// Make sure that all locks have holding correctly implemented.
 		for(i=0;i<NUMLOCKS;i++)
 			assert(spinlock_holding(&locks[i]) != 0);
+#ifndef SPINLOCK_NOTRACE
 		// Make sure that top i frames are somewhere in godeep.
 		for(i=0;i<NUMLOCKS;i++) 
 		{
@@ -107,15 +270,31 @@ void spinlock_check()
 					(uint32_t)spinlock_godeep+100);
 			}
 		}
+#endif
 
 		// Release all locks
 		for(i=0;i<NUMLOCKS;i++) spinlock_release(&locks[i]);
 		// Make sure that the CPU has been cleared
 		for(i=0;i<NUMLOCKS;i++) assert(locks[i].cpu == NULL);
+#ifndef SPINLOCK_NOTRACE
 		for(i=0;i<NUMLOCKS;i++) assert(locks[i].eips[0]==0);
+#endif
 		// Make sure that all locks have holding correctly implemented.
 		for(i=0;i<NUMLOCKS;i++) assert(spinlock_holding(&locks[i]) == 0);
+		// Every acquire took a ticket and every release passed it on.
+		for(i=0;i<NUMLOCKS;i++)
+			assert(locks[i].next == run+1 && locks[i].owner == run+1);
 	}
+
+	// A free lock can be taken without waiting, a held one cannot.
+	assert(spinlock_try(&locks[0]));
+	assert(spinlock_holding(&locks[0]));
+	locks[0].cpu = NULL;	// pretend another CPU holds it
+	assert(!spinlock_try(&locks[0]));
+	locks[0].cpu = cpu_cur();
+	spinlock_release(&locks[0]);
+	assert(spinlock_try(&locks[0]));
+	spinlock_release(&locks[0]);
 	cprintf("spinlock_check() succeeded!\n");
 }
 
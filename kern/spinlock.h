@@ -19,15 +19,45 @@
 #include <kern/debug.h>
 
 
+#ifdef SPINLOCK_PROFILE
+#define LOCKSTAT_NHIST	8	// Buckets in the hold-time histogram
+
+// Contention statistics for all the locks initialized at one source
+// file and line, kept when the kernel is built with SPINLOCK_PROFILE.
+// Updated without synchronization of their own, so they are only
+// approximate when several locks from one site are busy at once.
+typedef struct lockstat {
+	const char *volatile file; // Site's spinlock_init() file, NULL if free
+	int line;		// and line
+	uint32_t claimed;	// Set when a CPU starts filling in this entry
+	uint32_t acquires;	// Total acquisitions
+	uint32_t contended;	// Acquisitions that had to wait
+	uint64_t spincycles;	// Total TSC cycles spent waiting
+	uint64_t spinmax;	// Longest single wait in TSC cycles
+	uint32_t hold[LOCKSTAT_NHIST]; // Holds of < 2^(8+2i) cycles, the
+					// last bucket counting all longer ones
+} lockstat;
+#endif
+
 // Mutual exclusion lock.
+// A ticket lock: each acquirer takes the next ticket with one atomic add,
+// then waits (just reading) until the owner count reaches its ticket,
+// so waiting CPUs get the lock in the order they arrived.
+// The lock is free when owner == next.
 typedef struct spinlock {
-	uint32_t locked;	// Is the lock held?
+	volatile uint32_t next;	// Next ticket to hand out
+	volatile uint32_t owner; // Ticket currently holding the lock
 
 	// For debugging:
 	const char *file;	// Source file where spinlock_init() was called
 	int line;		// Line number of spinlock_init()
 	struct cpu *cpu;	// The cpu holding the lock.
-	uint32_t eips[DEBUG_TRACEFRAMES]; // Call stack that locked the lock.
+	uint32_t eips[DEBUG_TRACEFRAMES]; // Call stack that locked the lock,
+					// unless built with SPINLOCK_NOTRACE
+#ifdef SPINLOCK_PROFILE
+	lockstat *stat;		// Statistics for our init site, or NULL
+	uint64_t holdstart;	// TSC when the current holder got the lock
+#endif
 } spinlock;
 
 #define spinlock_init(lk)	spinlock_init_(lk, __FILE__, __LINE__)
@@ -35,8 +65,14 @@ typedef struct spinlock {
 
 void spinlock_init_(spinlock *lk, const char *file, int line);
 void spinlock_acquire(spinlock *lk);
+bool spinlock_try(spinlock *lk);
 void spinlock_release(spinlock *lk);
 int spinlock_holding(spinlock *lk);
 void spinlock_check();
 
+#ifdef SPINLOCK_PROFILE
+void spinlock_statfile(int ino);	// Write top contended locks to file
+uint32_t spinlock_contended(void);	// Sum of contended acquisitions
+#endif
+
 #endif /* !PIOS_KERN_SPINLOCK_H */
@@ -19,18 +19,23 @@
 #include <kern/proc.h>
 #include <kern/syscall.h>
 #include <kern/net.h>
+#include <kern/lat.h>
+#include <kern/disk.h>
 
 // This bit mask defines the eflags bits user code is allowed to set.
 #define FL_USER		(FL_CF|FL_PF|FL_AF|FL_ZF|FL_SF|FL_DF|FL_OF)
 
 extern uint8_t net_node;
 
+static void sysflush(void);
+
 // During a system call, generate a specific processor trap -
 // as if the user code's INT 0x30 instruction had caused it -
 // and reflect the trap to the parent process as with other traps.
 static void gcc_noreturn
 systrap(trapframe *utf, int trapno, int err)
 {
+    sysflush();
     utf->trapno = trapno;
     utf->err = err;
     proc_ret(utf, 0);
@@ -46,12 +51,25 @@ systrap(trapframe *utf, int trapno, int err)
 // - Be sure the parent gets the correct trapno, err, and eip values.
 // - Be sure to release any spinlocks you were holding during the copyin/out.
 //
+// A copy that runs into file data still on disk instead reads it in
+// and carries on, or if it has to wait for the disk, restarts the call.
+//
 static void gcc_noreturn
 sysrecover(trapframe *ktf, void *recoverdata)
 {
     trapframe *utf = (trapframe*)recoverdata;
     cpu *c = cpu_cur();
     c->recover = NULL;
+    uint32_t fva = rcr2();
+    pde_t *pdir = proc_cur()->pdir;
+    if (ktf->trapno == T_PGFLT && fva >= VM_USERLO && fva < VM_USERHI &&
+        disk_hasabsent(pdir, fva, 1)) {
+      sysflush();
+      if (disk_fill(utf, pdir, fva, 1, 0)) {
+        c->recover = sysrecover;
+        trap_return(ktf);
+      }
+    }
     systrap(utf, ktf->trapno, ktf->err);
 }
 
@@ -75,48 +93,141 @@ static void checkva(trapframe *utf, uint32_t uva, size_t size)
 }
 
 
+// Copy data to/from a user address range already validated by checkva(),
+// using sysrecover() to recover from any traps during the copy.
+// Arming the recovery hook costs only a store, so this is the fast path
+// for callers that check one large range and then copy it piecemeal.
+static void
+usercopyv(trapframe *utf, bool copyout, void *kva, uint32_t uva, size_t size)
+{
+  cpu *c = cpu_cur();
+  c->recover = sysrecover;
+  c->recoverdata = utf;
+
+  if(copyout)
+    memmove((void*)uva, kva, size);
+  else
+    memmove(kva, (void*)uva, size);
+
+  c->recover = NULL;
+}
+
 // Copy data to/from user space,
 // using checkva() above to validate the address range
 // and using sysrecover() to recover from any traps during the copy.
 void usercopy(trapframe *utf, bool copyout,
 			void *kva, uint32_t uva, size_t size) {
 	checkva(utf, uva, size);
+  usercopyv(utf, copyout, kva, uva, size);
+}
+
+// Return the length of the NUL-terminated user string at 'uva',
+// looking at no more than 'max' bytes and none beyond VM_USERHI,
+// and recovering from traps as usercopy() does.
+static size_t
+userstrlen(trapframe *utf, uint32_t uva, size_t max)
+{
+  checkva(utf, uva, 0);
+  if (max > VM_USERHI - uva)
+    max = VM_USERHI - uva;
   cpu *c = cpu_cur();
   c->recover = sysrecover;
+  c->recoverdata = utf;
 
-  if(copyout)
-    memmove((void*)uva, kva, size);
-  else
-    memmove(kva, (void*)uva, size);
+  const char *s = (const char*)uva;
+  size_t len = 0;
+  while (len < max && s[len] != 0)
+    len++;
 
   c->recover = NULL;
+  return len;
+}
+
+// Return child process cp's reference page directory,
+// allocating it now if the child has never been snapshotted.
+// Most children never snapshot, so we don't allocate one up front.
+static pde_t *
+childrpdir(trapframe *tf, proc *cp)
+{
+  if (cp->rpdir == NULL && (cp->rpdir = pmap_newpdir()) == NULL) {
+    warn("childrpdir: no memory for reference page directory");
+    systrap(tf, T_GPFLT, 0);
+  }
+  return cp->rpdir;
 }
 
 static void
 do_cputs(trapframe *tf, uint32_t cmd)
 {
-	// Print the string supplied by the user: pointer in EBX
-  // Add one for null termination
-  char tmp[CPUTS_MAX];
-  usercopy(tf, 0, tmp, tf->regs.ebx, CPUTS_MAX);
-  // Make sure it's null terminated (though it may be less than CPUTS_MAX long)
-  //tmp[CPUTS_MAX] = 0;
-	cprintf("%s", tmp);
+	// Print the string supplied by the user: pointer in EBX,
+  // up to the NUL or CPUTS_MAX-1 characters (see lib/cprintf.c).
+  // Once userstrlen() has touched every byte, the string is mapped and
+  // nothing else can change our address space while we run,
+  // so print it right out of user memory instead of copying it.
+  uint32_t uva = tf->regs.ebx;
+  size_t len = userstrlen(tf, uva, CPUTS_MAX-1);
+	cprintf("%.*s", (int)len, (const char*)uva);
 	trap_return(tf);	// syscall completed
 }
 
+// Shoot down the address spaces the current system call has changed,
+// before anything else can run in them: before the calling process
+// blocks, migrates, or traps, and before it starts a child.
 static void
-do_put(trapframe *tf, uint32_t cmd)
+sysflush(void)
 {
-	proc *curr = proc_cur();
-  spinlock_acquire(&curr->lock);
+  cpu *c = cpu_cur();
+  int i;
+  for (i = 0; i < 2; i++)
+    if (c->syspdir[i] != NULL) {
+      pmap_shootdown(c->syspdir[i]);
+      c->syspdir[i] = NULL;
+    }
+}
 
-  uint32_t child_index = tf->regs.edx;
+// Note that a get or put has changed the mappings of the calling process
+// and of child process cp.  Consecutive sysops on the same child
+// share a single shootdown; moving on to another child flushes the last.
+static void
+sysdirty(proc *cp)
+{
+  cpu *c = cpu_cur();
+  if (c->syspdir[1] != NULL && c->syspdir[1] != cp->pdir)
+    pmap_shootdown(c->syspdir[1]);
+  c->syspdir[0] = proc_cur()->pdir;
+  c->syspdir[1] = cp->pdir;
+}
+
+// Read in any file data 'pdir' maps from disk in 'size' bytes at 'va',
+// before an operation that can't carry it along unread (see kern/disk.c).
+// Waiting for the disk restarts the system call.
+static void
+sysdiskfill(trapframe *tf, pde_t *pdir, uint32_t va, size_t size)
+{
+  if (!disk_hasabsent(pdir, va, size))
+    return;
+  sysflush();
+  if (!disk_fill(tf, pdir, va, size, 0))
+    systrap(tf, T_PGFLT, 0);
+}
+
+// Migrate to the node a get, put or wait names in bits 15-8 of EDX.
+// Migrating restarts the system call there, after flushing the TLB
+// changes we have made so far; a batch resumes at the current sysop.
+// A get or put 'op' with SYS_PREFETCH takes our pages at its ESI along.
+static void
+sysmigrate(trapframe *tf, uint32_t child_index, const sysop *op)
+{
+  proc *curr = proc_cur();
   uint8_t node_number  = child_index >> 8 & 0xff;  // First 8 bits are the node number
-  uint8_t child_number = child_index & 0xff;// The last 8 bits for child number
 
-  // cprintf("node %d put: dest node: %d, child: %d, home node: %d\n", 
-  //   net_node, node_number, child_number, RRNODE(curr->home));
+  // Place a SYS_NODEANY child the first time, then stick with it.
+  if(node_number == SYS_NODEANY) {
+    uint8_t *placed = &curr->childnode[child_index & 0xff];
+    if(*placed == 0)
+      *placed = net_place();
+    node_number = *placed;
+  }
 
   // When migrating, make sure to adjust eip! => entry == 0
   // Trying to migrate home and this is not its home
@@ -124,123 +235,286 @@ do_put(trapframe *tf, uint32_t cmd)
     node_number = RRNODE(curr->home);
   }
   if (net_node != node_number) {
-    // cprintf("sys_put: %p migrating to %d\n", curr, RRNODE(curr->home));
-    spinlock_release(&curr->lock);
+    // cprintf("sys_get/put: %p migrating to %d\n", curr, node_number);
+    if(op != NULL && (op->cmd & SYS_PREFETCH)) {
+      uint32_t src = (uint32_t)op->src, size = op->size;
+      if(src < VM_USERLO || src > VM_USERHI || size > VM_USERHI - src)
+        systrap(tf, T_GPFLT, 0);
+      curr->pushva = PGADDR(src);
+      curr->pushlim = ROUNDUP(src + size, PAGESIZE);
+    }
+    sysflush();
     net_migrate(tf, node_number, 0);
   }
+}
 
-  proc *child = curr->child[child_number];
+// Find the child a get or put refers to, migrating to the child's node
+// and waiting for the child to stop first if necessary.
+// Waiting likewise restarts the system call once the child stops.
+// Allocates a fresh child if 'alloc' is set, else returns proc_null.
+// The get or put 'op', if any, is for sysmigrate().
+static proc *
+syschild(trapframe *tf, uint32_t child_index, bool alloc, const sysop *op)
+{
+  proc *curr = proc_cur();
+  uint8_t child_number = child_index & 0xff;// The last 8 bits for child number
 
-  if(!child) 
-    child = proc_alloc(curr, child_number);
+  // cprintf("node %d get/put: dest node: %d, child: %d, home node: %d\n", 
+  //   net_node, child_index >> 8, child_number, RRNODE(curr->home));
+  sysmigrate(tf, child_index, op);
+
+  spinlock_acquire(&curr->lock);
+  proc *child = curr->child[child_number];
+  if(!child)
+    child = alloc ? proc_alloc(curr, child_number) : &proc_null;
+  if(child->state != PROC_STOP && cpu_cur()->syspdir[0] != NULL) {
+    // Don't spin on shootdowns holding our lock: the child may need it.
+    spinlock_release(&curr->lock);
+    sysflush();
+    spinlock_acquire(&curr->lock);
+  }
   if(child->state != PROC_STOP)
     proc_wait(curr, child, tf);
-  
   spinlock_release(&curr->lock);
+  return child;
+}
+
+static void
+sysput(trapframe *tf, const sysop *op)
+{
+  proc *curr = proc_cur();
+  proc *child = syschild(tf, op->child, 1, op);
+  uint32_t cmd = op->cmd;
+
+  if(cmd & SYS_CLONE) {
+    // The sibling to clone is on this node too, since we're now here;
+    // naming the child itself clears its whole subtree instead.
+    uint8_t src_number = op->child >> 16 & 0xff;
+    proc *src = &proc_null;
+    if(src_number != (op->child & 0xff))
+      src = syschild(tf, net_node << 8 | src_number, 0, NULL);
+    if(!proc_clone(child, src))
+      systrap(tf, T_GPFLT, 0);
+  }
 
   // cprintf("do_put: current proc: %p, cpu_cur proc: %p\n", curr, cpu_cur()->proc);
 	if(cmd & SYS_REGS) {
-		usercopy(tf, 0, &child->sv, tf->regs.ebx, sizeof(procstate));
+		pmcstats pmc = child->sv.pmc;	// kept by the kernel alone
+		usercopy(tf, 0, &child->sv, (uint32_t)op->save, sizeof(procstate));
+		child->sv.pmc = pmc;
     child->sv.tf.ds = CPU_GDT_UDATA | 3;
 		child->sv.tf.es = CPU_GDT_UDATA | 3;
 		child->sv.tf.cs = CPU_GDT_UCODE | 3;
 		child->sv.tf.ss = CPU_GDT_UDATA | 3;
 		child->sv.tf.eflags &= FL_USER;
 		child->sv.tf.eflags |= FL_IF;
+
+		// Reserved MXCSR bits would make fxrstor fault in the kernel,
+		// and SYSEXIT would lose the ECX and EDX the parent supplied.
+		child->sv.fx.mxcsr &= 0xffbf;
+		child->sv.tf.err = T_SYSCALL_INT;
+		proc_fpuforget(child);
+		proc_setprio(child);
   }
-  uint32_t dest = tf->regs.edi; //syscall.h
-  uint32_t size = tf->regs.ecx;
-  uint32_t src = tf->regs.esi;
+	if(cmd & SYS_PMC)
+		memset(&child->sv.pmc, 0, sizeof(pmcstats));
+  uint32_t dest = (uint32_t)op->dest; //syscall.h
+  uint32_t size = op->size;
+  uint32_t src = (uint32_t)op->src;
 
   if(cmd & SYS_MEMOP) {
-    int op = cmd & SYS_MEMOP;
+    int memop = cmd & SYS_MEMOP;
     // Check if the destination range is okay
     if(dest < VM_USERLO || dest > VM_USERHI || dest + size > VM_USERHI)
         systrap(tf, T_GPFLT, 0);
-    if(op == SYS_COPY) {
+    if(memop == SYS_COPY) {
       // we have to check the source too
       if(src < VM_USERLO || src > VM_USERHI || src + size > VM_USERHI)
           systrap(tf, T_GPFLT, 0);
+      if(PGOFF(src | dest | size) != 0)   // copies whole pages only
+          systrap(tf, T_GPFLT, 0);
+      if(PTOFF(src ^ dest) != 0)  // moves pages within their 4MB areas
+          sysdiskfill(tf, curr->pdir, src, size);
       pmap_copy(curr->pdir, src, child->pdir, dest, size);
     } else
-      pmap_remove(child->pdir, dest, size);
+      pmap_removelazy(child->pdir, dest, size);
   }
 
 	if(cmd & SYS_PERM)
 		pmap_setperm(child->pdir, dest, size, cmd & SYS_RW);
 
-	if(cmd & SYS_SNAP)
-    // copy pdir to rpdir
-    pmap_copy(child->pdir, VM_USERLO, child->rpdir, VM_USERLO, VM_USERHI-VM_USERLO);
+  // Changes not made by the child's own write faults go on its dirty list,
+  // or spoil it if there are too many.
+  if(cmd & (SYS_MEMOP | SYS_PERM))
+    pmap_dirtyrange(child->dirty, dest, size);
 
-	if(cmd & SYS_START)
-		proc_ready(child);
+	if(cmd & SYS_SNAP) {
+    // copy pdir to rpdir, just the pages written since last time if we can
+    pmap_snap(child->pdir, childrpdir(tf, child), child->dirty);
+    child->dirty = pmap_dirtyreset(child->dirty);
+  }
 
-	trap_return(tf);	// syscall completed
+  // One shootdown per address space for everything done above,
+  // or for a whole run of sysops in a batch.
+  if(cmd & (SYS_MEMOP | SYS_PERM | SYS_SNAP))
+    sysdirty(child);
+
+	if(cmd & SYS_START) {
+    sysflush();
+		proc_start(child);
+  }
 }
 
 static void
-do_get(trapframe *tf, uint32_t cmd)
+sysget(trapframe *tf, const sysop *op)
 { 
   proc *curr = proc_cur();
-  spinlock_acquire(&curr->lock);
-  // Find child index (includes node number and child number)
-  int child_index = tf->regs.edx;
-  uint8_t node_number  = child_index >> 8;  // First 8 bits are the node number
-  uint8_t child_number = child_index & 0xff;// The last 8 bits for child number
-
-  // cprintf("node %d get: dest node: %d, child: %d, home node: %d\n", 
-  //   net_node, node_number, child_number, RRNODE(curr->home));
-
-  // When migrating, make sure to adjust eip! => entry == 0
-  // Trying to migrate home and this is not its home
-  if(node_number == 0) {
-    node_number = RRNODE(curr->home);
-  } 
-  if (net_node != node_number) {
-    // cprintf("sys_get: %p migrating to %d\n", curr, node_number);
-    spinlock_release(&curr->lock);
-    net_migrate(tf, node_number, 0);
-  }
+  proc *child = syschild(tf, op->child, 0, op);
+  uint32_t cmd = op->cmd;
 
-  proc *child = curr->child[child_number];
-  if(!child)
-    child = &proc_null;
-    // cprintf("No child process %d\n", child_index);
-  if(child->state != PROC_STOP)
-	proc_wait(curr, child, tf);
-
-  spinlock_release(&curr->lock);
   // cprintf("do_get: current proc: %p, cpu_cur proc: %p\n", curr, cpu_cur()->proc);
-  uint32_t dest = tf->regs.edi; //syscall.h
-  uint32_t size = tf->regs.ecx;
-  uint32_t src = tf->regs.esi;
+  uint32_t dest = (uint32_t)op->dest; //syscall.h
+  uint32_t size = op->size;
+  uint32_t src = (uint32_t)op->src;
 
   if(cmd & SYS_MEMOP) {
-    int op = cmd & SYS_MEMOP;
+    int memop = cmd & SYS_MEMOP;
     // Check if the destination range is okay
     if(dest < VM_USERLO || dest > VM_USERHI || dest + size > VM_USERHI)
         systrap(tf, T_GPFLT, 0);
-    if(op == SYS_COPY) {
+    if(memop == SYS_COPY) {
       // we have to check the source too
       if(src < VM_USERLO || src > VM_USERHI || src + size > VM_USERHI)
           systrap(tf, T_GPFLT, 0);
+      if(PGOFF(src | dest | size) != 0)   // copies whole pages only
+          systrap(tf, T_GPFLT, 0);
+      if(PTOFF(src ^ dest) != 0)  // moves pages within their 4MB areas
+          sysdiskfill(tf, child->pdir, src, size);
       pmap_copy(child->pdir, src, curr->pdir, dest, size);
-    } else if(op == SYS_MERGE) {
-        pmap_merge(child->rpdir, child->pdir, src, curr->pdir, dest, size);
+    } else if(memop == SYS_MERGE) {
+        // Merging compares page contents, so needs them all in memory.
+        if(src >= VM_USERLO && src <= VM_USERHI && src + size <= VM_USERHI) {
+          sysdiskfill(tf, childrpdir(tf, child), src, size);
+          sysdiskfill(tf, child->pdir, src, size);
+          sysdiskfill(tf, curr->pdir, dest, size);
+        }
+        mergereport *rep = &child->sv.merge;
+        memset(rep, 0, sizeof(*rep));
+        rep->policy = cmd & SYS_MERGEPOL;
+        if(rep->policy > SYS_MERGEMAX)
+          systrap(tf, T_GPFLT, 0);
+        pmap_merge(childrpdir(tf, child), child->pdir, src,
+          curr->pdir, dest, size, child->dirty, rep);
     } else
-        pmap_remove(curr->pdir, dest, size);
+        pmap_removelazy(curr->pdir, dest, size);
   }
 
 	if(cmd & SYS_PERM)
 		pmap_setperm(curr->pdir, dest, size, cmd & SYS_RW);
 
-    if(cmd & SYS_REGS)
-		usercopy(tf, 1, &child->sv, tf->regs.ebx, sizeof(procstate));
+  // Likewise our own dirty list, if our parent snapshotted us.
+  if(cmd & (SYS_MEMOP | SYS_PERM))
+    pmap_dirtyrange(curr->dirty, dest, size);
+
+  if(cmd & (SYS_MEMOP | SYS_PERM))
+    sysdirty(child);
 
+	if(cmd & SYS_REGS)
+		usercopy(tf, 1, &child->sv, (uint32_t)op->save, sizeof(procstate));
+	else if(cmd & SYS_PMC)
+		usercopy(tf, 1, &child->sv.pmc,
+			(uint32_t)&op->save->pmc, sizeof(pmcstats));
+}
+
+static void
+do_put(trapframe *tf, uint32_t cmd)
+{
+  sysop op = { cmd, tf->regs.edx, (procstate*)tf->regs.ebx,
+    (void*)tf->regs.esi, (void*)tf->regs.edi, tf->regs.ecx };
+  sysput(tf, &op);
+  sysflush();
 	trap_return(tf);	// syscall completed
 }
 
+static void
+do_get(trapframe *tf, uint32_t cmd)
+{
+  sysop op = { cmd, tf->regs.edx, (procstate*)tf->regs.ebx,
+    (void*)tf->regs.esi, (void*)tf->regs.edi, tf->regs.ecx };
+  sysget(tf, &op);
+  sysflush();
+	trap_return(tf);	// syscall completed
+}
+
+// Run an array of gets and puts (see inc/syscall.h),
+// stepping the caller's EBX and ECX past each one as it completes.
+static void
+do_batch(trapframe *tf, uint32_t cmd)
+{
+  // Validate the whole array up front, then copy it in sysop by sysop.
+  if (tf->regs.ecx > (VM_USERHI - VM_USERLO) / sizeof(sysop))
+    systrap(tf, T_PGFLT, 0);
+  checkva(tf, tf->regs.ebx, tf->regs.ecx * sizeof(sysop));
+  while (tf->regs.ecx > 0) {
+    sysop op;
+    usercopyv(tf, 0, &op, tf->regs.ebx, sizeof(op));
+    switch (op.cmd & SYS_TYPE) {
+    case SYS_PUT: sysput(tf, &op); break;
+    case SYS_GET: sysget(tf, &op); break;
+    default:      systrap(tf, T_GPFLT, 0);
+    }
+    tf->regs.ebx += sizeof(op);
+    tf->regs.ecx--;
+  }
+  sysflush();
+	trap_return(tf);	// syscall completed
+}
+
+// Wait for any of a set of children to stop (see inc/syscall.h).
+static void
+do_wait(trapframe *tf, uint32_t cmd)
+{
+  proc *curr = proc_cur();
+  if ((tf->regs.edx >> 8 & 0xff) == SYS_NODEANY)
+    systrap(tf, T_GPFLT, 0);
+  sysmigrate(tf, tf->regs.edx, NULL);
+
+  childset set, ready;
+  usercopy(tf, 0, &set, tf->regs.ebx, sizeof(set));
+  memset(&ready, 0, sizeof(ready));
+
+  spinlock_acquire(&curr->lock);
+  int cn, first = -1, nready = 0;
+  for (cn = 0; cn < CHILDSET_MAX; cn++) {
+    if (!childset_has(&set, cn))
+      continue;
+    if (first < 0)
+      first = cn;
+    proc *child = curr->child[cn];
+    if (child == NULL || child->state == PROC_STOP) {
+      childset_add(&ready, cn);
+      nready++;
+    }
+  }
+  if (!(curr->sv.pff & PFF_NONDET) && first >= 0) {
+    // Deterministic: the result mustn't depend on who stops first,
+    // nor when polling, on whether anyone has yet.
+    if (!childset_has(&ready, first) && !(cmd & SYS_POLL))
+      proc_wait(curr, curr->child[first], tf);
+    memset(&ready, 0, sizeof(ready));
+    if (!(cmd & SYS_POLL))
+      childset_add(&ready, first);
+  } else if (first >= 0 && nready == 0 && !(cmd & SYS_POLL)) {
+    // Nobody's done yet: the first child to stop restarts us.
+    curr->waitset = set;
+    proc_wait(curr, &proc_null, tf);
+  }
+  spinlock_release(&curr->lock);
+
+  usercopy(tf, 1, &ready, tf->regs.ebx, sizeof(ready));
+  trap_return(tf);	// syscall completed
+}
+
 static void
 do_ret(trapframe *tf, uint32_t cmd) {
   proc *curr = proc_cur();
@@ -255,6 +529,45 @@ do_ret(trapframe *tf, uint32_t cmd) {
   proc_ret(tf, 1);
 }
 
+// Complete a trapframe for a system call made with SYSENTER:
+// the user's stub left its stack pointer in EBP,
+// pointing at the address to return to.
+static void
+sysenterframe(trapframe *tf)
+{
+  tf->esp = tf->regs.ebp;
+  usercopy(tf, 0, &tf->eip, tf->esp, sizeof(tf->eip));
+}
+
+// Entered from sysenter_entry in kern/trapasm.S, with a trapframe
+// marked T_SYSCALL_SYSENTER so that trap_return() returns with SYSEXIT.
+// None of trap()'s other work applies to system calls, so go straight
+// to syscall(), leaving trap() just the calls syscall() doesn't handle.
+void gcc_noreturn
+syscall_fast(trapframe *tf)
+{
+  sysenterframe(tf);
+  lat_trap(tf);
+  syscall(tf);
+  trap(tf);
+}
+
+// Handle an invalid opcode trap from user mode in case it is SYSENTER
+// on a processor without it (see cpu_init()), by treating it as if
+// it had been INT T_SYSCALL.  Returns if it wasn't SYSENTER after all.
+void
+syscall_emulate(trapframe *tf)
+{
+  uint8_t insn[2];
+  usercopy(tf, 0, insn, tf->eip, sizeof(insn));
+  if (insn[0] != 0x0f || insn[1] != 0x34)
+    return;
+  tf->trapno = T_SYSCALL;
+  tf->err = T_SYSCALL_INT;
+  sysenterframe(tf);
+  syscall(tf);
+}
+
 // Common function to handle all system calls -
 // decode the system call type and call an appropriate handler function.
 // Be sure to handle undefined system calls appropriately.
@@ -263,11 +576,15 @@ syscall(trapframe *tf)
 {
 	// EAX register holds system call command/flags
 	uint32_t cmd = tf->regs.eax;
+	if ((cmd & SYS_TYPE) <= SYS_WAIT)
+		lat_syscall(cmd);
 	switch (cmd & SYS_TYPE) {
   	case SYS_CPUTS:	return do_cputs(tf, cmd);
   	case SYS_PUT: return do_put(tf, cmd);
   	case SYS_GET: return do_get(tf, cmd);
   	case SYS_RET: return do_ret(tf, cmd);
+  	case SYS_BATCH: return do_batch(tf, cmd);
+  	case SYS_WAIT: return do_wait(tf, cmd);
   	default:	return;		// handle as a regular trap
 	}
 }
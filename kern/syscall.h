@@ -18,5 +18,10 @@
 #include <inc/trap.h>
 
 void syscall(trapframe *tf);
+void syscall_fast(trapframe *tf) gcc_noreturn;	// SYSENTER entry
+void syscall_emulate(trapframe *tf);	// SYSENTER caused T_ILLOP?
+
+// SYSENTER entrypoint code in kern/trapasm.S
+extern char sysenter_entry[], sysenter_end[];
 
 #endif /* !PIOS_KERN_SYSCALL_H */
@@ -0,0 +1,179 @@
+/*
+ * Kernel one-shot timers on a per-CPU hashed timer wheel.
+ *
+ * Instead of taking a periodic interrupt and counting ticks,
+ * each CPU programs its local APIC timer in one-shot mode
+ * for its nearest pending deadline, or stops it entirely
+ * when it has none: an idle CPU, or a CPU running a single process
+ * with nothing else waiting, takes no timer interrupts at all.
+ * A CPU's notion of the current tick only advances while its LAPIC
+ * timer is running, which is all that relative deadlines need.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/timer.h>
+
+#include <dev/lapic.h>
+
+
+// Longest interval we can program into the 32-bit LAPIC counter.
+// Farther deadlines take an extra, empty interrupt every so often.
+#define TIMER_MAXDELAY	(0xffffffff / LAPIC_TICK)
+
+// Account for the LAPIC counts that elapsed since we last looked.
+static void
+timer_advance(cpu *c)
+{
+	if (c->timercount == 0)
+		return;			// timer stopped: no time passes
+	uint32_t left = lapic_timerleft();
+	uint32_t used = c->timercount - left + c->timerpart;
+	c->ticks += used / LAPIC_TICK;
+	c->timerpart = used % LAPIC_TICK;
+	c->timercount = left;
+}
+
+// Ticks until timer t is due; overdue timers are due at the next tick.
+static uint32_t
+timer_due(cpu *c, timer *t)
+{
+	int32_t d = t->expire - c->ticks;
+	return d < 1 ? 1 : d;
+}
+
+// Program the LAPIC to interrupt at this CPU's nearest deadline.
+// The wheel is hashed by deadline, so scanning forward from the
+// current tick normally finds the nearest timer within a few slots;
+// only timers a whole wheel revolution or more away need a full scan.
+static void
+timer_program(cpu *c)
+{
+	uint32_t delay = 0, i;
+	timer *t;
+	for (i = 1; i <= TIMER_WHEEL && delay == 0; i++)
+		for (t = c->timers[(c->ticks + i) % TIMER_WHEEL]; t;
+				t = t->next)
+			if (timer_due(c, t) <= i) {
+				delay = timer_due(c, t);
+				break;
+			}
+	if (delay == 0 && c->ntimers > 0) {
+		delay = TIMER_MAXDELAY;
+		for (i = 0; i < TIMER_WHEEL; i++)
+			for (t = c->timers[i]; t; t = t->next)
+				delay = MIN(delay, timer_due(c, t));
+	}
+
+	if (delay == 0) {		// nothing pending: stop ticking
+		if (c->timercount != 0)
+			lapic_timer(0);
+		c->timercount = 0;
+		return;
+	}
+	delay = MIN(delay, TIMER_MAXDELAY);
+	if (c->timercount != 0 && c->timerdeadline == c->ticks + delay)
+		return;			// already programmed for it
+	c->timerdeadline = c->ticks + delay;
+	c->timercount = delay * LAPIC_TICK - c->timerpart;
+	lapic_timer(c->timercount);
+}
+
+// Unlink pending timer t from its slot on CPU c's wheel.
+static void
+timer_unlink(cpu *c, timer *t)
+{
+	timer **tp = &c->timers[t->expire % TIMER_WHEEL];
+	while (*tp != t)
+		tp = &(*tp)->next;
+	*tp = t->next;
+	t->pending = 0;
+	c->ntimers--;
+}
+
+void
+timer_add(timer *t, uint32_t delay)
+{
+	// While t is firing it's on its CPU's chain of expired timers,
+	// which we mustn't relink: leave the re-arm to timer_intr(),
+	// unless it finished firing meanwhile without seeing our request.
+	if (t->firing) {
+		t->redelay = delay;
+		xchg(&t->rearm, 1);
+		if (t->firing || !xchg(&t->rearm, 0))
+			return;
+	}
+
+	cpu *c = cpu_cur();
+	if (t->pending) {
+		assert(t->cpu == c);
+		timer_unlink(c, t);
+	}
+	timer_advance(c);
+	t->cpu = c;
+	t->expire = c->ticks + MAX(delay, 1);
+	timer **slot = &c->timers[t->expire % TIMER_WHEEL];
+	t->next = *slot;
+	*slot = t;
+	t->pending = 1;
+	c->ntimers++;
+	timer_program(c);
+}
+
+// Disarm a pending timer.  This doesn't reprogram the LAPIC:
+// if it was the nearest deadline we'll just take one empty interrupt.
+void
+timer_cancel(timer *t)
+{
+	if (t->firing)
+		xchg(&t->rearm, 0);	// forget a re-arm timer_add() deferred
+	if (!t->pending)
+		return;
+	assert(t->cpu == cpu_cur());
+	timer_unlink(t->cpu, t);
+}
+
+void
+timer_intr(void)
+{
+	cpu *c = cpu_cur();
+
+	// Collect all expired timers, from every slot that came due since
+	// we last ran; then reprogram before calling any of them.
+	uint32_t last = c->timerlast;
+	timer_advance(c);
+	uint32_t n = MIN(c->ticks - last, TIMER_WHEEL);
+	c->timerlast = c->ticks;
+	timer *expired = NULL;
+	uint32_t i;
+	for (i = 0; i < n; i++) {
+		timer **tp = &c->timers[(c->ticks - i) % TIMER_WHEEL], *t;
+		while ((t = *tp) != NULL) {
+			if ((int32_t) (t->expire - c->ticks) > 0) {
+				tp = &t->next;	// due in a later revolution
+				continue;
+			}
+			*tp = t->next;
+			xchg(&t->firing, 1);	// before anyone sees !pending
+			t->pending = 0;
+			c->ntimers--;
+			t->next = expired;
+			expired = t;
+		}
+	}
+	timer_program(c);
+
+	timer *t;
+	while ((t = expired) != NULL) {
+		expired = t->next;
+		t->func(t);
+		xchg(&t->firing, 0);
+		if (xchg(&t->rearm, 0))		// timer_add()ed meanwhile
+			timer_add(t, t->redelay);
+	}
+}
@@ -0,0 +1,52 @@
+/*
+ * Kernel one-shot timers on a per-CPU hashed timer wheel.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_TIMER_H
+#define PIOS_KERN_TIMER_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct cpu;
+
+
+// Number of slots in each CPU's timer wheel: a timer due at tick t
+// hangs off slot t % TIMER_WHEEL.  Must be a power of two.
+#define TIMER_WHEEL	32
+
+// A one-shot timer.  The owner sets 'func' once, then arms the timer
+// with timer_add() on whichever CPU should run it.  It fires once,
+// from the timer interrupt on that CPU, with interrupts disabled;
+// 'func' may re-arm it but must return (not switch processes).
+// From the time it expires until 'func' returns, the timer is firing:
+// timer_add() then just notes the delay, from any CPU,
+// and the firing CPU re-arms it on its own wheel once 'func' is done.
+typedef struct timer {
+	struct timer	*next;		// Next timer in the same wheel slot
+	struct cpu	*cpu;		// CPU whose wheel holds us if pending
+	uint32_t	expire;		// Tick at which we fire, on that CPU
+	volatile bool	pending;	// True while armed
+	volatile uint32_t firing;	// Expired, and 'func' not yet done
+	volatile uint32_t rearm;	// timer_add() called while firing
+	uint32_t	redelay;	// and with what delay
+	void		(*func)(struct timer *t);
+} timer;
+
+
+// Arm timer 't' to fire 'delay' ticks from now on the current CPU.
+// Re-arming a pending timer moves its deadline; it must be pending
+// on the current CPU, as must any timer passed to timer_cancel().
+void timer_add(timer *t, uint32_t delay);
+void timer_cancel(timer *t);
+
+// Called on every local APIC timer interrupt: run expired timers
+// and program the LAPIC for this CPU's next deadline, if any.
+void timer_intr(void);
+
+#endif /* !PIOS_KERN_TIMER_H */
@@ -0,0 +1,109 @@
+/*
+ * Per-CPU scheduler event tracing.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/file.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/proc.h>
+#include <kern/trace.h>
+
+
+static const char *const trace_names[] = {
+	[TRACE_READY]	= "ready",
+	[TRACE_RUN]	= "run",
+	[TRACE_YIELD]	= "yield",
+	[TRACE_WAIT]	= "wait",
+	[TRACE_RET]	= "ret",
+	[TRACE_MIGRATE]	= "migrate",
+	[TRACE_PULL]	= "pull",
+};
+
+#define TRACE_LINEMAX	64	// Longest line trace_drain() produces
+
+void
+trace_init(void)
+{
+	assert(sizeof(trace_ring) <= PAGESIZE);
+
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL) {
+		warn("trace_init: no memory for CPU %d trace ring",
+			cpu_cur()->id);
+		return;
+	}
+	mem_incref(pi);
+	trace_ring *tr = mem_pi2ptr(pi);
+	memset(tr, 0, sizeof(*tr));
+	cpu_cur()->trace = tr;
+}
+
+// Record a scheduling event on the current CPU's ring.
+// Must be called with interrupts disabled, as all kernel code runs.
+// If the ring is full the event is counted as lost rather than
+// overwriting old records the drainer may be reading.
+void
+trace_log(trace_event ev, proc *p, uint16_t arg)
+{
+	cpu *c = cpu_cur();
+	trace_ring *tr = c->trace;
+	if (tr == NULL)
+		return;
+
+	uint32_t head = tr->head;
+	uint32_t next = head + 1 == TRACE_NREC ? 0 : head + 1;
+	if (next == tr->tail) {
+		tr->lost++;
+		return;
+	}
+	trace_rec *r = &tr->rec[head];
+	r->tsc = rdtsc();
+	r->proc = p->home;
+	r->arg = arg;
+	r->cpu = c->id;
+	r->event = ev;
+	asm volatile("" : : : "memory");	// publish record before head
+	tr->head = next;
+}
+
+// Drain every CPU's trace ring into the root process's file 'ino',
+// one text line per event:  "cpu tsc event proc arg", all in hex.
+// Called from file_io() in the root process's address space.
+// Records stay in the rings while the file is at its maximum size;
+// the root process can truncate the file to make room for more.
+void
+trace_drain(int ino)
+{
+	fileinode *fi = &files->fi[ino];
+	char *data = FILEDATA(ino);
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		trace_ring *tr = c->trace;
+		if (tr == NULL)
+			continue;
+		if (tr->lost && fi->size + TRACE_LINEMAX <= FILE_SLOTSIZE) {
+			fi->size += snprintf(data + fi->size, TRACE_LINEMAX,
+					"%x 0 lost 0 %x\n", c->id, tr->lost);
+			tr->lost = 0;	// racy, but only a statistic
+		}
+		uint32_t tail = tr->tail;
+		while (tail != tr->head &&
+				fi->size + TRACE_LINEMAX <= FILE_SLOTSIZE) {
+			trace_rec *r = &tr->rec[tail];
+			fi->size += snprintf(data + fi->size, TRACE_LINEMAX,
+					"%x %llx %s %x %x\n", r->cpu, r->tsc,
+					trace_names[r->event], r->proc, r->arg);
+			tail = tail + 1 == TRACE_NREC ? 0 : tail + 1;
+		}
+		asm volatile("" : : : "memory");	// done reading records
+		tr->tail = tail;
+	}
+}
@@ -0,0 +1,58 @@
+/*
+ * Per-CPU scheduler event tracing definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_TRACE_H
+#define PIOS_KERN_TRACE_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+struct proc;
+
+
+// Kinds of scheduler events recorded.
+typedef enum trace_event {
+	TRACE_READY = 1,	// Process queued; arg = CPU id queued on
+	TRACE_RUN,		// Process switched in; arg = priority level
+	TRACE_YIELD,		// Process preempted by the timer
+	TRACE_WAIT,		// Process blocked waiting for a child
+	TRACE_RET,		// Process returned to its parent
+	TRACE_MIGRATE,		// Process migrating; arg = destination node
+	TRACE_PULL,		// Process pulling a page; arg = source node
+} trace_event;
+
+// One trace record, timestamped with the recording CPU's TSC.
+typedef struct trace_rec {
+	uint64_t	tsc;		// Timestamp counter at time of event
+	uint32_t	proc;		// Home RR identifying the process
+	uint16_t	arg;		// Event-specific argument
+	uint8_t		cpu;		// Local APIC ID of recording CPU
+	uint8_t		event;		// trace_event
+} trace_rec;
+
+#define TRACE_NREC	(PAGESIZE / sizeof(trace_rec) - 1)
+
+// Each CPU's trace ring occupies one page.  Only the owning CPU writes
+// records (with interrupts disabled, so without locking), and only
+// trace_drain() consumes them, so head and tail each have one writer.
+typedef struct trace_ring {
+	volatile uint32_t head;		// Next slot the owning CPU fills
+	volatile uint32_t tail;		// Next slot trace_drain() reads
+	uint32_t	lost;		// Events dropped because ring was full
+	uint32_t	pad;
+	trace_rec	rec[TRACE_NREC];
+} trace_ring;
+
+
+void trace_init(void);		// Allocate this CPU's trace ring
+void trace_log(trace_event ev, struct proc *p, uint16_t arg);
+void trace_drain(int ino);	// Append all CPUs' events to root file
+
+#endif /* !PIOS_KERN_TRACE_H */
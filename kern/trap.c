@@ -20,11 +20,16 @@
 #include <kern/syscall.h>
 #include <kern/pmap.h>
 #include <kern/net.h>
+#include <kern/prof.h>
+#include <kern/lat.h>
 
 #include <dev/lapic.h>
+#include <dev/ioapic.h>
 #include <dev/kbd.h>
 #include <dev/serial.h>
 #include <dev/e100.h>
+#include <dev/virtio.h>
+#include <dev/vblk.h>
 
 
 // Interrupt descriptor table.  Must be built at run time because
@@ -46,11 +51,11 @@ trap_init_idt(void)
   // All the trap handlers.
   extern char tdivide, tdebug, tnmi, tbrkpt, toflow, tbound, tillop, 
               tdivide, tdblflt, ttss, tsegnp, tstack, tgpflt, tpgflt, 
-              tfperr, talign, tmchk, tsimd, tsecev,
+              tdevice, tfperr, talign, tmchk, tsimd, tsecev,
               tirq0, tirqspur, tirqkbd, tirqser, tirq2, tirq3, 
               tirq5, tirq6, tirq8, tirq9, tirq10, tirq11, tirq12, 
               tirq13, tirq14, tirq15,
-              tsystem, tltimer;
+              tsystem, tltimer, tipiwake, tipitlb;
       
   SETGATE(idt[T_DIVIDE], 0, CPU_GDT_KCODE, &tdivide, 0);
   SETGATE(idt[T_DEBUG], 0, CPU_GDT_KCODE, &tdebug, 0);
@@ -59,7 +64,7 @@ trap_init_idt(void)
   SETGATE(idt[T_OFLOW], 0, CPU_GDT_KCODE, &toflow, 3);
   SETGATE(idt[T_BOUND], 0, CPU_GDT_KCODE, &tbound, 0);
   SETGATE(idt[T_ILLOP], 0, CPU_GDT_KCODE, &tillop, 0);
-  SETGATE(idt[T_DEVICE], 0, CPU_GDT_KCODE, &tdivide, 0);
+  SETGATE(idt[T_DEVICE], 0, CPU_GDT_KCODE, &tdevice, 0);
   SETGATE(idt[T_DBLFLT], 0, CPU_GDT_KCODE, &tdblflt, 0);
   SETGATE(idt[T_TSS], 0, CPU_GDT_KCODE, &ttss, 0);
   SETGATE(idt[T_SEGNP], 0, CPU_GDT_KCODE, &tsegnp, 0);
@@ -93,6 +98,8 @@ trap_init_idt(void)
 
   SETGATE(idt[T_SYSCALL], 0, CPU_GDT_KCODE, &tsystem, 3);
   SETGATE(idt[T_LTIMER], 0, CPU_GDT_KCODE, &tltimer, 0);
+  SETGATE(idt[T_IPIWAKE], 0, CPU_GDT_KCODE, &tipiwake, 0);
+  SETGATE(idt[T_IPITLB], 0, CPU_GDT_KCODE, &tipitlb, 0);
 }
 
 void
@@ -107,8 +114,10 @@ trap_init(void)
 	asm volatile("lidt %0" : : "m" (idt_pd));
 
 	// Check for the correct IDT and trap handler operation.
+#ifndef BOOT_NOCHECK
 	if (cpu_onboot())
 		trap_check_kernel();
+#endif
 }
 
 const char *trap_name(int trapno)
@@ -183,6 +192,7 @@ trap(trapframe *tf)
 	// The user-level environment may have set the DF flag,
 	// and some versions of GCC rely on DF being clear.
 	asm volatile("cld" ::: "cc");
+	lat_trap(tf);
 
   // If it's a pagefault, check if it's one to blame on the user,
   // or this function will call trap_return itself.
@@ -204,12 +214,47 @@ trap(trapframe *tf)
     case T_SYSCALL:
       syscall(tf);
       break;
+    case T_ILLOP:
+      if(tf->cs & 3)
+        syscall_emulate(tf);	// returns unless it was SYSENTER
+      break;
+    case T_DEBUG:
+      // User code single-stepping into SYSENTER traps here
+      // after the first instruction of sysenter_entry:
+      // stop stepping and let the system call go ahead.
+      if(!(tf->cs & 3) && tf->eip > (uint32_t)sysenter_entry &&
+          tf->eip < (uint32_t)sysenter_end) {
+        tf->eflags &= ~FL_TF;
+        trap_return(tf);
+      }
+      break;
     case T_LTIMER:
-      net_tick();
       lapic_eoi();
-      //cprintf("Timer Interrupt.\n");
+      timer_intr();
+      prof_tick(tf);
+      cons_drain();   // print any console output the root has queued
+      if(cpu_onboot())
+        cons_logdrain();  // and the kernel's, in case no CPU goes idle
+      if(tf->cs & 3)
+        proc_tick(tf);
+      trap_return(tf);
+    case T_IPIWAKE:
+      // Kicks an idle CPU out of HLT in proc_sched(),
+      // or tells a busy one that work is now waiting (see proc_ready()).
+      lapic_eoi();
       if(tf->cs & 3)
-        proc_yield(tf);
+        proc_tick(tf);
+      trap_return(tf);
+    case T_IPITLB:
+      // Another CPU changed the page tables we're running on.
+      lapic_eoi();
+      pmap_tlbservice(c);
+      trap_return(tf);
+    case T_DEVICE:
+      // First FPU/SSE instruction since this process was switched in.
+      if(!(tf->cs & 3))
+        break;
+      proc_fpuload(curr);
       trap_return(tf);
     case T_IRQ0+IRQ_KBD:
       // cprintf("Keyboard interrupt\n");
@@ -227,9 +272,24 @@ trap(trapframe *tf)
       trap_return(tf);
   }
   
-  if(tf->trapno == e100_irq_gate) { 
+  if(tf->trapno == e100_irq_gate && e100_present) { 
       e100_intr();
       lapic_eoi();
+      ioapic_resteer(e100_irq);
+      trap_return(tf);
+  }
+  if(tf->trapno == T_IRQ0 + vblk_irq && vblk_present) {
+      vblk_intr();
+      if(virtio_present && virtio_irq == vblk_irq)
+        virtio_intr();    // legacy PCI interrupt lines may be shared
+      lapic_eoi();
+      ioapic_resteer(vblk_irq);
+      trap_return(tf);
+  }
+  if(tf->trapno == T_IRQ0 + virtio_irq && virtio_present) {
+      virtio_intr();
+      lapic_eoi();
+      ioapic_resteer(virtio_irq);
       trap_return(tf);
   }
 
@@ -21,6 +21,7 @@
 
 #include <inc/types.h>
 #include <inc/stdio.h>
+#include <inc/string.h>
 #include <inc/stdarg.h>
 #include <inc/assert.h>
 
@@ -49,6 +50,22 @@ putch(int ch, struct printbuf *b)
 	b->cnt++;
 }
 
+static void
+putbuf(const char *s, int n, struct printbuf *b)
+{
+	b->cnt += n;
+	while (n > 0) {
+		int m = MIN(n, CPUTS_MAX-1 - b->idx);
+		memcpy(b->buf + b->idx, s, m);
+		b->idx += m, s += m, n -= m;
+		if (b->idx == CPUTS_MAX-1) {
+			b->buf[b->idx] = 0;
+			cputs(b->buf);
+			b->idx = 0;
+		}
+	}
+}
+
 int
 vcprintf(const char *fmt, va_list ap)
 {
@@ -56,7 +73,7 @@ vcprintf(const char *fmt, va_list ap)
 
 	b.idx = 0;
 	b.cnt = 0;
-	vprintfmt((void*)putch, &b, fmt, ap);
+	vprintfmtbuf((void*)putch, (void*)putbuf, &b, fmt, ap);
 
 	b.buf[b.idx] = 0;
 	cputs(b.buf);
@@ -15,6 +15,94 @@
 #include <inc/dirent.h>
 #include <inc/stdio.h>
 
+
+////////// Directory index //////////
+
+// Each process's file state indexes all named inodes two ways:
+// by directory and name on the hash chains headed in fs->dirhash[],
+// so that looking up a name costs about one comparison instead of
+// a scan of all FILE_INODES inodes; and on one list per directory,
+// kept in inode order, for readdir().  Inodes are never unnamed
+// once named (a deleted file just has mode 0), so entries only join.
+// The kernel sets up the root's initial files without the index;
+// dir_index() builds it, in one pass, the first time it's needed.
+// Along with it goes fs->iused[], the bitmap of inodes that are named
+// or lend their area to a file, which fileino_extend() also updates.
+
+static int
+dir_hash(int dino, const char *name, int len)
+{
+	uint32_t h = dino;
+	while (len-- > 0)
+		h = h * 31 + (uint8_t)*name++;
+	return h % FILE_DIRHASH;
+}
+
+static void
+dir_insert(filestate *fs, int ino)
+{
+	fileinode *fi = &fs->fi[ino];
+	int h = dir_hash(fi->dino, fi->de.d_name, strlen(fi->de.d_name));
+	fi->hnext = fs->dirhash[h];
+	fs->dirhash[h] = ino;
+	fileino_setbit(fs->iused, ino);
+
+	int *pp = &fs->fi[fi->dino].dfirst;
+	while (*pp != 0 && *pp < ino)
+		pp = &fs->fi[*pp].dnext;
+	fi->dnext = *pp;
+	*pp = ino;
+}
+
+void
+dir_index(filestate *fs)
+{
+	if (fs->dirindexed)
+		return;
+	memset(fs->dirhash, 0, sizeof(fs->dirhash));
+	memset(fs->iused, 0, sizeof(fs->iused));
+	int ino;
+	for (ino = 1; ino < FILE_INODES; ino++) {
+		fs->fi[ino].dfirst = 0;
+		if (fs->fi[ino].extof != 0)
+			fileino_setbit(fs->iused, ino);
+	}
+	for (ino = FILE_INODES-1; ino > 0; ino--)	// so lists come out sorted
+		if (fs->fi[ino].de.d_name[0] != 0)
+			dir_insert(fs, ino);
+	fs->dirindexed = 1;
+}
+
+// Find the inode, deleted or not, named by the 'len' characters at 'name'
+// in directory 'dino' of file state 'fs', or return 0 if there is none.
+int
+dir_lookup(filestate *fs, int dino, const char *name, int len)
+{
+	dir_index(fs);
+	int ino = fs->dirhash[dir_hash(dino, name, len)];
+	for (; ino != 0; ino = fs->fi[ino].hnext) {
+		fileinode *fi = &fs->fi[ino];
+		if (fi->dino == dino && strncmp(fi->de.d_name, name, len) == 0
+				&& fi->de.d_name[len] == 0)
+			return ino;
+	}
+	return 0;
+}
+
+// Add inode 'ino', whose directory and name were just set, to the index.
+void
+dir_link(filestate *fs, int ino)
+{
+	assert(ino > 0 && ino < FILE_INODES);
+	if (!fs->dirindexed)
+		dir_index(fs);	// picks up 'ino' along with the rest
+	else
+		dir_insert(fs, ino);
+}
+
+
+////////// Path walking and directory scanning //////////
+
 int
 dir_walk(const char *path, mode_t createmode)
 {
@@ -36,14 +124,9 @@ dir_walk(const char *path, mode_t createmode)
 
 	// Look for a regular directory entry with a matching name.
 	int ino, len;
-	for (ino = 1; ino < FILE_INODES; ino++) {
-		if (!fileino_alloced(ino) || files->fi[ino].dino != dino)
-			continue;	// not an entry in directory 'dino'
-
-		// Does this inode's name match our next path component?
-		len = strlen(files->fi[ino].de.d_name);
-		if (memcmp(path, files->fi[ino].de.d_name, len) != 0)
-			continue;	// no match
+	for (len = 0; path[len] != 0 && path[len] != '/'; len++)
+		;
+	if ((ino = dir_lookup(files, dino, path, len)) != 0) {
 		found:
 		if (path[len] == 0) {
 			// Exact match at end of path - but does it exist?
@@ -58,10 +141,10 @@ dir_walk(const char *path, mode_t createmode)
 			files->fi[ino].ver++;	// an exclusive change
 			files->fi[ino].mode = createmode;
 			files->fi[ino].size = 0;
+			fileino_dirty(files, ino);
 			return ino;
 		}
-		if (path[len] != '/')
-			continue;	// no match
+		assert(path[len] == '/');
 
 		// Make sure this dirent refers to a directory
 		if (!fileino_isdir(ino)) {
@@ -111,9 +194,11 @@ dir_walk(const char *path, mode_t createmode)
 	assert(fileino_isvalid(ino) && !fileino_alloced(ino));
 	strcpy(files->fi[ino].de.d_name, path);
 	files->fi[ino].dino = dino;
+	dir_link(files, ino);
 	files->fi[ino].ver = 0;
 	files->fi[ino].mode = createmode;
 	files->fi[ino].size = 0;
+	fileino_dirty(files, ino);
 	return ino;
 }
 
@@ -150,16 +235,18 @@ int closedir(DIR *dir)
 // or NULL if the directory being scanned contains no more entries.
 struct dirent *readdir(DIR *dir)
 {
-	// Lab 4: insert your directory scanning code here.
-	// Hint: a fileinode's 'dino' field indicates
-	// what directory the file is in;
-	// this function shouldn't return entries from other directories!
-	while(dir->ofs < FILE_INODES) {
-		fileinode *fi = &files->fi[dir->ofs];
+	// The offset is the inode of the next entry on the directory's list,
+	// 0 if we haven't started, or FILE_INODES once we've reached the end.
+	dir_index(files);
+	int ino = dir->ofs == 0 ? files->fi[dir->ino].dfirst : dir->ofs;
+	while (ino > 0 && ino < FILE_INODES) {
+		fileinode *fi = &files->fi[ino];
+		assert(fi->dino == dir->ino);
 		// Update offset before returning
-		dir->ofs++;
-		if(fi->dino == dir->ino)
+		dir->ofs = fi->dnext != 0 ? fi->dnext : FILE_INODES;
+		if (fi->mode != 0)
 			return &fi->de;
+		ino = dir->ofs;		// skip deleted entries
 	}
 	return NULL;
 }
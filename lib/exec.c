@@ -26,8 +26,30 @@
 extern void start(void);
 extern void exec_start(intptr_t esp) gcc_noreturn;
 
-int exec_readelf(const char *path);
-intptr_t exec_copyargs(char *const argv[]);
+int exec_readelf(int child, const char *path);
+static void exec_copypages(int child, intptr_t pagelo, intptr_t pagehi,
+    intptr_t lo, intptr_t hi, const void *src);
+intptr_t exec_copyargs(int child, char *const argv[]);
+void *mmap_alloc(size_t plen);
+void mmap_free(void *va, size_t plen);
+
+// Cache of executable images we've loaded, so that loading one again,
+// as a shell running the same command many times does, takes just one
+// copy-on-write copy of the ready-made image into the new process.
+// Images are keyed by inode, along with the version, size, and write
+// sequence number that any change to the executable file would bump.
+#define EXEC_CACHE	4
+
+static struct execimg {
+  int     ino;          // Executable file's inode, 0 if entry unused
+  int     ver;          // File version the image was loaded from
+  int     wseq;         // File write sequence number, ditto
+  size_t  size;         // File size, ditto
+  void    *va;          // Where our copy of the image lives
+  size_t  len;          // Length of the image from VM_USERLO
+  int     used;         // When last used, to replace the oldest
+} execimgs[EXEC_CACHE];
+static int exectick;
 
 int
 execl(const char *path, const char *arg0, ...)
@@ -38,17 +60,20 @@ execl(const char *path, const char *arg0, ...)
 int
 execv(const char *path, char *const argv[])
 {
+  // The new program starts with empty stdio buffers.
+  stdio_sync();
+
   // We'll build the new program in child 0,
   // which never represents a forked child since 0 is an invalid pid.
   // First clear out the new program's entire address space.
   sys_put(SYS_ZERO, 0, NULL, NULL, (void*)VM_USERLO, VM_USERHI-VM_USERLO);
 
   // Load the ELF executable into child 0.
-  if (exec_readelf(path) < 0)
+  if (exec_readelf(0, path) < 0)
     return -1;
 
   // Setup child 0's stack with the argument array.
-  intptr_t esp = exec_copyargs(argv);
+  intptr_t esp = exec_copyargs(0, argv);
 
   // Copy our Unix file system and process state into the child.
   sys_put(SYS_COPY, 0, NULL, (void*)VM_FILELO, (void*)VM_FILELO,
@@ -59,18 +84,49 @@ execv(const char *path, char *const argv[])
   exec_start(esp);
 }
 
+// Load an ELF executable straight into the cleared address space of
+// 'child': child 0 for execv(), or a new process for spawn().
+// Whole pages of file-loaded segments get mapped copy-on-write from the
+// executable file itself, so loading the same program again copies
+// almost nothing; only the pages the file data partly covers get built.
 int
-exec_readelf(const char *path)
+exec_readelf(int child, const char *path)
 {
-  // We'll load the ELF image into a scratch area in our address space.
-  sys_get(SYS_ZERO, 0, NULL, NULL, (void*)VM_SCRATCHLO, EXEMAX);
-
   // Open the ELF image to load.
   filedesc *fd = filedesc_open(NULL, path, O_RDONLY, 0);
   if (fd == NULL)
     return -1;
   void *imgdata = FILEDATA(fd->ino);
   size_t imgsize = files->fi[fd->ino].size;
+  fileinode *fi = &files->fi[fd->ino];
+
+  // Look for a cached image of the same file, dropping stale ones.
+  struct execimg *xi, *oldest = execimgs;
+  for (xi = execimgs; xi < &execimgs[EXEC_CACHE]; xi++) {
+    if (xi->ino == fd->ino && (xi->ver != fi->ver || xi->wseq != fi->wseq
+        || xi->size != fi->size)) {
+      mmap_free(xi->va, xi->len);
+      xi->ino = 0;
+    }
+    if (xi->ino == fd->ino) {
+      sys_put(SYS_COPY, child, NULL, xi->va, (void*)VM_USERLO, xi->len);
+      xi->used = ++exectick;
+      filedesc_close(fd);
+      return 0;
+    }
+    if (oldest->ino != 0 && (xi->ino == 0 || xi->used < oldest->used))
+      oldest = xi;
+  }
+  intptr_t imghi = VM_USERLO;
+
+  // We read the image as one run from FILEDATA(ino), which holds
+  // only if any further 4MB areas it continues in follow on in turn.
+  int s;
+  for (s = fd->ino; files->fi[s].next != 0; s = files->fi[s].next)
+    if (files->fi[s].next != s + 1) {
+      warn("exec_readelf: executable file not contiguous");
+      goto err;
+    }
 
   // Make sure it looks like an ELF image.
   elfhdr *eh = imgdata;
@@ -100,17 +156,7 @@ exec_readelf(const char *path)
       goto err;
     }
 
-    // Map all pages the segment touches in our scratch region.
-    // They've already been zeroed by the SYS_ZERO above.
-    intptr_t scratchofs = VM_SCRATCHLO - VM_USERLO;
-    intptr_t pagelo = ROUNDDOWN(valo, PAGESIZE);
-    intptr_t pagehi = ROUNDUP(vahi, PAGESIZE);
-    sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
-      (void*)pagelo + scratchofs, pagehi - pagelo);
-
-    // Initialize the file-loaded part of the ELF image.
-    // (We could use copy-on-write if SYS_COPY
-    // supports copying at arbitrary page boundaries.)
+    // Find the file-loaded part of the segment.
     intptr_t filelo = ph->p_offset;
     intptr_t filehi = filelo + ph->p_filesz;
     if (filelo < 0 || filelo > imgsize
@@ -118,18 +164,33 @@ exec_readelf(const char *path)
       warn("exec_readelf: loaded section out of bounds");
       goto err;
     }
-    memcpy((void*)valo + scratchofs, imgdata + filelo,
-      filehi - filelo);
+    intptr_t pagelo = ROUNDDOWN(valo, PAGESIZE);
+    intptr_t pagehi = ROUNDUP(vahi, PAGESIZE);
+    intptr_t datahi = valo + (filehi - filelo);
+    imghi = MAX(imghi, pagehi);
 
-    // Finally, remove write permissions on read-only segments.
-    if (!(ph->p_flags & ELF_PROG_FLAG_WRITE))
-      sys_get(SYS_PERM | SYS_READ, 0, NULL, NULL,
-        (void*)pagelo + scratchofs, pagehi - pagelo);
-  }
+    // Pages lying wholly within the file-loaded part get mapped
+    // copy-on-write straight from the file, if it lays them out
+    // at the same page offsets as the segment.
+    // The partial pages at either end get copied by hand.
+    intptr_t cowlo = ROUNDUP(valo, PAGESIZE);
+    intptr_t cowhi = ROUNDDOWN(datahi, PAGESIZE);
+    if (PGOFF(valo) == PGOFF(filelo) && cowlo < cowhi) {
+      sys_put(SYS_COPY, child, NULL, imgdata + filelo + (cowlo - valo),
+        (void*)cowlo, cowhi - cowlo);
+      exec_copypages(child, pagelo, cowlo, valo, datahi, imgdata + filelo);
+      exec_copypages(child, cowhi, ROUNDUP(datahi, PAGESIZE), valo, datahi,
+        imgdata + filelo);
+    } else
+      exec_copypages(child, pagelo, ROUNDUP(datahi, PAGESIZE), valo, datahi,
+        imgdata + filelo);
 
-  // Copy the ELF image into its correct position in child 0.
-  sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
-    (void*)VM_USERLO, EXEMAX);
+    // Finally, set the segment's permissions,
+    // which also fills in the zero pages of its BSS.
+    sys_put(SYS_PERM | SYS_READ |
+      (ph->p_flags & ELF_PROG_FLAG_WRITE ? SYS_WRITE : 0),
+      child, NULL, NULL, (void*)pagelo, pagehi - pagelo);
+  }
 
   // The new program should have the same entrypoint as we do!
   if (eh->e_entry != (intptr_t)start) {
@@ -137,6 +198,24 @@ exec_readelf(const char *path)
     goto err;
   }
 
+  // Keep a copy of the finished image for next time,
+  // in place of the least recently used one -
+  // unless we're about to replace ourselves with it, as for execv().
+  size_t len = imghi - VM_USERLO;
+  if (child != 0 && oldest->ino != 0) {
+    mmap_free(oldest->va, oldest->len);
+    oldest->ino = 0;
+  }
+  if (child != 0 && (oldest->va = mmap_alloc(len)) != NULL) {
+    sys_get(SYS_COPY, child, NULL, (void*)VM_USERLO, oldest->va, len);
+    oldest->ino = fd->ino;
+    oldest->ver = fi->ver;
+    oldest->wseq = fi->wseq;
+    oldest->size = fi->size;
+    oldest->len = len;
+    oldest->used = ++exectick;
+  }
+
   filedesc_close(fd); // Done with the ELF file
   return 0;
 
@@ -145,8 +224,34 @@ err:
   return -1;
 }
 
+// Copy the part of a segment's file data from [lo,hi), found at 'src',
+// that lies within the pages [pagelo,pagehi) of 'child'.
+// The pages go through our scratch area, starting from whatever the child
+// already has on them, in case another segment shares a page at one end.
+static void
+exec_copypages(int child, intptr_t pagelo, intptr_t pagehi,
+    intptr_t lo, intptr_t hi, const void *src)
+{
+  if (pagelo >= pagehi)
+    return;
+  void *scratch = (void*)VM_SCRATCHLO;
+  intptr_t clo = MAX(lo, pagelo), chi = MIN(hi, pagehi);
+  sys_get(SYS_COPY | SYS_PERM | SYS_READ | SYS_WRITE, child, NULL,
+    (void*)pagelo, scratch, pagehi - pagelo);
+  if (clo < chi)
+    memcpy(scratch + (clo - pagelo), src + (clo - lo), chi - clo);
+  sysop ops[2] = {
+    { SYS_PUT | SYS_COPY, child, NULL, scratch, (void*)pagelo,
+      pagehi - pagelo },
+    { SYS_GET | SYS_ZERO, 0, NULL, NULL, scratch, pagehi - pagelo },
+  };
+  sys_batch(ops, 2);
+}
+
+// Give 'child' its stack, holding the argument array 'argv',
+// and return its initial stack pointer.
 intptr_t
-exec_copyargs(char *const argv[])
+exec_copyargs(int child, char *const argv[])
 {
   // Give the process a nice big 4MB, zero-filled stack.
   sys_get(SYS_ZERO | SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL,
@@ -207,8 +312,8 @@ exec_copyargs(char *const argv[])
   mv_esp -= sizeof(int);                    // Room for argc
   *(int *)mv_esp = argc;                    // Copy argc
 
-  // Copy the stack into its correct position in child 0.
-  sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
+  // Copy the stack into its correct position in the child.
+  sys_put(SYS_COPY, child, NULL, (void*)VM_SCRATCHLO,
     (void*)VM_STACKHI-PTSIZE, PTSIZE);
 
   // We eventually return the esp that starts at STACKHI, so
@@ -17,6 +17,7 @@
 #include <inc/syscall.h>
 #include <inc/errno.h>
 #include <inc/mmu.h>
+#include <inc/x86.h>
 
 
 // Although 'files' itself could be a preprocessor symbol like FILES,
@@ -26,23 +27,243 @@
 filestate *const files = FILES;
 
 
+////////// Bitmap functions //////////
+
+// These find the in-use or free entries of the file state's tables
+// a word of 32 entries at a time, see inc/file.h.
+
+int
+bitmap_next(const uint32_t *map, int n, int i)
+{
+	while (i < n) {
+		uint32_t w = map[i/32] >> (i%32);
+		if (w != 0)
+			return MIN(i + bsf(w), n);
+		i = ROUNDDOWN(i, 32) + 32;
+	}
+	return n;
+}
+
+int
+bitmap_nextclear(const uint32_t *map, int n, int i)
+{
+	while (i < n) {
+		uint32_t w = ~map[i/32] >> (i%32);
+		if (w != 0)
+			return MIN(i + bsf(w), n);
+		i = ROUNDDOWN(i, 32) + 32;
+	}
+	return n;
+}
+
+// Set the state of child 'pid' in file state 'fs' to one of PROC_*,
+// keeping the bitmaps of busy and forked children in step.
+// Here rather than in lib/fork.c so that lib/thread.c can use it
+// in programs that supply their own fork(), such as testvm.
+void
+procinfo_setstate(filestate *fs, int pid, int state)
+{
+	assert(pid >= 0 && pid < PROC_CHILDREN);
+	fs->child[pid].state = state;
+	if (state != PROC_FREE)
+		fileino_setbit(fs->cbusy, pid);
+	else
+		fileino_clrbit(fs->cbusy, pid);
+	if (state == PROC_FORKED)
+		fileino_setbit(fs->cforked, pid);
+	else
+		fileino_clrbit(fs->cforked, pid);
+}
+
+
 ////////// File inode functions //////////
 
+// Return the first free inode in 'fs' at or after 'ino',
+// or FILE_INODES if there is none.
+static int
+fileino_nextfree(filestate *fs, int ino)
+{
+	dir_index(fs);		// makes fs->iused[] valid
+	return bitmap_nextclear(fs->iused, FILE_INODES, ino);
+}
+
 // Find and return the index of a currently unused file inode in this process.
 // If no inodes are available, returns -1 and sets errno accordingly.
 int
 fileino_alloc(void)
 {
-	int i;
-	for (i = FILEINO_GENERAL; i < FILE_INODES; i++)
-		if (files->fi[i].de.d_name[0] == 0)
-			return i;
+	int i = fileino_nextfree(files, FILEINO_GENERAL);
+	if (i < FILE_INODES)
+		return i;
 
 	warn("fileino_alloc: no free inodes\n");
 	errno = ENOSPC;
 	return -1;
 }
 
+// Log a positioned write of bytes 'lo' up to 'hi' to file 'ino' in 'fs'.
+// A write that overlaps or abuts the latest one just extends it,
+// under a new sequence number, so sequential writes take one entry;
+// otherwise it replaces the oldest entry, whose number goes in 'wlost'.
+void
+fileino_logwrite(filestate *fs, int ino, off_t lo, off_t hi)
+{
+	fileinode *fi = &fs->fi[ino];
+	filerange *latest = NULL, *oldest = &fi->wr[0];
+	int i;
+	for (i = 0; i < FILE_WRANGES; i++) {
+		filerange *r = &fi->wr[i];
+		if (r->seq == fi->wseq && r->seq != 0)
+			latest = r;
+		if (r->seq < oldest->seq)
+			oldest = r;
+	}
+	if (latest != NULL && lo <= latest->hi && hi >= latest->lo) {
+		latest->lo = MIN(latest->lo, lo);
+		latest->hi = MAX(latest->hi, hi);
+		latest->seq = ++fi->wseq;
+		return;
+	}
+	fi->wlost = MAX(fi->wlost, oldest->seq);
+	oldest->lo = lo;
+	oldest->hi = hi;
+	oldest->seq = ++fi->wseq;
+}
+
+// Copy into 'wr' the logged writes to file 'ino' in 'fs' made after
+// sequence number 'since', and return how many there are,
+// or -1 if some of them have already been dropped from the log.
+int
+fileino_writes(filestate *fs, int ino, int since, filerange *wr)
+{
+	fileinode *fi = &fs->fi[ino];
+	if (fi->wlost > since)
+		return -1;
+	int i, n = 0;
+	for (i = 0; i < FILE_WRANGES; i++)
+		if (fi->wr[i].seq > since)
+			wr[n++] = fi->wr[i];
+	return n;
+}
+
+// Return the inode whose 4MB area holds byte 'ofs' of file 'ino' in 'fs':
+// 'ino' itself for the first 4MB, or the area it borrowed for later bytes.
+// Returns 0 if the file hasn't borrowed enough areas to reach 'ofs'.
+int
+fileino_slot(filestate *fs, int ino, off_t ofs)
+{
+	int n = ofs / FILE_SLOTSIZE;
+	while (n-- > 0 && ino != 0)
+		ino = fs->fi[ino].next;
+	return ino;
+}
+
+// Make sure file 'ino' in 'fs' has enough 4MB areas to hold 'size' bytes,
+// borrowing the areas of free inodes, preferably each one right after
+// the last so that the file stays contiguous in the address space.
+// On failure, returns -1 and sets errno, leaving the file's areas unchanged.
+int
+fileino_extend(filestate *fs, int ino, size_t size)
+{
+	int need = FILE_NSLOTS(size) - 1, last = ino, i;
+	while (need > 0 && fs->fi[last].next != 0) {
+		last = fs->fi[last].next;
+		need--;
+	}
+	if (need == 0)
+		return 0;
+	if (ino < FILEINO_GENERAL || size > FILE_MAXSIZE) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	// Make sure there are enough free areas first,
+	// so we fail without borrowing any.
+	int nfree = 0;
+	for (i = fileino_nextfree(fs, FILEINO_GENERAL);
+			i < FILE_INODES && nfree < need;
+			i = fileino_nextfree(fs, i + 1))
+		nfree++;
+	if (nfree < need) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	while (need-- > 0) {
+		int s = last + 1;
+		if (s >= FILE_INODES || !fileino_isfree(fs, s))
+			s = fileino_nextfree(fs, FILEINO_GENERAL);
+		assert(s < FILE_INODES);
+		fs->fi[s].extof = ino;
+		fs->fi[s].next = 0;
+		fileino_setbit(fs->iused, s);
+		fs->fi[last].next = s;
+		last = s;
+	}
+	return 0;
+}
+
+// Return the 4MB areas file 'ino' in 'fs' doesn't need for 'size' bytes.
+// The caller should first zero their contents, found via fileino_slot(),
+// so that the next file to use each one starts out empty.
+void
+fileino_shrink(filestate *fs, int ino, size_t size)
+{
+	int last = fileino_slot(fs, ino, (FILE_NSLOTS(size) - 1) * FILE_SLOTSIZE);
+	assert(last != 0);
+	int s = fs->fi[last].next;
+	fs->fi[last].next = 0;
+	while (s != 0) {
+		int next = fs->fi[s].next;
+		assert(fs->fi[s].extof == ino);
+		fs->fi[s].extof = fs->fi[s].next = 0;
+		fileino_clrbit(fs->iused, s);
+		s = next;
+	}
+}
+
+// Copy 'len' bytes between 'buf' and file 'ino' starting at offset 'ofs',
+// directly in each of the 4MB areas the byte range touches:
+// into the file if 'write' is true, or out of it otherwise.
+// A NULL 'buf' with 'write' true zero-fills the range instead.
+static void
+fileino_copy(int ino, off_t ofs, void *buf, size_t len, bool write)
+{
+	int s = fileino_slot(files, ino, ofs);
+	while (len > 0) {
+		assert(s != 0);
+		size_t o = ofs % FILE_SLOTSIZE;
+		size_t n = MIN(len, FILE_SLOTSIZE - o);
+		if (!write)
+			memcpy(buf, FILEDATA(s) + o, n);
+		else if (buf != NULL)
+			memcpy(FILEDATA(s) + o, buf, n);
+		else
+			memset(FILEDATA(s) + o, 0, n);
+		if (buf != NULL)
+			buf += n;
+		ofs += n;
+		len -= n;
+		s = files->fi[s].next;
+	}
+}
+
+// Set the page permissions of bytes 'lo' through 'hi' of file 'ino',
+// both page-aligned, in each of the 4MB areas the range touches.
+static void
+fileino_perm(int ino, off_t lo, off_t hi, int perm)
+{
+	int s = fileino_slot(files, ino, lo);
+	while (lo < hi) {
+		assert(s != 0);
+		size_t o = lo % FILE_SLOTSIZE;
+		size_t n = MIN(hi - lo, FILE_SLOTSIZE - o);
+		sys_get(SYS_PERM | perm, 0, NULL, NULL, FILEDATA(s) + o, n);
+		lo += n;
+		s = files->fi[s].next;
+	}
+}
+
 // Find or create an inode with a given parent directory inode and filename.
 // Returns the index of the inode found or created.
 // A newly-created inode is left in the "deleted" state, with mode == 0.
@@ -55,19 +276,20 @@ fileino_create(filestate *fs, int dino, const char *name)
 	assert(strlen(name) <= NAME_MAX);
 
 	// First see if an inode already exists for this directory and name.
-	int i;
-	for (i = FILEINO_GENERAL; i < FILE_INODES; i++)
-		if (fs->fi[i].dino == dino
-				&& strcmp(fs->fi[i].de.d_name, name) == 0)
-			return i;
+	int i = dir_lookup(fs, dino, name, strlen(name));
+	if (i >= FILEINO_GENERAL)
+		return i;
 
 	// No inode allocated to this name - find a free one to allocate.
-	for (i = FILEINO_GENERAL; i < FILE_INODES; i++)
-		if (fs->fi[i].de.d_name[0] == 0) {
-			fs->fi[i].dino = dino;
-			strcpy(fs->fi[i].de.d_name, name);
-			return i;
-		}
+	i = fileino_nextfree(fs, FILEINO_GENERAL);
+	if (i < FILE_INODES) {
+		fs->fi[i].dino = dino;
+		fs->fi[i].released = 0;
+		strcpy(fs->fi[i].de.d_name, name);
+		dir_link(fs, i);
+		fileino_dirty(fs, i);
+		return i;
+	}
 
 	warn("fileino_create: no free inodes\n");
 	errno = ENOSPC;
@@ -106,15 +328,13 @@ fileino_read(int ino, off_t ofs, void *buf, size_t eltsize, size_t count)
 		}
 	}
 
-	// Get start pointer
-	void *place = FILEDATA(ino) + ofs;
 	int bytes_left = fi->size - ofs;
 	int bytes_to_read = eltsize*count;
 
 	// Find the limiting factor: file size or things to read
 	int limit = bytes_to_read < bytes_left ? bytes_to_read : bytes_left;
-	// Copy data over
-	memcpy(buf, place, limit);
+	// Copy data over, straight from each 4MB area the range touches
+	fileino_copy(ino, ofs, buf, limit, 0);
 	// cprintf("fileino_read: limit: %d, read: %d", limit, limit/eltsize);
 	return limit/eltsize;
 }
@@ -125,10 +345,11 @@ fileino_read(int ino, off_t ofs, void *buf, size_t eltsize, size_t count)
 // which should always be equal to the 'count' input parameter
 // unless an error occurs, in which case this function
 // returns -1 and sets errno appropriately.
-// Since PIOS files can be up to only FILE_MAXSIZE bytes in size (4MB),
+// Since PIOS files can be up to only FILE_MAXSIZE bytes in size,
 // one particular reason an error might occur is if an application
 // tries to grow a file beyond this maximum file size,
-// in which case this function generates the EFBIG error.
+// in which case this function generates the EFBIG error;
+// growing beyond 4MB also fails with ENOSPC if no free inode areas remain.
 ssize_t
 fileino_write(int ino, off_t ofs, const void *buf, size_t eltsize, size_t count)
 {
@@ -150,14 +371,19 @@ fileino_write(int ino, off_t ofs, const void *buf, size_t eltsize, size_t count)
 	}
 	// File is growing
 	if(end > fi->size) {
+		// Borrow more 4MB areas if it no longer fits in those it has
+		if (fileino_extend(files, ino, end) < 0) {
+			warn("fileino_write: file ino %d can't grow to %d\n",
+				ino, end);
+			return -1;
+		}
 		// see if it crosses a page boundary
 		int oldsize = ROUNDUP(fi->size, PAGESIZE);
 		int newsize = ROUNDUP(end, PAGESIZE);
 		if(newsize > oldsize) {
 			// cprintf("fileino_write: growing from %d to %d\n", oldsize, newsize);
 			// Set the new page permissions appropriately
-			sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
-				FILEDATA(ino) + oldsize, newsize-oldsize);
+			fileino_perm(ino, oldsize, newsize, SYS_READ | SYS_WRITE);
 		}
 		fi->size = end;
 	}
@@ -165,10 +391,99 @@ fileino_write(int ino, off_t ofs, const void *buf, size_t eltsize, size_t count)
 	// cprintf("fileino_write: copying %d bytes from %x to %x\n", 
 	// 	bytes_to_write, FILEDATA(ino) + ofs, buf);
 	// Copy data over, this time from the buffer into the file.
-	memcpy(FILEDATA(ino) + ofs, buf, bytes_to_write);
+	fileino_copy(ino, ofs, (void*)buf, bytes_to_write, 1);
+	fileino_dirty(files, ino);
 	return count;
 }
 
+// Copy 'len' bytes between two files by hand, straight from the source's
+// 4MB areas into the destination's, which must already be big enough.
+static void
+fileino_xcopy(int dst, off_t dofs, int src, off_t sofs, size_t len)
+{
+	int s = fileino_slot(files, src, sofs);
+	while (len > 0) {
+		assert(s != 0);
+		size_t o = sofs % FILE_SLOTSIZE;
+		size_t n = MIN(len, FILE_SLOTSIZE - o);
+		fileino_copy(dst, dofs, FILEDATA(s) + o, n, 1);
+		sofs += n, dofs += n, len -= n;
+		s = files->fi[s].next;
+	}
+}
+
+// Copy 'len' bytes of file 'src' starting at offset 'sofs'
+// to file 'dst' starting at offset 'dofs', growing 'dst' as necessary.
+// Where both offsets share a page offset, the whole pages in between
+// are copied virtually, copy-on-write, and whole 4MB areas at once
+// when both sides are 4MB-aligned (so cp's copies take constant time);
+// only the partial pages at either end get copied by hand.
+// Returns 'len' on success, or -1 with errno set as for fileino_write().
+ssize_t
+fileino_xfer(int dst, off_t dofs, int src, off_t sofs, size_t len)
+{
+	assert(fileino_isreg(dst) && fileino_isreg(src) && dst != src);
+	assert(dofs >= 0 && sofs >= 0);
+	assert(sofs + len <= files->fi[src].size);
+
+	// Grow the destination first, so only data remains to move.
+	fileinode *fi = &files->fi[dst];
+	off_t end = dofs + len;
+	if (end < dofs || end > FILE_MAXSIZE) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (end > fi->size) {
+		if (fileino_extend(files, dst, end) < 0)
+			return -1;
+		fileino_perm(dst, ROUNDUP(fi->size, PAGESIZE),
+			ROUNDUP(end, PAGESIZE), SYS_READ | SYS_WRITE);
+		fi->size = end;
+	}
+	fileino_dirty(files, dst);
+
+	off_t lo = 0, hi = 0;	// Part of the source to copy virtually
+	if (PGOFF(sofs) == PGOFF(dofs)) {
+		lo = ROUNDUP(sofs, PAGESIZE);
+		hi = MAX(lo, ROUNDDOWN(sofs + len, PAGESIZE));
+	}
+	if (lo >= hi) {		// Nothing to share: just copy by hand.
+		fileino_xcopy(dst, dofs, src, sofs, len);
+		return len;
+	}
+
+	// Copy the partial pages at either end.
+	fileino_xcopy(dst, dofs, src, sofs, lo - sofs);
+	fileino_xcopy(dst, dofs + (hi - sofs), src, hi, sofs + len - hi);
+
+	// SYS_COPY only copies between address spaces,
+	// so bounce the pages through child 0, as exec() does,
+	// in pieces that each lie within one 4MB area on both sides.
+	off_t d = dofs + (lo - sofs);
+	int ss = fileino_slot(files, src, lo);
+	int ds = fileino_slot(files, dst, d);
+	while (lo < hi) {
+		size_t so = lo % FILE_SLOTSIZE, dso = d % FILE_SLOTSIZE;
+		size_t n = MIN(hi - lo,
+			MIN(FILE_SLOTSIZE - so, FILE_SLOTSIZE - dso));
+		sysop ops[3] = {
+			{ SYS_PUT | SYS_COPY, 0, NULL, FILEDATA(ss) + so,
+				FILEDATA(ds) + dso, n },
+			{ SYS_GET | SYS_COPY, 0, NULL, FILEDATA(ds) + dso,
+				FILEDATA(ds) + dso, n },
+			{ SYS_PUT | SYS_ZERO, 0, NULL, NULL,
+				FILEDATA(ds) + dso, n },
+		};
+		sys_batch(ops, 3);
+		lo += n, d += n;
+		if (so + n == FILE_SLOTSIZE)
+			ss = files->fi[ss].next;
+		if (dso + n == FILE_SLOTSIZE)
+			ds = files->fi[ds].next;
+	}
+	return len;
+}
+
 // Return file statistics about a particular inode.
 // The specified inode must indicate a file that exists,
 // but it can be any type of object: e.g., file, directory, special file, etc.
@@ -193,44 +508,139 @@ int
 fileino_truncate(int ino, off_t newsize)
 {
 	assert(fileino_isvalid(ino));
-	assert(newsize >= 0 && newsize <= FILE_MAXSIZE);
+	if (newsize < 0 || newsize > FILE_MAXSIZE) {
+		errno = EFBIG;
+		return -1;
+	}
 
 	size_t oldsize = files->fi[ino].size;
 	size_t oldpagelim = ROUNDUP(files->fi[ino].size, PAGESIZE);
 	size_t newpagelim = ROUNDUP(newsize, PAGESIZE);
 	if (newsize > oldsize) {
 		// Grow the file and fill the new space with zeros.
-		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
-			FILEDATA(ino) + oldpagelim,
-			newpagelim - oldpagelim);
-		memset(FILEDATA(ino) + oldsize, 0, newsize - oldsize);
-	} else if (newsize > 0) {
-		// Shrink the file, but not all the way to empty.
-		// Would prefer to use SYS_ZERO to free the file content,
-		// but SYS_ZERO isn't guaranteed to work at page granularity.
-		sys_get(SYS_PERM, 0, NULL, NULL,
-			FILEDATA(ino) + newpagelim, FILE_MAXSIZE - newpagelim);
+		if (fileino_extend(files, ino, newsize) < 0)
+			return -1;
+		fileino_perm(ino, oldpagelim, newpagelim,
+				SYS_READ | SYS_WRITE);
+		fileino_copy(ino, oldsize, NULL, newsize - oldsize, 1);
 	} else {
-		// Shrink the file to empty.  Use SYS_ZERO to free completely.
-		sys_get(SYS_ZERO, 0, NULL, NULL, FILEDATA(ino), FILE_MAXSIZE);
+		// Free whole 4MB areas the file no longer needs with SYS_ZERO.
+		int s = fileino_slot(files, ino,
+				FILE_NSLOTS(newsize) * FILE_SLOTSIZE);
+		for (; s != 0; s = files->fi[s].next)
+			sys_get(SYS_ZERO, 0, NULL, NULL, FILEDATA(s),
+				FILE_SLOTSIZE);
+		fileino_shrink(files, ino, newsize);
+		if (newsize > 0) {
+			// Shrink the file, but not all the way to empty.
+			// Would prefer to use SYS_ZERO to free the file content,
+			// but SYS_ZERO isn't guaranteed to work at page granularity.
+			s = fileino_slot(files, ino, newsize - 1);
+			size_t lim = ROUNDUP(newsize, FILE_SLOTSIZE);
+			sys_get(SYS_PERM, 0, NULL, NULL,
+				FILEDATA(s) + newpagelim % FILE_SLOTSIZE,
+				lim - newpagelim);
+		} else {
+			// Shrink the file to empty.  Use SYS_ZERO to free completely.
+			sys_get(SYS_ZERO, 0, NULL, NULL, FILEDATA(ino),
+				FILE_SLOTSIZE);
+		}
 	}
 	files->fi[ino].size = newsize;
+	files->fi[ino].released = ROUNDDOWN(MIN(files->fi[ino].released,
+						newsize), PAGESIZE);
 	files->fi[ino].ver++;	// truncation is always an exclusive change
+	fileino_dirty(files, ino);
 	return 0;
 }
 
 // Flush any outstanding writes on this file to our parent process.
+// The root's console output needs no flush: the kernel prints it
+// asynchronously, so the root only traps when it must wait for input.
+// A root with a disk traps for any change the disk doesn't have yet,
+// which the kernel notes by bringing rver up to date (see kern/disk.c).
 // (XXX should flushes propagate across multiple levels?)
 int
 fileino_flush(int ino)
 {
 	assert(fileino_isvalid(ino));
 
-	if (files->fi[ino].size > files->fi[ino].rlen)
+	if (ino == FILEINO_CONSOUT && files->consasync)
+		return 0;
+	fileinode *fi = &files->fi[ino];
+	if (fi->size > fi->rlen || (files->diskasync && fi->ver != fi->rver))
 		sys_ret();	// synchronize and reconcile with parent
 	return 0;
 }
 
+// Free the pages of partial file 'ino' wholly below offset 'ofs',
+// which a pipe's writer has already passed on to its parent
+// or its reader has already consumed (see waitpipe() in lib/fork.c),
+// so that streaming data doesn't pile up in the processes along a pipe.
+// The released pages read as zeros from then on,
+// and reconciliation doesn't bother copying anything new into them;
+// an 'ofs' of FILE_MAXSIZE drops a pipe this process has no use for.
+void
+fileino_release(int ino, off_t ofs)
+{
+	assert(fileino_isreg(ino));
+	fileinode *fi = &files->fi[ino];
+	if (ino < FILEINO_GENERAL || !(fi->mode & S_IFPART))
+		return;
+
+	ofs = ROUNDDOWN(ofs, PAGESIZE);
+	off_t lo = fi->released;
+	off_t hi = MIN(ofs, (off_t)ROUNDUP(fi->size, PAGESIZE));
+	while (lo < hi) {
+		int s = fileino_slot(files, ino, lo);
+		off_t lim = MIN(hi, ROUNDDOWN(lo, FILE_SLOTSIZE) + FILE_SLOTSIZE);
+		sys_get(SYS_ZERO | SYS_PERM | SYS_RW, 0, NULL, NULL,
+			FILEDATA(s) + lo % FILE_SLOTSIZE, lim - lo);
+		lo = lim;
+	}
+	fi->released = MAX((off_t)fi->released, ofs);
+}
+
+// Return a direct pointer to bytes 'ofs' through 'ofs+len' of file 'ino',
+// for mmap(): the file's data already lives in our address space,
+// but only in one piece if its 4MB areas happen to lie contiguously.
+// If 'grow' is true, first extends the file to cover the whole range,
+// logging the growth as a positioned write so it reconciles like one.
+// Returns NULL and sets errno if the file can't grow or isn't contiguous.
+void *
+fileino_map(int ino, off_t ofs, size_t len, bool grow)
+{
+	assert(fileino_isreg(ino));
+	assert(ofs >= 0);
+	fileinode *fi = &files->fi[ino];
+
+	off_t end = ofs + len;
+	if (end < ofs || end > FILE_MAXSIZE) {
+		errno = EFBIG;
+		return NULL;
+	}
+	if (grow && end > fi->size) {
+		if (fileino_extend(files, ino, end) < 0)
+			return NULL;
+		fileino_perm(ino, ROUNDUP(fi->size, PAGESIZE),
+			ROUNDUP(end, PAGESIZE), SYS_READ | SYS_WRITE);
+		fileino_logwrite(files, ino, fi->size, end);
+		fi->size = end;
+		fileino_dirty(files, ino);
+	}
+
+	// fileino_extend() prefers contiguous areas, so this usually works.
+	void *va = FILEDATA(fileino_slot(files, ino, ofs)) + ofs % FILE_SLOTSIZE;
+	off_t o;
+	for (o = ROUNDDOWN(ofs, FILE_SLOTSIZE) + FILE_SLOTSIZE; o < end;
+			o += FILE_SLOTSIZE)
+		if (FILEDATA(fileino_slot(files, ino, o)) != va + (o - ofs)) {
+			errno = EINVAL;
+			return NULL;
+		}
+	return va;
+}
+
 
 ////////// File descriptor functions //////////
 
@@ -240,14 +650,26 @@ fileino_flush(int ino)
 // returns NULL and set errno appropriately.
 filedesc *filedesc_alloc(void)
 {
-	int i;
-	for (i = 0; i < OPEN_MAX; i++)
-		if (files->fd[i].ino == FILEINO_NULL)
-			return &files->fd[i];
+	int i = bitmap_nextclear(files->fdopen, OPEN_MAX, 0);
+	if (i < OPEN_MAX)
+		return &files->fd[i];
 	errno = EMFILE;
 	return NULL;
 }
 
+// Point file descriptor 'fd' at inode 'ino', or mark it free with
+// FILEINO_NULL, keeping files->fdopen[] in step.
+void
+filedesc_setino(filedesc *fd, int ino)
+{
+	assert(filedesc_isvalid(fd));
+	fd->ino = ino;
+	if (ino != FILEINO_NULL)
+		fileino_setbit(files->fdopen, fd - files->fd);
+	else
+		fileino_clrbit(files->fdopen, fd - files->fd);
+}
+
 
 // Find or create and open a file, optionally using a given file descriptor.
 // The argument 'fd' must point to a currently unused file descriptor,
@@ -292,7 +714,7 @@ filedesc_open(filedesc *fd, const char *path, int openflags, mode_t mode)
 	}
 
 	// Initialize the file descriptor
-	fd->ino = ino;
+	filedesc_setino(fd, ino);
 	fd->flags = openflags;
 	fd->ofs = (openflags & O_APPEND) ? files->fi[ino].size : 0;
 	fd->err = 0;
@@ -301,7 +723,7 @@ filedesc_open(filedesc *fd, const char *path, int openflags, mode_t mode)
         // If its a symlink and not on creation
         char buf[PATH_MAX];
         filedesc_read(fd, &buf, 1, PATH_MAX);
-        fd->ino = FILEINO_NULL; // We aren't using this ino anymore
+        filedesc_setino(fd, FILEINO_NULL); // We aren't using this ino anymore
         return filedesc_open(NULL, buf, openflags, mode);
     }
 
@@ -336,6 +758,10 @@ filedesc_read(filedesc *fd, void *buf, size_t eltsize, size_t count)
 	fd->ofs += eltsize * actual;
 	assert(actual == 0 || fi->size >= fd->ofs);
 
+	// A pipe's reader drops the data it has consumed.
+	if (fi->mode & S_IFPART)
+		fileino_release(fd->ino, fd->ofs);
+
 	return actual;
 }
 
@@ -362,15 +788,64 @@ filedesc_write(filedesc *fd, const void *buf, size_t eltsize, size_t count)
 	}
 	assert(actual == count);
 
-	// Non-append-only writes constitute exclusive modifications,
-	// so must bump the file's version number.
-	if (!(fd->flags & O_APPEND))
-		fi->ver++;
+	// Non-append-only writes get logged instead of bumping the version,
+	// so reconcile_merge() can merge them with writes to other ranges.
+	if (!(fd->flags & O_APPEND) && count > 0)
+		fileino_logwrite(files, fd->ino, fd->ofs,
+				fd->ofs + eltsize * count);
 
 	// Advance the file position
 	fd->ofs += eltsize * count;
 	assert(fi->size >= fd->ofs);
 
+	// A pipe's writer hands each pipe-buffer-full on to the relay
+	// in its parent (see waitpipe() in lib/fork.c), then drops it.
+	if ((fi->mode & S_IFPART) && fd->ino >= FILEINO_GENERAL
+			&& fi->size - fi->rlen >= FILE_PIPEBUF) {
+		sys_ret();
+		fileino_release(fd->ino, fi->rlen);
+	}
+
+	return count;
+}
+
+// Copy up to 'count' bytes from the open file 'in' to the open file 'out'
+// as filedesc_write() would, but straight from one file to the other,
+// copy-on-write wherever the two files' positions allow (see fileino_xfer()).
+// Reads 'in' from '*offset' and advances that if 'offset' is non-NULL,
+// or else reads from and advances in's own file position.
+// Returns the number of bytes copied, which is short only at end of file,
+// or returns -1 and sets errno appropriately on error.
+ssize_t
+filedesc_sendfile(filedesc *out, filedesc *in, off_t *offset, size_t count)
+{
+	assert(filedesc_iswritable(out));
+	assert(filedesc_isreadable(in));
+	if (!fileino_isreg(out->ino) || !fileino_isreg(in->ino)
+			|| out->ino == in->ino) {
+		errno = out->err = EINVAL;
+		return -1;
+	}
+	off_t ofs = offset != NULL ? *offset : in->ofs;
+	size_t size = files->fi[in->ino].size;
+	count = ofs < size ? MIN(count, size - ofs) : 0;
+
+	// If we're appending to the file, seek to the end first.
+	if (out->flags & O_APPEND)
+		out->ofs = files->fi[out->ino].size;
+	if (count > 0 && fileino_xfer(out->ino, out->ofs, in->ino, ofs, count) < 0) {
+		out->err = errno;
+		return -1;
+	}
+	if (!(out->flags & O_APPEND) && count > 0)
+		fileino_logwrite(files, out->ino, out->ofs, out->ofs + count);
+
+	// Advance the file positions
+	out->ofs += count;
+	if (offset != NULL)
+		*offset += count;
+	else
+		in->ofs += count;
 	return count;
 }
 
@@ -409,6 +884,7 @@ filedesc_close(filedesc *fd)
 	assert(filedesc_isopen(fd));
 	assert(fileino_isvalid(fd->ino));
 
-	fd->ino = FILEINO_NULL;		// mark the fd free
+	stdio_close(fd);		// any stdio buffering goes first
+	filedesc_setino(fd, FILEINO_NULL);	// mark the fd free
 }
 
@@ -25,26 +25,92 @@
 bool reconcile(pid_t pid, filestate *cfiles);
 bool reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino);
 bool reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino);
+extern void start(void);
+int exec_readelf(int child, const char *path);
+intptr_t exec_copyargs(int child, char *const argv[]);
+static pid_t waitpoll(pid_t pid, int *status);
+
+// Gets and puts queued up by waitpid() and reconciliation,
+// to be issued together in one sys_batch() call.
+#define BATCHMAX  16
+static sysop batch[BATCHMAX];
+static int nbatch;
+
+static void
+batchflush(void)
+{
+  if (nbatch > 0)
+    sys_batch(batch, nbatch);
+  nbatch = 0;
+}
 
-pid_t fork(void)
+static void
+batchop(uint32_t cmd, pid_t pid, procstate *save,
+    void *src, void *dest, size_t size)
+{
+  if (nbatch == BATCHMAX)
+    batchflush();
+  sysop *op = &batch[nbatch++];
+  op->cmd = cmd;
+  op->child = pid;
+  op->save = save;
+  op->src = src;
+  op->dest = dest;
+  op->size = size;
+}
+
+// Find a free child process slot.
+// We just use child process slot numbers as Unix PIDs,
+// even though child slots are process-local in PIOS
+// whereas PIDs are global in Unix.
+// This means that commands like 'ps' and 'kill'
+// have to be shell-builtin commands under PIOS.
+static pid_t
+forkslot(const char *who)
+{
+  pid_t pid = bitmap_nextclear(files->cbusy, PROC_CHILDREN, 1);
+  if (pid < PROC_CHILDREN)
+    return pid;
+  warn("%s: no child process available", who);
+  errno = EAGAIN;
+  return -1;
+}
+
+// Set up the file state 'fs' of a new child as a copy of ours,
+// in sync with us as of now and with no children of its own yet.
+static void
+forkfiles(filestate *fs)
 {
   int i;
+  memset(&fs->child, 0, sizeof(fs->child));
+  memset(fs->cbusy, 0, sizeof(fs->cbusy));
+  memset(fs->cforked, 0, sizeof(fs->cforked));
+  procinfo_setstate(fs, 0, PROC_RESERVED);
+  fs->consasync = 0;   // our output goes through our parent
+  fs->diskasync = 0;
+  memset(fs->dirty, 0, sizeof(fs->dirty));  // in sync as of now
+  memset(fs->cdirty, 0, sizeof(fs->cdirty));
+  dir_index(fs);
+  for (i = bitmap_next(fs->iused, FILE_INODES, 1); i < FILE_INODES;
+      i = bitmap_next(fs->iused, FILE_INODES, i + 1)) {
+    fileinode *fi = &fs->fi[i];
+    if (fi->de.d_name[0] != 0) {
+      fi->rino = i;  // 1-to-1 mapping
+      fi->rver = fi->ver;
+      fi->rlen = fi->size;
+      fi->wsync = fi->pwseq = fi->wseq;
+    }
+  }
+}
+
+pid_t fork(void)
+{
+  // Don't let the child inherit our stdio buffers' contents.
+  stdio_sync();
 
-  // Find a free child process slot.
-  // We just use child process slot numbers as Unix PIDs,
-  // even though child slots are process-local in PIOS
-  // whereas PIDs are global in Unix.
-  // This means that commands like 'ps' and 'kill'
-  // have to be shell-builtin commands under PIOS.
-  pid_t pid;
-  for (pid = 1; pid < 256; pid++)
-    if (files->child[pid].state == PROC_FREE)
-      break;
-  if (pid == 256) {
-    warn("fork: no child process available");
-    errno = EAGAIN;
+  pid_t pid = forkslot("fork");
+  if (pid < 0)
     return -1;
-  }
 
   // Set up the register state for the child
   struct procstate ps;
@@ -70,30 +136,145 @@ pid_t fork(void)
     :
     : "ebx", "ecx", "edx");
   if (!isparent) {
-    // Clear our child state array, since we have no children yet.
-    memset(&files->child, 0, sizeof(files->child));
-    files->child[0].state = PROC_RESERVED;
-    for (i = 1; i < FILE_INODES; i++) {
-      if (fileino_alloced(i)) {
-        files->fi[i].rino = i;  // 1-to-1 mapping
-        files->fi[i].rver = files->fi[i].ver;
-        files->fi[i].rlen = files->fi[i].size;
-      }
-    }
+    forkfiles(files);
     return 0; // indicate that we're the child.
   }
 
-  // Copy our entire user address space into the child and start it.
+  // Copy our entire user address space into the child and start it,
+  // counting its performance events afresh.
   ps.tf.regs.eax = 0; // isparent == 0 in the child
-  sys_put(SYS_REGS | SYS_COPY | SYS_START, pid, &ps,
+  sys_put(SYS_REGS | SYS_COPY | SYS_PMC | SYS_START, pid, &ps,
     ALLVA, ALLVA, ALLSIZE);
 
   // Record the inode generation numbers of all inodes at fork time,
   // so that we can reconcile them later when we synchronize with it.
   memset(&files->child[pid], 0, sizeof(files->child[pid]));
-  files->child[pid].state = PROC_FORKED;
+  procinfo_setstate(files, pid, PROC_FORKED);
+
+  return pid;
+}
+
+// Create a child running the program at 'path' with arguments 'argv',
+// as fork() followed by execv() in the child would, but building the
+// child from scratch: it gets only the new program image, its stack,
+// and a copy-on-write copy of our file state, instead of a copy of
+// our whole address space that execv() would throw away right after.
+// Returns the child's pid for waitpid(), or -1 on error.
+pid_t
+spawnl(const char *path, const char *arg0, ...)
+{
+  return spawnv(path, (char *const *) &arg0);
+}
 
+pid_t
+spawnv(const char *path, char *const argv[])
+{
+  stdio_sync();   // the child sees our output so far in its files
+
+  pid_t pid = forkslot("spawn");
+  if (pid < 0)
+    return -1;
+
+  // Load the program and its arguments straight into the child.
+  sys_put(SYS_ZERO, pid, NULL, NULL, ALLVA, ALLSIZE);
+  intptr_t esp;
+  if (exec_readelf(pid, path) < 0)
+    goto err;
+  esp = exec_copyargs(pid, argv);
+
+  // Give the child our file state, and our files copy-on-write,
+  // then fix up its metadata as a forked child would for itself,
+  // bouncing it through our scratch area.
+  size_t fsize = ROUNDUP(sizeof(filestate), PAGESIZE);
+  sys_put(SYS_COPY, pid, NULL, (void*)VM_FILELO, (void*)VM_FILELO,
+    VM_FILEHI-VM_FILELO);
+  sys_get(SYS_COPY, pid, NULL, (void*)FILESVA, (void*)VM_SCRATCHLO, fsize);
+  forkfiles((filestate*)VM_SCRATCHLO);
+  sysop ops[2] = {
+    { SYS_PUT | SYS_COPY, pid, NULL, (void*)VM_SCRATCHLO, (void*)FILESVA,
+      fsize },
+    { SYS_GET | SYS_ZERO, 0, NULL, NULL, (void*)VM_SCRATCHLO, fsize },
+  };
+  sys_batch(ops, 2);
+
+  // Start the new program from its entrypoint, which is also ours.
+  struct procstate ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.tf.eip = (intptr_t)start;
+  ps.tf.esp = esp;
+  sys_put(SYS_REGS | SYS_PMC | SYS_START, pid, &ps, NULL, NULL, 0);
+
+  memset(&files->child[pid], 0, sizeof(files->child[pid]));
+  procinfo_setstate(files, pid, PROC_FORKED);
   return pid;
+
+err:
+  sys_put(SYS_ZERO, pid, NULL, NULL, ALLVA, ALLSIZE);
+  return -1;
+}
+
+// Checkpoint forked child 'pid', once it next stops, along with all
+// the processes it has forked: the kernel clones the whole subtree
+// into a spare child slot, sharing every page copy-on-write.
+// The child's own children must all have stopped too.
+// Returns the slot holding the checkpoint, for ckpt_restore(),
+// or -1 on error.
+pid_t
+ckpt_save(pid_t pid)
+{
+  assert(pid > 0 && pid < 256);
+  if (files->child[pid].state != PROC_FORKED) {
+    errno = ECHILD;
+    return -1;
+  }
+  pid_t ckpt = forkslot("ckpt_save");
+  if (ckpt < 0)
+    return -1;
+
+  batchflush();   // anything still queued for the child goes in first
+  sys_put(SYS_CLONE, SYS_CLONESRC(pid) | ckpt, NULL, NULL, NULL, 0);
+  files->child[ckpt] = files->child[pid];
+  procinfo_setstate(files, ckpt, PROC_CKPT);
+  return ckpt;
+}
+
+// Start a new child from checkpoint 'ckpt', as another clone of it.
+// The new child carries on from where the checkpointed one stopped,
+// so waitpid() picks it up just as it would have that one;
+// the checkpoint stays for further restores.
+// Returns the new child's pid, or -1 on error.
+pid_t
+ckpt_restore(pid_t ckpt)
+{
+  assert(ckpt > 0 && ckpt < 256);
+  if (files->child[ckpt].state != PROC_CKPT) {
+    errno = EINVAL;
+    return -1;
+  }
+  pid_t pid = forkslot("ckpt_restore");
+  if (pid < 0)
+    return -1;
+
+  sys_put(SYS_CLONE, SYS_CLONESRC(ckpt) | pid, NULL, NULL, NULL, 0);
+  files->child[pid] = files->child[ckpt];
+  procinfo_setstate(files, pid, PROC_FORKED);
+
+  // Our inodes' changes since the checkpoint weren't tracked for it,
+  // so have the next reconcile() look at all of them.
+  memset(files->child[pid].pdirty, 0xff, sizeof(files->child[pid].pdirty));
+  return pid;
+}
+
+// Discard checkpoint 'ckpt', freeing its slot and its processes' memory.
+void
+ckpt_free(pid_t ckpt)
+{
+  assert(ckpt > 0 && ckpt < 256);
+  assert(files->child[ckpt].state == PROC_CKPT);
+  batchop(SYS_PUT | SYS_CLONE, SYS_CLONESRC(ckpt) | ckpt, NULL,
+    NULL, NULL, 0);
+  batchflush();
+  procinfo_setstate(files, ckpt, PROC_FREE);
 }
 
 pid_t
@@ -102,20 +283,33 @@ wait(int *status)
   return waitpid(-1, status, 0);
 }
 
+// Clear out the address space of child 'pid', which has finished.
+static void
+waitdone(pid_t pid)
+{
+  batchop(SYS_PUT | SYS_ZERO, pid, NULL, ALLVA, ALLVA, ALLSIZE);
+  batchflush();
+  procinfo_setstate(files, pid, PROC_FREE);
+}
+
 pid_t
 waitpid(pid_t pid, int *status, int options)
 {
   assert(pid >= -1 && pid < 256);
+  if (options & WNOHANG)
+    return waitpoll(pid, status);
 
   // Find a process to wait for.
-  // Of course for interactive or load-balancing purposes
-  // we would like to have a way to wait for
-  // whichever child process happens to finish first -
-  // that requires a (nondeterministic) kernel API extension.
-  if (pid <= 0)
-    for (pid = 1; pid < 256; pid++)
-      if (files->child[pid].state == PROC_FORKED)
-        break;
+  // For interactive or load-balancing purposes we would like
+  // whichever child process happens to finish first, which SYS_WAIT
+  // gives us if our parent enabled PFF_NONDET for us;
+  // otherwise it deterministically picks the lowest-numbered child.
+  if (pid <= 0) {
+    childset set;
+    memcpy(set.bits, files->cforked, sizeof(set.bits));
+    sys_wait(0, &set);
+    pid = bitmap_next(set.bits, CHILDSET_MAX, 1);
+  }
   if (pid == 256 || files->child[pid].state != PROC_FORKED) {
     errno = ECHILD;
     return -1;
@@ -125,9 +319,12 @@ waitpid(pid_t pid, int *status, int options)
   while (1) {
     // Wait for the child to finish whatever it's doing,
     // and extract its CPU and process/file state.
+    // This goes in the same batch as the puts that restarted the child
+    // the last time around, so each round trip costs just one trap.
     struct procstate ps;
-    sys_get(SYS_COPY | SYS_REGS, pid, &ps,
-      (void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
+    batchop(SYS_GET | SYS_COPY | SYS_REGS, pid, &ps,
+      (void*)FILESVA, (void*)VM_SCRATCHLO, FILE_SYNCSIZE);
+    batchflush();
     filestate *cfiles = (filestate*)VM_SCRATCHLO;
 
     // Did the child take a trap?
@@ -140,9 +337,7 @@ waitpid(pid_t pid, int *status, int options)
         *status = WSIGNALED | ps.tf.trapno;
 
       done:
-      // Clear out the child's address space.
-      sys_put(SYS_ZERO, pid, NULL, ALLVA, ALLVA, ALLSIZE);
-      files->child[pid].state = PROC_FREE;
+      waitdone(pid);
       return pid;
     }
 
@@ -159,55 +354,270 @@ waitpid(pid_t pid, int *status, int options)
     // If the child is waiting for new input
     // and the reconciliation above didn't provide anything new,
     // then wait for something new from OUR parent in turn.
-    if (!didio)
+    if (!didio) {
+      batchflush();   // before our parent changes our files under us
       sys_ret();
+    }
 
     // Reconcile again, to forward any new I/O to the child.
     (void)reconcile(pid, cfiles);
 
     // Push the child's updated file state back into the child.
-    sys_put(SYS_COPY | SYS_START, pid, NULL,
-      (void*)VM_SCRATCHLO, (void*)FILESVA, PTSIZE);
+    batchop(SYS_PUT | SYS_COPY | SYS_START, pid, NULL,
+      (void*)VM_SCRATCHLO, (void*)FILESVA, FILE_SYNCSIZE);
+  }
+}
+
+// Synchronize once with child 'pid' of a pipeline, which has stopped.
+// Returns -1 if the child has finished, filling in *status if non-NULL;
+// 1 if reconciliation passed anything along in either direction,
+// in which case the child is set to restart with the next batch;
+// or 0 if the child is waiting for input nobody has for it yet,
+// in which case it stays stopped until waitpipe() tries it again.
+static int
+pipesync(pid_t pid, int *status)
+{
+  struct procstate ps;
+  batchop(SYS_GET | SYS_COPY | SYS_REGS, pid, &ps,
+    (void*)FILESVA, (void*)VM_SCRATCHLO, FILE_SYNCSIZE);
+  batchflush();
+  filestate *cfiles = (filestate*)VM_SCRATCHLO;
+
+  if (ps.tf.trapno != T_SYSCALL) {
+    warn("child %d took trap %d, eip %x\n",
+      pid, ps.tf.trapno, ps.tf.eip);
+    if (status != NULL)
+      *status = WSIGNALED | ps.tf.trapno;
+    waitdone(pid);
+    return -1;
+  }
+
+  bool didio = reconcile(pid, cfiles);
+  if (cfiles->exited) {
+    if (status != NULL)
+      *status = WEXITED | (cfiles->status & 0xff);
+    waitdone(pid);
+    return -1;
   }
+
+  batchop(SYS_PUT | SYS_COPY | (didio ? SYS_START : 0), pid, NULL,
+    (void*)VM_SCRATCHLO, (void*)FILESVA, FILE_SYNCSIZE);
+  return didio;
+}
+
+// waitpid() with WNOHANG: synchronize once with each of the children
+// it would wait for that has stopped, without waiting for any others,
+// passing along their output and any input we have for them.
+// Returns the first one found to have finished, filling in *status,
+// or 0 if none has yet; the rest keep running, or stay stopped for
+// another try if they are waiting for input nobody has for them yet.
+// Without PFF_NONDET none ever has (see SYS_POLL in inc/syscall.h).
+static pid_t
+waitpoll(pid_t pid, int *status)
+{
+  childset set;
+  memset(&set, 0, sizeof(set));
+  if (pid > 0) {
+    if (files->child[pid].state != PROC_FORKED) {
+      errno = ECHILD;
+      return -1;
+    }
+    childset_add(&set, pid);
+  } else {
+    memcpy(set.bits, files->cforked, sizeof(set.bits));
+    if (bitmap_next(set.bits, CHILDSET_MAX, 1) == CHILDSET_MAX) {
+      errno = ECHILD;
+      return -1;
+    }
+  }
+  sys_waitpoll(0, &set);
+
+  pid_t done = 0;
+  int cn;
+  for (cn = 1; cn < CHILDSET_MAX && done == 0; cn++)
+    if (childset_has(&set, cn) && pipesync(cn, status) < 0)
+      done = cn;
+  batchflush();   // restart the rest
+  return done;
+}
+
+// Relay pipe file 'ino' from forked child 'wpid', which writes it,
+// to forked child 'rpid', which reads it, until both have exited;
+// returns 'rpid' and the reader's exit status, as waitpid() would.
+// The pipe is a partial file (S_IFPART) both children inherited from us.
+// The writer syncs with us every FILE_PIPEBUF bytes (see filedesc_write()),
+// and the reader whenever it has consumed everything it has,
+// so each sync of one child may let us pass something on to the other;
+// a child with nothing to do meanwhile stays stopped rather than spin.
+// When the writer exits we clear S_IFPART, so the reader sees end-of-file.
+// Either child may itself be relaying a longer pipeline in the same way.
+pid_t
+waitpipe(pid_t wpid, pid_t rpid, int ino, int *status)
+{
+  enum { RUN, STALL, RETRY, DONE } st[2] = { RUN, RUN };
+  pid_t pid[2] = { wpid, rpid };
+  size_t has[2][FILE_INODES];  // How much of each pipe each child has
+  memset(has, 0, sizeof(has));
+  assert(fileino_isreg(ino) && (files->fi[ino].mode & S_IFPART));
+  assert(files->child[wpid].state == PROC_FORKED);
+  assert(files->child[rpid].state == PROC_FORKED);
+
+  while (st[0] != DONE || st[1] != DONE) {
+    // Pick a stalled child to try again, else the next running one to stop,
+    // else wait for our own parent to give us something new.
+    int i, r;
+    for (i = 0; i < 2 && st[i] != RETRY; i++)
+      ;
+    if (i == 2) {
+      childset set;
+      memset(&set, 0, sizeof(set));
+      for (i = 0; i < 2; i++)
+        if (st[i] == RUN)
+          childset_add(&set, pid[i]);
+      batchflush();
+      if (st[0] != RUN && st[1] != RUN) {
+        sys_ret();
+        for (i = 0; i < 2; i++)
+          if (st[i] == STALL)
+            st[i] = RETRY;
+        continue;
+      }
+      sys_wait(0, &set);
+      i = childset_has(&set, pid[0]) ? 0 : 1;
+    }
+
+    r = pipesync(pid[i], i == 1 ? status : NULL);
+    st[i] = r < 0 ? DONE : r > 0 ? RUN : STALL;
+    if (r == 0)
+      continue;
+    if (i == 0 && r < 0) {
+      // The writer is done: end the pipe for the reader.
+      files->fi[ino].mode &= ~S_IFPART;
+      fileino_dirty(files, ino);
+    }
+
+    // Drop whatever part of each pipe both children now have,
+    // including our own pipe and any pipe we're reading in turn,
+    // once the copies reconcile() queued up from those pages are done.
+    // The kernel's streams, such as "metrics", are partial files too,
+    // but outlive any pipe: those we leave alone.
+    batchflush();
+    filestate *cfiles = (filestate*)VM_SCRATCHLO;
+    int j;
+    for (j = FILEINO_GENERAL; j < FILE_INODES; j++) {
+      if (!fileino_isreg(j) || !(files->fi[j].mode & S_IFPART)
+          || (files->fi[j].mode & S_IFKERN))
+        continue;
+      int cino = files->child[pid[i]].p2c[j];
+      has[i][j] = r < 0 || cino == 0 ? FILE_MAXSIZE : cfiles->fi[cino].rlen;
+      fileino_release(j, MIN(has[0][j], has[1][j]));
+    }
+
+    // Something moved, which may be what the other child was waiting for;
+    // and pass on any console output the children produced.
+    if (st[!i] == STALL)
+      st[!i] = RETRY;
+    if (files->fi[FILEINO_CONSOUT].size > files->fi[FILEINO_CONSOUT].rlen) {
+      batchflush();
+      fileino_flush(FILEINO_CONSOUT);
+    }
+  }
+  return rpid;
+}
+
+// Pass the inodes we changed since last time on to each forked child's
+// pending set, for reconcile() to look at when the child next syncs.
+static void
+reconcile_fold(void)
+{
+  int pid, i;
+  uint32_t any = 0;
+  for (i = 0; i < FILE_DIRTYWORDS; i++)
+    any |= files->cdirty[i];
+  if (any == 0)
+    return;
+  for (pid = bitmap_next(files->cforked, PROC_CHILDREN, 1);
+      pid < PROC_CHILDREN;
+      pid = bitmap_next(files->cforked, PROC_CHILDREN, pid + 1))
+    for (i = 0; i < FILE_DIRTYWORDS; i++)
+      files->child[pid].pdirty[i] |= files->cdirty[i];
+  memset(files->cdirty, 0, sizeof(files->cdirty));
+}
+
+// Return the parent inode child inode 'cino' is validly mapped to, or 0.
+static int
+reconcile_c2p(procinfo *ci, filestate *cfiles, int cino)
+{
+  int pino = cfiles->fi[cino].rino;
+  if (pino <= 0 || pino >= FILE_INODES || ci->p2c[pino] != cino)
+    return 0;
+  return pino;
 }
 
 // Reconcile our file system state, whose metadata is in 'files',
 // with the file system state of child 'pid', whose metadata is in 'cfiles'.
 // Returns nonzero if any changes were propagated, false otherwise.
+// The parent-to-child inode mapping persists in files->child[pid].p2c,
+// and the child-to-parent mapping in the child's rino fields,
+// so after the first time we only visit inodes that either side changed
+// since the last time, plus the console inodes the kernel appends to.
 bool
 reconcile(pid_t pid, filestate *cfiles)
 {
+  procinfo *ci = &files->child[pid];
   bool didio = 0;
   int i;
 
-  // Compute a parent-to-child and child-to-parent inode mapping table.
-  int p2c[FILE_INODES], c2p[FILE_INODES];
-  memset(p2c, 0, sizeof(p2c)); memset(c2p, 0, sizeof(c2p));
-  p2c[FILEINO_CONSIN] = c2p[FILEINO_CONSIN] = FILEINO_CONSIN;
-  p2c[FILEINO_CONSOUT] = c2p[FILEINO_CONSOUT] = FILEINO_CONSOUT;
-  p2c[FILEINO_ROOTDIR] = c2p[FILEINO_ROOTDIR] = FILEINO_ROOTDIR;
+  // Gather the inodes to visit on each side, then start the next round.
+  uint32_t cvisit[FILE_DIRTYWORDS], pvisit[FILE_DIRTYWORDS];
+  reconcile_fold();
+  if (!ci->mapped) {
+    memset(cvisit, 0xff, sizeof(cvisit));
+    memset(pvisit, 0xff, sizeof(pvisit));
+    memset(ci->p2c, 0, sizeof(ci->p2c));
+    ci->p2c[FILEINO_CONSIN] = FILEINO_CONSIN;
+    ci->p2c[FILEINO_CONSOUT] = FILEINO_CONSOUT;
+    ci->p2c[FILEINO_ROOTDIR] = FILEINO_ROOTDIR;
+    ci->mapped = 1;
+  } else {
+    memcpy(cvisit, cfiles->dirty, sizeof(cvisit));
+    memcpy(pvisit, ci->pdirty, sizeof(pvisit));
+    for (i = 1; i < FILEINO_GENERAL; i++) {
+      fileino_setbit(cvisit, i);
+      fileino_setbit(pvisit, i);
+    }
+  }
+  memset(cfiles->dirty, 0, sizeof(cfiles->dirty));
+  memset(ci->pdirty, 0, sizeof(ci->pdirty));
+  cfiles->fi[FILEINO_CONSIN].rino = FILEINO_CONSIN;
+  cfiles->fi[FILEINO_CONSOUT].rino = FILEINO_CONSOUT;
+  cfiles->fi[FILEINO_ROOTDIR].rino = FILEINO_ROOTDIR;
 
-  // First make sure all the child's allocated inodes
+  // First make sure all the child's allocated inodes we're visiting
   // have a mapping in the parent, creating mappings as needed.
-  // Also keep track of the parent inodes we find mappings for.
   int cino;
-  for (cino = 1; cino < FILE_INODES; cino++) {
+  for (cino = bitmap_next(cvisit, FILE_INODES, 1); cino < FILE_INODES;
+      cino = bitmap_next(cvisit, FILE_INODES, cino + 1)) {
     fileinode *cfi = &cfiles->fi[cino];
     if (cfi->de.d_name[0] == 0)
       continue; // not allocated in the child
     if (cfi->mode == 0 && cfi->rino == 0)
       continue; // existed only ephemerally in child
+    if (reconcile_c2p(ci, cfiles, cino) != 0) {
+      fileino_setbit(pvisit, cfi->rino);
+      continue; // already mapped
+    }
     if (cfi->rino == 0) {
       // No corresponding parent inode known: find/create one.
       // The parent directory should already have a mapping.
       if (cfi->dino <= 0 || cfi->dino >= FILE_INODES
-        || c2p[cfi->dino] == 0) {
+        || reconcile_c2p(ci, cfiles, cfi->dino) == 0) {
         warn("reconcile: cino %d has invalid parent",
           cino);
         continue; // don't reconcile it
       }
-      cfi->rino = fileino_create(files, c2p[cfi->dino],
-              cfi->de.d_name);
+      cfi->rino = fileino_create(files,
+              reconcile_c2p(ci, cfiles, cfi->dino), cfi->de.d_name);
       // cprintf("reconcile: creating parent inode %d for %d\n", cfi->rino, cino);
       if (cfi->rino <= 0)
         continue; // no free inodes!
@@ -219,7 +629,8 @@ reconcile(pid_t pid, filestate *cfiles)
     int pino = cfi->rino;
     fileinode *pfi = &files->fi[pino];
     if (pino <= 0 || pino >= FILE_INODES
-        || p2c[pfi->dino] != cfi->dino
+        || ci->p2c[pino] != 0
+        || ci->p2c[pfi->dino] != cfi->dino
         || strcmp(pfi->de.d_name, cfi->de.d_name) != 0
         || cfi->rver > pfi->ver
         || cfi->rver > cfi->ver) {
@@ -232,33 +643,36 @@ reconcile(pid_t pid, filestate *cfiles)
     }
 
     // Record the mapping.
-    p2c[pino] = cino;
-    c2p[cino] = pino;
+    ci->p2c[pino] = cino;
+    fileino_setbit(pvisit, pino);
   }
 
-  // Now make sure all the parent's allocated inodes
+  // Now make sure all the parent's allocated inodes we're visiting
   // have a mapping in the child, creating mappings as needed.
   int pino;
-  for (pino = 1; pino < FILE_INODES; pino++) {
+  for (pino = bitmap_next(pvisit, FILE_INODES, 1); pino < FILE_INODES;
+      pino = bitmap_next(pvisit, FILE_INODES, pino + 1)) {
     fileinode *pfi = &files->fi[pino];
     if (pfi->de.d_name[0] == 0 || pfi->mode == 0)
       continue; // not in use or already deleted
-    if (p2c[pino] != 0)
+    if (ci->p2c[pino] != 0)
       continue; // already mapped
-    cino = fileino_create(cfiles, p2c[pfi->dino], pfi->de.d_name);
+    if (ci->p2c[pfi->dino] == 0)
+      continue; // directory not mapped, so neither can this be
+    cino = fileino_create(cfiles, ci->p2c[pfi->dino], pfi->de.d_name);
     if (cino <= 0)
       continue; // no free inodes!
     cfiles->fi[cino].rino = pino;
-    p2c[pino] = cino;
-    c2p[cino] = pino;
+    ci->p2c[pino] = cino;
   }
 
-  // Finally, reconcile each corresponding pair of inodes.
-  for (pino = 1; pino < FILE_INODES; pino++) {
-    if (!p2c[pino])
+  // Finally, reconcile each corresponding pair of inodes we're visiting.
+  for (pino = bitmap_next(pvisit, FILE_INODES, 1); pino < FILE_INODES;
+      pino = bitmap_next(pvisit, FILE_INODES, pino + 1)) {
+    if (!ci->p2c[pino])
       continue; // no corresponding inode in child
-    cino = p2c[pino];
-    assert(c2p[cino] == pino);
+    cino = ci->p2c[pino];
+    assert(reconcile_c2p(ci, cfiles, cino) == pino);
 
     didio |= reconcile_inode(pid, cfiles, pino, cino);
   }
@@ -266,6 +680,45 @@ reconcile(pid_t pid, filestate *cfiles)
   return didio;
 }
 
+// Copy the pages holding bytes 'lo' up to 'hi' of the child's file 'cino'
+// into our file 'pino' if 'get' is true, or ours into the child's if not,
+// as copy-on-write mappings; both files must already span that range.
+// Copying whole 4MB areas shares their page tables, which is cheap now
+// but costs a page table copy at each side's next write into the area,
+// so appends copy just the pages they touched.
+static void
+reconcile_copy(pid_t pid, filestate *cfiles, int pino, int cino,
+    size_t lo, size_t hi, bool get)
+{
+  // Skip the part of a pipe the receiving side has released.
+  lo = MAX(ROUNDDOWN(lo, PAGESIZE),
+      get ? files->fi[pino].released : cfiles->fi[cino].released);
+  hi = ROUNDUP(hi, PAGESIZE);
+  while (lo < hi) {
+    int ps = fileino_slot(files, pino, lo);
+    int cs = fileino_slot(cfiles, cino, lo);
+    assert(ps != 0 && cs != 0);
+    size_t o = lo % PTSIZE, n = MIN(hi - lo, PTSIZE - o);
+    if (get)
+      sys_get(SYS_COPY, pid, NULL, FILEDATA(cs) + o, FILEDATA(ps) + o, n);
+    else
+      batchop(SYS_PUT | SYS_COPY, pid, NULL, FILEDATA(ps) + o,
+        FILEDATA(cs) + o, n);
+    lo += n;
+  }
+}
+
+// Mark the parent's and child's inodes as being in conflict.
+static bool
+reconcile_conflict(filestate *cfiles, int pino, int cino)
+{
+  files->fi[pino].mode |= S_IFCONF;
+  cfiles->fi[cino].mode |= S_IFCONF;
+  fileino_dirty(files, pino);
+  fileino_setbit(cfiles->cdirty, cino); // for the child's own children
+  return true;
+}
+
 bool
 reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
 {
@@ -293,61 +746,132 @@ reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
   if (pfi->ver == rver)
     assert(pfi->size >= rlen);
 
+  // Within a version, files change only by appends and positioned writes,
+  // which each side logs (see fileino_logwrite()),
+  // except that we end a pipe by clearing S_IFPART (see waitpipe()).
+  bool child_changed = !(cfi->ver == rver && cfi->size == rlen
+      && cfi->wseq == cfi->wsync);
+  bool parent_changed = !(pfi->ver == rver && pfi->size == rlen
+      && pfi->wseq == cfi->pwseq && !(cfi->mode & ~pfi->mode & S_IFPART));
+
   // Detect inclusive only conflict
-  if((cfi->ver == rver && pfi->ver == rver) && 
-    (cfi->size > rlen && pfi->size > rlen)) {
+  if (child_changed && parent_changed
+      && cfi->ver == rver && pfi->ver == rver)
     return reconcile_merge(pid, cfiles, pino, cino);
-  }
-
-  bool child_changed = !(cfi->ver == rver && cfi->size == rlen);
-  bool parent_changed = !(pfi->ver == rver && pfi->size == rlen);
 
   if(child_changed && parent_changed) {
     // Conflict! Mark files as such
-    pfi->mode |= S_IFCONF;
-    cfi->mode |= S_IFCONF;
-    return true;
+    return reconcile_conflict(cfiles, pino, cino);
   }
+  filerange wr[FILE_WRANGES];
+  int nw, i;
   if(!child_changed && parent_changed) {
-    // Update the child version
-    cfi->rver = pfi->ver;
-    cfi->rlen = pfi->size;
+    // Make the child's file span as many 4MB areas as the parent's
+    if (fileino_extend(cfiles, cino, pfi->size) < 0) {
+      warn("reconcile_inode: child has no room to grow ino %d", cino);
+      return false;
+    }
+    int cs = fileino_slot(cfiles, cino, FILE_NSLOTS(pfi->size) * PTSIZE);
+    for (; cs != 0; cs = cfiles->fi[cs].next)
+      batchop(SYS_PUT | SYS_ZERO, pid, NULL, NULL, FILEDATA(cs), PTSIZE);
+    fileino_shrink(cfiles, cino, pfi->size);
 
     // Only works with this commented...
     // cfi->rino = pfi->rino = pfi->rino;
-    // Update child metadata
-    cfi->dino = pfi->dino;
+    // Update child metadata; the mapping already matched dir and name,
+    // which stay put so as not to disturb the child's directory index
     cfi->ver  = pfi->ver;
-    strcpy(cfi->de.d_name, pfi->de.d_name);
     cfi->mode = pfi->mode;
     cfi->size = pfi->size;
-    // Copy from parent into child
-    sys_put(SYS_COPY, pid, NULL, FILEDATA(pino), FILEDATA(cino), PTSIZE);
+    // Copy from parent into child, along with the rest of waitpid()'s puts:
+    // just the appended and rewritten pages if that's all that changed,
+    // logging the rewrites for the child's own children in turn
+    nw = pfi->ver == rver ? fileino_writes(files, pino, cfi->pwseq, wr) : -1;
+    if (nw >= 0) {
+      reconcile_copy(pid, cfiles, pino, cino, rlen, pfi->size, 0);
+      for (i = 0; i < nw; i++) {
+        reconcile_copy(pid, cfiles, pino, cino, wr[i].lo, wr[i].hi, 0);
+        fileino_logwrite(cfiles, cino, wr[i].lo, wr[i].hi);
+      }
+    } else {
+      cfi->released = 0;
+      reconcile_copy(pid, cfiles, pino, cino, 0,
+        FILE_NSLOTS(pfi->size) * PTSIZE, 0);
+      if (pfi->ver == rver)
+        fileino_logwrite(cfiles, cino, 0, pfi->size);
+    }
+    fileino_setbit(cfiles->cdirty, cino); // for the child's own children
 
+    // Update the child's references
+    cfi->rver = pfi->ver;
+    cfi->rlen = pfi->size;
+    cfi->wsync = cfi->wseq;
+    cfi->pwseq = pfi->wseq;
     return true;
   }
   if (child_changed && !parent_changed) {
-    // Update the child version
-    cfi->rver = pfi->ver;
-    cfi->rlen = pfi->size;
+    // Make our file span as many 4MB areas as the child's
+    if (fileino_extend(files, pino, cfi->size) < 0) {
+      warn("reconcile_inode: no room to grow ino %d", pino);
+      return false;
+    }
+    int ps = fileino_slot(files, pino, FILE_NSLOTS(cfi->size) * PTSIZE);
+    for (; ps != 0; ps = files->fi[ps].next)
+      sys_get(SYS_ZERO, 0, NULL, NULL, FILEDATA(ps), PTSIZE);
+    fileino_shrink(files, pino, cfi->size);
+
     // Only works with this commented...
     // cfi->rino = pfi->rino = cfi->rino;
-    // Update parent meta data
-    pfi->dino = cfi->dino;
+    // Update parent meta data, but for dir and name as above
     pfi->ver  = cfi->ver;
-    strcpy(pfi->de.d_name, cfi->de.d_name);
     // cprintf("reconcile_inode: ino %d/%d pmode set to %x\n", pino, cino, cfi->mode);
     pfi->mode = cfi->mode;
     pfi->size = cfi->size;
-    // Copy physical file from child to parent (we have to copy entire page)
-    sys_get(SYS_COPY, pid, NULL, FILEDATA(cino), FILEDATA(pino), PTSIZE);
+    // Copy physical file from child to parent (we have to copy entire pages),
+    // logging its rewrites for our other children as if we'd made them
+    nw = cfi->ver == rver ? fileino_writes(cfiles, cino, cfi->wsync, wr) : -1;
+    if (nw >= 0) {
+      reconcile_copy(pid, cfiles, pino, cino, rlen, cfi->size, 1);
+      for (i = 0; i < nw; i++) {
+        reconcile_copy(pid, cfiles, pino, cino, wr[i].lo, wr[i].hi, 1);
+        fileino_logwrite(files, pino, wr[i].lo, wr[i].hi);
+      }
+    } else {
+      pfi->released = 0;
+      reconcile_copy(pid, cfiles, pino, cino, 0,
+        FILE_NSLOTS(cfi->size) * PTSIZE, 1);
+      if (cfi->ver == rver)
+        fileino_logwrite(files, pino, 0, cfi->size);
+    }
+    fileino_dirty(files, pino);
 
+    // Update the child's references
+    cfi->rver = pfi->ver;
+    cfi->rlen = pfi->size;
+    cfi->wsync = cfi->wseq;
+    cfi->pwseq = pfi->wseq;
     return true;
   }
   // No changes...
   return false;
 }
 
+// Can the logged positioned writes 'wr' explain all of a file's growth
+// from 'rlen' to 'size', so that the file took no appends?
+static bool
+reconcile_noappend(filerange *wr, int n, size_t rlen, size_t size)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    rlen = MAX(rlen, wr[i].hi);
+  return size <= rlen;
+}
+
+// Merge the changes the parent and child made concurrently to a file
+// within one version: appends on both sides are concatenated, ours first,
+// as for console output; positioned writes on one or both sides merge
+// as long as they don't overlap those of the other side.
+// Anything else is a conflict.
 bool
 reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino)
 {
@@ -356,48 +880,105 @@ reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino)
   assert(pino > 0 && pino < FILE_INODES);
   assert(cino > 0 && cino < FILE_INODES);
   assert(pfi->ver == cfi->ver);
-  assert(pfi->mode == cfi->mode);
+  assert(((pfi->mode ^ cfi->mode) & ~S_IFPART) == 0);
+  pfi->mode = cfi->mode = pfi->mode & cfi->mode; // a pipe either side ended
 
   if (!S_ISREG(pfi->mode))
     return 0; // only regular files have data to merge
   
   // Rafi
   int rlen = cfi->rlen;
-  assert(cfi->size > rlen || pfi->size > rlen);
-
-  // Find the file size differences (both > 0)
-  int cdif = cfi->size - rlen;
-  int pdif = pfi->size - rlen;
+  filerange cw[FILE_WRANGES], pw[FILE_WRANGES];
+  int nc = fileino_writes(cfiles, cino, cfi->wsync, cw);
+  int np = fileino_writes(files, pino, cfi->pwseq, pw);
+  int newsize, lo, i, j;
+  if (nc == 0 && np == 0) {
+    // Both sides only appended, and both did (else we wouldn't be here).
+    assert(cfi->size > rlen && pfi->size > rlen);
+    newsize = cfi->size + pfi->size - rlen;
+    lo = rlen;
+  } else {
+    if (nc < 0 || np < 0
+        || !reconcile_noappend(cw, nc, rlen, cfi->size)
+        || !reconcile_noappend(pw, np, rlen, pfi->size))
+      return reconcile_conflict(cfiles, pino, cino);
+    lo = cfi->size;
+    for (i = 0; i < nc; i++) {
+      for (j = 0; j < np; j++)
+        if (cw[i].lo < pw[j].hi && pw[j].lo < cw[i].hi)
+          return reconcile_conflict(cfiles, pino, cino);
+      lo = MIN(lo, cw[i].lo);
+    }
+    for (j = 0; j < np; j++)
+      lo = MIN(lo, pw[j].lo);
+    newsize = MAX(cfi->size, pfi->size);
+  }
 
   // Since we can only sys_get/put PTSIZE-length items, we can't just
   // system call the differences -- we have to copy the child file into memory.
-  // We'll use the scratch space, but since cfiles is stored at
-  // VM_SCRATCHLO (and it's a page big), we'll start at VM_SCRATCHLO+PTSIZE
-  int child_loc = VM_SCRATCHLO+PTSIZE;
-  int parent_loc = (int)FILEDATA(pino);
-  sys_get(SYS_COPY, pid, NULL, FILEDATA(cino), (void*)child_loc, PTSIZE);
-
-  // cprintf("merge: cdif: %d, pdif: %d, csize: %d, psize: %d\n",
-  //  cdif, pdif, cfi->size, pfi->size);
-  void *cend = (void*)(child_loc + cfi->size);  // end of child in parent's memory
-  void *pend = (void*)(parent_loc + pfi->size); // end of parent
-
-  if(cfi->size + pdif <= FILE_MAXSIZE) {
-    memcpy(pend, cend-cdif, cdif);              // From last checkpointed end
-    memcpy(cend, pend-pdif, pdif);
-  } else {
+  // Only the 4MB areas from the one holding offset 'lo' onwards change,
+  // so we copy just those into the scratch space after the child's
+  // synchronized file state, which is at VM_SCRATCHLO (and a 4MB area big).
+  int first = lo / PTSIZE;
+  int nslots = FILE_NSLOTS(newsize) - first;
+  if (newsize > FILE_MAXSIZE
+      || nslots > (VM_SCRATCHHI - VM_SCRATCHLO) / PTSIZE - 1
+      || fileino_extend(cfiles, cino, newsize) < 0) {
     warn("reconcile_merge: merged files are too big...cancelling merge\n");
     return false;
   }
-  cfi->size += pdif;
-  pfi->size += cdif;
+  if (fileino_extend(files, pino, newsize) < 0) {
+    fileino_shrink(cfiles, cino, cfi->size);
+    warn("reconcile_merge: no room for merged file...cancelling merge\n");
+    return false;
+  }
+  void *scratch = (void*)VM_SCRATCHLO + PTSIZE;
+  void *child_loc = scratch - first * PTSIZE; // child's offset 0, if mapped
+  int cs;
+  for (cs = fileino_slot(cfiles, cino, first * PTSIZE), i = 0; cs != 0;
+      cs = cfiles->fi[cs].next, i++)
+    sys_get(SYS_COPY, pid, NULL, FILEDATA(cs), scratch + i * PTSIZE, PTSIZE);
+  sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
+    child_loc + ROUNDUP(cfi->size, PAGESIZE),
+    ROUNDUP(newsize, PAGESIZE) - ROUNDUP(cfi->size, PAGESIZE));
+
+  if (nc == 0 && np == 0) {
+    // cprintf("merge: csize: %d, psize: %d\n", cfi->size, pfi->size);
+    // Append the child's new data to ours, then ours to the child's copy.
+    int cdif = cfi->size - rlen, pdif = pfi->size - rlen;
+    if (fileino_write(pino, pfi->size, child_loc + rlen, 1, cdif) != cdif)
+      panic("reconcile_merge: can't append to our own file");
+    if (fileino_read(pino, rlen, child_loc + cfi->size, 1, pdif) != pdif)
+      panic("reconcile_merge: can't read back our own data");
+  } else {
+    // Apply each side's positioned writes to the other side's copy,
+    // logging them there for the other side's other reconciliations.
+    for (j = 0; j < np; j++) {
+      int n = pw[j].hi - pw[j].lo;
+      if (fileino_read(pino, pw[j].lo, child_loc + pw[j].lo, 1, n) != n)
+        panic("reconcile_merge: can't read back our own data");
+      fileino_logwrite(cfiles, cino, pw[j].lo, pw[j].hi);
+    }
+    for (i = 0; i < nc; i++) {
+      int n = cw[i].hi - cw[i].lo;
+      if (fileino_write(pino, cw[i].lo, child_loc + cw[i].lo, 1, n) != n)
+        panic("reconcile_merge: can't write our own file");
+      fileino_logwrite(files, pino, cw[i].lo, cw[i].hi);
+    }
+  }
+  cfi->size = newsize;
   // Make sure files are the same size
   assert(cfi->size == pfi->size);
   // Copy child file back
-  sys_put(SYS_COPY, pid, NULL, (void*)child_loc, FILEDATA(cino), PTSIZE);
-  // Update references
-  cfi->rlen = pfi->rlen = cfi->size;
+  for (cs = fileino_slot(cfiles, cino, first * PTSIZE), i = 0; cs != 0;
+      cs = cfiles->fi[cs].next, i++)
+    sys_put(SYS_COPY, pid, NULL, scratch + i * PTSIZE, FILEDATA(cs), PTSIZE);
+  fileino_setbit(cfiles->cdirty, cino); // fileino_write() marked ours
+  // Update the child's references; ours with our own parent stay put,
+  // since our parent hasn't seen what the child or we wrote yet.
+  cfi->rlen = cfi->size;
+  cfi->wsync = cfi->wseq;
+  cfi->pwseq = pfi->wseq;
 
   return true;
 }
-
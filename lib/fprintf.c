@@ -15,6 +15,7 @@
  * Adapted for PIOS by Bryan Ford at Yale University.
  */
 #include <inc/stdio.h>
+#include <inc/string.h>
 
 // Collect up to 256 characters into a buffer
 // and perform ONE system call to print all of them,
@@ -52,6 +53,21 @@ putch(int ch, void *thunk)
 	}
 }
 
+static void
+putbuf(const char *s, int n, void *thunk)
+{
+	struct printbuf *b = (struct printbuf *) thunk;
+	while (n > 0) {
+		int m = MIN(n, 256 - b->idx);
+		memcpy(b->buf + b->idx, s, m);
+		b->idx += m, s += m, n -= m;
+		if (b->idx == 256) {
+			writebuf(b);
+			b->idx = 0;
+		}
+	}
+}
+
 int
 vfprintf(FILE *fh, const char *fmt, va_list ap)
 {
@@ -61,7 +77,7 @@ vfprintf(FILE *fh, const char *fmt, va_list ap)
 	b.idx = 0;
 	b.result = 0;
 	b.err = 0;
-	vprintfmt(putch, &b, fmt, ap);
+	vprintfmtbuf(putch, putbuf, &b, fmt, ap);
 	if (b.idx > 0)
 		writebuf(&b);
 
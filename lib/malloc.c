@@ -0,0 +1,301 @@
+/*
+ * Size-class memory allocator for PIOS user programs.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+#include <inc/errno.h>
+
+// The heap between VM_HEAPLO and VM_HEAPHI is split into arenas,
+// each with its own bookkeeping in its first page.
+// Arena 0 is the main program's, and each thread tfork() creates
+// gets one of its own from its parent's spare ones (see malloc_fork()),
+// so threads running at once allocate from disjoint pages
+// and their heaps merge back without conflicts.
+// A thread's spare arenas go back to it when the child it gave them to
+// is joined, or when it forks another thread with that child number.
+// A thread forked when its parent has none spare gets no arena,
+// and its malloc() fails with ENOMEM.
+#define NARENAS		32		// One bit each in a uint32_t
+#define ARENASIZE	((VM_HEAPHI - VM_HEAPLO) / NARENAS)
+#define PERSIST		1		// In given[]: worker keeps its arenas
+
+// This thread's arena state, in the first page of the stack area:
+// it's thread-private, since merges never touch it.
+typedef struct mythread {
+	int		arena;		// Arena we allocate from, -1 if none
+	uint32_t	spare;		// Arenas we can give our own threads
+	uint32_t	given[256];	// Those given to each child number
+	int		childarena;	// For the child tfork() is creating
+	uint32_t	childspare;
+} mythread;
+#define MY		(*(mythread *) VM_STACKLO)
+
+#define MINSHIFT	4		// Smallest block, 16 bytes with header
+#define NCLASSES	8		// Up to 2KB; bigger get whole pages
+#define MAXBLOCK	(1 << (MINSHIFT + NCLASSES - 1))
+#define MAGIC		0x6d616c63	// In the header of blocks in use
+
+// Header in front of every block, in use or free.
+typedef struct mhdr {
+	uint32_t	size;		// Block size, header included
+	uint32_t	magic;		// MAGIC if in use, else 0
+} mhdr;
+
+// A free block, or a free run of whole pages.
+typedef struct mfree {
+	mhdr		h;
+	struct mfree	*next;
+} mfree;
+
+typedef struct arena {
+	uint8_t		*brk;		// Start of the arena's unused space
+	uint8_t		*lim;		// End of the arena
+	mfree		*free[NCLASSES]; // Free blocks of each size class
+	mfree		*runs;		// Free page runs, unsorted
+} arena;
+
+// Arenas whose first page we've set up, one byte each so threads
+// setting up different arenas write different bytes.
+static uint8_t arenaready[NARENAS];
+
+extern char end[];	// End of the program's data
+
+
+// Called from crt0.S before main(): make room for MY,
+// and give the main program every arena but its own to hand out.
+void
+malloc_init(void)
+{
+	assert((uintptr_t) end <= VM_HEAPLO);
+	assert(sizeof(mythread) <= PAGESIZE);
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, (void*) VM_STACKLO, PAGESIZE);
+	MY.spare = ~1u;
+}
+
+// Called by tfork() in the parent before forking child 'cn':
+// take back what an earlier thread 'cn' had, then set aside for the new
+// one an arena of its own, plus a quarter of the rest of our spares
+// for its own threads, leaving the others for its siblings.
+void
+malloc_fork(int cn)
+{
+	MY.spare |= MY.given[cn] & ~PERSIST;
+	MY.given[cn] = 0;
+	MY.childarena = -1;
+	MY.childspare = 0;
+	if (MY.spare == 0)
+		return;
+
+	int k, n = 0;
+	for (k = 0; !(MY.spare & (1u << k)); k++)
+		;
+	MY.childarena = k;
+	MY.spare &= ~(1u << k);
+	uint32_t s;
+	for (s = MY.spare; s != 0; s &= s - 1)
+		n++;
+	for (n /= 4, k = NARENAS - 1; n > 0; k--)
+		if (MY.spare & (1u << k)) {
+			MY.childspare |= 1u << k;
+			n--;
+		}
+	MY.spare &= ~MY.childspare;
+	MY.given[cn] = (1u << MY.childarena) | MY.childspare;
+}
+
+// Called in a new tfork() child, to take the arenas set aside for it.
+void
+malloc_thread(void)
+{
+	MY.arena = MY.childarena;
+	MY.spare = MY.childspare;
+	memset(MY.given, 0, sizeof(MY.given));
+}
+
+// Called once child 'cn' has been joined for good: take back its arenas.
+void
+malloc_join(int cn)
+{
+	if (MY.given[cn] & PERSIST)
+		return;
+	MY.spare |= MY.given[cn];
+	MY.given[cn] = 0;
+}
+
+// Mark child 'cn' as a worker that keeps its arenas across joins,
+// as tpool_start() makes it, or no longer so, as tpool_stop() does.
+void
+malloc_persist(int cn, bool persist)
+{
+	if (persist)
+		MY.given[cn] |= PERSIST;
+	else
+		MY.given[cn] &= ~PERSIST;
+}
+
+// Our arena, or NULL if we have none.
+static arena *
+myarena(void)
+{
+	int k = MY.arena;
+	if (k < 0)
+		return NULL;
+	arena *a = (arena *) (VM_HEAPLO + k * ARENASIZE);
+	if (!arenaready[k]) {
+		sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, a, PAGESIZE);
+		a->brk = (uint8_t *) a + PAGESIZE;
+		a->lim = (uint8_t *) a + ARENASIZE;
+		arenaready[k] = 1;
+	}
+	return a;
+}
+
+// Extend the arena's mapped space by 'len' bytes of fresh zero pages.
+static void *
+grow(arena *a, size_t len)
+{
+	if (len > a->lim - a->brk) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	void *va = a->brk;
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, va, len);
+	a->brk += len;
+	return va;
+}
+
+// Split a new page into free blocks of size class 'c'.
+static bool
+carve(arena *a, int c)
+{
+	uint32_t bsize = 1 << (MINSHIFT + c);
+	uint8_t *pg = grow(a, PAGESIZE), *p;
+	if (pg == NULL)
+		return 0;
+	for (p = pg + PAGESIZE - bsize; p >= pg; p -= bsize) {
+		mfree *b = (mfree *) p;
+		b->h.size = bsize;
+		b->next = a->free[c];
+		a->free[c] = b;
+	}
+	return 1;
+}
+
+void *
+malloc(size_t size)
+{
+	arena *a = myarena();
+	if (a == NULL || size > ARENASIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size_t need = size + sizeof(mhdr);
+
+	int c;
+	for (c = 0; c < NCLASSES && (1 << (MINSHIFT + c)) < need; c++)
+		;
+	if (c < NCLASSES) {
+		if (a->free[c] == NULL && !carve(a, c))
+			return NULL;
+		mfree *b = a->free[c];
+		a->free[c] = b->next;
+		b->h.magic = MAGIC;
+		return &b->h + 1;
+	}
+
+	// Big blocks are page runs: reuse a free one, or take new pages.
+	size_t len = ROUNDUP(need, PAGESIZE);
+	mfree **pp, *r;
+	for (pp = &a->runs; (r = *pp) != NULL; pp = &r->next)
+		if (r->h.size >= len)
+			break;
+	if (r != NULL) {
+		if (r->h.size > len) {		// Leave the rest on the list
+			mfree *rest = (mfree *) ((uint8_t *) r + len);
+			rest->h.size = r->h.size - len;
+			rest->h.magic = 0;
+			rest->next = r->next;
+			*pp = rest;
+		} else
+			*pp = r->next;
+	} else if ((r = grow(a, len)) == NULL)
+		return NULL;
+	r->h.size = len;
+	r->h.magic = MAGIC;
+	return &r->h + 1;
+}
+
+// Freed blocks go on the freeing thread's own arena's lists,
+// whichever arena they came from; page runs go back to the kernel.
+void
+free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	mfree *b = (mfree *) ((mhdr *) ptr - 1);
+	if (b->h.magic != MAGIC)
+		panic("free: %p not allocated", ptr);
+	b->h.magic = 0;
+
+	arena *a = myarena();
+	if (a == NULL)
+		return;			// nowhere to keep it: leak it
+	uint32_t size = b->h.size;
+	if (size <= MAXBLOCK) {
+		int c = 0;
+		while ((1 << (MINSHIFT + c)) < size)
+			c++;
+		b->next = a->free[c];
+		a->free[c] = b;
+		return;
+	}
+
+	// Drop the run's pages, leaving only its list entry in its first.
+	sys_get(SYS_ZERO | SYS_PERM | SYS_RW, 0, NULL, NULL, b, size);
+	if ((uint8_t *) b + size == a->brk) {
+		a->brk = (uint8_t *) b;		// Just give the space back
+		return;
+	}
+	b->h.size = size;
+	b->next = a->runs;
+	a->runs = b;
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	if (size != 0 && n > ARENASIZE / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	void *p = malloc(n * size);
+	if (p != NULL)
+		memset(p, 0, n * size);
+	return p;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return malloc(size);
+	mhdr *h = (mhdr *) ptr - 1;
+	assert(h->magic == MAGIC);
+	size_t have = h->size - sizeof(mhdr);
+	if (size <= have)
+		return ptr;
+	void *p = malloc(size);
+	if (p != NULL) {
+		memcpy(p, ptr, have);
+		free(ptr);
+	}
+	return p;
+}
@@ -24,7 +24,8 @@
 
 typedef struct printstate {
 	void (*putch)(int ch, void *putdat);	// character output function
-	void *putdat;		// data for above function
+	void (*putbuf)(const char *s, int n, void *putdat); // or n at once
+	void *putdat;		// data for above functions
 	int padc;		// left pad character, ' ' or '0'
 	int width;		// field width, -1=none
 	int prec;		// numeric precision or string length, -1=none
@@ -65,12 +66,30 @@ getint(printstate *st, va_list *ap)
 		return va_arg(*ap, int);
 }
 
-// Print padding characters, and an optional sign before a number.
+// Print 'n' characters from 's', in one call if we have a putbuf.
+static void
+putn(printstate *st, const char *s, int n)
+{
+	if (st->putbuf != NULL) {
+		if (n > 0)
+			st->putbuf(s, n, st->putdat);
+		return;
+	}
+	while (n-- > 0)
+		st->putch(*s++, st->putdat);
+}
+
+// Print padding characters to fill out the rest of the field width.
 static void
 putpad(printstate *st)
 {
-	while (--st->width >= 0)
-		st->putch(st->padc, st->putdat);
+	static const char spaces[16] = "                ";
+	static const char zeros[16] = "0000000000000000";
+	while (st->width > 0) {
+		int n = MIN(st->width, 16);
+		putn(st, st->padc == '0' ? zeros : spaces, n);
+		st->width -= n;
+	}
 }
 
 // Print a string with a specified maximum length (-1=unlimited),
@@ -87,23 +106,57 @@ putstr(printstate *st, const char *str, int maxlen)
 
 	if (!(st->flags & F_RPAD))	// print left-side padding
 		putpad(st);		// (also leaves st->width == 0)
-	while (str < lim) {
-		char ch = *str++;
-			st->putch(ch, st->putdat);
-	}
+	putn(st, str, lim-str);
 	putpad(st);			// print right-side padding
 }
 
-// Generate a number (base <= 16) in reverse order into a string buffer.
+static const char digits[] = "0123456789abcdef";
+static const char pairs[] =		// two decimal digits at a time
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+// Generate a number (base <= 16) backwards from the end of a buffer,
+// returning where it starts.  Powers of two just shift and mask.
+// Decimal goes two digits per division, and numbers that fit
+// in 32 bits avoid the much slower 64-bit division helpers.
 static char *
 genint(printstate *st, char *p, uintmax_t num)
 {
-	// first recursively print all preceding (more significant) digits
-	if (num >= st->base)
-		p = genint(st, p, num / st->base);	// output higher digits
-	else if (st->signc >= 0)
-		*p++ = st->signc;			// output leading sign
-	*p++ = "0123456789abcdef"[num % st->base];	// output this digit
+	if (st->base == 16 || st->base == 8) {
+		int shift = st->base == 16 ? 4 : 3;
+		do {
+			*--p = digits[num & (st->base - 1)];
+			num >>= shift;
+		} while (num != 0);
+	} else if (st->base == 10) {
+		while (num > 0xffffffff) {
+			uintmax_t q = num / 100;
+			const char *d = &pairs[(num - q * 100) * 2];
+			*--p = d[1];
+			*--p = d[0];
+			num = q;
+		}
+		uint32_t n = num;
+		for (; n >= 100; n /= 100) {
+			const char *d = &pairs[(n % 100) * 2];
+			*--p = d[1];
+			*--p = d[0];
+		}
+		if (n >= 10) {
+			*--p = pairs[n * 2 + 1];
+			*--p = pairs[n * 2];
+		} else
+			*--p = '0' + n;
+	} else {
+		do {
+			*--p = digits[num % st->base];
+			num /= st->base;
+		} while (num != 0);
+	}
+	if (st->signc >= 0)
+		*--p = st->signc;			// output leading sign
 	return p;
 }
 
@@ -111,26 +164,39 @@ genint(printstate *st, char *p, uintmax_t num)
 static void
 putint(printstate *st, uintmax_t num, int base)
 {
-	char buf[30], *p = buf;		// big enough for any 64-bit int in octal
+	char buf[30], *p;		// big enough for any 64-bit int in octal
 	st->base = base;		// select base for genint
-	p = genint(st, p, num);		// output to the string buffer
-	putstr(st, buf, p-buf);		// print it with left/right padding
+	p = genint(st, buf + sizeof(buf), num);	// output to the string buffer
+	putstr(st, p, buf + sizeof(buf) - p);	// print it with padding
 }
 
 
 // Main function to format and print a string.
 void
 vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
+{
+	vprintfmtbuf(putch, NULL, putdat, fmt, ap);
+}
+
+// Same, but output is also allowed to go 'n' characters at a time
+// through putbuf, if it's non-null: runs of literal characters
+// and whole formatted fields then come out in one call each.
+void
+vprintfmtbuf(void (*putch)(int, void*),
+		void (*putbuf)(const char *, int, void *), void *putdat,
+		const char *fmt, va_list ap)
 {
 	register int ch, err;
 
-	printstate st = { .putch = putch, .putdat = putdat };
+	printstate st = { .putch = putch, .putbuf = putbuf, .putdat = putdat };
 	while (1) {
-		while ((ch = *(unsigned char *) fmt++) != '%') {
-			if (ch == '\0')
-				return;
-			putch(ch, putdat);
-		}
+		const char *lit = fmt;
+		while ((ch = *(unsigned char *) fmt) != '%' && ch != '\0')
+			fmt++;
+		putn(&st, lit, fmt - lit);
+		if (ch == '\0')
+			return;
+		fmt++;
 
 		// Process a %-escape sequence
 		st.padc = ' ';
@@ -235,8 +301,7 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 
 		// pointer
 		case 'p':
-			putch('0', putdat);
-			putch('x', putdat);
+			putn(&st, "0x", 2);
 			putint(&st, (uintptr_t) va_arg(ap, void *), 16);
 			break;
 
@@ -3,6 +3,7 @@
 
 #include <inc/types.h>
 #include <inc/stdio.h>
+#include <inc/string.h>
 #include <inc/assert.h>
 
 struct sprintbuf {
@@ -19,6 +20,15 @@ sprintputch(int ch, struct sprintbuf *b)
 		*b->buf++ = ch;
 }
 
+static void
+sprintputbuf(const char *s, int n, struct sprintbuf *b)
+{
+	b->cnt += n;
+	size_t m = MIN((size_t) n, (uintptr_t) b->ebuf - (uintptr_t) b->buf);
+	memcpy(b->buf, s, m);
+	b->buf += m;
+}
+
 int
 vsprintf(char *buf, const char *fmt, va_list ap)
 {
@@ -26,7 +36,7 @@ vsprintf(char *buf, const char *fmt, va_list ap)
 	struct sprintbuf b = {buf, (char*)(intptr_t)~0, 0};
 
 	// print the string to the buffer
-	vprintfmt((void*)sprintputch, &b, fmt, ap);
+	vprintfmtbuf((void*)sprintputch, (void*)sprintputbuf, &b, fmt, ap);
 
 	// null terminate the buffer
 	*b.buf = '\0';
@@ -54,7 +64,7 @@ vsnprintf(char *buf, int n, const char *fmt, va_list ap)
 	struct sprintbuf b = {buf, buf+n-1, 0};
 
 	// print the string to the buffer
-	vprintfmt((void*)sprintputch, &b, fmt, ap);
+	vprintfmtbuf((void*)sprintputch, (void*)sprintputbuf, &b, fmt, ap);
 
 	// null terminate the buffer
 	*b.buf = '\0';
@@ -9,6 +9,12 @@
  * just point to the same filedesc structs that low-level fds refer to,
  * which simplifies PIOS's user-space C library code a lot.
  *
+ * We still buffer, though, since going through filedesc_read/write
+ * for every character costs descriptor and inode checks each time:
+ * each stream gets a read-ahead/write-behind buffer, kept here
+ * alongside the filedesc table rather than in it, so that dup2()
+ * and reconciliation never see it.  Console streams are line-buffered.
+ *
  * Copyright (C) 1997 Massachusetts Institute of Technology
  * See section "MIT License" in the file LICENSES for licensing terms.
  *
@@ -31,6 +37,128 @@ FILE *const stdin = &FILES->fd[0];
 FILE *const stdout = &FILES->fd[1];
 FILE *const stderr = &FILES->fd[2];
 
+// Buffering state of each stream, indexed like files->fd[].
+// A buffer holds either read-ahead data, between 'pos' and 'len',
+// or data written but not yet passed on to filedesc_write(), up to 'len'.
+static struct stdiobuf {
+	char	*base;		// Buffer set by setvbuf(), NULL for default
+	size_t	size;		// Size of buffer
+	int	mode;		// _IOFBF, _IOLBF, _IONBF, or 0 if not yet set
+	bool	writing;	// Buffer holds data to write, not read-ahead
+	size_t	pos;		// Next read-ahead byte to hand out
+	size_t	len;		// End of read-ahead or write-behind data
+} bufs[OPEN_MAX];
+
+static char bufspace[OPEN_MAX][BUFSIZ];	// Default buffers
+
+// Find a stream's buffering state, setting up the default if needed.
+static struct stdiobuf *
+stdio_buf(FILE *fd)
+{
+	assert(filedesc_isopen(fd));
+	struct stdiobuf *b = &bufs[fd - files->fd];
+	if (b->mode == 0) {
+		b->base = bufspace[fd - files->fd];
+		b->size = BUFSIZ;
+		b->mode = fd->ino == FILEINO_CONSIN || fd->ino == FILEINO_CONSOUT
+			? _IOLBF : _IOFBF;
+	}
+	return b;
+}
+
+// Write out any write-behind data for a stream, or give back the data
+// read ahead but not yet consumed by moving the file position back.
+// Either way the buffer is empty afterwards.
+// Returns 0 on success, or EOF and records the error for ferror().
+static int
+stdio_drain(FILE *fd, struct stdiobuf *b)
+{
+	int rc = 0;
+	if (b->writing && b->len > 0) {
+		if (filedesc_write(fd, b->base, 1, b->len) != b->len)
+			rc = EOF;
+	} else if (!b->writing)
+		fd->ofs -= b->len - b->pos;
+	b->writing = 0;
+	b->pos = b->len = 0;
+	return rc;
+}
+
+// Get ready for a stream to be closed, reopened, or handed to a new program.
+void
+stdio_close(FILE *fd)
+{
+	struct stdiobuf *b = &bufs[fd - files->fd];
+	if (b->mode != 0)
+		stdio_drain(fd, b);
+	b->mode = 0;
+}
+
+// Drain all streams' buffers: before fork(), exec() and exit(),
+// which would otherwise duplicate or lose them.
+void
+stdio_sync(void)
+{
+	int i;
+	for (i = bitmap_next(files->fdopen, OPEN_MAX, 0); i < OPEN_MAX;
+			i = bitmap_next(files->fdopen, OPEN_MAX, i + 1))
+		if (bufs[i].mode != 0)
+			stdio_drain(&files->fd[i], &bufs[i]);
+}
+
+// Refill a stream's empty buffer with read-ahead data.
+// Line-buffered streams read ahead only through the end of the line,
+// so that input we haven't asked for stays in the file for others,
+// and flush line-buffered output first, e.g., to show a prompt.
+// Returns the number of bytes now buffered, or -1 on error.
+static ssize_t
+stdio_fill(FILE *fd, struct stdiobuf *b)
+{
+	assert(!b->writing && b->pos == b->len);
+	if (b->mode == _IOLBF) {
+		int i;
+		for (i = bitmap_next(files->fdopen, OPEN_MAX, 0); i < OPEN_MAX;
+				i = bitmap_next(files->fdopen, OPEN_MAX, i + 1))
+			if (bufs[i].mode == _IOLBF && bufs[i].writing)
+				stdio_drain(&files->fd[i], &bufs[i]);
+	}
+	b->pos = b->len = 0;
+	ssize_t actual = filedesc_read(fd, b->base, 1, b->size);
+	if (actual <= 0)
+		return actual;
+	if (b->mode == _IOLBF) {
+		char *nl = memchr(b->base, '\n', actual);
+		if (nl != NULL) {
+			fd->ofs -= actual - (nl + 1 - b->base);
+			actual = nl + 1 - b->base;
+		}
+	}
+	b->len = actual;
+	return actual;
+}
+
+// Switch a stream's buffer to reading, returning it, or NULL if unbuffered.
+static struct stdiobuf *
+stdio_rbuf(FILE *fd)
+{
+	struct stdiobuf *b = stdio_buf(fd);
+	if (b->writing)
+		stdio_drain(fd, b);
+	return b->mode == _IONBF ? NULL : b;
+}
+
+// Switch a stream's buffer to writing, returning it, or NULL if unbuffered.
+static struct stdiobuf *
+stdio_wbuf(FILE *fd)
+{
+	struct stdiobuf *b = stdio_buf(fd);
+	if (!b->writing) {
+		stdio_drain(fd, b);
+		b->writing = 1;
+	}
+	return b->mode == _IONBF ? NULL : b;
+}
+
 FILE *
 fopen(const char *path, const char *mode)
 {
@@ -70,25 +198,54 @@ freopen(const char *path, const char *mode, FILE *fd)
 int
 fclose(FILE *fd)
 {
-	filedesc_close(fd);
+	filedesc_close(fd);	// drains our buffer via stdio_close()
+	return 0;
+}
+
+int
+setvbuf(FILE *fd, char *buf, int mode, size_t size)
+{
+	assert(mode == _IOFBF || mode == _IOLBF || mode == _IONBF);
+	struct stdiobuf *b = stdio_buf(fd);
+	if (stdio_drain(fd, b) < 0)
+		return EOF;
+	b->mode = mode;
+	if (buf != NULL && size > 0) {
+		b->base = buf;
+		b->size = size;
+	}
 	return 0;
 }
 
+void
+setbuf(FILE *fd, char *buf)
+{
+	setvbuf(fd, buf, buf != NULL ? _IOFBF : _IONBF, BUFSIZ);
+}
+
 int
 fgetc(FILE *fd)
 {
 	// cprintf("fgetc: %d\n", fd->ino);
 	unsigned char ch;
-	if (filedesc_read(fd, &ch, 1, 1) < 1)
+	struct stdiobuf *b = stdio_rbuf(fd);
+	if (b == NULL)
+		return filedesc_read(fd, &ch, 1, 1) < 1 ? EOF : ch;
+	if (b->pos == b->len && stdio_fill(fd, b) <= 0)
 		return EOF;
-	return ch;
+	return (unsigned char) b->base[b->pos++];
 }
 
 int
 fputc(int c, FILE *fd)
 {
 	unsigned char ch = c;
-	if (filedesc_write(fd, &ch, 1, 1) < 1)
+	struct stdiobuf *b = stdio_wbuf(fd);
+	if (b == NULL)
+		return filedesc_write(fd, &ch, 1, 1) < 1 ? EOF : ch;
+	b->base[b->len++] = ch;
+	if ((b->len == b->size || (b->mode == _IOLBF && ch == '\n'))
+			&& stdio_drain(fd, b) < 0)
 		return EOF;
 	return ch;
 }
@@ -96,22 +253,61 @@ fputc(int c, FILE *fd)
 size_t
 fread(void *buf, size_t eltsize, size_t count, FILE *fd)
 {
-	ssize_t actual = filedesc_read(fd, buf, eltsize, count);
-	return actual >= 0 ? actual : 0;	// no error indication
+	if (eltsize == 0 || count == 0)
+		return 0;		// nothing to read, and no dividing by 0
+	struct stdiobuf *b = stdio_rbuf(fd);
+	if (b == NULL) {
+		ssize_t actual = filedesc_read(fd, buf, eltsize, count);
+		return actual >= 0 ? actual : 0;	// no error indication
+	}
+
+	// Hand out read-ahead data, then read big requests directly.
+	size_t want = eltsize * count, got = 0;
+	while (got < want) {
+		if (b->pos == b->len && want - got >= b->size) {
+			ssize_t actual = filedesc_read(fd, buf + got, 1,
+							want - got);
+			if (actual <= 0)
+				break;
+			got += actual;
+			continue;
+		}
+		if (b->pos == b->len && stdio_fill(fd, b) <= 0)
+			break;
+		size_t n = MIN(want - got, b->len - b->pos);
+		memcpy(buf + got, b->base + b->pos, n);
+		b->pos += n;
+		got += n;
+	}
+	return got / eltsize;
 }
 
 size_t
 fwrite(const void *buf, size_t eltsize, size_t count, FILE *fd)
 {
-	ssize_t actual = filedesc_write(fd, buf, eltsize, count);
+	struct stdiobuf *b = stdio_wbuf(fd);
+	size_t len = eltsize * count;
+	if (b != NULL && b->len + len <= b->size) {
+		memcpy(b->base + b->len, buf, len);
+		b->len += len;
+		if (b->len < b->size && (b->mode != _IOLBF
+				|| memchr(buf, '\n', len) == NULL))
+			return count;
+		return stdio_drain(fd, b) < 0 ? 0 : count;
+	}
 
-		
+	// Too big to buffer: write what we have, then this directly.
+	if (b != NULL && stdio_drain(fd, b) < 0)
+		return 0;
+	ssize_t actual = filedesc_write(fd, buf, eltsize, count);
 	return actual >= 0 ? actual : 0;	// no error indication
 }
 
 int
 fseek(FILE *fd, off_t offset, int whence)
 {
+	if (stdio_drain(fd, stdio_buf(fd)) < 0)
+		return -1;
 	if (filedesc_seek(fd, offset, whence) < 0)
 		return -1;
 	return 0;	// fseek() returns 0 on success, not the new position
@@ -120,16 +316,19 @@ fseek(FILE *fd, off_t offset, int whence)
 long
 ftell(FILE *fd)
 {
-	assert(filedesc_isopen(fd));
-	return fd->ofs;
+	struct stdiobuf *b = stdio_buf(fd);
+	if (b->writing)
+		return fd->ofs + b->len;
+	return fd->ofs - (b->len - b->pos);
 }
 
 int
 feof(FILE *fd)
 {
-	assert(filedesc_isopen(fd));
+	struct stdiobuf *b = stdio_buf(fd);
 	fileinode *fi = &files->fi[fd->ino];
-	return fd->ofs >= fi->size && !(fi->mode & S_IFPART);
+	return (b->writing || b->pos == b->len)
+		&& fd->ofs >= fi->size && !(fi->mode & S_IFPART);
 }
 
 int
@@ -151,13 +350,15 @@ int
 fflush(FILE *f)
 {
 	if (f == NULL) {	// flush all open streams
-		for (f = &files->fd[0]; f < &files->fd[OPEN_MAX]; f++)
-			if (filedesc_isopen(f))
-				fflush(f);
+		int i;
+		for (i = bitmap_next(files->fdopen, OPEN_MAX, 0); i < OPEN_MAX;
+				i = bitmap_next(files->fdopen, OPEN_MAX, i + 1))
+			fflush(&files->fd[i]);
 		return 0;
 	}
 
-	assert(filedesc_isopen(f));
+	if (stdio_drain(f, stdio_buf(f)) < 0)
+		return EOF;
 	return fileino_flush(f->ino);
 }
 
@@ -13,6 +13,7 @@
 #include <inc/syscall.h>
 #include <inc/assert.h>
 #include <inc/string.h>
+#include <inc/stdio.h>
 
 void gcc_noreturn
 exit(int status)
@@ -20,6 +21,7 @@ exit(int status)
 	// To exit a PIOS user process, by convention,
 	// we just set our exit status in our filestate area
 	// and return to our parent process.
+	stdio_sync();
 	files->status = status;
 	files->exited = 1;
 	sys_ret();
@@ -15,6 +15,8 @@ strerror(int err)
 		"Resource temporarily unavailable",
 		"No child processes",
 		"Conflict detected",
+		"Cannot allocate memory",
+		"Directory not empty",
 	};
 	static char errbuf[64];
 
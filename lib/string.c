@@ -1,5 +1,6 @@
 /*
- * Basic string routines.  Not hardware optimized, but not shabby.
+ * Basic string routines.  Word at a time where it pays,
+ * and in user space 16 bytes at a time with SSE2 if the CPU has it.
  *
  * Copyright (C) 1997 Massachusetts Institute of Technology
  * See section "MIT License" in the file LICENSES for licensing terms.
@@ -8,6 +9,7 @@
  */
 
 #include <inc/string.h>
+#include <inc/x86.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -15,14 +17,48 @@
 // Primespipe runs 3x faster this way.
 #define ASM 1
 
+// The kernel can't touch the SSE registers without proc_fpugrab(),
+// which costs more than it would save here, so only user code uses SSE2.
+// Even there, the first SSE instruction in a time slice traps
+// to load the process's FPU state, so it's only worth it for big blocks.
+#ifndef PIOS_KERNEL
+#define SSE2		1
+#define SSE2_MIN	256	// Bytes below which the plain code wins
+static bool string_sse2;	// CPU has SSE2
+
+// Called from crt0.S before main(), so the flag is set before any
+// threads fork and never changes underneath a merge.
+void
+string_init(void)
+{
+	cpuinfo inf;
+	cpuid(1, &inf);
+	string_sse2 = (inf.edx & (1 << 26)) != 0;
+}
+#endif
+
+// Tests for a zero byte in the word 'x', or for a byte equal to the one
+// replicated across 'pat', without looking at each byte separately.
+#define ONES		0x01010101U
+#define HASZERO(x)	(((x) - ONES) & ~(x) & (ONES << 7))
+#define HASBYTE(x, pat)	HASZERO((x) ^ (pat))
+
 int
 strlen(const char *s)
 {
-	int n;
+	const char *p = s;
 
-	for (n = 0; *s != '\0'; s++)
-		n++;
-	return n;
+	// An aligned word never crosses a page,
+	// so reading a few bytes past the terminator can't fault.
+	for (; (uintptr_t)p % 4 != 0; p++)
+		if (*p == '\0')
+			return p - s;
+	const uint32_t *w = (const uint32_t *) p;
+	while (!HASZERO(*w))
+		w++;
+	for (p = (const char *) w; *p != '\0'; p++)
+		;
+	return p - s;
 }
 
 char *
@@ -97,26 +133,114 @@ strchr(const char *s, char c)
 }
 
 #if ASM
+
+// Copy forward a byte at a time until the destination is word-aligned,
+// then a word at a time, then the last few bytes.
+static void
+copyfwd(char *d, const char *s, size_t n)
+{
+	size_t k = n >= 16 ? -(uintptr_t)d % 4 : 0;
+	size_t w = (n - k) / 4, b = (n - k) % 4;
+	asm volatile("cld; rep movsb"
+		: "+D" (d), "+S" (s), "+c" (k) : : "cc", "memory");
+	asm volatile("rep movsl"
+		: "+D" (d), "+S" (s), "+c" (w) : : "cc", "memory");
+	asm volatile("rep movsb"
+		: "+D" (d), "+S" (s), "+c" (b) : : "cc", "memory");
+}
+
+// Likewise fill with the byte replicated across 'c'.
+static void
+setfwd(char *d, uint32_t c, size_t n)
+{
+	size_t k = n >= 16 ? -(uintptr_t)d % 4 : 0;
+	size_t w = (n - k) / 4, b = (n - k) % 4;
+	asm volatile("cld; rep stosb"
+		: "+D" (d), "+c" (k) : "a" (c) : "cc", "memory");
+	asm volatile("rep stosl"
+		: "+D" (d), "+c" (w) : "a" (c) : "cc", "memory");
+	asm volatile("rep stosb"
+		: "+D" (d), "+c" (b) : "a" (c) : "cc", "memory");
+}
+
+#if SSE2
+// Copy forward 64 bytes per loop into a 16-byte aligned destination,
+// for n >= SSE2_MIN.  Each loop loads everything before it stores,
+// so this is still safe for memmove() when dst < src.
+static void
+copysse2(char *d, const char *s, size_t n)
+{
+	size_t k = -(uintptr_t)d % 16;
+	copyfwd(d, s, k);
+	d += k, s += k, n -= k;
+	size_t m = n & ~63;
+	asm volatile(
+		"1:	movdqu	(%1),%%xmm0\n"
+		"	movdqu	16(%1),%%xmm1\n"
+		"	movdqu	32(%1),%%xmm2\n"
+		"	movdqu	48(%1),%%xmm3\n"
+		"	movdqa	%%xmm0,(%0)\n"
+		"	movdqa	%%xmm1,16(%0)\n"
+		"	movdqa	%%xmm2,32(%0)\n"
+		"	movdqa	%%xmm3,48(%0)\n"
+		"	addl	$64,%1\n"
+		"	addl	$64,%0\n"
+		"	subl	$64,%2\n"
+		"	jnz	1b\n"
+		: "+r" (d), "+r" (s), "+r" (m) : : "cc", "memory");
+	copyfwd(d, s, n % 64);
+}
+
+static void
+setsse2(char *d, uint32_t c, size_t n)
+{
+	size_t k = -(uintptr_t)d % 16;
+	setfwd(d, c, k);
+	d += k, n -= k;
+	size_t m = n & ~63;
+	asm volatile(
+		"	movd	%2,%%xmm0\n"
+		"	pshufd	$0,%%xmm0,%%xmm0\n"
+		"1:	movdqa	%%xmm0,(%0)\n"
+		"	movdqa	%%xmm0,16(%0)\n"
+		"	movdqa	%%xmm0,32(%0)\n"
+		"	movdqa	%%xmm0,48(%0)\n"
+		"	addl	$64,%0\n"
+		"	subl	$64,%1\n"
+		"	jnz	1b\n"
+		: "+r" (d), "+r" (m) : "r" (c) : "cc", "memory");
+	setfwd(d, c, n % 64);
+}
+#endif
+
 void *
 memset(void *v, int c, size_t n)
 {
-	char *p;
-
-	if (n == 0)
+	uint32_t pat = (uint8_t) c * ONES;
+#if SSE2
+	if (n >= SSE2_MIN && string_sse2) {
+		setsse2(v, pat, n);
 		return v;
-	if ((int)v%4 == 0 && n%4 == 0) {
-		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
-		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
-			: "cc", "memory");
-	} else
-		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
-			: "cc", "memory");
+	}
+#endif
+	setfwd(v, pat, n);
 	return v;
 }
 
+// Unlike memmove(), memcpy() needs no overlap check.
+void *
+memcpy(void *dst, const void *src, size_t n)
+{
+#if SSE2
+	if (n >= SSE2_MIN && string_sse2) {
+		copysse2(dst, src, n);
+		return dst;
+	}
+#endif
+	copyfwd(dst, src, n);
+	return dst;
+}
+
 void *
 memmove(void *dst, const void *src, size_t n)
 {
@@ -136,15 +260,9 @@ memmove(void *dst, const void *src, size_t n)
 				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
 		// Some versions of GCC rely on DF being clear
 		asm volatile("cld" ::: "cc");
-	} else {
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+		return dst;
 	}
-	return dst;
+	return memcpy(dst, src, n);	// copying forward is safe
 }
 
 #else
@@ -182,13 +300,13 @@ memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
-#endif
 
 void *
 memcpy(void *dst, const void *src, size_t n)
 {
 	return memmove(dst, src, n);
 }
+#endif
 
 int
 memcmp(const void *v1, const void *v2, size_t n)
@@ -196,6 +314,32 @@ memcmp(const void *v1, const void *v2, size_t n)
 	const uint8_t *s1 = (const uint8_t *) v1;
 	const uint8_t *s2 = (const uint8_t *) v2;
 
+#if SSE2
+	// Skip 16 bytes at a time up to the block with the first difference.
+	if (n >= SSE2_MIN && string_sse2) {
+		size_t off = 0, m = n & ~15;
+		uint32_t mask;
+		asm volatile(
+			"1:	movdqu	(%2,%1),%%xmm0\n"
+			"	movdqu	(%3,%1),%%xmm1\n"
+			"	pcmpeqb	%%xmm1,%%xmm0\n"
+			"	pmovmskb %%xmm0,%0\n"
+			"	cmpl	$0xffff,%0\n"
+			"	jne	2f\n"
+			"	addl	$16,%1\n"
+			"	cmpl	%4,%1\n"
+			"	jb	1b\n"
+			"2:\n"
+			: "=&r" (mask), "+r" (off)
+			: "r" (s1), "r" (s2), "r" (m)
+			: "cc", "memory");
+		s1 += off, s2 += off, n -= off;
+	}
+#endif
+	// Then a word at a time up to the word with the difference.
+	while (n >= 4 && *(const uint32_t *) s1 == *(const uint32_t *) s2)
+		s1 += 4, s2 += 4, n -= 4;
+
 	while (n-- > 0) {
 		if (*s1 != *s2)
 			return (int) *s1 - (int) *s2;
@@ -208,11 +352,17 @@ memcmp(const void *v1, const void *v2, size_t n)
 void *
 memchr(const void *s, int c, size_t n)
 {
-	const void *ends = (const char *) s + n;
-	for (; s < ends; s++)
-		if (*(const unsigned char *) s == (unsigned char) c)
-			return (void *) s;
+	const unsigned char *p = s;
+	unsigned char ch = c;
+
+	for (; n > 0 && (uintptr_t)p % 4 != 0; p++, n--)
+		if (*p == ch)
+			return (void *) p;
+	uint32_t pat = ch * ONES;
+	for (; n >= 4 && !HASBYTE(*(const uint32_t *) p, pat); p += 4, n -= 4)
+		;
+	for (; n > 0; p++, n--)
+		if (*p == ch)
+			return (void *) p;
 	return NULL;
 }
-
-
@@ -17,9 +17,11 @@
 #include <inc/unistd.h>
 #include <inc/assert.h>
 #include <inc/syscall.h>
+#include <inc/mmu.h>
 #include <inc/vm.h>
 #include <inc/file.h>
 #include <inc/errno.h>
+#include <inc/parallel.h>
 
 #define ALLVA		((void*) VM_USERLO)
 #define ALLSIZE		(VM_USERHI - VM_USERLO)
@@ -32,6 +34,11 @@
 
 static int thread_id;
 
+extern void malloc_fork(int cn);
+extern void malloc_thread(void);
+extern void malloc_join(int cn);
+extern void malloc_persist(int cn, bool persist);
+
 
 // Fork a child process/thread, returning 0 in the child and 1 in the parent.
 int
@@ -40,6 +47,7 @@ tfork(uint16_t child)
 	// Set up the register state for the child
 	struct procstate ps;
 	memset(&ps, 0, sizeof(ps));
+	malloc_fork(child & 0xff);	// set aside the child's arenas
 
 	// Use some assembly magic to propagate registers to child
 	// and generate an appropriate starting eip
@@ -61,32 +69,449 @@ tfork(uint16_t child)
 		:
 		: "ebx", "ecx", "edx");
 	if (!isparent) {
+		malloc_thread();	// allocate from our own arena
 		return 0;	// in the child
 	}
 
 	// Fork the child, copying our entire user address space into it.
 	ps.tf.regs.eax = 0;	// isparent == 0 in the child
-	sys_put(SYS_REGS | SYS_COPY | SYS_SNAP | SYS_START, child,
+	sys_put(SYS_REGS | SYS_COPY | SYS_SNAP | SYS_PMC | SYS_START, child,
  		&ps, ALLVA, ALLVA, ALLSIZE);
 
 	return 1;
 }
 
-void
-tjoin(uint16_t child)
+// Wait for a child to stop, merge in its changes to the shared space,
+// and return with its CPU state in 'ps'.
+static void
+tmerge(uint16_t child, struct procstate *ps)
 {
 	// Wait for the child and retrieve its CPU state.
 	// If merging, leave the highest 4MB containing the stack unmerged,
 	// so that the stack acts as a "thread-private" memory area.
-	struct procstate ps;
-	sys_get(SYS_MERGE | SYS_REGS, child, &ps, SHAREVA, SHAREVA, SHARESIZE);
+	sys_get(SYS_MERGE | SYS_REGS, child, ps, SHAREVA, SHAREVA, SHARESIZE);
 
 	// Make sure the child exited with the expected trap number
-	if (ps.tf.trapno != T_SYSCALL) {
-		cprintf("  eip  0x%08x\n", ps.tf.eip);
-		cprintf("  esp  0x%08x\n", ps.tf.esp);
+	if (ps->tf.trapno != T_SYSCALL) {
+		cprintf("  eip  0x%08x\n", ps->tf.eip);
+		cprintf("  esp  0x%08x\n", ps->tf.esp);
 		panic("tjoin: unexpected trap %d, expecting %d\n",
-			ps.tf.trapno, T_SYSCALL);
+			ps->tf.trapno, T_SYSCALL);
+	}
+}
+
+void
+tjoin(uint16_t child)
+{
+	struct procstate ps;
+	tmerge(child, &ps);
+	malloc_join(child & 0xff);
+}
+
+// Wait at a barrier, in a child forked with tfork():
+// our parent's tbarrier_sync() merges in what each child has done since
+// the last barrier, and hands the merged result back to all of them.
+void
+tbarrier(void)
+{
+	uint32_t eax = SYS_RET | EXIT_BARRIER, ecx, edx;
+	asm volatile(SYS_ENTER
+		: "+a" (eax), "=c" (ecx), "=d" (edx)
+		:
+		: "cc", "memory");
+}
+
+// Wait for 'child' to stop and merge in its changes, as tjoin() does,
+// returning 1 if it stopped at a tbarrier() rather than finishing.
+// From a barrier it can continue with tresume(), or be dropped there.
+bool
+tjoinbarrier(uint16_t child)
+{
+	struct procstate ps;
+	tmerge(child, &ps);
+	if (!(ps.tf.regs.eax & EXIT_BARRIER)) {
+		malloc_join(child & 0xff);
+		return 0;
+	}
+	return 1;
+}
+
+// Continue a child that tjoinbarrier() found at a barrier,
+// without giving it our changes; what it has merged back so far
+// becomes the new snapshot it merges from.
+void
+tresume(uint16_t child)
+{
+	sys_put(SYS_SNAP | SYS_START, child, NULL, NULL, NULL, 0);
+}
+
+// Synchronize the 'n' children in 'child' at their next barrier.
+// Once we've merged in the changes of all of them, each one waiting at
+// a barrier gets a copy-on-write copy of our merged shared space,
+// with a new snapshot to merge from next time, and continues;
+// the same processes keep going, with their private stacks intact.
+// Children that returned without a barrier are simply joined, as by tjoin(),
+// and flagged in 'done' if it's non-null: don't sync or join them again.
+// Returns the number of children still running.
+int
+tbarrier_sync(const uint16_t *child, int n, bool *done)
+{
+	bool atbarrier[n];
+	int i, nrun = 0;
+	for (i = 0; i < n; i++)
+		atbarrier[i] = tjoinbarrier(child[i]);
+	for (i = 0; i < n; i++) {
+		if (atbarrier[i]) {
+			sys_put(SYS_COPY | SYS_SNAP | SYS_START, child[i], NULL,
+				SHAREVA, SHAREVA, SHARESIZE);
+			nrun++;
+		}
+		if (done)
+			done[i] = !atbarrier[i];
+	}
+	return nrun;
+}
+
+
+
+// Persistent worker pool built on tfork() and tjoin().
+// A worker forks only once, then parks in sys_ret() between jobs,
+// so each further job costs just a re-snapshot and the copy of the one
+// page holding the job and its inputs, instead of a whole fresh fork;
+// tjoin() merges a job's results back in as it does a forked thread's.
+// A worker sees our memory as of when it started, plus each job's inputs:
+// whatever else we change meanwhile it doesn't see.
+static struct tjob {
+	void	(*fn)(void *arg);	// Function for the worker to run
+	size_t	len;			// Length of its argument block
+	char	arg[TPOOL_ARGMAX];	// Copy of the argument block
+} tjob gcc_aligned(PAGESIZE);
+
+// Fork off child 'child' as a worker, parked waiting for a job.
+void
+tpool_start(uint16_t child)
+{
+	if (tfork(child)) {
+		malloc_persist(child & 0xff, 1);	// for all its jobs
+		return;
+	}
+	while (1) {
+		sys_ret();		// wait for tpool_run() or tpool_stop()
+
+		// Work on a copy of the job on our private stack,
+		// so our writes to it don't get merged back into tjob.
+		char arg[TPOOL_ARGMAX];
+		memmove(arg, tjob.arg, tjob.len);
+		tjob.fn(arg);
 	}
 }
 
+// Start worker 'child', parked since its last job, running fn(arg)
+// on its own copy of the 'len' bytes at 'arg'.
+void
+tpool_run(uint16_t child, void (*fn)(void *arg), const void *arg, size_t len)
+{
+	assert(len <= TPOOL_ARGMAX);
+	tjob.fn = fn;
+	tjob.len = len;
+	memmove(tjob.arg, arg, len);
+
+	// Snapshotting the worker anew makes the next tjoin() merge back
+	// only what this job writes, not what earlier jobs already did.
+	// If the worker is on another node, the job goes along with us.
+	sys_put(SYS_COPY | SYS_SNAP | SYS_START | SYS_PREFETCH, child, NULL,
+		&tjob, &tjob, sizeof(tjob));
+}
+
+// Shut down worker 'child', after tjoin(), and free its memory.
+void
+tpool_stop(uint16_t child)
+{
+	sys_put(SYS_ZERO, child, NULL, NULL, ALLVA, ALLSIZE);
+	malloc_persist(child & 0xff, 0);
+	malloc_join(child & 0xff);
+}
+
+
+// Structured parallelism on top of the above:
+// parallel_for() and parallel_reduce() over index ranges,
+// and recursive fork/join tasks with task_fork() and task_join().
+// Like any threads here, the parallel parts see our memory as of when
+// they start, and their results are merged back in when they finish,
+// so as long as they write disjoint locations the result is the same
+// no matter how the work happens to get spread among them.
+// Only what they write in the shared space, not on the stack, comes back,
+// and parallel loops don't nest (tasks can, within the child numbers).
+// Worker child numbers come from the same table as Unix fork()'s pids.
+
+int parallel_nodes;	// Nonzero to spread workers across remote nodes too
+static bool par_intask;	// Set in a task_fork() child
+
+// Reserve a free child number for a worker or task, or return -1.
+static int
+par_alloc(void)
+{
+	int cn = bitmap_nextclear(files->cbusy, PROC_CHILDREN, 1);
+	if (cn == PROC_CHILDREN)
+		return -1;
+	procinfo_setstate(files, cn, PROC_RESERVED);
+	return cn;
+}
+
+// Child argument to tfork() and friends for child number 'cn'.
+#define par_child(cn)	((parallel_nodes ? SYS_NODEANY << 8 : 0) | (cn))
+
+// One chunk of a parallel_for() or parallel_reduce(), as a worker's job.
+struct par_chunk {
+	int	lo, hi;			// Index range to run
+	void	(*fn)(int i, void *arg);	// Loop body, for parallel_for
+	long	(*rfn)(int i, void *arg);	// Or element, for parallel_reduce
+	long	(*op)(long a, long b);		// and combining operator
+	long	ident;			// Identity for 'op'
+	long	*result;		// Where to put the chunk's reduction
+	void	*arg;
+};
+
+static void
+par_runchunk(void *a)
+{
+	struct par_chunk *c = a;
+	int i;
+	if (c->fn != NULL) {
+		for (i = c->lo; i < c->hi; i++)
+			c->fn(i, c->arg);
+		return;
+	}
+	long r = c->ident;
+	for (i = c->lo; i < c->hi; i++)
+		r = c->op(r, c->rfn(i, c->arg));
+	*c->result = r;
+}
+
+// Run chunk number 'n' of 'nchunks' in 'c' on pool worker 'cn'.
+static void
+par_give(struct par_chunk *c, int n, int lo, int hi, int grain, int cn,
+	long *partial)
+{
+	struct par_chunk job = *c;
+	job.lo = lo + n * grain;
+	job.hi = MIN(job.lo + grain, hi);
+	job.result = &partial[n];
+	tpool_run(par_child(cn), par_runchunk, &job, sizeof(job));
+}
+
+// Split [lo,hi) into chunks of 'grain' indexes and run them on a pool
+// of up to PAR_WORKERS workers, handing each worker that finishes the
+// next chunk still left over.  Which worker that is may vary if we
+// run with PFF_NONDET, but since chunks merge back in independently,
+// the results don't.
+static void
+par_chunks(struct par_chunk *c, int lo, int hi, int grain, long *partial)
+{
+	int nchunks = (hi - lo + grain - 1) / grain;
+	int cn[PAR_WORKERS], nw, next = 0, w;
+	for (nw = 0; nw < MIN(PAR_WORKERS, nchunks); nw++)
+		if ((cn[nw] = par_alloc()) < 0)
+			break;
+	if (nw == 0) {		// No children free: just do it ourselves
+		for (next = 0; next < nchunks; next++) {
+			struct par_chunk job = *c;
+			job.lo = lo + next * grain;
+			job.hi = MIN(job.lo + grain, hi);
+			job.result = &partial[next];
+			par_runchunk(&job);
+		}
+		return;
+	}
+
+	bool busy[PAR_WORKERS];
+	for (w = 0; w < nw; w++) {
+		tpool_start(par_child(cn[w]));
+		par_give(c, next++, lo, hi, grain, cn[w], partial);
+		busy[w] = 1;
+	}
+	int nbusy = nw;
+	while (nbusy > 0) {
+		// Find a worker that's done (remote ones just in turn).
+		childset set;
+		memset(&set, 0, sizeof(set));
+		for (w = 0; w < nw; w++)
+			if (busy[w]) {
+				childset_add(&set, cn[w]);
+				if (parallel_nodes)
+					break;
+			}
+		if (!parallel_nodes)
+			sys_wait(0, &set);
+		for (w = 0; w < nw; w++)
+			if (busy[w] && childset_has(&set, cn[w]))
+				break;
+		assert(w < nw);
+
+		tjoin(par_child(cn[w]));
+		if (next < nchunks) {
+			par_give(c, next++, lo, hi, grain, cn[w], partial);
+			continue;
+		}
+		tpool_stop(par_child(cn[w]));
+		procinfo_setstate(files, cn[w], PROC_FREE);
+		busy[w] = 0;
+		nbusy--;
+	}
+}
+
+// Run node 'w' of a parallel_tree() of 'n' workers, and its subtree.
+// Node w's children are nodes 2w+1 and 2w+2, each forked into a child
+// of ours, so each worker merges in its own two subtrees' results
+// before it returns, and joining n workers takes O(log n) merges in turn
+// instead of n.  Child numbers come from our copy of the table,
+// and go back before we return so the table merges back unchanged.
+static void
+par_treenode(int w, int n, void (*fn)(int w, void *arg), void *arg)
+{
+	int sub[2], cn[2], i;
+	for (i = 0; i < 2; i++) {
+		sub[i] = 2 * w + 1 + i;
+		cn[i] = sub[i] < n ? par_alloc() : -1;
+		if (cn[i] >= 0 && !tfork(par_child(cn[i]))) {
+			par_treenode(sub[i], n, fn, arg);
+			sys_ret();
+		}
+	}
+	fn(w, arg);
+	for (i = 0; i < 2; i++) {
+		if (sub[i] >= n)
+			continue;
+		if (cn[i] < 0) {	// No child free: do the subtree ourselves
+			par_treenode(sub[i], n, fn, arg);
+			continue;
+		}
+		tjoin(par_child(cn[i]));
+		sys_put(SYS_ZERO, par_child(cn[i]), NULL, NULL, ALLVA, ALLSIZE);
+		procinfo_setstate(files, cn[i], PROC_FREE);
+	}
+}
+
+// Run fn(w, arg) for each w in [0,n), each in its own worker,
+// forking and joining the workers as a binary tree, as for wide fan-outs
+// where merging every worker's results into ours one by one would
+// keep the joins waiting on our CPU alone.
+// Node 0's work runs in line.
+void
+parallel_tree(int n, void (*fn)(int w, void *arg), void *arg)
+{
+	if (n > 0)
+		par_treenode(0, n, fn, arg);
+}
+
+// Run fn(i, arg) for each i in [lo,hi), in parallel
+// in chunks of 'grain' consecutive indexes.
+void
+parallel_for(int lo, int hi, int grain, void (*fn)(int i, void *arg),
+		void *arg)
+{
+	if (grain < 1)
+		grain = 1;
+	if (hi - lo <= grain) {
+		int i;
+		for (i = lo; i < hi; i++)
+			fn(i, arg);
+		return;
+	}
+	struct par_chunk c = { .fn = fn, .arg = arg };
+	long dummy[PAR_MAXCHUNKS];
+	grain = MAX(grain, (hi - lo + PAR_MAXCHUNKS - 1) / PAR_MAXCHUNKS);
+	par_chunks(&c, lo, hi, grain, dummy);
+}
+
+// Combine fn(i, arg) for all i in [lo,hi) with the associative 'op',
+// whose identity is 'ident', computing chunks of 'grain' in parallel.
+// The chunks' partial results get combined in index order,
+// so the result is the same however the chunks got scheduled.
+long
+parallel_reduce(int lo, int hi, int grain, long (*fn)(int i, void *arg),
+		long (*op)(long a, long b), long ident, void *arg)
+{
+	int i;
+	if (grain < 1)
+		grain = 1;
+	grain = MAX(grain, (hi - lo + PAR_MAXCHUNKS - 1) / PAR_MAXCHUNKS);
+	if (hi - lo <= grain) {
+		long r = ident;
+		for (i = lo; i < hi; i++)
+			r = op(r, fn(i, arg));
+		return r;
+	}
+	static long partial[PAR_MAXCHUNKS];	// merged back from workers
+	struct par_chunk c = { .rfn = fn, .op = op, .ident = ident,
+				.arg = arg };
+	par_chunks(&c, lo, hi, grain, partial);
+	long r = ident;
+	for (i = 0; i < (hi - lo + grain - 1) / grain; i++)
+		r = op(r, partial[i]);
+	return r;
+}
+
+// Run fn(arg) as a parallel task, which may fork tasks of its own;
+// returns a task number for task_join(), or -1 if there are no child
+// numbers free, in which case the task has already run in line.
+int
+task_fork(void (*fn)(void *arg), void *arg)
+{
+	int cn = par_alloc();
+	if (cn < 0) {
+		fn(arg);
+		return -1;
+	}
+	if (!tfork(par_child(cn))) {
+		par_intask = 1;
+		fn(arg);
+		sys_ret();
+	}
+	return cn;
+}
+
+// Wait for a task from task_fork() and merge in its results.
+void
+task_join(int task)
+{
+	if (task < 0)
+		return;		// ran in line
+	tjoin(par_child(task));
+	sys_put(SYS_ZERO, par_child(task), NULL, NULL, ALLVA, ALLSIZE);
+	procinfo_setstate(files, task, PROC_FREE);
+}
+
+// Wait at a barrier in a task, for the parent's next task_sync().
+// A task that task_fork() ran in line has no parent to wait for,
+// so it just goes on.
+void
+task_barrier(void)
+{
+	if (par_intask)
+		tbarrier();
+}
+
+// Bring the 'n' tasks in 'task' through their next barrier together,
+// as with tbarrier_sync(), returning the number still running.
+// Tasks that finished instead are joined and replaced with -1,
+// which later task_sync() and task_join() calls skip.
+int
+task_sync(int *task, int n)
+{
+	uint16_t child[n];
+	bool done[n];
+	int i, nc = 0, nrun;
+	for (i = 0; i < n; i++)
+		if (task[i] >= 0)
+			child[nc++] = par_child(task[i]);
+	nrun = tbarrier_sync(child, nc, done);
+	for (i = 0, nc = 0; i < n; i++)
+		if (task[i] >= 0 && done[nc++]) {
+			sys_put(SYS_ZERO, child[nc-1], NULL,
+				NULL, ALLVA, ALLSIZE);
+			procinfo_setstate(files, task[i], PROC_FREE);
+			task[i] = -1;
+		}
+	return nrun;
+}
@@ -10,12 +10,16 @@
 
 #include <inc/file.h>
 #include <inc/unistd.h>
+#include <inc/stat.h>
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/dirent.h>
 #include <inc/assert.h>
 #include <inc/stdarg.h>
 #include <inc/errno.h>
+#include <inc/syscall.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
 
 int
 creat(const char *path, mode_t mode)
@@ -66,6 +70,15 @@ write(int fn, const void *buf, size_t nbytes)
 	return filedesc_write(&files->fd[fn], buf, 1, nbytes);
 }
 
+// Copy file to file without going through a buffer, like Linux's sendfile().
+// Copying a whole file to an empty one takes just one virtual copy per 4MB.
+ssize_t
+sendfile(int outfn, int infn, off_t *offset, size_t count)
+{
+	return filedesc_sendfile(&files->fd[outfn], &files->fd[infn],
+				offset, count);
+}
+
 off_t
 lseek(int fn, off_t offset, int whence)
 {
@@ -93,6 +106,7 @@ dup2(int oldfn, int newfn)
 		close(newfn);
 
 	*newfd = *oldfd;
+	filedesc_setino(newfd, oldfd->ino);
 
 	return newfn;
 }
@@ -106,6 +120,36 @@ truncate(const char *path, off_t newlength)
 	return fileino_truncate(ino, newlength);
 }
 
+// Delete a file, or an empty directory.  Like a file that was never
+// created, it keeps its inode and name in the "deleted" state, mode 0,
+// and the version bump carries the deletion to our parent on reconcile.
+int
+remove(const char *path)
+{
+	int ino = dir_walk(path, 0);
+	if (ino < 0)
+		return -1;
+	fileinode *fi = &files->fi[ino];
+	if (ino < FILEINO_GENERAL) {
+		errno = EINVAL;		// not the console or root directory
+		return -1;
+	}
+	if (S_ISDIR(fi->mode)) {
+		dir_index(files);
+		int i;
+		for (i = fi->dfirst; i != 0; i = files->fi[i].dnext)
+			if (fileino_exists(i)) {
+				errno = ENOTEMPTY;
+				return -1;
+			}
+	} else if (fileino_truncate(ino, 0) < 0)
+		return -1;
+	fi->mode = 0;
+	fi->ver++;
+	fileino_dirty(files, ino);
+	return 0;
+}
+
 int
 ftruncate(int fn, off_t newlength)
 {
@@ -147,3 +191,223 @@ fsync(int fn)
 }
 
 
+// Memory-mapped file regions.
+// Most mappings point straight at the file's data in our file state area,
+// and the table just remembers shared writable ones for msync();
+// the rest are private copy-on-write copies of the file's pages,
+// allocated downwards from the top of the general-purpose space
+// to the top of the malloc() heap.
+#define MMAP_MAX	16
+
+static struct mmapping {
+	void	*va;		// Start of mapping, NULL if entry unused
+	size_t	len;		// Length of mapping
+	int	ino;		// Inode mapped if shared writable, else 0
+	off_t	ofs;		// Offset of mapping in that file
+	bool	copy;		// Mapping is a private copy
+} mmaps[MMAP_MAX];
+
+static void *mmapnext = (void*) VM_SHAREHI;	// Bottom of private copies
+
+// Space freed above mmapnext, coalesced into maximal free ranges.
+// There's at most one range below each live copy, mmap()'s or exec's,
+// so this many always suffice.
+#define MMAP_HOLES	(MMAP_MAX + 8)
+static struct mmaphole {
+	void	*va;		// Start of the free range, NULL if entry unused
+	size_t	len;		// Its length
+} mmapholes[MMAP_HOLES];
+
+
+// Reserve 'plen' page-aligned bytes of address space for a private copy,
+// mmap()'s or exec's (see lib/exec.c); returns NULL if there's no room.
+// Reuses freed space first, taking the smallest free range that fits.
+void *
+mmap_alloc(size_t plen)
+{
+	struct mmaphole *h, *best = NULL;
+	for (h = mmapholes; h < &mmapholes[MMAP_HOLES]; h++)
+		if (h->va != NULL && h->len >= plen
+				&& (best == NULL || h->len < best->len))
+			best = h;
+	if (best != NULL) {
+		void *va = best->va;
+		best->va += plen;
+		best->len -= plen;
+		if (best->len == 0)
+			best->va = NULL;
+		return va;
+	}
+
+	if (plen > mmapnext - (void*)VM_HEAPHI) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	mmapnext -= plen;
+	return mmapnext;
+}
+
+// Drop the pages of a private copy from mmap_alloc(), and reclaim its
+// space: merge it with any free ranges it adjoins, then return it to
+// the space below mmapnext if it lies just above that.
+void
+mmap_free(void *va, size_t plen)
+{
+	sys_get(SYS_ZERO, 0, NULL, NULL, va, plen);
+
+	struct mmaphole *h, *free = NULL;
+	for (h = mmapholes; h < &mmapholes[MMAP_HOLES]; h++) {
+		if (h->va == NULL) {
+			free = h;
+			continue;
+		}
+		if (h->va + h->len == va) {		// just below us
+			va = h->va;
+			plen += h->len;
+			h->va = NULL;
+			free = h;
+		} else if (va + plen == h->va) {	// just above us
+			plen += h->len;
+			h->va = NULL;
+			free = h;
+		}
+	}
+	if (va == mmapnext)
+		mmapnext += plen;
+	else {
+		assert(free != NULL);	// see MMAP_HOLES
+		free->va = va;
+		free->len = plen;
+	}
+}
+
+// Make a private copy-on-write copy of 'plen' bytes of file 'ino'
+// starting at page-aligned offset 'ofs', zero-filled past the file's end.
+static void *
+mmap_copy(int ino, off_t ofs, size_t plen, int prot)
+{
+	void *va = mmap_alloc(plen);
+	if (va == NULL)
+		return MAP_FAILED;
+
+	// SYS_COPY only copies between address spaces,
+	// so bounce each 4MB area's part through child 0, as exec() does.
+	sys_get(SYS_ZERO, 0, NULL, NULL, va, plen);
+	off_t fend = ROUNDUP(files->fi[ino].size, PAGESIZE);
+	size_t size = ofs < fend ? MIN(plen, fend - ofs) : 0, done = 0;
+	int s = fileino_slot(files, ino, ofs);
+	while (done < size) {
+		assert(s != 0);
+		size_t o = (ofs + done) % FILE_SLOTSIZE;
+		size_t n = MIN(size - done, FILE_SLOTSIZE - o);
+		sysop ops[2] = {
+			{ SYS_PUT | SYS_COPY, 0, NULL, FILEDATA(s) + o,
+				va + done, n },
+			{ SYS_GET | SYS_COPY, 0, NULL, va + done, va + done, n },
+		};
+		sys_batch(ops, 2);
+		done += n;
+		s = files->fi[s].next;
+	}
+	if (done > 0)
+		sys_put(SYS_ZERO, 0, NULL, NULL, va, done);
+	sys_get(SYS_PERM | SYS_READ | (prot & PROT_WRITE ? SYS_WRITE : 0),
+		0, NULL, NULL, va, plen);
+	return va;
+}
+
+// Map 'len' bytes of the regular file open on 'fn' starting at 'ofs',
+// which must be page-aligned, into our address space.
+// Since the file's data is already mapped in our file state area,
+// read-only and shared mappings just return a pointer into it,
+// so reading through them costs no copy at all;
+// a shared writable mapping grows the file to cover the whole range.
+// A private writable mapping gets its own copy-on-write copy of the pages,
+// as do read-only mappings of files whose 4MB areas aren't contiguous.
+// 'addr' is only a hint, and like PROT_EXEC and PROT_NONE we ignore it:
+// a pointer into the file does permit writes, so don't write through
+// a read-only mapping.
+void *
+mmap(void *addr, size_t len, int prot, int flags, int fn, off_t ofs)
+{
+	filedesc *fd = &files->fd[fn];
+	int type = flags & MAP_TYPE;
+	bool wshared = type == MAP_SHARED && (prot & PROT_WRITE);
+	if (fn < 0 || fn >= OPEN_MAX || !filedesc_isopen(fd)
+			|| !fileino_isreg(fd->ino) || !filedesc_isreadable(fd)
+			|| (wshared && !filedesc_iswritable(fd))
+			|| (type != MAP_SHARED && type != MAP_PRIVATE)
+			|| len == 0 || ofs < 0 || PGOFF(ofs) != 0) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	struct mmapping *m;
+	for (m = mmaps; m->va != NULL; m++)
+		if (m == &mmaps[MMAP_MAX-1]) {
+			errno = ENOMEM;
+			return MAP_FAILED;
+		}
+
+	void *va = NULL;
+	if (type == MAP_SHARED || !(prot & PROT_WRITE)) {
+		va = fileino_map(fd->ino, ofs, len, wshared);
+		if (va == NULL && wshared)
+			return MAP_FAILED;
+	}
+	m->copy = va == NULL;
+	if (m->copy) {
+		va = mmap_copy(fd->ino, ofs, ROUNDUP(len, PAGESIZE), prot);
+		if (va == MAP_FAILED)
+			return MAP_FAILED;
+	}
+	m->va = va;
+	m->len = len;
+	m->ino = wshared ? fd->ino : 0;
+	m->ofs = ofs;
+	return va;
+}
+
+static struct mmapping *
+mmap_lookup(void *addr)
+{
+	struct mmapping *m;
+	for (m = mmaps; m < &mmaps[MMAP_MAX]; m++)
+		if (m->va != NULL && m->va == addr)
+			return m;
+	errno = EINVAL;
+	return NULL;
+}
+
+// Writes through a shared mapping bypass fileino_write(),
+// so here we log the whole mapped range as rewritten, for reconciliation:
+// a child's or parent's changes through a mapping reach the other side
+// at the first fork, wait, or sys_ret() after the next msync() or munmap().
+// Only whole mappings can be synced, so 'len' is ignored.
+int
+msync(void *addr, size_t len, int flags)
+{
+	struct mmapping *m = mmap_lookup(addr);
+	if (m == NULL)
+		return -1;
+	if (m->ino != 0 && fileino_isreg(m->ino)) {
+		off_t hi = MIN(m->ofs + m->len, files->fi[m->ino].size);
+		if (hi > m->ofs) {
+			fileino_logwrite(files, m->ino, m->ofs, hi);
+			fileino_dirty(files, m->ino);
+		}
+	}
+	return 0;
+}
+
+// Only whole mappings can be unmapped, so 'len' is ignored.
+int
+munmap(void *addr, size_t len)
+{
+	struct mmapping *m = mmap_lookup(addr);
+	if (m == NULL || msync(addr, len, MS_SYNC) < 0)
+		return -1;
+	if (m->copy)
+		mmap_free(m->va, ROUNDUP(m->len, PAGESIZE));
+	m->va = NULL;
+	return 0;
+}
@@ -0,0 +1,615 @@
+/*
+ * Microbenchmarks for the PIOS kernel and user-space runtime.
+ *
+ * Each result is one line on standard output, for scripts to collect:
+ *
+ *	bench <name> size=<bytes> iters=<n> cycles=<per iteration>
+ *
+ * with cycles measured by rdtsc, and size 0 where it doesn't apply.
+ * With no arguments, runs every benchmark but "migr", which needs
+ * a second node; otherwise runs just the ones named on the command line.
+ * "bench migr [home remote]" measures migration between nodes
+ * 'home' (where we're running, node 1 by default) and 'remote' (node 2).
+ *
+ * "bench sort" and "bench matmult" are scalable versions of testvm's
+ * parallel quicksort and matrix multiply, taking options
+ *
+ *	-s size		ints to sort, or rows and columns of the matrices
+ *	-w workers	most workers to try
+ *	-n node,...	nodes to spread workers over, starting with ours;
+ *			0, the default, means the forking thread's own node
+ *
+ * They run with 1, 2, 4, ... up to the given number of workers,
+ * over the first 1, 2, ... of the nodes, each run reporting
+ *
+ *	bench <name> size=<n> workers=<n> nodes=<n> cycles=<wall time>
+ *		merge=<cycles, all merges> conflicts=<bytes> eff=<percent>
+ *		instrs=<n> llcmiss=<n> dtlbmiss=<n>
+ *
+ * (on one line), where eff is the speedup over one worker per worker,
+ * and the last three are the workers' hardware performance counts
+ * (see SYS_PMC), zero where the CPU has no PMU to count them.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/unistd.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/file.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+#include <inc/parallel.h>
+
+#define CN		(PROC_CHILDREN-1)	// Child for our own use,
+						// out of fork()'s way
+// Scratch memory region for the memory benchmarks,
+// above program data and below the malloc() heap.
+#define BUFVA		((uint8_t*) 0x50000000)
+#define BUFMAX		(16 << 20)
+
+#define BENCHFILE	"/benchfile"
+
+#define SHAREVA		((void*) VM_SHARELO)
+#define SHARESIZE	(VM_SHAREHI - VM_SHARELO)
+
+#define MAXWORKERS	64
+#define MAXNODES	16
+
+static int nodes[MAXNODES];		// Nodes to put workers on
+static int nnodes = 1;
+static int usenodes;			// How many of them this run uses
+
+// Merge statistics, one slot per worker so workers never write the same
+// bytes: a worker merging in its own workers adds to its slot.
+static struct wstat {
+	uint64_t	merge;		// Cycles spent merging
+	uint32_t	conflicts;	// Bytes in conflict
+	pmcstats	pmc;		// Joined workers' performance counts
+} wstat[2*MAXWORKERS];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: bench [name ...]\n"
+			"       bench migr [home remote]\n"
+			"       bench sort|matmult [-s size] [-w workers] "
+			"[-n node,...]\n");
+	exit(1);
+}
+
+static void
+report(const char *name, size_t size, int iters, uint64_t cycles)
+{
+	printf("bench %s size=%u iters=%d cycles=%llu\n",
+		name, size, iters, cycles / iters);
+}
+
+static void
+migrate(int node)
+{
+	sys_get(0, node << 8, NULL, NULL, NULL, 0);
+}
+
+// Make our scratch region fresh zero pages: mapped, but not yet written.
+static void
+freshbuf(void)
+{
+	sys_get(SYS_ZERO | SYS_PERM | SYS_RW, 0, NULL, NULL, BUFVA, BUFMAX);
+}
+
+// Write a byte to each of the first 'npages' pages of our scratch region.
+static void
+touch(int npages)
+{
+	int i;
+	for (i = 0; i < npages; i++)
+		BUFVA[i * PAGESIZE]++;
+}
+
+// A system call that does no work: a GET from a child that's stopped.
+static void
+nullsys(void)
+{
+	const int iters = 10000;
+	sys_put(SYS_ZERO, CN, NULL, NULL, BUFVA, PAGESIZE);
+	uint64_t t0 = rdtsc();
+	int i;
+	for (i = 0; i < iters; i++)
+		sys_get(0, CN, NULL, NULL, NULL, 0);
+	report("nullsys", 0, iters, rdtsc() - t0);
+}
+
+// Start a child and wait for it to stop again.
+static void
+putget(void)
+{
+	const int iters = 1000;
+	if (!tfork(CN))
+		for (;;)
+			sys_ret();
+	sys_get(0, CN, NULL, NULL, NULL, 0);	// let it get to its loop
+	uint64_t t0 = rdtsc();
+	int i;
+	for (i = 0; i < iters; i++) {
+		sys_put(SYS_START, CN, NULL, NULL, NULL, 0);
+		sys_get(0, CN, NULL, NULL, NULL, 0);
+	}
+	report("putget", 0, iters, rdtsc() - t0);
+	sys_put(SYS_ZERO, CN, NULL, NULL, (void*) VM_USERLO,
+		VM_USERHI - VM_USERLO);
+}
+
+// Write to pages we've shared copy-on-write with a child.
+static void
+cowfault(void)
+{
+	const int npages = 1024;
+	freshbuf();
+	touch(npages);
+	sys_put(SYS_COPY, CN, NULL, BUFVA, BUFVA, npages * PAGESIZE);
+	uint64_t t0 = rdtsc();
+	touch(npages);
+	report("cowfault", PAGESIZE, npages, rdtsc() - t0);
+}
+
+// Copy regions of various sizes into a child.
+static void
+copy(void)
+{
+	size_t size;
+	freshbuf();
+	touch(BUFMAX / PAGESIZE);
+	for (size = PAGESIZE; size <= BUFMAX; size *= 4) {
+		const int iters = 16;
+		uint64_t t0 = rdtsc();
+		int i;
+		for (i = 0; i < iters; i++)
+			sys_put(SYS_COPY, CN, NULL, BUFVA, BUFVA, size);
+		report("copy", size, iters, rdtsc() - t0);
+	}
+}
+
+// Merge back a child's changes to regions of various sizes,
+// with various fractions (in 1/8ths) of their pages dirty.
+static void
+merge(void)
+{
+	size_t size;
+	freshbuf();
+	touch(BUFMAX / PAGESIZE);
+	for (size = 16 * PAGESIZE; size <= BUFMAX; size *= 4) {
+		int eighths;
+		for (eighths = 0; eighths <= 8; eighths += 2) {
+			int npages = size / PAGESIZE * eighths / 8;
+			if (!tfork(CN)) {
+				int i;
+				for (i = 0; i < npages; i++)	// spread out
+					BUFVA[i * 8 / eighths * PAGESIZE]++;
+				sys_ret();
+			}
+			sys_get(0, CN, NULL, NULL, NULL, 0);
+
+			uint64_t t0 = rdtsc();
+			sys_get(SYS_MERGE, CN, NULL, BUFVA, BUFVA, size);
+			char name[32];
+			sprintf(name, "merge%d/8", eighths);
+			report(name, size, 1, rdtsc() - t0);
+		}
+	}
+}
+
+// Fork a Unix process that exits straight away, and wait for it.
+static void
+forkwait(void)
+{
+	const int iters = 100;
+	uint64_t t0 = rdtsc();
+	int i;
+	for (i = 0; i < iters; i++) {
+		pid_t pid = fork();
+		if (pid == 0)
+			exit(0);
+		assert(pid > 0);
+		waitpid(pid, NULL, 0);
+	}
+	report("forkwait", 0, iters, rdtsc() - t0);
+}
+
+// Run a program that exits straight away, by fork+exec and by spawn.
+static void
+exec(void)
+{
+	const int iters = 50;
+	uint64_t t0 = rdtsc();
+	int i;
+	for (i = 0; i < iters; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			execl("bench", "bench", "exit", NULL);
+			exit(1);
+		}
+		assert(pid > 0);
+		waitpid(pid, NULL, 0);
+	}
+	report("forkexec", 0, iters, rdtsc() - t0);
+
+	t0 = rdtsc();
+	for (i = 0; i < iters; i++) {
+		pid_t pid = spawnl("bench", "bench", "exit", NULL);
+		assert(pid > 0);
+		waitpid(pid, NULL, 0);
+	}
+	report("spawn", 0, iters, rdtsc() - t0);
+}
+
+// Write and read back a file in chunks of various sizes.
+static void
+file(void)
+{
+	const size_t total = 1 << 20;
+	size_t chunk;
+	freshbuf();
+	touch(BUFMAX / PAGESIZE);
+	for (chunk = 64; chunk <= 64 * 1024; chunk *= 4) {
+		int iters = total / chunk, i;
+		int fd = open(BENCHFILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		assert(fd >= 0);
+		uint64_t t0 = rdtsc();
+		for (i = 0; i < iters; i++)
+			assert(write(fd, BUFVA, chunk) == chunk);
+		report("write", chunk, iters, rdtsc() - t0);
+		close(fd);
+
+		fd = open(BENCHFILE, O_RDONLY);
+		assert(fd >= 0);
+		t0 = rdtsc();
+		for (i = 0; i < iters; i++)
+			assert(read(fd, BUFVA, chunk) == chunk);
+		report("read", chunk, iters, rdtsc() - t0);
+		close(fd);
+	}
+	close(open(BENCHFILE, O_WRONLY | O_TRUNC));
+}
+
+
+// Migrate to another node and back, and pull pages from home while away.
+static void
+migr(int home, int remote)
+{
+	const int iters = 20, npages = 256;
+	uint64_t t0 = rdtsc();
+	int i;
+	for (i = 0; i < iters; i++) {
+		migrate(remote);
+		migrate(home);
+	}
+	report("migrate", 0, iters, rdtsc() - t0);
+
+	freshbuf();
+	touch(npages);
+	migrate(remote);
+	t0 = rdtsc();
+	touch(npages);		// each first touch pulls the page from home
+	uint64_t t1 = rdtsc();
+	migrate(home);
+	report("pull", PAGESIZE, npages, t1 - t0);
+}
+
+// Child number 'cn' of ours, on the node for worker 'w'.
+// Workers are numbered from 1: child 0 is reserved for exec().
+static uint16_t
+wchild(int w, int cn)
+{
+	return nodes[w % usenodes] << 8 | cn;
+}
+
+// Wait for a worker to finish, then merge in its changes as tjoin() does,
+// adding the merge's time and conflicts to the stats for worker 'w'.
+static void
+wjoin(uint16_t child, int w)
+{
+	struct procstate ps;
+	sys_get(0, child, NULL, NULL, NULL, 0);
+	uint64_t t0 = rdtsc();
+	sys_get(SYS_MERGE | SYS_REGS, child, &ps, SHAREVA, SHAREVA, SHARESIZE);
+	wstat[w].merge += rdtsc() - t0;
+	wstat[w].conflicts += ps.merge.conflicts;
+	int i;
+	for (i = 0; i < PMC_N; i++)
+		wstat[w].pmc.count[i] += ps.pmc.count[i];
+	assert(ps.tf.trapno == T_SYSCALL);
+}
+
+static uint32_t seed;
+
+static uint32_t
+rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 1;
+}
+
+#define swapints(a,b) ({ int t = (a); (a) = (b); (b) = t; })
+
+// Quicksort as testvm's pqsort() does it, as worker 'w' with 'nw' workers:
+// the two halves go to two new workers with half as many each,
+// down to one worker each, which sorts its part by itself.
+static void
+psort(int *lo, int *hi, int w, int nw)
+{
+	if (lo >= hi)
+		return;
+
+	int pivot = *lo;
+	int *l = lo+1, *h = hi;
+	while (l <= h) {
+		if (*l < pivot)
+			l++;
+		else if (*h > pivot)
+			h--;
+		else
+			swapints(*h, *l), l++, h--;
+	}
+	swapints(*lo, l[-1]);
+
+	if (nw <= 1) {
+		psort(lo, l-2, w, 1);
+		psort(h+1, hi, w, 1);
+		return;
+	}
+	uint16_t c1 = wchild(2*w+1, 1), c2 = wchild(2*w+2, 2);
+	if (!tfork(c1)) {
+		psort(lo, l-2, 2*w+1, nw/2);
+		sys_ret();
+	}
+	if (!tfork(c2)) {
+		psort(h+1, hi, 2*w+2, nw - nw/2);
+		sys_ret();
+	}
+	wjoin(c1, w);
+	wjoin(c2, w);
+}
+
+static void
+sortsetup(int n)
+{
+	int *a = (int*) BUFVA, i;
+	seed = n;
+	for (i = 0; i < n; i++)
+		a[i] = rnd();
+}
+
+static void
+sortrun(int n, int nw)
+{
+	int *a = (int*) BUFVA;
+	psort(&a[0], &a[n-1], 0, nw);
+}
+
+static uint32_t
+sortcheck(int n)
+{
+	int *a = (int*) BUFVA, i;
+	uint32_t sum = 0;
+	for (i = 0; i < n; i++) {
+		assert(i == 0 || a[i-1] <= a[i]);
+		sum += a[i];
+	}
+	return sum;
+}
+
+// Compute rows lo through hi-1 of c = a * b, for n-by-n matrices.
+static void
+mmrows(const int *a, const int *b, int *c, int n, int lo, int hi)
+{
+	int i, j, k;
+	for (i = lo; i < hi; i++) {
+		int *ci = &c[i*n];
+		memset(ci, 0, n * sizeof(int));
+		for (k = 0; k < n; k++) {
+			int aik = a[i*n+k];
+			const int *bk = &b[k*n];
+			for (j = 0; j < n; j++)
+				ci[j] += aik * bk[j];
+		}
+	}
+}
+
+static void
+mmsetup(int n)
+{
+	int *a = (int*) BUFVA, i;
+	seed = n;
+	for (i = 0; i < 2*n*n; i++)		// a and b
+		a[i] = rnd() % 256;
+}
+
+// Matrix multiply, a band of rows of the result per worker.
+static void
+mmrun(int n, int nw)
+{
+	int *a = (int*) BUFVA, *b = a + n*n, *c = b + n*n;
+	int w;
+	if (nw == 1)
+		mmrows(a, b, c, n, 0, n);
+	else {
+		for (w = 0; w < nw; w++)
+			if (!tfork(wchild(w, 1+w))) {
+				mmrows(a, b, c, n, w*n/nw, (w+1)*n/nw);
+				sys_ret();
+			}
+		for (w = 0; w < nw; w++)
+			wjoin(wchild(w, 1+w), 0);
+	}
+}
+
+static uint32_t
+mmcheck(int n)
+{
+	int *c = (int*) BUFVA + 2*n*n, i;
+	uint32_t sum = 0;
+	for (i = 0; i < n*n; i++)
+		sum = sum * 31 + c[i];
+	return sum;
+}
+
+static const struct {
+	const char *name;
+	void (*setup)(int size);	// Fill in the input
+	void (*run)(int size, int nw);	// Compute, with 'nw' workers
+	uint32_t (*check)(int size);	// Check and checksum the output
+	int defsize;
+	int maxsize;
+} scaled[] = {
+	{ "sort", sortsetup, sortrun, sortcheck, 1 << 20, BUFMAX / 4 },
+	{ "matmult", mmsetup, mmrun, mmcheck, 256, 1024 },
+};
+#define NSCALED		(sizeof(scaled) / sizeof(scaled[0]))
+
+// Run scaled benchmark 's' with ever more workers and nodes.
+static void
+scale(int s, int size, int maxw)
+{
+	uint64_t base = 0;
+	uint32_t check = 0;
+	int nw;
+	for (usenodes = 1; usenodes <= nnodes; usenodes++)
+		for (nw = 1; nw <= maxw; nw = nw < maxw && nw*2 > maxw ?
+						maxw : nw*2) {
+			if (nw < usenodes)
+				continue;
+			freshbuf();
+			scaled[s].setup(size);
+			memset(wstat, 0, sizeof(wstat));
+
+			uint64_t t0 = rdtsc();
+			scaled[s].run(size, nw);
+			if (usenodes > 1)
+				migrate(nodes[0]);	// for our own clock
+			uint64_t cycles = rdtsc() - t0;
+
+			uint32_t sum = scaled[s].check(size);
+			if (base == 0)
+				base = cycles, check = sum;
+			assert(sum == check);
+			uint64_t merge = 0;
+			uint32_t conflicts = 0;
+			pmcstats pmc;
+			memset(&pmc, 0, sizeof(pmc));
+			int i, j;
+			for (i = 0; i < 2*MAXWORKERS; i++) {
+				merge += wstat[i].merge;
+				conflicts += wstat[i].conflicts;
+				for (j = 0; j < PMC_N; j++)
+					pmc.count[j] += wstat[i].pmc.count[j];
+			}
+			printf("bench %s size=%d workers=%d nodes=%d "
+				"cycles=%llu merge=%llu conflicts=%u eff=%u "
+				"instrs=%llu llcmiss=%llu dtlbmiss=%llu\n",
+				scaled[s].name, size, nw, usenodes, cycles,
+				merge, conflicts,
+				(uint32_t) (base * 100 / (cycles * nw)),
+				pmc.count[PMC_INSTRS], pmc.count[PMC_LLCMISS],
+				pmc.count[PMC_DTLBMISS]);
+			if (nw == maxw)
+				break;
+		}
+}
+
+// Parse a decimal number from '*s', leaving '*s' just after it.
+static int
+parsenum(char **s)
+{
+	int n = 0;
+	if (**s < '0' || **s > '9')
+		usage();
+	while (**s >= '0' && **s <= '9')
+		n = n * 10 + *(*s)++ - '0';
+	if (**s != ',' && **s != 0)
+		usage();
+	return n;
+}
+
+// Parse the options for scaled benchmark 's', then run it.
+static void
+scaleopts(int s, int argc, char **argv)
+{
+	int size = scaled[s].defsize, maxw = PAR_WORKERS;
+	while (argc >= 2 && argv[0][0] == '-') {
+		char *p = argv[1];
+		if (strcmp(argv[0], "-s") == 0)
+			size = parsenum(&p);
+		else if (strcmp(argv[0], "-w") == 0)
+			maxw = parsenum(&p);
+		else if (strcmp(argv[0], "-n") == 0) {
+			nnodes = 0;
+			do {
+				if (nnodes == MAXNODES)
+					usage();
+				nodes[nnodes++] = parsenum(&p);
+			} while (*p && *p++ == ',');
+		} else
+			usage();
+		if (*p)
+			usage();
+		argc -= 2, argv += 2;
+	}
+	if (argc != 0 || size < 2 || size > scaled[s].maxsize ||
+			maxw < 1 || maxw > MAXWORKERS || nnodes > maxw)
+		usage();
+	scale(s, size, maxw);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} benches[] = {
+	{ "nullsys",	nullsys },
+	{ "putget",	putget },
+	{ "cowfault",	cowfault },
+	{ "copy",	copy },
+	{ "merge",	merge },
+	{ "forkwait",	forkwait },
+	{ "exec",	exec },
+	{ "file",	file },
+};
+#define NBENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+int
+main(int argc, char **argv)
+{
+	int i, j;
+	if (argc > 1 && strcmp(argv[1], "exit") == 0)
+		return 0;		// for the exec benchmarks
+	if (argc > 1 && strcmp(argv[1], "migr") == 0) {
+		migr(argc > 2 ? argv[2][0] - '0' : 1,
+			argc > 3 ? argv[3][0] - '0' : 2);
+		return 0;
+	}
+	for (i = 0; i < NSCALED; i++)
+		if (argc > 1 && strcmp(argv[1], scaled[i].name) == 0) {
+			scaleopts(i, argc - 2, argv + 2);
+			return 0;
+		}
+	for (i = 0; i < NBENCHES; i++) {
+		for (j = 1; j < argc; j++)
+			if (strcmp(argv[j], benches[i].name) == 0)
+				break;
+		if (argc == 1 || j < argc)
+			benches[i].fn();
+	}
+	if (argc == 1)
+		for (i = 0; i < NSCALED; i++)
+			scale(i, scaled[i].defsize, PAR_WORKERS);
+	sys_put(SYS_ZERO, CN, NULL, NULL, (void*) VM_USERLO,
+		VM_USERHI - VM_USERLO);
+	sys_get(SYS_ZERO, 0, NULL, NULL, BUFVA, BUFMAX);
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Simple Unix-like program to copy a file.
+ * Copies file to file with sendfile(), so the copy is copy-on-write:
+ * it takes one virtual copy per 4MB of file, no matter what's in it.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/unistd.h>
+#include <inc/assert.h>
+#include <inc/errno.h>
+#include <inc/stat.h>
+
+int
+main(int argc, char **argv)
+{
+	struct stat st;
+	int f, t;
+	ssize_t n;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: cp from to\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((f = open(argv[1], O_RDONLY)) < 0)
+		panic("can't open %s: %s", argv[1], strerror(errno));
+	if (fstat(f, &st) < 0 || !S_ISREG(st.st_mode))
+		panic("%s is not a regular file", argv[1]);
+	if ((t = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		panic("can't create %s: %s", argv[2], strerror(errno));
+
+	if ((n = sendfile(t, f, NULL, st.st_size)) != st.st_size)
+		panic("error copying %s to %s: %s", argv[1], argv[2],
+			strerror(errno));
+	close(t);
+	close(f);
+	return 0;
+}
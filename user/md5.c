@@ -6,6 +6,7 @@
  */
 
 #include <string.h>
+#include <x86.h>
 
 #include "md5.h"
 
@@ -30,6 +31,7 @@
 #define S44 21
 
 static void MD5Transform(uint32_t[4], unsigned char[64]);
+static void MD5TransformWords(uint32_t[4], uint32_t[16]);
 static void Encode(unsigned char *, uint32_t *, unsigned int);
 static void Decode(uint32_t *, unsigned char *, unsigned int);
 
@@ -77,6 +79,84 @@ static unsigned char PADDING[64] = {
  (a) += (b); \
   }
 
+/*
+ * The 64 steps of the MD5 block transformation, shared by MD5Transform
+ * and the multi-lane MD5ShortLanes below, where each variable is a vector.
+ */
+#define MD5_STEPS(a, b, c, d, x) { \
+	/* Round 1 */ \
+	FF(a, b, c, d, x[0], S11, 0xd76aa478);	/* 1 */ \
+	FF(d, a, b, c, x[1], S12, 0xe8c7b756);	/* 2 */ \
+	FF(c, d, a, b, x[2], S13, 0x242070db);	/* 3 */ \
+	FF(b, c, d, a, x[3], S14, 0xc1bdceee);	/* 4 */ \
+	FF(a, b, c, d, x[4], S11, 0xf57c0faf);	/* 5 */ \
+	FF(d, a, b, c, x[5], S12, 0x4787c62a);	/* 6 */ \
+	FF(c, d, a, b, x[6], S13, 0xa8304613);	/* 7 */ \
+	FF(b, c, d, a, x[7], S14, 0xfd469501);	/* 8 */ \
+	FF(a, b, c, d, x[8], S11, 0x698098d8);	/* 9 */ \
+	FF(d, a, b, c, x[9], S12, 0x8b44f7af);	/* 10 */ \
+	FF(c, d, a, b, x[10], S13, 0xffff5bb1);	/* 11 */ \
+	FF(b, c, d, a, x[11], S14, 0x895cd7be);	/* 12 */ \
+	FF(a, b, c, d, x[12], S11, 0x6b901122);	/* 13 */ \
+	FF(d, a, b, c, x[13], S12, 0xfd987193);	/* 14 */ \
+	FF(c, d, a, b, x[14], S13, 0xa679438e);	/* 15 */ \
+	FF(b, c, d, a, x[15], S14, 0x49b40821);	/* 16 */ \
+ \
+	/* Round 2 */ \
+	GG(a, b, c, d, x[1], S21, 0xf61e2562);	/* 17 */ \
+	GG(d, a, b, c, x[6], S22, 0xc040b340);	/* 18 */ \
+	GG(c, d, a, b, x[11], S23, 0x265e5a51);	/* 19 */ \
+	GG(b, c, d, a, x[0], S24, 0xe9b6c7aa);	/* 20 */ \
+	GG(a, b, c, d, x[5], S21, 0xd62f105d);	/* 21 */ \
+	GG(d, a, b, c, x[10], S22, 0x2441453);	/* 22 */ \
+	GG(c, d, a, b, x[15], S23, 0xd8a1e681);	/* 23 */ \
+	GG(b, c, d, a, x[4], S24, 0xe7d3fbc8);	/* 24 */ \
+	GG(a, b, c, d, x[9], S21, 0x21e1cde6);	/* 25 */ \
+	GG(d, a, b, c, x[14], S22, 0xc33707d6);	/* 26 */ \
+	GG(c, d, a, b, x[3], S23, 0xf4d50d87);	/* 27 */ \
+	GG(b, c, d, a, x[8], S24, 0x455a14ed);	/* 28 */ \
+	GG(a, b, c, d, x[13], S21, 0xa9e3e905);	/* 29 */ \
+	GG(d, a, b, c, x[2], S22, 0xfcefa3f8);	/* 30 */ \
+	GG(c, d, a, b, x[7], S23, 0x676f02d9);	/* 31 */ \
+	GG(b, c, d, a, x[12], S24, 0x8d2a4c8a);	/* 32 */ \
+ \
+	/* Round 3 */ \
+	HH(a, b, c, d, x[5], S31, 0xfffa3942);	/* 33 */ \
+	HH(d, a, b, c, x[8], S32, 0x8771f681);	/* 34 */ \
+	HH(c, d, a, b, x[11], S33, 0x6d9d6122);	/* 35 */ \
+	HH(b, c, d, a, x[14], S34, 0xfde5380c);	/* 36 */ \
+	HH(a, b, c, d, x[1], S31, 0xa4beea44);	/* 37 */ \
+	HH(d, a, b, c, x[4], S32, 0x4bdecfa9);	/* 38 */ \
+	HH(c, d, a, b, x[7], S33, 0xf6bb4b60);	/* 39 */ \
+	HH(b, c, d, a, x[10], S34, 0xbebfbc70);	/* 40 */ \
+	HH(a, b, c, d, x[13], S31, 0x289b7ec6);	/* 41 */ \
+	HH(d, a, b, c, x[0], S32, 0xeaa127fa);	/* 42 */ \
+	HH(c, d, a, b, x[3], S33, 0xd4ef3085);	/* 43 */ \
+	HH(b, c, d, a, x[6], S34, 0x4881d05);	/* 44 */ \
+	HH(a, b, c, d, x[9], S31, 0xd9d4d039);	/* 45 */ \
+	HH(d, a, b, c, x[12], S32, 0xe6db99e5);	/* 46 */ \
+	HH(c, d, a, b, x[15], S33, 0x1fa27cf8);	/* 47 */ \
+	HH(b, c, d, a, x[2], S34, 0xc4ac5665);	/* 48 */ \
+ \
+	/* Round 4 */ \
+	II(a, b, c, d, x[0], S41, 0xf4292244);	/* 49 */ \
+	II(d, a, b, c, x[7], S42, 0x432aff97);	/* 50 */ \
+	II(c, d, a, b, x[14], S43, 0xab9423a7);	/* 51 */ \
+	II(b, c, d, a, x[5], S44, 0xfc93a039);	/* 52 */ \
+	II(a, b, c, d, x[12], S41, 0x655b59c3);	/* 53 */ \
+	II(d, a, b, c, x[3], S42, 0x8f0ccc92);	/* 54 */ \
+	II(c, d, a, b, x[10], S43, 0xffeff47d);	/* 55 */ \
+	II(b, c, d, a, x[1], S44, 0x85845dd1);	/* 56 */ \
+	II(a, b, c, d, x[8], S41, 0x6fa87e4f);	/* 57 */ \
+	II(d, a, b, c, x[15], S42, 0xfe2ce6e0);	/* 58 */ \
+	II(c, d, a, b, x[6], S43, 0xa3014314);	/* 59 */ \
+	II(b, c, d, a, x[13], S44, 0x4e0811a1);	/* 60 */ \
+	II(a, b, c, d, x[4], S41, 0xf7537e82);	/* 61 */ \
+	II(d, a, b, c, x[11], S42, 0xbd3af235);	/* 62 */ \
+	II(c, d, a, b, x[2], S43, 0x2ad7d2bb);	/* 63 */ \
+	II(b, c, d, a, x[9], S44, 0xeb86d391);	/* 64 */ \
+  }
+
 /*
  * MD5 initialization. Begins an MD5 operation, writing a new context.
  */
@@ -168,6 +248,177 @@ MD5Final(digest, context)
 	memset(context, 0, sizeof(*context));
 }
 
+/*
+ * Multi-lane MD5 for short messages.  Each message of MD5_SHORTMAX bytes
+ * or less fits with its padding and length in one block, so hashing it is
+ * just one transformation from the initial state.  MD5ShortLanes does
+ * MD5_LANES of those at once with SSE2, one message per 32-bit lane.
+ * The AVX2 8-lane version would need the kernel to enable AVX state
+ * saving (XSAVE), which PIOS doesn't, so this stops at SSE2.
+ */
+typedef uint32_t md5vec __attribute__((vector_size(16)));
+
+static int md5sse2;		/* CPU has SSE2 */
+
+/*
+ * Check for SSE2 once, before any threads fork.
+ */
+void
+MD5ShortInit(void)
+{
+	cpuinfo inf;
+	cpuid(1, &inf);
+	md5sse2 = (inf.edx & (1 << 26)) != 0;
+}
+
+/*
+ * Transform the initial state by the MD5_LANES blocks whose words are
+ * interleaved in 'in', leaving the lanes' states interleaved in 'out'.
+ * Our caller's stack may not be 16-byte aligned, as vectors need.
+ */
+static void __attribute__((target("sse2"), force_align_arg_pointer))
+MD5ShortLanes(out, in)
+	uint32_t        out[4][MD5_LANES];
+	uint32_t        in[16][MD5_LANES];
+{
+	md5vec          x[16], st[4], a, b, c, d;
+
+	memcpy(x, in, sizeof(x));
+	a = st[0] = (md5vec) {0x67452301, 0x67452301, 0x67452301, 0x67452301};
+	b = st[1] = (md5vec) {0xefcdab89, 0xefcdab89, 0xefcdab89, 0xefcdab89};
+	c = st[2] = (md5vec) {0x98badcfe, 0x98badcfe, 0x98badcfe, 0x98badcfe};
+	d = st[3] = (md5vec) {0x10325476, 0x10325476, 0x10325476, 0x10325476};
+
+	MD5_STEPS(a, b, c, d, x);
+
+	st[0] += a;
+	st[1] += b;
+	st[2] += c;
+	st[3] += d;
+	memcpy(out, st, sizeof(st));
+}
+
+/*
+ * Hash 'n' <= MD5_LANES messages msg[i] of len[i] <= MD5_SHORTMAX bytes
+ * into digest[i], as MD5Init, MD5Update and MD5Final would.
+ */
+void
+MD5Short(digest, msg, len, n)
+	unsigned char   digest[][16];
+	unsigned char  *msg[];
+	unsigned int    len[];
+	int             n;
+{
+	uint32_t        in[16][MD5_LANES], out[4][MD5_LANES], x[16], st[4];
+	unsigned char   block[64];
+	int             i, l;
+
+	if (!md5sse2) {
+		for (l = 0; l < n; l++) {
+			MD5_CTX         ctx;
+			MD5Init(&ctx);
+			MD5Update(&ctx, msg[l], len[l]);
+			MD5Final(digest[l], &ctx);
+		}
+		return;
+	}
+
+	memset(in, 0, sizeof(in));
+	for (l = 0; l < n; l++) {
+		uint32_t        bits[2] = {len[l] << 3, 0};
+		memset(block, 0, sizeof(block));
+		memcpy(block, msg[l], len[l]);
+		block[len[l]] = 0x80;
+		Encode(&block[56], bits, 8);
+		Decode(x, block, 64);
+		for (i = 0; i < 16; i++)
+			in[i][l] = x[i];
+	}
+	MD5ShortLanes(out, in);
+	for (l = 0; l < n; l++) {
+		for (i = 0; i < 4; i++)
+			st[i] = out[i][l];
+		Encode(digest[l], st, 16);
+	}
+}
+
+/*
+ * Set up 't' for hashing messages of 'len' <= MD5_SHORTMAX bytes
+ * that all end as 'msg' does.  The words of the padded block are
+ * computed here once; MD5ShortLane only replaces the ones holding
+ * each message's own first bytes.
+ */
+void
+MD5ShortSetup(t, msg, len)
+	MD5_SHORT      *t;
+	unsigned char  *msg;
+	unsigned int    len;
+{
+	uint32_t        bits[2] = {len << 3, 0}, x[16];
+	int             i, l;
+
+	memset(t->block, 0, sizeof(t->block));
+	memcpy(t->block, msg, len);
+	t->block[len] = 0x80;
+	Encode(&t->block[56], bits, 8);
+	Decode(x, t->block, 64);
+	for (i = 0; i < 16; i++)
+		for (l = 0; l < MD5_LANES; l++)
+			t->x[i][l] = x[i];
+}
+
+/*
+ * Put in lane 'lane' of 't' the message that starts with the 'n' bytes
+ * at 'msg' and goes on like the one 't' was set up with.
+ */
+void
+MD5ShortLane(t, lane, msg, n)
+	MD5_SHORT      *t;
+	int             lane;
+	unsigned char  *msg;
+	unsigned int    n;
+{
+	unsigned char   w[4];
+	unsigned int    i, j;
+
+	for (i = 0; i < n; i += 4) {
+		for (j = 0; j < 4; j++)
+			w[j] = i + j < n ? msg[i + j] : t->block[i + j];
+		Decode(&t->x[i / 4][lane], w, 4);
+	}
+}
+
+/*
+ * Hash lanes 0 through n-1 of 't' into digest[0] through digest[n-1].
+ */
+void
+MD5ShortBatch(digest, t, n)
+	unsigned char   digest[][16];
+	MD5_SHORT      *t;
+	int             n;
+{
+	uint32_t        out[4][MD5_LANES], x[16], st[4];
+	int             i, l;
+
+	if (md5sse2)
+		MD5ShortLanes(out, t->x);
+	for (l = 0; l < n; l++) {
+		if (md5sse2) {
+			for (i = 0; i < 4; i++)
+				st[i] = out[i][l];
+		} else {
+			for (i = 0; i < 16; i++)
+				x[i] = t->x[i][l];
+			st[0] = 0x67452301;
+			st[1] = 0xefcdab89;
+			st[2] = 0x98badcfe;
+			st[3] = 0x10325476;
+			MD5TransformWords(st, x);
+		}
+		Encode(digest[l], st, 16);
+	}
+}
+
 /*
  * MD5 basic transformation. Transforms state based on block.
  */
@@ -176,92 +427,33 @@ MD5Transform(state, block)
 	uint32_t           state[4];
 	unsigned char   block[64];
 {
-	uint32_t           a = state[0], b = state[1], c = state[2], d = state[3],
-	                x[16];
+	uint32_t           x[16];
 
 	Decode(x, block, 64);
+	MD5TransformWords(state, x);
 
-	/* Round 1 */
-	FF(a, b, c, d, x[0], S11, 0xd76aa478);	/* 1 */
-	FF(d, a, b, c, x[1], S12, 0xe8c7b756);	/* 2 */
-	FF(c, d, a, b, x[2], S13, 0x242070db);	/* 3 */
-	FF(b, c, d, a, x[3], S14, 0xc1bdceee);	/* 4 */
-	FF(a, b, c, d, x[4], S11, 0xf57c0faf);	/* 5 */
-	FF(d, a, b, c, x[5], S12, 0x4787c62a);	/* 6 */
-	FF(c, d, a, b, x[6], S13, 0xa8304613);	/* 7 */
-	FF(b, c, d, a, x[7], S14, 0xfd469501);	/* 8 */
-	FF(a, b, c, d, x[8], S11, 0x698098d8);	/* 9 */
-	FF(d, a, b, c, x[9], S12, 0x8b44f7af);	/* 10 */
-	FF(c, d, a, b, x[10], S13, 0xffff5bb1);	/* 11 */
-	FF(b, c, d, a, x[11], S14, 0x895cd7be);	/* 12 */
-	FF(a, b, c, d, x[12], S11, 0x6b901122);	/* 13 */
-	FF(d, a, b, c, x[13], S12, 0xfd987193);	/* 14 */
-	FF(c, d, a, b, x[14], S13, 0xa679438e);	/* 15 */
-	FF(b, c, d, a, x[15], S14, 0x49b40821);	/* 16 */
-
-	/* Round 2 */
-	GG(a, b, c, d, x[1], S21, 0xf61e2562);	/* 17 */
-	GG(d, a, b, c, x[6], S22, 0xc040b340);	/* 18 */
-	GG(c, d, a, b, x[11], S23, 0x265e5a51);	/* 19 */
-	GG(b, c, d, a, x[0], S24, 0xe9b6c7aa);	/* 20 */
-	GG(a, b, c, d, x[5], S21, 0xd62f105d);	/* 21 */
-	GG(d, a, b, c, x[10], S22, 0x2441453);	/* 22 */
-	GG(c, d, a, b, x[15], S23, 0xd8a1e681);	/* 23 */
-	GG(b, c, d, a, x[4], S24, 0xe7d3fbc8);	/* 24 */
-	GG(a, b, c, d, x[9], S21, 0x21e1cde6);	/* 25 */
-	GG(d, a, b, c, x[14], S22, 0xc33707d6);	/* 26 */
-	GG(c, d, a, b, x[3], S23, 0xf4d50d87);	/* 27 */
-	GG(b, c, d, a, x[8], S24, 0x455a14ed);	/* 28 */
-	GG(a, b, c, d, x[13], S21, 0xa9e3e905);	/* 29 */
-	GG(d, a, b, c, x[2], S22, 0xfcefa3f8);	/* 30 */
-	GG(c, d, a, b, x[7], S23, 0x676f02d9);	/* 31 */
-	GG(b, c, d, a, x[12], S24, 0x8d2a4c8a);	/* 32 */
-
-	/* Round 3 */
-	HH(a, b, c, d, x[5], S31, 0xfffa3942);	/* 33 */
-	HH(d, a, b, c, x[8], S32, 0x8771f681);	/* 34 */
-	HH(c, d, a, b, x[11], S33, 0x6d9d6122);	/* 35 */
-	HH(b, c, d, a, x[14], S34, 0xfde5380c);	/* 36 */
-	HH(a, b, c, d, x[1], S31, 0xa4beea44);	/* 37 */
-	HH(d, a, b, c, x[4], S32, 0x4bdecfa9);	/* 38 */
-	HH(c, d, a, b, x[7], S33, 0xf6bb4b60);	/* 39 */
-	HH(b, c, d, a, x[10], S34, 0xbebfbc70);	/* 40 */
-	HH(a, b, c, d, x[13], S31, 0x289b7ec6);	/* 41 */
-	HH(d, a, b, c, x[0], S32, 0xeaa127fa);	/* 42 */
-	HH(c, d, a, b, x[3], S33, 0xd4ef3085);	/* 43 */
-	HH(b, c, d, a, x[6], S34, 0x4881d05);	/* 44 */
-	HH(a, b, c, d, x[9], S31, 0xd9d4d039);	/* 45 */
-	HH(d, a, b, c, x[12], S32, 0xe6db99e5);	/* 46 */
-	HH(c, d, a, b, x[15], S33, 0x1fa27cf8);	/* 47 */
-	HH(b, c, d, a, x[2], S34, 0xc4ac5665);	/* 48 */
-
-	/* Round 4 */
-	II(a, b, c, d, x[0], S41, 0xf4292244);	/* 49 */
-	II(d, a, b, c, x[7], S42, 0x432aff97);	/* 50 */
-	II(c, d, a, b, x[14], S43, 0xab9423a7);	/* 51 */
-	II(b, c, d, a, x[5], S44, 0xfc93a039);	/* 52 */
-	II(a, b, c, d, x[12], S41, 0x655b59c3);	/* 53 */
-	II(d, a, b, c, x[3], S42, 0x8f0ccc92);	/* 54 */
-	II(c, d, a, b, x[10], S43, 0xffeff47d);	/* 55 */
-	II(b, c, d, a, x[1], S44, 0x85845dd1);	/* 56 */
-	II(a, b, c, d, x[8], S41, 0x6fa87e4f);	/* 57 */
-	II(d, a, b, c, x[15], S42, 0xfe2ce6e0);	/* 58 */
-	II(c, d, a, b, x[6], S43, 0xa3014314);	/* 59 */
-	II(b, c, d, a, x[13], S44, 0x4e0811a1);	/* 60 */
-	II(a, b, c, d, x[4], S41, 0xf7537e82);	/* 61 */
-	II(d, a, b, c, x[11], S42, 0xbd3af235);	/* 62 */
-	II(c, d, a, b, x[2], S43, 0x2ad7d2bb);	/* 63 */
-	II(b, c, d, a, x[9], S44, 0xeb86d391);	/* 64 */
+	/*
+	 * Zeroize sensitive information.
+	 */
+	memset(x, 0, sizeof(x));
+}
+
+/*
+ * The same, from the block's words.
+ */
+static void
+MD5TransformWords(state, x)
+	uint32_t           state[4];
+	uint32_t           x[16];
+{
+	uint32_t           a = state[0], b = state[1], c = state[2], d = state[3];
+
+	MD5_STEPS(a, b, c, d, x);
 
 	state[0] += a;
 	state[1] += b;
 	state[2] += c;
 	state[3] += d;
-
-	/*
-	 * Zeroize sensitive information.
-	 */
-	memset(x, 0, sizeof(x));
 }
 
 /*
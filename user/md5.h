@@ -17,3 +17,19 @@ void MD5Init(MD5_CTX *);
 void MD5Update(MD5_CTX *, unsigned char *, unsigned int);
 void MD5Final(unsigned char[16], MD5_CTX *);
 
+/* Hashing several short messages at once, each in a single block. */
+#define MD5_LANES	4	/* messages per MD5Short call */
+#define MD5_SHORTMAX	55	/* longest message that fits one block */
+
+/* Short messages of one length that differ only in their first bytes. */
+typedef struct {
+	unsigned char   block[64];	/* padded block of the fixed part */
+	uint32_t        x[16][MD5_LANES];	/* its words, for each lane */
+}               MD5_SHORT;
+
+void MD5ShortInit(void);
+void MD5Short(unsigned char[][16], unsigned char *[], unsigned int[], int);
+void MD5ShortSetup(MD5_SHORT *, unsigned char *, unsigned int);
+void MD5ShortLane(MD5_SHORT *, int, unsigned char *, unsigned int);
+void MD5ShortBatch(unsigned char[][16], MD5_SHORT *, int);
+
@@ -0,0 +1,271 @@
+/*
+ * Collect metrics from every node in the cluster into a time series.
+ *
+ * Makes this node the metrics collector, by writing "collector <n>"
+ * with our own node number into the root's "netnodes" file, so that
+ * every node sends its counters here every so often (see kern/net.c).
+ * Reads the samples as they arrive from the "metrics" stream, one line
+ * each, "period node seq name value name value ...", and writes to
+ * the output file one line per sample and one cluster-wide total line
+ * per period, with the counters' values the change since the node's
+ * previous sample, and the gauges' as they are:
+ *
+ *	# period node nrun ncpu traps syscalls ...
+ *	12 1 2 2 1040 512 ...
+ *	12 2 1 2 377 120 ...
+ *	12 all 3 4 1417 632 ...
+ *
+ * After the number of periods asked for (30 unless -n says otherwise),
+ * stops collection again.  The kernel starts the stream over each time
+ * a collection starts, so we read it from the beginning.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/unistd.h>
+#include <inc/assert.h>
+#include <inc/errno.h>
+#include <inc/file.h>
+#include <inc/syscall.h>
+
+#define MAXMET		32		// Counters per sample we keep
+#define MAXNODES	256
+#define LINEMAX		512
+
+// Counters that are current values rather than running totals.
+static const char *const gauges[] = { "nrun", "ncpu", "free" };
+
+typedef struct node {
+	bool		seen;		// Have a previous sample
+	uint32_t	seq;		// Its sample number
+	uint32_t	val[MAXMET];	// Its values
+} node;
+
+static node nodes[MAXNODES];
+static char metname[MAXMET][16];	// Names, in the first sample's order
+static bool metgauge[MAXMET];
+static int nmet;
+
+static FILE *out;
+static uint32_t curperiod;		// Period whose total we're summing
+static uint32_t total[MAXMET];
+static int totalnodes;			// Samples in that total
+static int nperiods, maxperiods = 30;
+static int nlost;
+
+// Parse a decimal number at *sp after any blanks, advancing *sp past it.
+// Our little libc has no strtol().
+static uint32_t
+getnum(char **sp)
+{
+	uint32_t v = 0;
+	char *s = *sp;
+	while (*s == ' ')
+		s++;
+	for (; *s >= '0' && *s <= '9'; s++)
+		v = v * 10 + *s - '0';
+	*sp = s;
+	return v;
+}
+
+static void
+usage(void)
+{
+	cprintf("usage: metrics [-n periods] [outfile]\n");
+	exit(1);
+}
+
+// Write 'line' over the root's "netnodes" file, for the kernel to apply.
+static void
+netnodes(const char *line)
+{
+	int fd = open("netnodes", O_WRONLY | O_TRUNC);
+	if (fd < 0 || write(fd, line, strlen(line)) < 0)
+		panic("can't write netnodes: %s", strerror(errno));
+	close(fd);
+}
+
+// Find our own node number in the header of the "netnodes" listing.
+static int
+mynode(void)
+{
+	char buf[64];
+	int fd = open("netnodes", O_RDONLY);
+	if (fd < 0)
+		panic("can't open netnodes: %s", strerror(errno));
+	int n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[MAX(n, 0)] = 0;
+	if (strncmp(buf, "# node ", 7) != 0) {
+		cprintf("metrics: no node number in netnodes\n");
+		exit(1);
+	}
+	char *s = buf + 7;
+	return getnum(&s);
+}
+
+// Write the cluster-wide total of the current period, if it has any.
+static void
+flushperiod(void)
+{
+	int i;
+	if (totalnodes > 0) {
+		fprintf(out, "%u all", curperiod);
+		for (i = 0; i < nmet; i++)
+			fprintf(out, " %u", total[i]);
+		fprintf(out, "\n");
+		fflush(out);
+		nperiods++;
+	}
+	memset(total, 0, sizeof(total));
+	totalnodes = 0;
+}
+
+// Learn the counters' names from the first sample, and write the header.
+static void
+learnnames(char *s)
+{
+	while (*s && nmet < MAXMET) {
+		char *name = s;
+		while (*s && *s != ' ')
+			s++;
+		if (*s == 0)
+			break;
+		*s++ = 0;
+		getnum(&s);			// skip the value
+		while (*s == ' ')
+			s++;
+		int i;
+		strncpy(metname[nmet], name, sizeof(metname[0]) - 1);
+		for (i = 0; i < sizeof(gauges) / sizeof(gauges[0]); i++)
+			if (strcmp(name, gauges[i]) == 0)
+				metgauge[nmet] = 1;
+		nmet++;
+	}
+	fprintf(out, "# period node");
+	int i;
+	for (i = 0; i < nmet; i++)
+		fprintf(out, " %s", metname[i]);
+	fprintf(out, "\n");
+}
+
+// Parse one line of the metrics stream and add it to the time series.
+static void
+addline(char *line)
+{
+	char *s = line;
+	uint32_t period = getnum(&s);
+	uint32_t n = getnum(&s);
+	uint32_t seq = getnum(&s);
+	while (*s == ' ')
+		s++;
+	if (n == 0 && strncmp(s, "lost ", 5) == 0) {
+		s += 5;
+		nlost += getnum(&s);
+		return;
+	}
+	if (n == 0 || n >= MAXNODES || *s == 0)
+		return;
+	if (nmet == 0) {
+		char names[LINEMAX];
+		strcpy(names, s);
+		learnnames(names);
+	}
+	if (period != curperiod) {
+		flushperiod();
+		curperiod = period;
+	}
+
+	uint32_t val[MAXMET];
+	int i;
+	for (i = 0; i < nmet && *s; i++) {
+		while (*s && *s != ' ')		// skip the name
+			s++;
+		val[i] = getnum(&s);
+		while (*s == ' ')
+			s++;
+	}
+	if (i < nmet)
+		return;
+
+	// A node's first sample, or its first since it rebooted,
+	// only gives us a base for the next one.
+	node *nd = &nodes[n];
+	bool base = !nd->seen || seq <= nd->seq;
+	if (!base) {
+		fprintf(out, "%u %u", period, n);
+		for (i = 0; i < nmet; i++) {
+			uint32_t v = metgauge[i] ? val[i] : val[i] - nd->val[i];
+			fprintf(out, " %u", v);
+			total[i] += v;
+		}
+		fprintf(out, "\n");
+		totalnodes++;
+	}
+	nd->seen = 1;
+	nd->seq = seq;
+	memcpy(nd->val, val, sizeof(val));
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *outname = "metrics.out";
+	argc--, argv++;
+	while (argc >= 2 && strcmp(argv[0], "-n") == 0) {
+		char *p = argv[1];
+		maxperiods = getnum(&p);
+		if (*p)
+			usage();
+		argc -= 2, argv += 2;
+	}
+	if (argc > 1 || maxperiods < 1 || (argc == 1 && argv[0][0] == '-'))
+		usage();
+	if (argc == 1)
+		outname = argv[0];
+
+	out = fopen(outname, "w");
+	if (out == NULL)
+		panic("can't create %s: %s", outname, strerror(errno));
+
+	// The stream never ends: a read at its end waits for more.
+	// Our copy still holds what earlier collections left in it,
+	// until the new version the kernel starts for us comes down.
+	int fd = open("metrics", O_RDONLY);
+	if (fd < 0)
+		panic("can't open metrics: %s", strerror(errno));
+	fileinode *fi = &files->fi[files->fd[fd].ino];
+	int ver = fi->ver;
+
+	char line[LINEMAX];
+	snprintf(line, sizeof(line), "collector %d\n", mynode());
+	netnodes(line);
+	while (fi->ver == ver)
+		sys_ret();		// let our parents pass it down
+
+	static char buf[4096];
+	int len = 0, n, i;
+	while (nperiods < maxperiods && (n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n && nperiods < maxperiods; i++) {
+			if (buf[i] != '\n') {
+				if (len < LINEMAX - 1)
+					line[len++] = buf[i];
+				continue;
+			}
+			line[len] = 0;
+			addline(line);
+			len = 0;
+		}
+	close(fd);
+
+	netnodes("collector 0\n");
+	flushperiod();			// the last period's total so far
+	fclose(out);
+	if (nlost)
+		cprintf("metrics: %d samples lost in the kernel\n", nlost);
+	return 0;
+}
@@ -0,0 +1,228 @@
+/*
+ * Dump the kernel's timer-driven profile samples as folded stacks.
+ *
+ * Reads the root process's "profile" special file (see kern/prof.c),
+ * which has one line per sample, "cpu proc u|k eip caller caller...",
+ * and prints one line per distinct call stack, outermost frame first:
+ *
+ *	prog;main;runcmd;fork 12
+ *
+ * ready to feed to a flame graph generator.  User frames are symbolized
+ * against the symbol table of the program named on the command line,
+ * taken from the "prog.sym" file that kern/Makefrag puts alongside
+ * each program in the initial file system; every program is linked at
+ * the same address, so naming the profiled program is up to the user.
+ * Kernel frames are left in hex, for obj/kern/kernel.sym on the host.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/unistd.h>
+#include <inc/assert.h>
+#include <inc/errno.h>
+
+#define MAXDEPTH	16		// Frames per sample we keep
+#define MAXSTACKS	1024		// Distinct stacks we can count
+#define MAXSYMS		2048		// Text symbols we can load
+#define LINEMAX		256
+
+typedef struct stack {
+	int		count;		// Samples with this stack, 0 if unused
+	bool		user;		// Sampled in user mode
+	int		depth;
+	uint32_t	eip[MAXDEPTH];	// Innermost frame first
+} stack;
+
+static stack stacks[MAXSTACKS];
+static int nlost, nsamples, ndropped;
+
+static char symbuf[128*1024];	// Contents of the .sym file
+static uint32_t symaddr[MAXSYMS];
+static char *symname[MAXSYMS];
+static int nsyms;
+static const char *progname = "user";
+
+// Parse a hex number at *sp, advancing *sp past it and any blanks.
+static uint32_t
+gethex(char **sp)
+{
+	uint32_t v = 0;
+	char *s = *sp;
+	for (;; s++) {
+		if (*s >= '0' && *s <= '9')
+			v = v * 16 + *s - '0';
+		else if (*s >= 'a' && *s <= 'f')
+			v = v * 16 + *s - 'a' + 10;
+		else
+			break;
+	}
+	while (*s == ' ')
+		s++;
+	*sp = s;
+	return v;
+}
+
+// Load the text symbols from an 'nm -n' listing, already sorted.
+static void
+loadsyms(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		cprintf("prof: can't open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	int n = read(fd, symbuf, sizeof(symbuf) - 1);
+	close(fd);
+	if (n < 0)
+		panic("error reading %s: %s", path, strerror(errno));
+	symbuf[n] = 0;
+
+	char *s = symbuf;
+	while (*s && nsyms < MAXSYMS) {
+		char *line = s;
+		char *nl = strchr(s, '\n');
+		s = nl ? nl + 1 : s + strlen(s);
+		if (nl)
+			*nl = 0;
+		uint32_t addr = gethex(&line);
+		if ((line[0] == 'T' || line[0] == 't') && line[1] == ' ') {
+			symaddr[nsyms] = addr;
+			symname[nsyms++] = line + 2;
+		}
+	}
+}
+
+// Print the symbol containing user address eip, or eip in hex.
+static void
+printsym(uint32_t eip)
+{
+	int lo = 0, hi = nsyms;		// find last symbol <= eip
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (symaddr[mid] <= eip)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0)
+		printf("%s", symname[lo-1]);
+	else
+		printf("0x%x", eip);
+}
+
+// Count one sample's stack, merging it with identical stacks.
+static void
+addstack(bool user, int depth, uint32_t *eip)
+{
+	uint32_t h = user;
+	int i;
+	for (i = 0; i < depth; i++)
+		h = h * 16777619 ^ eip[i];
+	for (i = 0; i < MAXSTACKS; i++) {
+		stack *st = &stacks[(h + i) % MAXSTACKS];
+		if (st->count == 0) {
+			st->user = user;
+			st->depth = depth;
+			memcpy(st->eip, eip, depth * sizeof(eip[0]));
+		} else if (st->user != user || st->depth != depth
+				|| memcmp(st->eip, eip, depth * sizeof(eip[0])))
+			continue;
+		st->count++;
+		return;
+	}
+	ndropped++;
+}
+
+// Parse one line of the profile file.
+static void
+addline(char *line)
+{
+	gethex(&line);			// cpu
+	gethex(&line);			// proc
+	if (strncmp(line, "lost ", 5) == 0) {
+		line += 5;
+		nlost += gethex(&line);
+		return;
+	}
+	bool user = line[0] == 'u';
+	line += 2;
+	uint32_t eip[MAXDEPTH];
+	int depth = 0;
+	while (*line && depth < MAXDEPTH)
+		eip[depth++] = gethex(&line);
+	if (depth == 0)
+		return;
+	nsamples++;
+	addstack(user, depth, eip);
+}
+
+static void
+readprofile(void)
+{
+	int fd = open("profile", O_RDONLY);
+	if (fd < 0) {
+		cprintf("prof: can't open profile: %s\n", strerror(errno));
+		exit(1);
+	}
+	static char buf[4096];
+	char line[LINEMAX];
+	int len = 0, n, i;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++) {
+			if (buf[i] != '\n') {
+				if (len < LINEMAX - 1)
+					line[len++] = buf[i];
+				continue;
+			}
+			line[len] = 0;
+			addline(line);
+			len = 0;
+		}
+	if (n < 0)
+		panic("error reading profile: %s", strerror(errno));
+	close(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 2) {
+		cprintf("usage: prof [program]\n");
+		return 1;
+	}
+	if (argc == 2) {
+		char path[LINEMAX];
+		snprintf(path, sizeof(path), "%s.sym", argv[1]);
+		loadsyms(path);
+		progname = argv[1];
+	}
+
+	readprofile();
+
+	int i, j;
+	for (i = 0; i < MAXSTACKS; i++) {
+		stack *st = &stacks[i];
+		if (st->count == 0)
+			continue;
+		printf("%s", st->user ? progname : "kernel");
+		for (j = st->depth - 1; j >= 0; j--) {
+			printf(";");
+			if (st->user && nsyms > 0)
+				printsym(st->eip[j]);
+			else
+				printf("0x%x", st->eip[j]);
+		}
+		printf(" %d\n", st->count);
+	}
+	if (nlost || ndropped)
+		cprintf("prof: %d samples lost in the kernel, "
+			"%d stacks not counted\n", nlost, ndropped);
+	if (nsamples == 0)
+		cprintf("prof: no samples (kernel built without "
+			"PROF_SAMPLING?)\n");
+	return 0;
+}
@@ -24,6 +24,9 @@
 #define MAXLEN		10
 #define BLOCKLEN	3
 
+#define MAXWORKERS	16	// Most worker threads psearch() can use
+#define CHECKEVERY	16384	// Hashes between a worker's checks for a match
+
 #define hexdig(c)	((c) >= '0' && (c) <= '9' ? (c) - '0' : \
 			 (c) >= 'a' && (c) <= 'f' ? (c) - 'a' + 10 : \
 			 (c) >= 'A' && (c) <= 'F' ? (c) - 'A' + 10 : -1)
@@ -32,11 +35,16 @@
 int found;
 char out[MAXLEN+1];
 
+int nworkers = 4;			// Worker threads for psearch()
+int nodes[MAXWORKERS] = { SYS_NODEANY };	// Nodes to put them on in turn,
+int nnodes = 1;				// 0 for ours, SYS_NODEANY for any
+
 
 void
 usage()
 {
-	fprintf(stderr, "Usage: pwcrack <md5-hash>\n");
+	fprintf(stderr, "Usage: pwcrack [-w workers] [-n node,...] "
+			"<md5-hash>\n");
 	exit(1);
 }
 
@@ -57,60 +65,175 @@ incstr(uint8_t *str, int lo, int hi)
 }
 
 // Search all strings of length 'len' for one that hashes to 'hash'.
+// In a worker, stop at a barrier every CHECKEVERY hashes, so our parent
+// can collect us if another worker has already found the match.
 int
-search(uint8_t *str, int len, int lo, int hi, const unsigned char *hash)
+search(uint8_t *str, int len, int lo, int hi, const unsigned char *hash,
+	bool worker)
 {
 	assert(lo < hi);
 	assert(hi <= len);
 
+	// Hash MD5_LANES successive candidates at a time.
+	// Only the characters below 'hi' change, so the rest of the block
+	// stays the same throughout: just change each lane's first words.
+	MD5_SHORT t;
+	MD5ShortSetup(&t, str, len);
+	int wrapped, sincecheck = 0;
 	do {
-		unsigned char h[16];
-		MD5_CTX ctx;
-		MD5Init(&ctx);
-		MD5Update(&ctx, str, len);
-		MD5Final(h, &ctx);
-		if (memcmp(h, hash, 16) == 0) {
-			strcpy(out, (char*)str);
-			return found = 1;
+		unsigned char cand[MD5_LANES][MAXLEN+1], h[MD5_LANES][16];
+		int n = 0, i;
+		do {
+			memcpy(cand[n], str, len+1);
+			MD5ShortLane(&t, n, str, hi);
+			n++;
+			wrapped = incstr(str, lo, hi);
+		} while (n < MD5_LANES && !wrapped);
+		MD5ShortBatch(h, &t, n);
+		for (i = 0; i < n; i++)
+			if (memcmp(h[i], hash, 16) == 0) {
+				strcpy(out, (char*)cand[i]);
+				return found = 1;
+			}
+		if (worker && (sincecheck += n) >= CHECKEVERY) {
+			sincecheck = 0;
+			tbarrier();
 		}
-	} while (!incstr(str, lo, hi));
+	} while (!wrapped);
 	return 0;	// no match at this string length
 }
 
-// Like 'search', but do in parallel across 2 nodes with 2 threads each
+// One block of a parallel search, as a job for a worker thread.
+struct block {
+	int		child;		// Worker child number, for the log
+	int		len;		// String length
+	uint8_t		str[MAXLEN+1];	// Where in the search to start
+	unsigned char	hash[16];	// Hash to look for
+};
+
+void
+searchblock(void *arg)
+{
+	struct block *b = arg;
+	cprintf("child %x: search from '%s'\n", b->child, b->str);
+	search(b->str, b->len, 0, BLOCKLEN, b->hash, 1);
+}
+
+// Like 'search', but in parallel with 'nworkers' threads on 'nodes'.
+// Each worker that finishes a block gets the next one straight away,
+// and once one finds the match, the rest are dropped at their next check.
 int psearch(uint8_t *str, int len, const unsigned char *hash)
 {
 	if (len <= BLOCKLEN)
-		return search(str, len, 0, len, hash);
+		return search(str, len, 0, len, hash, 0);
 
-	// Iterate over blocks, searching 4 blocks at a time in parallel
-	int done = 0;
-	do {
-		// Child numbers to use when forking off workers:
-		// node number in bits 15-8, intra-node child number in 7-0.
-		static int child[4] = {0x0101,0x0102,0x0203,0x0204};
-
-		int i;
-		for (i = 0; i < sizeof(child)/sizeof(child[0]); i++) {
-			if (!tfork(child[i])) {
-				cprintf("child %x: search from '%s'\n",
-					child[i], str);
-				search(str, len, 0, BLOCKLEN, hash);
-				sys_ret();
-			}
+	// Child numbers to use for the workers:
+	// node number in bits 15-8, intra-node child number in 7-0.
+	uint16_t child[MAXWORKERS];
+	bool busy[MAXWORKERS], local = 1;
+	int i;
+	for (i = 0; i < nworkers; i++) {
+		int node = nodes[i % nnodes];
+		child[i] = node << 8 | (i + 1);
+		local &= node == 0;
+		busy[i] = 0;
+		tpool_start(child[i]);
+	}
+
+	int nbusy = 0, next = 0, done = 0;
+	while (1) {
+		for (i = 0; i < nworkers && !found && !done; i++) {
+			if (busy[i])
+				continue;
+			struct block b;
+			b.child = child[i];
+			b.len = len;
+			memcpy(b.str, str, len+1);
+			memcpy(b.hash, hash, 16);
+			tpool_run(child[i], searchblock, &b, sizeof(b));
 			done |= incstr(str, BLOCKLEN, len);
+			busy[i] = 1;
+			nbusy++;
 		}
-		for (i = 0; i < sizeof(child)/sizeof(child[0]); i++)
-			tjoin(child[i]);	// collect results
-		if (found)
-			return 1;
-	} while (!done);
-	return 0;	// no match at this string length
+		if (nbusy == 0)
+			break;
+
+		// Take whichever worker stops first if they're all here,
+		// which we can only wait for on one node; else go in turn.
+		if (local) {
+			childset set;
+			memset(&set, 0, sizeof(set));
+			for (i = 0; i < nworkers; i++)
+				if (busy[i])
+					childset_add(&set, child[i] & 0xff);
+			sys_wait(0, &set);
+			for (i = 0; !busy[i] ||
+					!childset_has(&set, child[i] & 0xff); i++)
+				;
+		} else {
+			for (i = next; !busy[i]; i = (i + 1) % nworkers)
+				;
+			next = (i + 1) % nworkers;
+		}
+
+		if (!tjoinbarrier(child[i])) {
+			busy[i] = 0;		// finished its block
+			nbusy--;
+		} else if (found) {
+			tpool_stop(child[i]);	// cancelled: just drop it
+			busy[i] = 0;
+			nbusy--;
+		} else
+			tresume(child[i]);	// keep going
+	}
+
+	for (i = 0; i < nworkers; i++)
+		tpool_stop(child[i]);
+	return found;
+}
+
+// Parse a decimal number ending at a comma or the end of 's'.
+static int
+parsenum(char **s)
+{
+	int n = 0;
+	if (**s < '0' || **s > '9')
+		usage();
+	while (**s >= '0' && **s <= '9')
+		n = n * 10 + *(*s)++ - '0';
+	if (**s != ',' && **s != 0)
+		usage();
+	return n;
+}
+
+// Parse the comma-separated node list for -n.
+static void
+parsenodes(char *s)
+{
+	nnodes = 0;
+	do {
+		if (nnodes == MAXWORKERS)
+			usage();
+		if ((nodes[nnodes++] = parsenum(&s)) > SYS_NODEANY)
+			usage();
+	} while (*s && *s++ == ',');
 }
 
 int
 main(int argc, char **argv)
 {
+	while (argc > 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-w") == 0) {
+			char *s = argv[2];
+			nworkers = parsenum(&s);
+			if (*s || nworkers < 1 || nworkers > MAXWORKERS)
+				usage();
+		} else if (strcmp(argv[1], "-n") == 0)
+			parsenodes(argv[2]);
+		else
+			usage();
+		argc -= 2, argv += 2;
+	}
 	if (argc != 2 || strlen(argv[1]) != 16*2)
 		usage();
 
@@ -126,6 +249,7 @@ main(int argc, char **argv)
 	}
 
 	// Search all strings of length 1, then of length 2, ...
+	MD5ShortInit();
 	int len;
 	for (len = 1; len < MAXLEN; len++) {
 		cprintf("Searching strings of length %d\n", len);
@@ -25,6 +25,10 @@
 
 int debug = 0;
 
+// Number of the command line being run in a forked runcmd(),
+// which names its pipes so that jobs running at once don't share them.
+static int jobno;
+
 // gettoken(s, 0) prepares gettoken for subsequent calls and returns 0.
 // gettoken(0, token) parses a shell token from the previously set string,
 // null-terminates that token, stores the token pointer in '*token',
@@ -33,6 +37,19 @@ int debug = 0;
 // tokens from the string.
 int gettoken(char *s, char **token);
 
+// Read all commands from the filesystem: add an initial '/' to
+// the command name, using 'buf' to hold it if necessary.
+// This essentially acts like 'PATH=/'.
+static char *
+cmdpath(char *cmd, char *buf)
+{
+	if (cmd[0] == '/')
+		return cmd;
+	buf[0] = '/';
+	strcpy(buf + 1, cmd);
+	return buf;
+}
+
 
 // Parse a shell command from string 's' and execute it.
 // Do not return until the shell command is finished.
@@ -42,8 +59,8 @@ int gettoken(char *s, char **token);
 void gcc_noreturn
 runcmd(char* s)
 {
-	char *argv[MAXARGS], *t, argv0buf[BUFSIZ];
-	int argc, c, i, r, p[2], fd, pipe_child;
+	char *argv[MAXARGS], *t, argv0buf[BUFSIZ], pipename[32];
+	int argc, c, i, r, fd, pino, pipe_child, status;
 
 	pipe_child = 0;
 	if(debug)
@@ -104,6 +121,50 @@ again:
 			}
 			break;
 			
+		case '|':	// Pipe
+			// The command so far runs in one child writing a pipe,
+			// and the rest of the line in another reading it,
+			// while we relay the data between them as it comes.
+			// The pipe is just a partial file (S_IFPART) of our own,
+			// so its reader waits for more at the end of what it has.
+			snprintf(pipename, sizeof(pipename), "/.pipe%d.%d",
+				jobno, ++pipe_child);
+			if ((fd = open(pipename, O_RDWR | O_CREAT | O_TRUNC,
+					0600)) < 0) {
+				cprintf("open %s: %s\n", pipename, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			pino = files->fd[fd].ino;
+			files->fi[pino].mode |= S_IFPART;
+			close(fd);
+
+			if ((r = fork()) < 0)
+				panic("fork: %e", r);
+			if (r == 0) {
+				// Writer: append-only, so its output just streams
+				if ((fd = open(pipename, O_WRONLY | O_APPEND)) < 0)
+					panic("open %s: %e", pipename, fd);
+				dup2(fd, 1);
+				close(fd);
+				goto runit;
+			}
+			if ((i = fork()) < 0)
+				panic("fork: %e", i);
+			if (i == 0) {
+				// Reader: drop whatever pipe we were reading until now
+				if (fileino_isreg(files->fd[0].ino))
+					fileino_release(files->fd[0].ino,
+							FILE_MAXSIZE);
+				if ((fd = open(pipename, O_RDONLY)) < 0)
+					panic("open %s: %e", pipename, fd);
+				dup2(fd, 0);
+				close(fd);
+				goto again;
+			}
+			waitpipe(r, i, pino, &status);
+			remove(pipename);
+			exit(WEXITSTATUS(status));
+
 		case 0:		// String is complete
 			// Run the current command!
 			goto runit;
@@ -124,14 +185,7 @@ runit:
 	}
 
 	// Clean up command line.
-	// Read all commands from the filesystem: add an initial '/' to
-	// the command name.
-	// This essentially acts like 'PATH=/'.
-	if (argv[0][0] != '/') {
-		argv0buf[0] = '/';
-		strcpy(argv0buf + 1, argv[0]);
-		argv[0] = argv0buf;
-	}
+	argv[0] = cmdpath(argv[0], argv0buf);
 	argv[argc] = 0;
 
 	// Print the command.
@@ -147,6 +201,36 @@ runit:
 }
 
 
+// Start the simple command in 's', which has no redirections or pipes
+// for a forked copy of the shell to set up, directly with spawnv(),
+// skipping the copy of our whole address space that execv() would discard.
+// Returns the child's pid, 0 if the line was empty, or -1 on error.
+pid_t
+spawncmd(char *s)
+{
+	char *argv[MAXARGS], *t, argv0buf[BUFSIZ];
+	int argc = 0;
+	pid_t pid;
+
+	gettoken(s, 0);
+	while (gettoken(0, &t) == 'w') {
+		if (argc == MAXARGS - 1) {
+			cprintf("sh: too many arguments\n");
+			return -1;
+		}
+		argv[argc++] = t;
+	}
+	if (argc == 0)
+		return 0;
+	argv[0] = cmdpath(argv[0], argv0buf);
+	argv[argc] = 0;
+
+	if ((pid = spawnv(argv[0], argv)) < 0)
+		cprintf("exec %s: %s\n", argv[0], strerror(errno));
+	return pid;
+}
+
+
 // Get the next token from string s.
 // Set *p1 to the beginning of the token and *p2 just past the token.
 // Returns
@@ -224,6 +308,104 @@ gettoken(char *s, char **p1)
 }
 
 
+// Background jobs, started by ending a line with '&'.
+// Job n (counting from 1) is in jobs[n-1].
+#define MAXJOBS		16
+#define JOBCMDLEN	64
+struct job {
+	pid_t	pid;			// Child running it, 0 if slot free
+	char	cmd[JOBCMDLEN];		// Its command line, for reports
+} jobs[MAXJOBS];
+
+// If command line 's' ends with '&', strip that off and return true.
+static bool
+background(char *s)
+{
+	int n = strlen(s);
+	while (n > 0 && strchr(WHITESPACE, s[n-1]))
+		n--;
+	if (n == 0 || s[n-1] != '&')
+		return 0;
+	s[n-1] = 0;
+	return 1;
+}
+
+// Report that job pid has finished with 'status', and forget it.
+static void
+jobdone(pid_t pid, int status)
+{
+	int j;
+	for (j = 0; j < MAXJOBS && jobs[j].pid != pid; j++)
+		;
+	if (j == MAXJOBS)
+		return;
+	if (WIFSIGNALED(status))
+		printf("[%d] Trap %d\t%s\n", j+1, WTERMSIG(status), jobs[j].cmd);
+	else if (WEXITSTATUS(status) != 0)
+		printf("[%d] Exit %d\t%s\n", j+1, WEXITSTATUS(status),
+			jobs[j].cmd);
+	else
+		printf("[%d] Done\t%s\n", j+1, jobs[j].cmd);
+	jobs[j].pid = 0;
+}
+
+// Note pid as a background job running 'cmd', and say so.
+// If the job table is full, just wait for it as if in the foreground.
+static void
+jobadd(pid_t pid, const char *cmd)
+{
+	int j;
+	for (j = 0; j < MAXJOBS && jobs[j].pid != 0; j++)
+		;
+	if (j == MAXJOBS) {
+		cprintf("sh: too many jobs; waiting for this one\n");
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	jobs[j].pid = pid;
+	strlcpy(jobs[j].cmd, cmd, JOBCMDLEN);
+	printf("[%d] %d\n", j+1, pid);
+}
+
+// Collect the jobs that have finished, without waiting for the rest:
+// just pass along what output they have for us so far.
+// Only the root process sees them finish before a 'wait' does
+// (only it has PFF_NONDET; see SYS_POLL in inc/syscall.h).
+static void
+jobpoll(void)
+{
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		jobdone(pid, status);
+}
+
+// The 'wait' builtin: wait for job 'arg' ("%n" or a pid),
+// or for all of them if arg is NULL, in whatever order they finish.
+static void
+jobwait(const char *arg)
+{
+	pid_t pid;
+	int status;
+	if (arg == NULL) {
+		while ((pid = waitpid(-1, &status, 0)) > 0)
+			jobdone(pid, status);
+		return;
+	}
+	const char *s = arg[0] == '%' ? arg + 1 : arg;
+	for (pid = 0; *s >= '0' && *s <= '9' && pid < 256; s++)
+		pid = pid * 10 + *s - '0';
+	if (*s != 0 || pid >= 256)
+		pid = 0;
+	else if (arg[0] == '%')
+		pid = pid >= 1 && pid <= MAXJOBS ? jobs[pid-1].pid : 0;
+	if (pid <= 0 || waitpid(pid, &status, 0) < 0) {
+		fprintf(stderr, "wait: no such job %s\n", arg);
+		return;
+	}
+	jobdone(pid, status);
+}
+
 void
 usage(void)
 {
@@ -273,10 +455,12 @@ main(int argc, char **argv)
 			}
 			continue;
 		}
+		jobpoll();
 		buf = readline(interactive ? "$ " : NULL);
 		if (buf == NULL) {
 			if (debug)
 				cprintf("EXITING\n");
+			jobwait(NULL);	// so their output isn't lost
 			exit(EXIT_SUCCESS);	// end of file
 		}
 		if (buf[0] == 0) {
@@ -359,11 +543,41 @@ main(int argc, char **argv)
 			}
 			continue;
 		}
+		if (!strcmp(token, "wait")) {
+			char *arg;
+			gettoken(0, &arg);
+			jobwait(arg);
+			continue;
+		}
+		if (!strcmp(token, "jobs")) {
+			for (r = 0; r < MAXJOBS; r++)
+				if (jobs[r].pid != 0)
+					printf("[%d] %d\t%s\n", r+1,
+						jobs[r].pid, jobs[r].cmd);
+			continue;
+		}
 		if (!strcmp(token, "clear")) {
 			clear = 1;
 		}
+		// A line ending in '&' runs in the background: no waiting.
+		bool bg = background(buf);
+		char cmd[JOBCMDLEN];
+		strlcpy(cmd, buf, JOBCMDLEN);	// parsing will chop up buf
+		char *sym = buf;
+		while (*sym && !strchr(SYMBOLS, *sym))
+			sym++;
+		if (*sym == 0) {	// simple command: no need to fork
+			if ((r = spawncmd(buf)) > 0) {
+				if (bg)
+					jobadd(r, cmd);
+				else
+					waitpid(r, NULL, 0);
+			}
+			continue;
+		}
 		if (debug)
 			cprintf("BEFORE FORK\n");
+		jobno++;
 		if ((r = fork()) < 0)
 			panic("fork: %e", r);
 		if (debug)
@@ -371,7 +585,9 @@ main(int argc, char **argv)
 		if (r == 0) {
 			runcmd(buf);
 			exit(EXIT_SUCCESS);
-		} else
+		} else if (bg)
+			jobadd(r, cmd);
+		else
 			waitpid(r, NULL, 0);
 	}
 }
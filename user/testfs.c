@@ -18,6 +18,7 @@
 #include <inc/file.h>
 #include <inc/stat.h>
 #include <inc/elf.h>
+#include <inc/mmu.h>
 
 
 int initfilecheck_count;
@@ -41,9 +42,13 @@ initfilecheck()
 			// initfiles are all in the root directory
 			assert(files->fi[ino].dino == FILEINO_ROOTDIR);
 			// initfiles are all regular files
-			assert(files->fi[ino].mode == S_IFREG);
-			// and should all contain some file data
-			assert(files->fi[ino].size > 0);
+			// and should all contain some file data,
+			// but the kernel's special files may still be empty
+			assert(S_ISREG(files->fi[ino].mode));
+			if (!(files->fi[ino].mode & S_IFKERN)) {
+				assert(files->fi[ino].mode == S_IFREG);
+				assert(files->fi[ino].size > 0);
+			}
 		}
 
 		// Make sure a couple specific files we're expecting show up
@@ -132,6 +137,19 @@ readwritecheck()
 	rc = stat("ls", &st2); assert(rc >= 0);
 	assert(memcmp(&st, &st2, sizeof(st)) == 0);
 
+	// There can be more descriptors open than there are inodes,
+	// and freed ones get reused lowest first.
+	int i;
+	fd = open("ls", O_RDONLY); assert(fd > 0);
+	for (i = fd + 1; i < FILE_INODES + 100; i++)
+		assert(dup(fd) == i);
+	close(fd + 7);
+	assert(dup(fd) == fd + 7);
+	for (i = fd; i < FILE_INODES + 100; i++)
+		close(i);
+	assert(open("ls", O_RDONLY) == fd);
+	close(fd);
+
 	cprintf("readwritecheck passed\n");
 }
 
@@ -262,6 +280,8 @@ readdircheck()
 	while ((de = readdir(d)) != NULL) {
 		struct stat st;
 		int rc = stat(de->d_name, &st); assert(rc == 0);
+		assert(dir_lookup(files, FILEINO_ROOTDIR, de->d_name,
+				strlen(de->d_name)) == st.st_ino);
 
 		cprintf("readdircheck: found file '%s' mode 0x%x size %d\n",
 			de->d_name, st.st_mode, st.st_size);
@@ -282,11 +302,15 @@ readdircheck()
 			continue;
 		}
 
-		// everything else should be a regular file
+		// everything else should be a regular file,
+		// with some data unless the kernel maintains it
 		assert(st.st_ino >= FILEINO_GENERAL);
 		assert(st.st_ino < FILE_INODES);
-		assert(st.st_mode == S_IFREG);
-		assert(st.st_size > 0);
+		assert(S_ISREG(st.st_mode));
+		if (!(st.st_mode & S_IFKERN)) {
+			assert(st.st_mode == S_IFREG);
+			assert(st.st_size > 0);
+		}
 
 		// Make sure a couple specific files we're expecting show up
 		if (strcmp(de->d_name, "sh") == 0)
@@ -353,6 +377,16 @@ spawn(const char *arg0, ...)
 	return pid;
 }
 
+// Like spawn(), but without forking a copy of ourselves first.
+pid_t
+spawnfresh(const char *arg0, ...)
+{
+	pid_t pid = spawnv(arg0, (char *const *)&arg0);
+	if (pid < 0)
+		panic("spawnv() failed: %s\n", strerror(errno));
+	return pid;
+}
+
 void
 waitcheckstatus(pid_t pid, int statexpect)
 {
@@ -372,6 +406,61 @@ execcheck()
 	cprintf("execcheck done\n");
 }
 
+void
+spawncheck()
+{
+	waitcheck(spawnfresh("echo", "-c", "called", "by", "spawncheck", NULL));
+
+	// The child sees our files as they were when we spawned it,
+	// and its exit status comes back as a forked child's would.
+	FILE *f = fopen("spawnfile", "w"); assert(f != NULL);
+	fprintf(f, "spawncheck: spawnfile\n");
+	fclose(f);
+	waitcheck(spawnfresh("cat", "spawnfile", NULL));
+	waitcheckstatus(spawnfresh("cat", "nosuchspawnfile", NULL), 1);
+
+	// spawnl() takes its arguments as a list, like execl().
+	pid_t pid = spawnl("echo", "echo", "-c", "called", "by", "spawnl", NULL);
+	assert(pid > 0);
+	waitcheck(pid);
+
+	// A program that doesn't exist fails in the parent, not the child.
+	assert(spawnl("nosuchprogram", "nosuchprogram", NULL) < 0);
+
+	cprintf("spawncheck done\n");
+}
+
+// Run a pipeline in the shell, and check that it cleans up its pipe.
+void
+pipecheck()
+{
+	FILE *f = fopen("pipescript", "w"); assert(f != NULL);
+	fprintf(f, "echo through a pipe | cat > pipeout\n");
+	fclose(f);
+	waitcheck(spawn("sh", "pipescript", NULL));
+
+	char buf[32];
+	int fd = open("pipeout", O_RDONLY); assert(fd > 0);
+	ssize_t act = read(fd, buf, sizeof(buf)); assert(act == 15);
+	assert(memcmp(buf, "through a pipe\n", 15) == 0);
+	close(fd);
+
+	// No pipe files left behind, as far as readdir() or open() can tell.
+	DIR *d = opendir("/"); assert(d != NULL);
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL)
+		assert(strncmp(de->d_name, ".pipe", 5) != 0);
+	closedir(d);
+
+	// remove() deletes plain files, and fails on missing ones.
+	assert(remove("pipeout") == 0);
+	assert(open("pipeout", O_RDONLY) < 0 && errno == ENOENT);
+	assert(remove("pipeout") < 0 && errno == ENOENT);
+	assert(remove("/") < 0);
+
+	cprintf("pipecheck passed\n");
+}
+
 pid_t forkwrite(const char *filename)
 {
 	pid_t pid = fork();
@@ -409,11 +498,39 @@ reconcilecheck()
 	waitcheckstatus(spawn("cat", "reconcilefileC", NULL), 1); // fails!
 	waitcheck(spawn("ls", "-l", NULL));
 
+	// Concurrent positioned writes to disjoint parts of one file merge.
+	static char rbuf[8192];
+	memset(rbuf, 'a', sizeof(rbuf));
+	int fd = open("reconcilefileR", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(fd > 0);
+	ssize_t act = write(fd, rbuf, sizeof(rbuf)); assert(act == sizeof(rbuf));
+	int ino = files->fd[fd].ino, rver = files->fi[ino].ver;
+	close(fd);
+	pid_t pid = fork();
+	if (pid == 0) {
+		fd = open("reconcilefileR", O_WRONLY); assert(fd > 0);
+		lseek(fd, 6000, SEEK_SET);
+		act = write(fd, "child", 5); assert(act == 5);
+		close(fd);
+		exit(0);
+	}
+	fd = open("reconcilefileR", O_RDWR); assert(fd > 0);
+	lseek(fd, 100, SEEK_SET);
+	act = write(fd, "parent", 6); assert(act == 6);
+	waitcheck(pid);
+	assert(files->fi[ino].ver == rver && !(files->fi[ino].mode & S_IFCONF));
+	lseek(fd, 0, SEEK_SET);
+	act = read(fd, rbuf, sizeof(rbuf)); assert(act == sizeof(rbuf));
+	assert(memcmp(rbuf + 100, "parent", 6) == 0);
+	assert(memcmp(rbuf + 6000, "child", 5) == 0);
+	assert(rbuf[99] == 'a' && rbuf[106] == 'a' && rbuf[6005] == 'a');
+	close(fd);
+
 	cprintf("reconcilecheck: basic file reconciliation successful\n");
 
 	// Reconcile append-only console output
 	printf("reconcilecheck: running echo\n");
-	pid_t pid = spawn("echo", "called", "by", "reconcilecheck", NULL);
+	pid = spawn("echo", "called", "by", "reconcilecheck", NULL);
 	printf("reconcilecheck: echo running\n");
 	waitcheck(pid);
 	printf("reconcilecheck: echo finished\n");
@@ -422,6 +539,248 @@ reconcilecheck()
 	cprintf("reconcilecheck done\n");
 }
 
+// We don't have PFF_NONDET, so WNOHANG never finds a child done
+// (whether it's done yet depends on timing), until we wait for it.
+void
+nohangcheck()
+{
+	int status;
+	assert(waitpid(-1, &status, WNOHANG) < 0 && errno == ECHILD);
+	pid_t pid = forkwrite("nohangfile");
+	assert(waitpid(pid, &status, WNOHANG) == 0);
+	assert(waitpid(-1, &status, WNOHANG) == 0);
+	waitcheck(pid);
+	assert(waitpid(pid, &status, WNOHANG) < 0 && errno == ECHILD);
+	waitcheck(spawn("cat", "nohangfile", NULL));
+
+	cprintf("nohangcheck done\n");
+}
+
+// Check files spanning several 4MB inode areas, and their reconciliation.
+void
+bigfilecheck()
+{
+	static char buf[4096], buf2[4096];
+	int i;
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7;
+
+	// Write a block straddling the end of the file's first 4MB.
+	int fd = open("bigfile", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(fd > 0);
+	int ino = files->fd[fd].ino;
+	off_t rc = lseek(fd, FILE_SLOTSIZE - 2048, SEEK_SET);
+	assert(rc == FILE_SLOTSIZE - 2048);
+	ssize_t act = write(fd, buf, 4096); assert(act == 4096);
+	assert(files->fi[ino].size == FILE_SLOTSIZE + 2048);
+	int s = fileino_slot(files, ino, FILE_SLOTSIZE);
+	assert(s != 0 && files->fi[s].extof == ino);
+	assert(memcmp(FILEDATA(s), buf + 2048, 2048) == 0);
+
+	// Read it back across the boundary, and the hole before it.
+	rc = lseek(fd, FILE_SLOTSIZE - 2048, SEEK_SET);
+	act = read(fd, buf2, 4096); assert(act == 4096);
+	assert(memcmp(buf, buf2, 4096) == 0);
+	rc = lseek(fd, 4096, SEEK_SET);
+	act = read(fd, buf2, 4096); assert(act == 4096);
+	for (i = 0; i < 4096; i++)
+		assert(buf2[i] == 0);
+	close(fd);
+
+	// A child grows the file into a third area; reconcile brings it back.
+	pid_t pid = fork();
+	if (pid == 0) {
+		fd = open("bigfile", O_WRONLY); assert(fd > 0);
+		rc = lseek(fd, 2 * FILE_SLOTSIZE + 100, SEEK_SET);
+		act = write(fd, buf, 4096); assert(act == 4096);
+		close(fd);
+		exit(0);
+	}
+	waitcheck(pid);
+	assert(files->fi[ino].size == 2 * FILE_SLOTSIZE + 100 + 4096);
+	fd = open("bigfile", O_RDONLY); assert(fd > 0);
+	rc = lseek(fd, 2 * FILE_SLOTSIZE + 100, SEEK_SET);
+	act = read(fd, buf2, 4096); assert(act == 4096);
+	assert(memcmp(buf, buf2, 4096) == 0);
+	rc = lseek(fd, FILE_SLOTSIZE - 2048, SEEK_SET);
+	act = read(fd, buf2, 4096); assert(act == 4096);
+	assert(memcmp(buf, buf2, 4096) == 0);
+	close(fd);
+
+	// Truncating gives the borrowed areas back.
+	rc = truncate("bigfile", 0); assert(rc == 0);
+	assert(files->fi[ino].next == 0);
+	assert(fileino_isfree(files, s));
+
+	cprintf("bigfilecheck passed\n");
+}
+
+// Check memory-mapped access to files.
+void
+mmapcheck()
+{
+	int fd = open("mmapfile", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(fd > 0);
+	int ino = files->fd[fd].ino;
+	ssize_t act = write(fd, "hello, mmap", 11); assert(act == 11);
+
+	// Read-only mappings point straight at the file's data.
+	char *p = mmap(NULL, 11, PROT_READ, MAP_SHARED, fd, 0);
+	assert(p == FILEDATA(ino));
+	assert(munmap(p, 11) == 0);
+	assert(mmap(NULL, 11, PROT_READ, MAP_SHARED, fd, 100) == MAP_FAILED);
+
+	// Private writable mappings are copies, zero-filled past the end.
+	p = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	assert(p != MAP_FAILED && p != FILEDATA(ino));
+	assert(memcmp(p, "hello, mmap", 11) == 0 && p[11] == 0 && p[8191] == 0);
+	p[0] = 'j';
+	assert(*(char*)FILEDATA(ino) == 'h');
+	assert(munmap(p, 8192) == 0);
+
+	// Shared writable mappings grow the file, and reconcile on munmap,
+	// which counts the whole mapping as rewritten.
+	p = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(p == FILEDATA(ino) && files->fi[ino].size == 8192);
+	p[0] = 'j';
+	pid_t pid = fork();
+	if (pid == 0) {
+		strcpy(p + 5000, "child");
+		munmap(p, 8192);
+		exit(0);
+	}
+	waitcheck(pid);
+	assert(munmap(p, 8192) == 0);
+	char buf[6];
+	lseek(fd, 5000, SEEK_SET);
+	act = read(fd, buf, 6); assert(act == 6);
+	assert(strcmp(buf, "child") == 0);
+	assert(*(char*)FILEDATA(ino) == 'j');
+	assert(!(files->fi[ino].mode & S_IFCONF));
+	close(fd);
+
+	cprintf("mmapcheck passed\n");
+}
+
+// Check copy-on-write copies between files.
+void
+sendfilecheck()
+{
+	static char buf[3*PAGESIZE];
+	int i;
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = 'a' + i % 26;
+	int f = open("sendfrom", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(f > 0);
+	ssize_t act = write(f, buf, sizeof(buf)); assert(act == sizeof(buf));
+	close(f);
+
+	// cp copies the whole thing, sharing pages with the original.
+	waitcheck(spawn("cp", "sendfrom", "sendto", NULL));
+	f = open("sendto", O_RDONLY); assert(f > 0);
+	int ino = files->fd[f].ino;
+	assert(files->fi[ino].size == sizeof(buf));
+	assert(memcmp(FILEDATA(ino), buf, sizeof(buf)) == 0);
+	close(f);
+
+	// Appending at another page offset copies by hand, from a given offset.
+	f = open("sendfrom", O_RDONLY); assert(f > 0);
+	int t = open("sendto", O_WRONLY | O_APPEND); assert(t > 0);
+	off_t ofs = 100;
+	act = sendfile(t, f, &ofs, 2*PAGESIZE); assert(act == 2*PAGESIZE);
+	assert(ofs == 100 + 2*PAGESIZE && files->fd[f].ofs == 0);
+	assert(files->fi[ino].size == sizeof(buf) + 2*PAGESIZE);
+	assert(memcmp(FILEDATA(ino) + sizeof(buf), buf + 100, 2*PAGESIZE) == 0);
+
+	// Appending to the console works too, and stops at end of file.
+	int cons = files->fi[FILEINO_CONSOUT].size;
+	ofs = sizeof(buf) - 10;
+	act = sendfile(STDOUT_FILENO, f, &ofs, 100); assert(act == 10);
+	assert(files->fi[FILEINO_CONSOUT].size == cons + 10);
+	close(t);
+	close(f);
+
+	cprintf("\nsendfilecheck passed\n");
+}
+
+// Find counter 'name' in the "diskstat" file's contents 'buf'.
+static int
+diskstatval(const char *buf, const char *name)
+{
+	int len = strlen(name);
+	const char *p;
+	for (p = buf; *p; p++)
+		if ((p == buf || p[-1] == ' ' || p[-1] == '\n') &&
+				strncmp(p, name, len) == 0 && p[len] == ' ') {
+			int v = 0;
+			for (p += len + 1; *p >= '0' && *p <= '9'; p++)
+				v = v * 10 + *p - '0';
+			return v;
+		}
+	panic("diskstat: no %s", name);
+}
+
+// Fsync until the kernel has started writing file 'fd' to disk:
+// it brings rver and rlen up to date once the file's pages are on their way.
+static void
+disksync(int fd)
+{
+	fileinode *fi = &files->fi[files->fd[fd].ino];
+	while (fi->ver != fi->rver || fi->size != fi->rlen)
+		fsync(fd);
+}
+
+// Check that files get written back to disk, when there is one:
+// writing a file anew overwrites the pages an earlier flush wrote,
+// which only starts once that flush's metadata is on disk.
+void
+diskcheck()
+{
+	static char buf[4*PAGESIZE], statbuf[512];
+	int fd = open("diskstat", O_RDONLY); assert(fd > 0);
+	ssize_t act = read(fd, statbuf, sizeof(statbuf) - 1); assert(act >= 0);
+	statbuf[act] = 0;
+	close(fd);
+	if (act == 0 || diskstatval(statbuf, "writable") == 0) {
+		cprintf("diskcheck: no writable disk; skipped\n");
+		return;
+	}
+
+	int i;
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = 'A' + i % 23;
+	int f = open("diskfile", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(f > 0);
+	int ino = files->fd[f].ino;
+	act = write(f, buf, 3*PAGESIZE); assert(act == 3*PAGESIZE);
+	disksync(f);
+	act = write(f, buf + 3*PAGESIZE, PAGESIZE); assert(act == PAGESIZE);
+	disksync(f);
+
+	// Rewrite it, with the kernel refreshing diskstat as we go.
+	fd = open("diskstat", O_WRONLY | O_TRUNC); assert(fd > 0);
+	close(fd);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = 'a' + i % 19;
+	assert(ftruncate(f, 0) == 0);
+	act = write(f, buf, 2*PAGESIZE); assert(act == 2*PAGESIZE);
+	disksync(f);
+	assert(files->fi[ino].size == 2*PAGESIZE);
+	assert(memcmp(FILEDATA(ino), buf, 2*PAGESIZE) == 0);
+	close(f);
+
+	fd = open("diskstat", O_RDONLY); assert(fd > 0);
+	act = read(fd, statbuf, sizeof(statbuf) - 1); assert(act > 0);
+	statbuf[act] = 0;
+	close(fd);
+	assert(diskstatval(statbuf, "errors") == 0);
+	assert(diskstatval(statbuf, "metawrites") >= 2);
+	assert(diskstatval(statbuf, "writepages") >= 4);
+
+	assert(remove("diskfile") == 0);
+	cprintf("diskcheck passed\n");
+}
+
 int
 main()
 {
@@ -436,8 +795,15 @@ main()
 	consincheck();
 
 	execcheck();
+	spawncheck();
+	pipecheck();
 
 	reconcilecheck();
+	nohangcheck();
+	bigfilecheck();
+	mmapcheck();
+	sendfilecheck();
+	diskcheck();
 
 	cprintf("testfs: all tests completed; starting shell...\n");
 	execl("sh", "sh", NULL);
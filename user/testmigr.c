@@ -9,6 +9,9 @@
  */
 
 #include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/unistd.h>
+#include <inc/assert.h>
 #include <inc/syscall.h>
 
 void migrate(int node, int time)
@@ -18,6 +21,71 @@ void migrate(int node, int time)
 	cprintf("testmigr (%d): now on node %d.\n", time, node);
 }
 
+#define GANGWORDS	8192		// Eight pages every gang member reads
+#define GANGMAX		8
+
+int gangdata[GANGWORDS];
+
+// Fork n children that all migrate to node 2 at once and come back.
+// They should travel in shared migration requests, and pull the pages
+// they all inherited only once between them ("follow" in netstat).
+void gang(int n)
+{
+	pid_t pid[GANGMAX];
+	int i;
+	for (i = 0; i < GANGWORDS; i++)
+		gangdata[i] = i;
+	for (i = 0; i < n; i++) {
+		pid[i] = fork();
+		if (pid[i] == 0) {
+			sys_get(0, (2 << 8) | 0, NULL, NULL, NULL, 0);
+			int sum = 0, j;
+			for (j = 0; j < GANGWORDS; j++)
+				sum += gangdata[j];
+			exit(sum == GANGWORDS * (GANGWORDS-1) / 2 ? 0 : 1);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		int status;
+		assert(waitpid(pid[i], &status, 0) == pid[i]);
+		assert(WEXITSTATUS(status) == 0);
+	}
+	cprintf("testmigr: gang of %d migrated and returned\n", n);
+}
+
+// Write a few words of pages we brought from home on node 2,
+// and check the writes came back home with us:
+// they travel as deltas ("diff" in netstat) instead of whole pages.
+void diffs(void)
+{
+	int i;
+	for (i = 0; i < GANGWORDS; i++)
+		gangdata[i] = i;
+	sys_get(0, (2 << 8) | 0, NULL, NULL, NULL, 0);
+	for (i = 0; i < GANGWORDS; i += 1024)
+		gangdata[i + 3] = -i;
+	sys_get(0, (1 << 8) | 0, NULL, NULL, NULL, 0);
+	for (i = 0; i < GANGWORDS; i++)
+		assert(gangdata[i] == (i % 1024 == 3 ? -(i - 3) : i));
+	cprintf("testmigr: writes made away came home\n");
+}
+
+// Migrate to node 2 naming gangdata with SYS_PREFETCH,
+// so that it's pushed there ahead of us instead of pulled.
+void prefetch(void)
+{
+	int i, sum = 0;
+	for (i = 0; i < GANGWORDS; i++)
+		gangdata[i] = i;
+	sys_get(SYS_PREFETCH, (2 << 8) | 0, NULL, gangdata, NULL,
+		sizeof(gangdata));
+	for (i = 0; i < GANGWORDS; i++)
+		sum += gangdata[i];
+	assert(sum == GANGWORDS * (GANGWORDS-1) / 2);
+	sys_get(0, (1 << 8) | 0, NULL, NULL, NULL, 0);
+	cprintf("testmigr: prefetched data arrived intact\n");
+}
+
 int
 main()
 {
@@ -26,6 +94,11 @@ main()
 	migrate(2, 1);
 	migrate(1, 2);
 	migrate(2, 2);
+	migrate(1, 3);
+
+	gang(GANGMAX);
+	diffs();
+	prefetch();
 
 	printf("testmigr done\n");
 	return 0;
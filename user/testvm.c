@@ -9,11 +9,13 @@
 
 #include <inc/stdio.h>
 #include <inc/string.h>
+#include <inc/stdlib.h>
 #include <inc/assert.h>
 #include <inc/syscall.h>
 #include <inc/x86.h>
 #include <inc/mmu.h>
 #include <inc/vm.h>
+#include <inc/parallel.h>
 
 
 #define STACKSIZE	PAGESIZE
@@ -327,10 +329,23 @@ memopcheck(void)
 	sys_get(SYS_PERM|SYS_READ, 0, NULL, NULL, dva2+ofs, PAGESIZE);
 	assert(*(volatile int*)(dva2+ofs) == 0xdeadbeef);	// survived?
 
+	// Test the same two copies as a single batch
+	sys_get(SYS_ZERO, 0, NULL, NULL, dva2, PTSIZE);
+	sysop ops[2] = {
+		{ SYS_PUT | SYS_COPY, 0, NULL, sva, dva, PTSIZE },
+		{ SYS_GET | SYS_COPY | SYS_PERM | SYS_READ, 0, NULL,
+			dva, dva2, PTSIZE },
+	};
+	sys_batch(ops, 2);
+	assert(memcmp(sva, dva2, etext - start) == 0);
+	assert(*(volatile int*)(dva2+ofs) == 0xdeadbeef);
+	writefaulttest(dva2);
+
 	cprintf("testvm: memopcheck passed\n");
 }
 
 int x, y;
+uint8_t snapbuf[4][PAGESIZE];	// Pages a re-snapshotted child writes
 
 int randints[256] = {	// some random ints
 	 20,726,926,682,210,585,829,491,612,744,753,405,346,189,669,416,
@@ -474,6 +489,26 @@ mergecheck()
 	join(SYS_MERGE, 1, T_SYSCALL);
 	assert(y == 0xdeadbeef); assert(x == 0xabadcafe);
 
+	// Snapshot the same child again and again as it keeps running:
+	// each merge must bring back just what it wrote since the last one.
+	x = 0;
+	if (!fork(SYS_START | SYS_SNAP, 0)) {
+		while (1) {
+			snapbuf[x][x] = x + 1;
+			x++;
+			sys_ret();
+		}
+	}
+	int i, j;
+	for (i = 1; i <= 4; i++) {
+		join(SYS_MERGE, 0, T_SYSCALL);
+		assert(x == i);
+		for (j = 0; j < 4; j++)
+			assert(snapbuf[j][j] == (j < i ? j + 1 : 0));
+		if (i < 4)
+			sys_put(SYS_SNAP | SYS_START, 0, NULL, NULL, NULL, 0);
+	}
+
 	// Parallel quicksort with recursive processes!
 	// (though probably not very efficient on arrays this small)
 	pqsort(&randints[0], &randints[256-1]);
@@ -488,6 +523,245 @@ mergecheck()
 	cprintf("testvm: mergecheck passed\n");
 }
 
+// Page-aligned so clonecheck() can copy it alone out of its children.
+int ckptval[PAGESIZE/sizeof(int)] gcc_aligned(PAGESIZE);
+
+// Check that SYS_CLONE checkpoints and restores a whole stopped subtree.
+void
+clonecheck()
+{
+	// Child 0 leaves a stopped grandchild behind before it stops.
+	ckptval[0] = 0;
+	if (!fork(SYS_START, 0)) {
+		ckptval[0] = 1;
+		if (!fork(SYS_START, 0)) {
+			ckptval[0] = 2;
+			gentrap(T_SYSCALL);
+		}
+		join(0, 0, T_SYSCALL);
+		gentrap(T_SYSCALL);
+
+		// Resumed, maybe as a clone: the grandchild must be there too.
+		sys_get(SYS_COPY, 0, NULL, ckptval, ckptval, PAGESIZE);
+		ckptval[0] += 100;
+		gentrap(T_SYSCALL);
+	}
+	join(0, 0, T_SYSCALL);
+
+	// Checkpoint child 0 into slot 1, restore it twice from there,
+	// and run the two restored copies and the original to completion.
+	sys_put(SYS_CLONE, SYS_CLONESRC(0) | 1, NULL, NULL, NULL, 0);
+	static const uint8_t runs[3] = { 2, 3, 0 };
+	int i;
+	for (i = 0; i < 3; i++) {
+		uint8_t cn = runs[i];
+		if (cn != 0)
+			sys_put(SYS_CLONE, SYS_CLONESRC(1) | cn, NULL,
+				NULL, NULL, 0);
+		sys_put(SYS_START, cn, NULL, NULL, NULL, 0);
+		join(0, cn, T_SYSCALL);
+		sys_get(SYS_COPY, cn, NULL, ckptval, ckptval, PAGESIZE);
+		assert(ckptval[0] == 102);
+		ckptval[0] = 0;
+	}
+
+	// Clearing the checkpoint leaves a fresh child with no memory.
+	sys_put(SYS_CLONE, SYS_CLONESRC(1) | 1, NULL, NULL, NULL, 0);
+	ckptval[0] = 5;
+	sys_get(SYS_COPY, 1, NULL, ckptval, ckptval, PAGESIZE);
+	assert(ckptval[0] == 0);
+
+	cprintf("testvm: clonecheck passed\n");
+}
+
+// Check that SYS_PMC gets and clears a child's performance counts.
+void
+pmccheck()
+{
+	// A child's performance counts start at zero with SYS_PMC,
+	// and cover at least its loop if the CPU can count at all.
+	if (!fork(SYS_PMC | SYS_START, 0)) {
+		volatile int i;
+		for (i = 0; i < 100000; i++)
+			;
+		gentrap(T_SYSCALL);
+	}
+	join(0, 0, T_SYSCALL);
+
+	// A get with SYS_PMC alone fills in only the counts.
+	struct procstate ps;
+	memset(&ps, 0, sizeof(ps));
+	ps.tf.eip = 0x1234;
+	sys_get(SYS_PMC, 0, &ps, NULL, NULL, 0);
+	assert(ps.tf.eip == 0x1234);
+	uint64_t instrs = ps.pmc.count[PMC_INSTRS];
+	assert(instrs == 0 || instrs >= 100000);
+	if (instrs == 0)
+		cprintf("testvm: no performance counters on this CPU\n");
+
+	// They survive a register put, and a put with SYS_PMC clears them.
+	sys_get(SYS_REGS, 0, &ps, NULL, NULL, 0);
+	sys_put(SYS_REGS, 0, &ps, NULL, NULL, 0);
+	sys_get(SYS_PMC, 0, &ps, NULL, NULL, 0);
+	assert(ps.pmc.count[PMC_INSTRS] == instrs);
+	sys_put(SYS_PMC, 0, NULL, NULL, NULL, 0);
+	sys_get(SYS_PMC, 0, &ps, NULL, NULL, 0);
+	int i;
+	for (i = 0; i < PMC_N; i++)
+		assert(ps.pmc.count[i] == 0);
+
+	cprintf("testvm: pmccheck passed\n");
+}
+
+int pr[8][8];		// Result matrix for parallelcheck()
+int bbuf[2][4];		// Double buffer for the barrier check
+int ptree[32];		// Per-worker results for the parallel_tree check
+char *pblk[4][2];	// Blocks each task malloc()s for parallelcheck()
+
+static void ptreeset(int w, void *arg)
+{
+	ptree[w] = w * w + (int)arg;
+}
+
+// Allocate and fill a small and a big block, alongside other tasks.
+static void pmalloc(void *arg)
+{
+	int t = (int)arg;
+	char *tmp = malloc(100);
+	pblk[t][0] = malloc(1000 + t);
+	pblk[t][1] = malloc(3 * PAGESIZE + t);
+	free(tmp);
+	memset(pblk[t][0], 'a' + t, 1000 + t);
+	memset(pblk[t][1], 'A' + t, 3 * PAGESIZE + t);
+}
+
+// One element's share of four lockstep steps, in a task.
+static void pbstep(void *arg)
+{
+	int i = (int)arg, s;
+	for (s = 0; s < 4; s++) {
+		bbuf[(s+1)%2][i] = bbuf[s%2][(i+1)%4] * 2;
+		task_barrier();
+	}
+}
+
+static void
+pmatcell(int c, void *arg)
+{
+	int k, sum = 0;
+	for (k = 0; k < 8; k++)
+		sum += ma[c/8][k] * mb[k][c%8];
+	pr[c/8][c%8] = sum;
+}
+
+static long
+pmatget(int c, void *arg)
+{
+	return pr[c/8][c%8];
+}
+
+static long
+plongadd(long a, long b)
+{
+	return a + b;
+}
+
+struct qrange { int *lo, *hi; };
+
+static void
+ptqsort(void *arg)
+{
+	struct qrange *r = arg;
+	int *lo = r->lo, *hi = r->hi;
+	if (lo >= hi)
+		return;
+
+	int pivot = *lo;
+	int *l = lo+1, *h = hi;
+	while (l <= h) {
+		if (*l < pivot)
+			l++;
+		else if (*h > pivot)
+			h--;
+		else
+			swapints(*h, *l), l++, h--;
+	}
+	swapints(*lo, l[-1]);
+
+	struct qrange r1 = { lo, l-2 }, r2 = { h+1, hi };
+	int t1 = task_fork(ptqsort, &r1);
+	int t2 = task_fork(ptqsort, &r2);
+	task_join(t1);
+	task_join(t2);
+}
+
+void
+parallelcheck()
+{
+	// Matrix multiply with parallel_for instead of a child per cell,
+	// then add up the result with parallel_reduce.
+	parallel_for(0, 64, 4, pmatcell, NULL);
+	assert(memcmp(pr, mc, sizeof(pr)) == 0);
+	long sum = 0;
+	int i;
+	for (i = 0; i < 64; i++)
+		sum += mc[i/8][i%8];
+	assert(parallel_reduce(0, 64, 1, pmatget, plongadd, 0, NULL) == sum);
+
+	// Quicksort with recursive tasks, on a fresh copy of the input
+	// scrambled back out of order.
+	for (i = 0; i < 256; i++)
+		randints[i] = sortints[(i * 97) % 256];
+	struct qrange r = { &randints[0], &randints[256-1] };
+	task_join(task_fork(ptqsort, &r));
+	assert(memcmp(randints, sortints, 256*sizeof(int)) == 0);
+
+	// Fan out to more workers than parallel_for would use,
+	// joined by merging up a tree.
+	parallel_tree(32, ptreeset, (void*)7);
+	for (i = 0; i < 32; i++)
+		assert(ptree[i] == i * i + 7);
+
+	// Tasks malloc() at once from their own arenas, merging cleanly.
+	char *p = malloc(24);
+	free(p);
+	assert(malloc(24) == p);
+	int mt[4];
+	for (i = 0; i < 4; i++)
+		mt[i] = task_fork(pmalloc, (void*)i);
+	for (i = 0; i < 4; i++)
+		task_join(mt[i]);
+	for (i = 0; i < 4; i++) {
+		int j;
+		for (j = 0; j < 4; j++)
+			if (j != i)
+				assert(pblk[i][0] != pblk[j][0]);
+		assert(pblk[i][0][999 + i] == 'a' + i);
+		assert(pblk[i][1][3 * PAGESIZE + i - 1] == 'A' + i);
+		free(pblk[i][0]);
+		free(pblk[i][1]);
+	}
+	free(p);
+
+	// Iterate in lockstep with barriers, with the same four children
+	// throughout: each step, each child computes its element from a
+	// neighbor's as of the last step, double-buffered.
+	int bt[4], steps = 0;
+	for (i = 0; i < 4; i++)
+		bbuf[0][i] = i + 1;
+	for (i = 0; i < 4; i++)
+		bt[i] = task_fork(pbstep, (void*)i);
+	while (task_sync(bt, 4) > 0)
+		steps++;
+	assert(steps == 4);
+	for (i = 0; i < 4; i++)
+		assert(bt[i] == -1);
+	for (i = 0; i < 4; i++)
+		assert(bbuf[0][i] == 16 * (i + 1));	// back around to i
+
+	cprintf("testvm: parallelcheck passed\n");
+}
+
 int
 main()
 {
@@ -498,6 +772,9 @@ main()
 	protcheck();
 	memopcheck();
 	mergecheck();
+	clonecheck();
+	pmccheck();
+	parallelcheck();
 
 	cprintf("testvm: all tests completed successfully!\n");
 	return 0;